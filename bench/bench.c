@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// veil-bench runs each benchmark on fresh VMs a number of times, after one
+// warm up run, and prints the median, minimum and maximum of every metric as
+// JSON. Every metric is a time, so lower is better. With --compare, medians
+// are checked against an earlier run's output: one more than --threshold
+// percent slower than its baseline is a regression, and the exit code is 1.
+//
+//   veil-bench [--repeat=N] [--threshold=PERCENT] [--filter=NAME]
+//              [--compare=BASELINE.json] [--output=FILE]
+
+#define BENCH_DEFAULT_REPEAT 5
+#define BENCH_MAX_REPEAT 1000
+#define BENCH_DEFAULT_THRESHOLD 10.0
+#define BENCH_MAX_METRICS 2
+
+#define MICROTASK_CHAIN_LENGTH 200000
+#define LOOP_TURNS 100000
+#define GC_OBJECTS 200000
+#define GC_PAUSES 11
+// a binary tree of modules, each importing its two children
+#define MODULE_GRAPH_SIZE 511
+
+typedef struct bench_s bench_t;
+
+typedef struct bench_def_s {
+  const char* name;
+  const char* metrics[BENCH_MAX_METRICS];
+  void (*run)(bench_t* bench, double* values);
+} bench_def_t;
+
+typedef struct bench_stats_s {
+  double median;
+  double min;
+  double max;
+  bool has_baseline;
+  double baseline;
+  bool regressed;
+} bench_stats_t;
+
+struct bench_s {
+  veil_t* veil;
+  veil_vm_t vm;
+  veil_uv_t uv;
+  cstr dir;
+};
+
+static void bench_startup(bench_t* bench, double* values);
+static void bench_microtasks(bench_t* bench, double* values);
+static void bench_loop_turn(bench_t* bench, double* values);
+static void bench_gc(bench_t* bench, double* values);
+static void bench_module_graph(bench_t* bench, double* values);
+static void vm_open(bench_t* bench);
+static void vm_close(bench_t* bench);
+static void vm_eval(bench_t* bench, const char* source);
+static cstr fixture_path(bench_t* bench, const char* name);
+static bool fixtures_create(bench_t* bench);
+static void fixtures_remove(bench_t* bench);
+static bool load_baseline(const char* filename, bench_stats_t (*stats)[BENCH_MAX_METRICS], const bool* selected);
+static void write_report(FILE* out, uint32_t repeat, double threshold, bench_stats_t (*stats)[BENCH_MAX_METRICS], const bool* selected);
+static int compare_double(const void* a, const void* b);
+static const char* option_value(const char* arg, const char* name);
+
+static const bench_def_t BENCHMARKS[] = {
+  { "startup", { "first_statement_ns" }, bench_startup },
+  { "microtasks", { "ns_per_job" }, bench_microtasks },
+  { "loop_turn", { "ns_per_turn" }, bench_loop_turn },
+  { "gc", { "pause_median_ns", "pause_max_ns" }, bench_gc },
+  { "module_graph", { "load_ns" }, bench_module_graph },
+};
+
+int main(int argc, char** argv) {
+  bench_stats_t stats[countof(BENCHMARKS)][BENCH_MAX_METRICS];
+  bool selected[countof(BENCHMARKS)];
+  double samples[BENCH_MAX_METRICS][BENCH_MAX_REPEAT];
+  double values[BENCH_MAX_METRICS];
+  uint32_t repeat = BENCH_DEFAULT_REPEAT;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  const char* filter = NULL;
+  const char* compare = NULL;
+  const char* output = NULL;
+  const char* value;
+  uint32_t regressions = 0;
+  bench_t bench;
+  FILE* out;
+
+  for (int n = 1; n < argc; n++) {
+    if ((value = option_value(argv[n], "--repeat"))) {
+      repeat = (uint32_t) strtoul(value, NULL, 10);
+    } else if ((value = option_value(argv[n], "--threshold"))) {
+      threshold = strtod(value, NULL);
+    } else if ((value = option_value(argv[n], "--filter"))) {
+      filter = value;
+    } else if ((value = option_value(argv[n], "--compare"))) {
+      compare = value;
+    } else if ((value = option_value(argv[n], "--output"))) {
+      output = value;
+    } else {
+      fprintf(stderr, "usage: veil-bench [--repeat=N] [--threshold=PERCENT] [--filter=NAME] "
+                      "[--compare=BASELINE.json] [--output=FILE]\n");
+      return 2;
+    }
+  }
+
+  if (repeat == 0 || repeat > BENCH_MAX_REPEAT || threshold < 0) {
+    fprintf(stderr, "veil-bench: --repeat must be 1 to %u and --threshold at least 0\n", BENCH_MAX_REPEAT);
+    return 2;
+  }
+
+  memset(stats, 0, sizeof(stats));
+  for (size_t b = 0; b < countof(BENCHMARKS); b++) {
+    selected[b] = !filter || strcmp(filter, BENCHMARKS[b].name) == 0;
+  }
+
+  if (compare && !load_baseline(compare, stats, selected)) {
+    fprintf(stderr, "veil-bench: could not read baseline '%s'\n", compare);
+    return 2;
+  }
+
+  memset(&bench, 0, sizeof(bench));
+  bench.veil = veil_init();
+  bench.veil->cfg.writable = false;
+
+  if (!fixtures_create(&bench)) {
+    fprintf(stderr, "veil-bench: could not write fixtures to a temporary directory\n");
+    veil_drop(bench.veil);
+    return 2;
+  }
+
+  for (size_t b = 0; b < countof(BENCHMARKS); b++) {
+    const bench_def_t* def = &BENCHMARKS[b];
+
+    if (!selected[b]) {
+      continue;
+    }
+
+    fprintf(stderr, "%s ", def->name);
+    def->run(&bench, values);
+    for (uint32_t r = 0; r < repeat; r++) {
+      def->run(&bench, values);
+      for (int m = 0; m < BENCH_MAX_METRICS && def->metrics[m]; m++) {
+        samples[m][r] = values[m];
+      }
+      fputc('.', stderr);
+    }
+    fputc('\n', stderr);
+
+    for (int m = 0; m < BENCH_MAX_METRICS && def->metrics[m]; m++) {
+      bench_stats_t* s = &stats[b][m];
+
+      qsort(samples[m], repeat, sizeof(double), compare_double);
+      s->min = samples[m][0];
+      s->max = samples[m][repeat - 1];
+      s->median = repeat % 2 ? samples[m][repeat / 2] : (samples[m][repeat / 2 - 1] + samples[m][repeat / 2]) / 2;
+      s->regressed = s->has_baseline && s->baseline > 0 && s->median > s->baseline * (1 + threshold / 100);
+      regressions += s->regressed;
+
+      fprintf(stderr, "  %-20s %14.1f", def->metrics[m], s->median);
+      if (s->has_baseline && s->baseline > 0) {
+        fprintf(stderr, "  baseline %14.1f  %+7.1f%%%s", s->baseline,
+                (s->median - s->baseline) / s->baseline * 100, s->regressed ? "  REGRESSION" : "");
+      }
+      fputc('\n', stderr);
+    }
+  }
+
+  fixtures_remove(&bench);
+  veil_drop(bench.veil);
+
+  out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "veil-bench: could not write '%s'\n", output);
+    return 2;
+  }
+  write_report(out, repeat, threshold, stats, selected);
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  return regressions ? 1 : 0;
+}
+
+// a fresh runtime, context and loop, up to the end of a script's first
+// statement
+static void bench_startup(bench_t* bench, double* values) {
+  cstr filename = fixture_path(bench, "startup.js");
+  uint64_t start = uv_hrtime();
+
+  vm_open(bench);
+  CHECK_TRUE(veil_vm_run_file(&bench->vm, cstr_str(&filename), false));
+  values[0] = (double) (uv_hrtime() - start);
+
+  vm_close(bench);
+  cstr_drop(&filename);
+}
+
+// one long promise chain through veil_vm_drain_microtasks()
+static void bench_microtasks(bench_t* bench, double* values) {
+  cstr source = cstr_from_fmt(
+      "let p = Promise.resolve(0);\n"
+      "for (let i = 0; i < %d; i++) p = p.then((v) => v + 1);\n",
+      MICROTASK_CHAIN_LENGTH);
+  uint64_t jobs;
+  uint64_t start;
+
+  vm_open(bench);
+  vm_eval(bench, cstr_str(&source));
+
+  jobs = bench->vm.microtasks.stats.jobs;
+  start = uv_hrtime();
+  while (!veil_vm_drain_microtasks(&bench->vm)) {
+  }
+  values[0] = (double) (uv_hrtime() - start) / (double) (bench->vm.microtasks.stats.jobs - jobs);
+
+  vm_close(bench);
+  cstr_drop(&source);
+}
+
+// an immediate that schedules the next keeps each turn of veil_uv_run()
+// down to the loop's own work
+static void bench_loop_turn(bench_t* bench, double* values) {
+  cstr source = cstr_from_fmt(
+      "let n = 0;\n"
+      "const turn = () => { if (++n < %d) setImmediate(turn); };\n"
+      "setImmediate(turn);\n",
+      LOOP_TURNS);
+  uint64_t start;
+
+  vm_open(bench);
+  vm_eval(bench, cstr_str(&source));
+
+  start = uv_hrtime();
+  veil_uv_run(&bench->uv);
+  values[0] = (double) (uv_hrtime() - start) / (double) (bench->uv.metrics.iterations ? bench->uv.metrics.iterations : 1);
+
+  vm_close(bench);
+  cstr_drop(&source);
+}
+
+// full collections over a heap of small linked objects
+static void bench_gc(bench_t* bench, double* values) {
+  cstr source = cstr_from_fmt(
+      "globalThis.graph = [];\n"
+      "for (let i = 0; i < %d; i++) graph.push({ i, prev: graph[i - 1], tag: 'n' + i });\n",
+      GC_OBJECTS);
+  double pauses[GC_PAUSES];
+
+  vm_open(bench);
+  vm_eval(bench, cstr_str(&source));
+
+  for (int n = 0; n < GC_PAUSES; n++) {
+    uint64_t start = uv_hrtime();
+
+    JS_RunGC(bench->vm.runtime);
+    pauses[n] = (double) (uv_hrtime() - start);
+  }
+
+  qsort(pauses, GC_PAUSES, sizeof(double), compare_double);
+  values[0] = pauses[GC_PAUSES / 2];
+  values[1] = pauses[GC_PAUSES - 1];
+
+  vm_close(bench);
+  cstr_drop(&source);
+}
+
+// resolve, read, compile and link a graph of modules from disk
+static void bench_module_graph(bench_t* bench, double* values) {
+  cstr filename = fixture_path(bench, "m0.js");
+  uint64_t start;
+
+  vm_open(bench);
+
+  start = uv_hrtime();
+  CHECK_TRUE(veil_vm_run_file(&bench->vm, cstr_str(&filename), true));
+  values[0] = (double) (uv_hrtime() - start);
+
+  vm_close(bench);
+  cstr_drop(&filename);
+}
+
+static void vm_open(bench_t* bench) {
+  veil_vm_init(&bench->vm, &bench->veil->cfg);
+  veil_uv_init(&bench->uv);
+  veil_vm_attach(&bench->vm, &bench->uv);
+}
+
+static void vm_close(bench_t* bench) {
+  veil_worker_drop_all(&bench->vm);
+  veil_vm_run_cleanups(&bench->vm);
+  veil_uv_drop(&bench->uv);
+  veil_vm_drop(&bench->vm);
+  memset(&bench->vm, 0, sizeof(veil_vm_t));
+  memset(&bench->uv, 0, sizeof(veil_uv_t));
+}
+
+static void vm_eval(bench_t* bench, const char* source) {
+  JSValue result = JS_Eval(bench->vm.context, source, strlen(source), "[bench]", JS_EVAL_TYPE_GLOBAL);
+
+  if (JS_IsException(result)) {
+    veil_vm_dump_exception(&bench->vm);
+  }
+  CHECK_TRUE(!JS_IsException(result));
+  JS_FreeValue(bench->vm.context, result);
+}
+
+static cstr fixture_path(bench_t* bench, const char* name) {
+  return cstr_from_fmt("%s/%s", cstr_str(&bench->dir), name);
+}
+
+static bool fixtures_create(bench_t* bench) {
+  static const char STARTUP[] = "globalThis.started = true;\n";
+  char tmpdir[4096];
+  size_t size = sizeof(tmpdir);
+  cstr pattern;
+  uv_fs_t req;
+  bool ok;
+
+  if (uv_os_tmpdir(tmpdir, &size) != 0) {
+    return false;
+  }
+
+  pattern = cstr_from_fmt("%s/veil-bench-XXXXXX", tmpdir);
+  ok = uv_fs_mkdtemp(NULL, &req, cstr_str(&pattern), NULL) == 0;
+  if (ok) {
+    bench->dir = cstr_from(req.path);
+  }
+  uv_fs_req_cleanup(&req);
+  cstr_drop(&pattern);
+
+  if (!ok) {
+    return false;
+  }
+
+  {
+    cstr filename = fixture_path(bench, "startup.js");
+
+    ok = veil_file_write(cstr_str(&filename), STARTUP, sizeof(STARTUP) - 1);
+    cstr_drop(&filename);
+  }
+
+  for (int n = 0; ok && n < MODULE_GRAPH_SIZE; n++) {
+    cstr name = cstr_from_fmt("m%d.js", n);
+    cstr filename = fixture_path(bench, cstr_str(&name));
+    cstr source;
+
+    if (2 * n + 2 < MODULE_GRAPH_SIZE) {
+      source = cstr_from_fmt(
+          "import { v as a } from './m%d.js';\n"
+          "import { v as b } from './m%d.js';\n"
+          "export const v = 1 + a + b;\n",
+          2 * n + 1, 2 * n + 2);
+    } else {
+      source = cstr_from("export const v = 1;\n");
+    }
+
+    ok = veil_file_write(cstr_str(&filename), cstr_str(&source), cstr_size(&source));
+
+    cstr_drop(&source);
+    cstr_drop(&filename);
+    cstr_drop(&name);
+  }
+
+  return ok;
+}
+
+static void fixtures_remove(bench_t* bench) {
+  uv_fs_t req;
+
+  if (cstr_is_empty(&bench->dir)) {
+    return;
+  }
+
+  for (int n = -1; n < MODULE_GRAPH_SIZE; n++) {
+    cstr name = n < 0 ? cstr_from("startup.js") : cstr_from_fmt("m%d.js", n);
+    cstr filename = fixture_path(bench, cstr_str(&name));
+
+    uv_fs_unlink(NULL, &req, cstr_str(&filename), NULL);
+    uv_fs_req_cleanup(&req);
+    cstr_drop(&filename);
+    cstr_drop(&name);
+  }
+
+  uv_fs_rmdir(NULL, &req, cstr_str(&bench->dir), NULL);
+  uv_fs_req_cleanup(&req);
+  cstr_drop(&bench->dir);
+}
+
+// the medians of a report written by an earlier run
+static bool load_baseline(const char* filename, bench_stats_t (*stats)[BENCH_MAX_METRICS], const bool* selected) {
+  JSRuntime* rt;
+  JSContext* ctx;
+  JSValue report;
+  JSValue benchmarks;
+  veil_file_t file;
+  bool ok;
+
+  if (!veil_file_read(&file, filename)) {
+    return false;
+  }
+
+  rt = JS_NewRuntime();
+  CHECK_NOT_NULL(rt);
+  ctx = JS_NewContext(rt);
+  CHECK_NOT_NULL(ctx);
+
+  report = JS_ParseJSON(ctx, file.data, file.size, filename);
+  benchmarks = JS_IsObject(report) ? JS_GetPropertyStr(ctx, report, "benchmarks") : JS_UNDEFINED;
+  ok = JS_IsObject(benchmarks);
+
+  for (size_t b = 0; ok && b < countof(BENCHMARKS); b++) {
+    JSValue benchmark;
+
+    if (!selected[b]) {
+      continue;
+    }
+
+    benchmark = JS_GetPropertyStr(ctx, benchmarks, BENCHMARKS[b].name);
+    for (int m = 0; m < BENCH_MAX_METRICS && BENCHMARKS[b].metrics[m] && JS_IsObject(benchmark); m++) {
+      JSValue metric = JS_GetPropertyStr(ctx, benchmark, BENCHMARKS[b].metrics[m]);
+      JSValue median = JS_GetPropertyStr(ctx, metric, "median");
+
+      if (JS_IsNumber(median)) {
+        stats[b][m].has_baseline = JS_ToFloat64(ctx, &stats[b][m].baseline, median) == 0;
+      }
+
+      JS_FreeValue(ctx, median);
+      JS_FreeValue(ctx, metric);
+    }
+    JS_FreeValue(ctx, benchmark);
+  }
+
+  JS_FreeValue(ctx, benchmarks);
+  JS_FreeValue(ctx, report);
+  JS_FreeContext(ctx);
+  JS_FreeRuntime(rt);
+  veil_file_drop(&file);
+
+  return ok;
+}
+
+static void write_report(FILE* out, uint32_t repeat, double threshold, bench_stats_t (*stats)[BENCH_MAX_METRICS], const bool* selected) {
+  bool first = true;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"veil\": \"%s\",\n", VEIL_VERSION_STR);
+  fprintf(out, "  \"quickjs\": \"%s\",\n", QJS_VERSION);
+  fprintf(out, "  \"libuv\": \"%s\",\n", uv_version_string());
+  fprintf(out, "  \"repeat\": %u,\n", repeat);
+  fprintf(out, "  \"threshold\": %.1f,\n", threshold);
+  fprintf(out, "  \"benchmarks\": {");
+
+  for (size_t b = 0; b < countof(BENCHMARKS); b++) {
+    if (!selected[b]) {
+      continue;
+    }
+
+    fprintf(out, "%s\n    \"%s\": {", first ? "" : ",", BENCHMARKS[b].name);
+    first = false;
+
+    for (int m = 0; m < BENCH_MAX_METRICS && BENCHMARKS[b].metrics[m]; m++) {
+      const bench_stats_t* s = &stats[b][m];
+
+      fprintf(out, "%s\n      \"%s\": { \"median\": %.1f, \"min\": %.1f, \"max\": %.1f",
+              m ? "," : "", BENCHMARKS[b].metrics[m], s->median, s->min, s->max);
+      if (s->has_baseline) {
+        fprintf(out, ", \"baseline\": %.1f, \"regressed\": %s", s->baseline, s->regressed ? "true" : "false");
+      }
+      fprintf(out, " }");
+    }
+
+    fprintf(out, "\n    }");
+  }
+
+  fprintf(out, "\n  }\n}\n");
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+
+  return (x > y) - (x < y);
+}
+
+// the value of --name=value, or NULL when arg is another option
+static const char* option_value(const char* arg, const char* name) {
+  size_t length = strlen(name);
+
+  return strncmp(arg, name, length) == 0 && arg[length] == '=' ? arg + length + 1 : NULL;
+}
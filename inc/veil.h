@@ -31,12 +31,76 @@ typedef enum {
   VEIL_INPUT_TYPE_COMMONJS
 } veil_input_type_t;
 
+typedef enum {
+  VEIL_ALLOCATOR_SYSTEM,
+  VEIL_ALLOCATOR_POOL,
+  VEIL_ALLOCATOR_MIMALLOC,
+  VEIL_ALLOCATOR_JEMALLOC,
+} veil_allocator_t;
+
 typedef enum {
   VEIL_SCRIPT_OP_SPECIFIER,
   VEIL_SCRIPT_OP_EVAL,
   VEIL_SCRIPT_OP_PRINT,
+  VEIL_SCRIPT_OP_BUNDLE,
 } veil_script_op_t;
 
+typedef struct veil_microtask_stats_s {
+  // microtask jobs executed
+  uint64_t jobs;
+  // check-phase drains of the microtask queue
+  uint64_t drains;
+  // drains that stopped on --microtask-budget or --microtask-slice with
+  // jobs still queued
+  uint64_t budget_hits;
+} veil_microtask_stats_t;
+
+typedef struct veil_loop_metrics_s {
+  // completed loop iterations since veil_run started the loop
+  uint64_t iterations;
+  // wall time since the loop started
+  uint64_t loop_ns;
+  // time blocked in poll waiting for events
+  uint64_t idle_ns;
+  // time in the poll phase, idle wait plus I/O callbacks
+  uint64_t poll_ns;
+  // time running due setTimeout() / setInterval() callbacks
+  uint64_t timer_ns;
+  // time running setImmediate() callbacks after poll
+  uint64_t immediate_ns;
+  // time draining microtasks after poll
+  uint64_t microtask_ns;
+  // time writing out batched output, before poll and after microtasks
+  uint64_t flush_ns;
+  // time in JS callbacks: timers, I/O, immediates and microtasks
+  uint64_t callback_ns;
+  // 1 - idle_ns / loop_ns
+  double utilization;
+  // busy (non-idle) time per loop iteration
+  uint64_t iteration_p50_ns;
+  uint64_t iteration_p90_ns;
+  uint64_t iteration_p99_ns;
+  uint64_t iteration_max_ns;
+} veil_loop_metrics_t;
+
+typedef struct veil_memory_usage_s {
+  // resident set size of the process
+  size_t rss;
+  // bytes allocated by the engine, including allocator overhead
+  size_t heap_total;
+  // bytes in use by live engine objects
+  size_t heap_used;
+  // --max-heap-size, 0 when unlimited
+  size_t heap_limit;
+  // ArrayBuffer and SharedArrayBuffer backing stores
+  size_t array_buffers;
+  uint64_t objects;
+  uint64_t strings;
+  uint64_t atoms;
+  uint64_t shapes;
+  uint64_t functions;
+} veil_memory_usage_t;
+
 typedef struct veil_parse_args_result_s {
   bool ok;
   int exit_code;
@@ -52,6 +116,49 @@ veil_parse_args_result_t veil_parse_args(veil_t* veil, int argc, char** argv);
 
 int veil_run(veil_t* veil);
 
+void veil_get_microtask_stats(veil_t* veil, veil_microtask_stats_t* stats);
+
+void veil_get_loop_metrics(veil_t* veil, veil_loop_metrics_t* metrics);
+
+void veil_get_memory_usage(veil_t* veil, veil_memory_usage_t* usage);
+
+bool veil_write_heap_snapshot(veil_t* veil, const char* filename);
+
+// A pool of initialized VMs for embedders that run many short scripts. Each
+// VM lives on a thread of its own, so any host thread can acquire one, run
+// work on it and release it. Releasing gives the VM a fresh context on its
+// existing runtime before it goes back into the pool.
+//
+// The pool takes its configuration from veil, which must outlive it and
+// is not run itself.
+typedef struct veil_pool_s veil_pool_t;
+typedef struct veil_pool_vm_s veil_pool_vm_t;
+
+veil_pool_t* veil_pool_new(veil_t* veil, uint32_t size);
+
+// Every VM must have been released.
+void veil_pool_free(veil_pool_t* pool);
+
+// Blocks until a VM is free.
+veil_pool_vm_t* veil_pool_acquire(veil_pool_t* pool);
+
+void veil_pool_release(veil_pool_vm_t* vm);
+
+// Both return once the result, or a returned promise, has settled; timers
+// and sockets the script leaves open are closed when the VM is released. A
+// job that never settles runs until the event loop has nothing left to do.
+// On success, result is the value as JSON, or NULL when it has no JSON form,
+// such as undefined. On failure, result is the error. Free result with free().
+//
+// Evaluates source, which is NUL-terminated, as a classic script.
+bool veil_pool_eval(veil_pool_vm_t* vm, const char* source, const char* filename, char** result);
+// Imports the module specifier and calls its export name with the elements
+// of args_json, a JSON array, or with no arguments when it is NULL.
+bool veil_pool_call(veil_pool_vm_t* vm, const char* specifier, const char* name, const char* args_json, char** result);
+
+bool veil_cfg_get_no_addon(veil_t* veil);
+void veil_cfg_set_no_addon(veil_t* veil, bool no_addon);
+
 bool veil_cfg_get_no_deprecation(veil_t* veil);
 void veil_cfg_set_no_deprecation(veil_t* veil, bool no_deprecation);
 
@@ -77,6 +184,62 @@ const char* veil_cfg_get_script(veil_t* veil);
 veil_script_op_t veil_cfg_get_script_op(veil_t* veil);
 void veil_cfg_set_script(veil_t* veil, const char* script, veil_script_op_t op);
 
+const char* veil_cfg_get_code_cache_dir(veil_t* veil);
+void veil_cfg_set_code_cache_dir(veil_t* veil, const char* code_cache_dir);
+
+bool veil_cfg_get_build_snapshot(veil_t* veil);
+void veil_cfg_set_build_snapshot(veil_t* veil, bool build_snapshot);
+
+const char* veil_cfg_get_snapshot_blob(veil_t* veil);
+void veil_cfg_set_snapshot_blob(veil_t* veil, const char* snapshot_blob);
+
+veil_allocator_t veil_cfg_get_allocator(veil_t* veil);
+bool veil_cfg_set_allocator(veil_t* veil, veil_allocator_t allocator);
+bool veil_cfg_set_allocator_str(veil_t* veil, const char* allocator);
+
+size_t veil_cfg_get_max_heap_size(veil_t* veil);
+void veil_cfg_set_max_heap_size(veil_t* veil, size_t max_heap_size);
+
+size_t veil_cfg_get_gc_threshold(veil_t* veil);
+void veil_cfg_set_gc_threshold(veil_t* veil, size_t gc_threshold);
+
+size_t veil_cfg_get_max_stack_size(veil_t* veil);
+void veil_cfg_set_max_stack_size(veil_t* veil, size_t max_stack_size);
+
+bool veil_cfg_get_gc_adaptive(veil_t* veil);
+void veil_cfg_set_gc_adaptive(veil_t* veil, bool gc_adaptive);
+
+uint32_t veil_cfg_get_microtask_budget(veil_t* veil);
+void veil_cfg_set_microtask_budget(veil_t* veil, uint32_t microtask_budget);
+
+uint32_t veil_cfg_get_microtask_slice(veil_t* veil);
+void veil_cfg_set_microtask_slice(veil_t* veil, uint32_t microtask_slice_ms);
+
+bool veil_cfg_get_cpu_prof(veil_t* veil);
+void veil_cfg_set_cpu_prof(veil_t* veil, bool cpu_prof);
+
+const char* veil_cfg_get_cpu_prof_dir(veil_t* veil);
+void veil_cfg_set_cpu_prof_dir(veil_t* veil, const char* cpu_prof_dir);
+
+uint32_t veil_cfg_get_cpu_prof_interval(veil_t* veil);
+void veil_cfg_set_cpu_prof_interval(veil_t* veil, uint32_t cpu_prof_interval_us);
+
+const char* veil_cfg_get_resolution_manifest(veil_t* veil);
+void veil_cfg_set_resolution_manifest(veil_t* veil, const char* resolution_manifest);
+
+int veil_cfg_get_heapsnapshot_signal(veil_t* veil);
+void veil_cfg_set_heapsnapshot_signal(veil_t* veil, int signum);
+
+uint32_t veil_cfg_get_workers(veil_t* veil);
+void veil_cfg_set_workers(veil_t* veil, uint32_t workers);
+
+const char* veil_cfg_get_build_bundle(veil_t* veil);
+void veil_cfg_set_build_bundle(veil_t* veil, const char* build_bundle);
+
+size_t veil_cfg_get_bundle_asset_count(veil_t* veil);
+const char* veil_cfg_get_bundle_asset(veil_t* veil, size_t index);
+void veil_cfg_add_bundle_asset(veil_t* veil, const char* filename);
+
 veil_input_type_t veil_cfg_get_input_type(veil_t* veil);
 bool veil_cfg_set_input_type(veil_t* veil, veil_input_type_t input_type);
 bool veil_cfg_set_input_type_str(veil_t* veil, const char* input_type);
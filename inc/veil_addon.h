@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Native addons are shared libraries, conventionally named *.node, that an
+// import loads with dlopen. An addon never links against veil: its init
+// function receives a table of API functions, and every value crosses the
+// boundary as an opaque handle. The table only ever grows at the end, so an
+// addon built against ABI version N loads in any veil that supports N or a
+// later version; VEIL_ADDON_HAS() tells whether a function added after the
+// addon's minimum is present.
+//
+// Handles are valid until the native call that received or created them
+// returns. A value that must outlive the call is kept with a reference.
+//
+//   static veil_addon_value_t add(veil_addon_env_t* env, veil_addon_callback_info_t* info) {...}
+//
+//   static veil_addon_value_t init(const veil_addon_api_t* api, veil_addon_env_t* env, veil_addon_value_t exports) {
+//     veil_addon_value_t fn;
+//     api->create_function(env, "add", add, NULL, &fn);
+//     api->set_named_property(env, exports, "add", fn);
+//     return exports;
+//   }
+//
+//   VEIL_ADDON_MODULE(init)
+//
+// The exports become the module's default export, and each of their own
+// enumerable string keys a named export.
+
+#define VEIL_ADDON_ABI_VERSION 1
+
+// for string lengths: the string is NUL-terminated
+#define VEIL_ADDON_AUTO_LENGTH SIZE_MAX
+
+#if defined(_WIN32)
+#define VEIL_ADDON_EXPORT __declspec(dllexport)
+#else
+#define VEIL_ADDON_EXPORT __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+#define VEIL_ADDON_EXTERN_C extern "C"
+#else
+#define VEIL_ADDON_EXTERN_C
+#endif
+
+typedef struct veil_addon_env_s veil_addon_env_t;
+typedef struct veil_addon_callback_info_s veil_addon_callback_info_t;
+typedef struct veil_addon_value_s* veil_addon_value_t;
+typedef struct veil_addon_ref_s* veil_addon_ref_t;
+
+typedef enum {
+  VEIL_ADDON_OK,
+  VEIL_ADDON_INVALID_ARG,
+  VEIL_ADDON_OBJECT_EXPECTED,
+  VEIL_ADDON_STRING_EXPECTED,
+  VEIL_ADDON_NUMBER_EXPECTED,
+  VEIL_ADDON_BOOLEAN_EXPECTED,
+  VEIL_ADDON_BIGINT_EXPECTED,
+  VEIL_ADDON_FUNCTION_EXPECTED,
+  VEIL_ADDON_BUFFER_EXPECTED,
+  VEIL_ADDON_PENDING_EXCEPTION,
+  VEIL_ADDON_GENERIC_FAILURE,
+} veil_addon_status_t;
+
+typedef enum {
+  VEIL_ADDON_UNDEFINED,
+  VEIL_ADDON_NULL,
+  VEIL_ADDON_BOOLEAN,
+  VEIL_ADDON_NUMBER,
+  VEIL_ADDON_STRING,
+  VEIL_ADDON_SYMBOL,
+  VEIL_ADDON_OBJECT,
+  VEIL_ADDON_FUNCTION,
+  VEIL_ADDON_BIGINT,
+  VEIL_ADDON_EXTERNAL,
+} veil_addon_type_t;
+
+// Returning NULL returns undefined, or throws when an exception is pending.
+typedef veil_addon_value_t (*veil_addon_callback_t)(veil_addon_env_t* env, veil_addon_callback_info_t* info);
+// Runs while the object is being collected, so it must not call into the API.
+typedef void (*veil_addon_finalize_t)(veil_addon_env_t* env, void* data, void* hint);
+
+typedef struct veil_addon_api_s {
+  // of the veil that filled the table
+  uint32_t version;
+  // sizeof the table, for VEIL_ADDON_HAS()
+  uint32_t size;
+
+  // version 1
+
+  veil_addon_status_t (*get_undefined)(veil_addon_env_t* env, veil_addon_value_t* result);
+  veil_addon_status_t (*get_null)(veil_addon_env_t* env, veil_addon_value_t* result);
+  veil_addon_status_t (*get_global)(veil_addon_env_t* env, veil_addon_value_t* result);
+  veil_addon_status_t (*get_boolean)(veil_addon_env_t* env, bool value, veil_addon_value_t* result);
+  veil_addon_status_t (*create_int32)(veil_addon_env_t* env, int32_t value, veil_addon_value_t* result);
+  veil_addon_status_t (*create_uint32)(veil_addon_env_t* env, uint32_t value, veil_addon_value_t* result);
+  veil_addon_status_t (*create_int64)(veil_addon_env_t* env, int64_t value, veil_addon_value_t* result);
+  veil_addon_status_t (*create_double)(veil_addon_env_t* env, double value, veil_addon_value_t* result);
+  veil_addon_status_t (*create_bigint_int64)(veil_addon_env_t* env, int64_t value, veil_addon_value_t* result);
+  veil_addon_status_t (*create_string_utf8)(veil_addon_env_t* env, const char* str, size_t length, veil_addon_value_t* result);
+  veil_addon_status_t (*create_object)(veil_addon_env_t* env, veil_addon_value_t* result);
+  veil_addon_status_t (*create_array)(veil_addon_env_t* env, veil_addon_value_t* result);
+  veil_addon_status_t (*create_function)(veil_addon_env_t* env, const char* name, veil_addon_callback_t cb, void* data, veil_addon_value_t* result);
+  veil_addon_status_t (*create_external)(veil_addon_env_t* env, void* data, veil_addon_finalize_t finalize, void* hint, veil_addon_value_t* result);
+  // a Buffer of size uninitialized bytes
+  veil_addon_status_t (*create_buffer)(veil_addon_env_t* env, size_t size, void** data, veil_addon_value_t* result);
+  veil_addon_status_t (*create_buffer_copy)(veil_addon_env_t* env, const void* src, size_t size, void** data, veil_addon_value_t* result);
+
+  veil_addon_status_t (*type_of)(veil_addon_env_t* env, veil_addon_value_t value, veil_addon_type_t* result);
+  veil_addon_status_t (*is_array)(veil_addon_env_t* env, veil_addon_value_t value, bool* result);
+  veil_addon_status_t (*get_value_bool)(veil_addon_env_t* env, veil_addon_value_t value, bool* result);
+  veil_addon_status_t (*get_value_int32)(veil_addon_env_t* env, veil_addon_value_t value, int32_t* result);
+  veil_addon_status_t (*get_value_uint32)(veil_addon_env_t* env, veil_addon_value_t value, uint32_t* result);
+  veil_addon_status_t (*get_value_int64)(veil_addon_env_t* env, veil_addon_value_t value, int64_t* result);
+  veil_addon_status_t (*get_value_double)(veil_addon_env_t* env, veil_addon_value_t value, double* result);
+  veil_addon_status_t (*get_value_bigint_int64)(veil_addon_env_t* env, veil_addon_value_t value, int64_t* result);
+  // With a NULL buf, result is the length in bytes. Otherwise copies as much
+  // as fits in bufsize - 1 bytes, NUL-terminates and sets result to the
+  // bytes copied.
+  veil_addon_status_t (*get_value_string_utf8)(veil_addon_env_t* env, veil_addon_value_t value, char* buf, size_t bufsize, size_t* result);
+  veil_addon_status_t (*get_value_external)(veil_addon_env_t* env, veil_addon_value_t value, void** result);
+  // the bytes of an ArrayBuffer, a typed array or a Buffer, borrowed for as
+  // long as the value is alive
+  veil_addon_status_t (*get_buffer_info)(veil_addon_env_t* env, veil_addon_value_t value, void** data, size_t* size);
+
+  veil_addon_status_t (*get_property)(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, veil_addon_value_t* result);
+  veil_addon_status_t (*set_property)(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, veil_addon_value_t value);
+  veil_addon_status_t (*has_property)(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, bool* result);
+  veil_addon_status_t (*get_named_property)(veil_addon_env_t* env, veil_addon_value_t object, const char* name, veil_addon_value_t* result);
+  veil_addon_status_t (*set_named_property)(veil_addon_env_t* env, veil_addon_value_t object, const char* name, veil_addon_value_t value);
+  veil_addon_status_t (*get_element)(veil_addon_env_t* env, veil_addon_value_t object, uint32_t index, veil_addon_value_t* result);
+  veil_addon_status_t (*set_element)(veil_addon_env_t* env, veil_addon_value_t object, uint32_t index, veil_addon_value_t value);
+  veil_addon_status_t (*get_array_length)(veil_addon_env_t* env, veil_addon_value_t value, uint32_t* result);
+
+  // argc is the capacity of argv on entry and the argument count on return;
+  // missing arguments are filled with undefined. Any out pointer can be NULL.
+  veil_addon_status_t (*get_cb_info)(veil_addon_env_t* env, veil_addon_callback_info_t* info, size_t* argc, veil_addon_value_t* argv, veil_addon_value_t* this_arg, void** data);
+  veil_addon_status_t (*call_function)(veil_addon_env_t* env, veil_addon_value_t recv, veil_addon_value_t func, size_t argc, const veil_addon_value_t* argv, veil_addon_value_t* result);
+  veil_addon_status_t (*new_instance)(veil_addon_env_t* env, veil_addon_value_t constructor, size_t argc, const veil_addon_value_t* argv, veil_addon_value_t* result);
+
+  // Ties native data to an object; finalize runs when the object is collected.
+  veil_addon_status_t (*wrap)(veil_addon_env_t* env, veil_addon_value_t object, void* data, veil_addon_finalize_t finalize, void* hint);
+  veil_addon_status_t (*unwrap)(veil_addon_env_t* env, veil_addon_value_t object, void** result);
+
+  // Strong references, released by delete_reference or with the VM.
+  veil_addon_status_t (*create_reference)(veil_addon_env_t* env, veil_addon_value_t value, veil_addon_ref_t* result);
+  veil_addon_status_t (*delete_reference)(veil_addon_env_t* env, veil_addon_ref_t ref);
+  veil_addon_status_t (*get_reference_value)(veil_addon_env_t* env, veil_addon_ref_t ref, veil_addon_value_t* result);
+
+  veil_addon_status_t (*throw_value)(veil_addon_env_t* env, veil_addon_value_t error);
+  // code, when not NULL, becomes the error's code property
+  veil_addon_status_t (*throw_error)(veil_addon_env_t* env, const char* code, const char* message);
+  veil_addon_status_t (*throw_type_error)(veil_addon_env_t* env, const char* code, const char* message);
+  veil_addon_status_t (*throw_range_error)(veil_addon_env_t* env, const char* code, const char* message);
+  veil_addon_status_t (*is_exception_pending)(veil_addon_env_t* env, bool* result);
+  veil_addon_status_t (*get_and_clear_last_exception)(veil_addon_env_t* env, veil_addon_value_t* result);
+} veil_addon_api_t;
+
+#define VEIL_ADDON_HAS(api, fn) (offsetof(veil_addon_api_t, fn) < (api)->size && (api)->fn != NULL)
+
+typedef uint32_t (*veil_addon_abi_version_fn)(void);
+typedef veil_addon_value_t (*veil_addon_init_fn)(const veil_addon_api_t* api, veil_addon_env_t* env, veil_addon_value_t exports);
+
+// Defines the entry points veil looks up in an addon. init returns the
+// module's exports, or NULL to keep the object it was given.
+#define VEIL_ADDON_MODULE(init)                                                                            \
+  VEIL_ADDON_EXTERN_C VEIL_ADDON_EXPORT uint32_t veil_addon_abi_version(void) {                            \
+    return VEIL_ADDON_ABI_VERSION;                                                                         \
+  }                                                                                                        \
+  VEIL_ADDON_EXTERN_C VEIL_ADDON_EXPORT veil_addon_value_t veil_addon_init(                                \
+      const veil_addon_api_t* api, veil_addon_env_t* env, veil_addon_value_t exports) {                    \
+    return (init)(api, env, exports);                                                                      \
+  }
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
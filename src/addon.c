@@ -0,0 +1,1274 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+#include <veil_addon.h>
+
+// Native addons (see veil_addon.h). Each VM has one env: its handles are
+// JSValues on a stack that every native call truncates back to where it
+// found it, and a handle is its stack index plus one so that NULL stays
+// invalid. An exception thrown by a JS operation or by the addon stays set
+// on the context and is flagged as pending until the native call returns
+// and rethrows it.
+//
+// Libraries are never closed: finalizers of wrapped objects can run as late
+// as the runtime's teardown.
+
+#define ADDON_ARG(arg) \
+  do { \
+    if (!(arg)) { \
+      return VEIL_ADDON_INVALID_ARG; \
+    } \
+  } while (0)
+
+typedef struct addon_module_s addon_module_t;
+
+struct addon_module_s {
+  addon_module_t* next;
+  JSModuleDef* m;
+  // the exports until the module's init hands them over
+  JSValue exports;
+  JSPropertyEnum* names;
+  uint32_t name_count;
+};
+
+struct veil_addon_ref_s {
+  veil_addon_ref_t next;
+  veil_addon_ref_t prev;
+  JSValue value;
+};
+
+struct veil_addon_env_s {
+  veil_vm_t* vm;
+  JSContext* ctx;
+  JSValue* handles;
+  size_t handle_count;
+  size_t handle_capacity;
+  bool pending;
+  // the property wrap() stores native data under
+  JSAtom wrap_key;
+  addon_module_t* modules;
+  struct veil_addon_ref_s refs;
+};
+
+struct veil_addon_callback_info_s {
+  JSValueConst this_val;
+  int argc;
+  JSValueConst* argv;
+  void* data;
+};
+
+typedef struct addon_function_s {
+  veil_addon_callback_t cb;
+  void* data;
+} addon_function_t;
+
+typedef struct addon_native_s {
+  void* data;
+  veil_addon_finalize_t finalize;
+  void* hint;
+} addon_native_t;
+
+typedef struct addon_scope_s {
+  size_t top;
+  bool pending;
+} addon_scope_t;
+
+static JSClassID function_class_id;
+static JSClassID native_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static veil_addon_env_t* get_env(veil_vm_t* vm);
+static void scope_open(veil_addon_env_t* env, addon_scope_t* scope);
+static JSValue scope_close(veil_addon_env_t* env, addon_scope_t* scope, veil_addon_value_t result);
+static veil_addon_value_t new_handle(veil_addon_env_t* env, JSValue value);
+static JSValueConst to_js(veil_addon_env_t* env, veil_addon_value_t value);
+static veil_addon_status_t set_result(veil_addon_env_t* env, JSValue value, veil_addon_value_t* result);
+static veil_addon_status_t set_pending(veil_addon_env_t* env);
+static int module_init(JSContext* ctx, JSModuleDef* m);
+static JSValue function_call(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic, JSValue* func_data);
+static void function_finalizer(JSRuntime* rt, JSValue val);
+static void native_finalizer(JSRuntime* rt, JSValue val);
+static JSValue new_native(veil_addon_env_t* env, void* data, veil_addon_finalize_t finalize, void* hint);
+static JSValue* to_js_args(veil_addon_env_t* env, size_t argc, const veil_addon_value_t* argv);
+static void module_free(JSContext* ctx, addon_module_t* module);
+static veil_addon_status_t throw_kind(veil_addon_env_t* env, JSValue (*thrower)(JSContext*, const char*, ...), const char* code, const char* message);
+
+static veil_addon_status_t api_get_undefined(veil_addon_env_t* env, veil_addon_value_t* result);
+static veil_addon_status_t api_get_null(veil_addon_env_t* env, veil_addon_value_t* result);
+static veil_addon_status_t api_get_global(veil_addon_env_t* env, veil_addon_value_t* result);
+static veil_addon_status_t api_get_boolean(veil_addon_env_t* env, bool value, veil_addon_value_t* result);
+static veil_addon_status_t api_create_int32(veil_addon_env_t* env, int32_t value, veil_addon_value_t* result);
+static veil_addon_status_t api_create_uint32(veil_addon_env_t* env, uint32_t value, veil_addon_value_t* result);
+static veil_addon_status_t api_create_int64(veil_addon_env_t* env, int64_t value, veil_addon_value_t* result);
+static veil_addon_status_t api_create_double(veil_addon_env_t* env, double value, veil_addon_value_t* result);
+static veil_addon_status_t api_create_bigint_int64(veil_addon_env_t* env, int64_t value, veil_addon_value_t* result);
+static veil_addon_status_t api_create_string_utf8(veil_addon_env_t* env, const char* str, size_t length, veil_addon_value_t* result);
+static veil_addon_status_t api_create_object(veil_addon_env_t* env, veil_addon_value_t* result);
+static veil_addon_status_t api_create_array(veil_addon_env_t* env, veil_addon_value_t* result);
+static veil_addon_status_t api_create_function(veil_addon_env_t* env, const char* name, veil_addon_callback_t cb, void* data, veil_addon_value_t* result);
+static veil_addon_status_t api_create_external(veil_addon_env_t* env, void* data, veil_addon_finalize_t finalize, void* hint, veil_addon_value_t* result);
+static veil_addon_status_t api_create_buffer(veil_addon_env_t* env, size_t size, void** data, veil_addon_value_t* result);
+static veil_addon_status_t api_create_buffer_copy(veil_addon_env_t* env, const void* src, size_t size, void** data, veil_addon_value_t* result);
+static veil_addon_status_t api_type_of(veil_addon_env_t* env, veil_addon_value_t value, veil_addon_type_t* result);
+static veil_addon_status_t api_is_array(veil_addon_env_t* env, veil_addon_value_t value, bool* result);
+static veil_addon_status_t api_get_value_bool(veil_addon_env_t* env, veil_addon_value_t value, bool* result);
+static veil_addon_status_t api_get_value_int32(veil_addon_env_t* env, veil_addon_value_t value, int32_t* result);
+static veil_addon_status_t api_get_value_uint32(veil_addon_env_t* env, veil_addon_value_t value, uint32_t* result);
+static veil_addon_status_t api_get_value_int64(veil_addon_env_t* env, veil_addon_value_t value, int64_t* result);
+static veil_addon_status_t api_get_value_double(veil_addon_env_t* env, veil_addon_value_t value, double* result);
+static veil_addon_status_t api_get_value_bigint_int64(veil_addon_env_t* env, veil_addon_value_t value, int64_t* result);
+static veil_addon_status_t api_get_value_string_utf8(veil_addon_env_t* env, veil_addon_value_t value, char* buf, size_t bufsize, size_t* result);
+static veil_addon_status_t api_get_value_external(veil_addon_env_t* env, veil_addon_value_t value, void** result);
+static veil_addon_status_t api_get_buffer_info(veil_addon_env_t* env, veil_addon_value_t value, void** data, size_t* size);
+static veil_addon_status_t api_get_property(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, veil_addon_value_t* result);
+static veil_addon_status_t api_set_property(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, veil_addon_value_t value);
+static veil_addon_status_t api_has_property(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, bool* result);
+static veil_addon_status_t api_get_named_property(veil_addon_env_t* env, veil_addon_value_t object, const char* name, veil_addon_value_t* result);
+static veil_addon_status_t api_set_named_property(veil_addon_env_t* env, veil_addon_value_t object, const char* name, veil_addon_value_t value);
+static veil_addon_status_t api_get_element(veil_addon_env_t* env, veil_addon_value_t object, uint32_t index, veil_addon_value_t* result);
+static veil_addon_status_t api_set_element(veil_addon_env_t* env, veil_addon_value_t object, uint32_t index, veil_addon_value_t value);
+static veil_addon_status_t api_get_array_length(veil_addon_env_t* env, veil_addon_value_t value, uint32_t* result);
+static veil_addon_status_t api_get_cb_info(veil_addon_env_t* env, veil_addon_callback_info_t* info, size_t* argc, veil_addon_value_t* argv, veil_addon_value_t* this_arg, void** data);
+static veil_addon_status_t api_call_function(veil_addon_env_t* env, veil_addon_value_t recv, veil_addon_value_t func, size_t argc, const veil_addon_value_t* argv, veil_addon_value_t* result);
+static veil_addon_status_t api_new_instance(veil_addon_env_t* env, veil_addon_value_t constructor, size_t argc, const veil_addon_value_t* argv, veil_addon_value_t* result);
+static veil_addon_status_t api_wrap(veil_addon_env_t* env, veil_addon_value_t object, void* data, veil_addon_finalize_t finalize, void* hint);
+static veil_addon_status_t api_unwrap(veil_addon_env_t* env, veil_addon_value_t object, void** result);
+static veil_addon_status_t api_create_reference(veil_addon_env_t* env, veil_addon_value_t value, veil_addon_ref_t* result);
+static veil_addon_status_t api_delete_reference(veil_addon_env_t* env, veil_addon_ref_t ref);
+static veil_addon_status_t api_get_reference_value(veil_addon_env_t* env, veil_addon_ref_t ref, veil_addon_value_t* result);
+static veil_addon_status_t api_throw_value(veil_addon_env_t* env, veil_addon_value_t error);
+static veil_addon_status_t api_throw_error(veil_addon_env_t* env, const char* code, const char* message);
+static veil_addon_status_t api_throw_type_error(veil_addon_env_t* env, const char* code, const char* message);
+static veil_addon_status_t api_throw_range_error(veil_addon_env_t* env, const char* code, const char* message);
+static veil_addon_status_t api_is_exception_pending(veil_addon_env_t* env, bool* result);
+static veil_addon_status_t api_get_and_clear_last_exception(veil_addon_env_t* env, veil_addon_value_t* result);
+
+static const veil_addon_api_t API = {
+  .version = VEIL_ADDON_ABI_VERSION,
+  .size = sizeof(veil_addon_api_t),
+  .get_undefined = api_get_undefined,
+  .get_null = api_get_null,
+  .get_global = api_get_global,
+  .get_boolean = api_get_boolean,
+  .create_int32 = api_create_int32,
+  .create_uint32 = api_create_uint32,
+  .create_int64 = api_create_int64,
+  .create_double = api_create_double,
+  .create_bigint_int64 = api_create_bigint_int64,
+  .create_string_utf8 = api_create_string_utf8,
+  .create_object = api_create_object,
+  .create_array = api_create_array,
+  .create_function = api_create_function,
+  .create_external = api_create_external,
+  .create_buffer = api_create_buffer,
+  .create_buffer_copy = api_create_buffer_copy,
+  .type_of = api_type_of,
+  .is_array = api_is_array,
+  .get_value_bool = api_get_value_bool,
+  .get_value_int32 = api_get_value_int32,
+  .get_value_uint32 = api_get_value_uint32,
+  .get_value_int64 = api_get_value_int64,
+  .get_value_double = api_get_value_double,
+  .get_value_bigint_int64 = api_get_value_bigint_int64,
+  .get_value_string_utf8 = api_get_value_string_utf8,
+  .get_value_external = api_get_value_external,
+  .get_buffer_info = api_get_buffer_info,
+  .get_property = api_get_property,
+  .set_property = api_set_property,
+  .has_property = api_has_property,
+  .get_named_property = api_get_named_property,
+  .set_named_property = api_set_named_property,
+  .get_element = api_get_element,
+  .set_element = api_set_element,
+  .get_array_length = api_get_array_length,
+  .get_cb_info = api_get_cb_info,
+  .call_function = api_call_function,
+  .new_instance = api_new_instance,
+  .wrap = api_wrap,
+  .unwrap = api_unwrap,
+  .create_reference = api_create_reference,
+  .delete_reference = api_delete_reference,
+  .get_reference_value = api_get_reference_value,
+  .throw_value = api_throw_value,
+  .throw_error = api_throw_error,
+  .throw_type_error = api_throw_type_error,
+  .throw_range_error = api_throw_range_error,
+  .is_exception_pending = api_is_exception_pending,
+  .get_and_clear_last_exception = api_get_and_clear_last_exception,
+};
+
+// no gc_mark: neither class holds JSValues; references are strong roots by
+// design and a function's holder is func_data, which QuickJS marks itself
+static const JSClassDef FUNCTION_CLASS = {
+  "AddonFunction",
+  .finalizer = function_finalizer,
+};
+
+static const JSClassDef NATIVE_CLASS = {
+  "External",
+  .finalizer = native_finalizer,
+};
+
+bool veil_addon_is_addon(const char* filename) {
+  size_t len = strlen(filename);
+
+  return len > 5 && memcmp(filename + len - 5, ".node", 5) == 0;
+}
+
+// Loads and initializes the library now, so that its exports are known when
+// the module is linked.
+JSModuleDef* veil_addon_load(JSContext* ctx, const char* filename) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_addon_abi_version_fn abi_version;
+  veil_addon_init_fn init;
+  veil_addon_env_t* env;
+  veil_addon_value_t handle;
+  veil_addon_value_t result;
+  addon_module_t* module;
+  addon_scope_t scope;
+  uint32_t version;
+  JSValue exports;
+  uv_lib_t lib;
+
+  if (vm->cfg->no_addon) {
+    JS_ThrowInternalError(ctx, "cannot load '%s': native addons are disabled by --no-addon", filename);
+    return NULL;
+  }
+
+  if (uv_dlopen(filename, &lib) != 0) {
+    JS_ThrowInternalError(ctx, "cannot load '%s': %s", filename, uv_dlerror(&lib));
+    uv_dlclose(&lib);
+    return NULL;
+  }
+
+  if (uv_dlsym(&lib, "veil_addon_abi_version", (void**) &abi_version) != 0
+      || uv_dlsym(&lib, "veil_addon_init", (void**) &init) != 0) {
+    JS_ThrowInternalError(ctx, "cannot load '%s': not a veil addon", filename);
+    uv_dlclose(&lib);
+    return NULL;
+  }
+
+  version = abi_version();
+  if (version < 1 || version > VEIL_ADDON_ABI_VERSION) {
+    JS_ThrowInternalError(ctx, "cannot load '%s': built for addon ABI version %u, veil supports 1 to %u",
+                          filename, version, VEIL_ADDON_ABI_VERSION);
+    uv_dlclose(&lib);
+    return NULL;
+  }
+
+  uv_once(&global_once, global_init);
+  if (!JS_IsRegisteredClass(vm->runtime, function_class_id)) {
+    JS_NewClass(vm->runtime, function_class_id, &FUNCTION_CLASS);
+    JS_NewClass(vm->runtime, native_class_id, &NATIVE_CLASS);
+  }
+
+  env = get_env(vm);
+  scope_open(env, &scope);
+  if (set_result(env, JS_NewObject(ctx), &handle) != VEIL_ADDON_OK) {
+    scope_close(env, &scope, NULL);
+    return NULL;
+  }
+
+  result = init(&API, env, handle);
+  exports = scope_close(env, &scope, result ? result : handle);
+  if (JS_IsException(exports)) {
+    return NULL;
+  }
+
+  module = calloc(1, sizeof(addon_module_t));
+  CHECK_NOT_NULL(module);
+  module->exports = exports;
+
+  if (JS_IsObject(exports)
+      && JS_GetOwnPropertyNames(ctx, &module->names, &module->name_count, exports, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+    JS_FreeValue(ctx, exports);
+    free(module);
+    return NULL;
+  }
+
+  module->m = JS_NewCModule(ctx, filename, module_init);
+  if (!module->m) {
+    module_free(ctx, module);
+    return NULL;
+  }
+
+  JS_AddModuleExport(ctx, module->m, "default");
+  for (uint32_t n = 0; n < module->name_count; n++) {
+    const char* name = JS_AtomToCString(ctx, module->names[n].atom);
+
+    if (name && strcmp(name, "default") != 0) {
+      JS_AddModuleExport(ctx, module->m, name);
+    }
+    JS_FreeCString(ctx, name);
+  }
+
+  module->next = env->modules;
+  env->modules = module;
+
+  return module->m;
+}
+
+// Releases the JS values the env holds; before the context is freed.
+void veil_addon_drop(veil_vm_t* vm) {
+  veil_addon_env_t* env = vm->addons;
+  JSContext* ctx = vm->context;
+  addon_module_t* module;
+
+  if (!env) {
+    return;
+  }
+
+  while ((module = env->modules)) {
+    env->modules = module->next;
+    module_free(ctx, module);
+  }
+
+  while (env->refs.next != &env->refs) {
+    api_delete_reference(env, env->refs.next);
+  }
+
+  for (size_t n = 0; n < env->handle_count; n++) {
+    JS_FreeValue(ctx, env->handles[n]);
+  }
+  env->handle_count = 0;
+
+  JS_FreeAtom(ctx, env->wrap_key);
+  env->wrap_key = JS_ATOM_NULL;
+}
+
+// after the runtime, whose teardown can still run finalizers
+void veil_addon_free(veil_addon_env_t* env) {
+  if (env) {
+    free(env->handles);
+    free(env);
+  }
+}
+
+static void global_init() {
+  JS_NewClassID(&function_class_id);
+  JS_NewClassID(&native_class_id);
+}
+
+static veil_addon_env_t* get_env(veil_vm_t* vm) {
+  veil_addon_env_t* env = vm->addons;
+  JSValue symbol_ctor;
+  JSValue description;
+  JSValue global;
+  JSValue key;
+
+  if (env) {
+    return env;
+  }
+
+  env = calloc(1, sizeof(veil_addon_env_t));
+  CHECK_NOT_NULL(env);
+  env->vm = vm;
+  env->ctx = vm->context;
+  env->refs.next = &env->refs;
+  env->refs.prev = &env->refs;
+
+  // a symbol keeps the wrapped data out of string-keyed reflection
+  global = JS_GetGlobalObject(vm->context);
+  symbol_ctor = JS_GetPropertyStr(vm->context, global, "Symbol");
+  description = JS_NewString(vm->context, "veil.addon.wrap");
+  key = JS_Call(vm->context, symbol_ctor, JS_UNDEFINED, 1, &description);
+  env->wrap_key = JS_ValueToAtom(vm->context, key);
+  CHECK_TRUE(env->wrap_key != JS_ATOM_NULL);
+  JS_FreeValue(vm->context, key);
+  JS_FreeValue(vm->context, description);
+  JS_FreeValue(vm->context, symbol_ctor);
+  JS_FreeValue(vm->context, global);
+
+  vm->addons = env;
+
+  return env;
+}
+
+static void scope_open(veil_addon_env_t* env, addon_scope_t* scope) {
+  scope->top = env->handle_count;
+  scope->pending = env->pending;
+  env->pending = false;
+}
+
+// Takes the call's result out of its handles before releasing them, or
+// JS_EXCEPTION with the exception still set when one is pending.
+static JSValue scope_close(veil_addon_env_t* env, addon_scope_t* scope, veil_addon_value_t result) {
+  JSValue value = env->pending ? JS_EXCEPTION : result ? JS_DupValue(env->ctx, to_js(env, result)) : JS_UNDEFINED;
+
+  while (env->handle_count > scope->top) {
+    JS_FreeValue(env->ctx, env->handles[--env->handle_count]);
+  }
+  env->pending = scope->pending;
+
+  return value;
+}
+
+static veil_addon_value_t new_handle(veil_addon_env_t* env, JSValue value) {
+  if (env->handle_count == env->handle_capacity) {
+    env->handle_capacity = env->handle_capacity ? env->handle_capacity * 2 : 64;
+    env->handles = realloc(env->handles, env->handle_capacity * sizeof(JSValue));
+    CHECK_NOT_NULL(env->handles);
+  }
+
+  env->handles[env->handle_count++] = value;
+
+  return (veil_addon_value_t) (uintptr_t) env->handle_count;
+}
+
+// A stale or foreign handle reads as undefined rather than past the stack.
+static JSValueConst to_js(veil_addon_env_t* env, veil_addon_value_t value) {
+  uintptr_t index = (uintptr_t) value;
+
+  return index > 0 && index <= env->handle_count ? env->handles[index - 1] : JS_UNDEFINED;
+}
+
+static veil_addon_status_t set_result(veil_addon_env_t* env, JSValue value, veil_addon_value_t* result) {
+  if (JS_IsException(value)) {
+    return set_pending(env);
+  }
+
+  *result = new_handle(env, value);
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t set_pending(veil_addon_env_t* env) {
+  env->pending = true;
+
+  return VEIL_ADDON_PENDING_EXCEPTION;
+}
+
+static int module_init(JSContext* ctx, JSModuleDef* m) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  addon_module_t* module = vm->addons ? vm->addons->modules : NULL;
+
+  while (module && module->m != m) {
+    module = module->next;
+  }
+
+  if (!module) {
+    JS_ThrowInternalError(ctx, "addon module was released before it was linked");
+    return -1;
+  }
+
+  for (uint32_t n = 0; n < module->name_count; n++) {
+    const char* name = JS_AtomToCString(ctx, module->names[n].atom);
+
+    if (name && strcmp(name, "default") != 0) {
+      JS_SetModuleExport(ctx, m, name, JS_GetProperty(ctx, module->exports, module->names[n].atom));
+    }
+    JS_FreeCString(ctx, name);
+  }
+
+  JS_SetModuleExport(ctx, m, "default", module->exports);
+  module->exports = JS_UNDEFINED;
+
+  return 0;
+}
+
+static void module_free(JSContext* ctx, addon_module_t* module) {
+  JS_FreeValue(ctx, module->exports);
+  for (uint32_t n = 0; n < module->name_count; n++) {
+    JS_FreeAtom(ctx, module->names[n].atom);
+  }
+  js_free(ctx, module->names);
+  free(module);
+}
+
+static JSValue function_call(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic, JSValue* func_data) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  addon_function_t* fn = JS_GetOpaque(func_data[0], function_class_id);
+  veil_addon_env_t* env = vm->addons;
+  veil_addon_callback_info_t info;
+  addon_scope_t scope;
+
+  info.this_val = this_val;
+  info.argc = argc;
+  info.argv = argv;
+  info.data = fn->data;
+
+  scope_open(env, &scope);
+
+  return scope_close(env, &scope, fn->cb(env, &info));
+}
+
+static void function_finalizer(JSRuntime* rt, JSValue val) {
+  free(JS_GetOpaque(val, function_class_id));
+}
+
+static void native_finalizer(JSRuntime* rt, JSValue val) {
+  veil_vm_t* vm = JS_GetRuntimeOpaque(rt);
+  addon_native_t* native = JS_GetOpaque(val, native_class_id);
+
+  if (native) {
+    if (native->finalize) {
+      native->finalize(vm->addons, native->data, native->hint);
+    }
+    free(native);
+  }
+}
+
+static JSValue new_native(veil_addon_env_t* env, void* data, veil_addon_finalize_t finalize, void* hint) {
+  JSValue obj = JS_NewObjectClass(env->ctx, native_class_id);
+  addon_native_t* native;
+
+  if (JS_IsException(obj)) {
+    return obj;
+  }
+
+  native = malloc(sizeof(addon_native_t));
+  CHECK_NOT_NULL(native);
+  native->data = data;
+  native->finalize = finalize;
+  native->hint = hint;
+  JS_SetOpaque(obj, native);
+
+  return obj;
+}
+
+// handles stay put while a call runs, so the values are borrowed
+static JSValue* to_js_args(veil_addon_env_t* env, size_t argc, const veil_addon_value_t* argv) {
+  JSValue* args = malloc((argc ? argc : 1) * sizeof(JSValue));
+
+  CHECK_NOT_NULL(args);
+  for (size_t n = 0; n < argc; n++) {
+    args[n] = to_js(env, argv[n]);
+  }
+
+  return args;
+}
+
+// a NULL thrower throws a plain Error
+static veil_addon_status_t throw_kind(veil_addon_env_t* env, JSValue (*thrower)(JSContext*, const char*, ...), const char* code, const char* message) {
+  JSValue error;
+
+  ADDON_ARG(env && message);
+
+  if (thrower) {
+    thrower(env->ctx, "%s", message);
+  } else {
+    error = JS_NewError(env->ctx);
+    JS_DefinePropertyValueStr(env->ctx, error, "message", JS_NewString(env->ctx, message), JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+    JS_Throw(env->ctx, error);
+  }
+  if (code) {
+    error = JS_GetException(env->ctx);
+    JS_SetPropertyStr(env->ctx, error, "code", JS_NewString(env->ctx, code));
+    JS_Throw(env->ctx, error);
+  }
+  env->pending = true;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_undefined(veil_addon_env_t* env, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_UNDEFINED, result);
+}
+
+static veil_addon_status_t api_get_null(veil_addon_env_t* env, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NULL, result);
+}
+
+static veil_addon_status_t api_get_global(veil_addon_env_t* env, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_GetGlobalObject(env->ctx), result);
+}
+
+static veil_addon_status_t api_get_boolean(veil_addon_env_t* env, bool value, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewBool(env->ctx, value), result);
+}
+
+static veil_addon_status_t api_create_int32(veil_addon_env_t* env, int32_t value, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewInt32(env->ctx, value), result);
+}
+
+static veil_addon_status_t api_create_uint32(veil_addon_env_t* env, uint32_t value, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewUint32(env->ctx, value), result);
+}
+
+static veil_addon_status_t api_create_int64(veil_addon_env_t* env, int64_t value, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewInt64(env->ctx, value), result);
+}
+
+static veil_addon_status_t api_create_double(veil_addon_env_t* env, double value, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewFloat64(env->ctx, value), result);
+}
+
+static veil_addon_status_t api_create_bigint_int64(veil_addon_env_t* env, int64_t value, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewBigInt64(env->ctx, value), result);
+}
+
+static veil_addon_status_t api_create_string_utf8(veil_addon_env_t* env, const char* str, size_t length, veil_addon_value_t* result) {
+  ADDON_ARG(env && result && (str || length == 0));
+
+  if (length == VEIL_ADDON_AUTO_LENGTH) {
+    length = strlen(str);
+  }
+
+  return set_result(env, JS_NewStringLen(env->ctx, str ? str : "", length), result);
+}
+
+static veil_addon_status_t api_create_object(veil_addon_env_t* env, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewObject(env->ctx), result);
+}
+
+static veil_addon_status_t api_create_array(veil_addon_env_t* env, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, JS_NewArray(env->ctx), result);
+}
+
+static veil_addon_status_t api_create_function(veil_addon_env_t* env, const char* name, veil_addon_callback_t cb, void* data, veil_addon_value_t* result) {
+  addon_function_t* fn;
+  JSValue holder;
+  JSValue func;
+
+  ADDON_ARG(env && cb && result);
+
+  holder = JS_NewObjectClass(env->ctx, function_class_id);
+  if (JS_IsException(holder)) {
+    return set_pending(env);
+  }
+
+  fn = malloc(sizeof(addon_function_t));
+  CHECK_NOT_NULL(fn);
+  fn->cb = cb;
+  fn->data = data;
+  JS_SetOpaque(holder, fn);
+
+  func = JS_NewCFunctionData(env->ctx, function_call, 0, 0, 1, &holder);
+  JS_FreeValue(env->ctx, holder);
+  if (!JS_IsException(func) && name) {
+    JS_DefinePropertyValueStr(env->ctx, func, "name", JS_NewString(env->ctx, name), JS_PROP_CONFIGURABLE);
+  }
+
+  return set_result(env, func, result);
+}
+
+static veil_addon_status_t api_create_external(veil_addon_env_t* env, void* data, veil_addon_finalize_t finalize, void* hint, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  return set_result(env, new_native(env, data, finalize, hint), result);
+}
+
+static veil_addon_status_t api_create_buffer(veil_addon_env_t* env, size_t size, void** data, veil_addon_value_t* result) {
+  uint8_t* bytes;
+  JSValue buffer;
+
+  ADDON_ARG(env && result);
+
+  bytes = malloc(size ? size : 1);
+  CHECK_NOT_NULL(bytes);
+
+  // takes the bytes, freeing them on failure
+  buffer = veil_buffer_new(env->ctx, bytes, size);
+  if (JS_IsException(buffer)) {
+    return set_pending(env);
+  }
+
+  if (data) {
+    *data = bytes;
+  }
+
+  return set_result(env, buffer, result);
+}
+
+static veil_addon_status_t api_create_buffer_copy(veil_addon_env_t* env, const void* src, size_t size, void** data, veil_addon_value_t* result) {
+  void* bytes;
+  veil_addon_status_t status;
+
+  ADDON_ARG(src || size == 0);
+
+  status = api_create_buffer(env, size, &bytes, result);
+  if (status == VEIL_ADDON_OK) {
+    if (size) {
+      memcpy(bytes, src, size);
+    }
+    if (data) {
+      *data = bytes;
+    }
+  }
+
+  return status;
+}
+
+static veil_addon_status_t api_type_of(veil_addon_env_t* env, veil_addon_value_t value, veil_addon_type_t* result) {
+  JSValueConst v;
+
+  ADDON_ARG(env && result);
+
+  v = to_js(env, value);
+  if (JS_IsUndefined(v)) {
+    *result = VEIL_ADDON_UNDEFINED;
+  } else if (JS_IsNull(v)) {
+    *result = VEIL_ADDON_NULL;
+  } else if (JS_IsBool(v)) {
+    *result = VEIL_ADDON_BOOLEAN;
+  } else if (JS_IsNumber(v)) {
+    *result = VEIL_ADDON_NUMBER;
+  } else if (JS_IsString(v)) {
+    *result = VEIL_ADDON_STRING;
+  } else if (JS_IsSymbol(v)) {
+    *result = VEIL_ADDON_SYMBOL;
+  } else if (JS_IsBigInt(env->ctx, v)) {
+    *result = VEIL_ADDON_BIGINT;
+  } else if (JS_IsFunction(env->ctx, v)) {
+    *result = VEIL_ADDON_FUNCTION;
+  } else if (JS_GetOpaque(v, native_class_id)) {
+    *result = VEIL_ADDON_EXTERNAL;
+  } else {
+    *result = VEIL_ADDON_OBJECT;
+  }
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_is_array(veil_addon_env_t* env, veil_addon_value_t value, bool* result) {
+  int is_array;
+
+  ADDON_ARG(env && result);
+
+  // a revoked proxy throws
+  is_array = JS_IsArray(env->ctx, to_js(env, value));
+  if (is_array < 0) {
+    return set_pending(env);
+  }
+  *result = is_array;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_value_bool(veil_addon_env_t* env, veil_addon_value_t value, bool* result) {
+  JSValueConst v;
+
+  ADDON_ARG(env && result);
+
+  v = to_js(env, value);
+  if (!JS_IsBool(v)) {
+    return VEIL_ADDON_BOOLEAN_EXPECTED;
+  }
+  *result = JS_VALUE_GET_BOOL(v);
+
+  return VEIL_ADDON_OK;
+}
+
+// Numbers convert without running JS, so these cannot leave an exception.
+static veil_addon_status_t api_get_value_int32(veil_addon_env_t* env, veil_addon_value_t value, int32_t* result) {
+  JSValueConst v;
+
+  ADDON_ARG(env && result);
+
+  v = to_js(env, value);
+  if (!JS_IsNumber(v)) {
+    return VEIL_ADDON_NUMBER_EXPECTED;
+  }
+  JS_ToInt32(env->ctx, result, v);
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_value_uint32(veil_addon_env_t* env, veil_addon_value_t value, uint32_t* result) {
+  int32_t i;
+  veil_addon_status_t status = api_get_value_int32(env, value, &i);
+
+  if (status == VEIL_ADDON_OK) {
+    *result = (uint32_t) i;
+  }
+
+  return status;
+}
+
+static veil_addon_status_t api_get_value_int64(veil_addon_env_t* env, veil_addon_value_t value, int64_t* result) {
+  JSValueConst v;
+
+  ADDON_ARG(env && result);
+
+  v = to_js(env, value);
+  if (!JS_IsNumber(v)) {
+    return VEIL_ADDON_NUMBER_EXPECTED;
+  }
+  JS_ToInt64(env->ctx, result, v);
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_value_double(veil_addon_env_t* env, veil_addon_value_t value, double* result) {
+  JSValueConst v;
+
+  ADDON_ARG(env && result);
+
+  v = to_js(env, value);
+  if (!JS_IsNumber(v)) {
+    return VEIL_ADDON_NUMBER_EXPECTED;
+  }
+  JS_ToFloat64(env->ctx, result, v);
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_value_bigint_int64(veil_addon_env_t* env, veil_addon_value_t value, int64_t* result) {
+  JSValueConst v;
+
+  ADDON_ARG(env && result);
+
+  v = to_js(env, value);
+  if (!JS_IsBigInt(env->ctx, v)) {
+    return VEIL_ADDON_BIGINT_EXPECTED;
+  }
+  JS_ToBigInt64(env->ctx, result, v);
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_value_string_utf8(veil_addon_env_t* env, veil_addon_value_t value, char* buf, size_t bufsize, size_t* result) {
+  const char* str;
+  size_t len;
+  JSValueConst v;
+
+  ADDON_ARG(env && (buf || result));
+
+  v = to_js(env, value);
+  if (!JS_IsString(v)) {
+    return VEIL_ADDON_STRING_EXPECTED;
+  }
+
+  str = JS_ToCStringLen(env->ctx, &len, v);
+  if (!str) {
+    return set_pending(env);
+  }
+
+  if (buf) {
+    // never split a UTF-8 sequence
+    if (len > (bufsize ? bufsize - 1 : 0)) {
+      len = bufsize ? bufsize - 1 : 0;
+      while (len > 0 && ((uint8_t) str[len] & 0xC0) == 0x80) {
+        len--;
+      }
+    }
+    if (bufsize) {
+      memcpy(buf, str, len);
+      buf[len] = '\0';
+    }
+  }
+  if (result) {
+    *result = len;
+  }
+  JS_FreeCString(env->ctx, str);
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_value_external(veil_addon_env_t* env, veil_addon_value_t value, void** result) {
+  addon_native_t* native;
+
+  ADDON_ARG(env && result);
+
+  native = JS_GetOpaque(to_js(env, value), native_class_id);
+  if (!native) {
+    return VEIL_ADDON_INVALID_ARG;
+  }
+  *result = native->data;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_buffer_info(veil_addon_env_t* env, veil_addon_value_t value, void** data, size_t* size) {
+  uint8_t* bytes;
+  size_t length;
+
+  ADDON_ARG(env);
+
+  if (!veil_builtin_get_bytes(env->ctx, to_js(env, value), &bytes, &length)) {
+    JS_FreeValue(env->ctx, JS_GetException(env->ctx));
+    return VEIL_ADDON_BUFFER_EXPECTED;
+  }
+
+  if (data) {
+    *data = bytes;
+  }
+  if (size) {
+    *size = length;
+  }
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_property(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, veil_addon_value_t* result) {
+  JSValue value;
+  JSAtom atom;
+
+  ADDON_ARG(env && result);
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsObject(to_js(env, object))) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  atom = JS_ValueToAtom(env->ctx, to_js(env, key));
+  if (atom == JS_ATOM_NULL) {
+    return set_pending(env);
+  }
+  value = JS_GetProperty(env->ctx, to_js(env, object), atom);
+  JS_FreeAtom(env->ctx, atom);
+
+  return set_result(env, value, result);
+}
+
+static veil_addon_status_t api_set_property(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, veil_addon_value_t value) {
+  JSAtom atom;
+  int ret;
+
+  ADDON_ARG(env);
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsObject(to_js(env, object))) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  atom = JS_ValueToAtom(env->ctx, to_js(env, key));
+  if (atom == JS_ATOM_NULL) {
+    return set_pending(env);
+  }
+  ret = JS_SetProperty(env->ctx, to_js(env, object), atom, JS_DupValue(env->ctx, to_js(env, value)));
+  JS_FreeAtom(env->ctx, atom);
+
+  return ret < 0 ? set_pending(env) : VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_has_property(veil_addon_env_t* env, veil_addon_value_t object, veil_addon_value_t key, bool* result) {
+  JSAtom atom;
+  int ret;
+
+  ADDON_ARG(env && result);
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsObject(to_js(env, object))) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  atom = JS_ValueToAtom(env->ctx, to_js(env, key));
+  if (atom == JS_ATOM_NULL) {
+    return set_pending(env);
+  }
+  ret = JS_HasProperty(env->ctx, to_js(env, object), atom);
+  JS_FreeAtom(env->ctx, atom);
+
+  if (ret < 0) {
+    return set_pending(env);
+  }
+  *result = ret;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_named_property(veil_addon_env_t* env, veil_addon_value_t object, const char* name, veil_addon_value_t* result) {
+  ADDON_ARG(env && name && result);
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsObject(to_js(env, object))) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  return set_result(env, JS_GetPropertyStr(env->ctx, to_js(env, object), name), result);
+}
+
+static veil_addon_status_t api_set_named_property(veil_addon_env_t* env, veil_addon_value_t object, const char* name, veil_addon_value_t value) {
+  ADDON_ARG(env && name);
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsObject(to_js(env, object))) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  if (JS_SetPropertyStr(env->ctx, to_js(env, object), name, JS_DupValue(env->ctx, to_js(env, value))) < 0) {
+    return set_pending(env);
+  }
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_element(veil_addon_env_t* env, veil_addon_value_t object, uint32_t index, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsObject(to_js(env, object))) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  return set_result(env, JS_GetPropertyUint32(env->ctx, to_js(env, object), index), result);
+}
+
+static veil_addon_status_t api_set_element(veil_addon_env_t* env, veil_addon_value_t object, uint32_t index, veil_addon_value_t value) {
+  ADDON_ARG(env);
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsObject(to_js(env, object))) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  if (JS_SetPropertyUint32(env->ctx, to_js(env, object), index, JS_DupValue(env->ctx, to_js(env, value))) < 0) {
+    return set_pending(env);
+  }
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_array_length(veil_addon_env_t* env, veil_addon_value_t value, uint32_t* result) {
+  JSValue length;
+  int ret;
+
+  ADDON_ARG(env && result);
+
+  if (JS_IsArray(env->ctx, to_js(env, value)) != 1) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  length = JS_GetPropertyStr(env->ctx, to_js(env, value), "length");
+  ret = JS_ToUint32(env->ctx, result, length);
+  JS_FreeValue(env->ctx, length);
+
+  return ret < 0 ? set_pending(env) : VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_cb_info(veil_addon_env_t* env, veil_addon_callback_info_t* info, size_t* argc, veil_addon_value_t* argv, veil_addon_value_t* this_arg, void** data) {
+  ADDON_ARG(env && info && (argc || !argv));
+
+  if (argv) {
+    for (size_t n = 0; n < *argc; n++) {
+      argv[n] = new_handle(env, n < (size_t) info->argc ? JS_DupValue(env->ctx, info->argv[n]) : JS_UNDEFINED);
+    }
+  }
+  if (argc) {
+    *argc = info->argc;
+  }
+  if (this_arg) {
+    *this_arg = new_handle(env, JS_DupValue(env->ctx, info->this_val));
+  }
+  if (data) {
+    *data = info->data;
+  }
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_call_function(veil_addon_env_t* env, veil_addon_value_t recv, veil_addon_value_t func, size_t argc, const veil_addon_value_t* argv, veil_addon_value_t* result) {
+  JSValue* args;
+  JSValue value;
+
+  ADDON_ARG(env && (argv || argc == 0));
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsFunction(env->ctx, to_js(env, func))) {
+    return VEIL_ADDON_FUNCTION_EXPECTED;
+  }
+
+  args = to_js_args(env, argc, argv);
+  value = JS_Call(env->ctx, to_js(env, func), to_js(env, recv), (int) argc, args);
+  free(args);
+
+  if (!result && !JS_IsException(value)) {
+    JS_FreeValue(env->ctx, value);
+    return VEIL_ADDON_OK;
+  }
+
+  return result ? set_result(env, value, result) : set_pending(env);
+}
+
+static veil_addon_status_t api_new_instance(veil_addon_env_t* env, veil_addon_value_t constructor, size_t argc, const veil_addon_value_t* argv, veil_addon_value_t* result) {
+  JSValue* args;
+  JSValue value;
+
+  ADDON_ARG(env && result && (argv || argc == 0));
+
+  if (env->pending) {
+    return VEIL_ADDON_PENDING_EXCEPTION;
+  }
+
+  if (!JS_IsConstructor(env->ctx, to_js(env, constructor))) {
+    return VEIL_ADDON_FUNCTION_EXPECTED;
+  }
+
+  args = to_js_args(env, argc, argv);
+  value = JS_CallConstructor(env->ctx, to_js(env, constructor), (int) argc, args);
+  free(args);
+
+  return set_result(env, value, result);
+}
+
+static veil_addon_status_t api_wrap(veil_addon_env_t* env, veil_addon_value_t object, void* data, veil_addon_finalize_t finalize, void* hint) {
+  JSValueConst obj;
+  JSValue native;
+
+  ADDON_ARG(env);
+
+  obj = to_js(env, object);
+  if (!JS_IsObject(obj)) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  native = new_native(env, data, finalize, hint);
+  if (JS_IsException(native)) {
+    return set_pending(env);
+  }
+
+  // not configurable, so an object is wrapped at most once
+  if (JS_DefinePropertyValue(env->ctx, obj, env->wrap_key, native, JS_PROP_THROW) < 0) {
+    return set_pending(env);
+  }
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_unwrap(veil_addon_env_t* env, veil_addon_value_t object, void** result) {
+  addon_native_t* native = NULL;
+  JSPropertyDescriptor desc;
+  JSValueConst obj;
+  int ret;
+
+  ADDON_ARG(env && result);
+
+  obj = to_js(env, object);
+  if (!JS_IsObject(obj)) {
+    return VEIL_ADDON_OBJECT_EXPECTED;
+  }
+
+  // own only: an object whose prototype is wrapped is not itself
+  ret = JS_GetOwnProperty(env->ctx, &desc, obj, env->wrap_key);
+  if (ret < 0) {
+    return set_pending(env);
+  }
+  if (ret > 0) {
+    native = JS_GetOpaque(desc.value, native_class_id);
+    JS_FreeValue(env->ctx, desc.value);
+    JS_FreeValue(env->ctx, desc.getter);
+    JS_FreeValue(env->ctx, desc.setter);
+  }
+  if (!native) {
+    return VEIL_ADDON_INVALID_ARG;
+  }
+  *result = native->data;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_create_reference(veil_addon_env_t* env, veil_addon_value_t value, veil_addon_ref_t* result) {
+  veil_addon_ref_t ref;
+
+  ADDON_ARG(env && result);
+
+  ref = malloc(sizeof(struct veil_addon_ref_s));
+  CHECK_NOT_NULL(ref);
+  ref->value = JS_DupValue(env->ctx, to_js(env, value));
+  ref->next = env->refs.next;
+  ref->prev = &env->refs;
+  env->refs.next->prev = ref;
+  env->refs.next = ref;
+  *result = ref;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_delete_reference(veil_addon_env_t* env, veil_addon_ref_t ref) {
+  ADDON_ARG(env && ref);
+
+  ref->prev->next = ref->next;
+  ref->next->prev = ref->prev;
+  JS_FreeValue(env->ctx, ref->value);
+  free(ref);
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_reference_value(veil_addon_env_t* env, veil_addon_ref_t ref, veil_addon_value_t* result) {
+  ADDON_ARG(env && ref && result);
+
+  return set_result(env, JS_DupValue(env->ctx, ref->value), result);
+}
+
+static veil_addon_status_t api_throw_value(veil_addon_env_t* env, veil_addon_value_t error) {
+  ADDON_ARG(env);
+
+  JS_Throw(env->ctx, JS_DupValue(env->ctx, to_js(env, error)));
+  env->pending = true;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_throw_error(veil_addon_env_t* env, const char* code, const char* message) {
+  return throw_kind(env, NULL, code, message);
+}
+
+static veil_addon_status_t api_throw_type_error(veil_addon_env_t* env, const char* code, const char* message) {
+  return throw_kind(env, JS_ThrowTypeError, code, message);
+}
+
+static veil_addon_status_t api_throw_range_error(veil_addon_env_t* env, const char* code, const char* message) {
+  return throw_kind(env, JS_ThrowRangeError, code, message);
+}
+
+static veil_addon_status_t api_is_exception_pending(veil_addon_env_t* env, bool* result) {
+  ADDON_ARG(env && result);
+
+  *result = env->pending;
+
+  return VEIL_ADDON_OK;
+}
+
+static veil_addon_status_t api_get_and_clear_last_exception(veil_addon_env_t* env, veil_addon_value_t* result) {
+  ADDON_ARG(env && result);
+
+  if (!env->pending) {
+    return api_get_undefined(env, result);
+  }
+
+  env->pending = false;
+  *result = new_handle(env, JS_GetException(env->ctx));
+
+  return VEIL_ADDON_OK;
+}
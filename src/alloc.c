@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#elif defined(__linux__)
+#include <malloc.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef VEIL_HAVE_MIMALLOC
+#include <mimalloc.h>
+#endif
+
+#ifdef VEIL_HAVE_JEMALLOC
+#include <jemalloc/jemalloc.h>
+#endif
+
+// matches the per-allocation overhead QuickJS assumes for its own accounting
+#define MALLOC_OVERHEAD 8
+
+// Pooled blocks carry no header. Every runtime's pages come out of one range
+// of address space reserved up front, so a pointer inside it is a pooled
+// block whose page header, and with it the size class, sits at the
+// page-aligned address below. Anything outside the range came from malloc.
+#define POOL_PAGE_SIZE (64 * 1024)
+#define POOL_PAGE_HEADER_SIZE 64
+#define POOL_MAX_SIZE 512
+#define POOL_REGION_SIZE (sizeof(void*) >= 8 ? ((size_t) 32 << 30) : ((size_t) 512 << 20))
+
+typedef struct pool_link_s {
+  struct pool_link_s* next;
+} pool_link_t;
+
+typedef struct pool_page_s pool_page_t;
+
+struct pool_page_s {
+  // the runtime's pages of this class with a free block
+  pool_page_t* next;
+  pool_page_t* prev;
+  // all of the runtime's pages
+  pool_page_t* next_owned;
+  pool_page_t* prev_owned;
+  pool_link_t* free;
+  uint8_t* bump;
+  uint32_t size_class;
+  uint32_t used;
+  bool listed;
+};
+
+static const uint32_t SIZE_CLASSES[VEIL_POOL_CLASS_COUNT] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+};
+
+static uint8_t class_lookup[(POOL_MAX_SIZE >> 4) + 1];
+static uv_once_t pool_once = UV_ONCE_INIT;
+
+// shared by every runtime on the pool allocator; pages are handed out and
+// taken back under the mutex, and blocks within them by their runtime alone
+static uv_mutex_t region_mutex;
+static uint8_t* region_start;
+static uint8_t* region_end;
+static uint8_t* region_bump;
+static pool_page_t* region_free_pages;
+static size_t os_page_size;
+
+static void pool_init();
+static bool check_limit(JSMallocState* s, size_t size);
+
+static pool_page_t* page_acquire(veil_alloc_t* alloc, uint32_t size_class);
+static void page_release(veil_alloc_t* alloc, pool_page_t* page);
+static void page_list(veil_alloc_t* alloc, pool_page_t* page);
+static void page_unlist(veil_alloc_t* alloc, pool_page_t* page);
+static bool page_full(const pool_page_t* page);
+static bool region_commit(uint8_t* page);
+static void region_decommit(uint8_t* page);
+
+static void* sys_malloc(JSMallocState* s, size_t size);
+static void sys_free(JSMallocState* s, void* ptr);
+static void* sys_realloc(JSMallocState* s, void* ptr, size_t size);
+static size_t sys_usable_size(const void* ptr);
+
+static void* pool_malloc(JSMallocState* s, size_t size);
+static void pool_free(JSMallocState* s, void* ptr);
+static void* pool_realloc(JSMallocState* s, void* ptr, size_t size);
+static size_t pool_usable_size(const void* ptr);
+
+#ifdef VEIL_HAVE_MIMALLOC
+static void* mi_js_malloc(JSMallocState* s, size_t size);
+static void mi_js_free(JSMallocState* s, void* ptr);
+static void* mi_js_realloc(JSMallocState* s, void* ptr, size_t size);
+static size_t mi_js_usable_size(const void* ptr);
+#endif
+
+#ifdef VEIL_HAVE_JEMALLOC
+static void* je_js_malloc(JSMallocState* s, size_t size);
+static void je_js_free(JSMallocState* s, void* ptr);
+static void* je_js_realloc(JSMallocState* s, void* ptr, size_t size);
+static size_t je_js_usable_size(const void* ptr);
+#endif
+
+static const JSMallocFunctions SYSTEM_FUNCTIONS = {
+  sys_malloc,
+  sys_free,
+  sys_realloc,
+  sys_usable_size,
+};
+
+static const JSMallocFunctions POOL_FUNCTIONS = {
+  pool_malloc,
+  pool_free,
+  pool_realloc,
+  pool_usable_size,
+};
+
+#ifdef VEIL_HAVE_MIMALLOC
+static const JSMallocFunctions MIMALLOC_FUNCTIONS = {
+  mi_js_malloc,
+  mi_js_free,
+  mi_js_realloc,
+  mi_js_usable_size,
+};
+#endif
+
+#ifdef VEIL_HAVE_JEMALLOC
+static const JSMallocFunctions JEMALLOC_FUNCTIONS = {
+  je_js_malloc,
+  je_js_free,
+  je_js_realloc,
+  je_js_usable_size,
+};
+#endif
+
+bool veil_alloc_available(veil_allocator_t kind) {
+  switch (kind) {
+    case VEIL_ALLOCATOR_SYSTEM:
+    case VEIL_ALLOCATOR_POOL:
+      return true;
+#ifdef VEIL_HAVE_MIMALLOC
+    case VEIL_ALLOCATOR_MIMALLOC:
+      return true;
+#endif
+#ifdef VEIL_HAVE_JEMALLOC
+    case VEIL_ALLOCATOR_JEMALLOC:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+void veil_alloc_init(veil_alloc_t* alloc, veil_allocator_t kind) {
+  memset(alloc, 0, sizeof(veil_alloc_t));
+  alloc->kind = veil_alloc_available(kind) ? kind : VEIL_ALLOCATOR_SYSTEM;
+
+  if (alloc->kind == VEIL_ALLOCATOR_POOL) {
+    uv_once(&pool_once, pool_init);
+  }
+}
+
+JSRuntime* veil_alloc_new_runtime(veil_alloc_t* alloc) {
+  const JSMallocFunctions* functions;
+  JSRuntime* rt;
+
+  switch (alloc->kind) {
+    case VEIL_ALLOCATOR_POOL:
+      functions = &POOL_FUNCTIONS;
+      break;
+#ifdef VEIL_HAVE_MIMALLOC
+    case VEIL_ALLOCATOR_MIMALLOC:
+      functions = &MIMALLOC_FUNCTIONS;
+      break;
+#endif
+#ifdef VEIL_HAVE_JEMALLOC
+    case VEIL_ALLOCATOR_JEMALLOC:
+      functions = &JEMALLOC_FUNCTIONS;
+      break;
+#endif
+    default:
+      functions = &SYSTEM_FUNCTIONS;
+      break;
+  }
+
+  rt = JS_NewRuntime2(functions, alloc);
+
+  if (rt) {
+    // the runtime struct itself is allocated against a temporary state on
+    // JS_NewRuntime2's stack; one more allocation latches the real one
+    js_free_rt(rt, js_malloc_rt(rt, 1));
+  }
+
+  return rt;
+}
+
+size_t veil_alloc_heap_size(const veil_alloc_t* alloc) {
+  return alloc->state ? alloc->state->malloc_size : 0;
+}
+
+void veil_alloc_drop(veil_alloc_t* alloc) {
+  // JS_FreeRuntime has freed every object; the pages it kept go back now
+  while (alloc->owned) {
+    page_release(alloc, alloc->owned);
+  }
+
+  memset(alloc->pages, 0, sizeof(alloc->pages));
+  alloc->state = NULL;
+}
+
+static void pool_init() {
+  uint32_t size_class = 0;
+  uint8_t* reserved;
+#ifdef _WIN32
+  SYSTEM_INFO info;
+#endif
+
+  for (uint32_t n = 0; n < countof(class_lookup); n++) {
+    while (SIZE_CLASSES[size_class] < (n << 4)) {
+      size_class++;
+    }
+    class_lookup[n] = size_class;
+  }
+
+  CHECK_OK(uv_mutex_init(&region_mutex));
+
+  // address space only; pages are committed as runtimes take them
+#ifdef _WIN32
+  GetSystemInfo(&info);
+  os_page_size = info.dwPageSize;
+  reserved = VirtualAlloc(NULL, POOL_REGION_SIZE + POOL_PAGE_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  os_page_size = (size_t) sysconf(_SC_PAGESIZE);
+  reserved = mmap(NULL, POOL_REGION_SIZE + POOL_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    reserved = NULL;
+  }
+#endif
+
+  // without it every block comes from malloc, as with the system allocator
+  if (reserved) {
+    region_start = (uint8_t*) (((uintptr_t) reserved + POOL_PAGE_SIZE - 1) & ~((uintptr_t) POOL_PAGE_SIZE - 1));
+    region_end = region_start + POOL_REGION_SIZE;
+    region_bump = region_start;
+  }
+}
+
+static bool check_limit(JSMallocState* s, size_t size) {
+  return s->malloc_size + size <= s->malloc_limit;
+}
+
+static void* sys_malloc(JSMallocState* s, size_t size) {
+  void* ptr;
+
+  ((veil_alloc_t*) s->opaque)->state = s;
+
+  if (!check_limit(s, size) || !(ptr = malloc(size))) {
+    return NULL;
+  }
+
+  s->malloc_count++;
+  s->malloc_size += sys_usable_size(ptr) + MALLOC_OVERHEAD;
+
+  return ptr;
+}
+
+static void sys_free(JSMallocState* s, void* ptr) {
+  if (ptr) {
+    s->malloc_count--;
+    s->malloc_size -= sys_usable_size(ptr) + MALLOC_OVERHEAD;
+    free(ptr);
+  }
+}
+
+static void* sys_realloc(JSMallocState* s, void* ptr, size_t size) {
+  size_t old_size;
+
+  if (!ptr) {
+    return size ? sys_malloc(s, size) : NULL;
+  }
+
+  if (size == 0) {
+    sys_free(s, ptr);
+    return NULL;
+  }
+
+  old_size = sys_usable_size(ptr);
+  if (size > old_size && !check_limit(s, size - old_size)) {
+    return NULL;
+  }
+
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    return NULL;
+  }
+  s->malloc_size += sys_usable_size(ptr) - old_size;
+
+  return ptr;
+}
+
+static size_t sys_usable_size(const void* ptr) {
+#if defined(__APPLE__)
+  return malloc_size(ptr);
+#elif defined(_WIN32)
+  return _msize((void*) ptr);
+#elif defined(__linux__)
+  return malloc_usable_size((void*) ptr);
+#else
+  return 0;
+#endif
+}
+
+static inline bool region_contains(const void* ptr) {
+  return (const uint8_t*) ptr >= region_start && (const uint8_t*) ptr < region_end;
+}
+
+static inline pool_page_t* page_of(const void* ptr) {
+  return (pool_page_t*) ((uintptr_t) ptr & ~((uintptr_t) POOL_PAGE_SIZE - 1));
+}
+
+// malloc_size is charged a whole page as it is taken and credited as it goes
+// back, so --max-heap-size and the adaptive GC see the memory actually held
+static void* pool_malloc(JSMallocState* s, size_t size) {
+  veil_alloc_t* alloc = s->opaque;
+  pool_page_t* page;
+  pool_link_t* block;
+  uint32_t size_class;
+
+  alloc->state = s;
+
+  if (size > POOL_MAX_SIZE) {
+    return sys_malloc(s, size);
+  }
+
+  size_class = class_lookup[(size + 15) >> 4];
+  page = alloc->pages[size_class];
+
+  if (!page) {
+    if (!check_limit(s, POOL_PAGE_SIZE)) {
+      return NULL;
+    }
+
+    page = page_acquire(alloc, size_class);
+    if (!page) {
+      return sys_malloc(s, size);
+    }
+    s->malloc_size += POOL_PAGE_SIZE;
+  }
+
+  if (page->free) {
+    block = page->free;
+    page->free = block->next;
+  } else {
+    block = (pool_link_t*) page->bump;
+    page->bump += SIZE_CLASSES[size_class];
+  }
+
+  page->used++;
+  if (page_full(page)) {
+    page_unlist(alloc, page);
+  }
+
+  s->malloc_count++;
+
+  return block;
+}
+
+static void pool_free(JSMallocState* s, void* ptr) {
+  veil_alloc_t* alloc = s->opaque;
+  pool_page_t* page;
+  pool_link_t* block = ptr;
+
+  if (!region_contains(ptr)) {
+    sys_free(s, ptr);
+    return;
+  }
+
+  page = page_of(ptr);
+  block->next = page->free;
+  page->free = block;
+  page->used--;
+  s->malloc_count--;
+
+  if (!page->listed) {
+    page_list(alloc, page);
+  }
+
+  // an empty page goes back unless it is the last of its class with room,
+  // which stays to absorb alloc/free churn
+  if (page->used == 0 && (page->next || page->prev)) {
+    page_release(alloc, page);
+    s->malloc_size -= POOL_PAGE_SIZE;
+  }
+}
+
+static void* pool_realloc(JSMallocState* s, void* ptr, size_t size) {
+  size_t old_size;
+  void* next;
+
+  if (!ptr) {
+    return size ? pool_malloc(s, size) : NULL;
+  }
+
+  if (size == 0) {
+    pool_free(s, ptr);
+    return NULL;
+  }
+
+  if (!region_contains(ptr)) {
+    return sys_realloc(s, ptr, size);
+  }
+
+  // shrinking, or growing within the block's size class, is free
+  old_size = SIZE_CLASSES[page_of(ptr)->size_class];
+  if (size <= old_size) {
+    return ptr;
+  }
+
+  next = pool_malloc(s, size);
+  if (!next) {
+    return NULL;
+  }
+  memcpy(next, ptr, old_size);
+  pool_free(s, ptr);
+
+  return next;
+}
+
+static size_t pool_usable_size(const void* ptr) {
+  if (!ptr) {
+    return 0;
+  }
+
+  return region_contains(ptr) ? SIZE_CLASSES[page_of(ptr)->size_class] : sys_usable_size(ptr);
+}
+
+static pool_page_t* page_acquire(veil_alloc_t* alloc, uint32_t size_class) {
+  pool_page_t* page = NULL;
+
+  uv_mutex_lock(&region_mutex);
+  if (region_free_pages) {
+    page = region_free_pages;
+    region_free_pages = page->next;
+  } else if (region_bump < region_end) {
+    page = (pool_page_t*) region_bump;
+    region_bump += POOL_PAGE_SIZE;
+  }
+  uv_mutex_unlock(&region_mutex);
+
+  if (!page) {
+    return NULL;
+  }
+
+  if (!region_commit((uint8_t*) page)) {
+    uv_mutex_lock(&region_mutex);
+    page->next = region_free_pages;
+    region_free_pages = page;
+    uv_mutex_unlock(&region_mutex);
+    return NULL;
+  }
+
+  memset(page, 0, sizeof(pool_page_t));
+  page->size_class = size_class;
+  page->bump = (uint8_t*) page + POOL_PAGE_HEADER_SIZE;
+
+  page->next_owned = alloc->owned;
+  if (alloc->owned) {
+    ((pool_page_t*) alloc->owned)->prev_owned = page;
+  }
+  alloc->owned = page;
+
+  page_list(alloc, page);
+
+  return page;
+}
+
+static void page_release(veil_alloc_t* alloc, pool_page_t* page) {
+  if (page->listed) {
+    page_unlist(alloc, page);
+  }
+
+  if (page->prev_owned) {
+    page->prev_owned->next_owned = page->next_owned;
+  } else {
+    alloc->owned = page->next_owned;
+  }
+  if (page->next_owned) {
+    page->next_owned->prev_owned = page->prev_owned;
+  }
+
+  region_decommit((uint8_t*) page);
+
+  uv_mutex_lock(&region_mutex);
+  page->next = region_free_pages;
+  region_free_pages = page;
+  uv_mutex_unlock(&region_mutex);
+}
+
+static void page_list(veil_alloc_t* alloc, pool_page_t* page) {
+  pool_page_t* head = alloc->pages[page->size_class];
+
+  page->prev = NULL;
+  page->next = head;
+  if (head) {
+    head->prev = page;
+  }
+  alloc->pages[page->size_class] = page;
+  page->listed = true;
+}
+
+static void page_unlist(veil_alloc_t* alloc, pool_page_t* page) {
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    alloc->pages[page->size_class] = page->next;
+  }
+  if (page->next) {
+    page->next->prev = page->prev;
+  }
+  page->next = NULL;
+  page->prev = NULL;
+  page->listed = false;
+}
+
+static bool page_full(const pool_page_t* page) {
+  return !page->free && page->bump + SIZE_CLASSES[page->size_class] > (const uint8_t*) page + POOL_PAGE_SIZE;
+}
+
+// Released pages keep their address and their first OS page, which holds the
+// header and the free page list link; the rest goes back to the OS.
+static bool region_commit(uint8_t* page) {
+#ifdef _WIN32
+  return VirtualAlloc(page, POOL_PAGE_SIZE, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+  return mprotect(page, POOL_PAGE_SIZE, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+static void region_decommit(uint8_t* page) {
+  if (os_page_size >= POOL_PAGE_SIZE) {
+    return;
+  }
+
+#if defined(_WIN32)
+  VirtualFree(page + os_page_size, POOL_PAGE_SIZE - os_page_size, MEM_DECOMMIT);
+#elif defined(__APPLE__)
+  madvise(page + os_page_size, POOL_PAGE_SIZE - os_page_size, MADV_FREE);
+#else
+  madvise(page + os_page_size, POOL_PAGE_SIZE - os_page_size, MADV_DONTNEED);
+#endif
+}
+
+#ifdef VEIL_HAVE_MIMALLOC
+static void* mi_js_malloc(JSMallocState* s, size_t size) {
+  void* ptr;
+
+  ((veil_alloc_t*) s->opaque)->state = s;
+
+  if (!check_limit(s, size) || !(ptr = mi_malloc(size))) {
+    return NULL;
+  }
+
+  s->malloc_count++;
+  s->malloc_size += mi_usable_size(ptr) + MALLOC_OVERHEAD;
+
+  return ptr;
+}
+
+static void mi_js_free(JSMallocState* s, void* ptr) {
+  if (ptr) {
+    s->malloc_count--;
+    s->malloc_size -= mi_usable_size(ptr) + MALLOC_OVERHEAD;
+    mi_free(ptr);
+  }
+}
+
+static void* mi_js_realloc(JSMallocState* s, void* ptr, size_t size) {
+  size_t old_size;
+
+  if (!ptr) {
+    return size ? mi_js_malloc(s, size) : NULL;
+  }
+
+  if (size == 0) {
+    mi_js_free(s, ptr);
+    return NULL;
+  }
+
+  old_size = mi_usable_size(ptr);
+  if (size > old_size && !check_limit(s, size - old_size)) {
+    return NULL;
+  }
+
+  ptr = mi_realloc(ptr, size);
+  if (!ptr) {
+    return NULL;
+  }
+  s->malloc_size += mi_usable_size(ptr) - old_size;
+
+  return ptr;
+}
+
+static size_t mi_js_usable_size(const void* ptr) {
+  return mi_usable_size(ptr);
+}
+#endif
+
+#ifdef VEIL_HAVE_JEMALLOC
+static void* je_js_malloc(JSMallocState* s, size_t size) {
+  void* ptr;
+
+  ((veil_alloc_t*) s->opaque)->state = s;
+
+  if (!check_limit(s, size) || !(ptr = mallocx(size, 0))) {
+    return NULL;
+  }
+
+  s->malloc_count++;
+  s->malloc_size += sallocx(ptr, 0) + MALLOC_OVERHEAD;
+
+  return ptr;
+}
+
+static void je_js_free(JSMallocState* s, void* ptr) {
+  if (ptr) {
+    s->malloc_count--;
+    s->malloc_size -= sallocx(ptr, 0) + MALLOC_OVERHEAD;
+    dallocx(ptr, 0);
+  }
+}
+
+static void* je_js_realloc(JSMallocState* s, void* ptr, size_t size) {
+  size_t old_size;
+
+  if (!ptr) {
+    return size ? je_js_malloc(s, size) : NULL;
+  }
+
+  if (size == 0) {
+    je_js_free(s, ptr);
+    return NULL;
+  }
+
+  old_size = sallocx(ptr, 0);
+  if (size > old_size && !check_limit(s, size - old_size)) {
+    return NULL;
+  }
+
+  ptr = rallocx(ptr, size, 0);
+  if (!ptr) {
+    return NULL;
+  }
+  s->malloc_size += sallocx(ptr, 0) - old_size;
+
+  return ptr;
+}
+
+static size_t je_js_usable_size(const void* ptr) {
+  return ptr ? sallocx((void*) ptr, 0) : 0;
+}
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+typedef JSModuleDef* (*builtin_init_cb)(JSContext* ctx, const char* name);
+
+typedef struct builtin_s {
+  const char* name;
+  builtin_init_cb init;
+} builtin_t;
+
+static const builtin_t BUILTINS[] = {
+    { "buffer", veil_buffer_init_module },
+    { "child_process", veil_child_process_init_module },
+    { "cluster", veil_cluster_init_module },
+    { "fs", veil_fs_init_module },
+    { "fs/promises", veil_fs_promises_init_module },
+    { "http", veil_http_init_module },
+    { "json", veil_json_init_module },
+    { "net", veil_net_init_module },
+    { "perf_hooks", veil_perf_hooks_init_module },
+    { "process", veil_process_init_module },
+    { "sea", veil_sea_init_module },
+    { "timers", veil_timers_init_module },
+    { "v8", veil_v8_init_module },
+    { "worker_threads", veil_worker_init_module },
+    { "zlib", veil_zlib_init_module },
+    {0}
+};
+
+static const builtin_t* find_builtin(const char* name);
+
+bool veil_builtin_exists(const char* name) {
+  return find_builtin(name) != NULL;
+}
+
+JSModuleDef* veil_builtin_load(JSContext* ctx, const char* name) {
+  const builtin_t* builtin = find_builtin(name);
+
+  if (!builtin) {
+    JS_ThrowReferenceError(ctx, "unknown builtin module '%s'", name);
+    return NULL;
+  }
+
+  return builtin->init(ctx, name);
+}
+
+static const builtin_t* find_builtin(const char* name) {
+  if (strncmp(name, "node:", 5) == 0) {
+    name += 5;
+  }
+
+  for (const builtin_t* builtin = BUILTINS; builtin->name; builtin++) {
+    if (strcmp(builtin->name, name) == 0) {
+      return builtin;
+    }
+  }
+
+  return NULL;
+}
+
+// Node style error for a failed libuv call: message, code, errno, syscall and
+// optionally path.
+JSValue veil_builtin_new_uv_error(JSContext* ctx, int err, const char* syscall, const char* path) {
+  JSValue error = JS_NewError(ctx);
+  cstr message;
+
+  if (path && *path) {
+    message = cstr_from_fmt("%s: %s, %s '%s'", uv_err_name(err), uv_strerror(err), syscall, path);
+  } else {
+    message = cstr_from_fmt("%s: %s, %s", uv_err_name(err), uv_strerror(err), syscall);
+  }
+
+  JS_SetPropertyStr(ctx, error, "message", JS_NewStringLen(ctx, cstr_str(&message), cstr_size(&message)));
+  JS_SetPropertyStr(ctx, error, "errno", JS_NewInt32(ctx, err));
+  JS_SetPropertyStr(ctx, error, "code", JS_NewString(ctx, uv_err_name(err)));
+  JS_SetPropertyStr(ctx, error, "syscall", JS_NewString(ctx, syscall));
+  if (path && *path) {
+    JS_SetPropertyStr(ctx, error, "path", JS_NewString(ctx, path));
+  }
+  cstr_drop(&message);
+
+  return error;
+}
+
+// Borrows the bytes of an ArrayBuffer or typed array; the caller keeps value
+// alive for as long as it uses them.
+bool veil_builtin_get_bytes(JSContext* ctx, JSValueConst value, uint8_t** data, size_t* size) {
+  size_t offset;
+  size_t length;
+  JSValue buffer;
+
+  if (!JS_IsObject(value)) {
+    JS_ThrowTypeError(ctx, "expected an ArrayBuffer or a typed array");
+    return false;
+  }
+
+  buffer = JS_GetTypedArrayBuffer(ctx, value, &offset, &length, NULL);
+  if (!JS_IsException(buffer)) {
+    *data = JS_GetArrayBuffer(ctx, size, buffer);
+    JS_FreeValue(ctx, buffer);
+    if (!*data) {
+      return false;
+    }
+    *data += offset;
+    *size = length;
+    return true;
+  }
+  JS_FreeValue(ctx, JS_GetException(ctx));
+
+  *data = JS_GetArrayBuffer(ctx, size, value);
+  if (!*data) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    JS_ThrowTypeError(ctx, "expected an ArrayBuffer or a typed array");
+    return false;
+  }
+
+  return true;
+}
+
+// Wraps buffer, which is consumed, in a Uint8Array over all of it.
+JSValue veil_builtin_new_uint8_array(JSContext* ctx, JSValue buffer) {
+  JSValue global;
+  JSValue ctor;
+  JSValue array;
+
+  if (JS_IsException(buffer)) {
+    return buffer;
+  }
+
+  global = JS_GetGlobalObject(ctx);
+  ctor = JS_GetPropertyStr(ctx, global, "Uint8Array");
+  array = JS_CallConstructor(ctx, ctor, 1, (JSValueConst*) &buffer);
+  JS_FreeValue(ctx, ctor);
+  JS_FreeValue(ctx, global);
+  JS_FreeValue(ctx, buffer);
+
+  return array;
+}
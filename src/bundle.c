@@ -0,0 +1,672 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// A bundle is a header, module records (bytecode, or NUL terminated source),
+// resolution records and asset records, followed by a trailer holding the
+// bundle's size. The trailer lets a bundle be appended to the veil
+// executable: the loader maps the whole file and finds the bundle from its
+// end.
+
+#define BUNDLE_MAGIC "VEILBDL1"
+#define BUNDLE_TRAILER_MAGIC "VEILBDLE"
+#define BUNDLE_VERSION_SIZE 32
+
+#define BUNDLE_MODULE_ROOT 0x1
+#define BUNDLE_MODULE_ESM 0x2
+#define BUNDLE_MODULE_SOURCE 0x4
+
+typedef struct bundle_header_s {
+  char magic[8];
+  char qjs_version[BUNDLE_VERSION_SIZE];
+  uint32_t header_size;
+  uint32_t module_count;
+  uint32_t resolution_count;
+  uint32_t asset_count;
+} bundle_header_t;
+
+typedef struct bundle_module_header_s {
+  uint32_t flags;
+  uint32_t name_size;
+  uint64_t data_size;
+} bundle_module_header_t;
+
+typedef struct bundle_resolution_header_s {
+  uint32_t base_size;
+  uint32_t specifier_size;
+  uint32_t resolved_size;
+  uint32_t reserved;
+} bundle_resolution_header_t;
+
+typedef struct bundle_asset_header_s {
+  uint32_t name_size;
+  uint32_t reserved;
+  uint64_t data_size;
+} bundle_asset_header_t;
+
+typedef struct bundle_trailer_s {
+  uint64_t size;
+  char magic[8];
+} bundle_trailer_t;
+
+typedef struct bundle_blob_s {
+  uint32_t flags;
+  const uint8_t* data;
+  size_t size;
+} bundle_blob_t;
+
+typedef struct bundle_record_s {
+  uint32_t flags;
+  cstr name;
+  uint8_t* data;
+  size_t size;
+} bundle_record_t;
+
+#define i_type cmap_bundle
+#define i_key_str
+#define i_val bundle_blob_t
+#include <stc/cmap.h>
+
+#define i_type cmap_bundle_index
+#define i_key_str
+#define i_val uint32_t
+#include <stc/cmap.h>
+
+#define i_type cvec_bundle_record
+#define i_val bundle_record_t
+#define i_opt c_no_cmp
+#include <stc/cvec.h>
+
+#define i_val_str
+#define i_opt (c_no_cmp | c_is_fwd)
+#include <stc/cvec.h>
+
+struct veil_bundle_s {
+  veil_mmap_t map;
+  cmap_bundle modules;
+  cmap_bundle resolutions;
+  cmap_bundle assets;
+  cvec_str roots;
+};
+
+struct veil_bundle_builder_s {
+  uv_mutex_t mutex;
+  cvec_bundle_record modules;
+  cmap_bundle_index module_index;
+  cvec_bundle_record resolutions;
+  cmap_bundle_index resolution_index;
+  cvec_str assets;
+};
+
+static bool parse(veil_bundle_t* bundle, const uint8_t* cursor, const uint8_t* end);
+static bool read_trailer(const uint8_t* data, size_t size, const uint8_t** start);
+static void header_init(bundle_header_t* header, uint32_t module_count, uint32_t resolution_count, uint32_t asset_count);
+static void resolution_key(cstr* key, const char* base, size_t base_size, const char* specifier, size_t specifier_size);
+static bool write_records(uv_file fd, int64_t* offset, const cvec_bundle_record* records, bool resolutions);
+static bool write_bufs(uv_file fd, int64_t* offset, uv_buf_t* bufs, unsigned int count);
+static int module_init(JSContext* ctx, JSModuleDef* m);
+static JSValue is_sea(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue get_asset(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+bool veil_bundle_detect(const char* filename) {
+  bundle_trailer_t trailer;
+  uv_buf_t buf;
+  uv_fs_t req;
+  uv_file fd;
+  bool found = false;
+
+  // one small read, since every executable start asks
+  fd = uv_fs_open(NULL, &req, filename, UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    return false;
+  }
+
+  if (uv_fs_fstat(NULL, &req, fd, NULL) == 0 && req.statbuf.st_size >= sizeof(trailer)) {
+    int64_t offset = (int64_t) req.statbuf.st_size - (int64_t) sizeof(trailer);
+
+    uv_fs_req_cleanup(&req);
+    buf = uv_buf_init((char*) &trailer, sizeof(trailer));
+    found = uv_fs_read(NULL, &req, fd, &buf, 1, offset, NULL) == (int) sizeof(trailer)
+        && memcmp(trailer.magic, BUNDLE_TRAILER_MAGIC, sizeof(trailer.magic)) == 0;
+  }
+  uv_fs_req_cleanup(&req);
+
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+
+  return found;
+}
+
+veil_bundle_t* veil_bundle_open(const char* filename) {
+  veil_bundle_t* bundle = calloc(1, sizeof(veil_bundle_t));
+  const uint8_t* start;
+  const uint8_t* end;
+
+  CHECK_NOT_NULL(bundle);
+
+  bundle->modules = cmap_bundle_init();
+  bundle->resolutions = cmap_bundle_init();
+  bundle->assets = cmap_bundle_init();
+  bundle->roots = cvec_str_init();
+
+  if (!veil_mmap_open(&bundle->map, filename)) {
+    fprintf(stderr, "veil: could not open bundle '%s'\n", filename);
+    veil_bundle_close(bundle);
+    return NULL;
+  }
+
+  end = (const uint8_t*) bundle->map.data + bundle->map.size;
+  if (!read_trailer(bundle->map.data, bundle->map.size, &start) || !parse(bundle, start, end - sizeof(bundle_trailer_t))) {
+    fprintf(stderr, "veil: invalid bundle '%s'\n", filename);
+    veil_bundle_close(bundle);
+    return NULL;
+  }
+
+  return bundle;
+}
+
+void veil_bundle_close(veil_bundle_t* bundle) {
+  if (!bundle) {
+    return;
+  }
+
+  cmap_bundle_drop(&bundle->modules);
+  cmap_bundle_drop(&bundle->resolutions);
+  cmap_bundle_drop(&bundle->assets);
+  cvec_str_drop(&bundle->roots);
+  veil_mmap_close(&bundle->map);
+  free(bundle);
+}
+
+size_t veil_bundle_root_count(const veil_bundle_t* bundle) {
+  return cvec_str_size(&bundle->roots);
+}
+
+const char* veil_bundle_root(const veil_bundle_t* bundle, size_t index) {
+  return cstr_str(cvec_str_at(&bundle->roots, index));
+}
+
+JSValue veil_bundle_compile(veil_bundle_t* bundle, JSContext* ctx, const char* filename) {
+  const cmap_bundle_value* found = cmap_bundle_get(&bundle->modules, filename);
+  const bundle_blob_t* blob;
+  int eval_flags;
+
+  if (!found) {
+    return JS_UNDEFINED;
+  }
+
+  blob = &found->second;
+  if (!(blob->flags & BUNDLE_MODULE_SOURCE)) {
+    return JS_ReadObject(ctx, blob->data, blob->size, JS_READ_OBJ_BYTECODE);
+  }
+
+  eval_flags = (blob->flags & BUNDLE_MODULE_ESM) ? JS_EVAL_TYPE_MODULE : JS_EVAL_TYPE_GLOBAL;
+
+  return JS_Eval(ctx, (const char*) blob->data, blob->size, filename, eval_flags | JS_EVAL_FLAG_COMPILE_ONLY);
+}
+
+bool veil_bundle_contains(const veil_bundle_t* bundle, const char* filename) {
+  return cmap_bundle_contains(&bundle->modules, filename);
+}
+
+char* veil_bundle_resolve(veil_bundle_t* bundle, JSContext* ctx, const char* base, const char* specifier) {
+  const cmap_bundle_value* found;
+  cstr key = cstr_init();
+
+  resolution_key(&key, base, strlen(base), specifier, strlen(specifier));
+  found = cmap_bundle_get(&bundle->resolutions, cstr_str(&key));
+  cstr_drop(&key);
+
+  if (!found) {
+    // no filesystem fallback; the build run never saw this import
+    JS_ThrowReferenceError(ctx, "cannot find module '%s' imported from '%s' in bundle", specifier, base);
+    return NULL;
+  }
+
+  return js_strndup(ctx, (const char*) found->second.data, found->second.size);
+}
+
+bool veil_bundle_get_asset(const veil_bundle_t* bundle, const char* name, const uint8_t** data, size_t* size) {
+  const cmap_bundle_value* found = cmap_bundle_get(&bundle->assets, name);
+
+  if (!found) {
+    return false;
+  }
+
+  *data = found->second.data;
+  *size = found->second.size;
+
+  return true;
+}
+
+veil_bundle_builder_t* veil_bundle_builder_new() {
+  veil_bundle_builder_t* builder = calloc(1, sizeof(veil_bundle_builder_t));
+  CHECK_NOT_NULL(builder);
+
+  // workers record their modules too
+  CHECK_OK(uv_mutex_init(&builder->mutex));
+  builder->modules = cvec_bundle_record_init();
+  builder->module_index = cmap_bundle_index_init();
+  builder->resolutions = cvec_bundle_record_init();
+  builder->resolution_index = cmap_bundle_index_init();
+  builder->assets = cvec_str_init();
+
+  return builder;
+}
+
+void veil_bundle_builder_free(veil_bundle_builder_t* builder) {
+  if (!builder) {
+    return;
+  }
+
+  c_foreach (it, cvec_bundle_record, builder->modules) {
+    cstr_drop(&it.ref->name);
+    free(it.ref->data);
+  }
+  c_foreach (it, cvec_bundle_record, builder->resolutions) {
+    cstr_drop(&it.ref->name);
+    free(it.ref->data);
+  }
+  cvec_bundle_record_drop(&builder->modules);
+  cmap_bundle_index_drop(&builder->module_index);
+  cvec_bundle_record_drop(&builder->resolutions);
+  cmap_bundle_index_drop(&builder->resolution_index);
+  cvec_str_drop(&builder->assets);
+  uv_mutex_destroy(&builder->mutex);
+  free(builder);
+}
+
+void veil_bundle_builder_add_module(veil_bundle_builder_t* builder, JSContext* ctx, const char* filename, JSValueConst compiled, bool root) {
+  bundle_record_t record;
+  uint8_t* bytecode;
+  size_t size;
+
+  uv_mutex_lock(&builder->mutex);
+  if (cmap_bundle_index_contains(&builder->module_index, filename)) {
+    uv_mutex_unlock(&builder->mutex);
+    return;
+  }
+  uv_mutex_unlock(&builder->mutex);
+
+  bytecode = JS_WriteObject(ctx, &size, compiled, JS_WRITE_OBJ_BYTECODE);
+  CHECK_NOT_NULL(bytecode);
+
+  record.flags = (root ? BUNDLE_MODULE_ROOT : 0) | (JS_VALUE_GET_TAG(compiled) == JS_TAG_MODULE ? BUNDLE_MODULE_ESM : 0);
+  record.name = cstr_from(filename);
+  record.data = malloc(size);
+  CHECK_NOT_NULL(record.data);
+  memcpy(record.data, bytecode, size);
+  record.size = size;
+  js_free(ctx, bytecode);
+
+  uv_mutex_lock(&builder->mutex);
+  if (cmap_bundle_index_emplace(&builder->module_index, filename, cvec_bundle_record_size(&builder->modules)).inserted) {
+    cvec_bundle_record_push(&builder->modules, record);
+  } else {
+    cstr_drop(&record.name);
+    free(record.data);
+  }
+  uv_mutex_unlock(&builder->mutex);
+}
+
+void veil_bundle_builder_add_resolution(veil_bundle_builder_t* builder, const char* base, const char* specifier, const char* resolved) {
+  bundle_record_t record;
+
+  // name holds the lookup key, data the resolved name
+  record.flags = 0;
+  record.name = cstr_init();
+  resolution_key(&record.name, base, strlen(base), specifier, strlen(specifier));
+  record.size = strlen(resolved);
+  record.data = malloc(record.size + 1);
+  CHECK_NOT_NULL(record.data);
+  memcpy(record.data, resolved, record.size + 1);
+
+  uv_mutex_lock(&builder->mutex);
+  if (cmap_bundle_index_emplace(&builder->resolution_index, cstr_str(&record.name), cvec_bundle_record_size(&builder->resolutions)).inserted) {
+    cvec_bundle_record_push(&builder->resolutions, record);
+  } else {
+    cstr_drop(&record.name);
+    free(record.data);
+  }
+  uv_mutex_unlock(&builder->mutex);
+}
+
+void veil_bundle_builder_add_asset(veil_bundle_builder_t* builder, const char* filename) {
+  cvec_str_emplace_back(&builder->assets, filename);
+}
+
+bool veil_bundle_builder_write(veil_bundle_builder_t* builder, const char* filename) {
+  bundle_header_t header;
+  bundle_trailer_t trailer;
+  uv_buf_t buf;
+  uv_fs_t req;
+  uv_file fd;
+  int64_t offset = 0;
+  bool ok;
+
+  fd = uv_fs_open(NULL, &req, filename, UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    return false;
+  }
+
+  header_init(&header, cvec_bundle_record_size(&builder->modules), cvec_bundle_record_size(&builder->resolutions),
+      cvec_str_size(&builder->assets));
+  buf = uv_buf_init((char*) &header, sizeof(header));
+  ok = write_bufs(fd, &offset, &buf, 1)
+      && write_records(fd, &offset, &builder->modules, false)
+      && write_records(fd, &offset, &builder->resolutions, true);
+
+  c_foreach (it, cvec_str, builder->assets) {
+    veil_file_t asset;
+    bundle_asset_header_t asset_header;
+    uv_buf_t bufs[3];
+
+    if (!ok) {
+      break;
+    }
+
+    if (!veil_file_read(&asset, cstr_str(it.ref))) {
+      fprintf(stderr, "veil: could not read bundle asset '%s'\n", cstr_str(it.ref));
+      ok = false;
+      break;
+    }
+
+    asset_header = (bundle_asset_header_t) {
+      .name_size = cstr_size(it.ref),
+      .data_size = asset.size,
+    };
+    bufs[0] = uv_buf_init((char*) &asset_header, sizeof(asset_header));
+    bufs[1] = uv_buf_init((char*) cstr_str(it.ref), asset_header.name_size);
+    bufs[2] = uv_buf_init(asset.data, asset.size);
+    ok = write_bufs(fd, &offset, bufs, 3);
+    veil_file_drop(&asset);
+  }
+
+  if (ok) {
+    trailer.size = offset + sizeof(trailer);
+    memcpy(trailer.magic, BUNDLE_TRAILER_MAGIC, sizeof(trailer.magic));
+    buf = uv_buf_init((char*) &trailer, sizeof(trailer));
+    ok = write_bufs(fd, &offset, &buf, 1);
+  }
+
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+
+  return ok;
+}
+
+JSModuleDef* veil_sea_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, module_init);
+
+  if (m) {
+    JS_AddModuleExport(ctx, m, "isSea");
+    JS_AddModuleExport(ctx, m, "getAsset");
+  }
+
+  return m;
+}
+
+static bool parse(veil_bundle_t* bundle, const uint8_t* cursor, const uint8_t* end) {
+  bundle_header_t expected;
+  bundle_header_t header;
+  cstr key = cstr_init();
+  bool ok = true;
+
+  if ((size_t) (end - cursor) < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, cursor, sizeof(header));
+  cursor += sizeof(header);
+
+  // bytecode is only readable by the QuickJS that wrote it
+  header_init(&expected, header.module_count, header.resolution_count, header.asset_count);
+  if (memcmp(&header, &expected, sizeof(header)) != 0) {
+    return false;
+  }
+
+  for (uint32_t n = 0; ok && n < header.module_count; n++) {
+    bundle_module_header_t module_header;
+    bundle_blob_t blob;
+    const char* name;
+    size_t padding;
+
+    if ((size_t) (end - cursor) < sizeof(module_header)) {
+      ok = false;
+      break;
+    }
+    memcpy(&module_header, cursor, sizeof(module_header));
+    cursor += sizeof(module_header);
+
+    // sources carry the NUL the parser expects
+    padding = (module_header.flags & BUNDLE_MODULE_SOURCE) ? 1 : 0;
+    if ((uint64_t) (end - cursor) < module_header.name_size + module_header.data_size + padding) {
+      ok = false;
+      break;
+    }
+    name = (const char*) cursor;
+    cursor += module_header.name_size;
+
+    blob.flags = module_header.flags;
+    blob.data = cursor;
+    blob.size = module_header.data_size;
+    cursor += module_header.data_size + padding;
+
+    cstr_assign_n(&key, name, module_header.name_size);
+    cmap_bundle_emplace(&bundle->modules, cstr_str(&key), blob);
+    if (blob.flags & BUNDLE_MODULE_ROOT) {
+      cvec_str_emplace_back(&bundle->roots, cstr_str(&key));
+    }
+  }
+
+  for (uint32_t n = 0; ok && n < header.resolution_count; n++) {
+    bundle_resolution_header_t resolution_header;
+    bundle_blob_t blob = { 0 };
+    const char* base;
+    const char* specifier;
+
+    if ((size_t) (end - cursor) < sizeof(resolution_header)) {
+      ok = false;
+      break;
+    }
+    memcpy(&resolution_header, cursor, sizeof(resolution_header));
+    cursor += sizeof(resolution_header);
+
+    if ((uint64_t) (end - cursor) < (uint64_t) resolution_header.base_size + resolution_header.specifier_size + resolution_header.resolved_size) {
+      ok = false;
+      break;
+    }
+    base = (const char*) cursor;
+    specifier = base + resolution_header.base_size;
+    blob.data = (const uint8_t*) specifier + resolution_header.specifier_size;
+    blob.size = resolution_header.resolved_size;
+    cursor = blob.data + blob.size;
+
+    resolution_key(&key, base, resolution_header.base_size, specifier, resolution_header.specifier_size);
+    cmap_bundle_emplace(&bundle->resolutions, cstr_str(&key), blob);
+  }
+
+  for (uint32_t n = 0; ok && n < header.asset_count; n++) {
+    bundle_asset_header_t asset_header;
+    bundle_blob_t blob = { 0 };
+
+    if ((size_t) (end - cursor) < sizeof(asset_header)) {
+      ok = false;
+      break;
+    }
+    memcpy(&asset_header, cursor, sizeof(asset_header));
+    cursor += sizeof(asset_header);
+
+    if ((uint64_t) (end - cursor) < asset_header.name_size + asset_header.data_size) {
+      ok = false;
+      break;
+    }
+    cstr_assign_n(&key, (const char*) cursor, asset_header.name_size);
+    cursor += asset_header.name_size;
+
+    blob.data = cursor;
+    blob.size = asset_header.data_size;
+    cursor += asset_header.data_size;
+
+    cmap_bundle_emplace(&bundle->assets, cstr_str(&key), blob);
+  }
+
+  cstr_drop(&key);
+
+  return ok;
+}
+
+static bool read_trailer(const uint8_t* data, size_t size, const uint8_t** start) {
+  bundle_trailer_t trailer;
+
+  if (size < sizeof(trailer)) {
+    return false;
+  }
+  memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+
+  if (memcmp(trailer.magic, BUNDLE_TRAILER_MAGIC, sizeof(trailer.magic)) != 0
+      || trailer.size < sizeof(bundle_header_t) + sizeof(trailer)
+      || trailer.size > size) {
+    return false;
+  }
+
+  *start = data + size - trailer.size;
+
+  return true;
+}
+
+static void header_init(bundle_header_t* header, uint32_t module_count, uint32_t resolution_count, uint32_t asset_count) {
+  memset(header, 0, sizeof(bundle_header_t));
+  memcpy(header->magic, BUNDLE_MAGIC, sizeof(header->magic));
+  strncpy(header->qjs_version, QJS_VERSION, BUNDLE_VERSION_SIZE - 1);
+  header->header_size = sizeof(bundle_header_t);
+  header->module_count = module_count;
+  header->resolution_count = resolution_count;
+  header->asset_count = asset_count;
+}
+
+static void resolution_key(cstr* key, const char* base, size_t base_size, const char* specifier, size_t specifier_size) {
+  cstr_assign_n(key, base, base_size);
+  cstr_append(key, "\n");
+  cstr_append_n(key, specifier, specifier_size);
+}
+
+static bool write_records(uv_file fd, int64_t* offset, const cvec_bundle_record* records, bool resolutions) {
+  c_foreach (it, cvec_bundle_record, *records) {
+    const char* name = cstr_str(&it.ref->name);
+    size_t name_size = cstr_size(&it.ref->name);
+
+    if (resolutions) {
+      // split the key back into base and specifier
+      const char* newline = memchr(name, '\n', name_size);
+      bundle_resolution_header_t resolution_header = {
+        .base_size = newline - name,
+        .specifier_size = name_size - (newline - name) - 1,
+        .resolved_size = it.ref->size,
+      };
+      uv_buf_t bufs[4] = {
+        uv_buf_init((char*) &resolution_header, sizeof(resolution_header)),
+        uv_buf_init((char*) name, resolution_header.base_size),
+        uv_buf_init((char*) newline + 1, resolution_header.specifier_size),
+        uv_buf_init((char*) it.ref->data, it.ref->size),
+      };
+
+      if (!write_bufs(fd, offset, bufs, 4)) {
+        return false;
+      }
+    } else {
+      bundle_module_header_t module_header = {
+        .flags = it.ref->flags,
+        .name_size = name_size,
+        .data_size = it.ref->size,
+      };
+      uv_buf_t bufs[3] = {
+        uv_buf_init((char*) &module_header, sizeof(module_header)),
+        uv_buf_init((char*) name, name_size),
+        uv_buf_init((char*) it.ref->data, it.ref->size),
+      };
+
+      if (!write_bufs(fd, offset, bufs, 3)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static bool write_bufs(uv_file fd, int64_t* offset, uv_buf_t* bufs, unsigned int count) {
+  uv_fs_t req;
+  size_t size = 0;
+  bool ok;
+
+  for (unsigned int n = 0; n < count; n++) {
+    size += bufs[n].len;
+  }
+
+  ok = uv_fs_write(NULL, &req, fd, bufs, count, *offset, NULL) == (int) size;
+  uv_fs_req_cleanup(&req);
+  *offset += size;
+
+  return ok;
+}
+
+static int module_init(JSContext* ctx, JSModuleDef* m) {
+  JS_SetModuleExport(ctx, m, "isSea", JS_NewCFunction(ctx, is_sea, "isSea", 0));
+  JS_SetModuleExport(ctx, m, "getAsset", JS_NewCFunction(ctx, get_asset, "getAsset", 2));
+
+  return 0;
+}
+
+static JSValue is_sea(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+
+  return JS_NewBool(ctx, vm->bundle != NULL);
+}
+
+static JSValue get_asset(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  const uint8_t* data;
+  size_t size;
+  const char* key;
+  const char* encoding = NULL;
+  JSValue result;
+
+  if (!vm->bundle) {
+    return JS_ThrowTypeError(ctx, "getAsset() can only be called from a bundle");
+  }
+
+  key = JS_ToCString(ctx, argc > 0 ? argv[0] : JS_UNDEFINED);
+  if (!key) {
+    return JS_EXCEPTION;
+  }
+
+  if (!veil_bundle_get_asset(vm->bundle, key, &data, &size)) {
+    result = JS_ThrowReferenceError(ctx, "no asset '%s' in bundle", key);
+    JS_FreeCString(ctx, key);
+    return result;
+  }
+  JS_FreeCString(ctx, key);
+
+  if (argc > 1 && !JS_IsUndefined(argv[1])) {
+    encoding = JS_ToCString(ctx, argv[1]);
+    if (!encoding) {
+      return JS_EXCEPTION;
+    }
+
+    if (strcmp(encoding, "utf8") != 0 && strcmp(encoding, "utf-8") != 0) {
+      result = JS_ThrowTypeError(ctx, "unsupported encoding '%s'", encoding);
+    } else {
+      result = JS_NewStringLen(ctx, (const char*) data, size);
+    }
+    JS_FreeCString(ctx, encoding);
+
+    return result;
+  }
+
+  // a copy; the mapping is read-only
+  return JS_NewArrayBufferCopy(ctx, data, size);
+}
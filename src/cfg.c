@@ -4,6 +4,7 @@
 
 #include "defs.h"
 #include <stc/coption.h>
+#include <signal.h>
 
 #define i_val_str
 #define i_opt (c_no_cmp | c_is_fwd)
@@ -13,9 +14,13 @@
 #define PARSE_RESULT_EXIT() (veil_parse_args_result_t) { .ok = false, .exit_code = 0 }
 #define PARSE_RESULT_ERR(EXIT_CODE) (veil_parse_args_result_t) { .ok = false, .exit_code = EXIT_CODE }
 
+#define EXEPATH_SIZE 4096
+
 static void print_help();
 static void print_version();
 static const char* cvec_str_get_or_empty(const cvec_str* vec, size_t index);
+static bool parse_uint32(const char* str, uint32_t* out);
+static bool parse_signal(const char* str, int* out);
 
 typedef enum {
   // stc/coption status
@@ -42,6 +47,25 @@ typedef enum {
   OPT_NO_DEPRECATION = 0x10B,
   OPT_THROW_DEPRECATION = 0x10C,
   OPT_IMPORT = 0x10D,
+  OPT_CODE_CACHE_DIR = 0x10E,
+  OPT_BUILD_SNAPSHOT = 0x10F,
+  OPT_SNAPSHOT_BLOB = 0x110,
+  OPT_ALLOCATOR = 0x111,
+  OPT_MAX_HEAP_SIZE = 0x112,
+  OPT_GC_THRESHOLD = 0x113,
+  OPT_MAX_STACK_SIZE = 0x114,
+  OPT_GC_ADAPTIVE = 0x115,
+  OPT_MICROTASK_BUDGET = 0x116,
+  OPT_MICROTASK_SLICE = 0x117,
+  OPT_CPU_PROF = 0x118,
+  OPT_CPU_PROF_DIR = 0x119,
+  OPT_CPU_PROF_INTERVAL = 0x11A,
+  OPT_HEAPSNAPSHOT_SIGNAL = 0x11B,
+  OPT_RESOLUTION_MANIFEST = 0x11C,
+  OPT_BUILD_BUNDLE = 0x11D,
+  OPT_BUNDLE_ASSET = 0x11E,
+  OPT_NO_ADDON = 0x11F,
+  OPT_WORKERS = 0x120,
 } cli_option_id_t;
 
 static const char* OPTS_SHORT = "+hvr:e:p:C:dw:";
@@ -50,6 +74,7 @@ static coption_long OPTS_LONG[] = {
     { "help", coption_no_argument, OPT_HELP },
     { "version", coption_no_argument, OPT_VERSION },
     { "expose-gc", coption_no_argument, OPT_EXPOSE_GC },
+    { "no-addon", coption_no_argument, OPT_NO_ADDON },
     { "no-deprecation", coption_no_argument, OPT_NO_DEPRECATION },
     { "throw-deprecation", coption_no_argument, OPT_THROW_DEPRECATION },
     { "expose-internals", coption_no_argument, OPT_EXPOSE_INTERNALS },
@@ -63,24 +88,61 @@ static coption_long OPTS_LONG[] = {
     { "print", coption_required_argument, OPT_PRINT },
     { "input-type", coption_required_argument, OPT_INPUT_TYPE },
     { "es-module-specifier-resolution", coption_required_argument, OPT_ESM_SPECIFIER_RESOLUTION },
+    { "code-cache-dir", coption_required_argument, OPT_CODE_CACHE_DIR },
+    { "build-snapshot", coption_no_argument, OPT_BUILD_SNAPSHOT },
+    { "snapshot-blob", coption_required_argument, OPT_SNAPSHOT_BLOB },
+    { "allocator", coption_required_argument, OPT_ALLOCATOR },
+    { "max-heap-size", coption_required_argument, OPT_MAX_HEAP_SIZE },
+    { "gc-threshold", coption_required_argument, OPT_GC_THRESHOLD },
+    { "max-stack-size", coption_required_argument, OPT_MAX_STACK_SIZE },
+    { "gc-adaptive", coption_no_argument, OPT_GC_ADAPTIVE },
+    { "microtask-budget", coption_required_argument, OPT_MICROTASK_BUDGET },
+    { "microtask-slice", coption_required_argument, OPT_MICROTASK_SLICE },
+    { "cpu-prof", coption_no_argument, OPT_CPU_PROF },
+    { "cpu-prof-dir", coption_required_argument, OPT_CPU_PROF_DIR },
+    { "cpu-prof-interval", coption_required_argument, OPT_CPU_PROF_INTERVAL },
+    { "heapsnapshot-signal", coption_required_argument, OPT_HEAPSNAPSHOT_SIGNAL },
+    { "resolution-manifest", coption_required_argument, OPT_RESOLUTION_MANIFEST },
+    { "build-bundle", coption_required_argument, OPT_BUILD_BUNDLE },
+    { "bundle-asset", coption_required_argument, OPT_BUNDLE_ASSET },
+    { "workers", coption_required_argument, OPT_WORKERS },
     {0}
 };
 
 void veil_cfg_init(veil_cfg_t* cfg) {
   cfg->expose_gc = false;
+  cfg->no_addon = false;
   cfg->no_deprecation = false;
   cfg->throw_deprecation = false;
   cfg->expose_gc = false;
   cfg->expose_internals = false;
   cfg->preserve_symlinks = false;
   cfg->preserve_symlinks_main = false;
+  cfg->build_snapshot = false;
+  cfg->gc_adaptive = false;
+  cfg->max_heap_size = 0;
+  cfg->gc_threshold = 0;
+  cfg->max_stack_size = 0;
+  cfg->microtask_budget = 0;
+  cfg->microtask_slice_ms = 0;
+  cfg->workers = 0;
+  cfg->cpu_prof = false;
+  cfg->cpu_prof_interval = VEIL_CPU_PROF_DEFAULT_INTERVAL;
+  cfg->heapsnapshot_signal = 0;
+  cfg->cpu_prof_dir = cstr_init();
   cfg->loader = cstr_init();
   cfg->script = cstr_init();
+  cfg->code_cache_dir = cstr_init();
+  cfg->resolution_manifest = cstr_init();
+  cfg->snapshot_blob = cstr_init();
+  cfg->build_bundle = cstr_init();
+  cfg->allocator = VEIL_ALLOCATOR_SYSTEM;
   cfg->input_type = VEIL_INPUT_TYPE_COMMONJS;
   cfg->script_op = VEIL_SCRIPT_OP_SPECIFIER;
   cfg->conditions = cvec_str_init();
   cfg->require = cvec_str_init();
   cfg->import = cvec_str_init();
+  cfg->bundle_assets = cvec_str_init();
   cfg->esm_specifier_resolution = VEIL_ESM_SPECIFIER_RESOLUTION_NODE;
   cfg->argv0 = cstr_init();
   cfg->argv = cvec_str_init();
@@ -90,9 +152,15 @@ void veil_cfg_init(veil_cfg_t* cfg) {
 void veil_cfg_drop(veil_cfg_t* cfg) {
   cstr_drop(&cfg->loader);
   cstr_drop(&cfg->script);
+  cstr_drop(&cfg->code_cache_dir);
+  cstr_drop(&cfg->resolution_manifest);
+  cstr_drop(&cfg->snapshot_blob);
+  cstr_drop(&cfg->build_bundle);
+  cstr_drop(&cfg->cpu_prof_dir);
   cvec_str_drop(&cfg->conditions);
   cvec_str_drop(&cfg->require);
   cvec_str_drop(&cfg->import);
+  cvec_str_drop(&cfg->bundle_assets);
   cstr_drop(&cfg->argv0);
   cvec_str_drop(&cfg->argv);
   cvec_str_drop(&cfg->exec_argv);
@@ -102,13 +170,31 @@ void veil_cfg_drop(veil_cfg_t* cfg) {
 
 veil_parse_args_result_t veil_cfg_parse_args(veil_t* veil, int argc, char** argv) {
   int32_t value;
+  size_t size;
+  uint32_t count;
+  char exepath[EXEPATH_SIZE];
   coption opt = coption_init();
 
+  // an executable with a bundle appended runs it, and every argument is the
+  // application's
+  size = sizeof(exepath);
+  if (uv_exepath(exepath, &size) == 0 && veil_bundle_detect(exepath)) {
+    veil_cfg_set_argv0(veil, argv[0]);
+    veil_cfg_set_script(veil, exepath, VEIL_SCRIPT_OP_BUNDLE);
+    for (size_t n = 1; n < argc; n++) {
+      veil_cfg_add_argv(veil, argv[n]);
+    }
+    return PARSE_RESULT_OK();
+  }
+
   while ((value = coption_get(&opt, argc, argv, OPTS_SHORT, OPTS_LONG)) != OPT_STATUS_END) {
     switch (value) {
       case OPT_EXPOSE_GC:
         veil_cfg_set_expose_gc(veil, true);
         break;
+      case OPT_NO_ADDON:
+        veil_cfg_set_no_addon(veil, true);
+        break;
       case OPT_NO_DEPRECATION:
         veil_cfg_set_no_deprecation(veil, true);
         break;
@@ -148,6 +234,98 @@ veil_parse_args_result_t veil_cfg_parse_args(veil_t* veil, int argc, char** argv
       case OPT_CONDITIONS:
         veil_cfg_add_condition(veil, opt.arg);
         break;
+      case OPT_CODE_CACHE_DIR:
+        veil_cfg_set_code_cache_dir(veil, opt.arg);
+        break;
+      case OPT_RESOLUTION_MANIFEST:
+        veil_cfg_set_resolution_manifest(veil, opt.arg);
+        break;
+      case OPT_BUILD_SNAPSHOT:
+        veil_cfg_set_build_snapshot(veil, true);
+        break;
+      case OPT_SNAPSHOT_BLOB:
+        veil_cfg_set_snapshot_blob(veil, opt.arg);
+        break;
+      case OPT_BUILD_BUNDLE:
+        veil_cfg_set_build_bundle(veil, opt.arg);
+        break;
+      case OPT_BUNDLE_ASSET:
+        veil_cfg_add_bundle_asset(veil, opt.arg);
+        break;
+      case OPT_ALLOCATOR:
+        if (!veil_cfg_set_allocator_str(veil, opt.arg)) {
+          fprintf(stderr, "veil: --allocator must be \"system\", \"pool\", \"mimalloc\" or \"jemalloc\" (if linked)\n");
+          return PARSE_RESULT_ERR(1);
+        }
+        break;
+      case OPT_MAX_HEAP_SIZE:
+        if (!veil_parse_size(opt.arg, &size)) {
+          fprintf(stderr, "veil: --max-heap-size must be a size such as 512m\n");
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_max_heap_size(veil, size);
+        break;
+      case OPT_GC_THRESHOLD:
+        if (!veil_parse_size(opt.arg, &size)) {
+          fprintf(stderr, "veil: --gc-threshold must be a size such as 4m\n");
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_gc_threshold(veil, size);
+        break;
+      case OPT_MAX_STACK_SIZE:
+        if (!veil_parse_size(opt.arg, &size)) {
+          fprintf(stderr, "veil: --max-stack-size must be a size such as 1m\n");
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_max_stack_size(veil, size);
+        break;
+      case OPT_GC_ADAPTIVE:
+        veil_cfg_set_gc_adaptive(veil, true);
+        break;
+      case OPT_MICROTASK_BUDGET:
+        if (!parse_uint32(opt.arg, &count)) {
+          fprintf(stderr, "veil: --microtask-budget must be a job count\n");
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_microtask_budget(veil, count);
+        break;
+      case OPT_MICROTASK_SLICE:
+        if (!parse_uint32(opt.arg, &count)) {
+          fprintf(stderr, "veil: --microtask-slice must be a number of milliseconds\n");
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_microtask_slice(veil, count);
+        break;
+      case OPT_CPU_PROF:
+        veil_cfg_set_cpu_prof(veil, true);
+        break;
+      case OPT_CPU_PROF_DIR:
+        veil_cfg_set_cpu_prof_dir(veil, opt.arg);
+        break;
+      case OPT_CPU_PROF_INTERVAL:
+        if (!parse_uint32(opt.arg, &count) || count == 0) {
+          fprintf(stderr, "veil: --cpu-prof-interval must be a positive number of microseconds\n");
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_cpu_prof_interval(veil, count);
+        break;
+      case OPT_WORKERS:
+        if (!parse_uint32(opt.arg, &count) || count == 0 || count > VEIL_CLUSTER_MAX_WORKERS) {
+          fprintf(stderr, "veil: --workers must be a process count from 1 to %u\n", VEIL_CLUSTER_MAX_WORKERS);
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_workers(veil, count);
+        break;
+      case OPT_HEAPSNAPSHOT_SIGNAL: {
+        int signum;
+
+        if (!parse_signal(opt.arg, &signum)) {
+          fprintf(stderr, "veil: --heapsnapshot-signal: unsupported signal '%s'\n", opt.arg);
+          return PARSE_RESULT_ERR(1);
+        }
+        veil_cfg_set_heapsnapshot_signal(veil, signum);
+        break;
+      }
       case OPT_ESM_SPECIFIER_RESOLUTION:
         if (!veil_cfg_set_esm_specifier_resolution_str(veil, opt.arg)) {
           fprintf(stderr, "veil: --es-module-specifier-resolution must be \"node\" or \"explicit\"");
@@ -169,6 +347,22 @@ veil_parse_args_result_t veil_cfg_parse_args(veil_t* veil, int argc, char** argv
     }
   }
 
+  if (!veil_cfg_get_cpu_prof(veil)
+      && (!cstr_is_empty(&veil->cfg.cpu_prof_dir) || veil_cfg_get_cpu_prof_interval(veil) != VEIL_CPU_PROF_DEFAULT_INTERVAL)) {
+    fprintf(stderr, "veil: --cpu-prof-dir and --cpu-prof-interval must be used with --cpu-prof\n");
+    return PARSE_RESULT_ERR(1);
+  }
+
+  if (veil_cfg_get_build_snapshot(veil) && cstr_is_empty(&veil->cfg.snapshot_blob)) {
+    fprintf(stderr, "veil: --build-snapshot requires --snapshot-blob\n");
+    return PARSE_RESULT_ERR(1);
+  }
+
+  if (veil_cfg_get_bundle_asset_count(veil) > 0 && cstr_is_empty(&veil->cfg.build_bundle)) {
+    fprintf(stderr, "veil: --bundle-asset requires --build-bundle\n");
+    return PARSE_RESULT_ERR(1);
+  }
+
   int32_t non_option_index = opt.ind;
 
   // argv0
@@ -182,9 +376,11 @@ veil_parse_args_result_t veil_cfg_parse_args(veil_t* veil, int argc, char** argv
   // capture specifier/filename arg
   if (veil_cfg_get_script_op(veil) == VEIL_SCRIPT_OP_SPECIFIER) {
     if (non_option_index < argc) {
-      veil_cfg_set_script(veil, argv[non_option_index], VEIL_SCRIPT_OP_SPECIFIER);
+      // a bundle file runs like an executable with one appended
+      veil_cfg_set_script(veil, argv[non_option_index],
+          veil_bundle_detect(argv[non_option_index]) ? VEIL_SCRIPT_OP_BUNDLE : VEIL_SCRIPT_OP_SPECIFIER);
       non_option_index++;
-    } else {
+    } else if (!veil_cfg_get_build_snapshot(veil)) {
       fprintf(stderr, "veil: no filename specified\n");
       return PARSE_RESULT_ERR(1);
     }
@@ -198,6 +394,14 @@ veil_parse_args_result_t veil_cfg_parse_args(veil_t* veil, int argc, char** argv
   return PARSE_RESULT_OK();
 }
 
+bool veil_cfg_get_no_addon(veil_t* veil) {
+  return veil->cfg.no_addon;
+}
+
+void veil_cfg_set_no_addon(veil_t* veil, bool no_addon) {
+  veil->cfg.no_addon = no_addon;
+}
+
 bool veil_cfg_get_no_deprecation(veil_t* veil) {
   return veil->cfg.no_deprecation;
 }
@@ -267,6 +471,172 @@ void veil_cfg_set_script(veil_t* veil, const char* script, veil_script_op_t op)
   veil->cfg.script_op = op;
 }
 
+const char* veil_cfg_get_code_cache_dir(veil_t* veil) {
+  return cstr_str_safe(&veil->cfg.code_cache_dir);
+}
+
+void veil_cfg_set_code_cache_dir(veil_t* veil, const char* code_cache_dir) {
+  cstr_assign(&veil->cfg.code_cache_dir, code_cache_dir);
+}
+
+bool veil_cfg_get_build_snapshot(veil_t* veil) {
+  return veil->cfg.build_snapshot;
+}
+
+void veil_cfg_set_build_snapshot(veil_t* veil, bool build_snapshot) {
+  veil->cfg.build_snapshot = build_snapshot;
+}
+
+const char* veil_cfg_get_snapshot_blob(veil_t* veil) {
+  return cstr_str_safe(&veil->cfg.snapshot_blob);
+}
+
+void veil_cfg_set_snapshot_blob(veil_t* veil, const char* snapshot_blob) {
+  cstr_assign(&veil->cfg.snapshot_blob, snapshot_blob);
+}
+
+veil_allocator_t veil_cfg_get_allocator(veil_t* veil) {
+  return veil->cfg.allocator;
+}
+
+bool veil_cfg_set_allocator(veil_t* veil, veil_allocator_t allocator) {
+  if (!veil_alloc_available(allocator)) {
+    return false;
+  }
+  veil->cfg.allocator = allocator;
+  return true;
+}
+
+bool veil_cfg_set_allocator_str(veil_t* veil, const char* allocator) {
+  if (strcmp(allocator, "system") == 0) {
+    return veil_cfg_set_allocator(veil, VEIL_ALLOCATOR_SYSTEM);
+  } else if (strcmp(allocator, "pool") == 0) {
+    return veil_cfg_set_allocator(veil, VEIL_ALLOCATOR_POOL);
+  } else if (strcmp(allocator, "mimalloc") == 0) {
+    return veil_cfg_set_allocator(veil, VEIL_ALLOCATOR_MIMALLOC);
+  } else if (strcmp(allocator, "jemalloc") == 0) {
+    return veil_cfg_set_allocator(veil, VEIL_ALLOCATOR_JEMALLOC);
+  } else {
+    return false;
+  }
+}
+
+size_t veil_cfg_get_max_heap_size(veil_t* veil) {
+  return veil->cfg.max_heap_size;
+}
+
+void veil_cfg_set_max_heap_size(veil_t* veil, size_t max_heap_size) {
+  veil->cfg.max_heap_size = max_heap_size;
+}
+
+size_t veil_cfg_get_gc_threshold(veil_t* veil) {
+  return veil->cfg.gc_threshold;
+}
+
+void veil_cfg_set_gc_threshold(veil_t* veil, size_t gc_threshold) {
+  veil->cfg.gc_threshold = gc_threshold;
+}
+
+size_t veil_cfg_get_max_stack_size(veil_t* veil) {
+  return veil->cfg.max_stack_size;
+}
+
+void veil_cfg_set_max_stack_size(veil_t* veil, size_t max_stack_size) {
+  veil->cfg.max_stack_size = max_stack_size;
+}
+
+bool veil_cfg_get_gc_adaptive(veil_t* veil) {
+  return veil->cfg.gc_adaptive;
+}
+
+void veil_cfg_set_gc_adaptive(veil_t* veil, bool gc_adaptive) {
+  veil->cfg.gc_adaptive = gc_adaptive;
+}
+
+uint32_t veil_cfg_get_microtask_budget(veil_t* veil) {
+  return veil->cfg.microtask_budget;
+}
+
+void veil_cfg_set_microtask_budget(veil_t* veil, uint32_t microtask_budget) {
+  veil->cfg.microtask_budget = microtask_budget;
+}
+
+uint32_t veil_cfg_get_microtask_slice(veil_t* veil) {
+  return veil->cfg.microtask_slice_ms;
+}
+
+void veil_cfg_set_microtask_slice(veil_t* veil, uint32_t microtask_slice_ms) {
+  veil->cfg.microtask_slice_ms = microtask_slice_ms;
+}
+
+bool veil_cfg_get_cpu_prof(veil_t* veil) {
+  return veil->cfg.cpu_prof;
+}
+
+void veil_cfg_set_cpu_prof(veil_t* veil, bool cpu_prof) {
+  veil->cfg.cpu_prof = cpu_prof;
+}
+
+const char* veil_cfg_get_cpu_prof_dir(veil_t* veil) {
+  return cstr_str_safe(&veil->cfg.cpu_prof_dir);
+}
+
+void veil_cfg_set_cpu_prof_dir(veil_t* veil, const char* cpu_prof_dir) {
+  cstr_assign(&veil->cfg.cpu_prof_dir, cpu_prof_dir);
+}
+
+uint32_t veil_cfg_get_cpu_prof_interval(veil_t* veil) {
+  return veil->cfg.cpu_prof_interval;
+}
+
+void veil_cfg_set_cpu_prof_interval(veil_t* veil, uint32_t cpu_prof_interval_us) {
+  veil->cfg.cpu_prof_interval = cpu_prof_interval_us;
+}
+
+int veil_cfg_get_heapsnapshot_signal(veil_t* veil) {
+  return veil->cfg.heapsnapshot_signal;
+}
+
+void veil_cfg_set_heapsnapshot_signal(veil_t* veil, int signum) {
+  veil->cfg.heapsnapshot_signal = signum;
+}
+
+const char* veil_cfg_get_resolution_manifest(veil_t* veil) {
+  return cstr_str_safe(&veil->cfg.resolution_manifest);
+}
+
+void veil_cfg_set_resolution_manifest(veil_t* veil, const char* resolution_manifest) {
+  cstr_assign(&veil->cfg.resolution_manifest, resolution_manifest);
+}
+
+uint32_t veil_cfg_get_workers(veil_t* veil) {
+  return veil->cfg.workers;
+}
+
+void veil_cfg_set_workers(veil_t* veil, uint32_t workers) {
+  veil->cfg.workers = workers;
+}
+
+const char* veil_cfg_get_build_bundle(veil_t* veil) {
+  return cstr_str_safe(&veil->cfg.build_bundle);
+}
+
+void veil_cfg_set_build_bundle(veil_t* veil, const char* build_bundle) {
+  cstr_assign(&veil->cfg.build_bundle, build_bundle);
+}
+
+size_t veil_cfg_get_bundle_asset_count(veil_t* veil) {
+  return cvec_str_size(&veil->cfg.bundle_assets);
+}
+
+const char* veil_cfg_get_bundle_asset(veil_t* veil, size_t index) {
+  return cvec_str_get_or_empty(&veil->cfg.bundle_assets, index);
+}
+
+void veil_cfg_add_bundle_asset(veil_t* veil, const char* filename) {
+  cvec_str_emplace_back(&veil->cfg.bundle_assets, filename);
+}
+
 veil_input_type_t veil_cfg_get_input_type(veil_t* veil) {
   return veil->cfg.input_type;
 }
@@ -384,6 +754,54 @@ static const char* cvec_str_get_or_empty(const cvec_str* vec, size_t index) {
   return cstr_str_safe(value);
 }
 
+static bool parse_uint32(const char* str, uint32_t* out) {
+  char* end;
+  unsigned long value;
+
+  if (*str < '0' || *str > '9') {
+    return false;
+  }
+
+  value = strtoul(str, &end, 10);
+  if (*end != '\0' || value > UINT32_MAX) {
+    return false;
+  }
+
+  *out = (uint32_t) value;
+
+  return true;
+}
+
+static bool parse_signal(const char* str, int* out) {
+  static const struct { const char* name; int signum; } SIGNALS[] = {
+#ifdef SIGUSR1
+    { "SIGUSR1", SIGUSR1 },
+#endif
+#ifdef SIGUSR2
+    { "SIGUSR2", SIGUSR2 },
+#endif
+#ifdef SIGHUP
+    { "SIGHUP", SIGHUP },
+#endif
+#ifdef SIGQUIT
+    { "SIGQUIT", SIGQUIT },
+#endif
+#ifdef SIGBREAK
+    { "SIGBREAK", SIGBREAK },
+#endif
+    { "SIGINT", SIGINT },
+  };
+
+  for (size_t n = 0; n < countof(SIGNALS); n++) {
+    if (strcmp(str, SIGNALS[n].name) == 0) {
+      *out = SIGNALS[n].signum;
+      return true;
+    }
+  }
+
+  return false;
+}
+
 static void print_help() {
   printf("Usage: veil [options] [script.js] [arguments]\n\nOptions:\n");
   // node-like options
@@ -408,6 +826,35 @@ static void print_help() {
   printf("  --es-module-specifier-resolution=...                                          \n"
          "                                  select extension resolution algorithm for es  \n"
          "                                  modules; either 'explicit' (default) or 'node'\n");
+  printf("  --code-cache-dir=...            directory to store compiled bytecode of loaded\n"
+         "                                  scripts and modules                           \n");
+  printf("  --build-snapshot                run preloads and the script, then write the   \n"
+         "                                  preloads' compiled records to --snapshot-blob \n");
+  printf("  --snapshot-blob=...             snapshot blob to restore preloads from, or to \n"
+         "                                  write with --build-snapshot                   \n");
+  printf("  --allocator=...                 JS heap allocator: 'system' (default), 'pool',\n"
+         "                                  or 'mimalloc'/'jemalloc' when linked          \n");
+  printf("  --max-heap-size=...             fail allocations once the JS heap reaches this\n"
+         "                                  size (accepts k, m and g suffixes)            \n");
+  printf("  --gc-threshold=...              heap growth that triggers a collection        \n");
+  printf("  --max-stack-size=...            maximum JS stack size (default 256k)          \n");
+  printf("  --gc-adaptive                   grow the gc threshold with the share of the   \n"
+         "                                  heap that survives each collection            \n");
+  printf("  --microtask-budget=...          run at most this many microtasks per loop turn\n"
+         "                                  before polling for I/O again (0 = no limit)   \n");
+  printf("  --microtask-slice=...           likewise, but a time slice in milliseconds    \n");
+  printf("  --cpu-prof                      sample the JS stack and write a .cpuprofile on\n"
+         "                                  exit                                          \n");
+  printf("  --cpu-prof-dir=...              directory for --cpu-prof output               \n");
+  printf("  --cpu-prof-interval=...         sampling interval in microseconds (1000)      \n");
+  printf("  --resolution-manifest=...       persist module resolutions to this file       \n");
+  printf("  --heapsnapshot-signal=...       write a .heapsnapshot on this signal          \n");
+  printf("  --build-bundle=...              run preloads and the script, then write the   \n"
+         "                                  modules and resolutions they used to this file\n");
+  printf("  --bundle-asset=...              file to embed with --build-bundle (repeatable)\n");
+  printf("  --workers=...                   run the script in this many child processes   \n"
+         "                                  that share listen ports, restarting crashed   \n"
+         "                                  ones                                          \n");
   printf("\nEnvironment variables:\n\n");
   printf("UV_THREADPOOL_SIZE                sets the number of threads used in libuv's    \n"
          "                                  threadpool                                    \n");
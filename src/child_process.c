@@ -0,0 +1,2913 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// spawn() starts the child for the VM's loop, with a Pipe object for each
+// piped stdio stream. Handing one child's stdout to another child, or to a
+// file descriptor, through the stdio option costs nothing: the second child
+// inherits the descriptor and the parent closes its copy. stdout.pipe() onto a
+// child's stdin, a descriptor or a path takes both descriptors away from
+// their streams and pumps the bytes natively, with splice() through a kernel
+// pipe on Linux and read()/write() elsewhere, so no chunk is ever seen by JS.
+//
+// exec(), execFile() and the *Sync() calls collect the whole output with one
+// set of handles. exec() and execFile() put them on the VM's loop, like
+// spawn(), so thousands of children cost no threads and never hold up fs or
+// getaddrinfo work on the threadpool. The *Sync() calls put them on a private
+// loop that the calling thread runs until the child is done, as node does.
+//
+// None of them fork on the loop that asked. A uv_spawn() stalls its thread
+// for as long as fork() takes to copy the parent's page tables, so one spawner
+// thread, with a loop of its own, starts every child and reaps it; it holds no
+// threadpool thread while children run. The asking loop learns the pid or the
+// error, and later the exit status, through an async handle. Stdio pipes are
+// made up front, so the parent's ends are ordinary pipes on the asking loop
+// and the spawner only hands the other ends to the child. A child's pid is
+// known from its 'spawn' event on, and kill() before then is applied as soon
+// as the child exists.
+
+#define CP_DEFAULT_MAX_BUFFER (1024 * 1024)
+// collected output grows by at least this much
+#define CP_READ_SIZE (64 * 1024)
+// pipe.write() returns false once this much is in flight
+#define CP_HIGH_WATER_MARK (16 * 1024)
+// bytes moved by one read or splice of the pump
+#define CP_PUMP_CHUNK (64 * 1024)
+// chunks moved per poll callback, so one busy pump cannot hog the loop
+#define CP_PUMP_ROUNDS 16
+
+enum {
+  CP_SPAWN,
+  CP_EXEC,
+  CP_EXEC_FILE,
+};
+
+typedef enum {
+  CP_STDIO_PIPE,
+  CP_STDIO_IGNORE,
+  CP_STDIO_FD,
+  CP_STDIO_STREAM,
+} cp_stdio_mode_t;
+
+typedef struct cp_pipe_s cp_pipe_t;
+typedef struct cp_pump_s cp_pump_t;
+
+typedef struct cp_stdio_s {
+  cp_stdio_mode_t mode;
+  int fd;
+  cp_pipe_t* pipe;
+} cp_stdio_t;
+
+// Plain C, so that the threadpool can use it after the call has returned.
+typedef struct cp_options_s {
+  char* file;
+  // NULL terminated, starting with the file
+  char** args;
+  size_t arg_count;
+  // NULL terminated "name=value" strings, or NULL to inherit
+  char** env;
+  size_t env_count;
+  char* cwd;
+  // the command line, for error messages
+  char* cmd;
+  cp_stdio_t stdio[3];
+  uint8_t* input;
+  size_t input_size;
+  uint64_t timeout;
+  int kill_signal;
+  size_t max_buffer;
+  // collected output is decoded as UTF-8 rather than returned as Buffers
+  bool strings;
+  bool detached;
+  bool verbatim;
+  bool set_uid;
+  bool set_gid;
+  uv_uid_t uid;
+  uv_gid_t gid;
+} cp_options_t;
+
+typedef struct cp_output_s {
+  char* data;
+  size_t size;
+  size_t capacity;
+} cp_output_t;
+
+typedef struct cp_launch_s cp_launch_t;
+
+typedef void (*cp_launch_cb)(cp_launch_t* launch);
+
+// A child started by the spawner thread for the loop of its owner, a
+// collection or a ChildProcess.
+struct cp_launch_s {
+  // on the owner's loop
+  uv_async_t async;
+  // on the spawner's loop
+  uv_process_t process;
+  // copies of what uv_spawn() reads, so the owner can go at any time
+  uv_process_options_t process_options;
+  uv_stdio_container_t stdio[3];
+  // the child's ends of its stdio, closed by the spawner once it is forked
+  int child_fds[3];
+  void* data;
+  cp_launch_cb spawn_cb;
+  cp_launch_cb exit_cb;
+  cp_launch_cb close_cb;
+  // owner only
+  bool spawn_reported;
+  bool exit_reported;
+  bool released;
+  // the rest is guarded by spawner_mutex
+  cp_launch_t* next;
+  uint32_t refs;
+  bool queued;
+  bool spawned;
+  bool exited;
+  bool closing;
+  int pending_signal;
+  int err;
+  int pid;
+  int64_t status;
+  int term_signal;
+};
+
+typedef struct cp_collect_s cp_collect_t;
+
+typedef void (*cp_collect_cb)(cp_collect_t* collect);
+
+struct cp_collect_s {
+  veil_cleanup_t cleanup;
+  // NULL for the *Sync() calls and once the VM has gone and released the JS
+  // values
+  veil_vm_t* vm;
+  JSValue callback;
+  JSValue resolving_funcs[2];
+  cp_options_t options;
+  // called once every handle has closed
+  cp_collect_cb done_cb;
+  uint32_t open_handles;
+  cp_launch_t* launch;
+  uv_pipe_t pipes[3];
+  uv_timer_t timer;
+  uv_write_t write;
+  cp_output_t output[3];
+  bool exited;
+  bool timer_active;
+  bool killed;
+  int pid;
+  int64_t status;
+  int signal;
+  int err;
+  const char* syscall;
+};
+
+typedef struct cp_child_s {
+  cp_launch_t* launch;
+  veil_cleanup_t cleanup;
+  veil_vm_t* vm;
+  // held until the launch and every pipe have closed
+  JSValue object;
+  // stdio streams of other children handed to this one once it is forked
+  JSValue inherited[3];
+  cp_pipe_t* pipes[3];
+  uint32_t open_pipes;
+  int pid;
+  int64_t exit_code;
+  int term_signal;
+  bool spawned;
+  bool exited;
+  bool killed;
+  bool closing;
+  bool closed;
+  bool finished;
+  bool released;
+} cp_child_t;
+
+struct cp_pipe_s {
+  uv_pipe_t pipe;
+  veil_cleanup_t cleanup;
+  veil_vm_t* vm;
+  // NULL once the pipe is done
+  cp_child_t* child;
+  // held until the handle has closed and any pump is done
+  JSValue object;
+  cp_pump_t* pump;
+  uv_shutdown_t shutdown;
+  size_t writable_length;
+  bool readable;
+  bool strings;
+  bool paused;
+  bool ending;
+  bool eof;
+  bool need_drain;
+  bool had_error;
+  bool closing;
+  bool closed;
+  bool done;
+  bool released;
+};
+
+typedef struct cp_write_s {
+  uv_write_t req;
+  cp_pipe_t* pipe;
+  // the buffer written from, or JS_UNDEFINED for strings
+  JSValue keep;
+  const char* str;
+  JSValue callback;
+  size_t size;
+} cp_write_t;
+
+struct cp_pump_s {
+  uv_poll_t in;
+  uv_poll_t out;
+  veil_cleanup_t cleanup;
+  veil_vm_t* vm;
+  cp_pipe_t* source;
+  // a child's stdin, or NULL for a descriptor or a path
+  cp_pipe_t* dest;
+  int in_fd;
+  int out_fd;
+  // regular files never make the pump wait, so they are not polled
+  bool out_polled;
+  // Linux moves the bytes through this kernel pipe with splice()
+  bool use_splice;
+  int stage[2];
+  // the bytes read or spliced and not yet written
+  size_t staged;
+  char* buf;
+  size_t buf_offset;
+  uint32_t open_polls;
+  bool eof;
+  bool done;
+  bool released;
+  int err;
+};
+
+static JSClassID child_class_id;
+static JSClassID pipe_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static uv_once_t spawner_once = UV_ONCE_INIT;
+static uv_mutex_t spawner_mutex;
+static uv_loop_t spawner_loop;
+static uv_async_t spawner_async;
+static uv_thread_t spawner_thread;
+// guarded by spawner_mutex
+static cp_launch_t* spawner_head;
+static cp_launch_t* spawner_tail;
+
+static void global_init();
+static int child_process_module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue cp_spawn(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue cp_exec(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue cp_spawn_sync(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+
+static JSValue child_kill(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue child_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue child_get(JSContext* ctx, JSValueConst this_val, int magic);
+static void child_finalizer(JSRuntime* rt, JSValue val);
+
+static JSValue pipe_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue pipe_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue pipe_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue pipe_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue pipe_set_encoding(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue pipe_pipe(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue pipe_get(JSContext* ctx, JSValueConst this_val, int magic);
+static void pipe_finalizer(JSRuntime* rt, JSValue val);
+
+static bool parse_options(JSContext* ctx, int kind, bool strings, int argc, JSValueConst* argv, cp_options_t* out);
+static bool parse_stdio(JSContext* ctx, JSValueConst value, int kind, cp_options_t* out);
+static bool parse_env(JSContext* ctx, JSValueConst value, cp_options_t* out);
+static bool parse_signal(JSContext* ctx, JSValueConst value, int* out);
+static const char* signal_name(int signum);
+static void options_init(cp_options_t* options);
+static void options_fill(cp_options_t* options, uv_process_options_t* out, uv_stdio_container_t* stdio, const int* child_fds);
+static void options_drop(cp_options_t* options);
+static char* to_string(JSContext* ctx, JSValueConst value);
+static void list_push(char*** list, size_t* count, char* str);
+
+static void collect_start(cp_collect_t* collect, uv_loop_t* loop);
+static void collect_kill(cp_collect_t* collect, int err);
+static void collect_close(cp_collect_t* collect, uv_handle_t* handle);
+static void collect_close_pipe(cp_collect_t* collect, int n);
+static void collect_close_cb(uv_handle_t* handle);
+static void collect_closed(cp_collect_t* collect);
+static void collect_spawn_cb(cp_launch_t* launch);
+static void collect_exit_cb(cp_launch_t* launch);
+static void collect_launch_close_cb(cp_launch_t* launch);
+static void collect_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+static void collect_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+static void collect_write_cb(uv_write_t* req, int status);
+static void collect_timer_cb(uv_timer_t* timer);
+static bool collect_failed(cp_collect_t* collect);
+static JSValue collect_output(JSContext* ctx, cp_collect_t* collect, int n);
+static JSValue collect_error(JSContext* ctx, cp_collect_t* collect, JSValueConst stdout_value, JSValueConst stderr_value);
+static void collect_drop(cp_collect_t* collect);
+static void exec_done_cb(cp_collect_t* collect);
+static void exec_settle(JSContext* ctx, cp_collect_t* collect);
+static void exec_cleanup_cb(veil_cleanup_t* cleanup);
+
+static void child_spawn_cb(cp_launch_t* launch);
+static void child_exit_cb(cp_launch_t* launch);
+static void child_close(cp_child_t* child);
+static void child_close_cb(cp_launch_t* launch);
+static void child_maybe_finish(cp_child_t* child);
+static void child_cleanup_cb(veil_cleanup_t* cleanup);
+static JSValue emit_spawn_error(JSContext* ctx, int argc, JSValueConst* argv);
+
+static cp_pipe_t* pipe_new(JSContext* ctx, cp_child_t* child, bool readable, JSValue* object);
+static void pipe_start_reading(cp_pipe_t* pipe);
+static void pipe_fail(cp_pipe_t* pipe, int err, const char* syscall);
+static void pipe_destroy_now(cp_pipe_t* pipe);
+static void pipe_maybe_finish(cp_pipe_t* pipe);
+static void pipe_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+static void pipe_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+static void pipe_write_cb(uv_write_t* req, int status);
+static void pipe_shutdown_cb(uv_shutdown_t* req, int status);
+static void pipe_close_cb(uv_handle_t* handle);
+static void pipe_cleanup_cb(veil_cleanup_t* cleanup);
+static int pipe_open_stdio(uv_pipe_t* pipe, int n, int* child_fd);
+static int pipe_dup_fd(cp_pipe_t* pipe, int* fd);
+
+static cp_launch_t* launch_start(uv_loop_t* loop, const uv_process_options_t* options, const int* child_fds, void* data);
+static int launch_kill(cp_launch_t* launch, int signum);
+static void launch_close(cp_launch_t* launch);
+static void launch_async_cb(uv_async_t* handle);
+static void launch_async_close_cb(uv_handle_t* handle);
+static void launch_run(cp_launch_t* launch);
+static void launch_post(cp_launch_t* launch);
+static void launch_exit_cb(uv_process_t* process, int64_t exit_status, int term_signal);
+static void launch_process_close_cb(uv_handle_t* handle);
+static void launch_close_fds(cp_launch_t* launch);
+static void launch_unref(cp_launch_t* launch);
+static void spawner_init();
+static void spawner_main(void* arg);
+static void spawner_async_cb(uv_async_t* handle);
+static char** strv_copy(char** strv);
+static void strv_free(char** strv);
+
+#ifndef _WIN32
+static int pump_start(cp_pipe_t* source, cp_pipe_t* dest, int fd, const char* path);
+static void pump_run(cp_pump_t* pump);
+static ssize_t pump_fill(cp_pump_t* pump);
+static ssize_t pump_drain(cp_pump_t* pump);
+static void pump_stop_splice(cp_pump_t* pump);
+static void pump_watch(cp_pump_t* pump);
+static void pump_finish(cp_pump_t* pump, int err);
+static void pump_poll_cb(uv_poll_t* poll, int status, int events);
+static void pump_close_cb(uv_handle_t* handle);
+static void pump_cleanup_cb(veil_cleanup_t* cleanup);
+#endif
+
+static void emit_error(JSContext* ctx, JSValueConst obj, int err, const char* syscall);
+static void emit_error_value(JSContext* ctx, JSValueConst obj, JSValue error);
+
+enum {
+  CHILD_PID,
+  CHILD_EXIT_CODE,
+  CHILD_SIGNAL_CODE,
+  CHILD_KILLED,
+};
+
+enum {
+  PIPE_WRITABLE_LENGTH,
+  PIPE_WRITABLE_NEED_DRAIN,
+  PIPE_DESTROYED,
+};
+
+// no gc_mark: the only JSValue either class holds is its own object, which
+// is a root until the handles have closed
+static const JSClassDef CHILD_CLASS = {
+  "ChildProcess",
+  .finalizer = child_finalizer,
+};
+
+static const JSClassDef PIPE_CLASS = {
+  "Pipe",
+  .finalizer = pipe_finalizer,
+};
+
+static const JSCFunctionListEntry CHILD_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("kill", 1, child_kill),
+  JS_CFUNC_MAGIC_DEF("ref", 0, child_ref, true),
+  JS_CFUNC_MAGIC_DEF("unref", 0, child_ref, false),
+  JS_CGETSET_MAGIC_DEF("pid", child_get, NULL, CHILD_PID),
+  JS_CGETSET_MAGIC_DEF("exitCode", child_get, NULL, CHILD_EXIT_CODE),
+  JS_CGETSET_MAGIC_DEF("signalCode", child_get, NULL, CHILD_SIGNAL_CODE),
+  JS_CGETSET_MAGIC_DEF("killed", child_get, NULL, CHILD_KILLED),
+};
+
+static const JSCFunctionListEntry PIPE_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("write", 2, pipe_write),
+  JS_CFUNC_DEF("end", 2, pipe_end),
+  JS_CFUNC_DEF("destroy", 0, pipe_destroy),
+  JS_CFUNC_MAGIC_DEF("pause", 0, pipe_pause, true),
+  JS_CFUNC_MAGIC_DEF("resume", 0, pipe_pause, false),
+  JS_CFUNC_DEF("setEncoding", 1, pipe_set_encoding),
+  JS_CFUNC_DEF("pipe", 1, pipe_pipe),
+  JS_CGETSET_MAGIC_DEF("writableLength", pipe_get, NULL, PIPE_WRITABLE_LENGTH),
+  JS_CGETSET_MAGIC_DEF("writableNeedDrain", pipe_get, NULL, PIPE_WRITABLE_NEED_DRAIN),
+  JS_CGETSET_MAGIC_DEF("destroyed", pipe_get, NULL, PIPE_DESTROYED),
+};
+
+static const JSCFunctionListEntry CHILD_PROCESS[] = {
+  JS_CFUNC_DEF("spawn", 3, cp_spawn),
+  JS_CFUNC_MAGIC_DEF("exec", 3, cp_exec, CP_EXEC),
+  JS_CFUNC_MAGIC_DEF("execFile", 4, cp_exec, CP_EXEC_FILE),
+  JS_CFUNC_MAGIC_DEF("spawnSync", 3, cp_spawn_sync, CP_SPAWN),
+  JS_CFUNC_MAGIC_DEF("execSync", 2, cp_spawn_sync, CP_EXEC),
+  JS_CFUNC_MAGIC_DEF("execFileSync", 3, cp_spawn_sync, CP_EXEC_FILE),
+};
+
+static const struct { const char* name; int signum; } SIGNALS[] = {
+  { "SIGTERM", SIGTERM },
+  { "SIGINT", SIGINT },
+#ifdef SIGKILL
+  { "SIGKILL", SIGKILL },
+#endif
+#ifdef SIGHUP
+  { "SIGHUP", SIGHUP },
+#endif
+#ifdef SIGQUIT
+  { "SIGQUIT", SIGQUIT },
+#endif
+#ifdef SIGUSR1
+  { "SIGUSR1", SIGUSR1 },
+#endif
+#ifdef SIGUSR2
+  { "SIGUSR2", SIGUSR2 },
+#endif
+#ifdef SIGSTOP
+  { "SIGSTOP", SIGSTOP },
+#endif
+#ifdef SIGCONT
+  { "SIGCONT", SIGCONT },
+#endif
+#ifdef SIGPIPE
+  { "SIGPIPE", SIGPIPE },
+#endif
+#ifdef SIGALRM
+  { "SIGALRM", SIGALRM },
+#endif
+  { "SIGABRT", SIGABRT },
+  { "SIGSEGV", SIGSEGV },
+};
+
+JSModuleDef* veil_child_process_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, child_process_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, CHILD_PROCESS, countof(CHILD_PROCESS));
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+static void global_init() {
+  JS_NewClassID(&child_class_id);
+  JS_NewClassID(&pipe_class_id);
+#ifndef _WIN32
+  // as in node, a child that goes away mid-write is an EPIPE, not a signal
+  // that kills the parent
+  signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+static int child_process_module_init(JSContext* ctx, JSModuleDef* m) {
+  JSRuntime* rt = JS_GetRuntime(ctx);
+  JSValue proto;
+  JSValue child_process;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, child_class_id)) {
+    JS_NewClass(rt, child_class_id, &CHILD_CLASS);
+    JS_NewClass(rt, pipe_class_id, &PIPE_CLASS);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, CHILD_PROTO, countof(CHILD_PROTO));
+  JS_SetClassProto(ctx, child_class_id, proto);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, PIPE_PROTO, countof(PIPE_PROTO));
+  JS_SetClassProto(ctx, pipe_class_id, proto);
+
+  child_process = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, child_process, CHILD_PROCESS, countof(CHILD_PROCESS));
+
+  JS_SetModuleExportList(ctx, m, CHILD_PROCESS, countof(CHILD_PROCESS));
+  JS_SetModuleExport(ctx, m, "default", child_process);
+
+  return 0;
+}
+
+// spawn(file[, args][, options])
+static JSValue cp_spawn(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  uv_process_options_t process_options;
+  uv_stdio_container_t stdio[3];
+  cp_options_t options;
+  cp_child_t* child;
+  JSValue pipe_objects[3] = { JS_NULL, JS_NULL, JS_NULL };
+  int child_fds[3] = { -1, -1, -1 };
+  JSValue obj;
+  JSValue error;
+  int err = 0;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "child_process requires an event loop");
+  }
+
+  if (!parse_options(ctx, CP_SPAWN, false, argc, argv, &options)) {
+    return JS_EXCEPTION;
+  }
+
+  obj = JS_NewObjectClass(ctx, child_class_id);
+  if (JS_IsException(obj)) {
+    options_drop(&options);
+    return obj;
+  }
+
+  child = calloc(1, sizeof(cp_child_t));
+  CHECK_NOT_NULL(child);
+  child->vm = vm;
+  child->object = JS_DupValue(ctx, obj);
+  for (int n = 0; n < 3; n++) {
+    child->inherited[n] = JS_UNDEFINED;
+  }
+  JS_SetOpaque(obj, child);
+
+  for (int n = 0; n < 3; n++) {
+    if (options.stdio[n].mode != CP_STDIO_PIPE) {
+      continue;
+    }
+
+    child->pipes[n] = pipe_new(ctx, child, n > 0, &pipe_objects[n]);
+    if (!child->pipes[n]) {
+      // nothing has started yet, so the pipes made so far just close
+      for (int i = 0; i < n; i++) {
+        if (!child->pipes[i]) {
+          continue;
+        }
+        child->pipes[i]->child = NULL;
+        child->pipes[i]->released = true;
+        pipe_destroy_now(child->pipes[i]);
+        JS_FreeValue(ctx, pipe_objects[i]);
+        if (child_fds[i] >= 0) {
+          uv_fs_t req;
+
+          uv_fs_close(NULL, &req, child_fds[i], NULL);
+        }
+      }
+      JS_FreeValue(ctx, child->object);
+      JS_FreeValue(ctx, obj);
+      options_drop(&options);
+      return JS_EXCEPTION;
+    }
+    child->open_pipes++;
+
+    if (!err) {
+      err = pipe_open_stdio(&child->pipes[n]->pipe, n, &child_fds[n]);
+    }
+  }
+
+  // the spawner gets a descriptor of its own for another child's stream,
+  // which stays open here until this child has it
+  for (int n = 0; n < 3 && !err; n++) {
+    if (options.stdio[n].mode == CP_STDIO_STREAM) {
+      err = pipe_dup_fd(options.stdio[n].pipe, &child_fds[n]);
+      if (!err) {
+        child->inherited[n] = JS_DupValue(ctx, options.stdio[n].pipe->object);
+      }
+    }
+  }
+
+  if (!err) {
+    options_fill(&options, &process_options, stdio, child_fds);
+    child->launch = launch_start(&vm->uv->loop, &process_options, child_fds, child);
+    child->launch->spawn_cb = child_spawn_cb;
+    child->launch->exit_cb = child_exit_cb;
+    child->launch->close_cb = child_close_cb;
+  } else {
+    // as in node, a failed spawn is an asynchronous 'error' and then 'close'
+    for (int n = 0; n < 3; n++) {
+      if (child->pipes[n]) {
+        child->pipes[n]->released = true;
+        pipe_destroy_now(child->pipes[n]);
+      }
+      if (child_fds[n] >= 0) {
+        uv_fs_t req;
+
+        uv_fs_close(NULL, &req, child_fds[n], NULL);
+      }
+      JS_FreeValue(ctx, child->inherited[n]);
+      child->inherited[n] = JS_UNDEFINED;
+    }
+    error = veil_builtin_new_uv_error(ctx, err, "spawn", options.file);
+    JS_EnqueueJob(ctx, emit_spawn_error, 2, (JSValueConst[]) { obj, error });
+    JS_FreeValue(ctx, error);
+  }
+
+  // a failed child closes once its 'error' is out
+  veil_vm_add_cleanup(vm, &child->cleanup, child_cleanup_cb);
+
+  JS_SetPropertyStr(ctx, obj, "stdin", pipe_objects[0]);
+  JS_SetPropertyStr(ctx, obj, "stdout", pipe_objects[1]);
+  JS_SetPropertyStr(ctx, obj, "stderr", pipe_objects[2]);
+  JS_SetPropertyStr(ctx, obj, "spawnfile", JS_NewString(ctx, options.file));
+  options_drop(&options);
+
+  return obj;
+}
+
+// exec(command[, options][, callback]) and
+// execFile(file[, args][, options][, callback]) call back with
+// (error, stdout, stderr); without a callback they return a promise of
+// { stdout, stderr }.
+static JSValue cp_exec(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  cp_collect_t* collect;
+  JSValue promise = JS_UNDEFINED;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "child_process requires an event loop");
+  }
+
+  collect = calloc(1, sizeof(cp_collect_t));
+  CHECK_NOT_NULL(collect);
+  collect->callback = JS_UNDEFINED;
+  collect->resolving_funcs[0] = JS_UNDEFINED;
+  collect->resolving_funcs[1] = JS_UNDEFINED;
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    collect->callback = JS_DupValue(ctx, argv[--argc]);
+  }
+
+  // as in node, the asynchronous calls default to UTF-8 and the *Sync() ones
+  // to Buffers
+  if (!parse_options(ctx, magic, true, argc, argv, &collect->options)) {
+    JS_FreeValue(ctx, collect->callback);
+    free(collect);
+    return JS_EXCEPTION;
+  }
+
+  if (JS_IsUndefined(collect->callback)) {
+    promise = JS_NewPromiseCapability(ctx, collect->resolving_funcs);
+    if (JS_IsException(promise)) {
+      collect_drop(collect);
+      free(collect);
+      return promise;
+    }
+  }
+
+  collect->vm = vm;
+  collect->done_cb = exec_done_cb;
+  veil_vm_add_cleanup(vm, &collect->cleanup, exec_cleanup_cb);
+  collect_start(collect, &vm->uv->loop);
+
+  return promise;
+}
+
+// spawnSync() returns { pid, status, signal, output, stdout, stderr, error };
+// execSync() and execFileSync() return stdout or throw.
+static JSValue cp_spawn_sync(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  cp_collect_t collect = { 0 };
+  uv_loop_t loop;
+  JSValue stdout_value;
+  JSValue stderr_value;
+  JSValue result;
+
+  if (!parse_options(ctx, magic, false, argc, argv, &collect.options)) {
+    return JS_EXCEPTION;
+  }
+
+  CHECK_OK(uv_loop_init(&loop));
+  collect_start(&collect, &loop);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  CHECK_OK(uv_loop_close(&loop));
+
+  stdout_value = collect_output(ctx, &collect, 1);
+  stderr_value = collect_output(ctx, &collect, 2);
+
+  if (magic == CP_SPAWN) {
+    JSValue output = JS_NewArray(ctx);
+
+    result = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, result, "pid", JS_NewInt32(ctx, collect.pid));
+    JS_SetPropertyStr(ctx, result, "status",
+        collect.exited && !collect.signal ? JS_NewInt64(ctx, collect.status) : JS_NULL);
+    JS_SetPropertyStr(ctx, result, "signal",
+        collect.signal ? JS_NewString(ctx, signal_name(collect.signal)) : JS_NULL);
+    JS_SetPropertyUint32(ctx, output, 0, JS_NULL);
+    JS_SetPropertyUint32(ctx, output, 1, JS_DupValue(ctx, stdout_value));
+    JS_SetPropertyUint32(ctx, output, 2, JS_DupValue(ctx, stderr_value));
+    JS_SetPropertyStr(ctx, result, "output", output);
+    JS_SetPropertyStr(ctx, result, "stdout", stdout_value);
+    JS_SetPropertyStr(ctx, result, "stderr", stderr_value);
+    if (collect.err) {
+      JS_SetPropertyStr(ctx, result, "error",
+          veil_builtin_new_uv_error(ctx, collect.err, collect.syscall, collect.options.file));
+    }
+  } else if (collect_failed(&collect)) {
+    result = JS_Throw(ctx, collect_error(ctx, &collect, stdout_value, stderr_value));
+    JS_FreeValue(ctx, stdout_value);
+    JS_FreeValue(ctx, stderr_value);
+  } else {
+    result = stdout_value;
+    JS_FreeValue(ctx, stderr_value);
+  }
+
+  collect_drop(&collect);
+
+  return result;
+}
+
+static JSValue child_kill(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  cp_child_t* child = JS_GetOpaque2(ctx, this_val, child_class_id);
+  int signum = SIGTERM;
+  int err;
+
+  if (!child) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && !parse_signal(ctx, argv[0], &signum)) {
+    return JS_EXCEPTION;
+  }
+
+  if (child->exited || child->closing) {
+    return JS_FALSE;
+  }
+
+  // before 'spawn' this waits with the spawner until the child exists
+  err = launch_kill(child->launch, signum);
+  if (err) {
+    emit_error(ctx, this_val, err, "kill");
+    return JS_FALSE;
+  }
+  child->killed = true;
+
+  return JS_TRUE;
+}
+
+static JSValue child_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  cp_child_t* child = JS_GetOpaque2(ctx, this_val, child_class_id);
+
+  if (!child) {
+    return JS_EXCEPTION;
+  }
+
+  if (!child->closing) {
+    if (magic) {
+      uv_ref((uv_handle_t*) &child->launch->async);
+    } else {
+      uv_unref((uv_handle_t*) &child->launch->async);
+    }
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue child_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  cp_child_t* child = JS_GetOpaque2(ctx, this_val, child_class_id);
+
+  if (!child) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case CHILD_PID:
+      return child->spawned ? JS_NewInt32(ctx, child->pid) : JS_UNDEFINED;
+    case CHILD_EXIT_CODE:
+      return child->exited && !child->term_signal ? JS_NewInt64(ctx, child->exit_code) : JS_NULL;
+    case CHILD_SIGNAL_CODE:
+      return child->term_signal ? JS_NewString(ctx, signal_name(child->term_signal)) : JS_NULL;
+    case CHILD_KILLED:
+      return JS_NewBool(ctx, child->killed);
+    default:
+      return JS_UNDEFINED;
+  }
+}
+
+static void child_finalizer(JSRuntime* rt, JSValue val) {
+  cp_child_t* child = JS_GetOpaque(val, child_class_id);
+
+  // the handle and the pipes hold a reference until they have closed
+  free(child);
+}
+
+static JSValue pipe_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  cp_pipe_t* pipe = JS_GetOpaque2(ctx, this_val, pipe_class_id);
+  JSValueConst data = argc > 0 ? argv[0] : JS_UNDEFINED;
+  cp_write_t* write;
+  uv_buf_t buf;
+  uint8_t* bytes;
+  size_t size;
+  int err;
+
+  if (!pipe) {
+    return JS_EXCEPTION;
+  }
+
+  if (pipe->readable) {
+    return JS_ThrowTypeError(ctx, "the stream is not writable");
+  }
+
+  if (pipe->closing || pipe->ending || pipe->pump) {
+    return JS_ThrowTypeError(ctx, "write after end");
+  }
+
+  write = calloc(1, sizeof(cp_write_t));
+  CHECK_NOT_NULL(write);
+  write->pipe = pipe;
+  write->keep = JS_UNDEFINED;
+  write->callback = argc > 1 && JS_IsFunction(ctx, argv[argc - 1]) ? JS_DupValue(ctx, argv[argc - 1]) : JS_UNDEFINED;
+
+  if (JS_IsString(data)) {
+    write->str = JS_ToCStringLen(ctx, &size, data);
+    bytes = (uint8_t*) write->str;
+  } else if (veil_builtin_get_bytes(ctx, data, &bytes, &size)) {
+    write->keep = JS_DupValue(ctx, data);
+  } else {
+    bytes = NULL;
+  }
+
+  if (!bytes) {
+    JS_FreeValue(ctx, write->callback);
+    free(write);
+    return JS_EXCEPTION;
+  }
+
+  write->size = size;
+  buf = uv_buf_init((char*) bytes, (unsigned int) size);
+  err = uv_write(&write->req, (uv_stream_t*) &pipe->pipe, &buf, 1, pipe_write_cb);
+  if (err) {
+    JS_FreeValue(ctx, write->keep);
+    JS_FreeValue(ctx, write->callback);
+    JS_FreeCString(ctx, write->str);
+    free(write);
+    pipe_fail(pipe, err, "write");
+    return JS_FALSE;
+  }
+
+  pipe->writable_length += size;
+  if (pipe->writable_length >= CP_HIGH_WATER_MARK) {
+    pipe->need_drain = true;
+    return JS_FALSE;
+  }
+
+  return JS_TRUE;
+}
+
+static JSValue pipe_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  cp_pipe_t* pipe = JS_GetOpaque2(ctx, this_val, pipe_class_id);
+  JSValue result;
+  int err;
+
+  if (!pipe) {
+    return JS_EXCEPTION;
+  }
+
+  if (pipe->readable || pipe->closing || pipe->ending || pipe->pump) {
+    return JS_DupValue(ctx, this_val);
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    veil_emitter_on(ctx, this_val, "finish", argv[--argc]);
+  }
+
+  if (argc > 0 && !JS_IsUndefined(argv[0]) && !JS_IsNull(argv[0])) {
+    result = pipe_write(ctx, this_val, 1, argv);
+    if (JS_IsException(result)) {
+      return result;
+    }
+    if (pipe->closing) {
+      return JS_DupValue(ctx, this_val);
+    }
+  }
+
+  // the shutdown goes out behind the writes in flight, and the child reads EOF
+  pipe->ending = true;
+  err = uv_shutdown(&pipe->shutdown, (uv_stream_t*) &pipe->pipe, pipe_shutdown_cb);
+  if (err) {
+    pipe_fail(pipe, err, "shutdown");
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue pipe_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  cp_pipe_t* pipe = JS_GetOpaque2(ctx, this_val, pipe_class_id);
+
+  if (!pipe) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && JS_IsObject(argv[0]) && !pipe->closing) {
+    pipe->had_error = true;
+    veil_emitter_emit(ctx, this_val, "error", 1, argv);
+  }
+
+  if (!pipe->pump) {
+    pipe_destroy_now(pipe);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue pipe_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  cp_pipe_t* pipe = JS_GetOpaque2(ctx, this_val, pipe_class_id);
+
+  if (!pipe) {
+    return JS_EXCEPTION;
+  }
+
+  // a paused child blocks once the pipe's kernel buffer is full
+  if (magic && !pipe->paused) {
+    pipe->paused = true;
+    if (pipe->readable && !pipe->closing) {
+      uv_read_stop((uv_stream_t*) &pipe->pipe);
+    }
+  } else if (!magic && pipe->paused) {
+    pipe->paused = false;
+    pipe_start_reading(pipe);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+// setEncoding('utf8') makes 'data' strings; any other encoding, or none,
+// gives Buffers.
+static JSValue pipe_set_encoding(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  cp_pipe_t* pipe = JS_GetOpaque2(ctx, this_val, pipe_class_id);
+  const char* encoding;
+
+  if (!pipe) {
+    return JS_EXCEPTION;
+  }
+
+  pipe->strings = false;
+  if (argc > 0 && JS_IsString(argv[0])) {
+    encoding = JS_ToCString(ctx, argv[0]);
+    if (!encoding) {
+      return JS_EXCEPTION;
+    }
+    pipe->strings = strcmp(encoding, "utf8") == 0 || strcmp(encoding, "utf-8") == 0;
+    JS_FreeCString(ctx, encoding);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+// pipe(destination) moves everything this stream reads to another child's
+// stdin, a file descriptor or a file path without surfacing it to JS. Both
+// streams leave JS for good: this one emits 'end' and the destination
+// 'finish' once the source reaches EOF, and then both emit 'close'.
+static JSValue pipe_pipe(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  cp_pipe_t* pipe = JS_GetOpaque2(ctx, this_val, pipe_class_id);
+
+  if (!pipe) {
+    return JS_EXCEPTION;
+  }
+
+  if (!pipe->readable) {
+    return JS_ThrowTypeError(ctx, "the stream is not readable");
+  }
+
+#ifdef _WIN32
+  return JS_Throw(ctx, veil_builtin_new_uv_error(ctx, UV_ENOTSUP, "pipe", NULL));
+#else
+  JSValueConst destination = argc > 0 ? argv[0] : JS_UNDEFINED;
+  cp_pipe_t* dest = NULL;
+  const char* path = NULL;
+  int32_t fd = -1;
+  int err;
+
+  if (pipe->closing || pipe->eof || pipe->pump) {
+    return JS_ThrowTypeError(ctx, "the stream is closed or already piped");
+  }
+
+  if (JS_IsString(destination)) {
+    path = JS_ToCString(ctx, destination);
+    if (!path) {
+      return JS_EXCEPTION;
+    }
+  } else if (JS_IsNumber(destination)) {
+    if (JS_ToInt32(ctx, &fd, destination) < 0) {
+      return JS_EXCEPTION;
+    }
+  } else {
+    dest = JS_GetOpaque(destination, pipe_class_id);
+    if (!dest || dest->readable) {
+      return JS_ThrowTypeError(ctx, "destination must be a child's stdin, a file descriptor or a path");
+    }
+    // the bytes would overtake what is still queued
+    if (dest->closing || dest->ending || dest->pump || dest->writable_length) {
+      return JS_ThrowTypeError(ctx, "destination is closed, ending or has writes in flight");
+    }
+  }
+
+  err = pump_start(pipe, dest, fd, path);
+  if (err) {
+    JSValue error = veil_builtin_new_uv_error(ctx, err, "pipe", path);
+
+    JS_FreeCString(ctx, path);
+    return JS_Throw(ctx, error);
+  }
+  JS_FreeCString(ctx, path);
+
+  return JS_DupValue(ctx, destination);
+#endif
+}
+
+static JSValue pipe_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  cp_pipe_t* pipe = JS_GetOpaque2(ctx, this_val, pipe_class_id);
+
+  if (!pipe) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case PIPE_WRITABLE_LENGTH:
+      return JS_NewInt64(ctx, (int64_t) pipe->writable_length);
+    case PIPE_WRITABLE_NEED_DRAIN:
+      return JS_NewBool(ctx, pipe->need_drain);
+    case PIPE_DESTROYED:
+      return JS_NewBool(ctx, pipe->closing);
+    default:
+      return JS_UNDEFINED;
+  }
+}
+
+static void pipe_finalizer(JSRuntime* rt, JSValue val) {
+  cp_pipe_t* pipe = JS_GetOpaque(val, pipe_class_id);
+
+  // the handle holds a reference until it has closed, so only memory is left
+  free(pipe);
+}
+
+// strings is the default for collected output, for when there is no encoding
+// option.
+static bool parse_options(JSContext* ctx, int kind, bool strings, int argc, JSValueConst* argv, cp_options_t* out) {
+  JSValueConst options = JS_UNDEFINED;
+  JSValueConst args = JS_UNDEFINED;
+  JSValue value;
+  char* command = NULL;
+  char* shell = NULL;
+  cstr cmd;
+  uint32_t length = 0;
+  double number = 0;
+
+  options_init(out);
+  out->strings = strings;
+
+  if (argc < 1 || !JS_IsString(argv[0])) {
+    JS_ThrowTypeError(ctx, kind == CP_EXEC ? "command must be a string" : "file must be a string");
+    return false;
+  }
+
+  if (kind != CP_EXEC && argc > 1 && JS_IsArray(ctx, argv[1])) {
+    args = argv[1];
+    options = argc > 2 ? argv[2] : JS_UNDEFINED;
+  } else {
+    options = argc > 1 ? argv[1] : JS_UNDEFINED;
+  }
+
+  if (!JS_IsUndefined(options) && !JS_IsNull(options) && !JS_IsObject(options)) {
+    JS_ThrowTypeError(ctx, "options must be an object");
+    return false;
+  }
+
+  command = to_string(ctx, argv[0]);
+  if (!command) {
+    return false;
+  }
+  list_push(&out->args, &out->arg_count, strdup(command));
+  cmd = cstr_from(command);
+
+  if (!JS_IsUndefined(args)) {
+    value = JS_GetPropertyStr(ctx, args, "length");
+    if (JS_ToUint32(ctx, &length, value) < 0) {
+      JS_FreeValue(ctx, value);
+      goto fail;
+    }
+    JS_FreeValue(ctx, value);
+  }
+
+  for (uint32_t n = 0; n < length; n++) {
+    char* arg;
+
+    value = JS_GetPropertyUint32(ctx, args, n);
+    arg = to_string(ctx, value);
+    JS_FreeValue(ctx, value);
+    if (!arg) {
+      goto fail;
+    }
+    cstr_append(&cmd, " ");
+    cstr_append(&cmd, arg);
+    list_push(&out->args, &out->arg_count, arg);
+  }
+
+  if (kind == CP_EXEC) {
+    shell = strdup("");
+  }
+
+  if (JS_IsObject(options)) {
+    value = JS_GetPropertyStr(ctx, options, "shell");
+    if (JS_IsString(value)) {
+      free(shell);
+      shell = to_string(ctx, value);
+      if (!shell) {
+        JS_FreeValue(ctx, value);
+        goto fail;
+      }
+    } else if (!JS_IsUndefined(value) && !shell && JS_ToBool(ctx, value)) {
+      shell = strdup("");
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "cwd");
+    if (!JS_IsUndefined(value) && !JS_IsNull(value) && !(out->cwd = to_string(ctx, value))) {
+      JS_FreeValue(ctx, value);
+      goto fail;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "env");
+    if (!parse_env(ctx, value, out)) {
+      JS_FreeValue(ctx, value);
+      goto fail;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "stdio");
+    if (!parse_stdio(ctx, value, kind, out)) {
+      JS_FreeValue(ctx, value);
+      goto fail;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "input");
+    if (JS_IsString(value)) {
+      size_t size;
+      const char* str = JS_ToCStringLen(ctx, &size, value);
+
+      if (!str) {
+        JS_FreeValue(ctx, value);
+        goto fail;
+      }
+      out->input = malloc(size + 1);
+      CHECK_NOT_NULL(out->input);
+      memcpy(out->input, str, size);
+      out->input_size = size;
+      JS_FreeCString(ctx, str);
+    } else if (!JS_IsUndefined(value) && !JS_IsNull(value)) {
+      uint8_t* bytes;
+      size_t size;
+
+      if (!veil_builtin_get_bytes(ctx, value, &bytes, &size)) {
+        JS_FreeValue(ctx, value);
+        goto fail;
+      }
+      out->input = malloc(size + 1);
+      CHECK_NOT_NULL(out->input);
+      memcpy(out->input, bytes, size);
+      out->input_size = size;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "timeout");
+    if (!JS_IsUndefined(value) && JS_ToFloat64(ctx, &number, value) < 0) {
+      JS_FreeValue(ctx, value);
+      goto fail;
+    }
+    if (!JS_IsUndefined(value) && number > 0) {
+      out->timeout = (uint64_t) number;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "killSignal");
+    if (!JS_IsUndefined(value) && !parse_signal(ctx, value, &out->kill_signal)) {
+      JS_FreeValue(ctx, value);
+      goto fail;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "maxBuffer");
+    if (!JS_IsUndefined(value) && JS_ToFloat64(ctx, &number, value) < 0) {
+      JS_FreeValue(ctx, value);
+      goto fail;
+    }
+    if (!JS_IsUndefined(value)) {
+      out->max_buffer = number >= (double) SIZE_MAX ? SIZE_MAX : number > 0 ? (size_t) number : 0;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "encoding");
+    if (JS_IsString(value)) {
+      const char* encoding = JS_ToCString(ctx, value);
+
+      if (!encoding) {
+        JS_FreeValue(ctx, value);
+        goto fail;
+      }
+      out->strings = strcmp(encoding, "buffer") != 0;
+      JS_FreeCString(ctx, encoding);
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "detached");
+    out->detached = JS_ToBool(ctx, value);
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "uid");
+    if (JS_IsNumber(value)) {
+      int32_t id;
+
+      JS_ToInt32(ctx, &id, value);
+      out->set_uid = true;
+      out->uid = (uv_uid_t) id;
+    }
+    JS_FreeValue(ctx, value);
+
+    value = JS_GetPropertyStr(ctx, options, "gid");
+    if (JS_IsNumber(value)) {
+      int32_t id;
+
+      JS_ToInt32(ctx, &id, value);
+      out->set_gid = true;
+      out->gid = (uv_gid_t) id;
+    }
+    JS_FreeValue(ctx, value);
+  }
+
+  // the arguments join the command line and the shell runs that
+  if (shell) {
+    for (size_t n = 0; n < out->arg_count; n++) {
+      free(out->args[n]);
+    }
+    free(out->args);
+    out->args = NULL;
+    out->arg_count = 0;
+#ifdef _WIN32
+    cstr quoted;
+
+    if (!*shell) {
+      const char* comspec = getenv("ComSpec");
+
+      free(shell);
+      shell = strdup(comspec ? comspec : "cmd.exe");
+    }
+    list_push(&out->args, &out->arg_count, strdup(shell));
+    list_push(&out->args, &out->arg_count, strdup("/d"));
+    list_push(&out->args, &out->arg_count, strdup("/s"));
+    list_push(&out->args, &out->arg_count, strdup("/c"));
+    quoted = cstr_from_fmt("\"%s\"", cstr_str(&cmd));
+    list_push(&out->args, &out->arg_count, strdup(cstr_str(&quoted)));
+    cstr_drop(&quoted);
+    out->verbatim = true;
+#else
+    if (!*shell) {
+      free(shell);
+      shell = strdup("/bin/sh");
+    }
+    list_push(&out->args, &out->arg_count, strdup(shell));
+    list_push(&out->args, &out->arg_count, strdup("-c"));
+    list_push(&out->args, &out->arg_count, strdup(cstr_str(&cmd)));
+#endif
+    out->file = shell;
+    free(command);
+  } else {
+    out->file = command;
+  }
+
+  out->cmd = strdup(cstr_str(&cmd));
+  cstr_drop(&cmd);
+
+  return true;
+
+fail:
+  free(command);
+  free(shell);
+  cstr_drop(&cmd);
+  options_drop(out);
+
+  return false;
+}
+
+// 'pipe', 'inherit', 'ignore' or an array of those, file descriptors and,
+// for spawn(), another child's Pipe, whose descriptor the child inherits.
+static bool parse_stdio(JSContext* ctx, JSValueConst value, int kind, cp_options_t* out) {
+  bool array = JS_IsArray(ctx, value);
+
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    return true;
+  }
+
+  for (int n = 0; n < 3; n++) {
+    JSValue item = array ? JS_GetPropertyUint32(ctx, value, (uint32_t) n) : JS_DupValue(ctx, value);
+    cp_stdio_t* stdio = &out->stdio[n];
+    cp_pipe_t* pipe;
+    bool ok = true;
+
+    if (JS_IsUndefined(item) || JS_IsNull(item)) {
+      stdio->mode = CP_STDIO_PIPE;
+    } else if (JS_IsNumber(item)) {
+      stdio->mode = CP_STDIO_FD;
+      ok = JS_ToInt32(ctx, &stdio->fd, item) == 0;
+    } else if (JS_IsString(item)) {
+      const char* str = JS_ToCString(ctx, item);
+
+      ok = str != NULL;
+      if (ok && strcmp(str, "pipe") == 0) {
+        stdio->mode = CP_STDIO_PIPE;
+      } else if (ok && strcmp(str, "inherit") == 0) {
+        stdio->mode = CP_STDIO_FD;
+        stdio->fd = n;
+      } else if (ok && strcmp(str, "ignore") == 0) {
+        stdio->mode = CP_STDIO_IGNORE;
+      } else if (ok) {
+        JS_ThrowTypeError(ctx, "unsupported stdio '%s'", str);
+        ok = false;
+      }
+      JS_FreeCString(ctx, str);
+    } else if (kind == CP_SPAWN && (pipe = JS_GetOpaque(item, pipe_class_id))) {
+      if (pipe->closing || pipe->pump || pipe->ending || pipe->writable_length) {
+        JS_ThrowTypeError(ctx, "stdio %d is closed, piped or has writes in flight", n);
+        ok = false;
+      }
+      stdio->mode = CP_STDIO_STREAM;
+      stdio->pipe = pipe;
+    } else {
+      JS_ThrowTypeError(ctx, "unsupported stdio %d", n);
+      ok = false;
+    }
+    JS_FreeValue(ctx, item);
+
+    if (!ok) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool parse_env(JSContext* ctx, JSValueConst value, cp_options_t* out) {
+  JSPropertyEnum* props;
+  uint32_t count;
+  bool ok = true;
+
+  if (!JS_IsObject(value)) {
+    return true;
+  }
+
+  if (JS_GetOwnPropertyNames(ctx, &props, &count, value, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+    return false;
+  }
+
+  // an empty environment is still an environment
+  list_push(&out->env, &out->env_count, NULL);
+  out->env_count = 0;
+
+  for (uint32_t n = 0; n < count && ok; n++) {
+    JSValue item = JS_GetProperty(ctx, value, props[n].atom);
+    const char* name = JS_AtomToCString(ctx, props[n].atom);
+    const char* str = name && !JS_IsUndefined(item) ? JS_ToCString(ctx, item) : NULL;
+
+    ok = name != NULL && (str != NULL || JS_IsUndefined(item));
+    if (str) {
+      cstr entry = cstr_from_fmt("%s=%s", name, str);
+
+      list_push(&out->env, &out->env_count, strdup(cstr_str(&entry)));
+      cstr_drop(&entry);
+    }
+    JS_FreeCString(ctx, name);
+    JS_FreeCString(ctx, str);
+    JS_FreeValue(ctx, item);
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    JS_FreeAtom(ctx, props[n].atom);
+  }
+  js_free(ctx, props);
+
+  return ok;
+}
+
+static bool parse_signal(JSContext* ctx, JSValueConst value, int* out) {
+  const char* name;
+
+  if (JS_IsNumber(value)) {
+    return JS_ToInt32(ctx, out, value) == 0;
+  }
+
+  name = JS_ToCString(ctx, value);
+  if (!name) {
+    return false;
+  }
+
+  for (size_t n = 0; n < countof(SIGNALS); n++) {
+    if (strcmp(name, SIGNALS[n].name) == 0) {
+      *out = SIGNALS[n].signum;
+      JS_FreeCString(ctx, name);
+      return true;
+    }
+  }
+
+  JS_ThrowTypeError(ctx, "unknown signal '%s'", name);
+  JS_FreeCString(ctx, name);
+
+  return false;
+}
+
+static const char* signal_name(int signum) {
+  for (size_t n = 0; n < countof(SIGNALS); n++) {
+    if (SIGNALS[n].signum == signum) {
+      return SIGNALS[n].name;
+    }
+  }
+
+  return "SIGUNKNOWN";
+}
+
+static void options_init(cp_options_t* options) {
+  memset(options, 0, sizeof(*options));
+  options->kill_signal = SIGTERM;
+  options->max_buffer = CP_DEFAULT_MAX_BUFFER;
+  for (int n = 0; n < 3; n++) {
+    options->stdio[n].mode = CP_STDIO_PIPE;
+  }
+}
+
+// Pipes and other children's streams reach the child as the descriptors in
+// child_fds.
+static void options_fill(cp_options_t* options, uv_process_options_t* out, uv_stdio_container_t* stdio, const int* child_fds) {
+  memset(out, 0, sizeof(*out));
+  out->file = options->file;
+  out->args = options->args;
+  out->env = options->env;
+  out->cwd = options->cwd;
+  out->stdio = stdio;
+  out->stdio_count = 3;
+  out->flags = UV_PROCESS_WINDOWS_HIDE;
+  if (options->detached) {
+    out->flags |= UV_PROCESS_DETACHED;
+  }
+  if (options->verbatim) {
+    out->flags |= UV_PROCESS_WINDOWS_VERBATIM_ARGUMENTS;
+  }
+  if (options->set_uid) {
+    out->flags |= UV_PROCESS_SETUID;
+    out->uid = options->uid;
+  }
+  if (options->set_gid) {
+    out->flags |= UV_PROCESS_SETGID;
+    out->gid = options->gid;
+  }
+
+  for (int n = 0; n < 3; n++) {
+    switch (options->stdio[n].mode) {
+      case CP_STDIO_PIPE:
+      case CP_STDIO_STREAM:
+        stdio[n].flags = UV_INHERIT_FD;
+        stdio[n].data.fd = child_fds[n];
+        break;
+      case CP_STDIO_IGNORE:
+        stdio[n].flags = UV_IGNORE;
+        break;
+      case CP_STDIO_FD:
+        stdio[n].flags = UV_INHERIT_FD;
+        stdio[n].data.fd = options->stdio[n].fd;
+        break;
+    }
+  }
+}
+
+static void options_drop(cp_options_t* options) {
+  for (size_t n = 0; n < options->arg_count; n++) {
+    free(options->args[n]);
+  }
+  for (size_t n = 0; n < options->env_count; n++) {
+    free(options->env[n]);
+  }
+  free(options->args);
+  free(options->env);
+  free(options->file);
+  free(options->cwd);
+  free(options->cmd);
+  free(options->input);
+  memset(options, 0, sizeof(*options));
+}
+
+static char* to_string(JSContext* ctx, JSValueConst value) {
+  const char* str = JS_ToCString(ctx, value);
+  char* copy;
+
+  if (!str) {
+    return NULL;
+  }
+
+  copy = strdup(str);
+  CHECK_NOT_NULL(copy);
+  JS_FreeCString(ctx, str);
+
+  return copy;
+}
+
+static void list_push(char*** list, size_t* count, char* str) {
+  *list = realloc(*list, (*count + 2) * sizeof(char*));
+  CHECK_NOT_NULL(*list);
+  (*list)[(*count)++] = str;
+  (*list)[*count] = NULL;
+}
+
+// Starts the child with its handles on loop; done_cb runs once they have all
+// closed.
+static void collect_start(cp_collect_t* collect, uv_loop_t* loop) {
+  cp_options_t* options = &collect->options;
+  uv_process_options_t process_options;
+  uv_stdio_container_t stdio[3];
+  int child_fds[3] = { -1, -1, -1 };
+  int err = 0;
+
+  collect->syscall = "spawn";
+
+  for (int n = 0; n < 3; n++) {
+    if (options->stdio[n].mode == CP_STDIO_PIPE) {
+      CHECK_OK(uv_pipe_init(loop, &collect->pipes[n], 0));
+      collect->pipes[n].data = collect;
+      collect->open_handles++;
+      if (!err) {
+        err = pipe_open_stdio(&collect->pipes[n], n, &child_fds[n]);
+      }
+    }
+  }
+
+  if (err) {
+    collect->err = err;
+    for (int n = 0; n < 3; n++) {
+      if (child_fds[n] >= 0) {
+        uv_fs_t req;
+
+        uv_fs_close(NULL, &req, child_fds[n], NULL);
+      }
+      collect_close_pipe(collect, n);
+    }
+    return;
+  }
+
+  options_fill(options, &process_options, stdio, child_fds);
+  collect->open_handles++;
+  collect->launch = launch_start(loop, &process_options, child_fds, collect);
+  collect->launch->spawn_cb = collect_spawn_cb;
+  collect->launch->exit_cb = collect_exit_cb;
+  collect->launch->close_cb = collect_launch_close_cb;
+}
+
+static void collect_spawn_cb(cp_launch_t* launch) {
+  cp_collect_t* collect = launch->data;
+  cp_options_t* options = &collect->options;
+  uv_loop_t* loop = launch->async.loop;
+  uv_buf_t buf;
+  int err;
+
+  if (launch->err) {
+    collect->err = launch->err;
+    launch_close(launch);
+    for (int n = 0; n < 3; n++) {
+      collect_close_pipe(collect, n);
+    }
+    return;
+  }
+
+  collect->pid = launch->pid;
+
+  for (int n = 1; n < 3; n++) {
+    if (options->stdio[n].mode == CP_STDIO_PIPE) {
+      err = uv_read_start((uv_stream_t*) &collect->pipes[n], collect_alloc_cb, collect_read_cb);
+      if (err) {
+        collect_kill(collect, err);
+        collect_close_pipe(collect, n);
+      }
+    }
+  }
+
+  if (options->stdio[0].mode == CP_STDIO_PIPE) {
+    buf = uv_buf_init((char*) options->input, (unsigned int) options->input_size);
+    if (!options->input_size
+        || uv_write(&collect->write, (uv_stream_t*) &collect->pipes[0], &buf, 1, collect_write_cb) != 0) {
+      collect_close_pipe(collect, 0);
+    }
+  }
+
+  if (options->timeout && !collect->exited) {
+    CHECK_OK(uv_timer_init(loop, &collect->timer));
+    collect->timer.data = collect;
+    collect->open_handles++;
+    CHECK_OK(uv_timer_start(&collect->timer, collect_timer_cb, options->timeout, 0));
+    collect->timer_active = true;
+  }
+}
+
+static void collect_kill(cp_collect_t* collect, int err) {
+  if (!collect->err) {
+    collect->err = err;
+  }
+
+  if (!collect->exited && !collect->killed && collect->launch) {
+    collect->killed = true;
+    launch_kill(collect->launch, collect->options.kill_signal);
+  }
+}
+
+static void collect_close(cp_collect_t* collect, uv_handle_t* handle) {
+  if (!uv_is_closing(handle)) {
+    uv_close(handle, collect_close_cb);
+  }
+}
+
+static void collect_close_pipe(cp_collect_t* collect, int n) {
+  if (collect->options.stdio[n].mode == CP_STDIO_PIPE) {
+    collect_close(collect, (uv_handle_t*) &collect->pipes[n]);
+  }
+}
+
+static void collect_close_cb(uv_handle_t* handle) {
+  collect_closed(handle->data);
+}
+
+static void collect_closed(cp_collect_t* collect) {
+  if (--collect->open_handles == 0 && collect->done_cb) {
+    collect->done_cb(collect);
+  }
+}
+
+static void collect_exit_cb(cp_launch_t* launch) {
+  cp_collect_t* collect = launch->data;
+
+  collect->exited = true;
+  collect->status = launch->status;
+  collect->signal = launch->term_signal;
+  launch_close(launch);
+
+  // the pipes close at EOF, which may come later from a grandchild
+  if (collect->timer_active) {
+    collect->timer_active = false;
+    collect_close(collect, (uv_handle_t*) &collect->timer);
+  }
+}
+
+static void collect_launch_close_cb(cp_launch_t* launch) {
+  cp_collect_t* collect = launch->data;
+
+  collect->launch = NULL;
+  collect_closed(collect);
+}
+
+static void collect_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  cp_collect_t* collect = handle->data;
+  cp_output_t* output = &collect->output[(uv_pipe_t*) handle == &collect->pipes[1] ? 1 : 2];
+
+  if (output->capacity - output->size < CP_READ_SIZE) {
+    output->capacity = output->capacity * 2 > output->size + CP_READ_SIZE
+        ? output->capacity * 2 : output->size + CP_READ_SIZE;
+    output->data = realloc(output->data, output->capacity);
+    CHECK_NOT_NULL(output->data);
+  }
+
+  *buf = uv_buf_init(output->data + output->size, (unsigned int) (output->capacity - output->size));
+}
+
+static void collect_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  cp_collect_t* collect = stream->data;
+  int n = (uv_pipe_t*) stream == &collect->pipes[1] ? 1 : 2;
+  cp_output_t* output = &collect->output[n];
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    if (nread != UV_EOF && !collect->err) {
+      collect->err = (int) nread;
+      collect->syscall = "read";
+    }
+    collect_close_pipe(collect, n);
+    return;
+  }
+
+  output->size += (size_t) nread;
+  if (output->size > collect->options.max_buffer) {
+    output->size = collect->options.max_buffer;
+    collect->syscall = "read";
+    collect_kill(collect, UV_ENOBUFS);
+    collect_close_pipe(collect, n);
+  }
+}
+
+static void collect_write_cb(uv_write_t* req, int status) {
+  cp_collect_t* collect = container_of(req, cp_collect_t, write);
+
+  // a child that exits without reading its input is not an error
+  collect_close_pipe(collect, 0);
+}
+
+static void collect_timer_cb(uv_timer_t* timer) {
+  cp_collect_t* collect = timer->data;
+
+  collect->syscall = "spawn";
+  collect_kill(collect, UV_ETIMEDOUT);
+  collect->timer_active = false;
+  collect_close(collect, (uv_handle_t*) timer);
+}
+
+static bool collect_failed(cp_collect_t* collect) {
+  return collect->err || collect->signal || collect->status;
+}
+
+static JSValue collect_output(JSContext* ctx, cp_collect_t* collect, int n) {
+  cp_output_t* output = &collect->output[n];
+  JSValue value;
+
+  if (collect->options.stdio[n].mode != CP_STDIO_PIPE) {
+    return JS_NULL;
+  }
+
+  if (collect->options.strings) {
+    value = JS_NewStringLen(ctx, output->data ? output->data : "", output->size);
+    free(output->data);
+  } else {
+    // the Buffer takes the memory over
+    value = veil_buffer_new(ctx, output->data ? (uint8_t*) output->data : malloc(1), output->size);
+  }
+  output->data = NULL;
+  output->size = output->capacity = 0;
+
+  return value;
+}
+
+// As node's: a uv error when spawning or collecting failed, otherwise
+// "Command failed", with the exit status, signal and output attached.
+static JSValue collect_error(JSContext* ctx, cp_collect_t* collect, JSValueConst stdout_value, JSValueConst stderr_value) {
+  JSValue error;
+
+  if (collect->err) {
+    error = veil_builtin_new_uv_error(ctx, collect->err, collect->syscall, collect->options.file);
+  } else {
+    cstr message = cstr_from_fmt("Command failed: %s", collect->options.cmd);
+
+    error = JS_NewError(ctx);
+    JS_SetPropertyStr(ctx, error, "message", JS_NewStringLen(ctx, cstr_str(&message), cstr_size(&message)));
+    JS_SetPropertyStr(ctx, error, "code",
+        collect->signal ? JS_NULL : JS_NewInt64(ctx, collect->status));
+    cstr_drop(&message);
+  }
+
+  JS_SetPropertyStr(ctx, error, "cmd", JS_NewString(ctx, collect->options.cmd));
+  JS_SetPropertyStr(ctx, error, "pid", JS_NewInt32(ctx, collect->pid));
+  JS_SetPropertyStr(ctx, error, "status",
+      collect->exited && !collect->signal ? JS_NewInt64(ctx, collect->status) : JS_NULL);
+  JS_SetPropertyStr(ctx, error, "signal",
+      collect->signal ? JS_NewString(ctx, signal_name(collect->signal)) : JS_NULL);
+  JS_SetPropertyStr(ctx, error, "killed", JS_NewBool(ctx, collect->killed));
+  JS_SetPropertyStr(ctx, error, "stdout", JS_DupValue(ctx, stdout_value));
+  JS_SetPropertyStr(ctx, error, "stderr", JS_DupValue(ctx, stderr_value));
+
+  return error;
+}
+
+// Frees the native state; JS values are released by the caller or the VM.
+static void collect_drop(cp_collect_t* collect) {
+  for (int n = 0; n < 3; n++) {
+    free(collect->output[n].data);
+    collect->output[n].data = NULL;
+  }
+  options_drop(&collect->options);
+}
+
+static void exec_done_cb(cp_collect_t* collect) {
+  // the VM is gone and has already released the JS values
+  if (collect->vm) {
+    JSContext* ctx = collect->vm->context;
+
+    veil_vm_remove_cleanup(&collect->cleanup);
+    exec_settle(ctx, collect);
+    JS_FreeValue(ctx, collect->callback);
+    JS_FreeValue(ctx, collect->resolving_funcs[0]);
+    JS_FreeValue(ctx, collect->resolving_funcs[1]);
+  }
+
+  collect_drop(collect);
+  free(collect);
+}
+
+static void exec_settle(JSContext* ctx, cp_collect_t* collect) {
+  JSValue stdout_value = collect_output(ctx, collect, 1);
+  JSValue stderr_value = collect_output(ctx, collect, 2);
+  JSValue error = collect_failed(collect) ? collect_error(ctx, collect, stdout_value, stderr_value) : JS_NULL;
+  JSValue result;
+
+  if (JS_IsUndefined(collect->callback)) {
+    if (JS_IsNull(error)) {
+      JSValue value = JS_NewObject(ctx);
+
+      JS_SetPropertyStr(ctx, value, "stdout", JS_DupValue(ctx, stdout_value));
+      JS_SetPropertyStr(ctx, value, "stderr", JS_DupValue(ctx, stderr_value));
+      result = JS_Call(ctx, collect->resolving_funcs[0], JS_UNDEFINED, 1, (JSValueConst*) &value);
+      JS_FreeValue(ctx, value);
+    } else {
+      result = JS_Call(ctx, collect->resolving_funcs[1], JS_UNDEFINED, 1, (JSValueConst*) &error);
+    }
+  } else {
+    result = JS_Call(ctx, collect->callback, JS_UNDEFINED, 3, (JSValueConst[]) { error, stdout_value, stderr_value });
+  }
+
+  if (JS_IsException(result)) {
+    veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+  }
+
+  JS_FreeValue(ctx, result);
+  JS_FreeValue(ctx, error);
+  JS_FreeValue(ctx, stdout_value);
+  JS_FreeValue(ctx, stderr_value);
+}
+
+static void exec_cleanup_cb(veil_cleanup_t* cleanup) {
+  cp_collect_t* collect = container_of(cleanup, cp_collect_t, cleanup);
+
+  // As with spawn(), the child is left running. Its handles close before
+  // the loop does, and the last one frees the collection.
+  JS_FreeValue(collect->vm->context, collect->callback);
+  JS_FreeValue(collect->vm->context, collect->resolving_funcs[0]);
+  JS_FreeValue(collect->vm->context, collect->resolving_funcs[1]);
+  collect->vm = NULL;
+
+  if (collect->launch) {
+    launch_close(collect->launch);
+  }
+  for (int n = 0; n < 3; n++) {
+    collect_close_pipe(collect, n);
+  }
+  if (collect->timer_active) {
+    collect->timer_active = false;
+    collect_close(collect, (uv_handle_t*) &collect->timer);
+  }
+}
+
+static void child_spawn_cb(cp_launch_t* launch) {
+  cp_child_t* child = launch->data;
+  JSContext* ctx = child->vm->context;
+  JSValue error;
+
+  if (launch->err) {
+    for (int n = 0; n < 3; n++) {
+      if (child->pipes[n]) {
+        child->pipes[n]->released = true;
+        pipe_destroy_now(child->pipes[n]);
+      }
+      JS_FreeValue(ctx, child->inherited[n]);
+      child->inherited[n] = JS_UNDEFINED;
+    }
+    error = veil_builtin_new_uv_error(ctx, launch->err, "spawn", launch->process_options.file);
+    emit_error_value(ctx, child->object, error);
+    child_close(child);
+    return;
+  }
+
+  child->spawned = true;
+  child->pid = launch->pid;
+  for (int n = 0; n < 3; n++) {
+    // an inherited stream now belongs to this child
+    if (!JS_IsUndefined(child->inherited[n])) {
+      cp_pipe_t* pipe = JS_GetOpaque(child->inherited[n], pipe_class_id);
+
+      if (pipe) {
+        pipe_destroy_now(pipe);
+      }
+      JS_FreeValue(ctx, child->inherited[n]);
+      child->inherited[n] = JS_UNDEFINED;
+    }
+    if (child->pipes[n] && child->pipes[n]->readable) {
+      pipe_start_reading(child->pipes[n]);
+    }
+  }
+
+  veil_emitter_emit(ctx, child->object, "spawn", 0, NULL);
+}
+
+static void child_exit_cb(cp_launch_t* launch) {
+  cp_child_t* child = launch->data;
+  JSContext* ctx = child->vm->context;
+  JSValue args[2];
+
+  child->exited = true;
+  child->exit_code = launch->status;
+  child->term_signal = launch->term_signal;
+
+  // nothing reads the child's stdin any more
+  if (child->pipes[0] && !child->pipes[0]->pump) {
+    pipe_destroy_now(child->pipes[0]);
+  }
+
+  args[0] = child->term_signal ? JS_NULL : JS_NewInt64(ctx, child->exit_code);
+  args[1] = child->term_signal ? JS_NewString(ctx, signal_name(child->term_signal)) : JS_NULL;
+  veil_emitter_emit(ctx, child->object, "exit", 2, args);
+  JS_FreeValue(ctx, args[1]);
+
+  child_close(child);
+}
+
+static void child_close(cp_child_t* child) {
+  if (child->closing) {
+    return;
+  }
+
+  child->closing = true;
+  veil_vm_remove_cleanup(&child->cleanup);
+
+  for (int n = 0; n < 3; n++) {
+    JS_FreeValue(child->vm->context, child->inherited[n]);
+    child->inherited[n] = JS_UNDEFINED;
+  }
+
+  if (child->launch) {
+    launch_close(child->launch);
+  } else {
+    // the spawn failed before there was anything to launch
+    child->closed = true;
+    child_maybe_finish(child);
+  }
+}
+
+static void child_close_cb(cp_launch_t* launch) {
+  cp_child_t* child = launch->data;
+
+  child->launch = NULL;
+  child->closed = true;
+  child_maybe_finish(child);
+}
+
+// 'close' follows 'exit' once the child's stdio has closed too.
+static void child_maybe_finish(cp_child_t* child) {
+  JSContext* ctx = child->vm->context;
+  JSValue object = child->object;
+  JSValue args[2];
+
+  if (!child->closed || child->open_pipes || child->finished) {
+    return;
+  }
+
+  child->finished = true;
+  if (!child->released) {
+    args[0] = child->exited && !child->term_signal ? JS_NewInt64(ctx, child->exit_code) : JS_NULL;
+    args[1] = child->term_signal ? JS_NewString(ctx, signal_name(child->term_signal)) : JS_NULL;
+    veil_emitter_emit(ctx, object, "close", 2, args);
+    JS_FreeValue(ctx, args[1]);
+  }
+
+  // the last reference can run the finalizer, which frees child
+  child->object = JS_UNDEFINED;
+  JS_FreeValue(ctx, object);
+}
+
+// Exiting does not kill children, as in node; only the handle goes away.
+static void child_cleanup_cb(veil_cleanup_t* cleanup) {
+  cp_child_t* child = container_of(cleanup, cp_child_t, cleanup);
+
+  child->released = true;
+  child_close(child);
+}
+
+static JSValue emit_spawn_error(JSContext* ctx, int argc, JSValueConst* argv) {
+  cp_child_t* child = JS_GetOpaque(argv[0], child_class_id);
+
+  if (child && !child->released) {
+    emit_error_value(ctx, argv[0], JS_DupValue(ctx, argv[1]));
+    child_close(child);
+  }
+
+  return JS_UNDEFINED;
+}
+
+static cp_pipe_t* pipe_new(JSContext* ctx, cp_child_t* child, bool readable, JSValue* object) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  cp_pipe_t* pipe;
+  JSValue obj = JS_NewObjectClass(ctx, pipe_class_id);
+
+  if (JS_IsException(obj)) {
+    return NULL;
+  }
+
+  pipe = calloc(1, sizeof(cp_pipe_t));
+  CHECK_NOT_NULL(pipe);
+  pipe->vm = vm;
+  pipe->child = child;
+  pipe->readable = readable;
+  CHECK_OK(uv_pipe_init(&vm->uv->loop, &pipe->pipe, 0));
+  pipe->pipe.data = pipe;
+  pipe->object = JS_DupValue(ctx, obj);
+  JS_SetOpaque(obj, pipe);
+  veil_vm_add_cleanup(vm, &pipe->cleanup, pipe_cleanup_cb);
+
+  *object = obj;
+
+  return pipe;
+}
+
+static void pipe_start_reading(cp_pipe_t* pipe) {
+  int err;
+
+  if (!pipe->readable || pipe->paused || pipe->closing || pipe->eof || pipe->pump) {
+    return;
+  }
+
+  err = uv_read_start((uv_stream_t*) &pipe->pipe, pipe_alloc_cb, pipe_read_cb);
+  if (err) {
+    pipe_fail(pipe, err, "read");
+  }
+}
+
+static void pipe_fail(cp_pipe_t* pipe, int err, const char* syscall) {
+  if (pipe->closing) {
+    return;
+  }
+
+  pipe->had_error = true;
+  if (!pipe->released) {
+    emit_error(pipe->vm->context, pipe->object, err, syscall);
+  }
+  pipe_destroy_now(pipe);
+}
+
+static void pipe_destroy_now(cp_pipe_t* pipe) {
+  if (pipe->closing) {
+    return;
+  }
+
+  pipe->closing = true;
+  veil_vm_remove_cleanup(&pipe->cleanup);
+
+  // writes in flight and the shutdown complete with UV_ECANCELED first
+  uv_close((uv_handle_t*) &pipe->pipe, pipe_close_cb);
+}
+
+// A pipe is done once its handle has closed and any pump has finished with
+// its descriptor.
+static void pipe_maybe_finish(cp_pipe_t* pipe) {
+  JSContext* ctx = pipe->vm->context;
+  JSValue object = pipe->object;
+  cp_child_t* child = pipe->child;
+  JSValue had_error;
+
+  if (!pipe->closed || pipe->pump || pipe->done) {
+    return;
+  }
+
+  pipe->done = true;
+  if (!pipe->released) {
+    had_error = JS_NewBool(ctx, pipe->had_error);
+    veil_emitter_emit(ctx, object, "close", 1, &had_error);
+  }
+
+  pipe->child = NULL;
+  pipe->object = JS_UNDEFINED;
+  JS_FreeValue(ctx, object);
+
+  if (child) {
+    for (int n = 0; n < 3; n++) {
+      if (child->pipes[n] == pipe) {
+        child->pipes[n] = NULL;
+      }
+    }
+    child->open_pipes--;
+    child_maybe_finish(child);
+  }
+}
+
+static void pipe_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  cp_pipe_t* pipe = handle->data;
+  size_t size;
+  void* slab = veil_net_slab_acquire(pipe->vm, &size);
+
+  *buf = uv_buf_init(slab, (unsigned int) size);
+}
+
+static void pipe_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  cp_pipe_t* pipe = stream->data;
+  JSContext* ctx = pipe->vm->context;
+  JSValue data = JS_UNDEFINED;
+
+  if (nread > 0) {
+    if (pipe->strings) {
+      data = JS_NewStringLen(ctx, buf->base, (size_t) nread);
+    } else {
+      uint8_t* bytes = malloc((size_t) nread);
+
+      CHECK_NOT_NULL(bytes);
+      memcpy(bytes, buf->base, (size_t) nread);
+      data = veil_buffer_new(ctx, bytes, (size_t) nread);
+    }
+  }
+
+  if (buf->base) {
+    veil_net_slab_release(pipe->vm, buf->base);
+  }
+
+  if (nread > 0) {
+    if (JS_IsException(data)) {
+      veil_vm_dump_exception(pipe->vm);
+      return;
+    }
+    veil_emitter_emit(ctx, pipe->object, "data", 1, (JSValueConst*) &data);
+    JS_FreeValue(ctx, data);
+    return;
+  }
+
+  if (nread == 0 || pipe->closing) {
+    return;
+  }
+
+  if (nread != UV_EOF) {
+    pipe_fail(pipe, (int) nread, "read");
+    return;
+  }
+
+  pipe->eof = true;
+  uv_read_stop(stream);
+  veil_emitter_emit(ctx, pipe->object, "end", 0, NULL);
+  pipe_destroy_now(pipe);
+}
+
+static void pipe_write_cb(uv_write_t* req, int status) {
+  cp_write_t* write = container_of(req, cp_write_t, req);
+  cp_pipe_t* pipe = write->pipe;
+  JSContext* ctx = pipe->vm->context;
+  JSValue error = JS_UNDEFINED;
+
+  pipe->writable_length -= write->size;
+
+  if (!pipe->released) {
+    if (status) {
+      error = veil_builtin_new_uv_error(ctx, status, "write", NULL);
+    }
+
+    if (JS_IsFunction(ctx, write->callback)) {
+      JSValue result = JS_Call(ctx, write->callback, pipe->object, 1, (JSValueConst*) &error);
+
+      if (JS_IsException(result)) {
+        veil_vm_dump_exception(pipe->vm);
+      }
+      JS_FreeValue(ctx, result);
+    }
+  }
+
+  JS_FreeValue(ctx, write->keep);
+  JS_FreeValue(ctx, write->callback);
+  JS_FreeCString(ctx, write->str);
+  free(write);
+
+  if (pipe->released || pipe->closing) {
+    JS_FreeValue(ctx, error);
+    return;
+  }
+
+  if (status) {
+    pipe->had_error = true;
+    veil_emitter_emit(ctx, pipe->object, "error", 1, (JSValueConst*) &error);
+    JS_FreeValue(ctx, error);
+    pipe_destroy_now(pipe);
+    return;
+  }
+
+  if (pipe->need_drain && pipe->writable_length == 0) {
+    pipe->need_drain = false;
+    veil_emitter_emit(ctx, pipe->object, "drain", 0, NULL);
+  }
+}
+
+static void pipe_shutdown_cb(uv_shutdown_t* req, int status) {
+  cp_pipe_t* pipe = container_of(req, cp_pipe_t, shutdown);
+
+  if (pipe->closing) {
+    return;
+  }
+
+  if (status) {
+    pipe_fail(pipe, status, "shutdown");
+    return;
+  }
+
+  veil_emitter_emit(pipe->vm->context, pipe->object, "finish", 0, NULL);
+  pipe_destroy_now(pipe);
+}
+
+static void pipe_close_cb(uv_handle_t* handle) {
+  cp_pipe_t* pipe = handle->data;
+
+  pipe->closed = true;
+  pipe_maybe_finish(pipe);
+}
+
+static void pipe_cleanup_cb(veil_cleanup_t* cleanup) {
+  cp_pipe_t* pipe = container_of(cleanup, cp_pipe_t, cleanup);
+
+  pipe->released = true;
+  pipe_destroy_now(pipe);
+}
+
+// Makes the pipe for stdio n, this end open on pipe and the child's end left
+// in child_fd. Sockets, as with UV_CREATE_PIPE, so that end() can shut the
+// child's stdin down; Windows has anonymous pipes instead.
+static int pipe_open_stdio(uv_pipe_t* pipe, int n, int* child_fd) {
+  uv_fs_t req;
+  int fds[2];
+  int err;
+
+#ifdef _WIN32
+  err = uv_pipe(fds, 0, 0);
+#else
+  err = uv_socketpair(SOCK_STREAM, 0, fds, 0, 0);
+#endif
+  if (err) {
+    return err;
+  }
+
+  // the child reads its stdin and writes the others
+  err = uv_pipe_open(pipe, n == 0 ? fds[1] : fds[0]);
+  if (err) {
+    uv_fs_close(NULL, &req, fds[0], NULL);
+    uv_fs_close(NULL, &req, fds[1], NULL);
+    return err;
+  }
+  *child_fd = n == 0 ? fds[0] : fds[1];
+
+  return 0;
+}
+
+// A descriptor of its own onto the pipe, for a child to inherit.
+static int pipe_dup_fd(cp_pipe_t* pipe, int* fd) {
+  uv_os_fd_t fileno;
+  int err = uv_fileno((uv_handle_t*) &pipe->pipe, &fileno);
+#ifdef _WIN32
+  HANDLE handle;
+#endif
+
+  if (err) {
+    return err;
+  }
+
+#ifdef _WIN32
+  if (!DuplicateHandle(GetCurrentProcess(), fileno, GetCurrentProcess(), &handle, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+    return uv_translate_sys_error((int) GetLastError());
+  }
+  *fd = _open_osfhandle((intptr_t) handle, 0);
+  if (*fd < 0) {
+    CloseHandle(handle);
+    return UV_EMFILE;
+  }
+#else
+  *fd = fcntl(fileno, F_DUPFD_CLOEXEC, 0);
+  if (*fd < 0) {
+    return uv_translate_sys_error(errno);
+  }
+#endif
+
+  return 0;
+}
+
+// The callbacks are set by the owner before its loop next runs.
+static cp_launch_t* launch_start(uv_loop_t* loop, const uv_process_options_t* options, const int* child_fds, void* data) {
+  cp_launch_t* launch = calloc(1, sizeof(cp_launch_t));
+
+  CHECK_NOT_NULL(launch);
+  uv_once(&spawner_once, spawner_init);
+
+  launch->process_options = *options;
+  launch->process_options.file = strdup(options->file);
+  CHECK_NOT_NULL(launch->process_options.file);
+  launch->process_options.args = strv_copy(options->args);
+  launch->process_options.env = strv_copy(options->env);
+  if (options->cwd) {
+    launch->process_options.cwd = strdup(options->cwd);
+    CHECK_NOT_NULL(launch->process_options.cwd);
+  }
+  memcpy(launch->stdio, options->stdio, sizeof(launch->stdio));
+  launch->process_options.stdio = launch->stdio;
+  launch->process_options.exit_cb = launch_exit_cb;
+  memcpy(launch->child_fds, child_fds, sizeof(launch->child_fds));
+  launch->process.data = launch;
+  launch->data = data;
+  // one for each loop
+  launch->refs = 2;
+
+  CHECK_OK(uv_async_init(loop, &launch->async, launch_async_cb));
+  launch->async.data = launch;
+
+  launch_post(launch);
+
+  return launch;
+}
+
+// Signals the child, once it exists if it does not yet.
+static int launch_kill(cp_launch_t* launch, int signum) {
+  int err = 0;
+
+  uv_mutex_lock(&spawner_mutex);
+  if (launch->exited || launch->err) {
+    err = UV_ESRCH;
+  } else {
+    launch->pending_signal = signum;
+  }
+  uv_mutex_unlock(&spawner_mutex);
+
+  if (!err) {
+    launch_post(launch);
+  }
+
+  return err;
+}
+
+// The owner is done with the launch; close_cb follows. A child already forked
+// runs on, reaped by the spawner, as in node.
+static void launch_close(cp_launch_t* launch) {
+  if (launch->released) {
+    return;
+  }
+
+  launch->released = true;
+
+  uv_mutex_lock(&spawner_mutex);
+  launch->closing = true;
+  uv_mutex_unlock(&spawner_mutex);
+
+  uv_close((uv_handle_t*) &launch->async, launch_async_close_cb);
+}
+
+static void launch_async_cb(uv_async_t* handle) {
+  cp_launch_t* launch = handle->data;
+  bool spawned;
+  bool exited;
+
+  uv_mutex_lock(&spawner_mutex);
+  spawned = launch->spawned;
+  exited = launch->exited;
+  uv_mutex_unlock(&spawner_mutex);
+
+  if (spawned && !launch->spawn_reported && !launch->released) {
+    launch->spawn_reported = true;
+    launch->spawn_cb(launch);
+  }
+
+  if (exited && !launch->exit_reported && !launch->released) {
+    launch->exit_reported = true;
+    launch->exit_cb(launch);
+  }
+}
+
+static void launch_async_close_cb(uv_handle_t* handle) {
+  cp_launch_t* launch = handle->data;
+
+  launch->close_cb(launch);
+  launch_unref(launch);
+}
+
+// On the spawner thread: forks the child the first time, then delivers any
+// pending kill.
+static void launch_run(cp_launch_t* launch) {
+  bool spawned;
+  bool closing;
+  int signum;
+  int err;
+
+  uv_mutex_lock(&spawner_mutex);
+  spawned = launch->spawned;
+  closing = launch->closing;
+  uv_mutex_unlock(&spawner_mutex);
+
+  if (!spawned) {
+    // an owner that went before the fork gets no child
+    err = closing ? UV_ECANCELED : uv_spawn(&spawner_loop, &launch->process, &launch->process_options);
+    launch_close_fds(launch);
+
+    // sent under the mutex, so that launch_close() cannot close the handle
+    // in between
+    uv_mutex_lock(&spawner_mutex);
+    launch->spawned = true;
+    launch->err = err;
+    launch->pid = err ? 0 : launch->process.pid;
+    if (!launch->closing) {
+      uv_async_send(&launch->async);
+    }
+    uv_mutex_unlock(&spawner_mutex);
+
+    if (err) {
+      // the process handle needs closing even when the spawn fails
+      if (closing) {
+        launch_unref(launch);
+      } else {
+        uv_close((uv_handle_t*) &launch->process, launch_process_close_cb);
+      }
+      return;
+    }
+  }
+
+  uv_mutex_lock(&spawner_mutex);
+  signum = launch->exited || launch->err ? 0 : launch->pending_signal;
+  launch->pending_signal = 0;
+  uv_mutex_unlock(&spawner_mutex);
+
+  if (signum) {
+    uv_process_kill(&launch->process, signum);
+  }
+}
+
+static void launch_post(cp_launch_t* launch) {
+  uv_mutex_lock(&spawner_mutex);
+  if (!launch->queued) {
+    launch->queued = true;
+    if (spawner_tail) {
+      spawner_tail->next = launch;
+    } else {
+      spawner_head = launch;
+    }
+    spawner_tail = launch;
+  }
+  uv_mutex_unlock(&spawner_mutex);
+
+  uv_async_send(&spawner_async);
+}
+
+static void launch_exit_cb(uv_process_t* process, int64_t exit_status, int term_signal) {
+  cp_launch_t* launch = process->data;
+
+  uv_mutex_lock(&spawner_mutex);
+  launch->exited = true;
+  launch->status = exit_status;
+  launch->term_signal = term_signal;
+  if (!launch->closing) {
+    uv_async_send(&launch->async);
+  }
+  uv_mutex_unlock(&spawner_mutex);
+
+  uv_close((uv_handle_t*) process, launch_process_close_cb);
+}
+
+static void launch_process_close_cb(uv_handle_t* handle) {
+  launch_unref(handle->data);
+}
+
+static void launch_close_fds(cp_launch_t* launch) {
+  uv_fs_t req;
+
+  for (int n = 0; n < 3; n++) {
+    if (launch->child_fds[n] >= 0) {
+      uv_fs_close(NULL, &req, launch->child_fds[n], NULL);
+      launch->child_fds[n] = -1;
+    }
+  }
+}
+
+static void launch_unref(cp_launch_t* launch) {
+  bool last;
+
+  uv_mutex_lock(&spawner_mutex);
+  last = --launch->refs == 0;
+  // a kill may still be queued for a child that has gone
+  if (last && launch->queued) {
+    cp_launch_t* prev = NULL;
+    cp_launch_t** link = &spawner_head;
+
+    while (*link != launch) {
+      prev = *link;
+      link = &prev->next;
+    }
+    *link = launch->next;
+    if (spawner_tail == launch) {
+      spawner_tail = prev;
+    }
+  }
+  uv_mutex_unlock(&spawner_mutex);
+
+  if (!last) {
+    return;
+  }
+
+  launch_close_fds(launch);
+  free((char*) launch->process_options.file);
+  free((char*) launch->process_options.cwd);
+  strv_free(launch->process_options.args);
+  strv_free(launch->process_options.env);
+  free(launch);
+}
+
+static void spawner_init() {
+  CHECK_OK(uv_mutex_init(&spawner_mutex));
+  CHECK_OK(uv_loop_init(&spawner_loop));
+  CHECK_OK(uv_async_init(&spawner_loop, &spawner_async, spawner_async_cb));
+  CHECK_OK(uv_thread_create(&spawner_thread, spawner_main, NULL));
+}
+
+// runs for the life of the process, as the threadpool does
+static void spawner_main(void* arg) {
+  uv_run(&spawner_loop, UV_RUN_DEFAULT);
+}
+
+static void spawner_async_cb(uv_async_t* handle) {
+  for (;;) {
+    cp_launch_t* launch;
+
+    uv_mutex_lock(&spawner_mutex);
+    launch = spawner_head;
+    if (launch) {
+      spawner_head = launch->next;
+      if (!spawner_head) {
+        spawner_tail = NULL;
+      }
+      launch->next = NULL;
+      launch->queued = false;
+    }
+    uv_mutex_unlock(&spawner_mutex);
+
+    if (!launch) {
+      return;
+    }
+    launch_run(launch);
+  }
+}
+
+static char** strv_copy(char** strv) {
+  size_t count = 0;
+  char** copy;
+
+  if (!strv) {
+    return NULL;
+  }
+
+  while (strv[count]) {
+    count++;
+  }
+
+  copy = malloc((count + 1) * sizeof(char*));
+  CHECK_NOT_NULL(copy);
+  for (size_t n = 0; n < count; n++) {
+    copy[n] = strdup(strv[n]);
+    CHECK_NOT_NULL(copy[n]);
+  }
+  copy[count] = NULL;
+
+  return copy;
+}
+
+static void strv_free(char** strv) {
+  if (!strv) {
+    return;
+  }
+
+  for (size_t n = 0; strv[n]; n++) {
+    free(strv[n]);
+  }
+  free(strv);
+}
+
+#ifndef _WIN32
+// Takes the descriptors of source and of the destination stream, if any, so
+// that their handles can close while the pump owns copies.
+static int pump_start(cp_pipe_t* source, cp_pipe_t* dest, int fd, const char* path) {
+  uv_loop_t* loop = &source->vm->uv->loop;
+  cp_pump_t* pump;
+  uv_os_fd_t fileno;
+  struct stat st;
+  int in_fd = -1;
+  int out_fd = -1;
+  int err = 0;
+
+  err = uv_fileno((uv_handle_t*) &source->pipe, &fileno);
+  if (err) {
+    return err;
+  }
+  if ((in_fd = fcntl(fileno, F_DUPFD_CLOEXEC, 0)) < 0) {
+    return uv_translate_sys_error(errno);
+  }
+
+  if (dest) {
+    err = uv_fileno((uv_handle_t*) &dest->pipe, &fileno);
+    if (!err && (out_fd = fcntl(fileno, F_DUPFD_CLOEXEC, 0)) < 0) {
+      err = uv_translate_sys_error(errno);
+    }
+  } else if (path) {
+    if ((out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+      err = uv_translate_sys_error(errno);
+    }
+  } else if ((out_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+    err = uv_translate_sys_error(errno);
+  }
+
+  if (!err && fstat(out_fd, &st) != 0) {
+    err = uv_translate_sys_error(errno);
+  }
+
+  if (err) {
+    close(in_fd);
+    if (out_fd >= 0) {
+      close(out_fd);
+    }
+    return err;
+  }
+
+  pump = calloc(1, sizeof(cp_pump_t));
+  CHECK_NOT_NULL(pump);
+  pump->vm = source->vm;
+  pump->source = source;
+  pump->dest = dest;
+  pump->in_fd = in_fd;
+  pump->out_fd = out_fd;
+  pump->out_polled = !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode);
+  pump->stage[0] = pump->stage[1] = -1;
+#ifdef __linux__
+  pump->use_splice = pipe2(pump->stage, O_NONBLOCK | O_CLOEXEC) == 0;
+#endif
+  if (!pump->use_splice) {
+    pump->buf = malloc(CP_PUMP_CHUNK);
+    CHECK_NOT_NULL(pump->buf);
+  }
+
+  CHECK_OK(uv_poll_init(loop, &pump->in, in_fd));
+  pump->in.data = pump;
+  pump->open_polls++;
+  if (pump->out_polled) {
+    CHECK_OK(uv_poll_init(loop, &pump->out, out_fd));
+    pump->out.data = pump;
+    pump->open_polls++;
+  }
+
+  // the handles close as usual, but 'close' waits for the pump
+  source->pump = pump;
+  uv_read_stop((uv_stream_t*) &source->pipe);
+  pipe_destroy_now(source);
+  if (dest) {
+    dest->pump = pump;
+    pipe_destroy_now(dest);
+  }
+
+  veil_vm_add_cleanup(pump->vm, &pump->cleanup, pump_cleanup_cb);
+  pump_run(pump);
+
+  return 0;
+}
+
+static void pump_run(cp_pump_t* pump) {
+  ssize_t n = 0;
+
+  for (int round = 0; round < CP_PUMP_ROUNDS && !pump->eof; round++) {
+    if (pump->staged == 0) {
+      n = pump_fill(pump);
+      if (n == 0) {
+        pump->eof = true;
+        break;
+      }
+      if (n == UV_EAGAIN) {
+        break;
+      }
+      if (n < 0) {
+        pump_finish(pump, (int) n);
+        return;
+      }
+      pump->staged = (size_t) n;
+    }
+
+    // a file takes everything at once
+    do {
+      n = pump_drain(pump);
+      if (n > 0) {
+        pump->staged -= (size_t) n;
+      }
+    } while (n >= 0 && pump->staged && !pump->out_polled);
+
+    if (n == UV_EAGAIN) {
+      break;
+    }
+    if (n < 0) {
+      pump_finish(pump, (int) n);
+      return;
+    }
+  }
+
+  if (pump->eof && !pump->staged) {
+    pump_finish(pump, 0);
+    return;
+  }
+
+  pump_watch(pump);
+}
+
+static ssize_t pump_fill(cp_pump_t* pump) {
+  ssize_t n;
+
+#ifdef __linux__
+  if (pump->use_splice) {
+    n = splice(pump->in_fd, NULL, pump->stage[1], NULL, CP_PUMP_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n >= 0) {
+      return n;
+    }
+    if (errno != EINVAL) {
+      return errno == EINTR ? UV_EAGAIN : uv_translate_sys_error(errno);
+    }
+    // the stage is empty between fills, so copying can take over here
+    pump_stop_splice(pump);
+  }
+#endif
+
+  do {
+    n = read(pump->in_fd, pump->buf, CP_PUMP_CHUNK);
+  } while (n < 0 && errno == EINTR);
+  pump->buf_offset = 0;
+
+  return n < 0 ? uv_translate_sys_error(errno) : n;
+}
+
+static ssize_t pump_drain(cp_pump_t* pump) {
+  ssize_t n;
+
+#ifdef __linux__
+  if (pump->use_splice) {
+    n = splice(pump->stage[0], NULL, pump->out_fd, NULL, pump->staged, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n >= 0 || errno != EINVAL) {
+      return n >= 0 ? n : errno == EINTR ? 0 : uv_translate_sys_error(errno);
+    }
+    // the destination cannot splice, such as an O_APPEND file: take the
+    // staged bytes back out and copy from here on
+    pump_stop_splice(pump);
+    if (pump->buf_offset != pump->staged) {
+      return UV_EIO;
+    }
+    pump->buf_offset = 0;
+  }
+#endif
+
+  do {
+    n = write(pump->out_fd, pump->buf + pump->buf_offset, pump->staged);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    return uv_translate_sys_error(errno);
+  }
+  pump->buf_offset += (size_t) n;
+
+  return n;
+}
+
+// Leaves whatever was staged at the start of buf, with buf_offset its size.
+static void pump_stop_splice(cp_pump_t* pump) {
+  ssize_t n;
+
+  pump->buf = malloc(CP_PUMP_CHUNK);
+  CHECK_NOT_NULL(pump->buf);
+  pump->buf_offset = 0;
+  while (pump->buf_offset < pump->staged
+      && (n = read(pump->stage[0], pump->buf + pump->buf_offset, pump->staged - pump->buf_offset)) > 0) {
+    pump->buf_offset += (size_t) n;
+  }
+
+  close(pump->stage[0]);
+  close(pump->stage[1]);
+  pump->stage[0] = pump->stage[1] = -1;
+  pump->use_splice = false;
+}
+
+// Polls are level-triggered, so only the side the pump is waiting on stays
+// armed: the source while nothing is staged, the destination while something
+// is.
+static void pump_watch(cp_pump_t* pump) {
+  int err;
+
+  if (pump->staged && pump->out_polled) {
+    uv_poll_stop(&pump->in);
+    err = uv_poll_start(&pump->out, UV_WRITABLE, pump_poll_cb);
+  } else {
+    if (pump->out_polled) {
+      uv_poll_stop(&pump->out);
+    }
+    err = uv_poll_start(&pump->in, UV_READABLE | UV_DISCONNECT, pump_poll_cb);
+  }
+
+  if (err) {
+    pump_finish(pump, err);
+  }
+}
+
+static void pump_finish(cp_pump_t* pump, int err) {
+  if (pump->done) {
+    return;
+  }
+
+  pump->done = true;
+  pump->err = err;
+  veil_vm_remove_cleanup(&pump->cleanup);
+
+  // the descriptors close once nothing polls them
+  uv_close((uv_handle_t*) &pump->in, pump_close_cb);
+  if (pump->out_polled) {
+    uv_close((uv_handle_t*) &pump->out, pump_close_cb);
+  }
+}
+
+static void pump_poll_cb(uv_poll_t* poll, int status, int events) {
+  cp_pump_t* pump = poll->data;
+
+  if (status < 0) {
+    pump_finish(pump, status);
+    return;
+  }
+
+  pump_run(pump);
+}
+
+static void pump_close_cb(uv_handle_t* handle) {
+  cp_pump_t* pump = handle->data;
+  JSContext* ctx = pump->vm->context;
+  cp_pipe_t* source = pump->source;
+  cp_pipe_t* dest = pump->dest;
+
+  if (--pump->open_polls) {
+    return;
+  }
+
+  // closing the copy of the child's stdin is what lets that child see EOF
+  close(pump->in_fd);
+  close(pump->out_fd);
+  if (pump->use_splice) {
+    close(pump->stage[0]);
+    close(pump->stage[1]);
+  }
+  free(pump->buf);
+
+  source->pump = NULL;
+  source->released |= pump->released;
+  if (dest) {
+    dest->pump = NULL;
+    dest->released |= pump->released;
+  }
+
+  // a destination that went away first ends the pipe like EOF would
+  if (!pump->released) {
+    if (pump->err && pump->err != UV_EPIPE) {
+      source->had_error = true;
+      emit_error(ctx, source->object, pump->err, "pipe");
+    } else {
+      veil_emitter_emit(ctx, source->object, "end", 0, NULL);
+      if (dest) {
+        veil_emitter_emit(ctx, dest->object, "finish", 0, NULL);
+      }
+    }
+  }
+  free(pump);
+
+  pipe_maybe_finish(source);
+  if (dest) {
+    pipe_maybe_finish(dest);
+  }
+}
+
+static void pump_cleanup_cb(veil_cleanup_t* cleanup) {
+  cp_pump_t* pump = container_of(cleanup, cp_pump_t, cleanup);
+
+  pump->released = true;
+  pump_finish(pump, 0);
+}
+#endif
+
+static void emit_error(JSContext* ctx, JSValueConst obj, int err, const char* syscall) {
+  emit_error_value(ctx, obj, veil_builtin_new_uv_error(ctx, err, syscall, NULL));
+}
+
+static void emit_error_value(JSContext* ctx, JSValueConst obj, JSValue error) {
+  // an unhandled 'error' must not pass silently
+  if (!veil_emitter_emit(ctx, obj, "error", 1, (JSValueConst*) &error)) {
+    JS_Throw(ctx, error);
+    veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+    return;
+  }
+
+  JS_FreeValue(ctx, error);
+}
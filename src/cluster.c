@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+// --workers=N turns the process into a supervisor that runs no JS. It starts
+// N copies of itself with the same arguments, each told its worker id by the
+// environment, so every worker is an ordinary veil process with its own loop.
+// Workers bind their listen ports with SO_REUSEPORT, so they all accept on
+// the same port with no hop through the supervisor. This is not node's
+// round-robin: the kernel picks a worker by a hash of each connection's
+// addresses and ports (Linux and FreeBSD; macOS favours one socket), so the
+// spread is even only over many clients, and a busy worker still gets its
+// share. Round-robin would need the supervisor to accept every connection
+// and pass it over IPC, which costs a hop per connection.
+//
+// A worker that exits with a failure or a signal is restarted after a
+// backoff; one that keeps failing within a second of starting is given up
+// on. SIGINT and SIGTERM are passed on to the workers, and the supervisor
+// exits once they are all gone.
+
+#define CLUSTER_WORKER_ENV "VEIL_CLUSTER_WORKER"
+// a worker that fails sooner than this after starting failed at startup
+#define CLUSTER_FAST_FAILURE_MS 1000
+#define CLUSTER_MAX_FAST_FAILURES 5
+#define CLUSTER_RESTART_DELAY_MS 100
+#define CLUSTER_RESTART_DELAY_MAX_SHIFT 6
+
+typedef struct cluster_s cluster_t;
+
+typedef struct cluster_child_s {
+  cluster_t* cluster;
+  uv_process_t process;
+  uv_timer_t restart;
+  uint32_t id;
+  uint64_t started;
+  uint32_t fast_failures;
+  uint64_t restart_delay;
+  bool running;
+  bool restart_pending;
+  char env_id[32];
+} cluster_child_t;
+
+struct cluster_s {
+  uv_loop_t loop;
+  uv_signal_t sigint;
+  uv_signal_t sigterm;
+  char exepath[4096];
+  char** args;
+  char** env;
+  // the env slot that holds each child's CLUSTER_WORKER_ENV
+  size_t env_id_index;
+  cluster_child_t* children;
+  uint32_t count;
+  bool stopping;
+  int exit_code;
+};
+
+static uv_once_t worker_id_once = UV_ONCE_INIT;
+static uint32_t worker_id;
+
+static void worker_id_init();
+static int module_init(JSContext* ctx, JSModuleDef* m);
+static bool build_env(cluster_t* cluster);
+static void spawn_child(cluster_child_t* child);
+static void exit_cb(uv_process_t* process, int64_t exit_status, int term_signal);
+static void process_close_cb(uv_handle_t* handle);
+static void restart_cb(uv_timer_t* handle);
+static void signal_cb(uv_signal_t* handle, int signum);
+
+uint32_t veil_cluster_worker_id() {
+  uv_once(&worker_id_once, worker_id_init);
+
+  return worker_id;
+}
+
+int veil_cluster_run(veil_t* veil, int argc, char** argv) {
+  cluster_t cluster;
+  size_t size;
+
+#ifndef SO_REUSEPORT
+  fprintf(stderr, "veil: --workers needs SO_REUSEPORT, which this platform lacks\n");
+  return 1;
+#endif
+
+  memset(&cluster, 0, sizeof(cluster));
+  cluster.count = veil->cfg.workers;
+
+  size = sizeof(cluster.exepath);
+  if (uv_exepath(cluster.exepath, &size) != 0) {
+    fprintf(stderr, "veil: --workers could not find the veil executable\n");
+    return 1;
+  }
+
+  if (!build_env(&cluster)) {
+    fprintf(stderr, "veil: --workers could not read the environment\n");
+    return 1;
+  }
+
+  // the workers get the same arguments, --workers included: the environment
+  // tells them they are workers
+  cluster.args = calloc(argc + 1, sizeof(char*));
+  CHECK_NOT_NULL(cluster.args);
+  cluster.args[0] = cluster.exepath;
+  for (int n = 1; n < argc; n++) {
+    cluster.args[n] = argv[n];
+  }
+
+  CHECK_OK(uv_loop_init(&cluster.loop));
+  CHECK_OK(uv_signal_init(&cluster.loop, &cluster.sigint));
+  CHECK_OK(uv_signal_init(&cluster.loop, &cluster.sigterm));
+  cluster.sigint.data = &cluster;
+  cluster.sigterm.data = &cluster;
+  CHECK_OK(uv_signal_start(&cluster.sigint, signal_cb, SIGINT));
+  CHECK_OK(uv_signal_start(&cluster.sigterm, signal_cb, SIGTERM));
+  // the loop lasts as long as the workers do
+  uv_unref((uv_handle_t*) &cluster.sigint);
+  uv_unref((uv_handle_t*) &cluster.sigterm);
+
+  cluster.children = calloc(cluster.count, sizeof(cluster_child_t));
+  CHECK_NOT_NULL(cluster.children);
+  for (uint32_t n = 0; n < cluster.count; n++) {
+    cluster_child_t* child = &cluster.children[n];
+
+    child->cluster = &cluster;
+    child->id = n + 1;
+    CHECK_OK(uv_timer_init(&cluster.loop, &child->restart));
+    child->restart.data = child;
+    uv_unref((uv_handle_t*) &child->restart);
+    spawn_child(child);
+  }
+
+  uv_run(&cluster.loop, UV_RUN_DEFAULT);
+
+  uv_close((uv_handle_t*) &cluster.sigint, NULL);
+  uv_close((uv_handle_t*) &cluster.sigterm, NULL);
+  for (uint32_t n = 0; n < cluster.count; n++) {
+    uv_close((uv_handle_t*) &cluster.children[n].restart, NULL);
+  }
+  uv_run(&cluster.loop, UV_RUN_DEFAULT);
+  CHECK_OK(uv_loop_close(&cluster.loop));
+
+  for (size_t n = 0; cluster.env[n]; n++) {
+    if (n != cluster.env_id_index) {
+      free(cluster.env[n]);
+    }
+  }
+  free(cluster.env);
+  free(cluster.args);
+  free(cluster.children);
+
+  return cluster.exit_code;
+}
+
+JSModuleDef* veil_cluster_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, module_init);
+
+  if (m) {
+    JS_AddModuleExport(ctx, m, "isPrimary");
+    JS_AddModuleExport(ctx, m, "isWorker");
+    JS_AddModuleExport(ctx, m, "worker");
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+static void worker_id_init() {
+  char value[16];
+  size_t size = sizeof(value);
+  uint32_t id = 0;
+
+  if (uv_os_getenv(CLUSTER_WORKER_ENV, value, &size) == 0) {
+    for (const char* p = value; *p >= '0' && *p <= '9' && id <= VEIL_CLUSTER_MAX_WORKERS; p++) {
+      id = id * 10 + (*p - '0');
+    }
+  }
+
+  worker_id = id <= VEIL_CLUSTER_MAX_WORKERS ? id : 0;
+}
+
+// Code only ever runs in workers or without --workers, where a process is
+// its own primary, as in node.
+static int module_init(JSContext* ctx, JSModuleDef* m) {
+  uint32_t id = veil_cluster_worker_id();
+  JSValue cluster = JS_NewObject(ctx);
+  JSValue worker = JS_UNDEFINED;
+
+  if (id) {
+    worker = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, worker, "id", JS_NewUint32(ctx, id));
+  }
+
+  JS_SetPropertyStr(ctx, cluster, "isPrimary", JS_NewBool(ctx, !id));
+  JS_SetPropertyStr(ctx, cluster, "isWorker", JS_NewBool(ctx, id));
+  JS_SetPropertyStr(ctx, cluster, "worker", JS_DupValue(ctx, worker));
+
+  JS_SetModuleExport(ctx, m, "isPrimary", JS_NewBool(ctx, !id));
+  JS_SetModuleExport(ctx, m, "isWorker", JS_NewBool(ctx, id));
+  JS_SetModuleExport(ctx, m, "worker", worker);
+  JS_SetModuleExport(ctx, m, "default", cluster);
+
+  return 0;
+}
+
+// The environment without CLUSTER_WORKER_ENV, plus a slot for it that each
+// spawn points at the child's own string.
+static bool build_env(cluster_t* cluster) {
+  uv_env_item_t* items;
+  size_t size = 0;
+  int count;
+
+  if (uv_os_environ(&items, &count) != 0) {
+    return false;
+  }
+
+  cluster->env = calloc(count + 2, sizeof(char*));
+  CHECK_NOT_NULL(cluster->env);
+
+  for (int n = 0; n < count; n++) {
+    if (strcmp(items[n].name, CLUSTER_WORKER_ENV) != 0) {
+      cstr entry = cstr_from_fmt("%s=%s", items[n].name, items[n].value);
+
+      cluster->env[size++] = strdup(cstr_str(&entry));
+      CHECK_NOT_NULL(cluster->env[size - 1]);
+      cstr_drop(&entry);
+    }
+  }
+
+  cluster->env_id_index = size;
+  uv_os_free_environ(items, count);
+
+  return true;
+}
+
+static void spawn_child(cluster_child_t* child) {
+  cluster_t* cluster = child->cluster;
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[3];
+  int err;
+
+  memset(&options, 0, sizeof(options));
+  for (int n = 0; n < 3; n++) {
+    stdio[n].flags = UV_INHERIT_FD;
+    stdio[n].data.fd = n;
+  }
+
+  // uv_spawn() is done with the environment by the time it returns
+  snprintf(child->env_id, sizeof(child->env_id), "%s=%u", CLUSTER_WORKER_ENV, child->id);
+  cluster->env[cluster->env_id_index] = child->env_id;
+
+  options.file = cluster->exepath;
+  options.args = cluster->args;
+  options.env = cluster->env;
+  options.exit_cb = exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  child->process.data = child;
+  child->started = uv_now(&cluster->loop);
+  err = uv_spawn(&cluster->loop, &child->process, &options);
+  if (err) {
+    fprintf(stderr, "veil: could not start worker %u: %s\n", child->id, uv_strerror(err));
+    // counts as a failure at startup, so that it is retried a few times
+    exit_cb(&child->process, 1, 0);
+    return;
+  }
+
+  child->running = true;
+}
+
+static void exit_cb(uv_process_t* process, int64_t exit_status, int term_signal) {
+  cluster_child_t* child = process->data;
+  cluster_t* cluster = child->cluster;
+  uint64_t uptime = uv_now(&cluster->loop) - child->started;
+
+  child->running = false;
+
+  if (!cluster->stopping && (exit_status != 0 || term_signal != 0)) {
+    cluster->exit_code = 1;
+    child->fast_failures = uptime < CLUSTER_FAST_FAILURE_MS ? child->fast_failures + 1 : 0;
+
+    if (child->fast_failures >= CLUSTER_MAX_FAST_FAILURES) {
+      fprintf(stderr, "veil: worker %u keeps failing at startup, not restarting it\n", child->id);
+    } else {
+      child->restart_delay = CLUSTER_RESTART_DELAY_MS
+          << (child->fast_failures < CLUSTER_RESTART_DELAY_MAX_SHIFT ? child->fast_failures : CLUSTER_RESTART_DELAY_MAX_SHIFT);
+      child->restart_pending = true;
+      if (term_signal) {
+        fprintf(stderr, "veil: worker %u was killed by signal %d, restarting in %u ms\n",
+                child->id, term_signal, (unsigned) child->restart_delay);
+      } else {
+        fprintf(stderr, "veil: worker %u exited with code %d, restarting in %u ms\n",
+                child->id, (int) exit_status, (unsigned) child->restart_delay);
+      }
+    }
+  }
+
+  uv_close((uv_handle_t*) process, process_close_cb);
+}
+
+// the handle is reused once it has closed
+static void process_close_cb(uv_handle_t* handle) {
+  cluster_child_t* child = handle->data;
+
+  if (child->restart_pending && !child->cluster->stopping) {
+    uv_ref((uv_handle_t*) &child->restart);
+    CHECK_OK(uv_timer_start(&child->restart, restart_cb, child->restart_delay, 0));
+  }
+}
+
+static void restart_cb(uv_timer_t* handle) {
+  cluster_child_t* child = handle->data;
+
+  child->restart_pending = false;
+  uv_unref((uv_handle_t*) &child->restart);
+  spawn_child(child);
+}
+
+static void signal_cb(uv_signal_t* handle, int signum) {
+  cluster_t* cluster = handle->data;
+
+  // being asked to stop is not a failure, whatever happened before
+  cluster->stopping = true;
+  cluster->exit_code = 0;
+
+  for (uint32_t n = 0; n < cluster->count; n++) {
+    cluster_child_t* child = &cluster->children[n];
+
+    if (child->restart_pending) {
+      child->restart_pending = false;
+      uv_timer_stop(&child->restart);
+      uv_unref((uv_handle_t*) &child->restart);
+    }
+    if (child->running) {
+      uv_process_kill(&child->process, signum);
+    }
+  }
+}
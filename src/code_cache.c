@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#define CODE_CACHE_MAGIC "VEILJSC1"
+#define CODE_CACHE_VERSION_SIZE 32
+
+typedef struct code_cache_header_s {
+  char magic[8];
+  char qjs_version[CODE_CACHE_VERSION_SIZE];
+  uint32_t header_size;
+  uint32_t eval_flags;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t source_hash;
+  uint64_t filename_size;
+  uint64_t bytecode_size;
+} code_cache_header_t;
+
+static void entry_path(veil_code_cache_t* cache, cstr* out, const char* filename);
+static void absolute_path(cstr* out, const char* filename);
+static void header_init(code_cache_header_t* header, const veil_file_t* source, int eval_flags, size_t filename_size, size_t bytecode_size);
+
+void veil_code_cache_init(veil_code_cache_t* cache, const char* dir) {
+  uv_fs_t req;
+
+  cache->dir = cstr_from(dir);
+  cache->enabled = !cstr_is_empty(&cache->dir);
+
+  if (cache->enabled) {
+    // EEXIST is expected on every run after the first
+    uv_fs_mkdir(NULL, &req, dir, 0755, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+}
+
+void veil_code_cache_drop(veil_code_cache_t* cache) {
+  cstr_drop(&cache->dir);
+  cache->enabled = false;
+}
+
+JSValue veil_code_cache_load(veil_code_cache_t* cache, JSContext* ctx, const char* filename, const veil_file_t* source, int eval_flags) {
+  code_cache_header_t expected;
+  const code_cache_header_t* header;
+  veil_mmap_t map;
+  cstr abs_filename;
+  cstr path;
+  JSValue compiled = JS_UNDEFINED;
+
+  if (!cache->enabled) {
+    return JS_UNDEFINED;
+  }
+
+  abs_filename = cstr_init();
+  absolute_path(&abs_filename, filename);
+  path = cstr_init();
+  entry_path(cache, &path, cstr_str(&abs_filename));
+
+  if (!veil_mmap_open(&map, cstr_str(&path))) {
+    goto done;
+  }
+
+  if (map.size < sizeof(code_cache_header_t)) {
+    goto unmap;
+  }
+
+  header = map.data;
+  header_init(&expected, source, eval_flags, cstr_size(&abs_filename), header->bytecode_size);
+
+  if (memcmp(header, &expected, sizeof(code_cache_header_t)) != 0
+      || map.size != sizeof(code_cache_header_t) + header->filename_size + header->bytecode_size
+      || memcmp((const char*) map.data + sizeof(code_cache_header_t), cstr_str(&abs_filename), header->filename_size) != 0) {
+    goto unmap;
+  }
+
+  compiled = JS_ReadObject(
+      ctx,
+      (const uint8_t*) map.data + sizeof(code_cache_header_t) + header->filename_size,
+      header->bytecode_size,
+      JS_READ_OBJ_BYTECODE);
+
+  if (JS_IsException(compiled)) {
+    // stale or corrupt entry; fall back to compiling from source
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    compiled = JS_UNDEFINED;
+  }
+
+unmap:
+  veil_mmap_close(&map);
+done:
+  cstr_drop(&path);
+  cstr_drop(&abs_filename);
+
+  return compiled;
+}
+
+void veil_code_cache_store(veil_code_cache_t* cache, JSContext* ctx, const char* filename, const veil_file_t* source, int eval_flags, JSValueConst compiled) {
+  code_cache_header_t header;
+  uv_buf_t bufs[3];
+  uv_fs_t req;
+  uv_file fd;
+  size_t bytecode_size;
+  uint8_t* bytecode;
+  cstr abs_filename;
+  cstr path;
+  cstr tmp_path;
+  int written;
+
+  if (!cache->enabled) {
+    return;
+  }
+
+  bytecode = JS_WriteObject(ctx, &bytecode_size, compiled, JS_WRITE_OBJ_BYTECODE);
+  if (!bytecode) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    return;
+  }
+
+  abs_filename = cstr_init();
+  absolute_path(&abs_filename, filename);
+  path = cstr_init();
+  entry_path(cache, &path, cstr_str(&abs_filename));
+  // workers share the cache directory, so the temp name is per runtime too
+  tmp_path = cstr_from_fmt("%s.%d.%p.tmp", cstr_str(&path), (int) uv_os_getpid(), (void*) ctx);
+
+  header_init(&header, source, eval_flags, cstr_size(&abs_filename), bytecode_size);
+
+  bufs[0] = uv_buf_init((char*) &header, sizeof(header));
+  bufs[1] = uv_buf_init((char*) cstr_str(&abs_filename), cstr_size(&abs_filename));
+  bufs[2] = uv_buf_init((char*) bytecode, bytecode_size);
+
+  // write to a private temp file and rename over the entry so that concurrent
+  // processes never observe a partially written cache file
+  fd = uv_fs_open(NULL, &req, cstr_str(&tmp_path), UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+
+  if (fd >= 0) {
+    written = uv_fs_write(NULL, &req, fd, bufs, 3, 0, NULL);
+    uv_fs_req_cleanup(&req);
+    uv_fs_close(NULL, &req, fd, NULL);
+    uv_fs_req_cleanup(&req);
+
+    if (written == (int) (bufs[0].len + bufs[1].len + bufs[2].len)) {
+      uv_fs_rename(NULL, &req, cstr_str(&tmp_path), cstr_str(&path), NULL);
+    } else {
+      uv_fs_unlink(NULL, &req, cstr_str(&tmp_path), NULL);
+    }
+    uv_fs_req_cleanup(&req);
+  }
+
+  cstr_drop(&tmp_path);
+  cstr_drop(&path);
+  cstr_drop(&abs_filename);
+  js_free(ctx, bytecode);
+}
+
+static void entry_path(veil_code_cache_t* cache, cstr* out, const char* filename) {
+  cstr_printf(out, "%s/%016llx.jsc", cstr_str(&cache->dir), (unsigned long long) veil_hash(filename, strlen(filename)));
+}
+
+static void absolute_path(cstr* out, const char* filename) {
+  char cwd[4096];
+  size_t cwd_size = sizeof(cwd);
+
+  if (filename[0] == '/' || filename[0] == '\\' || (filename[0] && filename[1] == ':')) {
+    cstr_assign(out, filename);
+  } else if (uv_cwd(cwd, &cwd_size) == 0) {
+    cstr_printf(out, "%s/%s", cwd, filename);
+  } else {
+    cstr_assign(out, filename);
+  }
+}
+
+static void header_init(code_cache_header_t* header, const veil_file_t* source, int eval_flags, size_t filename_size, size_t bytecode_size) {
+  // zeroed so padding compares equal with memcmp
+  memset(header, 0, sizeof(code_cache_header_t));
+  memcpy(header->magic, CODE_CACHE_MAGIC, sizeof(header->magic));
+  strncpy(header->qjs_version, QJS_VERSION, CODE_CACHE_VERSION_SIZE - 1);
+  header->header_size = sizeof(code_cache_header_t);
+  header->eval_flags = eval_flags;
+  header->source_size = source->size;
+  header->source_mtime_sec = source->mtime.tv_sec;
+  header->source_mtime_nsec = source->mtime.tv_nsec;
+  header->source_hash = veil_hash(source->data, source->size);
+  header->filename_size = filename_size;
+  header->bytecode_size = bytecode_size;
+}
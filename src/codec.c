@@ -0,0 +1,1032 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// Text and binary encoding kernels. Every routine has a portable scalar
+// version; the hot loops also have vector versions that are picked once at
+// runtime. SSE2 and NEON are part of the x86-64 and AArch64 baselines and are
+// used unconditionally, AVX2 only when the CPU reports it.
+//
+// The UTF-8 validator is the lookup-table algorithm of Keiser and Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte" (2021). The base64
+// kernels follow Muła and Lemire, "Faster Base64 Encoding and Decoding Using
+// AVX2 Instructions" (2018).
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CODEC_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CODEC_TARGET_AVX2
+#else
+#define CODEC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CODEC_NEON
+#include <arm_neon.h>
+#endif
+
+// leaves room for a vector store that runs past the last decoded byte
+#define BASE64_AVX2_MIN_INPUT 44
+
+#define B64_SKIP 64
+#define B64_PAD 65
+#define B64_BAD 0xFF
+
+typedef struct codec_kernels_s {
+  size_t (*ascii_length)(const uint8_t* data, size_t size);
+  // the length of the longest valid prefix that ends on a character boundary
+  size_t (*utf8_valid_length)(const uint8_t* data, size_t size);
+  size_t (*base64_encode)(const uint8_t* data, size_t size, char* out, bool url);
+  size_t (*base64_decode)(const char* data, size_t size, uint8_t* out, size_t* written, bool strict);
+} codec_kernels_t;
+
+static void global_init();
+static size_t ascii_length_scalar(const uint8_t* data, size_t size);
+static size_t utf8_valid_length_scalar(const uint8_t* data, size_t size);
+static size_t base64_encode_none(const uint8_t* data, size_t size, char* out, bool url);
+static size_t base64_decode_none(const char* data, size_t size, uint8_t* out, size_t* written, bool strict);
+static int32_t utf8_next(const uint8_t* data, size_t size, size_t* length, bool* truncated);
+static uint8_t* put_utf8(uint8_t* out, uint32_t cp);
+
+#ifdef CODEC_X64
+static size_t ascii_length_sse2(const uint8_t* data, size_t size);
+static size_t ascii_length_avx2(const uint8_t* data, size_t size);
+static size_t utf8_valid_length_avx2(const uint8_t* data, size_t size);
+static size_t base64_encode_avx2(const uint8_t* data, size_t size, char* out, bool url);
+static size_t base64_decode_avx2(const char* data, size_t size, uint8_t* out, size_t* written, bool strict);
+static bool has_avx2();
+static uint32_t ctz32(uint32_t value);
+#endif
+
+#ifdef CODEC_NEON
+static size_t ascii_length_neon(const uint8_t* data, size_t size);
+static size_t utf8_valid_length_neon(const uint8_t* data, size_t size);
+static size_t base64_encode_neon(const uint8_t* data, size_t size, char* out, bool url);
+static size_t base64_decode_neon(const char* data, size_t size, uint8_t* out, size_t* written, bool strict);
+#endif
+
+static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char BASE64_URL[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static const char HEX[] = "0123456789abcdef";
+
+// values of both alphabets; whitespace is skipped and '=' ends the data
+static uint8_t BASE64_DECODE[256];
+static uint8_t HEX_DECODE[256];
+
+static codec_kernels_t kernels;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+size_t veil_codec_ascii_length(const uint8_t* data, size_t size) {
+  uv_once(&global_once, global_init);
+  return kernels.ascii_length(data, size);
+}
+
+bool veil_codec_utf8_valid(const uint8_t* data, size_t size) {
+  uv_once(&global_once, global_init);
+  return kernels.utf8_valid_length(data, size) == size;
+}
+
+// Copies data to out with every maximal invalid subsequence replaced by
+// U+FFFD, as the WHATWG decoder does. out holds 3 * size bytes.
+size_t veil_codec_utf8_sanitize(const uint8_t* data, size_t size, uint8_t* out) {
+  uint8_t* start = out;
+  size_t offset = 0;
+  size_t valid;
+  size_t length;
+  bool truncated;
+
+  uv_once(&global_once, global_init);
+
+  while (offset < size) {
+    valid = kernels.utf8_valid_length(data + offset, size - offset);
+    memcpy(out, data + offset, valid);
+    out += valid;
+    offset += valid;
+
+    if (offset < size) {
+      utf8_next(data + offset, size - offset, &length, &truncated);
+      out = put_utf8(out, 0xFFFD);
+      offset += length;
+    }
+  }
+
+  return (size_t) (out - start);
+}
+
+// The number of bytes at the end of data that begin a character but stop
+// short of finishing it, which a streaming decoder holds for the next call.
+size_t veil_codec_utf8_incomplete(const uint8_t* data, size_t size) {
+  size_t start = size > 3 ? size - 3 : 0;
+  size_t length;
+  bool truncated;
+
+  for (size_t n = size; n-- > start;) {
+    if ((data[n] & 0xC0) != 0x80) {
+      if (data[n] >= 0xC2 && data[n] <= 0xF4
+          && utf8_next(data + n, size - n, &length, &truncated) < 0 && truncated) {
+        return size - n;
+      }
+      break;
+    }
+  }
+
+  return 0;
+}
+
+// JS_ToCString encodes a lone surrogate as its own three byte sequence; this
+// replaces each one with U+FFFD, which has the same length.
+void veil_codec_wtf8_fix(uint8_t* data, size_t size) {
+  uint8_t* p = data;
+  uint8_t* end = data + size;
+
+  while (p + 2 < end && (p = memchr(p, 0xED, (size_t) (end - p - 2)))) {
+    if (p[1] >= 0xA0) {
+      p[0] = 0xEF;
+      p[1] = 0xBF;
+      p[2] = 0xBD;
+      p += 3;
+    } else {
+      p++;
+    }
+  }
+}
+
+// out holds 2 * size bytes
+size_t veil_codec_latin1_to_utf8(const uint8_t* data, size_t size, uint8_t* out) {
+  uint8_t* start = out;
+  size_t offset = 0;
+  size_t ascii;
+
+  uv_once(&global_once, global_init);
+
+  while (offset < size) {
+    ascii = kernels.ascii_length(data + offset, size - offset);
+    memcpy(out, data + offset, ascii);
+    out += ascii;
+    offset += ascii;
+
+    while (offset < size && data[offset] >= 0x80) {
+      *out++ = (uint8_t) (0xC0 | (data[offset] >> 6));
+      *out++ = (uint8_t) (0x80 | (data[offset] & 0x3F));
+      offset++;
+    }
+  }
+
+  return (size_t) (out - start);
+}
+
+// Decodes whole code units; unpaired surrogates become U+FFFD. out holds
+// size / 2 * 3 bytes.
+size_t veil_codec_utf16le_to_utf8(const uint8_t* data, size_t size, uint8_t* out) {
+  uint8_t* start = out;
+  size_t count = size / 2;
+  uint32_t unit;
+  uint32_t low;
+
+  for (size_t n = 0; n < count; n++) {
+    unit = (uint32_t) data[n * 2] | (uint32_t) data[n * 2 + 1] << 8;
+
+    if (unit < 0x80) {
+      *out++ = (uint8_t) unit;
+    } else if (unit < 0xD800 || unit > 0xDFFF) {
+      out = put_utf8(out, unit);
+    } else if (unit < 0xDC00 && n + 1 < count
+        && (low = (uint32_t) data[n * 2 + 2] | (uint32_t) data[n * 2 + 3] << 8) >= 0xDC00 && low <= 0xDFFF) {
+      out = put_utf8(out, 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00));
+      n++;
+    } else {
+      out = put_utf8(out, 0xFFFD);
+    }
+  }
+
+  return (size_t) (out - start);
+}
+
+// The source comes from JS_ToCString, so a lone surrogate keeps its code unit
+// here. out holds 2 * size bytes.
+size_t veil_codec_utf8_to_utf16le(const uint8_t* data, size_t size, uint8_t* out) {
+  uint8_t* start = out;
+  size_t offset = 0;
+  uint32_t cp;
+  uint8_t c;
+
+  while (offset < size) {
+    c = data[offset];
+
+    if (c < 0x80) {
+      cp = c;
+      offset++;
+    } else if (c < 0xE0 && offset + 1 < size) {
+      cp = (uint32_t) (c & 0x1F) << 6 | (data[offset + 1] & 0x3F);
+      offset += 2;
+    } else if (c < 0xF0 && offset + 2 < size) {
+      cp = (uint32_t) (c & 0x0F) << 12 | (uint32_t) (data[offset + 1] & 0x3F) << 6 | (data[offset + 2] & 0x3F);
+      offset += 3;
+    } else if (offset + 3 < size) {
+      cp = (uint32_t) (c & 0x07) << 18 | (uint32_t) (data[offset + 1] & 0x3F) << 12
+          | (uint32_t) (data[offset + 2] & 0x3F) << 6 | (data[offset + 3] & 0x3F);
+      offset += 4;
+    } else {
+      break;
+    }
+
+    if (cp >= 0x10000) {
+      cp -= 0x10000;
+      *out++ = (uint8_t) ((0xD800 + (cp >> 10)) & 0xFF);
+      *out++ = (uint8_t) ((0xD800 + (cp >> 10)) >> 8);
+      cp = 0xDC00 + (cp & 0x3FF);
+    }
+    *out++ = (uint8_t) (cp & 0xFF);
+    *out++ = (uint8_t) (cp >> 8);
+  }
+
+  return (size_t) (out - start);
+}
+
+// Keeps the low byte of each code point, like node. out holds size bytes.
+size_t veil_codec_utf8_to_latin1(const uint8_t* data, size_t size, uint8_t* out) {
+  uint8_t* start = out;
+  size_t offset = 0;
+  size_t ascii;
+  uint8_t c;
+
+  uv_once(&global_once, global_init);
+
+  while (offset < size) {
+    ascii = kernels.ascii_length(data + offset, size - offset);
+    memcpy(out, data + offset, ascii);
+    out += ascii;
+    offset += ascii;
+
+    if (offset < size) {
+      c = data[offset];
+      if (c < 0xE0 && offset + 1 < size) {
+        *out++ = (uint8_t) ((c & 0x1F) << 6 | (data[offset + 1] & 0x3F));
+        offset += 2;
+      } else if (c < 0xF0 && offset + 2 < size) {
+        *out++ = (uint8_t) ((data[offset + 1] & 0x3F) << 6 | (data[offset + 2] & 0x3F));
+        offset += 3;
+      } else if (offset + 3 < size) {
+        *out++ = (uint8_t) ((data[offset + 2] & 0x3F) << 6 | (data[offset + 3] & 0x3F));
+        offset += 4;
+      } else {
+        break;
+      }
+    }
+  }
+
+  return (size_t) (out - start);
+}
+
+// Writes padding unless url is set. out holds VEIL_BASE64_SIZE(size) bytes.
+size_t veil_codec_base64_encode(const uint8_t* data, size_t size, char* out, bool url) {
+  const char* alphabet = url ? BASE64_URL : BASE64;
+  char* start = out;
+  size_t offset;
+  uint32_t bits;
+
+  uv_once(&global_once, global_init);
+
+  offset = kernels.base64_encode(data, size, out, url);
+  out += offset / 3 * 4;
+
+  for (; offset + 3 <= size; offset += 3) {
+    bits = (uint32_t) data[offset] << 16 | (uint32_t) data[offset + 1] << 8 | data[offset + 2];
+    out[0] = alphabet[bits >> 18];
+    out[1] = alphabet[(bits >> 12) & 0x3F];
+    out[2] = alphabet[(bits >> 6) & 0x3F];
+    out[3] = alphabet[bits & 0x3F];
+    out += 4;
+  }
+
+  if (offset < size) {
+    bits = (uint32_t) data[offset] << 16 | (offset + 1 < size ? (uint32_t) data[offset + 1] << 8 : 0);
+    *out++ = alphabet[bits >> 18];
+    *out++ = alphabet[(bits >> 12) & 0x3F];
+    if (offset + 1 < size) {
+      *out++ = alphabet[(bits >> 6) & 0x3F];
+    } else if (!url) {
+      *out++ = '=';
+    }
+    if (!url) {
+      *out++ = '=';
+    }
+  }
+
+  return (size_t) (out - start);
+}
+
+// Both alphabets are accepted and ASCII whitespace is skipped. Otherwise a
+// strict decode is the forgiving-base64 decode of atob(): it fails on any
+// other character, on misplaced padding and on a lone trailing character,
+// and rejects the url alphabet. A loose decode, like node's Buffer, skips
+// what it does not recognise and stops at the first '='. out holds
+// VEIL_BASE64_DECODED_SIZE(size) bytes.
+bool veil_codec_base64_decode(const char* data, size_t size, uint8_t* out, size_t* out_size, bool strict) {
+  const uint8_t* in = (const uint8_t*) data;
+  uint8_t* start = out;
+  size_t offset = 0;
+  size_t written;
+  size_t pad = 0;
+  uint32_t bits = 0;
+  uint32_t count = 0;
+  uint8_t value;
+
+  uv_once(&global_once, global_init);
+
+  while (offset < size) {
+    // the vector kernel decodes whole quanta, so it only starts between them
+    if (count == 0) {
+      offset += kernels.base64_decode(data + offset, size - offset, out, &written, strict);
+      out += written;
+      if (offset == size) {
+        break;
+      }
+    }
+
+    value = BASE64_DECODE[in[offset++]];
+    if (value < 64) {
+      if (strict && (in[offset - 1] == '-' || in[offset - 1] == '_')) {
+        return false;
+      }
+      bits = bits << 6 | value;
+      if (++count == 4) {
+        *out++ = (uint8_t) (bits >> 16);
+        *out++ = (uint8_t) (bits >> 8);
+        *out++ = (uint8_t) bits;
+        bits = 0;
+        count = 0;
+      }
+    } else if (value == B64_PAD) {
+      if (!strict) {
+        break;
+      }
+      // only padding and whitespace may follow
+      pad = 1;
+      for (; offset < size; offset++) {
+        value = BASE64_DECODE[in[offset]];
+        if (value == B64_PAD) {
+          pad++;
+        } else if (value != B64_SKIP) {
+          return false;
+        }
+      }
+      if (pad > 2 || (count + pad) % 4 != 0) {
+        return false;
+      }
+    } else if (value != B64_SKIP && strict) {
+      return false;
+    }
+  }
+
+  if (count == 1 && strict) {
+    return false;
+  }
+
+  if (count >= 2) {
+    bits <<= 6 * (4 - count);
+    *out++ = (uint8_t) (bits >> 16);
+    if (count == 3) {
+      *out++ = (uint8_t) (bits >> 8);
+    }
+  }
+
+  *out_size = (size_t) (out - start);
+
+  return true;
+}
+
+// out holds 2 * size bytes
+size_t veil_codec_hex_encode(const uint8_t* data, size_t size, char* out) {
+  size_t offset = 0;
+
+#ifdef CODEC_X64
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i digits = _mm_set1_epi8('0');
+  const __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*) (data + offset));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+    __m128i lo = _mm_and_si128(in, mask);
+    __m128i first = _mm_unpacklo_epi8(hi, lo);
+    __m128i second = _mm_unpackhi_epi8(hi, lo);
+
+    first = _mm_add_epi8(_mm_add_epi8(first, digits), _mm_and_si128(_mm_cmpgt_epi8(first, nine), letters));
+    second = _mm_add_epi8(_mm_add_epi8(second, digits), _mm_and_si128(_mm_cmpgt_epi8(second, nine), letters));
+    _mm_storeu_si128((__m128i*) (out + offset * 2), first);
+    _mm_storeu_si128((__m128i*) (out + offset * 2 + 16), second);
+  }
+#elif defined(CODEC_NEON)
+  const uint8x16_t table = vld1q_u8((const uint8_t*) HEX);
+
+  for (; offset + 16 <= size; offset += 16) {
+    uint8x16_t in = vld1q_u8(data + offset);
+    uint8x16x2_t pair;
+
+    pair.val[0] = vqtbl1q_u8(table, vshrq_n_u8(in, 4));
+    pair.val[1] = vqtbl1q_u8(table, vandq_u8(in, vdupq_n_u8(0x0F)));
+    vst2q_u8((uint8_t*) out + offset * 2, pair);
+  }
+#endif
+
+  for (; offset < size; offset++) {
+    out[offset * 2] = HEX[data[offset] >> 4];
+    out[offset * 2 + 1] = HEX[data[offset] & 0x0F];
+  }
+
+  return size * 2;
+}
+
+// Stops at the first pair that is not hex, like node. out holds size / 2
+// bytes.
+size_t veil_codec_hex_decode(const char* data, size_t size, uint8_t* out) {
+  const uint8_t* in = (const uint8_t*) data;
+  size_t count = size / 2;
+  uint8_t hi;
+  uint8_t lo;
+
+  uv_once(&global_once, global_init);
+
+  for (size_t n = 0; n < count; n++) {
+    hi = HEX_DECODE[in[n * 2]];
+    lo = HEX_DECODE[in[n * 2 + 1]];
+    if ((hi | lo) & 0xF0) {
+      return n;
+    }
+    out[n] = (uint8_t) (hi << 4 | lo);
+  }
+
+  return count;
+}
+
+static void global_init() {
+  memset(BASE64_DECODE, B64_BAD, sizeof(BASE64_DECODE));
+  for (uint8_t n = 0; n < 64; n++) {
+    BASE64_DECODE[(uint8_t) BASE64[n]] = n;
+    BASE64_DECODE[(uint8_t) BASE64_URL[n]] = n;
+  }
+  BASE64_DECODE['='] = B64_PAD;
+  BASE64_DECODE[' '] = B64_SKIP;
+  BASE64_DECODE['\t'] = B64_SKIP;
+  BASE64_DECODE['\n'] = B64_SKIP;
+  BASE64_DECODE['\f'] = B64_SKIP;
+  BASE64_DECODE['\r'] = B64_SKIP;
+
+  memset(HEX_DECODE, 0xFF, sizeof(HEX_DECODE));
+  for (uint8_t n = 0; n < 16; n++) {
+    HEX_DECODE[(uint8_t) HEX[n]] = n;
+    if (n >= 10) {
+      HEX_DECODE[(uint8_t) (HEX[n] - 'a' + 'A')] = n;
+    }
+  }
+
+  kernels.ascii_length = ascii_length_scalar;
+  kernels.utf8_valid_length = utf8_valid_length_scalar;
+  kernels.base64_encode = base64_encode_none;
+  kernels.base64_decode = base64_decode_none;
+
+#ifdef CODEC_X64
+  kernels.ascii_length = ascii_length_sse2;
+  if (has_avx2()) {
+    kernels.ascii_length = ascii_length_avx2;
+    kernels.utf8_valid_length = utf8_valid_length_avx2;
+    kernels.base64_encode = base64_encode_avx2;
+    kernels.base64_decode = base64_decode_avx2;
+  }
+#elif defined(CODEC_NEON)
+  kernels.ascii_length = ascii_length_neon;
+  kernels.utf8_valid_length = utf8_valid_length_neon;
+  kernels.base64_encode = base64_encode_neon;
+  kernels.base64_decode = base64_decode_neon;
+#endif
+}
+
+static size_t ascii_length_scalar(const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  uint64_t word;
+
+  for (; offset + 8 <= size; offset += 8) {
+    memcpy(&word, data + offset, 8);
+    if (word & 0x8080808080808080ULL) {
+      break;
+    }
+  }
+
+  while (offset < size && data[offset] < 0x80) {
+    offset++;
+  }
+
+  return offset;
+}
+
+static size_t utf8_valid_length_scalar(const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  size_t length;
+  bool truncated;
+
+  while (offset < size) {
+    offset += ascii_length_scalar(data + offset, size - offset);
+    if (offset == size) {
+      break;
+    }
+    if (utf8_next(data + offset, size - offset, &length, &truncated) < 0) {
+      break;
+    }
+    offset += length;
+  }
+
+  return offset;
+}
+
+static size_t base64_encode_none(const uint8_t* data, size_t size, char* out, bool url) {
+  return 0;
+}
+
+static size_t base64_decode_none(const char* data, size_t size, uint8_t* out, size_t* written, bool strict) {
+  *written = 0;
+  return 0;
+}
+
+// Decodes one character. On failure, length is the maximal subpart to
+// replace and truncated tells whether data ended inside a valid prefix.
+static int32_t utf8_next(const uint8_t* data, size_t size, size_t* length, bool* truncated) {
+  uint8_t c = data[0];
+  uint8_t lower = 0x80;
+  uint8_t upper = 0xBF;
+  size_t needed;
+  uint32_t cp;
+
+  *length = 1;
+  *truncated = false;
+
+  if (c < 0x80) {
+    return c;
+  } else if (c >= 0xC2 && c <= 0xDF) {
+    needed = 1;
+    cp = c & 0x1F;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    needed = 2;
+    cp = c & 0x0F;
+    lower = c == 0xE0 ? 0xA0 : 0x80;
+    upper = c == 0xED ? 0x9F : 0xBF;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    needed = 3;
+    cp = c & 0x07;
+    lower = c == 0xF0 ? 0x90 : 0x80;
+    upper = c == 0xF4 ? 0x8F : 0xBF;
+  } else {
+    return -1;
+  }
+
+  for (size_t n = 1; n <= needed; n++) {
+    if (n >= size) {
+      *truncated = true;
+      return -1;
+    }
+    if (data[n] < lower || data[n] > upper) {
+      return -1;
+    }
+    cp = cp << 6 | (data[n] & 0x3F);
+    lower = 0x80;
+    upper = 0xBF;
+    *length = n + 1;
+  }
+
+  return (int32_t) cp;
+}
+
+static uint8_t* put_utf8(uint8_t* out, uint32_t cp) {
+  if (cp < 0x80) {
+    *out++ = (uint8_t) cp;
+  } else if (cp < 0x800) {
+    *out++ = (uint8_t) (0xC0 | cp >> 6);
+    *out++ = (uint8_t) (0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    *out++ = (uint8_t) (0xE0 | cp >> 12);
+    *out++ = (uint8_t) (0x80 | ((cp >> 6) & 0x3F));
+    *out++ = (uint8_t) (0x80 | (cp & 0x3F));
+  } else {
+    *out++ = (uint8_t) (0xF0 | cp >> 18);
+    *out++ = (uint8_t) (0x80 | ((cp >> 12) & 0x3F));
+    *out++ = (uint8_t) (0x80 | ((cp >> 6) & 0x3F));
+    *out++ = (uint8_t) (0x80 | (cp & 0x3F));
+  }
+
+  return out;
+}
+
+// error classes of the two byte window, see the paper for the derivation
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define UTF8_BYTE_1_HIGH \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+  TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+  TOO_SHORT | OVERLONG_2, \
+  TOO_SHORT, \
+  TOO_SHORT | OVERLONG_3 | SURROGATE, \
+  TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define UTF8_BYTE_1_LOW \
+  CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+  CARRY | OVERLONG_2, \
+  CARRY, \
+  CARRY, \
+  CARRY | TOO_LARGE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define UTF8_BYTE_2_HIGH \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+#ifdef CODEC_X64
+static size_t ascii_length_sse2(const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  int mask;
+
+  for (; offset + 16 <= size; offset += 16) {
+    mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (data + offset)));
+    if (mask) {
+      return offset + (size_t) ctz32((uint32_t) mask);
+    }
+  }
+
+  return offset + ascii_length_scalar(data + offset, size - offset);
+}
+
+CODEC_TARGET_AVX2 static size_t ascii_length_avx2(const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  int mask;
+
+  for (; offset + 32 <= size; offset += 32) {
+    mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) (data + offset)));
+    if (mask) {
+      return offset + (size_t) ctz32((uint32_t) mask);
+    }
+  }
+
+  return offset + ascii_length_sse2(data + offset, size - offset);
+}
+
+CODEC_TARGET_AVX2 static size_t utf8_valid_length_avx2(const uint8_t* data, size_t size) {
+  const __m256i byte_1_high = _mm256_setr_epi8(UTF8_BYTE_1_HIGH, UTF8_BYTE_1_HIGH);
+  const __m256i byte_1_low = _mm256_setr_epi8(UTF8_BYTE_1_LOW, UTF8_BYTE_1_LOW);
+  const __m256i byte_2_high = _mm256_setr_epi8(UTF8_BYTE_2_HIGH, UTF8_BYTE_2_HIGH);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  // the last three bytes of a block may not start a sequence that needs more
+  const __m256i incomplete_max = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+  __m256i prev_input = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  size_t offset = 0;
+  size_t checked = 0;
+
+  for (; offset + 32 <= size; offset += 32) {
+    __m256i input = _mm256_loadu_si256((const __m256i*) (data + offset));
+    __m256i error;
+
+    if (!_mm256_movemask_epi8(input)) {
+      // an ASCII block is only wrong if the previous one ended mid sequence
+      if (!_mm256_testz_si256(prev_incomplete, prev_incomplete)) {
+        break;
+      }
+      prev_input = input;
+      checked = offset + 32;
+      continue;
+    }
+
+    __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xF0 - 0x80)));
+    __m256i must_be_cont = _mm256_and_si256(
+        _mm256_cmpgt_epi8(_mm256_or_si256(third, fourth), _mm256_setzero_si256()),
+        _mm256_set1_epi8((char) 0x80));
+
+    error = _mm256_xor_si256(must_be_cont, special);
+    if (!_mm256_testz_si256(error, error)) {
+      break;
+    }
+
+    prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+    prev_input = input;
+    // a block that ends mid sequence is settled by the next one
+    if (_mm256_testz_si256(prev_incomplete, prev_incomplete)) {
+      checked = offset + 32;
+    }
+  }
+
+  return checked + utf8_valid_length_scalar(data + checked, size - checked);
+}
+
+CODEC_TARGET_AVX2 static inline __m256i base64_encode_block_avx2(__m256i input, __m256i lut) {
+  // spread each 3 byte group over a 32 bit lane, then move the four sextets
+  // into separate bytes with two multiplies
+  __m256i in = _mm256_shuffle_epi8(input, _mm256_set_epi8(
+      10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+      14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5));
+  __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00));
+  __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+  __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0));
+  __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+  __m256i indices = _mm256_or_si256(t1, t3);
+  // offset from each sextet to its character, chosen by range
+  __m256i ranges = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+
+  ranges = _mm256_sub_epi8(ranges, _mm256_cmpgt_epi8(indices, _mm256_set1_epi8(25)));
+
+  return _mm256_add_epi8(indices, _mm256_shuffle_epi8(lut, ranges));
+}
+
+CODEC_TARGET_AVX2 static size_t base64_encode_avx2(const uint8_t* data, size_t size, char* out, bool url) {
+  const char plus = url ? '-' - 62 : '+' - 62;
+  const char slash = url ? '_' - 63 : '/' - 63;
+  const __m256i lut = _mm256_setr_epi8(
+      65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, plus, slash, 0, 0,
+      65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, plus, slash, 0, 0);
+  size_t offset = 0;
+  __m256i input;
+
+  if (size < 28) {
+    return 0;
+  }
+
+  // blocks are loaded 4 bytes early so that each lane holds 12 input bytes;
+  // the first load masks off the bytes before data
+  input = _mm256_maskload_epi32((const int*) (data - 4), _mm256_set_epi32(
+      (int) 0x80000000, (int) 0x80000000, (int) 0x80000000, (int) 0x80000000,
+      (int) 0x80000000, (int) 0x80000000, (int) 0x80000000, 0));
+
+  for (;;) {
+    _mm256_storeu_si256((__m256i*) (out + offset / 3 * 4), base64_encode_block_avx2(input, lut));
+    offset += 24;
+    if (size - offset < 28) {
+      break;
+    }
+    input = _mm256_loadu_si256((const __m256i*) (data + offset - 4));
+  }
+
+  return offset;
+}
+
+CODEC_TARGET_AVX2 static size_t base64_decode_avx2(const char* data, size_t size, uint8_t* out, size_t* written, bool strict) {
+  const __m256i lut_lo = _mm256_setr_epi8(
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+  size_t offset = 0;
+
+  // stops at the first block with anything but the standard alphabet in it
+  for (; size - offset >= BASE64_AVX2_MIN_INPUT; offset += 32) {
+    __m256i str = _mm256_loadu_si256((const __m256i*) (data + offset));
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    __m256i merged;
+
+    if (!_mm256_testz_si256(lo, hi)) {
+      break;
+    }
+
+    // sextets back to bytes, then pack the 24 output bytes together
+    str = _mm256_add_epi8(str, roll);
+    merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256((__m256i*) (out + offset / 4 * 3), merged);
+  }
+
+  *written = offset / 4 * 3;
+
+  return offset;
+}
+
+static bool has_avx2() {
+#ifdef _MSC_VER
+  int info[4];
+
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  __cpuid(info, 1);
+  // AVX and OSXSAVE, and the OS saves the YMM registers
+  if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+
+  return (info[1] & 0x20) != 0;
+#else
+  __builtin_cpu_init();
+
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static uint32_t ctz32(uint32_t value) {
+#ifdef _MSC_VER
+  unsigned long index;
+
+  _BitScanForward(&index, value);
+
+  return (uint32_t) index;
+#else
+  return (uint32_t) __builtin_ctz(value);
+#endif
+}
+#endif
+
+#ifdef CODEC_NEON
+static size_t ascii_length_neon(const uint8_t* data, size_t size) {
+  size_t offset = 0;
+
+  for (; offset + 16 <= size; offset += 16) {
+    if (vmaxvq_u8(vld1q_u8(data + offset)) >= 0x80) {
+      break;
+    }
+  }
+
+  return offset + ascii_length_scalar(data + offset, size - offset);
+}
+
+static size_t utf8_valid_length_neon(const uint8_t* data, size_t size) {
+  static const uint8_t BYTE_1_HIGH[16] = { UTF8_BYTE_1_HIGH };
+  static const uint8_t BYTE_1_LOW[16] = { UTF8_BYTE_1_LOW };
+  static const uint8_t BYTE_2_HIGH[16] = { UTF8_BYTE_2_HIGH };
+  static const uint8_t INCOMPLETE_MAX[16] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+  };
+  const uint8x16_t byte_1_high = vld1q_u8(BYTE_1_HIGH);
+  const uint8x16_t byte_1_low = vld1q_u8(BYTE_1_LOW);
+  const uint8x16_t byte_2_high = vld1q_u8(BYTE_2_HIGH);
+  const uint8x16_t incomplete_max = vld1q_u8(INCOMPLETE_MAX);
+  const uint8x16_t nibble = vdupq_n_u8(0x0F);
+  uint8x16_t prev_input = vdupq_n_u8(0);
+  uint8x16_t prev_incomplete = vdupq_n_u8(0);
+  size_t offset = 0;
+  size_t checked = 0;
+
+  for (; offset + 16 <= size; offset += 16) {
+    uint8x16_t input = vld1q_u8(data + offset);
+
+    if (vmaxvq_u8(input) < 0x80) {
+      if (vmaxvq_u8(prev_incomplete)) {
+        break;
+      }
+      prev_input = input;
+      checked = offset + 16;
+      continue;
+    }
+
+    uint8x16_t prev1 = vextq_u8(prev_input, input, 15);
+    uint8x16_t prev2 = vextq_u8(prev_input, input, 14);
+    uint8x16_t prev3 = vextq_u8(prev_input, input, 13);
+    uint8x16_t special = vandq_u8(
+        vandq_u8(vqtbl1q_u8(byte_1_high, vshrq_n_u8(prev1, 4)), vqtbl1q_u8(byte_1_low, vandq_u8(prev1, nibble))),
+        vqtbl1q_u8(byte_2_high, vshrq_n_u8(input, 4)));
+    uint8x16_t third = vqsubq_u8(prev2, vdupq_n_u8(0xE0 - 0x80));
+    uint8x16_t fourth = vqsubq_u8(prev3, vdupq_n_u8(0xF0 - 0x80));
+    uint8x16_t must_be_cont = vandq_u8(vcgtq_u8(vorrq_u8(third, fourth), vdupq_n_u8(0)), vdupq_n_u8(0x80));
+
+    if (vmaxvq_u8(veorq_u8(must_be_cont, special))) {
+      break;
+    }
+
+    prev_incomplete = vqsubq_u8(input, incomplete_max);
+    prev_input = input;
+    if (!vmaxvq_u8(prev_incomplete)) {
+      checked = offset + 16;
+    }
+  }
+
+  return checked + utf8_valid_length_scalar(data + checked, size - checked);
+}
+
+static size_t base64_encode_neon(const uint8_t* data, size_t size, char* out, bool url) {
+  const char* alphabet = url ? BASE64_URL : BASE64;
+  uint8x16x4_t table;
+  size_t offset = 0;
+
+  table.val[0] = vld1q_u8((const uint8_t*) alphabet);
+  table.val[1] = vld1q_u8((const uint8_t*) alphabet + 16);
+  table.val[2] = vld1q_u8((const uint8_t*) alphabet + 32);
+  table.val[3] = vld1q_u8((const uint8_t*) alphabet + 48);
+
+  for (; offset + 48 <= size; offset += 48) {
+    uint8x16x3_t in = vld3q_u8(data + offset);
+    uint8x16x4_t result;
+
+    result.val[0] = vshrq_n_u8(in.val[0], 2);
+    result.val[1] = vandq_u8(vorrq_u8(vshrq_n_u8(in.val[1], 4), vshlq_n_u8(in.val[0], 4)), vdupq_n_u8(0x3F));
+    result.val[2] = vandq_u8(vorrq_u8(vshrq_n_u8(in.val[2], 6), vshlq_n_u8(in.val[1], 2)), vdupq_n_u8(0x3F));
+    result.val[3] = vandq_u8(in.val[2], vdupq_n_u8(0x3F));
+    result.val[0] = vqtbl4q_u8(table, result.val[0]);
+    result.val[1] = vqtbl4q_u8(table, result.val[1]);
+    result.val[2] = vqtbl4q_u8(table, result.val[2]);
+    result.val[3] = vqtbl4q_u8(table, result.val[3]);
+    vst4q_u8((uint8_t*) out + offset / 3 * 4, result);
+  }
+
+  return offset;
+}
+
+static size_t base64_decode_neon(const char* data, size_t size, uint8_t* out, size_t* written, bool strict) {
+  uint8x16x4_t low;
+  uint8x16x4_t high;
+  uint8_t table[128];
+  size_t offset = 0;
+
+  *written = 0;
+  if (size < 64) {
+    return 0;
+  }
+
+  // BASE64_DECODE maps everything that is not a sextet to 64 or above
+  for (int n = 0; n < 128; n++) {
+    table[n] = BASE64_DECODE[n] < 64 ? BASE64_DECODE[n] : 0xFF;
+  }
+  if (strict) {
+    table['-'] = 0xFF;
+    table['_'] = 0xFF;
+  }
+  for (int n = 0; n < 4; n++) {
+    low.val[n] = vld1q_u8(table + n * 16);
+    high.val[n] = vld1q_u8(table + 64 + n * 16);
+  }
+
+  for (; offset + 64 <= size; offset += 64) {
+    uint8x16x4_t in = vld4q_u8((const uint8_t*) data + offset);
+    uint8x16x3_t result;
+    uint8x16_t error = vdupq_n_u8(0);
+
+    for (int n = 0; n < 4; n++) {
+      uint8x16_t c = in.val[n];
+
+      // vqtbl gives 0 past its table, so bytes from 0x80 are caught apart
+      in.val[n] = vqtbx4q_u8(vqtbl4q_u8(low, c), high, veorq_u8(c, vdupq_n_u8(0x40)));
+      error = vorrq_u8(error, vorrq_u8(in.val[n], vshrq_n_u8(c, 1)));
+    }
+    if (vmaxvq_u8(error) >= 0x40) {
+      break;
+    }
+
+    result.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+    result.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+    result.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+    vst3q_u8(out + offset / 4 * 3, result);
+  }
+
+  *written = offset / 4 * 3;
+
+  return offset;
+}
+#endif
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <veil.h>
+#include <veil_addon.h>
 #include <quickjs.h>
 #include <uv.h>
 #include <stc/cstr.h>
@@ -15,52 +16,232 @@
 
 forward_cvec(cvec_str, cstr);
 
-typedef struct veil_vm_s {
-  bool enabled;
-  JSRuntime* runtime;
-  JSContext* context;
-} veil_vm_t;
-
-typedef struct uv_microtask_context_s uv_microtask_context_t;
-typedef bool (*uv_has_mircotasks_cb)(uv_microtask_context_t* context);
-typedef void (*uv_run_mircotasks_cb)(uv_microtask_context_t* context);
-
-typedef struct veil_uv_s {
-  bool enabled;
-  uv_loop_t loop;
-
-  uv_prepare_t prepare_job;
-  uv_idle_t idle_job;
-  uv_check_t check_job;
-  uv_async_t stop;
-
-  uv_microtask_context_t* microtask_context;
-  uv_has_mircotasks_cb has_microtasks_cb;
-  uv_run_mircotasks_cb run_microtasks_cb;
-} veil_uv_t;
-
 typedef struct veil_cfg_s {
   bool writable;
+  bool no_addon;
   bool no_deprecation;
   bool throw_deprecation;
   bool expose_gc;
   bool expose_internals;
   bool preserve_symlinks;
   bool preserve_symlinks_main;
+  bool build_snapshot;
+  bool gc_adaptive;
+  bool cpu_prof;
+  uint32_t cpu_prof_interval;
+  int heapsnapshot_signal;
+  cstr cpu_prof_dir;
+  size_t max_heap_size;
+  size_t gc_threshold;
+  size_t max_stack_size;
+  uint32_t microtask_budget;
+  uint32_t microtask_slice_ms;
+  // --workers: child processes to supervise, 0 to run in this one
+  uint32_t workers;
   cstr loader;
   cstr script;
+  cstr code_cache_dir;
+  cstr resolution_manifest;
+  cstr snapshot_blob;
+  cstr build_bundle;
+  veil_allocator_t allocator;
   veil_input_type_t input_type;
   veil_script_op_t script_op;
   veil_esm_specifier_resolution_t esm_specifier_resolution;
   cvec_str conditions;
   cvec_str require;
   cvec_str import;
+  cvec_str bundle_assets;
 
   cstr argv0;
   cvec_str argv;
   cvec_str exec_argv;
 } veil_cfg_t;
 
+#define VEIL_POOL_CLASS_COUNT 16
+
+typedef struct veil_alloc_s {
+  veil_allocator_t kind;
+  JSMallocState* state;
+  // pool pages with a free block, per size class, and every page held
+  void* pages[VEIL_POOL_CLASS_COUNT];
+  void* owned;
+} veil_alloc_t;
+
+typedef struct veil_gc_s {
+  bool adaptive;
+  size_t threshold;
+  size_t min_threshold;
+  size_t max_threshold;
+  uint64_t runs;
+} veil_gc_t;
+
+typedef struct veil_microtasks_s {
+  uint32_t budget;
+  uint64_t slice_ns;
+  veil_microtask_stats_t stats;
+} veil_microtasks_t;
+
+typedef struct veil_code_cache_s {
+  bool enabled;
+  cstr dir;
+} veil_code_cache_t;
+
+typedef struct veil_snapshot_entry_s {
+  bool root;
+  bool module;
+  cstr name;
+  uint8_t* bytecode;
+  size_t bytecode_size;
+} veil_snapshot_entry_t;
+
+forward_cvec(cvec_snapshot_entry, veil_snapshot_entry_t);
+forward_cmap(cmap_snapshot_resolution, cstr, cstr);
+
+typedef struct veil_snapshot_s {
+  bool recording;
+  cvec_snapshot_entry entries;
+  // "base\nspecifier" -> resolved name of every import in the preload graph
+  cmap_snapshot_resolution resolutions;
+} veil_snapshot_t;
+
+// a promise rejected without a handler, uncaught unless one is attached by
+// the time the microtask queue drains
+typedef struct veil_rejection_s {
+  JSValue promise;
+  JSValue reason;
+} veil_rejection_t;
+
+forward_cvec(cvec_rejection, veil_rejection_t);
+
+typedef struct veil_uv_s veil_uv_t;
+typedef struct veil_worker_s veil_worker_t;
+typedef struct veil_profiler_s veil_profiler_t;
+typedef struct veil_resolver_s veil_resolver_t;
+typedef struct veil_prefetch_s veil_prefetch_t;
+typedef struct veil_bundle_s veil_bundle_t;
+typedef struct veil_bundle_builder_s veil_bundle_builder_t;
+typedef struct veil_net_s veil_net_t;
+typedef struct veil_timers_s veil_timers_t;
+typedef struct veil_timer_s veil_timer_t;
+
+// microseconds, node's default --cpu-prof-interval
+#define VEIL_CPU_PROF_DEFAULT_INTERVAL 1000
+
+#define VEIL_HISTOGRAM_BUCKETS 1920
+
+#define VEIL_CLUSTER_MAX_WORKERS 1024
+
+typedef struct veil_histogram_s {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+  double sum_sq;
+  uint64_t buckets[VEIL_HISTOGRAM_BUCKETS];
+} veil_histogram_t;
+
+// Native resources that must be released before the VM's loop is closed,
+// typically uv handles owned by JS objects that may outlive the loop. Nodes
+// unlink themselves when released early.
+typedef struct veil_cleanup_s veil_cleanup_t;
+typedef void (*veil_cleanup_cb)(veil_cleanup_t* cleanup);
+
+struct veil_cleanup_s {
+  veil_cleanup_t* next;
+  veil_cleanup_t* prev;
+  veil_cleanup_cb cb;
+};
+
+typedef struct veil_vm_s {
+  bool enabled;
+  veil_alloc_t alloc;
+  veil_gc_t gc;
+  veil_microtasks_t microtasks;
+  uint64_t time_origin;
+  veil_cleanup_t cleanups;
+  veil_profiler_t* profiler;
+  veil_resolver_t* resolver;
+  veil_prefetch_t* prefetch;
+  // borrowed from veil_run(), shared with workers
+  veil_bundle_t* bundle;
+  veil_bundle_builder_t* bundle_builder;
+  // created by the first import of net
+  veil_net_t* net;
+  // created by the first timer
+  veil_timers_t* timers;
+  // created by the first addon
+  veil_addon_env_t* addons;
+  // Uint8Array and Buffer.prototype, for making Buffers from C
+  JSValue uint8_array;
+  JSValue buffer_proto;
+  // the engine's ArrayBuffer, behind veil's global one
+  JSValue array_buffer;
+  // the engine's Atomics.wait() and Atomics.notify(), which validate for
+  // veil's interruptible versions
+  JSValue atomics_wait;
+  JSValue atomics_notify;
+  JSInterruptHandler* interrupt;
+  void* interrupt_opaque;
+  JSRuntime* runtime;
+  JSContext* context;
+  const veil_cfg_t* cfg;
+  veil_code_cache_t code_cache;
+  veil_snapshot_t snapshot;
+  veil_uv_t* uv;
+  veil_worker_t* worker;
+  veil_worker_t* workers;
+  cvec_rejection rejections;
+  // an exception reached the top level; the loop stops and veil exits with 1
+  bool uncaught;
+} veil_vm_t;
+
+typedef struct uv_microtask_context_s uv_microtask_context_t;
+typedef bool (*uv_has_mircotasks_cb)(uv_microtask_context_t* context);
+typedef void (*uv_run_mircotasks_cb)(uv_microtask_context_t* context);
+typedef void (*uv_heap_snapshot_cb)(uv_microtask_context_t* context);
+typedef void (*uv_flush_cb)(uv_microtask_context_t* context);
+typedef bool (*uv_has_immediates_cb)(uv_microtask_context_t* context);
+typedef void (*uv_run_immediates_cb)(uv_microtask_context_t* context);
+
+typedef struct veil_uv_metrics_s {
+  uint64_t start;
+  uint64_t iterations;
+  uint64_t poll_start;
+  uint64_t poll_ns;
+  uint64_t timer_ns;
+  uint64_t immediate_ns;
+  uint64_t microtask_ns;
+  uint64_t flush_ns;
+  uint64_t iteration_end;
+  uint64_t iteration_idle;
+  veil_histogram_t iteration_busy;
+} veil_uv_metrics_t;
+
+struct veil_uv_s {
+  bool enabled;
+  uv_loop_t loop;
+  veil_uv_metrics_t metrics;
+
+  uv_prepare_t prepare_job;
+  uv_idle_t idle_job;
+  uv_check_t check_job;
+  uv_async_t stop;
+  uv_signal_t heap_snapshot_signal;
+
+  uv_microtask_context_t* microtask_context;
+  uv_has_mircotasks_cb has_microtasks_cb;
+  uv_run_mircotasks_cb run_microtasks_cb;
+  // writes batched during the turn go out before poll and after microtasks
+  uv_flush_cb flush_cb;
+  // setImmediate() callbacks run in the check phase, ahead of microtasks
+  uv_has_immediates_cb has_immediates_cb;
+  uv_run_immediates_cb run_immediates_cb;
+  // --heapsnapshot-signal, 0 when unset
+  int heap_snapshot_signum;
+  uv_heap_snapshot_cb heap_snapshot_cb;
+};
+
 struct veil_s {
   veil_cfg_t cfg;
   veil_uv_t uv;
@@ -75,10 +256,198 @@ veil_parse_args_result_t veil_cfg_parse_args(veil_t* veil, int argc, char** argv
 void veil_uv_init(veil_uv_t* uv);
 void veil_uv_drop(veil_uv_t* uv);
 void veil_uv_run(veil_uv_t* uv);
+void veil_uv_get_metrics(veil_uv_t* uv, veil_loop_metrics_t* metrics);
 
-void veil_vm_init(veil_vm_t* vm);
+void veil_vm_init(veil_vm_t* vm, const veil_cfg_t* cfg);
 void veil_vm_drop(veil_vm_t* vm);
-void veil_vm_drain_microtasks(veil_vm_t* vm);
+void veil_vm_reset(veil_vm_t* vm);
+void veil_vm_attach(veil_vm_t* vm, veil_uv_t* uv);
+bool veil_vm_drain_microtasks(veil_vm_t* vm);
+JSValue veil_vm_compile_file(veil_vm_t* vm, const char* filename, bool force_module);
+bool veil_vm_run_file(veil_vm_t* vm, const char* filename, bool force_module);
+bool veil_vm_run_compiled(veil_vm_t* vm, JSValue compiled);
+void veil_vm_dump_exception(veil_vm_t* vm);
+void veil_vm_set_interrupt(veil_vm_t* vm, JSInterruptHandler* handler, void* opaque);
+void veil_vm_add_cleanup(veil_vm_t* vm, veil_cleanup_t* cleanup, veil_cleanup_cb cb);
+void veil_vm_remove_cleanup(veil_cleanup_t* cleanup);
+void veil_vm_run_cleanups(veil_vm_t* vm);
+
+bool veil_alloc_available(veil_allocator_t kind);
+void veil_alloc_init(veil_alloc_t* alloc, veil_allocator_t kind);
+void veil_alloc_drop(veil_alloc_t* alloc);
+JSRuntime* veil_alloc_new_runtime(veil_alloc_t* alloc);
+size_t veil_alloc_heap_size(const veil_alloc_t* alloc);
+
+veil_resolver_t* veil_resolver_new(const veil_cfg_t* cfg);
+void veil_resolver_free(veil_resolver_t* resolver);
+char* veil_resolver_resolve(veil_resolver_t* resolver, JSContext* ctx, const char* base, const char* specifier);
+bool veil_resolver_save(veil_resolver_t* resolver);
+
+typedef struct veil_prefetched_s {
+  veil_file_t source;
+  int eval_flags;
+  uint8_t* bytecode;
+  size_t bytecode_size;
+} veil_prefetched_t;
+
+veil_prefetch_t* veil_prefetch_new(veil_vm_t* vm);
+void veil_prefetch_free(veil_prefetch_t* prefetch);
+void veil_prefetch_add(veil_prefetch_t* prefetch, const char* filename, bool force_module);
+void veil_prefetch_wait(veil_prefetch_t* prefetch);
+bool veil_prefetch_take(veil_prefetch_t* prefetch, const char* filename, veil_prefetched_t* out);
+
+bool veil_bundle_detect(const char* filename);
+veil_bundle_t* veil_bundle_open(const char* filename);
+void veil_bundle_close(veil_bundle_t* bundle);
+size_t veil_bundle_root_count(const veil_bundle_t* bundle);
+const char* veil_bundle_root(const veil_bundle_t* bundle, size_t index);
+JSValue veil_bundle_compile(veil_bundle_t* bundle, JSContext* ctx, const char* filename);
+bool veil_bundle_contains(const veil_bundle_t* bundle, const char* filename);
+char* veil_bundle_resolve(veil_bundle_t* bundle, JSContext* ctx, const char* base, const char* specifier);
+bool veil_bundle_get_asset(const veil_bundle_t* bundle, const char* name, const uint8_t** data, size_t* size);
+veil_bundle_builder_t* veil_bundle_builder_new();
+void veil_bundle_builder_free(veil_bundle_builder_t* builder);
+void veil_bundle_builder_add_module(veil_bundle_builder_t* builder, JSContext* ctx, const char* filename, JSValueConst compiled, bool root);
+void veil_bundle_builder_add_resolution(veil_bundle_builder_t* builder, const char* base, const char* specifier, const char* resolved);
+void veil_bundle_builder_add_asset(veil_bundle_builder_t* builder, const char* filename);
+bool veil_bundle_builder_write(veil_bundle_builder_t* builder, const char* filename);
+JSModuleDef* veil_sea_init_module(JSContext* ctx, const char* name);
+
+veil_profiler_t* veil_profiler_start(uint32_t interval_us);
+void veil_profiler_stop(veil_profiler_t* profiler);
+void veil_profiler_free(veil_profiler_t* profiler);
+void veil_profiler_sample(veil_profiler_t* profiler, JSContext* ctx);
+bool veil_profiler_write(veil_profiler_t* profiler, const char* filename);
+
+void veil_heap_get_usage(veil_vm_t* vm, veil_memory_usage_t* usage);
+bool veil_heap_write_snapshot(veil_vm_t* vm, const char* filename);
+JSModuleDef* veil_v8_init_module(JSContext* ctx, const char* name);
+
+void veil_histogram_init(veil_histogram_t* histogram);
+void veil_histogram_record(veil_histogram_t* histogram, uint64_t value);
+uint64_t veil_histogram_percentile(const veil_histogram_t* histogram, double percentile);
+double veil_histogram_mean(const veil_histogram_t* histogram);
+double veil_histogram_stddev(const veil_histogram_t* histogram);
+
+void veil_code_cache_init(veil_code_cache_t* cache, const char* dir);
+void veil_code_cache_drop(veil_code_cache_t* cache);
+JSValue veil_code_cache_load(veil_code_cache_t* cache, JSContext* ctx, const char* filename, const veil_file_t* source, int eval_flags);
+void veil_code_cache_store(veil_code_cache_t* cache, JSContext* ctx, const char* filename, const veil_file_t* source, int eval_flags, JSValueConst compiled);
+
+void veil_snapshot_init(veil_snapshot_t* snapshot, bool recording);
+void veil_snapshot_drop(veil_snapshot_t* snapshot);
+void veil_snapshot_record(veil_snapshot_t* snapshot, JSContext* ctx, const char* filename, JSValueConst compiled, bool root);
+void veil_snapshot_record_resolution(veil_snapshot_t* snapshot, const char* base, const char* specifier, const char* resolved);
+char* veil_snapshot_resolve(veil_snapshot_t* snapshot, JSContext* ctx, const char* base, const char* specifier);
+bool veil_snapshot_write(veil_snapshot_t* snapshot, const char* filename);
+bool veil_snapshot_restore(veil_vm_t* vm, const char* filename);
+
+bool veil_builtin_exists(const char* name);
+JSModuleDef* veil_builtin_load(JSContext* ctx, const char* name);
+JSValue veil_builtin_new_uv_error(JSContext* ctx, int err, const char* syscall, const char* path);
+bool veil_builtin_get_bytes(JSContext* ctx, JSValueConst value, uint8_t** data, size_t* size);
+JSValue veil_builtin_new_uint8_array(JSContext* ctx, JSValue buffer);
+
+void veil_emitter_on(JSContext* ctx, JSValueConst obj, const char* event, JSValueConst listener);
+void veil_emitter_off(JSContext* ctx, JSValueConst obj, const char* event, JSValueConst listener);
+uint32_t veil_emitter_count(JSContext* ctx, JSValueConst obj, const char* event);
+bool veil_emitter_emit(JSContext* ctx, JSValueConst obj, const char* event, int argc, JSValueConst* argv);
+JSValue veil_emitter_js_on(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+JSValue veil_emitter_js_off(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+void veil_shared_install(JSRuntime* rt);
+void veil_shared_install_globals(veil_vm_t* vm);
+void veil_shared_drop_globals(veil_vm_t* vm);
+void* veil_shared_alloc(size_t size);
+// registers malloc'd data as a block with one reference
+void* veil_shared_adopt(void* data);
+void veil_shared_dup(void* data);
+void veil_shared_free(void* data);
+bool veil_shared_owns(const void* data);
+JSValue veil_shared_new_array_buffer(JSContext* ctx, void* data, size_t size);
+// takes malloc'd data, freed on failure; large stores become shared blocks
+JSValue veil_shared_adopt_array_buffer(JSContext* ctx, uint8_t* data, size_t size);
+// wakes the VM's thread from Atomics.wait() to check its interrupt handler
+void veil_shared_interrupt(const veil_vm_t* vm);
+
+#define VEIL_BASE64_SIZE(size) (((size) + 2) / 3 * 4)
+#define VEIL_BASE64_DECODED_SIZE(size) ((size) / 4 * 3 + 3)
+
+size_t veil_codec_ascii_length(const uint8_t* data, size_t size);
+bool veil_codec_utf8_valid(const uint8_t* data, size_t size);
+size_t veil_codec_utf8_sanitize(const uint8_t* data, size_t size, uint8_t* out);
+size_t veil_codec_utf8_incomplete(const uint8_t* data, size_t size);
+void veil_codec_wtf8_fix(uint8_t* data, size_t size);
+size_t veil_codec_latin1_to_utf8(const uint8_t* data, size_t size, uint8_t* out);
+size_t veil_codec_utf16le_to_utf8(const uint8_t* data, size_t size, uint8_t* out);
+size_t veil_codec_utf8_to_utf16le(const uint8_t* data, size_t size, uint8_t* out);
+size_t veil_codec_utf8_to_latin1(const uint8_t* data, size_t size, uint8_t* out);
+size_t veil_codec_base64_encode(const uint8_t* data, size_t size, char* out, bool url);
+bool veil_codec_base64_decode(const char* data, size_t size, uint8_t* out, size_t* out_size, bool strict);
+size_t veil_codec_hex_encode(const uint8_t* data, size_t size, char* out);
+size_t veil_codec_hex_decode(const char* data, size_t size, uint8_t* out);
+
+uint32_t veil_cluster_worker_id();
+int veil_cluster_run(veil_t* veil, int argc, char** argv);
+JSModuleDef* veil_cluster_init_module(JSContext* ctx, const char* name);
+
+bool veil_addon_is_addon(const char* filename);
+JSModuleDef* veil_addon_load(JSContext* ctx, const char* filename);
+void veil_addon_drop(veil_vm_t* vm);
+void veil_addon_free(veil_addon_env_t* env);
+
+void veil_encoding_install(veil_vm_t* vm);
+void veil_encoding_drop(veil_vm_t* vm);
+JSModuleDef* veil_buffer_init_module(JSContext* ctx, const char* name);
+JSValue veil_buffer_new(JSContext* ctx, uint8_t* data, size_t size);
+
+JSModuleDef* veil_child_process_init_module(JSContext* ctx, const char* name);
+
+JSModuleDef* veil_fs_init_module(JSContext* ctx, const char* name);
+JSModuleDef* veil_fs_promises_init_module(JSContext* ctx, const char* name);
+
+JSModuleDef* veil_http_init_module(JSContext* ctx, const char* name);
+
+JSModuleDef* veil_json_init_module(JSContext* ctx, const char* name);
+
+typedef struct veil_net_listen_s {
+  struct sockaddr_storage addr;
+  int backlog;
+  bool reuse_port;
+} veil_net_listen_t;
+
+JSModuleDef* veil_net_init_module(JSContext* ctx, const char* name);
+void veil_net_flush(veil_vm_t* vm);
+void veil_net_free(veil_net_t* net);
+bool veil_net_parse_listen(JSContext* ctx, int argc, JSValueConst* argv, veil_net_listen_t* out);
+int veil_net_listen(uv_tcp_t* tcp, const veil_net_listen_t* listen, uv_connection_cb cb);
+JSValue veil_net_new_address(JSContext* ctx, const struct sockaddr_storage* addr);
+void* veil_net_slab_acquire(veil_vm_t* vm, size_t* size);
+void veil_net_slab_release(veil_vm_t* vm, void* slab);
+
+JSModuleDef* veil_perf_hooks_init_module(JSContext* ctx, const char* name);
+
+JSModuleDef* veil_process_init_module(JSContext* ctx, const char* name);
+
+void veil_timers_install(veil_vm_t* vm);
+JSModuleDef* veil_timers_init_module(JSContext* ctx, const char* name);
+bool veil_timers_has_immediates(veil_vm_t* vm);
+void veil_timers_run_immediates(veil_vm_t* vm);
+
+JSModuleDef* veil_worker_init_module(JSContext* ctx, const char* name);
+void veil_worker_drop_all(veil_vm_t* vm);
+int32_t veil_worker_thread_id(const veil_vm_t* vm);
+void veil_worker_post_exception(veil_vm_t* vm, JSValueConst exception);
+
+JSModuleDef* veil_zlib_init_module(JSContext* ctx, const char* name);
+
+#ifndef countof
+#define countof(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+#ifndef container_of
+#define container_of(ptr, type, member) ((type*) ((char*) (ptr) - offsetof(type, member)))
+#endif
 
 #define CHECK(EXPR) do { if (!(EXPR)) { veil_abort(__FILE__, __LINE__, #EXPR); } } while (0)
 #define CHECK_OK(X) CHECK((X) == 0)
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// Listeners live on the JS object itself under a non-enumerable "_events"
+// record of event name -> array of functions, so native classes get
+// on()/off() without any per-class bookkeeping.
+
+static JSValue get_events(JSContext* ctx, JSValueConst obj, bool create);
+static JSValue get_listeners(JSContext* ctx, JSValueConst obj, const char* event, uint32_t* length);
+
+void veil_emitter_on(JSContext* ctx, JSValueConst obj, const char* event, JSValueConst listener) {
+  JSValue events = get_events(ctx, obj, true);
+  JSValue list = JS_GetPropertyStr(ctx, events, event);
+  uint32_t length = 0;
+
+  if (JS_IsUndefined(list)) {
+    list = JS_NewArray(ctx);
+    JS_SetPropertyStr(ctx, events, event, JS_DupValue(ctx, list));
+  } else {
+    JSValue value = JS_GetPropertyStr(ctx, list, "length");
+    JS_ToUint32(ctx, &length, value);
+    JS_FreeValue(ctx, value);
+  }
+
+  JS_SetPropertyUint32(ctx, list, length, JS_DupValue(ctx, listener));
+
+  JS_FreeValue(ctx, list);
+  JS_FreeValue(ctx, events);
+}
+
+void veil_emitter_off(JSContext* ctx, JSValueConst obj, const char* event, JSValueConst listener) {
+  uint32_t length;
+  uint32_t count = 0;
+  JSValue list = get_listeners(ctx, obj, event, &length);
+  JSValue events;
+  JSValue next;
+
+  if (length == 0) {
+    JS_FreeValue(ctx, list);
+    return;
+  }
+
+  next = JS_NewArray(ctx);
+  for (uint32_t n = 0; n < length; n++) {
+    JSValue fn = JS_GetPropertyUint32(ctx, list, n);
+
+    if (JS_VALUE_GET_PTR(fn) == JS_VALUE_GET_PTR(listener)) {
+      JS_FreeValue(ctx, fn);
+    } else {
+      JS_SetPropertyUint32(ctx, next, count++, fn);
+    }
+  }
+
+  events = get_events(ctx, obj, false);
+  JS_SetPropertyStr(ctx, events, event, next);
+
+  JS_FreeValue(ctx, events);
+  JS_FreeValue(ctx, list);
+}
+
+uint32_t veil_emitter_count(JSContext* ctx, JSValueConst obj, const char* event) {
+  uint32_t length;
+
+  JS_FreeValue(ctx, get_listeners(ctx, obj, event, &length));
+
+  return length;
+}
+
+bool veil_emitter_emit(JSContext* ctx, JSValueConst obj, const char* event, int argc, JSValueConst* argv) {
+  uint32_t length;
+  JSValue list = get_listeners(ctx, obj, event, &length);
+  JSValue* listeners;
+
+  if (length == 0) {
+    JS_FreeValue(ctx, list);
+    return false;
+  }
+
+  // copy first: listeners may add or remove listeners while being called
+  listeners = js_malloc(ctx, length * sizeof(JSValue));
+  CHECK_NOT_NULL(listeners);
+  for (uint32_t n = 0; n < length; n++) {
+    listeners[n] = JS_GetPropertyUint32(ctx, list, n);
+  }
+  JS_FreeValue(ctx, list);
+
+  for (uint32_t n = 0; n < length; n++) {
+    JSValue result = JS_Call(ctx, listeners[n], obj, argc, argv);
+
+    if (JS_IsException(result)) {
+      veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+    }
+    JS_FreeValue(ctx, result);
+    JS_FreeValue(ctx, listeners[n]);
+  }
+
+  js_free(ctx, listeners);
+
+  return true;
+}
+
+JSValue veil_emitter_js_on(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  const char* event;
+
+  if (argc < 2 || !JS_IsFunction(ctx, argv[1])) {
+    return JS_ThrowTypeError(ctx, "listener must be a function");
+  }
+
+  event = JS_ToCString(ctx, argv[0]);
+  if (!event) {
+    return JS_EXCEPTION;
+  }
+
+  veil_emitter_on(ctx, this_val, event, argv[1]);
+  JS_FreeCString(ctx, event);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+JSValue veil_emitter_js_off(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  const char* event;
+
+  if (argc < 2) {
+    return JS_DupValue(ctx, this_val);
+  }
+
+  event = JS_ToCString(ctx, argv[0]);
+  if (!event) {
+    return JS_EXCEPTION;
+  }
+
+  veil_emitter_off(ctx, this_val, event, argv[1]);
+  JS_FreeCString(ctx, event);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue get_events(JSContext* ctx, JSValueConst obj, bool create) {
+  JSValue events = JS_GetPropertyStr(ctx, obj, "_events");
+
+  if (JS_IsUndefined(events) && create) {
+    events = JS_NewObjectProto(ctx, JS_NULL);
+    JS_DefinePropertyValueStr(ctx, obj, "_events", JS_DupValue(ctx, events), JS_PROP_CONFIGURABLE | JS_PROP_WRITABLE);
+  }
+
+  return events;
+}
+
+static JSValue get_listeners(JSContext* ctx, JSValueConst obj, const char* event, uint32_t* length) {
+  JSValue events = get_events(ctx, obj, false);
+  JSValue list = JS_UNDEFINED;
+
+  *length = 0;
+
+  if (JS_IsObject(events)) {
+    list = JS_GetPropertyStr(ctx, events, event);
+
+    if (JS_IsObject(list)) {
+      JSValue value = JS_GetPropertyStr(ctx, list, "length");
+      JS_ToUint32(ctx, length, value);
+      JS_FreeValue(ctx, value);
+    }
+  }
+
+  JS_FreeValue(ctx, events);
+
+  return list;
+}
@@ -0,0 +1,1427 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+
+// Buffer, TextEncoder, TextDecoder, atob and btoa as globals of every context,
+// with the byte work done by the kernels in codec.c.
+//
+// A Buffer is a Uint8Array whose prototype is Buffer.prototype, which in turn
+// inherits from Uint8Array.prototype. Buffer is also Uint8Array's species, so
+// subarray(), map() and friends construct Buffers through it.
+
+enum {
+  ENCODING_UTF8,
+  ENCODING_HEX,
+  ENCODING_BASE64,
+  ENCODING_BASE64URL,
+  ENCODING_LATIN1,
+  ENCODING_ASCII,
+  ENCODING_UTF16LE,
+  // TextDecoder only: the WHATWG decoder behind the latin1 and ascii labels
+  ENCODING_WINDOWS_1252,
+};
+
+typedef struct text_decoder_s {
+  int encoding;
+  bool fatal;
+  bool ignore_bom;
+  // past the start of the stream, where a BOM would be
+  bool started;
+  // the end of a character split across decode() calls
+  uint8_t pending[4];
+  uint32_t pending_size;
+} text_decoder_t;
+
+static const struct {
+  const char* name;
+  int encoding;
+} ENCODINGS[] = {
+  { "utf8", ENCODING_UTF8 },
+  { "utf-8", ENCODING_UTF8 },
+  { "hex", ENCODING_HEX },
+  { "base64", ENCODING_BASE64 },
+  { "base64url", ENCODING_BASE64URL },
+  { "latin1", ENCODING_LATIN1 },
+  { "binary", ENCODING_LATIN1 },
+  { "ascii", ENCODING_ASCII },
+  { "utf16le", ENCODING_UTF16LE },
+  { "utf-16le", ENCODING_UTF16LE },
+  { "ucs2", ENCODING_UTF16LE },
+  { "ucs-2", ENCODING_UTF16LE },
+};
+
+static const struct {
+  const char* label;
+  int encoding;
+} DECODER_LABELS[] = {
+  { "utf-8", ENCODING_UTF8 },
+  { "utf8", ENCODING_UTF8 },
+  { "unicode-1-1-utf-8", ENCODING_UTF8 },
+  { "utf-16le", ENCODING_UTF16LE },
+  { "utf-16", ENCODING_UTF16LE },
+  { "windows-1252", ENCODING_WINDOWS_1252 },
+  { "latin1", ENCODING_WINDOWS_1252 },
+  { "iso-8859-1", ENCODING_WINDOWS_1252 },
+  { "iso8859-1", ENCODING_WINDOWS_1252 },
+  { "l1", ENCODING_WINDOWS_1252 },
+  { "cp1252", ENCODING_WINDOWS_1252 },
+  { "ascii", ENCODING_WINDOWS_1252 },
+  { "us-ascii", ENCODING_WINDOWS_1252 },
+};
+
+// windows-1252 differs from latin1 only in 0x80 to 0x9F
+static const uint16_t WINDOWS_1252[32] = {
+  0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+  0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+  0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+  0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+};
+
+static JSClassID encoder_class_id;
+static JSClassID decoder_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static int buffer_module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue buffer_ctor(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_from(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_alloc(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue buffer_byte_length(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_is_buffer(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_is_encoding(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_concat(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_compare(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_to_string(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_equals(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_index_of(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue buffer_slice(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue buffer_to_json(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static JSValue encoder_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv);
+static JSValue encoder_encode(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue encoder_encode_into(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue encoder_encoding(JSContext* ctx, JSValueConst this_val);
+
+static JSValue decoder_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv);
+static JSValue decoder_decode(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue decoder_get(JSContext* ctx, JSValueConst this_val, int magic);
+static void decoder_finalizer(JSRuntime* rt, JSValue val);
+
+static JSValue global_atob(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue global_btoa(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static JSValue new_buffer_view(JSContext* ctx, JSValueConst array_buffer, size_t offset, size_t length);
+static JSValue new_uint8_array(JSContext* ctx, uint8_t* data, size_t size);
+static bool get_encoding(JSContext* ctx, JSValueConst value, int* encoding);
+static uint8_t* encode(JSContext* ctx, JSValueConst value, int encoding, size_t* size);
+static JSValue decode(JSContext* ctx, const uint8_t* data, size_t size, int encoding);
+static bool get_range(JSContext* ctx, int argc, JSValueConst* argv, size_t size, size_t* start, size_t* end);
+static bool utf16le_valid(const uint8_t* data, size_t size);
+static bool equals_ignore_case(const char* lower, const char* str);
+static bool get_index(JSContext* ctx, JSValueConst value, int64_t max, bool relative, int64_t* out);
+static JSValue throw_invalid_character(JSContext* ctx, const char* message);
+static uint8_t* alloc_bytes(size_t size);
+
+enum {
+  ALLOC_ZEROED,
+  ALLOC_UNSAFE,
+};
+
+enum {
+  SEARCH_INDEX_OF,
+  SEARCH_INCLUDES,
+};
+
+enum {
+  DECODER_ENCODING,
+  DECODER_FATAL,
+  DECODER_IGNORE_BOM,
+};
+
+static const JSClassDef ENCODER_CLASS = {
+  "TextEncoder",
+};
+
+static const JSClassDef DECODER_CLASS = {
+  "TextDecoder",
+  .finalizer = decoder_finalizer,
+};
+
+static const JSCFunctionListEntry BUFFER[] = {
+  JS_CFUNC_DEF("from", 3, buffer_from),
+  JS_CFUNC_MAGIC_DEF("alloc", 3, buffer_alloc, ALLOC_ZEROED),
+  JS_CFUNC_MAGIC_DEF("allocUnsafe", 1, buffer_alloc, ALLOC_UNSAFE),
+  JS_CFUNC_DEF("byteLength", 2, buffer_byte_length),
+  JS_CFUNC_DEF("isBuffer", 1, buffer_is_buffer),
+  JS_CFUNC_DEF("isEncoding", 1, buffer_is_encoding),
+  JS_CFUNC_DEF("concat", 2, buffer_concat),
+  JS_CFUNC_DEF("compare", 2, buffer_compare),
+};
+
+static const JSCFunctionListEntry BUFFER_PROTO[] = {
+  JS_CFUNC_DEF("toString", 3, buffer_to_string),
+  JS_CFUNC_DEF("write", 4, buffer_write),
+  JS_CFUNC_DEF("equals", 1, buffer_equals),
+  JS_CFUNC_DEF("compare", 1, buffer_compare),
+  JS_CFUNC_MAGIC_DEF("indexOf", 3, buffer_index_of, SEARCH_INDEX_OF),
+  JS_CFUNC_MAGIC_DEF("includes", 3, buffer_index_of, SEARCH_INCLUDES),
+  JS_CFUNC_DEF("slice", 2, buffer_slice),
+  JS_CFUNC_DEF("toJSON", 0, buffer_to_json),
+};
+
+static const JSCFunctionListEntry ENCODER_PROTO[] = {
+  JS_CFUNC_DEF("encode", 1, encoder_encode),
+  JS_CFUNC_DEF("encodeInto", 2, encoder_encode_into),
+  JS_CGETSET_DEF("encoding", encoder_encoding, NULL),
+};
+
+static const JSCFunctionListEntry DECODER_PROTO[] = {
+  JS_CFUNC_DEF("decode", 2, decoder_decode),
+  JS_CGETSET_MAGIC_DEF("encoding", decoder_get, NULL, DECODER_ENCODING),
+  JS_CGETSET_MAGIC_DEF("fatal", decoder_get, NULL, DECODER_FATAL),
+  JS_CGETSET_MAGIC_DEF("ignoreBOM", decoder_get, NULL, DECODER_IGNORE_BOM),
+};
+
+static const JSCFunctionListEntry GLOBALS[] = {
+  JS_CFUNC_DEF("atob", 1, global_atob),
+  JS_CFUNC_DEF("btoa", 1, global_btoa),
+};
+
+void veil_encoding_install(veil_vm_t* vm) {
+  JSContext* ctx = vm->context;
+  JSRuntime* rt = vm->runtime;
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue uint8_array_proto;
+  JSValue proto;
+  JSValue ctor;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, encoder_class_id)) {
+    JS_NewClass(rt, encoder_class_id, &ENCODER_CLASS);
+    JS_NewClass(rt, decoder_class_id, &DECODER_CLASS);
+  }
+
+  vm->uint8_array = JS_GetPropertyStr(ctx, global, "Uint8Array");
+  uint8_array_proto = JS_GetPropertyStr(ctx, vm->uint8_array, "prototype");
+
+  vm->buffer_proto = JS_NewObjectProto(ctx, uint8_array_proto);
+  JS_FreeValue(ctx, uint8_array_proto);
+  JS_SetPropertyFunctionList(ctx, vm->buffer_proto, BUFFER_PROTO, countof(BUFFER_PROTO));
+  ctor = JS_NewCFunction2(ctx, buffer_ctor, "Buffer", 3, JS_CFUNC_constructor_or_func, 0);
+  JS_SetConstructor(ctx, ctor, vm->buffer_proto);
+  JS_SetPrototype(ctx, ctor, vm->uint8_array);
+  JS_SetPropertyFunctionList(ctx, ctor, BUFFER, countof(BUFFER));
+  JS_SetPropertyStr(ctx, global, "Buffer", ctor);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, ENCODER_PROTO, countof(ENCODER_PROTO));
+  ctor = JS_NewCFunction2(ctx, encoder_ctor, "TextEncoder", 0, JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, ctor, proto);
+  JS_SetClassProto(ctx, encoder_class_id, proto);
+  JS_SetPropertyStr(ctx, global, "TextEncoder", ctor);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, DECODER_PROTO, countof(DECODER_PROTO));
+  ctor = JS_NewCFunction2(ctx, decoder_ctor, "TextDecoder", 0, JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, ctor, proto);
+  JS_SetClassProto(ctx, decoder_class_id, proto);
+  JS_SetPropertyStr(ctx, global, "TextDecoder", ctor);
+
+  JS_SetPropertyFunctionList(ctx, global, GLOBALS, countof(GLOBALS));
+  JS_FreeValue(ctx, global);
+}
+
+void veil_encoding_drop(veil_vm_t* vm) {
+  JS_FreeValue(vm->context, vm->uint8_array);
+  JS_FreeValue(vm->context, vm->buffer_proto);
+  vm->uint8_array = JS_UNDEFINED;
+  vm->buffer_proto = JS_UNDEFINED;
+}
+
+JSModuleDef* veil_buffer_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, buffer_module_init);
+
+  if (m) {
+    JS_AddModuleExport(ctx, m, "Buffer");
+    JS_AddModuleExport(ctx, m, "atob");
+    JS_AddModuleExport(ctx, m, "btoa");
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+// takes data, which is malloc'd
+JSValue veil_buffer_new(JSContext* ctx, uint8_t* data, size_t size) {
+  JSValue array_buffer = veil_shared_adopt_array_buffer(ctx, data, size);
+  JSValue result;
+
+  if (JS_IsException(array_buffer)) {
+    return array_buffer;
+  }
+
+  result = new_buffer_view(ctx, array_buffer, 0, size);
+  JS_FreeValue(ctx, array_buffer);
+
+  return result;
+}
+
+static void global_init() {
+  JS_NewClassID(&encoder_class_id);
+  JS_NewClassID(&decoder_class_id);
+}
+
+// the same objects as the globals
+static int buffer_module_init(JSContext* ctx, JSModuleDef* m) {
+  static const char* const NAMES[] = { "Buffer", "atob", "btoa" };
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue buffer = JS_NewObject(ctx);
+
+  for (size_t n = 0; n < countof(NAMES); n++) {
+    JSValue value = JS_GetPropertyStr(ctx, global, NAMES[n]);
+
+    JS_SetPropertyStr(ctx, buffer, NAMES[n], JS_DupValue(ctx, value));
+    JS_SetModuleExport(ctx, m, NAMES[n], value);
+  }
+
+  JS_SetModuleExport(ctx, m, "default", buffer);
+  JS_FreeValue(ctx, global);
+
+  return 0;
+}
+
+// Buffer(size), Buffer(string[, encoding]) or Buffer(arrayBuffer[, offset[,
+// length]]), called directly or as the species of a Buffer
+static JSValue buffer_ctor(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  if (argc > 0 && JS_IsNumber(argv[0])) {
+    return buffer_alloc(ctx, this_val, 1, argv, ALLOC_ZEROED);
+  }
+
+  return buffer_from(ctx, this_val, argc, argv);
+}
+
+static JSValue buffer_from(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JSValueConst value = argc > 0 ? argv[0] : JS_UNDEFINED;
+  JSValue data;
+  JSValue length_value;
+  uint8_t* bytes;
+  size_t size;
+  size_t offset = 0;
+  int64_t number;
+  uint32_t length;
+  int encoding = ENCODING_UTF8;
+
+  if (JS_IsString(value)) {
+    if (!get_encoding(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, &encoding)) {
+      return JS_EXCEPTION;
+    }
+    bytes = encode(ctx, value, encoding, &size);
+    return bytes ? veil_buffer_new(ctx, bytes, size) : JS_EXCEPTION;
+  }
+
+  if (!JS_IsObject(value)) {
+    return JS_ThrowTypeError(ctx, "argument must be a string, an array, an ArrayBuffer or a typed array");
+  }
+
+  // an ArrayBuffer is shared; a typed array is copied
+  data = JS_GetTypedArrayBuffer(ctx, value, NULL, NULL, NULL);
+  if (JS_IsException(data)) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    if (JS_GetArrayBuffer(ctx, &size, value)) {
+      if (argc > 1 && !JS_IsUndefined(argv[1])) {
+        if (!get_index(ctx, argv[1], (int64_t) size, false, &number)) {
+          return JS_EXCEPTION;
+        }
+        offset = (size_t) number;
+      }
+      number = (int64_t) (size - offset);
+      if (argc > 2 && !JS_IsUndefined(argv[2])
+          && !get_index(ctx, argv[2], (int64_t) (size - offset), false, &number)) {
+        return JS_EXCEPTION;
+      }
+      return new_buffer_view(ctx, value, offset, (size_t) number);
+    }
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  } else {
+    JS_FreeValue(ctx, data);
+    if (!veil_builtin_get_bytes(ctx, value, &bytes, &size)) {
+      return JS_EXCEPTION;
+    }
+    data = JS_NewArrayBufferCopy(ctx, bytes, size);
+    if (JS_IsException(data)) {
+      return data;
+    }
+    value = new_buffer_view(ctx, data, 0, size);
+    JS_FreeValue(ctx, data);
+    return value;
+  }
+
+  // an array-like, or the { type: 'Buffer', data } of toJSON()
+  data = JS_GetPropertyStr(ctx, value, "data");
+  if (!JS_IsArray(ctx, data)) {
+    JS_FreeValue(ctx, data);
+    data = JS_DupValue(ctx, value);
+  }
+
+  length_value = JS_GetPropertyStr(ctx, data, "length");
+  if (JS_ToUint32(ctx, &length, length_value) < 0) {
+    JS_FreeValue(ctx, length_value);
+    JS_FreeValue(ctx, data);
+    return JS_EXCEPTION;
+  }
+  JS_FreeValue(ctx, length_value);
+
+  bytes = alloc_bytes(length);
+  for (uint32_t n = 0; n < length; n++) {
+    JSValue item = JS_GetPropertyUint32(ctx, data, n);
+    int32_t byte = 0;
+
+    if (JS_ToInt32(ctx, &byte, item) < 0) {
+      JS_FreeValue(ctx, item);
+      JS_FreeValue(ctx, data);
+      free(bytes);
+      return JS_EXCEPTION;
+    }
+    JS_FreeValue(ctx, item);
+    bytes[n] = (uint8_t) byte;
+  }
+  JS_FreeValue(ctx, data);
+
+  return veil_buffer_new(ctx, bytes, length);
+}
+
+// alloc(size[, fill[, encoding]]) or allocUnsafe(size)
+static JSValue buffer_alloc(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  JSValueConst fill = argc > 1 ? argv[1] : JS_UNDEFINED;
+  uint8_t* pattern = NULL;
+  uint8_t* bytes;
+  size_t pattern_size = 0;
+  int64_t size;
+  int32_t byte;
+  int encoding = ENCODING_UTF8;
+
+  if (JS_ToInt64(ctx, &size, argc > 0 ? argv[0] : JS_UNDEFINED) < 0) {
+    return JS_EXCEPTION;
+  }
+  if (size < 0 || size > INT32_MAX) {
+    return JS_ThrowRangeError(ctx, "invalid buffer size %" PRId64, size);
+  }
+
+  bytes = alloc_bytes((size_t) size);
+  if (magic == ALLOC_UNSAFE) {
+    return veil_buffer_new(ctx, bytes, (size_t) size);
+  }
+
+  if (JS_IsString(fill)) {
+    if (!get_encoding(ctx, argc > 2 ? argv[2] : JS_UNDEFINED, &encoding)
+        || !(pattern = encode(ctx, fill, encoding, &pattern_size))) {
+      free(bytes);
+      return JS_EXCEPTION;
+    }
+  } else if (JS_IsObject(fill)) {
+    if (!veil_builtin_get_bytes(ctx, fill, &pattern, &pattern_size)) {
+      free(bytes);
+      return JS_EXCEPTION;
+    }
+    pattern = memcpy(alloc_bytes(pattern_size), pattern, pattern_size);
+  } else if (!JS_IsUndefined(fill)) {
+    if (JS_ToInt32(ctx, &byte, fill) < 0) {
+      free(bytes);
+      return JS_EXCEPTION;
+    }
+    memset(bytes, (uint8_t) byte, (size_t) size);
+    return veil_buffer_new(ctx, bytes, (size_t) size);
+  }
+
+  if (pattern_size == 0) {
+    memset(bytes, 0, (size_t) size);
+  } else {
+    // double the filled part until it covers the buffer
+    size_t filled = (size_t) size < pattern_size ? (size_t) size : pattern_size;
+
+    memcpy(bytes, pattern, filled);
+    while (filled < (size_t) size) {
+      size_t count = (size_t) size - filled < filled ? (size_t) size - filled : filled;
+
+      memcpy(bytes + filled, bytes, count);
+      filled += count;
+    }
+  }
+  free(pattern);
+
+  return veil_buffer_new(ctx, bytes, (size_t) size);
+}
+
+static JSValue buffer_byte_length(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JSValueConst value = argc > 0 ? argv[0] : JS_UNDEFINED;
+  const char* str;
+  uint8_t* bytes;
+  size_t size;
+  int encoding = ENCODING_UTF8;
+
+  if (!JS_IsString(value)) {
+    return veil_builtin_get_bytes(ctx, value, &bytes, &size) ? JS_NewInt64(ctx, (int64_t) size) : JS_EXCEPTION;
+  }
+
+  if (!get_encoding(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, &encoding)) {
+    return JS_EXCEPTION;
+  }
+
+  // a lone surrogate and its replacement have the same length
+  if (encoding == ENCODING_UTF8) {
+    str = JS_ToCStringLen(ctx, &size, value);
+    if (!str) {
+      return JS_EXCEPTION;
+    }
+    JS_FreeCString(ctx, str);
+    return JS_NewInt64(ctx, (int64_t) size);
+  }
+
+  bytes = encode(ctx, value, encoding, &size);
+  if (!bytes) {
+    return JS_EXCEPTION;
+  }
+  free(bytes);
+
+  return JS_NewInt64(ctx, (int64_t) size);
+}
+
+static JSValue buffer_is_buffer(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  JSValue proto;
+  bool result;
+
+  if (argc < 1 || !JS_IsObject(argv[0])) {
+    return JS_FALSE;
+  }
+
+  // not reference counted in this QuickJS version
+  proto = JS_GetPrototype(ctx, argv[0]);
+  result = JS_IsObject(proto) && JS_VALUE_GET_PTR(proto) == JS_VALUE_GET_PTR(vm->buffer_proto);
+
+  return JS_NewBool(ctx, result);
+}
+
+static JSValue buffer_is_encoding(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  int encoding;
+  bool result;
+
+  if (argc < 1 || !JS_IsString(argv[0])) {
+    return JS_FALSE;
+  }
+
+  result = get_encoding(ctx, argv[0], &encoding);
+  if (!result) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  }
+
+  return JS_NewBool(ctx, result);
+}
+
+static JSValue buffer_concat(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JSValueConst list = argc > 0 ? argv[0] : JS_UNDEFINED;
+  JSValue length_value;
+  uint8_t* bytes = NULL;
+  uint8_t* data;
+  size_t size;
+  size_t total = 0;
+  size_t offset = 0;
+  int64_t limit = -1;
+  uint32_t length;
+
+  if (!JS_IsArray(ctx, list)) {
+    return JS_ThrowTypeError(ctx, "list must be an array of buffers");
+  }
+
+  length_value = JS_GetPropertyStr(ctx, list, "length");
+  if (JS_ToUint32(ctx, &length, length_value) < 0) {
+    JS_FreeValue(ctx, length_value);
+    return JS_EXCEPTION;
+  }
+  JS_FreeValue(ctx, length_value);
+
+  if (argc > 1 && !JS_IsUndefined(argv[1]) && !get_index(ctx, argv[1], INT32_MAX, false, &limit)) {
+    return JS_EXCEPTION;
+  }
+
+  // sized first so that the bytes are copied once
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      if (limit < 0) {
+        limit = (int64_t) total;
+      }
+      bytes = alloc_bytes((size_t) limit);
+    }
+
+    for (uint32_t n = 0; n < length; n++) {
+      JSValue item = JS_GetPropertyUint32(ctx, list, n);
+      bool ok = veil_builtin_get_bytes(ctx, item, &data, &size);
+
+      JS_FreeValue(ctx, item);
+      if (!ok) {
+        if (pass == 1) {
+          free(bytes);
+        }
+        return JS_EXCEPTION;
+      }
+
+      if (pass == 0) {
+        total += size;
+      } else {
+        if (size > (size_t) limit - offset) {
+          size = (size_t) limit - offset;
+        }
+        memcpy(bytes + offset, data, size);
+        offset += size;
+      }
+    }
+  }
+
+  memset(bytes + offset, 0, (size_t) limit - offset);
+
+  return veil_buffer_new(ctx, bytes, (size_t) limit);
+}
+
+// Buffer.compare(a, b) or a.compare(b)
+static JSValue buffer_compare(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  bool is_static = !JS_IsObject(this_val) || JS_IsFunction(ctx, this_val);
+  JSValueConst a = is_static ? (argc > 0 ? argv[0] : JS_UNDEFINED) : this_val;
+  JSValueConst b = is_static ? (argc > 1 ? argv[1] : JS_UNDEFINED) : (argc > 0 ? argv[0] : JS_UNDEFINED);
+  uint8_t* a_data;
+  uint8_t* b_data;
+  size_t a_size;
+  size_t b_size;
+  int result;
+
+  if (!veil_builtin_get_bytes(ctx, a, &a_data, &a_size) || !veil_builtin_get_bytes(ctx, b, &b_data, &b_size)) {
+    return JS_EXCEPTION;
+  }
+
+  result = memcmp(a_data, b_data, a_size < b_size ? a_size : b_size);
+  if (result == 0) {
+    result = a_size < b_size ? -1 : a_size > b_size ? 1 : 0;
+  }
+
+  return JS_NewInt32(ctx, result < 0 ? -1 : result > 0 ? 1 : 0);
+}
+
+// toString([encoding[, start[, end]]])
+static JSValue buffer_to_string(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  uint8_t* data;
+  size_t size;
+  size_t start;
+  size_t end;
+  int encoding = ENCODING_UTF8;
+
+  if (!veil_builtin_get_bytes(ctx, this_val, &data, &size)
+      || !get_encoding(ctx, argc > 0 ? argv[0] : JS_UNDEFINED, &encoding)
+      || !get_range(ctx, argc - 1, argv + 1, size, &start, &end)) {
+    return JS_EXCEPTION;
+  }
+
+  return decode(ctx, data + start, end - start, encoding);
+}
+
+// write(string[, offset[, length]][, encoding]); only whole characters of a
+// utf8 string are written
+static JSValue buffer_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JSValueConst encoding_value = JS_UNDEFINED;
+  uint8_t* data;
+  uint8_t* bytes;
+  size_t size;
+  size_t count;
+  int64_t offset = 0;
+  int64_t length;
+  int encoding = ENCODING_UTF8;
+
+  if (!veil_builtin_get_bytes(ctx, this_val, &data, &size)) {
+    return JS_EXCEPTION;
+  }
+  length = (int64_t) size;
+
+  if (argc < 1 || !JS_IsString(argv[0])) {
+    return JS_ThrowTypeError(ctx, "argument must be a string");
+  }
+
+  if (argc > 1 && JS_IsString(argv[1])) {
+    encoding_value = argv[1];
+  } else {
+    if (argc > 1 && !JS_IsUndefined(argv[1]) && !get_index(ctx, argv[1], (int64_t) size, false, &offset)) {
+      return JS_EXCEPTION;
+    }
+    length = (int64_t) size - offset;
+    if (argc > 2 && JS_IsString(argv[2])) {
+      encoding_value = argv[2];
+    } else {
+      if (argc > 2 && !JS_IsUndefined(argv[2]) && !get_index(ctx, argv[2], length, false, &length)) {
+        return JS_EXCEPTION;
+      }
+      encoding_value = argc > 3 ? argv[3] : JS_UNDEFINED;
+    }
+  }
+
+  if (!get_encoding(ctx, encoding_value, &encoding) || !(bytes = encode(ctx, argv[0], encoding, &count))) {
+    return JS_EXCEPTION;
+  }
+
+  if (count > (size_t) length) {
+    count = (size_t) length;
+    if (encoding == ENCODING_UTF8) {
+      while (count > 0 && (bytes[count] & 0xC0) == 0x80) {
+        count--;
+      }
+    } else if (encoding == ENCODING_UTF16LE) {
+      count &= ~(size_t) 1;
+    }
+  }
+
+  memcpy(data + offset, bytes, count);
+  free(bytes);
+
+  return JS_NewInt64(ctx, (int64_t) count);
+}
+
+static JSValue buffer_equals(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  uint8_t* a_data;
+  uint8_t* b_data;
+  size_t a_size;
+  size_t b_size;
+
+  if (!veil_builtin_get_bytes(ctx, this_val, &a_data, &a_size)
+      || !veil_builtin_get_bytes(ctx, argc > 0 ? argv[0] : JS_UNDEFINED, &b_data, &b_size)) {
+    return JS_EXCEPTION;
+  }
+
+  return JS_NewBool(ctx, a_size == b_size && memcmp(a_data, b_data, a_size) == 0);
+}
+
+// indexOf(value[, byteOffset[, encoding]]) for a byte, a string or bytes
+static JSValue buffer_index_of(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  JSValueConst value = argc > 0 ? argv[0] : JS_UNDEFINED;
+  uint8_t* data;
+  uint8_t* needle;
+  uint8_t* owned = NULL;
+  uint8_t* found = NULL;
+  uint8_t byte;
+  size_t size;
+  size_t needle_size;
+  int64_t offset = 0;
+  int64_t result = -1;
+  int32_t number;
+  int encoding = ENCODING_UTF8;
+
+  if (!veil_builtin_get_bytes(ctx, this_val, &data, &size)) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 1 && JS_IsString(argv[1])) {
+    if (!get_encoding(ctx, argv[1], &encoding)) {
+      return JS_EXCEPTION;
+    }
+  } else {
+    if (argc > 1 && !JS_IsUndefined(argv[1])) {
+      if (!get_index(ctx, argv[1], (int64_t) size, true, &offset)) {
+        return JS_EXCEPTION;
+      }
+    }
+    if (argc > 2 && !get_encoding(ctx, argv[2], &encoding)) {
+      return JS_EXCEPTION;
+    }
+  }
+
+  if (JS_IsNumber(value)) {
+    if (JS_ToInt32(ctx, &number, value) < 0) {
+      return JS_EXCEPTION;
+    }
+    byte = (uint8_t) number;
+    needle = &byte;
+    needle_size = 1;
+  } else if (JS_IsString(value)) {
+    if (!(owned = encode(ctx, value, encoding, &needle_size))) {
+      return JS_EXCEPTION;
+    }
+    needle = owned;
+  } else if (!veil_builtin_get_bytes(ctx, value, &needle, &needle_size)) {
+    return JS_EXCEPTION;
+  }
+
+  if (needle_size == 0) {
+    result = offset;
+  } else {
+    // memchr finds the candidates for the first byte
+    for (uint8_t* p = data + offset; (size_t) (data + size - p) >= needle_size; p = found + 1) {
+      found = memchr(p, needle[0], (size_t) (data + size - p) - needle_size + 1);
+      if (!found) {
+        break;
+      }
+      if (memcmp(found, needle, needle_size) == 0) {
+        result = found - data;
+        break;
+      }
+    }
+  }
+  free(owned);
+
+  return magic == SEARCH_INCLUDES ? JS_NewBool(ctx, result >= 0) : JS_NewInt64(ctx, result);
+}
+
+// a view, unlike Uint8Array.prototype.slice
+static JSValue buffer_slice(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  size_t offset;
+  size_t length;
+  size_t start;
+  size_t end;
+  int64_t value;
+  JSValue data;
+  JSValue result;
+
+  data = JS_GetTypedArrayBuffer(ctx, this_val, &offset, &length, NULL);
+  if (JS_IsException(data)) {
+    return data;
+  }
+
+  start = 0;
+  end = length;
+  if (argc > 0 && !JS_IsUndefined(argv[0])) {
+    if (!get_index(ctx, argv[0], (int64_t) length, true, &value)) {
+      JS_FreeValue(ctx, data);
+      return JS_EXCEPTION;
+    }
+    start = (size_t) value;
+  }
+  if (argc > 1 && !JS_IsUndefined(argv[1])) {
+    if (!get_index(ctx, argv[1], (int64_t) length, true, &value)) {
+      JS_FreeValue(ctx, data);
+      return JS_EXCEPTION;
+    }
+    end = (size_t) value;
+  }
+
+  result = new_buffer_view(ctx, data, offset + start, end > start ? end - start : 0);
+  JS_FreeValue(ctx, data);
+
+  return result;
+}
+
+static JSValue buffer_to_json(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JSValue result;
+  JSValue array;
+  uint8_t* data;
+  size_t size;
+
+  if (!veil_builtin_get_bytes(ctx, this_val, &data, &size)) {
+    return JS_EXCEPTION;
+  }
+
+  array = JS_NewArray(ctx);
+  for (size_t n = 0; n < size; n++) {
+    JS_SetPropertyUint32(ctx, array, (uint32_t) n, JS_NewInt32(ctx, data[n]));
+  }
+
+  result = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, result, "type", JS_NewString(ctx, "Buffer"));
+  JS_SetPropertyStr(ctx, result, "data", array);
+
+  return result;
+}
+
+static JSValue encoder_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv) {
+  JSValue proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  JSValue obj = JS_NewObjectProtoClass(ctx, proto, encoder_class_id);
+
+  JS_FreeValue(ctx, proto);
+
+  return obj;
+}
+
+static JSValue encoder_encode(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  uint8_t* bytes;
+  size_t size = 0;
+
+  if (argc < 1 || JS_IsUndefined(argv[0])) {
+    return new_uint8_array(ctx, alloc_bytes(0), 0);
+  }
+
+  bytes = encode(ctx, argv[0], ENCODING_UTF8, &size);
+
+  return bytes ? new_uint8_array(ctx, bytes, size) : JS_EXCEPTION;
+}
+
+// Writes the whole characters that fit and reports the UTF-16 code units
+// read and the bytes written.
+static JSValue encoder_encode_into(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JSValue result;
+  const char* str;
+  uint8_t* dest;
+  size_t dest_size;
+  size_t size;
+  size_t offset;
+  size_t length;
+  int64_t read;
+
+  if (argc < 2 || !veil_builtin_get_bytes(ctx, argv[1], &dest, &dest_size)) {
+    return argc < 2 ? JS_ThrowTypeError(ctx, "encodeInto requires a destination") : JS_EXCEPTION;
+  }
+
+  str = JS_ToCStringLen(ctx, &size, argv[0]);
+  if (!str) {
+    return JS_EXCEPTION;
+  }
+
+  // ASCII is one unit per byte
+  offset = veil_codec_ascii_length((const uint8_t*) str, size < dest_size ? size : dest_size);
+  memcpy(dest, str, offset);
+  read = (int64_t) offset;
+
+  while (offset < size) {
+    uint8_t c = (uint8_t) str[offset];
+
+    length = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+    if (length > dest_size - offset) {
+      break;
+    }
+    memcpy(dest + offset, str + offset, length);
+    veil_codec_wtf8_fix(dest + offset, length);
+    offset += length;
+    read += length == 4 ? 2 : 1;
+  }
+  JS_FreeCString(ctx, str);
+
+  result = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, result, "read", JS_NewInt64(ctx, read));
+  JS_SetPropertyStr(ctx, result, "written", JS_NewInt64(ctx, (int64_t) offset));
+
+  return result;
+}
+
+static JSValue encoder_encoding(JSContext* ctx, JSValueConst this_val) {
+  return JS_NewString(ctx, "utf-8");
+}
+
+// TextDecoder([label[, { fatal, ignoreBOM }]])
+static JSValue decoder_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv) {
+  text_decoder_t* decoder;
+  const char* label;
+  const char* start;
+  const char* end;
+  char lower[32];
+  size_t size = 0;
+  JSValue proto;
+  JSValue obj;
+  int encoding = -1;
+
+  if (argc > 0 && !JS_IsUndefined(argv[0])) {
+    label = JS_ToCString(ctx, argv[0]);
+    if (!label) {
+      return JS_EXCEPTION;
+    }
+    start = label;
+    end = label + strlen(label);
+    while (start < end && isspace((unsigned char) *start)) {
+      start++;
+    }
+    while (end > start && isspace((unsigned char) end[-1])) {
+      end--;
+    }
+    for (; start < end && size < sizeof(lower) - 1; start++) {
+      lower[size++] = (char) tolower((unsigned char) *start);
+    }
+    lower[size] = 0;
+
+    for (size_t n = 0; n < countof(DECODER_LABELS) && start == end; n++) {
+      if (strcmp(DECODER_LABELS[n].label, lower) == 0) {
+        encoding = DECODER_LABELS[n].encoding;
+        break;
+      }
+    }
+    if (encoding < 0) {
+      JS_ThrowRangeError(ctx, "the '%s' encoding is not supported", label);
+      JS_FreeCString(ctx, label);
+      return JS_EXCEPTION;
+    }
+    JS_FreeCString(ctx, label);
+  } else {
+    encoding = ENCODING_UTF8;
+  }
+
+  decoder = calloc(1, sizeof(text_decoder_t));
+  CHECK_NOT_NULL(decoder);
+  decoder->encoding = encoding;
+
+  if (argc > 1 && JS_IsObject(argv[1])) {
+    JSValue fatal = JS_GetPropertyStr(ctx, argv[1], "fatal");
+    JSValue ignore_bom = JS_GetPropertyStr(ctx, argv[1], "ignoreBOM");
+
+    decoder->fatal = JS_ToBool(ctx, fatal);
+    decoder->ignore_bom = JS_ToBool(ctx, ignore_bom);
+    JS_FreeValue(ctx, fatal);
+    JS_FreeValue(ctx, ignore_bom);
+  }
+
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  obj = JS_NewObjectProtoClass(ctx, proto, decoder_class_id);
+  JS_FreeValue(ctx, proto);
+  if (JS_IsException(obj)) {
+    free(decoder);
+    return obj;
+  }
+  JS_SetOpaque(obj, decoder);
+
+  return obj;
+}
+
+// decode([input[, { stream }]])
+static JSValue decoder_decode(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  text_decoder_t* decoder = JS_GetOpaque2(ctx, this_val, decoder_class_id);
+  uint8_t* joined = NULL;
+  uint8_t* data = NULL;
+  size_t size = 0;
+  size_t hold = 0;
+  uint32_t unit;
+  bool stream = false;
+  bool valid = true;
+  JSValue result;
+
+  if (!decoder) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && !JS_IsUndefined(argv[0]) && !veil_builtin_get_bytes(ctx, argv[0], &data, &size)) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 1 && JS_IsObject(argv[1])) {
+    JSValue value = JS_GetPropertyStr(ctx, argv[1], "stream");
+
+    stream = JS_ToBool(ctx, value);
+    JS_FreeValue(ctx, value);
+  }
+
+  if (decoder->pending_size) {
+    joined = alloc_bytes(decoder->pending_size + size);
+    memcpy(joined, decoder->pending, decoder->pending_size);
+    memcpy(joined + decoder->pending_size, data, size);
+    data = joined;
+    size += decoder->pending_size;
+    decoder->pending_size = 0;
+  }
+
+  switch (decoder->encoding) {
+    case ENCODING_UTF8:
+      if (stream) {
+        hold = veil_codec_utf8_incomplete(data, size);
+      }
+      if (!decoder->started && !decoder->ignore_bom && size - hold >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0) {
+        data += 3;
+        size -= 3;
+      }
+      valid = !decoder->fatal || veil_codec_utf8_valid(data, size - hold);
+      break;
+    case ENCODING_UTF16LE:
+      // an odd byte, or a high surrogate that may be paired next time
+      if (stream) {
+        hold = size & 1;
+        if (size - hold >= 2) {
+          unit = (uint32_t) data[size - hold - 2] | (uint32_t) data[size - hold - 1] << 8;
+          if (unit >= 0xD800 && unit < 0xDC00) {
+            hold += 2;
+          }
+        }
+      }
+      if (!decoder->started && !decoder->ignore_bom && size - hold >= 2 && data[0] == 0xFF && data[1] == 0xFE) {
+        data += 2;
+        size -= 2;
+      }
+      valid = !decoder->fatal || ((size - hold) % 2 == 0 && utf16le_valid(data, size - hold));
+      break;
+    default:
+      break;
+  }
+
+  if (!valid) {
+    free(joined);
+    decoder->started = false;
+    return JS_ThrowTypeError(ctx, "the encoded data was not valid for encoding %s",
+        decoder->encoding == ENCODING_UTF8 ? "utf-8" : "utf-16le");
+  }
+
+  if (size - hold > 0) {
+    decoder->started = true;
+  }
+  memcpy(decoder->pending, data + size - hold, hold);
+  decoder->pending_size = (uint32_t) hold;
+
+  // a lone trailing byte of UTF-16 is one replacement character
+  if (decoder->encoding == ENCODING_UTF16LE && (size - hold) % 2 == 1) {
+    uint8_t* out = alloc_bytes((size - hold) / 2 * 3 + 3);
+    size_t length = veil_codec_utf16le_to_utf8(data, size - hold, out);
+
+    memcpy(out + length, "\xEF\xBF\xBD", 3);
+    result = JS_NewStringLen(ctx, (const char*) out, length + 3);
+    free(out);
+  } else {
+    result = decode(ctx, data, size - hold, decoder->encoding);
+  }
+  free(joined);
+
+  if (!stream) {
+    decoder->started = false;
+  }
+
+  return result;
+}
+
+static JSValue decoder_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  text_decoder_t* decoder = JS_GetOpaque2(ctx, this_val, decoder_class_id);
+
+  if (!decoder) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case DECODER_FATAL:
+      return JS_NewBool(ctx, decoder->fatal);
+    case DECODER_IGNORE_BOM:
+      return JS_NewBool(ctx, decoder->ignore_bom);
+    default:
+      return JS_NewString(ctx, decoder->encoding == ENCODING_UTF8 ? "utf-8"
+          : decoder->encoding == ENCODING_UTF16LE ? "utf-16le" : "windows-1252");
+  }
+}
+
+static void decoder_finalizer(JSRuntime* rt, JSValue val) {
+  free(JS_GetOpaque(val, decoder_class_id));
+}
+
+// forgiving-base64 decode into a latin1 string
+static JSValue global_atob(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  const char* str;
+  uint8_t* bytes;
+  size_t size;
+  size_t decoded;
+  JSValue result;
+
+  if (argc < 1) {
+    return JS_ThrowTypeError(ctx, "atob requires an argument");
+  }
+
+  str = JS_ToCStringLen(ctx, &size, argv[0]);
+  if (!str) {
+    return JS_EXCEPTION;
+  }
+
+  bytes = alloc_bytes(VEIL_BASE64_DECODED_SIZE(size));
+  if (!veil_codec_base64_decode(str, size, bytes, &decoded, true)) {
+    JS_FreeCString(ctx, str);
+    free(bytes);
+    return throw_invalid_character(ctx, "the string to be decoded is not correctly encoded");
+  }
+  JS_FreeCString(ctx, str);
+
+  result = decode(ctx, bytes, decoded, ENCODING_LATIN1);
+  free(bytes);
+
+  return result;
+}
+
+static JSValue global_btoa(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  const char* str;
+  uint8_t* bytes;
+  size_t size;
+  JSValue result;
+
+  if (argc < 1) {
+    return JS_ThrowTypeError(ctx, "btoa requires an argument");
+  }
+
+  str = JS_ToCStringLen(ctx, &size, argv[0]);
+  if (!str) {
+    return JS_EXCEPTION;
+  }
+
+  // a lead byte above 0xC3 starts a code point past latin1
+  for (size_t n = veil_codec_ascii_length((const uint8_t*) str, size); n < size; n++) {
+    if ((uint8_t) str[n] > 0xC3) {
+      JS_FreeCString(ctx, str);
+      return throw_invalid_character(ctx, "the string to be encoded contains characters outside of the Latin1 range");
+    }
+  }
+
+  bytes = alloc_bytes(size);
+  size = veil_codec_utf8_to_latin1((const uint8_t*) str, size, bytes);
+  JS_FreeCString(ctx, str);
+
+  result = decode(ctx, bytes, size, ENCODING_BASE64);
+  free(bytes);
+
+  return result;
+}
+
+static JSValue new_buffer_view(JSContext* ctx, JSValueConst array_buffer, size_t offset, size_t length) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  JSValue args[3] = { JS_DupValue(ctx, array_buffer), JS_NewInt64(ctx, (int64_t) offset), JS_NewInt64(ctx, (int64_t) length) };
+  JSValue array = JS_CallConstructor(ctx, vm->uint8_array, 3, args);
+
+  JS_FreeValue(ctx, args[0]);
+  if (!JS_IsException(array)) {
+    JS_SetPrototype(ctx, array, vm->buffer_proto);
+  }
+
+  return array;
+}
+
+// a plain Uint8Array, for the WHATWG APIs; takes data
+static JSValue new_uint8_array(JSContext* ctx, uint8_t* data, size_t size) {
+  JSValue buffer = veil_shared_adopt_array_buffer(ctx, data, size);
+
+  if (JS_IsException(buffer)) {
+    return buffer;
+  }
+
+  return veil_builtin_new_uint8_array(ctx, buffer);
+}
+
+// undefined and null mean utf8; anything else has to name an encoding
+static bool get_encoding(JSContext* ctx, JSValueConst value, int* encoding) {
+  const char* name;
+
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    *encoding = ENCODING_UTF8;
+    return true;
+  }
+
+  name = JS_ToCString(ctx, value);
+  if (!name) {
+    return false;
+  }
+
+  for (size_t n = 0; n < countof(ENCODINGS); n++) {
+    if (equals_ignore_case(ENCODINGS[n].name, name)) {
+      *encoding = ENCODINGS[n].encoding;
+      JS_FreeCString(ctx, name);
+      return true;
+    }
+  }
+
+  JS_ThrowTypeError(ctx, "unknown encoding: %s", name);
+  JS_FreeCString(ctx, name);
+
+  return false;
+}
+
+// the bytes of a string in an encoding, malloc'd
+static uint8_t* encode(JSContext* ctx, JSValueConst value, int encoding, size_t* size) {
+  const char* str;
+  uint8_t* bytes;
+  size_t length;
+
+  str = JS_ToCStringLen(ctx, &length, value);
+  if (!str) {
+    return NULL;
+  }
+
+  switch (encoding) {
+    case ENCODING_HEX:
+      bytes = alloc_bytes(length / 2);
+      *size = veil_codec_hex_decode(str, length, bytes);
+      break;
+    case ENCODING_BASE64:
+    case ENCODING_BASE64URL:
+      bytes = alloc_bytes(VEIL_BASE64_DECODED_SIZE(length));
+      veil_codec_base64_decode(str, length, bytes, size, false);
+      break;
+    case ENCODING_LATIN1:
+    case ENCODING_ASCII:
+      bytes = alloc_bytes(length);
+      *size = veil_codec_utf8_to_latin1((const uint8_t*) str, length, bytes);
+      break;
+    case ENCODING_UTF16LE:
+      bytes = alloc_bytes(length * 2);
+      *size = veil_codec_utf8_to_utf16le((const uint8_t*) str, length, bytes);
+      break;
+    default:
+      bytes = alloc_bytes(length);
+      memcpy(bytes, str, length);
+      veil_codec_wtf8_fix(bytes, length);
+      *size = length;
+      break;
+  }
+  JS_FreeCString(ctx, str);
+
+  return bytes;
+}
+
+// JS strings are made from UTF-8, so everything is transcoded to that first
+static JSValue decode(JSContext* ctx, const uint8_t* data, size_t size, int encoding) {
+  uint8_t* out = NULL;
+  size_t length = 0;
+  size_t ascii;
+  JSValue result;
+
+  switch (encoding) {
+    case ENCODING_UTF8:
+      if (veil_codec_utf8_valid(data, size)) {
+        return JS_NewStringLen(ctx, (const char*) data, size);
+      }
+      out = alloc_bytes(size * 3);
+      length = veil_codec_utf8_sanitize(data, size, out);
+      break;
+    case ENCODING_HEX:
+      out = alloc_bytes(size * 2);
+      length = veil_codec_hex_encode(data, size, (char*) out);
+      break;
+    case ENCODING_BASE64:
+    case ENCODING_BASE64URL:
+      out = alloc_bytes(VEIL_BASE64_SIZE(size));
+      length = veil_codec_base64_encode(data, size, (char*) out, encoding == ENCODING_BASE64URL);
+      break;
+    case ENCODING_ASCII:
+      ascii = veil_codec_ascii_length(data, size);
+      if (ascii == size) {
+        return JS_NewStringLen(ctx, (const char*) data, size);
+      }
+      out = alloc_bytes(size);
+      memcpy(out, data, ascii);
+      for (size_t n = ascii; n < size; n++) {
+        out[n] = data[n] & 0x7F;
+      }
+      length = size;
+      break;
+    case ENCODING_UTF16LE:
+      out = alloc_bytes(size / 2 * 3);
+      length = veil_codec_utf16le_to_utf8(data, size, out);
+      break;
+    case ENCODING_WINDOWS_1252:
+      out = alloc_bytes(size * 3);
+      for (size_t n = 0; n < size;) {
+        ascii = veil_codec_ascii_length(data + n, size - n);
+        memcpy(out + length, data + n, ascii);
+        length += ascii;
+        n += ascii;
+        for (; n < size && data[n] >= 0x80; n++) {
+          uint32_t cp = data[n] < 0xA0 ? WINDOWS_1252[data[n] - 0x80] : data[n];
+
+          if (cp < 0x800) {
+            out[length++] = (uint8_t) (0xC0 | cp >> 6);
+          } else {
+            out[length++] = (uint8_t) (0xE0 | cp >> 12);
+            out[length++] = (uint8_t) (0x80 | ((cp >> 6) & 0x3F));
+          }
+          out[length++] = (uint8_t) (0x80 | (cp & 0x3F));
+        }
+      }
+      break;
+    default:
+      out = alloc_bytes(size * 2);
+      length = veil_codec_latin1_to_utf8(data, size, out);
+      break;
+  }
+
+  result = JS_NewStringLen(ctx, (const char*) out, length);
+  free(out);
+
+  return result;
+}
+
+// [start[, end]] clamped to size
+static bool get_range(JSContext* ctx, int argc, JSValueConst* argv, size_t size, size_t* start, size_t* end) {
+  int64_t value;
+
+  *start = 0;
+  *end = size;
+
+  if (argc > 0 && !JS_IsUndefined(argv[0])) {
+    if (!get_index(ctx, argv[0], (int64_t) size, false, &value)) {
+      return false;
+    }
+    *start = (size_t) value;
+  }
+
+  if (argc > 1 && !JS_IsUndefined(argv[1])) {
+    if (!get_index(ctx, argv[1], (int64_t) size, false, &value)) {
+      return false;
+    }
+    *end = (size_t) value;
+  }
+
+  if (*end < *start) {
+    *end = *start;
+  }
+
+  return true;
+}
+
+static bool utf16le_valid(const uint8_t* data, size_t size) {
+  uint32_t unit;
+  uint32_t low;
+
+  for (size_t n = 0; n + 1 < size; n += 2) {
+    unit = (uint32_t) data[n] | (uint32_t) data[n + 1] << 8;
+    if (unit < 0xD800 || unit > 0xDFFF) {
+      continue;
+    }
+    if (unit >= 0xDC00 || n + 3 >= size) {
+      return false;
+    }
+    low = (uint32_t) data[n + 2] | (uint32_t) data[n + 3] << 8;
+    if (low < 0xDC00 || low > 0xDFFF) {
+      return false;
+    }
+    n += 2;
+  }
+
+  return true;
+}
+
+static bool equals_ignore_case(const char* lower, const char* str) {
+  for (; *lower; lower++, str++) {
+    if (tolower((unsigned char) *str) != *lower) {
+      return false;
+    }
+  }
+
+  return *str == 0;
+}
+
+// an integer clamped to [0, max]; a relative one counts back from max when
+// negative
+static bool get_index(JSContext* ctx, JSValueConst value, int64_t max, bool relative, int64_t* out) {
+  int64_t index;
+
+  if (JS_ToInt64(ctx, &index, value) < 0) {
+    return false;
+  }
+
+  if (index < 0 && relative) {
+    index += max;
+  }
+
+  *out = index < 0 ? 0 : index > max ? max : index;
+
+  return true;
+}
+
+static JSValue throw_invalid_character(JSContext* ctx, const char* message) {
+  JSValue error = JS_NewError(ctx);
+
+  JS_SetPropertyStr(ctx, error, "name", JS_NewString(ctx, "InvalidCharacterError"));
+  JS_SetPropertyStr(ctx, error, "message", JS_NewString(ctx, message));
+
+  return JS_Throw(ctx, error);
+}
+
+static uint8_t* alloc_bytes(size_t size) {
+  uint8_t* bytes = malloc(size ? size : 1);
+
+  CHECK_NOT_NULL(bytes);
+
+  return bytes;
+}
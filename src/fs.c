@@ -0,0 +1,1225 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// Every operation is a run_op() over synchronous uv_fs_* calls. The *Sync
+// functions call it directly; the async forms run it as one threadpool job,
+// so readFile() is a single round trip (open, fstat, read, close) instead of
+// four chained requests. Reads go straight into the memory that backs the
+// returned ArrayBuffer, or into the caller's buffers.
+
+// the largest ArrayBuffer QuickJS can hold
+#define FS_MAX_LENGTH INT32_MAX
+// first read size for files whose size fstat cannot tell, such as pipes
+#define FS_CHUNK_SIZE (64 * 1024)
+#define FS_DEFAULT_MODE 0666
+
+enum {
+  FS_OPEN,
+  FS_CLOSE,
+  FS_READ,
+  FS_WRITE,
+  FS_READV,
+  FS_WRITEV,
+  FS_STAT,
+  FS_LSTAT,
+  FS_FSTAT,
+  FS_UNLINK,
+  FS_RENAME,
+  FS_MKDIR,
+  FS_RMDIR,
+  FS_READDIR,
+  FS_READ_FILE,
+  FS_WRITE_FILE,
+  FS_EXISTS,
+};
+
+// fs/promises flavour: open() resolves to a FileHandle and reads and writes
+// to { bytesRead, buffer } style objects
+#define FS_PROMISES 0x100
+#define FS_OP(magic) ((magic) & 0xFF)
+
+typedef struct fs_req_s {
+  uv_work_t work;
+  veil_cleanup_t cleanup;
+  // NULL once the VM has gone
+  veil_vm_t* vm;
+  // the VM's context after that, which outlives the loop
+  JSContext* context;
+  int op;
+  bool promises;
+  JSValue callback;
+  JSValue resolving_funcs[2];
+  // keeps the buffers that bufs point into alive
+  JSValue keep;
+  // UTF-8 of a string argument
+  const char* str;
+
+  cstr path;
+  cstr dest;
+  uv_file fd;
+  int flags;
+  int mode;
+  int64_t position;
+  bool recursive;
+  bool utf8;
+  uv_buf_t* bufs;
+  unsigned int nbufs;
+
+  int err;
+  const char* syscall;
+  int64_t result;
+  uv_stat_t stat;
+  uint8_t* data;
+  size_t size;
+  cvec_str names;
+} fs_req_t;
+
+typedef struct fs_handle_s {
+  uv_file fd;
+  bool closed;
+} fs_handle_t;
+
+#define i_val_str
+#define i_opt (c_no_cmp | c_is_fwd)
+#include <stc/cvec.h>
+
+static JSClassID stats_class_id;
+static JSClassID handle_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static void register_classes(JSContext* ctx);
+static int fs_module_init(JSContext* ctx, JSModuleDef* m);
+static int promises_module_init(JSContext* ctx, JSModuleDef* m);
+static JSValue new_promises(JSContext* ctx);
+
+static JSValue fs_sync(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue fs_async(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue handle_call(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue handle_fd(JSContext* ctx, JSValueConst this_val);
+static void handle_finalizer(JSRuntime* rt, JSValue val);
+static JSValue stats_is(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+
+static void req_init(fs_req_t* req, int op);
+static void req_release(JSContext* ctx, fs_req_t* req);
+static bool prepare(JSContext* ctx, fs_req_t* req, int argc, JSValueConst* argv);
+static void run_op(fs_req_t* req);
+static void read_file(fs_req_t* req);
+static void write_file(fs_req_t* req);
+static void mkdir_p(fs_req_t* req, char* path);
+static JSValue result_value(JSContext* ctx, fs_req_t* req);
+static void work_cb(uv_work_t* work);
+static void after_work_cb(uv_work_t* work, int status);
+static void settle(JSContext* ctx, fs_req_t* req);
+static void req_cleanup_cb(veil_cleanup_t* cleanup);
+
+static bool get_path(JSContext* ctx, JSValueConst value, cstr* out);
+static bool get_fd(JSContext* ctx, JSValueConst value, uv_file* out);
+static bool get_position(JSContext* ctx, JSValueConst value, int64_t* out);
+static bool get_bufs(JSContext* ctx, fs_req_t* req, JSValueConst list);
+static bool get_flags(JSContext* ctx, JSValueConst value, int* out);
+static bool get_encoding(JSContext* ctx, JSValueConst options, bool* utf8);
+static JSValue get_option(JSContext* ctx, JSValueConst options, const char* name);
+static JSValue new_uint8_array(JSContext* ctx, uint8_t* data, size_t size);
+static JSValue new_stats(JSContext* ctx, const uv_stat_t* stat);
+
+static const JSClassDef STATS_CLASS = {
+  "Stats",
+};
+
+static const JSClassDef HANDLE_CLASS = {
+  "FileHandle",
+  .finalizer = handle_finalizer,
+};
+
+static const JSCFunctionListEntry STATS_PROTO[] = {
+  JS_CFUNC_MAGIC_DEF("isFile", 0, stats_is, S_IFREG),
+  JS_CFUNC_MAGIC_DEF("isDirectory", 0, stats_is, S_IFDIR),
+  JS_CFUNC_MAGIC_DEF("isSymbolicLink", 0, stats_is, S_IFLNK),
+  JS_CFUNC_MAGIC_DEF("isCharacterDevice", 0, stats_is, S_IFCHR),
+#ifdef S_IFBLK
+  JS_CFUNC_MAGIC_DEF("isBlockDevice", 0, stats_is, S_IFBLK),
+#endif
+#ifdef S_IFIFO
+  JS_CFUNC_MAGIC_DEF("isFIFO", 0, stats_is, S_IFIFO),
+#endif
+#ifdef S_IFSOCK
+  JS_CFUNC_MAGIC_DEF("isSocket", 0, stats_is, S_IFSOCK),
+#endif
+};
+
+static const JSCFunctionListEntry HANDLE_PROTO[] = {
+  JS_CGETSET_DEF("fd", handle_fd, NULL),
+  JS_CFUNC_MAGIC_DEF("read", 4, handle_call, FS_READ),
+  JS_CFUNC_MAGIC_DEF("write", 4, handle_call, FS_WRITE),
+  JS_CFUNC_MAGIC_DEF("readv", 2, handle_call, FS_READV),
+  JS_CFUNC_MAGIC_DEF("writev", 2, handle_call, FS_WRITEV),
+  JS_CFUNC_MAGIC_DEF("stat", 0, handle_call, FS_FSTAT),
+  JS_CFUNC_MAGIC_DEF("readFile", 1, handle_call, FS_READ_FILE),
+  JS_CFUNC_MAGIC_DEF("writeFile", 2, handle_call, FS_WRITE_FILE),
+  JS_CFUNC_MAGIC_DEF("close", 0, handle_call, FS_CLOSE),
+};
+
+static const JSCFunctionListEntry FS[] = {
+  JS_CFUNC_MAGIC_DEF("openSync", 3, fs_sync, FS_OPEN),
+  JS_CFUNC_MAGIC_DEF("closeSync", 1, fs_sync, FS_CLOSE),
+  JS_CFUNC_MAGIC_DEF("readSync", 5, fs_sync, FS_READ),
+  JS_CFUNC_MAGIC_DEF("writeSync", 5, fs_sync, FS_WRITE),
+  JS_CFUNC_MAGIC_DEF("readvSync", 3, fs_sync, FS_READV),
+  JS_CFUNC_MAGIC_DEF("writevSync", 3, fs_sync, FS_WRITEV),
+  JS_CFUNC_MAGIC_DEF("statSync", 1, fs_sync, FS_STAT),
+  JS_CFUNC_MAGIC_DEF("lstatSync", 1, fs_sync, FS_LSTAT),
+  JS_CFUNC_MAGIC_DEF("fstatSync", 1, fs_sync, FS_FSTAT),
+  JS_CFUNC_MAGIC_DEF("unlinkSync", 1, fs_sync, FS_UNLINK),
+  JS_CFUNC_MAGIC_DEF("renameSync", 2, fs_sync, FS_RENAME),
+  JS_CFUNC_MAGIC_DEF("mkdirSync", 2, fs_sync, FS_MKDIR),
+  JS_CFUNC_MAGIC_DEF("rmdirSync", 1, fs_sync, FS_RMDIR),
+  JS_CFUNC_MAGIC_DEF("readdirSync", 1, fs_sync, FS_READDIR),
+  JS_CFUNC_MAGIC_DEF("readFileSync", 2, fs_sync, FS_READ_FILE),
+  JS_CFUNC_MAGIC_DEF("writeFileSync", 3, fs_sync, FS_WRITE_FILE),
+  JS_CFUNC_MAGIC_DEF("existsSync", 1, fs_sync, FS_EXISTS),
+  JS_CFUNC_MAGIC_DEF("open", 4, fs_async, FS_OPEN),
+  JS_CFUNC_MAGIC_DEF("close", 2, fs_async, FS_CLOSE),
+  JS_CFUNC_MAGIC_DEF("read", 6, fs_async, FS_READ),
+  JS_CFUNC_MAGIC_DEF("write", 6, fs_async, FS_WRITE),
+  JS_CFUNC_MAGIC_DEF("readv", 4, fs_async, FS_READV),
+  JS_CFUNC_MAGIC_DEF("writev", 4, fs_async, FS_WRITEV),
+  JS_CFUNC_MAGIC_DEF("stat", 2, fs_async, FS_STAT),
+  JS_CFUNC_MAGIC_DEF("lstat", 2, fs_async, FS_LSTAT),
+  JS_CFUNC_MAGIC_DEF("fstat", 2, fs_async, FS_FSTAT),
+  JS_CFUNC_MAGIC_DEF("unlink", 2, fs_async, FS_UNLINK),
+  JS_CFUNC_MAGIC_DEF("rename", 3, fs_async, FS_RENAME),
+  JS_CFUNC_MAGIC_DEF("mkdir", 3, fs_async, FS_MKDIR),
+  JS_CFUNC_MAGIC_DEF("rmdir", 2, fs_async, FS_RMDIR),
+  JS_CFUNC_MAGIC_DEF("readdir", 2, fs_async, FS_READDIR),
+  JS_CFUNC_MAGIC_DEF("readFile", 3, fs_async, FS_READ_FILE),
+  JS_CFUNC_MAGIC_DEF("writeFile", 4, fs_async, FS_WRITE_FILE),
+};
+
+static const JSCFunctionListEntry PROMISES[] = {
+  JS_CFUNC_MAGIC_DEF("open", 3, fs_async, FS_OPEN | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("stat", 1, fs_async, FS_STAT | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("lstat", 1, fs_async, FS_LSTAT | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("unlink", 1, fs_async, FS_UNLINK | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("rename", 2, fs_async, FS_RENAME | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("mkdir", 2, fs_async, FS_MKDIR | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("rmdir", 1, fs_async, FS_RMDIR | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("readdir", 1, fs_async, FS_READDIR | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("readFile", 2, fs_async, FS_READ_FILE | FS_PROMISES),
+  JS_CFUNC_MAGIC_DEF("writeFile", 3, fs_async, FS_WRITE_FILE | FS_PROMISES),
+};
+
+JSModuleDef* veil_fs_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, fs_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, FS, countof(FS));
+    JS_AddModuleExport(ctx, m, "promises");
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+JSModuleDef* veil_fs_promises_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, promises_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, PROMISES, countof(PROMISES));
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+static void global_init() {
+  JS_NewClassID(&stats_class_id);
+  JS_NewClassID(&handle_class_id);
+}
+
+static void register_classes(JSContext* ctx) {
+  JSRuntime* rt = JS_GetRuntime(ctx);
+  JSValue proto;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, stats_class_id)) {
+    JS_NewClass(rt, stats_class_id, &STATS_CLASS);
+    JS_NewClass(rt, handle_class_id, &HANDLE_CLASS);
+  }
+
+  // both modules may be imported; the second import reuses the prototypes
+  proto = JS_GetClassProto(ctx, stats_class_id);
+  if (JS_IsObject(proto)) {
+    JS_FreeValue(ctx, proto);
+    return;
+  }
+  JS_FreeValue(ctx, proto);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, STATS_PROTO, countof(STATS_PROTO));
+  JS_SetClassProto(ctx, stats_class_id, proto);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, HANDLE_PROTO, countof(HANDLE_PROTO));
+  JS_SetClassProto(ctx, handle_class_id, proto);
+}
+
+static int fs_module_init(JSContext* ctx, JSModuleDef* m) {
+  JSValue fs;
+
+  register_classes(ctx);
+
+  fs = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, fs, FS, countof(FS));
+  JS_SetPropertyStr(ctx, fs, "promises", new_promises(ctx));
+
+  JS_SetModuleExportList(ctx, m, FS, countof(FS));
+  JS_SetModuleExport(ctx, m, "promises", JS_GetPropertyStr(ctx, fs, "promises"));
+  JS_SetModuleExport(ctx, m, "default", fs);
+
+  return 0;
+}
+
+static int promises_module_init(JSContext* ctx, JSModuleDef* m) {
+  register_classes(ctx);
+
+  JS_SetModuleExportList(ctx, m, PROMISES, countof(PROMISES));
+  JS_SetModuleExport(ctx, m, "default", new_promises(ctx));
+
+  return 0;
+}
+
+static JSValue new_promises(JSContext* ctx) {
+  JSValue promises = JS_NewObject(ctx);
+
+  JS_SetPropertyFunctionList(ctx, promises, PROMISES, countof(PROMISES));
+
+  return promises;
+}
+
+static JSValue fs_sync(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  fs_req_t req;
+  JSValue result;
+
+  req_init(&req, FS_OP(magic));
+
+  if (!prepare(ctx, &req, argc, argv)) {
+    req_release(ctx, &req);
+    return JS_EXCEPTION;
+  }
+
+  run_op(&req);
+
+  if (req.op == FS_EXISTS) {
+    result = JS_NewBool(ctx, req.err == 0);
+  } else if (req.err) {
+    result = JS_Throw(ctx, veil_builtin_new_uv_error(ctx, req.err, req.syscall, cstr_str(&req.path)));
+  } else {
+    result = result_value(ctx, &req);
+  }
+
+  req_release(ctx, &req);
+
+  return result;
+}
+
+static JSValue fs_async(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  fs_req_t* req;
+  JSValue promise = JS_UNDEFINED;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "asynchronous fs calls require an event loop");
+  }
+
+  req = calloc(1, sizeof(fs_req_t));
+  CHECK_NOT_NULL(req);
+  req_init(req, FS_OP(magic));
+  req->promises = magic & FS_PROMISES;
+
+  // node style: a trailing function is the callback, otherwise a promise
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    req->callback = JS_DupValue(ctx, argv[--argc]);
+  }
+
+  if (!prepare(ctx, req, argc, argv)) {
+    req_release(ctx, req);
+    free(req);
+    return JS_EXCEPTION;
+  }
+
+  if (JS_IsUndefined(req->callback)) {
+    promise = JS_NewPromiseCapability(ctx, req->resolving_funcs);
+    if (JS_IsException(promise)) {
+      req_release(ctx, req);
+      free(req);
+      return promise;
+    }
+  }
+
+  req->vm = vm;
+  req->work.data = req;
+  veil_vm_add_cleanup(vm, &req->cleanup, req_cleanup_cb);
+  CHECK_OK(uv_queue_work(&vm->uv->loop, &req->work, work_cb, after_work_cb));
+
+  return promise;
+}
+
+static JSValue handle_call(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  fs_handle_t* handle = JS_GetOpaque2(ctx, this_val, handle_class_id);
+  JSValue args[6];
+
+  if (!handle) {
+    return JS_EXCEPTION;
+  }
+
+  if (handle->closed) {
+    return JS_ThrowTypeError(ctx, "file handle is closed");
+  }
+
+  if (magic == FS_CLOSE) {
+    handle->closed = true;
+  }
+
+  // the fd goes in front of the method's own arguments
+  if (argc > (int) countof(args) - 1) {
+    argc = countof(args) - 1;
+  }
+  args[0] = JS_NewInt32(ctx, handle->fd);
+  for (int n = 0; n < argc; n++) {
+    args[n + 1] = argv[n];
+  }
+
+  return fs_async(ctx, JS_UNDEFINED, argc + 1, args, magic | FS_PROMISES);
+}
+
+static JSValue handle_fd(JSContext* ctx, JSValueConst this_val) {
+  fs_handle_t* handle = JS_GetOpaque2(ctx, this_val, handle_class_id);
+
+  if (!handle) {
+    return JS_EXCEPTION;
+  }
+
+  return JS_NewInt32(ctx, handle->closed ? -1 : handle->fd);
+}
+
+static void handle_finalizer(JSRuntime* rt, JSValue val) {
+  fs_handle_t* handle = JS_GetOpaque(val, handle_class_id);
+  uv_fs_t req;
+
+  if (!handle) {
+    return;
+  }
+
+  // a handle that was never closed must not leak its descriptor
+  if (!handle->closed) {
+    uv_fs_close(NULL, &req, handle->fd, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  free(handle);
+}
+
+static JSValue stats_is(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  JSValue value = JS_GetPropertyStr(ctx, this_val, "mode");
+  int32_t mode;
+
+  if (JS_ToInt32(ctx, &mode, value) < 0) {
+    JS_FreeValue(ctx, value);
+    return JS_EXCEPTION;
+  }
+  JS_FreeValue(ctx, value);
+
+  return JS_NewBool(ctx, (mode & S_IFMT) == magic);
+}
+
+static void req_init(fs_req_t* req, int op) {
+  memset(req, 0, sizeof(fs_req_t));
+  req->op = op;
+  req->callback = JS_UNDEFINED;
+  req->resolving_funcs[0] = JS_UNDEFINED;
+  req->resolving_funcs[1] = JS_UNDEFINED;
+  req->keep = JS_UNDEFINED;
+  req->path = cstr_init();
+  req->dest = cstr_init();
+  req->fd = -1;
+  req->mode = FS_DEFAULT_MODE;
+  req->position = -1;
+  req->names = cvec_str_init();
+}
+
+static void req_release(JSContext* ctx, fs_req_t* req) {
+  JS_FreeValue(ctx, req->callback);
+  JS_FreeValue(ctx, req->resolving_funcs[0]);
+  JS_FreeValue(ctx, req->resolving_funcs[1]);
+  JS_FreeValue(ctx, req->keep);
+  JS_FreeCString(ctx, req->str);
+  req->callback = JS_UNDEFINED;
+  req->resolving_funcs[0] = JS_UNDEFINED;
+  req->resolving_funcs[1] = JS_UNDEFINED;
+  req->keep = JS_UNDEFINED;
+  req->str = NULL;
+
+  cstr_drop(&req->path);
+  cstr_drop(&req->dest);
+  cvec_str_drop(&req->names);
+  free(req->bufs);
+  free(req->data);
+  req->bufs = NULL;
+  req->data = NULL;
+}
+
+static bool prepare(JSContext* ctx, fs_req_t* req, int argc, JSValueConst* argv) {
+  JSValueConst arg[5];
+  JSValue value;
+
+  // missing arguments read as undefined
+  for (size_t n = 0; n < countof(arg); n++) {
+    arg[n] = n < argc ? argv[n] : JS_UNDEFINED;
+  }
+
+  switch (req->op) {
+    case FS_OPEN:
+      return get_path(ctx, arg[0], &req->path)
+          && get_flags(ctx, arg[1], &req->flags)
+          && (JS_IsUndefined(arg[2]) || JS_ToInt32(ctx, &req->mode, arg[2]) == 0);
+    case FS_CLOSE:
+    case FS_FSTAT:
+      return get_fd(ctx, arg[0], &req->fd);
+    case FS_READ:
+    case FS_WRITE: {
+      uint8_t* data;
+      size_t size;
+      uint64_t offset = 0;
+      uint64_t length;
+
+      if (!get_fd(ctx, arg[0], &req->fd)) {
+        return false;
+      }
+
+      req->bufs = calloc(1, sizeof(uv_buf_t));
+      CHECK_NOT_NULL(req->bufs);
+      req->nbufs = 1;
+
+      if (req->op == FS_WRITE && JS_IsString(arg[1])) {
+        // write(fd, string[, position])
+        req->str = JS_ToCStringLen(ctx, &size, arg[1]);
+        if (!req->str) {
+          return false;
+        }
+        req->bufs[0] = uv_buf_init((char*) req->str, size);
+        return get_position(ctx, arg[2], &req->position);
+      }
+
+      if (!veil_builtin_get_bytes(ctx, arg[1], &data, &size)) {
+        return false;
+      }
+
+      if (!JS_IsUndefined(arg[2]) && JS_ToIndex(ctx, &offset, arg[2]) < 0) {
+        return false;
+      }
+      if (offset > size) {
+        JS_ThrowRangeError(ctx, "offset is out of bounds");
+        return false;
+      }
+
+      length = size - offset;
+      if (!JS_IsUndefined(arg[3]) && JS_ToIndex(ctx, &length, arg[3]) < 0) {
+        return false;
+      }
+      if (length > size - offset) {
+        JS_ThrowRangeError(ctx, "length is out of bounds");
+        return false;
+      }
+
+      req->keep = JS_DupValue(ctx, arg[1]);
+      req->bufs[0] = uv_buf_init((char*) data + offset, length);
+      return get_position(ctx, arg[4], &req->position);
+    }
+    case FS_READV:
+    case FS_WRITEV:
+      return get_fd(ctx, arg[0], &req->fd)
+          && get_bufs(ctx, req, arg[1])
+          && get_position(ctx, arg[2], &req->position);
+    case FS_STAT:
+    case FS_LSTAT:
+    case FS_UNLINK:
+    case FS_RMDIR:
+    case FS_READDIR:
+    case FS_EXISTS:
+      return get_path(ctx, arg[0], &req->path);
+    case FS_RENAME:
+      return get_path(ctx, arg[0], &req->path) && get_path(ctx, arg[1], &req->dest);
+    case FS_MKDIR:
+      if (!get_path(ctx, arg[0], &req->path)) {
+        return false;
+      }
+
+      if (JS_IsNumber(arg[1])) {
+        return JS_ToInt32(ctx, &req->mode, arg[1]) == 0;
+      }
+
+      value = get_option(ctx, arg[1], "recursive");
+      req->recursive = JS_ToBool(ctx, value);
+      JS_FreeValue(ctx, value);
+
+      value = get_option(ctx, arg[1], "mode");
+      if (!JS_IsUndefined(value) && JS_ToInt32(ctx, &req->mode, value) < 0) {
+        JS_FreeValue(ctx, value);
+        return false;
+      }
+      JS_FreeValue(ctx, value);
+      return true;
+    case FS_READ_FILE:
+      if (JS_IsNumber(arg[0]) ? !get_fd(ctx, arg[0], &req->fd) : !get_path(ctx, arg[0], &req->path)) {
+        return false;
+      }
+
+      value = get_option(ctx, arg[1], "flag");
+      req->flags = UV_FS_O_RDONLY;
+      if (!JS_IsUndefined(value) && !get_flags(ctx, value, &req->flags)) {
+        JS_FreeValue(ctx, value);
+        return false;
+      }
+      JS_FreeValue(ctx, value);
+
+      return get_encoding(ctx, arg[1], &req->utf8);
+    case FS_WRITE_FILE: {
+      uint8_t* data;
+      size_t size;
+
+      if (JS_IsNumber(arg[0]) ? !get_fd(ctx, arg[0], &req->fd) : !get_path(ctx, arg[0], &req->path)) {
+        return false;
+      }
+
+      req->bufs = calloc(1, sizeof(uv_buf_t));
+      CHECK_NOT_NULL(req->bufs);
+      req->nbufs = 1;
+
+      if (JS_IsString(arg[1])) {
+        req->str = JS_ToCStringLen(ctx, &size, arg[1]);
+        if (!req->str) {
+          return false;
+        }
+        req->bufs[0] = uv_buf_init((char*) req->str, size);
+      } else if (veil_builtin_get_bytes(ctx, arg[1], &data, &size)) {
+        req->keep = JS_DupValue(ctx, arg[1]);
+        req->bufs[0] = uv_buf_init((char*) data, size);
+      } else {
+        return false;
+      }
+
+      value = get_option(ctx, arg[2], "flag");
+      if (JS_IsUndefined(value)) {
+        req->flags = UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC;
+      } else if (!get_flags(ctx, value, &req->flags)) {
+        JS_FreeValue(ctx, value);
+        return false;
+      }
+      JS_FreeValue(ctx, value);
+
+      value = get_option(ctx, arg[2], "mode");
+      if (!JS_IsUndefined(value) && JS_ToInt32(ctx, &req->mode, value) < 0) {
+        JS_FreeValue(ctx, value);
+        return false;
+      }
+      JS_FreeValue(ctx, value);
+      return true;
+    }
+    default:
+      veil_abort(__FILE__, __LINE__, "unknown fs operation");
+      return false;
+  }
+}
+
+static void run_op(fs_req_t* req) {
+  // runs on the threadpool for the async forms: no JS in here
+  uv_fs_t fs;
+  int64_t result = 0;
+  const char* path = cstr_str(&req->path);
+
+  switch (req->op) {
+    case FS_OPEN:
+      req->syscall = "open";
+      result = uv_fs_open(NULL, &fs, path, req->flags, req->mode, NULL);
+      break;
+    case FS_CLOSE:
+      req->syscall = "close";
+      result = uv_fs_close(NULL, &fs, req->fd, NULL);
+      break;
+    case FS_READ:
+    case FS_READV:
+      req->syscall = "read";
+      result = uv_fs_read(NULL, &fs, req->fd, req->bufs, req->nbufs, req->position, NULL);
+      break;
+    case FS_WRITE:
+    case FS_WRITEV:
+      req->syscall = "write";
+      result = uv_fs_write(NULL, &fs, req->fd, req->bufs, req->nbufs, req->position, NULL);
+      break;
+    case FS_STAT:
+    case FS_EXISTS:
+      req->syscall = "stat";
+      result = uv_fs_stat(NULL, &fs, path, NULL);
+      break;
+    case FS_LSTAT:
+      req->syscall = "lstat";
+      result = uv_fs_lstat(NULL, &fs, path, NULL);
+      break;
+    case FS_FSTAT:
+      req->syscall = "fstat";
+      result = uv_fs_fstat(NULL, &fs, req->fd, NULL);
+      break;
+    case FS_UNLINK:
+      req->syscall = "unlink";
+      result = uv_fs_unlink(NULL, &fs, path, NULL);
+      break;
+    case FS_RENAME:
+      req->syscall = "rename";
+      result = uv_fs_rename(NULL, &fs, path, cstr_str(&req->dest), NULL);
+      break;
+    case FS_MKDIR:
+      req->syscall = "mkdir";
+      if (req->recursive) {
+        mkdir_p(req, cstr_data(&req->path));
+        return;
+      }
+      result = uv_fs_mkdir(NULL, &fs, path, req->mode, NULL);
+      break;
+    case FS_RMDIR:
+      req->syscall = "rmdir";
+      result = uv_fs_rmdir(NULL, &fs, path, NULL);
+      break;
+    case FS_READDIR: {
+      uv_dirent_t entry;
+
+      req->syscall = "scandir";
+      result = uv_fs_scandir(NULL, &fs, path, 0, NULL);
+      if (result >= 0) {
+        while (uv_fs_scandir_next(&fs, &entry) != UV_EOF) {
+          cvec_str_emplace_back(&req->names, entry.name);
+        }
+      }
+      break;
+    }
+    case FS_READ_FILE:
+      read_file(req);
+      return;
+    case FS_WRITE_FILE:
+      write_file(req);
+      return;
+    default:
+      veil_abort(__FILE__, __LINE__, "unknown fs operation");
+      return;
+  }
+
+  if (result < 0) {
+    req->err = (int) result;
+  } else {
+    req->result = result;
+    if (req->op == FS_STAT || req->op == FS_LSTAT || req->op == FS_FSTAT) {
+      req->stat = fs.statbuf;
+    }
+  }
+  uv_fs_req_cleanup(&fs);
+}
+
+static void read_file(fs_req_t* req) {
+  uv_fs_t fs;
+  uv_file fd = req->fd;
+  uint64_t expected;
+  size_t capacity = 0;
+  bool regular;
+
+  if (fd < 0) {
+    req->syscall = "open";
+    fd = uv_fs_open(NULL, &fs, cstr_str(&req->path), req->flags, 0, NULL);
+    uv_fs_req_cleanup(&fs);
+    if (fd < 0) {
+      req->err = fd;
+      return;
+    }
+  }
+
+  // one fstat sizes the buffer, so a regular file takes a single read
+  req->syscall = "fstat";
+  req->err = uv_fs_fstat(NULL, &fs, fd, NULL);
+  expected = fs.statbuf.st_size;
+  regular = (fs.statbuf.st_mode & S_IFMT) == S_IFREG;
+  uv_fs_req_cleanup(&fs);
+
+  if (req->err == 0) {
+    req->syscall = "read";
+
+    if (regular && expected > FS_MAX_LENGTH) {
+      req->err = UV_EFBIG;
+    } else {
+      capacity = regular && expected > 0 ? (size_t) expected : FS_CHUNK_SIZE;
+      req->data = malloc(capacity);
+      CHECK_NOT_NULL(req->data);
+    }
+  }
+
+  while (req->err == 0) {
+    uv_buf_t buf = uv_buf_init((char*) req->data + req->size, capacity - req->size);
+    int result = uv_fs_read(NULL, &fs, fd, &buf, 1, -1, NULL);
+
+    uv_fs_req_cleanup(&fs);
+    if (result < 0) {
+      req->err = result;
+      break;
+    }
+
+    req->size += result;
+    // procfs and friends report regular files of size 0
+    if (result == 0 || (regular && expected > 0 && req->size >= expected)) {
+      break;
+    }
+
+    // the file grew, or its size is unknown
+    if (req->size == capacity) {
+      if (capacity == FS_MAX_LENGTH) {
+        req->err = UV_EFBIG;
+        break;
+      }
+      capacity = capacity > FS_MAX_LENGTH / 2 ? FS_MAX_LENGTH : capacity * 2;
+      req->data = realloc(req->data, capacity);
+      CHECK_NOT_NULL(req->data);
+    }
+  }
+
+  // descriptors passed in stay open
+  if (req->fd < 0) {
+    uv_fs_close(NULL, &fs, fd, NULL);
+    uv_fs_req_cleanup(&fs);
+  }
+}
+
+static void write_file(fs_req_t* req) {
+  uv_fs_t fs;
+  uv_file fd = req->fd;
+  uv_buf_t buf = req->bufs[0];
+
+  if (fd < 0) {
+    req->syscall = "open";
+    fd = uv_fs_open(NULL, &fs, cstr_str(&req->path), req->flags, req->mode, NULL);
+    uv_fs_req_cleanup(&fs);
+    if (fd < 0) {
+      req->err = fd;
+      return;
+    }
+  }
+
+  req->syscall = "write";
+  while (buf.len > 0) {
+    int result = uv_fs_write(NULL, &fs, fd, &buf, 1, -1, NULL);
+
+    uv_fs_req_cleanup(&fs);
+    if (result < 0) {
+      req->err = result;
+      break;
+    }
+
+    buf.base += result;
+    buf.len -= result;
+  }
+
+  if (req->fd < 0) {
+    uv_fs_close(NULL, &fs, fd, NULL);
+    uv_fs_req_cleanup(&fs);
+  }
+}
+
+static void mkdir_p(fs_req_t* req, char* path) {
+  uv_fs_t fs;
+  char* slash;
+  int result = uv_fs_mkdir(NULL, &fs, path, req->mode, NULL);
+
+  uv_fs_req_cleanup(&fs);
+
+  if (result == UV_ENOENT && (slash = strrchr(path, '/')) && slash != path) {
+    // create the parent, then retry
+    *slash = '\0';
+    mkdir_p(req, path);
+    *slash = '/';
+
+    if (req->err) {
+      return;
+    }
+
+    result = uv_fs_mkdir(NULL, &fs, path, req->mode, NULL);
+    uv_fs_req_cleanup(&fs);
+  }
+
+  if (result == UV_EEXIST) {
+    uv_fs_stat(NULL, &fs, path, NULL);
+    if ((fs.statbuf.st_mode & S_IFMT) == S_IFDIR) {
+      result = 0;
+    }
+    uv_fs_req_cleanup(&fs);
+  }
+
+  req->err = result;
+}
+
+static JSValue result_value(JSContext* ctx, fs_req_t* req) {
+  JSValue value;
+
+  switch (req->op) {
+    case FS_OPEN:
+      if (req->promises) {
+        fs_handle_t* handle;
+
+        value = JS_NewObjectClass(ctx, handle_class_id);
+        if (JS_IsException(value)) {
+          return value;
+        }
+
+        handle = calloc(1, sizeof(fs_handle_t));
+        CHECK_NOT_NULL(handle);
+        handle->fd = (uv_file) req->result;
+        JS_SetOpaque(value, handle);
+
+        return value;
+      }
+      return JS_NewInt32(ctx, (int32_t) req->result);
+    case FS_READ:
+    case FS_WRITE:
+    case FS_READV:
+    case FS_WRITEV:
+      if (req->promises) {
+        bool read = req->op == FS_READ || req->op == FS_READV;
+        bool vector = req->op == FS_READV || req->op == FS_WRITEV;
+
+        value = JS_NewObject(ctx);
+        JS_SetPropertyStr(ctx, value, read ? "bytesRead" : "bytesWritten", JS_NewInt64(ctx, req->result));
+        JS_SetPropertyStr(ctx, value, vector ? "buffers" : "buffer", JS_DupValue(ctx, req->keep));
+
+        return value;
+      }
+      return JS_NewInt64(ctx, req->result);
+    case FS_STAT:
+    case FS_LSTAT:
+    case FS_FSTAT:
+      return new_stats(ctx, &req->stat);
+    case FS_READDIR: {
+      uint32_t index = 0;
+
+      value = JS_NewArray(ctx);
+      c_foreach (it, cvec_str, req->names) {
+        JS_SetPropertyUint32(ctx, value, index++, JS_NewStringLen(ctx, cstr_str(it.ref), cstr_size(it.ref)));
+      }
+
+      return value;
+    }
+    case FS_READ_FILE:
+      if (req->utf8) {
+        return JS_NewStringLen(ctx, (const char*) req->data, req->size);
+      }
+
+      // the ArrayBuffer takes over the memory read into
+      value = new_uint8_array(ctx, req->data, req->size);
+      req->data = NULL;
+
+      return value;
+    default:
+      return JS_UNDEFINED;
+  }
+}
+
+static void work_cb(uv_work_t* work) {
+  run_op(work->data);
+}
+
+static void after_work_cb(uv_work_t* work, int status) {
+  fs_req_t* req = work->data;
+
+  if (req->vm) {
+    veil_vm_remove_cleanup(&req->cleanup);
+    settle(req->vm->context, req);
+    req_release(req->vm->context, req);
+  } else {
+    // the VM is going and waits for this before the runtime does
+    req_release(req->context, req);
+  }
+
+  free(req);
+}
+
+static void settle(JSContext* ctx, fs_req_t* req) {
+  JSValue args[3] = { JS_NULL, JS_UNDEFINED, JS_UNDEFINED };
+  JSValue result;
+  int argc = 2;
+
+  if (req->err) {
+    args[0] = veil_builtin_new_uv_error(ctx, req->err, req->syscall, cstr_str(&req->path));
+    argc = 1;
+  } else {
+    args[1] = result_value(ctx, req);
+    if (JS_IsException(args[1])) {
+      args[0] = JS_GetException(ctx);
+      args[1] = JS_UNDEFINED;
+    }
+  }
+
+  if (JS_IsUndefined(req->callback)) {
+    bool failed = !JS_IsNull(args[0]);
+
+    result = JS_Call(ctx, req->resolving_funcs[failed ? 1 : 0], JS_UNDEFINED, 1, &args[failed ? 0 : 1]);
+  } else {
+    // node passes the buffer back along with the byte count
+    if (argc == 2 && (req->op == FS_READ || req->op == FS_WRITE || req->op == FS_READV || req->op == FS_WRITEV)) {
+      args[2] = JS_DupValue(ctx, req->keep);
+      argc = 3;
+    }
+    result = JS_Call(ctx, req->callback, JS_UNDEFINED, argc, args);
+  }
+
+  if (JS_IsException(result)) {
+    veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+  }
+
+  JS_FreeValue(ctx, result);
+  for (size_t n = 0; n < countof(args); n++) {
+    JS_FreeValue(ctx, args[n]);
+  }
+}
+
+static void req_cleanup_cb(veil_cleanup_t* cleanup) {
+  fs_req_t* req = container_of(cleanup, fs_req_t, cleanup);
+
+  // Nothing is settled now. A request a thread has already taken still
+  // reads or writes the memory of keep and str, so those stay until
+  // after_work_cb, which the loop's teardown waits for.
+  uv_cancel((uv_req_t*) &req->work);
+  JS_FreeValue(req->vm->context, req->callback);
+  JS_FreeValue(req->vm->context, req->resolving_funcs[0]);
+  JS_FreeValue(req->vm->context, req->resolving_funcs[1]);
+  req->callback = JS_UNDEFINED;
+  req->resolving_funcs[0] = JS_UNDEFINED;
+  req->resolving_funcs[1] = JS_UNDEFINED;
+  req->context = req->vm->context;
+  req->vm = NULL;
+}
+
+static bool get_path(JSContext* ctx, JSValueConst value, cstr* out) {
+  size_t size;
+  const char* str;
+
+  if (!JS_IsString(value)) {
+    JS_ThrowTypeError(ctx, "path must be a string");
+    return false;
+  }
+
+  str = JS_ToCStringLen(ctx, &size, value);
+  if (!str) {
+    return false;
+  }
+
+  if (memchr(str, '\0', size)) {
+    JS_FreeCString(ctx, str);
+    JS_ThrowTypeError(ctx, "path must not contain null bytes");
+    return false;
+  }
+
+  cstr_assign_n(out, str, size);
+  JS_FreeCString(ctx, str);
+
+  return true;
+}
+
+static bool get_fd(JSContext* ctx, JSValueConst value, uv_file* out) {
+  int32_t fd;
+
+  if (!JS_IsNumber(value)) {
+    JS_ThrowTypeError(ctx, "fd must be a non-negative integer");
+    return false;
+  }
+
+  if (JS_ToInt32(ctx, &fd, value) < 0) {
+    return false;
+  }
+
+  if (fd < 0) {
+    JS_ThrowRangeError(ctx, "fd must be a non-negative integer");
+    return false;
+  }
+
+  *out = fd;
+
+  return true;
+}
+
+static bool get_position(JSContext* ctx, JSValueConst value, int64_t* out) {
+  // null or undefined reads and writes at the current position
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    *out = -1;
+    return true;
+  }
+
+  return JS_ToInt64(ctx, out, value) == 0;
+}
+
+static bool get_bufs(JSContext* ctx, fs_req_t* req, JSValueConst list) {
+  JSValue value;
+  int64_t length;
+
+  if (!JS_IsArray(ctx, list)) {
+    JS_ThrowTypeError(ctx, "buffers must be an array");
+    return false;
+  }
+
+  value = JS_GetPropertyStr(ctx, list, "length");
+  if (JS_ToInt64(ctx, &length, value) < 0) {
+    JS_FreeValue(ctx, value);
+    return false;
+  }
+  JS_FreeValue(ctx, value);
+
+  if (length < 0 || length > UINT16_MAX) {
+    JS_ThrowRangeError(ctx, "too many buffers");
+    return false;
+  }
+
+  // the whole batch goes to a single readv/writev
+  req->nbufs = (unsigned int) length;
+  req->bufs = calloc(req->nbufs + 1, sizeof(uv_buf_t));
+  CHECK_NOT_NULL(req->bufs);
+  req->keep = JS_NewArray(ctx);
+
+  for (uint32_t n = 0; n < req->nbufs; n++) {
+    uint8_t* data;
+    size_t size;
+
+    value = JS_GetPropertyUint32(ctx, list, n);
+    if (!veil_builtin_get_bytes(ctx, value, &data, &size)) {
+      JS_FreeValue(ctx, value);
+      return false;
+    }
+
+    req->bufs[n] = uv_buf_init((char*) data, size);
+    JS_SetPropertyUint32(ctx, req->keep, n, value);
+  }
+
+  return true;
+}
+
+static bool get_flags(JSContext* ctx, JSValueConst value, int* out) {
+  static const struct {
+    const char* name;
+    int flags;
+  } FLAGS[] = {
+    { "r", UV_FS_O_RDONLY },
+    { "r+", UV_FS_O_RDWR },
+    { "rs+", UV_FS_O_RDWR | UV_FS_O_SYNC },
+    { "w", UV_FS_O_TRUNC | UV_FS_O_CREAT | UV_FS_O_WRONLY },
+    { "wx", UV_FS_O_TRUNC | UV_FS_O_CREAT | UV_FS_O_WRONLY | UV_FS_O_EXCL },
+    { "w+", UV_FS_O_TRUNC | UV_FS_O_CREAT | UV_FS_O_RDWR },
+    { "wx+", UV_FS_O_TRUNC | UV_FS_O_CREAT | UV_FS_O_RDWR | UV_FS_O_EXCL },
+    { "a", UV_FS_O_APPEND | UV_FS_O_CREAT | UV_FS_O_WRONLY },
+    { "ax", UV_FS_O_APPEND | UV_FS_O_CREAT | UV_FS_O_WRONLY | UV_FS_O_EXCL },
+    { "a+", UV_FS_O_APPEND | UV_FS_O_CREAT | UV_FS_O_RDWR },
+    { "ax+", UV_FS_O_APPEND | UV_FS_O_CREAT | UV_FS_O_RDWR | UV_FS_O_EXCL },
+  };
+  const char* str;
+
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    *out = UV_FS_O_RDONLY;
+    return true;
+  }
+
+  if (JS_IsNumber(value)) {
+    return JS_ToInt32(ctx, out, value) == 0;
+  }
+
+  str = JS_ToCString(ctx, value);
+  if (!str) {
+    return false;
+  }
+
+  for (size_t n = 0; n < countof(FLAGS); n++) {
+    if (strcmp(str, FLAGS[n].name) == 0) {
+      *out = FLAGS[n].flags;
+      JS_FreeCString(ctx, str);
+      return true;
+    }
+  }
+
+  JS_ThrowTypeError(ctx, "invalid flags '%s'", str);
+  JS_FreeCString(ctx, str);
+
+  return false;
+}
+
+static bool get_encoding(JSContext* ctx, JSValueConst options, bool* utf8) {
+  JSValue value = JS_IsString(options) ? JS_DupValue(ctx, options) : get_option(ctx, options, "encoding");
+  const char* str;
+
+  *utf8 = false;
+
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    return true;
+  }
+
+  str = JS_ToCString(ctx, value);
+  JS_FreeValue(ctx, value);
+  if (!str) {
+    return false;
+  }
+
+  // other encodings need a Buffer implementation
+  *utf8 = strcmp(str, "utf8") == 0 || strcmp(str, "utf-8") == 0;
+  if (!*utf8) {
+    JS_ThrowTypeError(ctx, "unsupported encoding '%s'", str);
+  }
+  JS_FreeCString(ctx, str);
+
+  return *utf8;
+}
+
+static JSValue get_option(JSContext* ctx, JSValueConst options, const char* name) {
+  if (!JS_IsObject(options)) {
+    return JS_UNDEFINED;
+  }
+
+  return JS_GetPropertyStr(ctx, options, name);
+}
+
+static JSValue new_uint8_array(JSContext* ctx, uint8_t* data, size_t size) {
+  JSValue buffer = veil_shared_adopt_array_buffer(ctx, data, size);
+
+  if (JS_IsException(buffer)) {
+    return buffer;
+  }
+
+  return veil_builtin_new_uint8_array(ctx, buffer);
+}
+
+static JSValue new_stats(JSContext* ctx, const uv_stat_t* stat) {
+  JSValue stats = JS_NewObjectClass(ctx, stats_class_id);
+
+  if (JS_IsException(stats)) {
+    return stats;
+  }
+
+  JS_SetPropertyStr(ctx, stats, "dev", JS_NewInt64(ctx, (int64_t) stat->st_dev));
+  JS_SetPropertyStr(ctx, stats, "mode", JS_NewInt64(ctx, (int64_t) stat->st_mode));
+  JS_SetPropertyStr(ctx, stats, "nlink", JS_NewInt64(ctx, (int64_t) stat->st_nlink));
+  JS_SetPropertyStr(ctx, stats, "uid", JS_NewInt64(ctx, (int64_t) stat->st_uid));
+  JS_SetPropertyStr(ctx, stats, "gid", JS_NewInt64(ctx, (int64_t) stat->st_gid));
+  JS_SetPropertyStr(ctx, stats, "rdev", JS_NewInt64(ctx, (int64_t) stat->st_rdev));
+  JS_SetPropertyStr(ctx, stats, "blksize", JS_NewInt64(ctx, (int64_t) stat->st_blksize));
+  JS_SetPropertyStr(ctx, stats, "ino", JS_NewInt64(ctx, (int64_t) stat->st_ino));
+  JS_SetPropertyStr(ctx, stats, "size", JS_NewInt64(ctx, (int64_t) stat->st_size));
+  JS_SetPropertyStr(ctx, stats, "blocks", JS_NewInt64(ctx, (int64_t) stat->st_blocks));
+  JS_SetPropertyStr(ctx, stats, "atimeMs", JS_NewFloat64(ctx, stat->st_atim.tv_sec * 1e3 + stat->st_atim.tv_nsec / 1e6));
+  JS_SetPropertyStr(ctx, stats, "mtimeMs", JS_NewFloat64(ctx, stat->st_mtim.tv_sec * 1e3 + stat->st_mtim.tv_nsec / 1e6));
+  JS_SetPropertyStr(ctx, stats, "ctimeMs", JS_NewFloat64(ctx, stat->st_ctim.tv_sec * 1e3 + stat->st_ctim.tv_nsec / 1e6));
+  JS_SetPropertyStr(ctx, stats, "birthtimeMs",
+      JS_NewFloat64(ctx, stat->st_birthtim.tv_sec * 1e3 + stat->st_birthtim.tv_nsec / 1e6));
+
+  return stats;
+}
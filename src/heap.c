@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// QuickJS exposes no heap iterator, so the snapshot is the graph of objects
+// and strings reachable from the global object through own properties
+// (including accessors and symbols) and prototypes. Closure captures and
+// engine internals are not visible; retention through them shows up as an
+// unexplained self size on the function that holds them. Self sizes are
+// estimated from the runtime's average object and property sizes.
+
+#define i_type cmap_heap_seen
+#define i_key uintptr_t
+#define i_val int32_t
+#include <stc/cmap.h>
+
+#define i_type cmap_heap_string
+#define i_key_str
+#define i_val int32_t
+#include <stc/cmap.h>
+
+#define i_val_str
+#define i_opt (c_no_cmp | c_is_fwd)
+#include <stc/cvec.h>
+
+#define HEAP_NODE_FIELD_COUNT 6
+#define HEAP_STRING_PREVIEW 1024
+#define HEAP_STRING_HEADER_SIZE 16
+
+// indexes into the node_types and edge_types tables of the snapshot meta
+enum {
+  NODE_HIDDEN = 0,
+  NODE_ARRAY = 1,
+  NODE_STRING = 2,
+  NODE_OBJECT = 3,
+  NODE_CLOSURE = 5,
+  NODE_SYNTHETIC = 9,
+};
+
+enum {
+  EDGE_ELEMENT = 1,
+  EDGE_PROPERTY = 2,
+  EDGE_INTERNAL = 3,
+  EDGE_SHORTCUT = 5,
+};
+
+typedef struct heap_node_s {
+  JSValue value;
+  int32_t type;
+  int32_t name;
+  size_t self_size;
+  uint32_t edge_count;
+} heap_node_t;
+
+typedef struct heap_edge_s {
+  int32_t type;
+  // string index for named edges, the element index for EDGE_ELEMENT
+  int32_t name_or_index;
+  int32_t to;
+} heap_edge_t;
+
+#define i_type cvec_heap_node
+#define i_val heap_node_t
+#define i_opt c_no_cmp
+#include <stc/cvec.h>
+
+#define i_type cvec_heap_edge
+#define i_val heap_edge_t
+#define i_opt c_no_cmp
+#include <stc/cvec.h>
+
+typedef struct heap_walk_s {
+  JSContext* ctx;
+  size_t object_size;
+  size_t property_size;
+  cvec_heap_node nodes;
+  cvec_heap_edge edges;
+  cmap_heap_seen seen;
+  cmap_heap_string string_index;
+  cvec_str strings;
+} heap_walk_t;
+
+static const char SNAPSHOT_META[] =
+    "{\"snapshot\":{\"meta\":{"
+    "\"node_fields\":[\"type\",\"name\",\"id\",\"self_size\",\"edge_count\",\"trace_node_id\"],"
+    "\"node_types\":[[\"hidden\",\"array\",\"string\",\"object\",\"code\",\"closure\",\"regexp\",\"number\","
+    "\"native\",\"synthetic\",\"concatenated string\",\"sliced string\",\"symbol\",\"bigint\"],"
+    "\"string\",\"number\",\"number\",\"number\",\"number\"],"
+    "\"edge_fields\":[\"type\",\"name_or_index\",\"to_node\"],"
+    "\"edge_types\":[[\"context\",\"element\",\"property\",\"internal\",\"hidden\",\"shortcut\",\"weak\"],"
+    "\"string_or_number\",\"node\"],"
+    "\"trace_function_info_fields\":[],\"trace_node_fields\":[],\"sample_fields\":[],\"location_fields\":[]},";
+
+static int module_init(JSContext* ctx, JSModuleDef* m);
+static JSValue get_heap_statistics(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue write_heap_snapshot(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static void walk_init(heap_walk_t* walk, veil_vm_t* vm);
+static void walk_drop(heap_walk_t* walk);
+static void walk_run(heap_walk_t* walk);
+static void walk_visit(heap_walk_t* walk, int32_t index);
+static void walk_property(heap_walk_t* walk, int32_t from, JSValueConst obj, JSAtom atom);
+static int32_t intern(heap_walk_t* walk, const char* str, size_t size);
+static int32_t add_node(heap_walk_t* walk, JSValueConst value, int32_t type, int32_t name, size_t self_size);
+static int32_t node_for(heap_walk_t* walk, JSValueConst value);
+static void add_edge(heap_walk_t* walk, int32_t from, int32_t type, int32_t name_or_index, int32_t to);
+static bool own_string(JSContext* ctx, JSValueConst obj, const char* key, cstr* out);
+static bool parse_index(const char* str, uint32_t* index);
+static void write_json(heap_walk_t* walk, cstr* out);
+
+static const JSCFunctionListEntry V8[] = {
+  JS_CFUNC_DEF("getHeapStatistics", 0, get_heap_statistics),
+  JS_CFUNC_DEF("writeHeapSnapshot", 1, write_heap_snapshot),
+};
+
+void veil_heap_get_usage(veil_vm_t* vm, veil_memory_usage_t* usage) {
+  JSMemoryUsage s;
+
+  memset(usage, 0, sizeof(veil_memory_usage_t));
+
+  if (!vm->enabled) {
+    return;
+  }
+
+  JS_ComputeMemoryUsage(vm->runtime, &s);
+
+  if (uv_resident_set_memory(&usage->rss) != 0) {
+    usage->rss = 0;
+  }
+
+  usage->heap_total = (size_t) s.malloc_size;
+  usage->heap_used = (size_t) s.memory_used_size;
+  usage->heap_limit = s.malloc_limit > 0 ? (size_t) s.malloc_limit : 0;
+  usage->array_buffers = (size_t) s.binary_object_size;
+  usage->objects = (uint64_t) s.obj_count;
+  usage->strings = (uint64_t) s.str_count;
+  usage->atoms = (uint64_t) s.atom_count;
+  usage->shapes = (uint64_t) s.shape_count;
+  usage->functions = (uint64_t) s.js_func_count;
+}
+
+bool veil_heap_write_snapshot(veil_vm_t* vm, const char* filename) {
+  heap_walk_t walk;
+  cstr out = cstr_init();
+  bool ok;
+
+  // like V8, only what survives a collection is worth reporting
+  JS_RunGC(vm->runtime);
+
+  walk_init(&walk, vm);
+  walk_run(&walk);
+  write_json(&walk, &out);
+  walk_drop(&walk);
+
+  ok = veil_file_write(filename, cstr_str(&out), cstr_size(&out));
+  cstr_drop(&out);
+
+  return ok;
+}
+
+JSModuleDef* veil_v8_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, V8, countof(V8));
+  }
+
+  return m;
+}
+
+static int module_init(JSContext* ctx, JSModuleDef* m) {
+  return JS_SetModuleExportList(ctx, m, V8, countof(V8));
+}
+
+static JSValue get_heap_statistics(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_memory_usage_t usage;
+  JSValue stats;
+
+  veil_heap_get_usage(vm, &usage);
+
+  stats = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, stats, "total_heap_size", JS_NewInt64(ctx, (int64_t) usage.heap_total));
+  JS_SetPropertyStr(ctx, stats, "used_heap_size", JS_NewInt64(ctx, (int64_t) usage.heap_used));
+  JS_SetPropertyStr(ctx, stats, "heap_size_limit", JS_NewInt64(ctx, (int64_t) usage.heap_limit));
+  JS_SetPropertyStr(ctx, stats, "external_memory", JS_NewInt64(ctx, (int64_t) usage.array_buffers));
+  JS_SetPropertyStr(ctx, stats, "number_of_objects", JS_NewInt64(ctx, (int64_t) usage.objects));
+  JS_SetPropertyStr(ctx, stats, "number_of_strings", JS_NewInt64(ctx, (int64_t) usage.strings));
+  JS_SetPropertyStr(ctx, stats, "number_of_atoms", JS_NewInt64(ctx, (int64_t) usage.atoms));
+  JS_SetPropertyStr(ctx, stats, "number_of_shapes", JS_NewInt64(ctx, (int64_t) usage.shapes));
+  JS_SetPropertyStr(ctx, stats, "number_of_functions", JS_NewInt64(ctx, (int64_t) usage.functions));
+
+  return stats;
+}
+
+static JSValue write_heap_snapshot(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  cstr filename = cstr_init();
+  JSValue result;
+
+  if (argc >= 1 && !JS_IsUndefined(argv[0])) {
+    const char* str = JS_ToCString(ctx, argv[0]);
+
+    if (!str) {
+      cstr_drop(&filename);
+      return JS_EXCEPTION;
+    }
+    cstr_assign(&filename, str);
+    JS_FreeCString(ctx, str);
+  } else {
+    veil_diagnostic_filename(&filename, NULL, "Heap", "heapsnapshot", veil_worker_thread_id(vm));
+  }
+
+  if (veil_heap_write_snapshot(vm, cstr_str(&filename))) {
+    result = JS_NewString(ctx, cstr_str(&filename));
+  } else {
+    result = JS_ThrowInternalError(ctx, "could not write heap snapshot '%s'", cstr_str(&filename));
+  }
+  cstr_drop(&filename);
+
+  return result;
+}
+
+static void walk_init(heap_walk_t* walk, veil_vm_t* vm) {
+  JSMemoryUsage s;
+
+  JS_ComputeMemoryUsage(vm->runtime, &s);
+
+  walk->ctx = vm->context;
+  walk->object_size = s.obj_count ? (size_t) (s.obj_size / s.obj_count) : 0;
+  walk->property_size = s.prop_count ? (size_t) (s.prop_size / s.prop_count) : 0;
+  walk->nodes = cvec_heap_node_init();
+  walk->edges = cvec_heap_edge_init();
+  walk->seen = cmap_heap_seen_init();
+  walk->string_index = cmap_heap_string_init();
+  walk->strings = cvec_str_init();
+}
+
+static void walk_drop(heap_walk_t* walk) {
+  c_foreach (it, cvec_heap_node, walk->nodes) {
+    JS_FreeValue(walk->ctx, it.ref->value);
+  }
+  cvec_heap_node_drop(&walk->nodes);
+  cvec_heap_edge_drop(&walk->edges);
+  cmap_heap_seen_drop(&walk->seen);
+  cmap_heap_string_drop(&walk->string_index);
+  cvec_str_drop(&walk->strings);
+}
+
+static void walk_run(heap_walk_t* walk) {
+  JSValue global = JS_GetGlobalObject(walk->ctx);
+  int32_t root = add_node(walk, JS_UNDEFINED, NODE_SYNTHETIC, intern(walk, "", 0), 0);
+
+  add_edge(walk, root, EDGE_SHORTCUT, intern(walk, "global", 6), node_for(walk, global));
+  JS_FreeValue(walk->ctx, global);
+
+  // breadth first; nodes are appended while walking, so edges stay grouped
+  // by their source node as the format requires
+  for (int32_t n = root + 1; n < (int32_t) cvec_heap_node_size(&walk->nodes); n++) {
+    walk_visit(walk, n);
+  }
+}
+
+static void walk_visit(heap_walk_t* walk, int32_t index) {
+  JSContext* ctx = walk->ctx;
+  JSValue obj = cvec_heap_node_at(&walk->nodes, index)->value;
+  JSPropertyEnum* props;
+  uint32_t count;
+  JSValue proto;
+
+  if (!JS_IsObject(obj)) {
+    return;
+  }
+
+  if (JS_GetOwnPropertyNames(ctx, &props, &count, obj, JS_GPN_STRING_MASK | JS_GPN_SYMBOL_MASK) < 0) {
+    // e.g. a Proxy whose ownKeys trap throws
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    count = 0;
+    props = NULL;
+  }
+
+  cvec_heap_node_at_mut(&walk->nodes, index)->self_size += count * walk->property_size;
+
+  for (uint32_t n = 0; n < count; n++) {
+    walk_property(walk, index, obj, props[n].atom);
+    JS_FreeAtom(ctx, props[n].atom);
+  }
+  js_free(ctx, props);
+
+  // not reference counted in this QuickJS version
+  proto = JS_GetPrototype(ctx, obj);
+  if (JS_IsObject(proto)) {
+    add_edge(walk, index, EDGE_INTERNAL, intern(walk, "__proto__", 9), node_for(walk, proto));
+  }
+}
+
+static void walk_property(heap_walk_t* walk, int32_t from, JSValueConst obj, JSAtom atom) {
+  JSContext* ctx = walk->ctx;
+  JSPropertyDescriptor desc;
+  const char* name;
+  uint32_t element;
+  int found;
+
+  // the descriptor, unlike a [[Get]], never runs user getters
+  found = JS_GetOwnProperty(ctx, &desc, obj, atom);
+  if (found <= 0) {
+    if (found < 0) {
+      JS_FreeValue(ctx, JS_GetException(ctx));
+    }
+    return;
+  }
+
+  name = JS_AtomToCString(ctx, atom);
+  if (!name) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  } else if (desc.flags & JS_PROP_GETSET) {
+    cstr accessor = cstr_init();
+
+    if (JS_IsObject(desc.getter)) {
+      cstr_printf(&accessor, "get %s", name);
+      add_edge(walk, from, EDGE_INTERNAL, intern(walk, cstr_str(&accessor), cstr_size(&accessor)), node_for(walk, desc.getter));
+    }
+
+    if (JS_IsObject(desc.setter)) {
+      cstr_printf(&accessor, "set %s", name);
+      add_edge(walk, from, EDGE_INTERNAL, intern(walk, cstr_str(&accessor), cstr_size(&accessor)), node_for(walk, desc.setter));
+    }
+    cstr_drop(&accessor);
+  } else {
+    int32_t to = node_for(walk, desc.value);
+
+    if (to >= 0 && parse_index(name, &element)) {
+      add_edge(walk, from, EDGE_ELEMENT, (int32_t) element, to);
+    } else if (to >= 0) {
+      add_edge(walk, from, EDGE_PROPERTY, intern(walk, name, strlen(name)), to);
+    }
+  }
+
+  JS_FreeCString(ctx, name);
+  JS_FreeValue(ctx, desc.value);
+  JS_FreeValue(ctx, desc.getter);
+  JS_FreeValue(ctx, desc.setter);
+}
+
+static int32_t intern(heap_walk_t* walk, const char* str, size_t size) {
+  cstr key = cstr_from_n(str, size);
+  const cmap_heap_string_value* found = cmap_heap_string_get(&walk->string_index, cstr_str(&key));
+  int32_t index;
+
+  if (found) {
+    cstr_drop(&key);
+    return found->second;
+  }
+
+  index = (int32_t) cvec_str_size(&walk->strings);
+  cmap_heap_string_emplace(&walk->string_index, cstr_str(&key), index);
+  cvec_str_push(&walk->strings, key);
+
+  return index;
+}
+
+static int32_t add_node(heap_walk_t* walk, JSValueConst value, int32_t type, int32_t name, size_t self_size) {
+  int32_t index = (int32_t) cvec_heap_node_size(&walk->nodes);
+
+  cvec_heap_node_push(&walk->nodes, (heap_node_t) {
+    .value = JS_DupValue(walk->ctx, value),
+    .type = type,
+    .name = name,
+    .self_size = self_size,
+    .edge_count = 0,
+  });
+
+  if (JS_VALUE_HAS_REF_COUNT(value)) {
+    cmap_heap_seen_insert(&walk->seen, (uintptr_t) JS_VALUE_GET_PTR(value), index);
+  }
+
+  return index;
+}
+
+static int32_t node_for(heap_walk_t* walk, JSValueConst value) {
+  JSContext* ctx = walk->ctx;
+  const cmap_heap_seen_value* seen;
+  cstr name;
+  int32_t type;
+  int32_t index;
+
+  if (!JS_IsObject(value) && !JS_IsString(value)) {
+    return -1;
+  }
+
+  seen = cmap_heap_seen_get(&walk->seen, (uintptr_t) JS_VALUE_GET_PTR(value));
+  if (seen) {
+    return seen->second;
+  }
+
+  if (JS_IsString(value)) {
+    size_t size;
+    const char* str = JS_ToCStringLen(ctx, &size, value);
+
+    if (!str) {
+      JS_FreeValue(ctx, JS_GetException(ctx));
+      return -1;
+    }
+
+    index = add_node(walk, value, NODE_STRING, intern(walk, str, size < HEAP_STRING_PREVIEW ? size : HEAP_STRING_PREVIEW),
+        HEAP_STRING_HEADER_SIZE + size);
+    JS_FreeCString(ctx, str);
+
+    return index;
+  }
+
+  name = cstr_init();
+
+  if (JS_IsFunction(ctx, value)) {
+    type = NODE_CLOSURE;
+    if (!own_string(ctx, value, "name", &name) || cstr_is_empty(&name)) {
+      cstr_assign(&name, "(anonymous)");
+    }
+  } else {
+    JSValue proto = JS_GetPrototype(ctx, value);
+    JSPropertyDescriptor desc;
+    JSAtom atom;
+    int found = 0;
+
+    type = JS_IsArray(ctx, value) > 0 ? NODE_ARRAY : NODE_OBJECT;
+
+    // instances are named after their constructor, as in DevTools
+    if (JS_IsObject(proto)) {
+      atom = JS_NewAtom(ctx, "constructor");
+      found = JS_GetOwnProperty(ctx, &desc, proto, atom);
+      JS_FreeAtom(ctx, atom);
+    }
+
+    if (found < 0) {
+      JS_FreeValue(ctx, JS_GetException(ctx));
+    } else if (found > 0) {
+      if (JS_IsFunction(ctx, desc.value)) {
+        own_string(ctx, desc.value, "name", &name);
+      }
+      JS_FreeValue(ctx, desc.value);
+      JS_FreeValue(ctx, desc.getter);
+      JS_FreeValue(ctx, desc.setter);
+    }
+
+    if (cstr_is_empty(&name)) {
+      cstr_assign(&name, type == NODE_ARRAY ? "Array" : "Object");
+    }
+  }
+
+  index = add_node(walk, value, type, intern(walk, cstr_str(&name), cstr_size(&name)), walk->object_size);
+  cstr_drop(&name);
+
+  return index;
+}
+
+static void add_edge(heap_walk_t* walk, int32_t from, int32_t type, int32_t name_or_index, int32_t to) {
+  if (to < 0) {
+    return;
+  }
+
+  cvec_heap_edge_push(&walk->edges, (heap_edge_t) {
+    .type = type,
+    .name_or_index = name_or_index,
+    .to = to,
+  });
+  cvec_heap_node_at_mut(&walk->nodes, from)->edge_count++;
+}
+
+static bool own_string(JSContext* ctx, JSValueConst obj, const char* key, cstr* out) {
+  JSPropertyDescriptor desc;
+  JSAtom atom = JS_NewAtom(ctx, key);
+  int found = JS_GetOwnProperty(ctx, &desc, obj, atom);
+  bool ok = false;
+
+  JS_FreeAtom(ctx, atom);
+
+  if (found < 0) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    return false;
+  }
+
+  if (found == 0) {
+    return false;
+  }
+
+  if (JS_IsString(desc.value)) {
+    size_t size;
+    const char* str = JS_ToCStringLen(ctx, &size, desc.value);
+
+    if (str) {
+      cstr_assign_n(out, str, size);
+      JS_FreeCString(ctx, str);
+      ok = true;
+    }
+  }
+
+  JS_FreeValue(ctx, desc.value);
+  JS_FreeValue(ctx, desc.getter);
+  JS_FreeValue(ctx, desc.setter);
+
+  return ok;
+}
+
+static bool parse_index(const char* str, uint32_t* index) {
+  // canonical array indexes only: no sign, no leading zeros, below 2^31
+  uint64_t value = 0;
+
+  if (*str == '\0' || (*str == '0' && str[1] != '\0')) {
+    return false;
+  }
+
+  for (const char* p = str; *p; p++) {
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+
+    value = value * 10 + (uint64_t) (*p - '0');
+    if (value > INT32_MAX) {
+      return false;
+    }
+  }
+
+  *index = (uint32_t) value;
+
+  return true;
+}
+
+static void write_json(heap_walk_t* walk, cstr* out) {
+  size_t node_count = cvec_heap_node_size(&walk->nodes);
+  size_t edge_count = cvec_heap_edge_size(&walk->edges);
+
+  cstr_append(out, SNAPSHOT_META);
+  veil_json_append_fmt(out, "\"node_count\":%zu,\"edge_count\":%zu,\"trace_function_count\":0},\"nodes\":[", node_count, edge_count);
+
+  for (size_t n = 0; n < node_count; n++) {
+    const heap_node_t* node = cvec_heap_node_at(&walk->nodes, n);
+
+    // odd ids for heap objects, as V8 assigns them
+    veil_json_append_fmt(out, "%s%d,%d,%zu,%zu,%u,0", n ? "," : "", node->type, node->name, n * 2 + 1, node->self_size, node->edge_count);
+  }
+
+  cstr_append(out, "],\"edges\":[");
+
+  for (size_t n = 0; n < edge_count; n++) {
+    const heap_edge_t* edge = cvec_heap_edge_at(&walk->edges, n);
+
+    veil_json_append_fmt(out, "%s%d,%d,%d", n ? "," : "", edge->type, edge->name_or_index, edge->to * HEAP_NODE_FIELD_COUNT);
+  }
+
+  cstr_append(out, "],\"trace_function_infos\":[],\"trace_tree\":[],\"samples\":[],\"locations\":[],\"strings\":[");
+
+  for (size_t n = 0; n < cvec_str_size(&walk->strings); n++) {
+    const cstr* str = cvec_str_at(&walk->strings, n);
+
+    if (n) {
+      cstr_append(out, ",");
+    }
+    veil_json_append_string(out, cstr_str_safe(str), cstr_size(str));
+  }
+
+  cstr_append(out, "]}");
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <math.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// HDR-style log-linear buckets: values below 2^HISTOGRAM_SUB_BITS are counted
+// exactly and every power of two above that is split into 2^(SUB_BITS - 1)
+// equal sub-buckets, bounding the relative error of any reading to ~3%.
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT (HISTOGRAM_SUB_COUNT >> 1)
+
+static uint32_t msb64(uint64_t value);
+static uint32_t bucket_index(uint64_t value);
+static uint64_t bucket_upper(uint32_t index);
+
+void veil_histogram_init(veil_histogram_t* histogram) {
+  memset(histogram, 0, sizeof(veil_histogram_t));
+  histogram->min = UINT64_MAX;
+}
+
+void veil_histogram_record(veil_histogram_t* histogram, uint64_t value) {
+  histogram->buckets[bucket_index(value)]++;
+  histogram->count++;
+  histogram->sum += (double) value;
+  histogram->sum_sq += (double) value * (double) value;
+
+  if (value < histogram->min) {
+    histogram->min = value;
+  }
+
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+}
+
+uint64_t veil_histogram_percentile(const veil_histogram_t* histogram, double percentile) {
+  uint64_t target;
+  uint64_t seen = 0;
+
+  if (histogram->count == 0) {
+    return 0;
+  }
+
+  if (percentile <= 0) {
+    return histogram->min;
+  }
+
+  if (percentile >= 100) {
+    return histogram->max;
+  }
+
+  target = (uint64_t) ceil(percentile / 100 * (double) histogram->count);
+  if (target == 0) {
+    target = 1;
+  }
+
+  for (uint32_t n = 0; n < VEIL_HISTOGRAM_BUCKETS; n++) {
+    seen += histogram->buckets[n];
+
+    if (seen >= target) {
+      uint64_t value = bucket_upper(n);
+
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+double veil_histogram_mean(const veil_histogram_t* histogram) {
+  return histogram->count ? histogram->sum / (double) histogram->count : 0;
+}
+
+double veil_histogram_stddev(const veil_histogram_t* histogram) {
+  double mean;
+  double variance;
+
+  if (histogram->count == 0) {
+    return 0;
+  }
+
+  mean = veil_histogram_mean(histogram);
+  variance = histogram->sum_sq / (double) histogram->count - mean * mean;
+
+  return variance > 0 ? sqrt(variance) : 0;
+}
+
+static uint32_t msb64(uint64_t value) {
+#ifdef _MSC_VER
+  unsigned long index;
+
+  _BitScanReverse64(&index, value);
+
+  return index;
+#else
+  return 63 - __builtin_clzll(value);
+#endif
+}
+
+static uint32_t bucket_index(uint64_t value) {
+  uint32_t msb;
+  uint32_t shift;
+
+  if (value < HISTOGRAM_SUB_COUNT) {
+    return (uint32_t) value;
+  }
+
+  msb = msb64(value);
+  shift = msb - (HISTOGRAM_SUB_BITS - 1);
+
+  return HISTOGRAM_SUB_COUNT + (shift - 1) * HISTOGRAM_HALF_COUNT + (uint32_t) (value >> shift) - HISTOGRAM_HALF_COUNT;
+}
+
+static uint64_t bucket_upper(uint32_t index) {
+  uint32_t shift;
+  uint64_t mantissa;
+
+  if (index < HISTOGRAM_SUB_COUNT) {
+    return index;
+  }
+
+  shift = (index - HISTOGRAM_SUB_COUNT) / HISTOGRAM_HALF_COUNT + 1;
+  mantissa = (index - HISTOGRAM_SUB_COUNT) % HISTOGRAM_HALF_COUNT + HISTOGRAM_HALF_COUNT;
+
+  return ((mantissa + 1) << shift) - 1;
+}
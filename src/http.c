@@ -0,0 +1,2340 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+// Requests are parsed in C as they arrive. The head is gathered into one
+// buffer up to its blank line and split into offsets in a single pass; the
+// body is framed by Content-Length or chunked encoding straight out of the
+// read slab. An IncomingMessage keeps the head buffer and only creates JS
+// strings for what the handler reads, and getHeader() finds one field
+// without building the headers object at all.
+//
+// A connection answers pipelined requests in order: a response that is not
+// at the front of the queue holds its output until the ones before it have
+// finished. Everything produced while a read is being parsed goes out in a
+// single uv_write once the parse is done.
+//
+// A request body flows once it has a 'data' listener or resume() is called.
+// Until then the connection holds the unparsed bytes and stops reading, and
+// a body still unread when its response finishes is discarded.
+
+#define HTTP_MAX_HEAD (16 * 1024)
+#define HTTP_MAX_HEADERS 100
+// unanswered pipelined requests before the connection stops reading
+#define HTTP_MAX_PIPELINE 32
+#define HTTP_KEEP_ALIVE_TIMEOUT 5000
+#define HTTP_HIGH_WATER_MARK (16 * 1024)
+#define HTTP_STACK_BUFS 32
+
+enum {
+  HTTP_HEAD,
+  HTTP_BODY,
+  HTTP_CHUNK_SIZE,
+  HTTP_CHUNK_EXT,
+  HTTP_CHUNK_DATA,
+  HTTP_CHUNK_END,
+  HTTP_TRAILER,
+  // nothing more is read: after an error or a request that closes
+  HTTP_DONE,
+};
+
+typedef struct http_conn_s http_conn_t;
+typedef struct http_server_s http_server_t;
+typedef struct http_response_s http_response_t;
+
+typedef struct http_chunk_s {
+  uv_buf_t buf;
+  // the buffer that buf points into
+  JSValue keep;
+  // malloc'd memory that buf points into
+  char* owned;
+} http_chunk_t;
+
+typedef struct http_output_s {
+  http_chunk_t* chunks;
+  uint32_t count;
+  uint32_t capacity;
+  size_t size;
+} http_output_t;
+
+typedef struct http_write_s {
+  uv_write_t req;
+  http_conn_t* conn;
+  http_output_t output;
+} http_write_t;
+
+// offsets into the request's head buffer
+typedef struct http_field_s {
+  uint32_t name;
+  uint32_t name_size;
+  uint32_t value;
+  uint32_t value_size;
+} http_field_t;
+
+typedef struct http_request_s {
+  char* head;
+  size_t head_size;
+  // the method starts the head
+  uint32_t method_size;
+  uint32_t url;
+  uint32_t url_size;
+  int version_minor;
+  http_field_t* fields;
+  uint32_t field_count;
+  // reading this request's body, NULL once the body has ended
+  http_conn_t* conn;
+  bool flowing;
+} http_request_t;
+
+typedef struct http_head_info_s {
+  int64_t content_length;
+  bool chunked;
+  bool keep_alive;
+} http_head_info_t;
+
+typedef struct http_header_s {
+  cstr name;
+  cstr value;
+} http_header_t;
+
+struct http_response_s {
+  // NULL once finished, or after the connection has closed
+  http_conn_t* conn;
+  http_response_t* next;
+  // held while queued on the connection
+  JSValue object;
+  int status;
+  cstr status_message;
+  http_header_t* headers;
+  uint32_t header_count;
+  uint32_t header_capacity;
+  // output held back behind earlier pipelined responses
+  http_output_t held;
+  int version_minor;
+  bool head_request;
+  bool keep_alive;
+  bool headers_sent;
+  bool chunked;
+  bool no_body;
+  bool finished;
+  bool need_drain;
+};
+
+struct http_conn_s {
+  uv_tcp_t tcp;
+  uv_timer_t timer;
+  veil_cleanup_t cleanup;
+  veil_vm_t* vm;
+  http_server_t* server;
+  // keeps the server alive while it has connections
+  JSValue server_object;
+  http_conn_t* prev;
+  http_conn_t* next;
+
+  int state;
+  char* head;
+  size_t head_size;
+  size_t head_capacity;
+  // the line being scanned, to spot the blank one that ends the head
+  size_t line_chars;
+  char line_first;
+  // body bytes left, or bytes left in the current chunk
+  uint64_t remaining;
+  uint32_t chunk_digits;
+  // IncomingMessage receiving 'data' and 'end'
+  JSValue body_target;
+  // the request being read closes the connection
+  bool last_request;
+  // sent once the responses before it are out
+  int error_status;
+
+  http_response_t* queue_head;
+  http_response_t* queue_tail;
+  uint32_t queue_count;
+
+  // output not yet handed to uv_write
+  http_output_t pending;
+  // pending plus in flight
+  size_t writable_length;
+  // bytes read while the pipeline was full
+  char* stash;
+  size_t stash_size;
+
+  bool parsing;
+  bool stalled;
+  bool close_when_done;
+  bool shutdown_sent;
+  bool closing;
+  // set by the VM cleanup: no more events, only native teardown remains
+  bool released;
+  int closed_handles;
+  uv_shutdown_t shutdown;
+};
+
+struct http_server_s {
+  uv_tcp_t tcp;
+  veil_cleanup_t cleanup;
+  veil_vm_t* vm;
+  JSValue object;
+  http_conn_t* connections;
+  uint64_t keep_alive_timeout;
+  time_t date_time;
+  char date[48];
+  bool open;
+  bool closing;
+  bool released;
+};
+
+static const struct {
+  int code;
+  const char* reason;
+} STATUS_CODES[] = {
+  { 100, "Continue" },
+  { 101, "Switching Protocols" },
+  { 200, "OK" },
+  { 201, "Created" },
+  { 202, "Accepted" },
+  { 203, "Non-Authoritative Information" },
+  { 204, "No Content" },
+  { 205, "Reset Content" },
+  { 206, "Partial Content" },
+  { 300, "Multiple Choices" },
+  { 301, "Moved Permanently" },
+  { 302, "Found" },
+  { 303, "See Other" },
+  { 304, "Not Modified" },
+  { 307, "Temporary Redirect" },
+  { 308, "Permanent Redirect" },
+  { 400, "Bad Request" },
+  { 401, "Unauthorized" },
+  { 403, "Forbidden" },
+  { 404, "Not Found" },
+  { 405, "Method Not Allowed" },
+  { 406, "Not Acceptable" },
+  { 408, "Request Timeout" },
+  { 409, "Conflict" },
+  { 410, "Gone" },
+  { 411, "Length Required" },
+  { 412, "Precondition Failed" },
+  { 413, "Payload Too Large" },
+  { 414, "URI Too Long" },
+  { 415, "Unsupported Media Type" },
+  { 416, "Range Not Satisfiable" },
+  { 417, "Expectation Failed" },
+  { 422, "Unprocessable Entity" },
+  { 426, "Upgrade Required" },
+  { 429, "Too Many Requests" },
+  { 431, "Request Header Fields Too Large" },
+  { 500, "Internal Server Error" },
+  { 501, "Not Implemented" },
+  { 502, "Bad Gateway" },
+  { 503, "Service Unavailable" },
+  { 504, "Gateway Timeout" },
+  { 505, "HTTP Version Not Supported" },
+};
+
+static JSClassID server_class_id;
+static JSClassID request_class_id;
+static JSClassID response_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static int http_module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue http_create_server(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static JSValue server_listen(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue server_close(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue server_address(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue server_listening(JSContext* ctx, JSValueConst this_val);
+static void server_finalizer(JSRuntime* rt, JSValue val);
+static void connection_cb(uv_stream_t* stream, int status);
+static void server_close_cb(uv_handle_t* handle);
+static void server_cleanup_cb(veil_cleanup_t* cleanup);
+static JSValue emit_listening(JSContext* ctx, int argc, JSValueConst* argv);
+static const char* server_date(http_server_t* server);
+
+static JSValue request_get(JSContext* ctx, JSValueConst this_val, int magic);
+static JSValue request_get_header(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue request_on(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue request_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static void request_set_flowing(JSContext* ctx, JSValueConst obj, http_request_t* request, bool flowing);
+static JSValue resume_body(JSContext* ctx, int argc, JSValueConst* argv);
+static JSValue emit_end(JSContext* ctx, int argc, JSValueConst* argv);
+static void request_finalizer(JSRuntime* rt, JSValue val);
+static JSValue request_field_value(JSContext* ctx, http_request_t* request, uint32_t index);
+
+static JSValue response_get(JSContext* ctx, JSValueConst this_val, int magic);
+static JSValue response_set(JSContext* ctx, JSValueConst this_val, JSValueConst value, int magic);
+static JSValue response_set_header(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue response_get_header(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue response_write_head(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue response_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue response_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static void response_finalizer(JSRuntime* rt, JSValue val);
+static bool response_add_header(JSContext* ctx, http_response_t* res, JSValueConst name, JSValueConst value);
+static int32_t response_find_header(http_response_t* res, const char* name, size_t size);
+static void response_remove_header(http_response_t* res, const char* name, size_t size);
+static bool response_body_chunk(JSContext* ctx, JSValueConst value, http_chunk_t* chunk);
+static void response_send_head(JSContext* ctx, http_response_t* res, int64_t content_length);
+static void response_output(JSContext* ctx, http_response_t* res, http_chunk_t chunk);
+
+static void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+static void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+static void conn_feed(http_conn_t* conn, const char* data, size_t size);
+static size_t conn_parse(http_conn_t* conn, const char* data, size_t size);
+static size_t scan_head(http_conn_t* conn, const char* data, size_t size, bool* complete);
+static void on_head(http_conn_t* conn);
+static int parse_head(http_request_t* request, http_head_info_t* info);
+static http_request_t* body_request(http_conn_t* conn);
+static void emit_body(http_conn_t* conn, const char* data, size_t size);
+static void finish_body(http_conn_t* conn, const char* event);
+static void conn_fail(http_conn_t* conn, int status);
+static void conn_send_error(http_conn_t* conn);
+static void conn_advance(http_conn_t* conn);
+static void conn_resume(http_conn_t* conn);
+static void conn_idle(http_conn_t* conn);
+static void conn_flush(http_conn_t* conn);
+static void conn_close(http_conn_t* conn);
+static void write_cb(uv_write_t* req, int status);
+static void shutdown_cb(uv_shutdown_t* req, int status);
+static void timer_cb(uv_timer_t* timer);
+static void conn_close_cb(uv_handle_t* handle);
+static void conn_cleanup_cb(veil_cleanup_t* cleanup);
+
+static void output_push(http_output_t* output, http_chunk_t chunk);
+static void output_move(http_output_t* to, http_output_t* from);
+static void output_release(JSRuntime* rt, http_output_t* output);
+static http_chunk_t owned_chunk(const char* data, size_t size);
+static http_chunk_t static_chunk(const char* str);
+static const char* status_reason(int status);
+static bool is_token(char c);
+static bool equals_lower(const char* str, size_t size, const char* lower);
+static bool equals_ignore_case(const char* a, const char* b, size_t size);
+static bool has_token(const char* str, size_t size, const char* token);
+
+enum {
+  REQUEST_METHOD,
+  REQUEST_URL,
+  REQUEST_HTTP_VERSION,
+  REQUEST_HEADERS,
+  REQUEST_RAW_HEADERS,
+};
+
+enum {
+  RESPONSE_STATUS_CODE,
+  RESPONSE_STATUS_MESSAGE,
+  RESPONSE_HEADERS_SENT,
+  RESPONSE_WRITABLE_ENDED,
+  RESPONSE_WRITABLE_LENGTH,
+};
+
+enum {
+  HEADER_GET,
+  HEADER_HAS,
+  HEADER_REMOVE,
+};
+
+static const JSClassDef SERVER_CLASS = {
+  "Server",
+  .finalizer = server_finalizer,
+};
+
+static const JSClassDef REQUEST_CLASS = {
+  "IncomingMessage",
+  .finalizer = request_finalizer,
+};
+
+static const JSClassDef RESPONSE_CLASS = {
+  "ServerResponse",
+  .finalizer = response_finalizer,
+};
+
+static const JSCFunctionListEntry SERVER_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("listen", 3, server_listen),
+  JS_CFUNC_DEF("close", 1, server_close),
+  JS_CFUNC_DEF("address", 0, server_address),
+  JS_CGETSET_DEF("listening", server_listening, NULL),
+};
+
+static const JSCFunctionListEntry REQUEST_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, request_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("getHeader", 1, request_get_header),
+  JS_CFUNC_MAGIC_DEF("pause", 0, request_pause, true),
+  JS_CFUNC_MAGIC_DEF("resume", 0, request_pause, false),
+  JS_CGETSET_MAGIC_DEF("method", request_get, NULL, REQUEST_METHOD),
+  JS_CGETSET_MAGIC_DEF("url", request_get, NULL, REQUEST_URL),
+  JS_CGETSET_MAGIC_DEF("httpVersion", request_get, NULL, REQUEST_HTTP_VERSION),
+  JS_CGETSET_MAGIC_DEF("headers", request_get, NULL, REQUEST_HEADERS),
+  JS_CGETSET_MAGIC_DEF("rawHeaders", request_get, NULL, REQUEST_RAW_HEADERS),
+};
+
+static const JSCFunctionListEntry RESPONSE_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("setHeader", 2, response_set_header),
+  JS_CFUNC_MAGIC_DEF("getHeader", 1, response_get_header, HEADER_GET),
+  JS_CFUNC_MAGIC_DEF("hasHeader", 1, response_get_header, HEADER_HAS),
+  JS_CFUNC_MAGIC_DEF("removeHeader", 1, response_get_header, HEADER_REMOVE),
+  JS_CFUNC_DEF("writeHead", 3, response_write_head),
+  JS_CFUNC_DEF("write", 2, response_write),
+  JS_CFUNC_DEF("end", 2, response_end),
+  JS_CGETSET_MAGIC_DEF("statusCode", response_get, response_set, RESPONSE_STATUS_CODE),
+  JS_CGETSET_MAGIC_DEF("statusMessage", response_get, response_set, RESPONSE_STATUS_MESSAGE),
+  JS_CGETSET_MAGIC_DEF("headersSent", response_get, NULL, RESPONSE_HEADERS_SENT),
+  JS_CGETSET_MAGIC_DEF("writableEnded", response_get, NULL, RESPONSE_WRITABLE_ENDED),
+  JS_CGETSET_MAGIC_DEF("writableLength", response_get, NULL, RESPONSE_WRITABLE_LENGTH),
+};
+
+static const JSCFunctionListEntry HTTP[] = {
+  JS_CFUNC_DEF("createServer", 2, http_create_server),
+};
+
+JSModuleDef* veil_http_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, http_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, HTTP, countof(HTTP));
+    JS_AddModuleExport(ctx, m, "STATUS_CODES");
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+static void global_init() {
+  JS_NewClassID(&server_class_id);
+  JS_NewClassID(&request_class_id);
+  JS_NewClassID(&response_class_id);
+}
+
+static int http_module_init(JSContext* ctx, JSModuleDef* m) {
+  JSRuntime* rt = JS_GetRuntime(ctx);
+  JSValue proto;
+  JSValue codes;
+  JSValue http;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, server_class_id)) {
+    JS_NewClass(rt, server_class_id, &SERVER_CLASS);
+    JS_NewClass(rt, request_class_id, &REQUEST_CLASS);
+    JS_NewClass(rt, response_class_id, &RESPONSE_CLASS);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, SERVER_PROTO, countof(SERVER_PROTO));
+  JS_SetClassProto(ctx, server_class_id, proto);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, REQUEST_PROTO, countof(REQUEST_PROTO));
+  JS_SetClassProto(ctx, request_class_id, proto);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, RESPONSE_PROTO, countof(RESPONSE_PROTO));
+  JS_SetClassProto(ctx, response_class_id, proto);
+
+  codes = JS_NewObject(ctx);
+  for (size_t n = 0; n < countof(STATUS_CODES); n++) {
+    JS_SetPropertyUint32(ctx, codes, STATUS_CODES[n].code, JS_NewString(ctx, STATUS_CODES[n].reason));
+  }
+
+  http = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, http, HTTP, countof(HTTP));
+  JS_SetPropertyStr(ctx, http, "STATUS_CODES", JS_DupValue(ctx, codes));
+
+  JS_SetModuleExportList(ctx, m, HTTP, countof(HTTP));
+  JS_SetModuleExport(ctx, m, "STATUS_CODES", codes);
+  JS_SetModuleExport(ctx, m, "default", http);
+
+  return 0;
+}
+
+static JSValue http_create_server(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  http_server_t* server;
+  JSValue value;
+  JSValue obj;
+  int64_t timeout = HTTP_KEEP_ALIVE_TIMEOUT;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "http requires an event loop");
+  }
+
+  // createServer([options][, requestListener])
+  if (argc > 0 && JS_IsObject(argv[0]) && !JS_IsFunction(ctx, argv[0])) {
+    value = JS_GetPropertyStr(ctx, argv[0], "keepAliveTimeout");
+    if (!JS_IsUndefined(value) && JS_ToInt64(ctx, &timeout, value) < 0) {
+      JS_FreeValue(ctx, value);
+      return JS_EXCEPTION;
+    }
+    JS_FreeValue(ctx, value);
+  }
+
+  obj = JS_NewObjectClass(ctx, server_class_id);
+  if (JS_IsException(obj)) {
+    return obj;
+  }
+
+  server = calloc(1, sizeof(http_server_t));
+  CHECK_NOT_NULL(server);
+  server->vm = vm;
+  server->object = JS_UNDEFINED;
+  server->keep_alive_timeout = timeout > 0 ? (uint64_t) timeout : 0;
+  JS_SetOpaque(obj, server);
+
+  for (int n = 0; n < argc && n < 2; n++) {
+    if (JS_IsFunction(ctx, argv[n])) {
+      veil_emitter_on(ctx, obj, "request", argv[n]);
+      break;
+    }
+  }
+
+  return obj;
+}
+
+static JSValue server_listen(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+  veil_net_listen_t listen;
+  int err;
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  if (server->open) {
+    return JS_ThrowTypeError(ctx, "server is already listening");
+  }
+
+  if (!veil_net_parse_listen(ctx, argc, argv, &listen)) {
+    return JS_EXCEPTION;
+  }
+
+  err = uv_tcp_init_ex(&server->vm->uv->loop, &server->tcp, listen.addr.ss_family);
+  if (err) {
+    return JS_Throw(ctx, veil_builtin_new_uv_error(ctx, err, "listen", NULL));
+  }
+  server->tcp.data = server;
+  server->open = true;
+  server->object = JS_DupValue(ctx, this_val);
+  veil_vm_add_cleanup(server->vm, &server->cleanup, server_cleanup_cb);
+
+  err = veil_net_listen(&server->tcp, &listen, connection_cb);
+  if (err) {
+    server->closing = true;
+    veil_vm_remove_cleanup(&server->cleanup);
+    uv_close((uv_handle_t*) &server->tcp, server_close_cb);
+    return JS_Throw(ctx, veil_builtin_new_uv_error(ctx, err, "listen", NULL));
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    veil_emitter_on(ctx, this_val, "listening", argv[argc - 1]);
+  }
+
+  JS_EnqueueJob(ctx, emit_listening, 1, &this_val);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue server_close(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+  http_conn_t* conn;
+  http_conn_t* next;
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[0])) {
+    veil_emitter_on(ctx, this_val, "close", argv[0]);
+  }
+
+  if (!server->open || server->closing) {
+    return JS_DupValue(ctx, this_val);
+  }
+
+  server->closing = true;
+  veil_vm_remove_cleanup(&server->cleanup);
+  uv_close((uv_handle_t*) &server->tcp, server_close_cb);
+
+  // idle keep-alive connections go now, busy ones after their last response
+  for (conn = server->connections; conn; conn = next) {
+    next = conn->next;
+    conn->close_when_done = true;
+    if (!conn->queue_head && conn->head_size == 0 && conn->state == HTTP_HEAD) {
+      conn_close(conn);
+    }
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue server_address(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+  struct sockaddr_storage addr;
+  int size = sizeof(addr);
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  if (!server->open || server->closing
+      || uv_tcp_getsockname(&server->tcp, (struct sockaddr*) &addr, &size) != 0) {
+    return JS_NULL;
+  }
+
+  return veil_net_new_address(ctx, &addr);
+}
+
+static JSValue server_listening(JSContext* ctx, JSValueConst this_val) {
+  http_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  return JS_NewBool(ctx, server->open && !server->closing);
+}
+
+static void server_finalizer(JSRuntime* rt, JSValue val) {
+  free(JS_GetOpaque(val, server_class_id));
+}
+
+static void connection_cb(uv_stream_t* stream, int status) {
+  http_server_t* server = stream->data;
+  JSContext* ctx = server->vm->context;
+  http_conn_t* conn;
+  JSValue error;
+  int err = status;
+
+  if (!err) {
+    conn = calloc(1, sizeof(http_conn_t));
+    CHECK_NOT_NULL(conn);
+    conn->vm = server->vm;
+    conn->server = server;
+    conn->body_target = JS_UNDEFINED;
+    CHECK_OK(uv_tcp_init(&server->vm->uv->loop, &conn->tcp));
+    CHECK_OK(uv_timer_init(&server->vm->uv->loop, &conn->timer));
+    conn->tcp.data = conn;
+    conn->timer.data = conn;
+
+    err = uv_accept(stream, (uv_stream_t*) &conn->tcp);
+    if (!err) {
+      err = uv_read_start((uv_stream_t*) &conn->tcp, alloc_cb, read_cb);
+    }
+    if (err) {
+      conn->closing = true;
+      conn->released = true;
+      conn->server_object = JS_UNDEFINED;
+      uv_close((uv_handle_t*) &conn->tcp, conn_close_cb);
+      uv_close((uv_handle_t*) &conn->timer, conn_close_cb);
+    } else {
+      conn->server_object = JS_DupValue(ctx, server->object);
+      conn->next = server->connections;
+      if (server->connections) {
+        server->connections->prev = conn;
+      }
+      server->connections = conn;
+      veil_vm_add_cleanup(conn->vm, &conn->cleanup, conn_cleanup_cb);
+      uv_tcp_nodelay(&conn->tcp, 1);
+      conn_idle(conn);
+      return;
+    }
+  }
+
+  error = veil_builtin_new_uv_error(ctx, err, "accept", NULL);
+  veil_emitter_emit(ctx, server->object, "error", 1, (JSValueConst*) &error);
+  JS_FreeValue(ctx, error);
+}
+
+static void server_close_cb(uv_handle_t* handle) {
+  http_server_t* server = handle->data;
+  JSContext* ctx = server->vm->context;
+  JSValue object = server->object;
+
+  server->open = false;
+  server->closing = false;
+  server->object = JS_UNDEFINED;
+
+  if (!server->released) {
+    veil_emitter_emit(ctx, object, "close", 0, NULL);
+  }
+
+  // the last reference can run the finalizer, which frees server
+  JS_FreeValue(ctx, object);
+}
+
+static void server_cleanup_cb(veil_cleanup_t* cleanup) {
+  http_server_t* server = container_of(cleanup, http_server_t, cleanup);
+
+  server->released = true;
+  server->closing = true;
+  uv_close((uv_handle_t*) &server->tcp, server_close_cb);
+}
+
+static JSValue emit_listening(JSContext* ctx, int argc, JSValueConst* argv) {
+  http_server_t* server = JS_GetOpaque(argv[0], server_class_id);
+
+  if (server && server->open && !server->closing) {
+    veil_emitter_emit(ctx, argv[0], "listening", 0, NULL);
+  }
+
+  return JS_UNDEFINED;
+}
+
+// formatted at most once a second
+static const char* server_date(http_server_t* server) {
+  time_t now = time(NULL);
+  struct tm tm;
+
+  if (now != server->date_time) {
+#ifdef _WIN32
+    gmtime_s(&tm, &now);
+#else
+    gmtime_r(&now, &tm);
+#endif
+    strftime(server->date, sizeof(server->date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    server->date_time = now;
+  }
+
+  return server->date;
+}
+
+static JSValue request_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  http_request_t* request = JS_GetOpaque2(ctx, this_val, request_class_id);
+  const char* name;
+  JSValue value;
+
+  if (!request) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case REQUEST_METHOD:
+      name = "method";
+      value = JS_NewStringLen(ctx, request->head, request->method_size);
+      break;
+    case REQUEST_URL:
+      name = "url";
+      value = JS_NewStringLen(ctx, request->head + request->url, request->url_size);
+      break;
+    case REQUEST_HTTP_VERSION:
+      name = "httpVersion";
+      value = JS_NewString(ctx, request->version_minor ? "1.1" : "1.0");
+      break;
+    case REQUEST_HEADERS: {
+      char lower[256];
+      JSAtom atom;
+
+      name = "headers";
+      value = JS_NewObject(ctx);
+
+      for (uint32_t n = 0; n < request->field_count; n++) {
+        const http_field_t* field = &request->fields[n];
+        uint32_t size = field->name_size < sizeof(lower) ? field->name_size : sizeof(lower);
+        JSValue existing;
+
+        for (uint32_t i = 0; i < size; i++) {
+          char c = request->head[field->name + i];
+          lower[i] = c >= 'A' && c <= 'Z' ? (char) (c + 32) : c;
+        }
+
+        // repeated fields join with ", " as in node, except set-cookie
+        atom = JS_NewAtomLen(ctx, lower, size);
+        existing = JS_GetProperty(ctx, value, atom);
+        if (JS_IsUndefined(existing)) {
+          JS_SetProperty(ctx, value, atom, request_field_value(ctx, request, n));
+        } else if (!JS_IsArray(ctx, existing)) {
+          const char* str = JS_ToCString(ctx, existing);
+          cstr joined = cstr_from(str ? str : "");
+
+          cstr_append(&joined, ", ");
+          cstr_append_n(&joined, request->head + field->value, field->value_size);
+          JS_SetProperty(ctx, value, atom, JS_NewStringLen(ctx, cstr_str(&joined), cstr_size(&joined)));
+          cstr_drop(&joined);
+          JS_FreeCString(ctx, str);
+        } else {
+          JSValue length = JS_GetPropertyStr(ctx, existing, "length");
+          uint32_t index = 0;
+
+          JS_ToUint32(ctx, &index, length);
+          JS_FreeValue(ctx, length);
+          JS_SetPropertyUint32(ctx, existing, index,
+              JS_NewStringLen(ctx, request->head + field->value, field->value_size));
+        }
+        JS_FreeValue(ctx, existing);
+        JS_FreeAtom(ctx, atom);
+      }
+      break;
+    }
+    case REQUEST_RAW_HEADERS:
+      name = "rawHeaders";
+      value = JS_NewArray(ctx);
+      for (uint32_t n = 0; n < request->field_count; n++) {
+        const http_field_t* field = &request->fields[n];
+
+        JS_SetPropertyUint32(ctx, value, n * 2, JS_NewStringLen(ctx, request->head + field->name, field->name_size));
+        JS_SetPropertyUint32(ctx, value, n * 2 + 1,
+            JS_NewStringLen(ctx, request->head + field->value, field->value_size));
+      }
+      break;
+    default:
+      return JS_UNDEFINED;
+  }
+
+  // later reads find the own property and skip the getter
+  JS_DefinePropertyValueStr(ctx, this_val, name, JS_DupValue(ctx, value), JS_PROP_C_W_E);
+
+  return value;
+}
+
+static JSValue request_get_header(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_request_t* request = JS_GetOpaque2(ctx, this_val, request_class_id);
+  JSValue result = JS_UNDEFINED;
+  const char* name;
+  size_t size;
+  cstr joined;
+  uint32_t found = 0;
+
+  if (!request) {
+    return JS_EXCEPTION;
+  }
+
+  name = JS_ToCStringLen(ctx, &size, argc > 0 ? argv[0] : JS_UNDEFINED);
+  if (!name) {
+    return JS_EXCEPTION;
+  }
+
+  joined = cstr_init();
+  for (uint32_t n = 0; n < request->field_count; n++) {
+    const http_field_t* field = &request->fields[n];
+
+    if (field->name_size != size || !equals_ignore_case(request->head + field->name, name, size)) {
+      continue;
+    }
+
+    if (found++ == 0) {
+      result = request_field_value(ctx, request, n);
+      cstr_assign_n(&joined, request->head + field->value, field->value_size);
+    } else {
+      cstr_append(&joined, ", ");
+      cstr_append_n(&joined, request->head + field->value, field->value_size);
+    }
+  }
+
+  if (found > 1) {
+    JS_FreeValue(ctx, result);
+    result = JS_NewStringLen(ctx, cstr_str(&joined), cstr_size(&joined));
+  }
+
+  cstr_drop(&joined);
+  JS_FreeCString(ctx, name);
+
+  return result;
+}
+
+static JSValue request_on(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_request_t* request = JS_GetOpaque(this_val, request_class_id);
+  JSValue result = veil_emitter_js_on(ctx, this_val, argc, argv);
+
+  if (request && !request->flowing && !JS_IsException(result) && veil_emitter_count(ctx, this_val, "data") > 0) {
+    request_set_flowing(ctx, this_val, request, true);
+  }
+
+  return result;
+}
+
+static JSValue request_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  http_request_t* request = JS_GetOpaque2(ctx, this_val, request_class_id);
+
+  if (!request) {
+    return JS_EXCEPTION;
+  }
+
+  request_set_flowing(ctx, this_val, request, !magic);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static void request_set_flowing(JSContext* ctx, JSValueConst obj, http_request_t* request, bool flowing) {
+  bool resumed = flowing && !request->flowing;
+
+  request->flowing = flowing;
+
+  // held bytes are parsed from a job, never from inside on() or resume()
+  if (resumed && request->conn && request->conn->stalled) {
+    JS_EnqueueJob(ctx, resume_body, 1, &obj);
+  }
+}
+
+static JSValue resume_body(JSContext* ctx, int argc, JSValueConst* argv) {
+  http_request_t* request = JS_GetOpaque(argv[0], request_class_id);
+  http_conn_t* conn = request ? request->conn : NULL;
+
+  if (conn && request->flowing && !conn->parsing) {
+    conn_resume(conn);
+    conn_flush(conn);
+    conn_idle(conn);
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue emit_end(JSContext* ctx, int argc, JSValueConst* argv) {
+  veil_emitter_emit(ctx, argv[0], "end", 0, NULL);
+
+  return JS_UNDEFINED;
+}
+
+static void request_finalizer(JSRuntime* rt, JSValue val) {
+  http_request_t* request = JS_GetOpaque(val, request_class_id);
+
+  if (request) {
+    free(request->head);
+    free(request->fields);
+    free(request);
+  }
+}
+
+static JSValue request_field_value(JSContext* ctx, http_request_t* request, uint32_t index) {
+  const http_field_t* field = &request->fields[index];
+  JSValue value = JS_NewStringLen(ctx, request->head + field->value, field->value_size);
+  JSValue list;
+
+  if (!equals_lower(request->head + field->name, field->name_size, "set-cookie")) {
+    return value;
+  }
+
+  list = JS_NewArray(ctx);
+  JS_SetPropertyUint32(ctx, list, 0, value);
+
+  return list;
+}
+
+static JSValue response_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  http_response_t* res = JS_GetOpaque2(ctx, this_val, response_class_id);
+
+  if (!res) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case RESPONSE_STATUS_CODE:
+      return JS_NewInt32(ctx, res->status);
+    case RESPONSE_STATUS_MESSAGE:
+      return cstr_is_empty(&res->status_message)
+          ? JS_NewString(ctx, status_reason(res->status))
+          : JS_NewStringLen(ctx, cstr_str(&res->status_message), cstr_size(&res->status_message));
+    case RESPONSE_HEADERS_SENT:
+      return JS_NewBool(ctx, res->headers_sent);
+    case RESPONSE_WRITABLE_ENDED:
+      return JS_NewBool(ctx, res->finished);
+    case RESPONSE_WRITABLE_LENGTH:
+      if (res->conn && res == res->conn->queue_head) {
+        return JS_NewInt64(ctx, (int64_t) res->conn->writable_length);
+      }
+      return JS_NewInt64(ctx, (int64_t) res->held.size);
+    default:
+      return JS_UNDEFINED;
+  }
+}
+
+static JSValue response_set(JSContext* ctx, JSValueConst this_val, JSValueConst value, int magic) {
+  http_response_t* res = JS_GetOpaque2(ctx, this_val, response_class_id);
+  const char* str;
+  int32_t status;
+
+  if (!res) {
+    return JS_EXCEPTION;
+  }
+
+  if (magic == RESPONSE_STATUS_CODE) {
+    if (JS_ToInt32(ctx, &status, value) < 0) {
+      return JS_EXCEPTION;
+    }
+    if (status < 100 || status > 999) {
+      return JS_ThrowRangeError(ctx, "invalid status code %d", status);
+    }
+    res->status = status;
+    return JS_UNDEFINED;
+  }
+
+  str = JS_ToCString(ctx, value);
+  if (!str) {
+    return JS_EXCEPTION;
+  }
+  cstr_assign(&res->status_message, str);
+  JS_FreeCString(ctx, str);
+
+  return JS_UNDEFINED;
+}
+
+static JSValue response_set_header(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_response_t* res = JS_GetOpaque2(ctx, this_val, response_class_id);
+  const char* name;
+  size_t size;
+
+  if (!res) {
+    return JS_EXCEPTION;
+  }
+
+  if (res->headers_sent) {
+    return JS_ThrowTypeError(ctx, "cannot set headers after they are sent");
+  }
+
+  name = JS_ToCStringLen(ctx, &size, argc > 0 ? argv[0] : JS_UNDEFINED);
+  if (!name) {
+    return JS_EXCEPTION;
+  }
+  response_remove_header(res, name, size);
+  JS_FreeCString(ctx, name);
+
+  if (!response_add_header(ctx, res, argv[0], argc > 1 ? argv[1] : JS_UNDEFINED)) {
+    return JS_EXCEPTION;
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue response_get_header(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  http_response_t* res = JS_GetOpaque2(ctx, this_val, response_class_id);
+  JSValue result = JS_UNDEFINED;
+  const char* name;
+  size_t size;
+  uint32_t count = 0;
+
+  if (!res) {
+    return JS_EXCEPTION;
+  }
+
+  name = JS_ToCStringLen(ctx, &size, argc > 0 ? argv[0] : JS_UNDEFINED);
+  if (!name) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case HEADER_HAS:
+      result = JS_NewBool(ctx, response_find_header(res, name, size) >= 0);
+      break;
+    case HEADER_REMOVE:
+      if (res->headers_sent) {
+        result = JS_ThrowTypeError(ctx, "cannot remove headers after they are sent");
+      } else {
+        response_remove_header(res, name, size);
+      }
+      break;
+    default:
+      // one value is a string, several an array
+      for (uint32_t n = 0; n < res->header_count; n++) {
+        const http_header_t* header = &res->headers[n];
+        JSValue value;
+
+        if (cstr_size(&header->name) != size || !equals_ignore_case(cstr_str(&header->name), name, size)) {
+          continue;
+        }
+
+        value = JS_NewStringLen(ctx, cstr_str(&header->value), cstr_size(&header->value));
+        if (count == 0) {
+          result = value;
+        } else {
+          if (count == 1) {
+            JSValue list = JS_NewArray(ctx);
+
+            JS_SetPropertyUint32(ctx, list, 0, result);
+            result = list;
+          }
+          JS_SetPropertyUint32(ctx, result, count, value);
+        }
+        count++;
+      }
+      break;
+  }
+
+  JS_FreeCString(ctx, name);
+
+  return result;
+}
+
+static JSValue response_write_head(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_response_t* res = JS_GetOpaque2(ctx, this_val, response_class_id);
+  JSValueConst headers = JS_UNDEFINED;
+  JSPropertyEnum* props;
+  uint32_t count;
+
+  if (!res) {
+    return JS_EXCEPTION;
+  }
+
+  if (res->headers_sent) {
+    return JS_ThrowTypeError(ctx, "cannot write headers after they are sent");
+  }
+
+  if (JS_IsException(response_set(ctx, this_val, argc > 0 ? argv[0] : JS_UNDEFINED, RESPONSE_STATUS_CODE))) {
+    return JS_EXCEPTION;
+  }
+
+  // writeHead(status[, statusMessage][, headers])
+  if (argc > 1 && JS_IsString(argv[1])) {
+    if (JS_IsException(response_set(ctx, this_val, argv[1], RESPONSE_STATUS_MESSAGE))) {
+      return JS_EXCEPTION;
+    }
+    headers = argc > 2 ? argv[2] : JS_UNDEFINED;
+  } else if (argc > 1) {
+    headers = argv[1];
+  }
+
+  if (!JS_IsObject(headers)) {
+    return JS_DupValue(ctx, this_val);
+  }
+
+  if (JS_GetOwnPropertyNames(ctx, &props, &count, headers, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+    return JS_EXCEPTION;
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    JSValue name = JS_AtomToString(ctx, props[n].atom);
+    JSValue value = JS_GetProperty(ctx, headers, props[n].atom);
+    size_t size;
+    const char* str = JS_ToCStringLen(ctx, &size, name);
+    bool ok = str != NULL;
+
+    if (ok) {
+      response_remove_header(res, str, size);
+      JS_FreeCString(ctx, str);
+      ok = response_add_header(ctx, res, name, value);
+    }
+    JS_FreeValue(ctx, name);
+    JS_FreeValue(ctx, value);
+
+    if (!ok) {
+      for (uint32_t i = 0; i < count; i++) {
+        JS_FreeAtom(ctx, props[i].atom);
+      }
+      js_free(ctx, props);
+      return JS_EXCEPTION;
+    }
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    JS_FreeAtom(ctx, props[n].atom);
+  }
+  js_free(ctx, props);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue response_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_response_t* res = JS_GetOpaque2(ctx, this_val, response_class_id);
+  http_chunk_t chunk;
+  char size_line[24];
+  size_t writable;
+
+  if (!res) {
+    return JS_EXCEPTION;
+  }
+
+  if (res->finished) {
+    return JS_ThrowTypeError(ctx, "write after end");
+  }
+
+  if (!response_body_chunk(ctx, argc > 0 ? argv[0] : JS_UNDEFINED, &chunk)) {
+    return JS_EXCEPTION;
+  }
+
+  // the length is not known up front: chunked for HTTP/1.1, else to close
+  if (!res->headers_sent) {
+    response_send_head(ctx, res, -1);
+  }
+
+  if (res->no_body || chunk.buf.len == 0) {
+    output_release(JS_GetRuntime(ctx), &(http_output_t) { &chunk, 1, 1, 0 });
+  } else if (res->chunked) {
+    response_output(ctx, res, owned_chunk(size_line, snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk.buf.len)));
+    response_output(ctx, res, chunk);
+    response_output(ctx, res, static_chunk("\r\n"));
+  } else {
+    response_output(ctx, res, chunk);
+  }
+
+  if (!res->conn) {
+    return JS_FALSE;
+  }
+
+  writable = res == res->conn->queue_head ? res->conn->writable_length : res->held.size;
+  if (writable >= HTTP_HIGH_WATER_MARK) {
+    res->need_drain = true;
+    return JS_FALSE;
+  }
+
+  return JS_TRUE;
+}
+
+static JSValue response_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  http_response_t* res = JS_GetOpaque2(ctx, this_val, response_class_id);
+  http_conn_t* conn;
+  http_chunk_t chunk = { uv_buf_init(NULL, 0), JS_UNDEFINED, NULL };
+  char size_line[24];
+
+  if (!res) {
+    return JS_EXCEPTION;
+  }
+
+  if (res->finished) {
+    return JS_DupValue(ctx, this_val);
+  }
+
+  // end([data][, encoding][, callback])
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    veil_emitter_on(ctx, this_val, "finish", argv[--argc]);
+  }
+
+  if (argc > 0 && !JS_IsUndefined(argv[0]) && !JS_IsNull(argv[0])
+      && !response_body_chunk(ctx, argv[0], &chunk)) {
+    return JS_EXCEPTION;
+  }
+
+  // a response that never called write() knows its length: head and body go
+  // out together in the same writev
+  if (!res->headers_sent) {
+    response_send_head(ctx, res, (int64_t) chunk.buf.len);
+  }
+
+  if (res->no_body || chunk.buf.len == 0) {
+    output_release(JS_GetRuntime(ctx), &(http_output_t) { &chunk, 1, 1, 0 });
+  } else if (res->chunked) {
+    response_output(ctx, res, owned_chunk(size_line, snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk.buf.len)));
+    response_output(ctx, res, chunk);
+    response_output(ctx, res, static_chunk("\r\n"));
+  } else {
+    response_output(ctx, res, chunk);
+  }
+
+  if (res->chunked && !res->no_body) {
+    response_output(ctx, res, static_chunk("0\r\n\r\n"));
+  }
+
+  res->finished = true;
+  veil_emitter_emit(ctx, this_val, "finish", 0, NULL);
+
+  conn = res->conn;
+  if (conn && res == conn->queue_head) {
+    conn_advance(conn);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static void response_finalizer(JSRuntime* rt, JSValue val) {
+  http_response_t* res = JS_GetOpaque(val, response_class_id);
+
+  if (!res) {
+    return;
+  }
+
+  for (uint32_t n = 0; n < res->header_count; n++) {
+    cstr_drop(&res->headers[n].name);
+    cstr_drop(&res->headers[n].value);
+  }
+  free(res->headers);
+  cstr_drop(&res->status_message);
+  output_release(rt, &res->held);
+  free(res->held.chunks);
+  free(res);
+}
+
+static bool response_add_header(JSContext* ctx, http_response_t* res, JSValueConst name, JSValueConst value) {
+  const char* name_str;
+  const char* value_str;
+  size_t name_size;
+  size_t value_size;
+  uint32_t length = 1;
+  bool list = JS_IsArray(ctx, value);
+
+  if (list) {
+    JSValue prop = JS_GetPropertyStr(ctx, value, "length");
+
+    if (JS_ToUint32(ctx, &length, prop) < 0) {
+      JS_FreeValue(ctx, prop);
+      return false;
+    }
+    JS_FreeValue(ctx, prop);
+  }
+
+  name_str = JS_ToCStringLen(ctx, &name_size, name);
+  if (!name_str) {
+    return false;
+  }
+
+  for (size_t n = 0; n < name_size; n++) {
+    if (!is_token(name_str[n])) {
+      JS_ThrowTypeError(ctx, "invalid header name '%s'", name_str);
+      JS_FreeCString(ctx, name_str);
+      return false;
+    }
+  }
+
+  // an array sets the field once per element, as Set-Cookie needs
+  for (uint32_t n = 0; n < length; n++) {
+    JSValue item = list ? JS_GetPropertyUint32(ctx, value, n) : JS_DupValue(ctx, value);
+    http_header_t* header;
+
+    value_str = JS_ToCStringLen(ctx, &value_size, item);
+    JS_FreeValue(ctx, item);
+    if (!value_str) {
+      JS_FreeCString(ctx, name_str);
+      return false;
+    }
+
+    // CR or LF would let a value inject headers of its own
+    if (memchr(value_str, '\r', value_size) || memchr(value_str, '\n', value_size)) {
+      JS_ThrowTypeError(ctx, "invalid character in header '%s'", name_str);
+      JS_FreeCString(ctx, value_str);
+      JS_FreeCString(ctx, name_str);
+      return false;
+    }
+
+    if (res->header_count == res->header_capacity) {
+      res->header_capacity = res->header_capacity ? res->header_capacity * 2 : 8;
+      res->headers = realloc(res->headers, res->header_capacity * sizeof(http_header_t));
+      CHECK_NOT_NULL(res->headers);
+    }
+    header = &res->headers[res->header_count++];
+    header->name = cstr_from_n(name_str, name_size);
+    header->value = cstr_from_n(value_str, value_size);
+    JS_FreeCString(ctx, value_str);
+  }
+
+  JS_FreeCString(ctx, name_str);
+
+  return true;
+}
+
+static int32_t response_find_header(http_response_t* res, const char* name, size_t size) {
+  for (uint32_t n = 0; n < res->header_count; n++) {
+    const http_header_t* header = &res->headers[n];
+
+    if (cstr_size(&header->name) == size && equals_ignore_case(cstr_str(&header->name), name, size)) {
+      return (int32_t) n;
+    }
+  }
+
+  return -1;
+}
+
+static void response_remove_header(http_response_t* res, const char* name, size_t size) {
+  uint32_t count = 0;
+
+  for (uint32_t n = 0; n < res->header_count; n++) {
+    http_header_t* header = &res->headers[n];
+
+    if (cstr_size(&header->name) == size && equals_ignore_case(cstr_str(&header->name), name, size)) {
+      cstr_drop(&header->name);
+      cstr_drop(&header->value);
+    } else {
+      res->headers[count++] = *header;
+    }
+  }
+  res->header_count = count;
+}
+
+static bool response_body_chunk(JSContext* ctx, JSValueConst value, http_chunk_t* chunk) {
+  const char* str;
+  uint8_t* data;
+  size_t size;
+
+  chunk->keep = JS_UNDEFINED;
+  chunk->owned = NULL;
+
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    chunk->buf = uv_buf_init(NULL, 0);
+    return true;
+  }
+
+  // strings are copied out so that no context is needed to release them
+  if (JS_IsString(value)) {
+    str = JS_ToCStringLen(ctx, &size, value);
+    if (!str) {
+      return false;
+    }
+    *chunk = owned_chunk(str, size);
+    JS_FreeCString(ctx, str);
+    return true;
+  }
+
+  if (!veil_builtin_get_bytes(ctx, value, &data, &size)) {
+    return false;
+  }
+  chunk->buf = uv_buf_init((char*) data, size);
+  chunk->keep = JS_DupValue(ctx, value);
+
+  return true;
+}
+
+static void response_send_head(JSContext* ctx, http_response_t* res, int64_t content_length) {
+  static const char* const FRAMING[] = { "content-length", "transfer-encoding" };
+  char number[32];
+  int32_t index;
+  bool framed = false;
+  cstr head;
+
+  res->headers_sent = true;
+  res->no_body = res->status == 204 || res->status == 304 || res->status < 200;
+
+  head = cstr_init();
+  cstr_append(&head, "HTTP/1.1 ");
+  cstr_append_n(&head, number, snprintf(number, sizeof(number), "%d ", res->status));
+  cstr_append(&head, cstr_is_empty(&res->status_message) ? status_reason(res->status) : cstr_str(&res->status_message));
+  cstr_append(&head, "\r\n");
+
+  for (uint32_t n = 0; n < res->header_count; n++) {
+    cstr_append_n(&head, cstr_str(&res->headers[n].name), cstr_size(&res->headers[n].name));
+    cstr_append(&head, ": ");
+    cstr_append_n(&head, cstr_str(&res->headers[n].value), cstr_size(&res->headers[n].value));
+    cstr_append(&head, "\r\n");
+  }
+
+  for (size_t n = 0; n < countof(FRAMING); n++) {
+    index = response_find_header(res, FRAMING[n], strlen(FRAMING[n]));
+    if (index >= 0) {
+      framed = true;
+      if (n == 1 && has_token(cstr_str(&res->headers[index].value), cstr_size(&res->headers[index].value), "chunked")) {
+        res->chunked = true;
+      }
+    }
+  }
+
+  index = response_find_header(res, "connection", 10);
+  if (index >= 0 && has_token(cstr_str(&res->headers[index].value), cstr_size(&res->headers[index].value), "close")) {
+    res->keep_alive = false;
+  }
+
+  if (!framed && !res->no_body) {
+    if (content_length >= 0) {
+      cstr_append(&head, "Content-Length: ");
+      cstr_append_n(&head, number, snprintf(number, sizeof(number), "%" PRId64, content_length));
+      cstr_append(&head, "\r\n");
+    } else if (res->version_minor >= 1) {
+      cstr_append(&head, "Transfer-Encoding: chunked\r\n");
+      res->chunked = true;
+    } else {
+      // an HTTP/1.0 body of unknown length ends when the connection does
+      res->keep_alive = false;
+    }
+  }
+
+  if (response_find_header(res, "date", 4) < 0 && res->conn) {
+    cstr_append(&head, "Date: ");
+    cstr_append(&head, server_date(res->conn->server));
+    cstr_append(&head, "\r\n");
+  }
+
+  if (index < 0) {
+    if (!res->keep_alive) {
+      cstr_append(&head, "Connection: close\r\n");
+    } else if (res->version_minor == 0) {
+      cstr_append(&head, "Connection: keep-alive\r\n");
+    }
+  }
+
+  cstr_append(&head, "\r\n");
+  response_output(ctx, res, owned_chunk(cstr_str(&head), cstr_size(&head)));
+  cstr_drop(&head);
+}
+
+static void response_output(JSContext* ctx, http_response_t* res, http_chunk_t chunk) {
+  http_conn_t* conn = res->conn;
+
+  if (!conn) {
+    output_release(JS_GetRuntime(ctx), &(http_output_t) { &chunk, 1, 1, 0 });
+    return;
+  }
+
+  if (res == conn->queue_head) {
+    conn->writable_length += chunk.buf.len;
+    output_push(&conn->pending, chunk);
+    if (!conn->parsing) {
+      conn_flush(conn);
+    }
+  } else {
+    output_push(&res->held, chunk);
+  }
+}
+
+static void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  http_conn_t* conn = handle->data;
+  size_t size;
+  char* slab = veil_net_slab_acquire(conn->vm, &size);
+
+  *buf = uv_buf_init(slab, size);
+}
+
+static void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  http_conn_t* conn = stream->data;
+
+  if (nread > 0) {
+    uv_timer_stop(&conn->timer);
+    conn_feed(conn, buf->base, (size_t) nread);
+  }
+
+  // everything the parser keeps has been copied out by now
+  if (buf->base) {
+    veil_net_slab_release(conn->vm, buf->base);
+  }
+
+  if (nread >= 0 || conn->closing) {
+    return;
+  }
+
+  // the client is done sending; answer what it asked for, then close
+  if (nread == UV_EOF && (conn->queue_head || !JS_IsUndefined(conn->body_target))) {
+    uv_read_stop(stream);
+    if (!JS_IsUndefined(conn->body_target)) {
+      finish_body(conn, "aborted");
+    }
+    conn->state = HTTP_DONE;
+    conn->close_when_done = true;
+    if (!conn->queue_head) {
+      conn_close(conn);
+    }
+    return;
+  }
+
+  conn_close(conn);
+}
+
+static void conn_feed(http_conn_t* conn, const char* data, size_t size) {
+  size_t consumed;
+
+  conn->parsing = true;
+  consumed = conn_parse(conn, data, size);
+  conn->parsing = false;
+
+  if (conn->closing) {
+    return;
+  }
+
+  // the pipeline is full or the body is paused: hold the rest and stop
+  // reading until it drains or flows
+  if (consumed < size && conn->state != HTTP_DONE) {
+    conn->stash = realloc(conn->stash, conn->stash_size + size - consumed);
+    CHECK_NOT_NULL(conn->stash);
+    memcpy(conn->stash + conn->stash_size, data + consumed, size - consumed);
+    conn->stash_size += size - consumed;
+    conn->stalled = true;
+  }
+
+  if (conn->stalled || conn->state == HTTP_DONE) {
+    uv_read_stop((uv_stream_t*) &conn->tcp);
+  }
+
+  conn_flush(conn);
+  conn_idle(conn);
+}
+
+static size_t conn_parse(http_conn_t* conn, const char* data, size_t size) {
+  size_t offset = 0;
+  size_t count;
+  bool complete;
+  char c;
+
+  while (offset < size && !conn->closing) {
+    switch (conn->state) {
+      case HTTP_HEAD:
+        if (conn->queue_count >= HTTP_MAX_PIPELINE) {
+          return offset;
+        }
+        complete = false;
+        offset += scan_head(conn, data + offset, size - offset, &complete);
+        if (conn->head_size > HTTP_MAX_HEAD) {
+          conn_fail(conn, 431);
+        } else if (complete) {
+          on_head(conn);
+        }
+        break;
+      case HTTP_BODY:
+      case HTTP_CHUNK_DATA:
+        if (!body_request(conn)->flowing) {
+          return offset;
+        }
+        count = size - offset < conn->remaining ? size - offset : (size_t) conn->remaining;
+        emit_body(conn, data + offset, count);
+        offset += count;
+        conn->remaining -= count;
+        if (conn->remaining == 0) {
+          if (conn->state == HTTP_BODY) {
+            finish_body(conn, "end");
+          } else {
+            conn->state = HTTP_CHUNK_END;
+          }
+        }
+        break;
+      case HTTP_CHUNK_SIZE:
+        c = data[offset++];
+        if (c >= '0' && c <= '9') {
+          conn->remaining = conn->remaining * 16 + (uint64_t) (c - '0');
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+          conn->remaining = conn->remaining * 16 + (uint64_t) ((c | 0x20) - 'a' + 10);
+        } else if ((c == ';' || c == ' ' || c == '\t') && conn->chunk_digits > 0) {
+          conn->state = HTTP_CHUNK_EXT;
+          break;
+        } else if (c == '\r') {
+          break;
+        } else if (c == '\n' && conn->chunk_digits > 0) {
+          conn->line_chars = 0;
+          conn->state = conn->remaining ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+          break;
+        } else {
+          conn_fail(conn, 400);
+          break;
+        }
+        if (++conn->chunk_digits > 15) {
+          conn_fail(conn, 413);
+        }
+        break;
+      case HTTP_CHUNK_EXT: {
+        const char* nl = memchr(data + offset, '\n', size - offset);
+
+        // extensions are ignored
+        if (!nl) {
+          offset = size;
+          break;
+        }
+        offset = (size_t) (nl - data) + 1;
+        conn->line_chars = 0;
+        conn->state = conn->remaining ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+        break;
+      }
+      case HTTP_CHUNK_END:
+        c = data[offset++];
+        if (c == '\n') {
+          conn->remaining = 0;
+          conn->chunk_digits = 0;
+          conn->state = HTTP_CHUNK_SIZE;
+        } else if (c != '\r') {
+          conn_fail(conn, 400);
+        }
+        break;
+      case HTTP_TRAILER:
+        // trailer fields are read past; a blank line ends the message
+        c = data[offset++];
+        if (c == '\n') {
+          if (conn->line_chars == 0) {
+            finish_body(conn, "end");
+          }
+          conn->line_chars = 0;
+        } else if (c != '\r') {
+          conn->line_chars++;
+        }
+        break;
+      default:
+        return size;
+    }
+  }
+
+  return offset;
+}
+
+// Appends data to the head buffer up to and including the blank line that
+// ends the head, and returns how much of it was used.
+static size_t scan_head(http_conn_t* conn, const char* data, size_t size, bool* complete) {
+  const char* p = data;
+  const char* end = data + size;
+  const char* start;
+  const char* nl;
+  size_t needed;
+
+  // empty lines ahead of a request line are ignored
+  if (conn->head_size == 0) {
+    while (p < end && (*p == '\r' || *p == '\n')) {
+      p++;
+    }
+  }
+  start = p;
+
+  while (p < end) {
+    nl = memchr(p, '\n', (size_t) (end - p));
+    if (!nl) {
+      if (conn->line_chars == 0) {
+        conn->line_first = *p;
+      }
+      conn->line_chars += (size_t) (end - p);
+      p = end;
+      break;
+    }
+
+    if (nl > p) {
+      if (conn->line_chars == 0) {
+        conn->line_first = *p;
+      }
+      conn->line_chars += (size_t) (nl - p);
+    }
+    p = nl + 1;
+
+    if (conn->line_chars == 0 || (conn->line_chars == 1 && conn->line_first == '\r')) {
+      *complete = true;
+      conn->line_chars = 0;
+      break;
+    }
+    conn->line_chars = 0;
+  }
+
+  needed = conn->head_size + (size_t) (p - start);
+  if (needed > conn->head_capacity) {
+    while (conn->head_capacity < needed) {
+      conn->head_capacity = conn->head_capacity ? conn->head_capacity * 2 : 1024;
+    }
+    conn->head = realloc(conn->head, conn->head_capacity);
+    CHECK_NOT_NULL(conn->head);
+  }
+  memcpy(conn->head + conn->head_size, start, (size_t) (p - start));
+  conn->head_size = needed;
+
+  return (size_t) (p - data);
+}
+
+static void on_head(http_conn_t* conn) {
+  JSContext* ctx = conn->vm->context;
+  http_request_t* request;
+  http_response_t* res;
+  http_head_info_t info;
+  JSValue args[2];
+  int status;
+
+  request = calloc(1, sizeof(http_request_t));
+  CHECK_NOT_NULL(request);
+  request->head = conn->head;
+  request->head_size = conn->head_size;
+  conn->head = NULL;
+  conn->head_size = 0;
+  conn->head_capacity = 0;
+
+  status = parse_head(request, &info);
+  if (status) {
+    free(request->head);
+    free(request->fields);
+    free(request);
+    conn_fail(conn, status);
+    return;
+  }
+
+  args[0] = JS_NewObjectClass(ctx, request_class_id);
+  args[1] = JS_NewObjectClass(ctx, response_class_id);
+  if (JS_IsException(args[0]) || JS_IsException(args[1])) {
+    JS_FreeValue(ctx, args[0]);
+    JS_FreeValue(ctx, args[1]);
+    free(request->head);
+    free(request->fields);
+    free(request);
+    veil_vm_dump_exception(conn->vm);
+    conn_fail(conn, 500);
+    return;
+  }
+  JS_SetOpaque(args[0], request);
+
+  res = calloc(1, sizeof(http_response_t));
+  CHECK_NOT_NULL(res);
+  res->conn = conn;
+  res->object = JS_DupValue(ctx, args[1]);
+  res->status = 200;
+  res->status_message = cstr_init();
+  res->version_minor = request->version_minor;
+  res->head_request = request->method_size == 4 && memcmp(request->head, "HEAD", 4) == 0;
+  res->keep_alive = info.keep_alive && !conn->close_when_done;
+  JS_SetOpaque(args[1], res);
+
+  if (conn->queue_tail) {
+    conn->queue_tail->next = res;
+  } else {
+    conn->queue_head = res;
+  }
+  conn->queue_tail = res;
+  conn->queue_count++;
+
+  conn->last_request = !res->keep_alive;
+  if (info.chunked) {
+    conn->state = HTTP_CHUNK_SIZE;
+    conn->remaining = 0;
+    conn->chunk_digits = 0;
+    conn->body_target = JS_DupValue(ctx, args[0]);
+    request->conn = conn;
+  } else if (info.content_length > 0) {
+    conn->state = HTTP_BODY;
+    conn->remaining = (uint64_t) info.content_length;
+    conn->body_target = JS_DupValue(ctx, args[0]);
+    request->conn = conn;
+  } else {
+    conn->state = conn->last_request ? HTTP_DONE : HTTP_HEAD;
+  }
+
+  veil_emitter_emit(ctx, conn->server_object, "request", 2, args);
+
+  // once the handler has had a chance to listen for it
+  if (!info.chunked && info.content_length <= 0) {
+    JS_EnqueueJob(ctx, emit_end, 1, (JSValueConst*) &args[0]);
+  }
+
+  JS_FreeValue(ctx, args[0]);
+  JS_FreeValue(ctx, args[1]);
+}
+
+// Splits a complete head into the request line and field offsets. Returns 0
+// or the status to reject the request with.
+static int parse_head(http_request_t* request, http_head_info_t* info) {
+  const char* head = request->head;
+  const char* p = head;
+  const char* end = head + request->head_size;
+  const char* nl;
+  const char* value_end;
+  uint32_t lines = 0;
+  bool has_length = false;
+  bool close = false;
+  bool keep_alive = false;
+
+  info->content_length = 0;
+  info->chunked = false;
+
+  // method SP request-target SP HTTP/1.x
+  while (p < end && is_token(*p)) {
+    p++;
+  }
+  if (p == head || p == end || *p != ' ') {
+    return 400;
+  }
+  request->method_size = (uint32_t) (p - head);
+
+  request->url = (uint32_t) (++p - head);
+  while (p < end && (unsigned char) *p > ' ' && *p != 0x7F) {
+    p++;
+  }
+  if (p == head + request->url || p == end || *p != ' ') {
+    return 400;
+  }
+  request->url_size = (uint32_t) (p - head) - request->url;
+  p++;
+
+  if (end - p < 9 || memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1')) {
+    return end - p >= 5 && memcmp(p, "HTTP/", 5) == 0 ? 505 : 400;
+  }
+  request->version_minor = p[7] - '0';
+  p += 8;
+  if (*p == '\r') {
+    p++;
+  }
+  if (p == end || *p != '\n') {
+    return 400;
+  }
+  p++;
+
+  for (const char* q = p; (q = memchr(q, '\n', (size_t) (end - q))); q++) {
+    lines++;
+  }
+  if (lines > HTTP_MAX_HEADERS + 1) {
+    return 431;
+  }
+  request->fields = malloc((lines ? lines : 1) * sizeof(http_field_t));
+  CHECK_NOT_NULL(request->fields);
+
+  // name ":" OWS value OWS, up to the blank line
+  while (p < end && *p != '\r' && *p != '\n') {
+    http_field_t* field = &request->fields[request->field_count];
+    const char* name = p;
+    const char* value;
+
+    while (p < end && is_token(*p)) {
+      p++;
+    }
+    // no whitespace before the colon, and no obsolete line folding
+    if (p == name || p == end || *p != ':') {
+      return 400;
+    }
+    field->name = (uint32_t) (name - head);
+    field->name_size = (uint32_t) (p - name);
+    p++;
+
+    nl = memchr(p, '\n', (size_t) (end - p));
+    if (!nl) {
+      return 400;
+    }
+    while (p < nl && (*p == ' ' || *p == '\t')) {
+      p++;
+    }
+    value = p;
+    value_end = nl;
+    while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+      value_end--;
+    }
+    field->value = (uint32_t) (value - head);
+    field->value_size = (uint32_t) (value_end - value);
+    p = nl + 1;
+    request->field_count++;
+
+    if (equals_lower(name, field->name_size, "content-length")) {
+      int64_t length = 0;
+
+      if (value == value_end) {
+        return 400;
+      }
+      for (const char* d = value; d < value_end; d++) {
+        if (*d < '0' || *d > '9' || length > (INT64_MAX - 9) / 10) {
+          return 400;
+        }
+        length = length * 10 + (*d - '0');
+      }
+      // repeated lengths must agree
+      if (has_length && length != info->content_length) {
+        return 400;
+      }
+      has_length = true;
+      info->content_length = length;
+    } else if (equals_lower(name, field->name_size, "transfer-encoding")) {
+      const char* last = value_end;
+
+      // chunked has to be the final coding; nothing else can be framed
+      while (last > value && last[-1] != ',' && last[-1] != ' ') {
+        last--;
+      }
+      if (!equals_lower(last, (size_t) (value_end - last), "chunked")) {
+        return 501;
+      }
+      info->chunked = true;
+    } else if (equals_lower(name, field->name_size, "connection")) {
+      close = close || has_token(value, (size_t) (value_end - value), "close");
+      keep_alive = keep_alive || has_token(value, (size_t) (value_end - value), "keep-alive");
+    }
+  }
+
+  // both framings at once is how requests get smuggled past proxies
+  if (info->chunked && has_length) {
+    return 400;
+  }
+
+  info->keep_alive = request->version_minor >= 1 ? !close : keep_alive && !close;
+
+  return 0;
+}
+
+static http_request_t* body_request(http_conn_t* conn) {
+  return JS_GetOpaque(conn->body_target, request_class_id);
+}
+
+static void emit_body(http_conn_t* conn, const char* data, size_t size) {
+  JSContext* ctx = conn->vm->context;
+  JSValue chunk;
+
+  if (size == 0 || veil_emitter_count(ctx, conn->body_target, "data") == 0) {
+    return;
+  }
+
+  chunk = veil_builtin_new_uint8_array(ctx, JS_NewArrayBufferCopy(ctx, (const uint8_t*) data, size));
+  if (JS_IsException(chunk)) {
+    veil_vm_dump_exception(conn->vm);
+    return;
+  }
+
+  veil_emitter_emit(ctx, conn->body_target, "data", 1, (JSValueConst*) &chunk);
+  JS_FreeValue(ctx, chunk);
+}
+
+static void finish_body(http_conn_t* conn, const char* event) {
+  JSContext* ctx = conn->vm->context;
+  JSValue target = conn->body_target;
+
+  body_request(conn)->conn = NULL;
+  conn->body_target = JS_UNDEFINED;
+  conn->state = conn->last_request ? HTTP_DONE : HTTP_HEAD;
+
+  if (!conn->released) {
+    veil_emitter_emit(ctx, target, event, 0, NULL);
+  }
+  JS_FreeValue(ctx, target);
+}
+
+static void conn_fail(http_conn_t* conn, int status) {
+  if (!JS_IsUndefined(conn->body_target)) {
+    finish_body(conn, "aborted");
+  }
+
+  conn->state = HTTP_DONE;
+  conn->error_status = status;
+  conn->close_when_done = true;
+
+  if (!conn->queue_head) {
+    conn_send_error(conn);
+  }
+}
+
+static void conn_send_error(http_conn_t* conn) {
+  char response[128];
+  int size = snprintf(response, sizeof(response),
+      "HTTP/1.1 %d %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n",
+      conn->error_status, status_reason(conn->error_status));
+  http_chunk_t chunk = owned_chunk(response, (size_t) size);
+
+  conn->error_status = 0;
+  conn->writable_length += chunk.buf.len;
+  output_push(&conn->pending, chunk);
+  if (!conn->parsing) {
+    conn_flush(conn);
+  }
+}
+
+// Retires finished responses from the front of the queue and lets the next
+// one's held output through.
+static void conn_advance(http_conn_t* conn) {
+  JSContext* ctx = conn->vm->context;
+  http_response_t* res;
+
+  while ((res = conn->queue_head) && res->finished) {
+    conn->queue_head = res->next;
+    if (!conn->queue_head) {
+      conn->queue_tail = NULL;
+    }
+    conn->queue_count--;
+
+    if (!res->keep_alive) {
+      conn->close_when_done = true;
+    }
+    res->conn = NULL;
+    res->next = NULL;
+    JS_FreeValue(ctx, res->object);
+
+    if (conn->queue_head) {
+      conn->writable_length += conn->queue_head->held.size;
+      output_move(&conn->pending, &conn->queue_head->held);
+    }
+  }
+
+  if (!conn->queue_head && conn->error_status) {
+    conn_send_error(conn);
+  }
+
+  // the body being read belongs to the last response; once that has gone
+  // out unread, the rest is read past so the next request can follow
+  if (!conn->queue_head && !JS_IsUndefined(conn->body_target)) {
+    body_request(conn)->flowing = true;
+  }
+
+  if (!conn->parsing) {
+    conn_resume(conn);
+    conn_flush(conn);
+    conn_idle(conn);
+  }
+}
+
+static void conn_resume(http_conn_t* conn) {
+  char* stash = conn->stash;
+  size_t size = conn->stash_size;
+  int err;
+
+  if (!conn->stalled || conn->closing || conn->queue_count >= HTTP_MAX_PIPELINE) {
+    return;
+  }
+
+  conn->stash = NULL;
+  conn->stash_size = 0;
+  conn->stalled = false;
+
+  conn_feed(conn, stash, size);
+  free(stash);
+
+  if (!conn->stalled && !conn->closing && conn->state != HTTP_DONE) {
+    err = uv_read_start((uv_stream_t*) &conn->tcp, alloc_cb, read_cb);
+    if (err) {
+      conn_close(conn);
+    }
+  }
+}
+
+// An idle keep-alive connection is closed after the server's timeout.
+static void conn_idle(http_conn_t* conn) {
+  uint64_t timeout = conn->server->keep_alive_timeout;
+
+  if (conn->closing || conn->queue_head || conn->state != HTTP_HEAD || !timeout) {
+    return;
+  }
+
+  uv_timer_start(&conn->timer, timer_cb, timeout, 0);
+}
+
+static void conn_flush(http_conn_t* conn) {
+  uv_buf_t stack_bufs[HTTP_STACK_BUFS];
+  uv_buf_t* bufs;
+  http_write_t* write;
+  int err;
+
+  if (conn->closing) {
+    return;
+  }
+
+  if (conn->pending.count > 0) {
+    write = calloc(1, sizeof(http_write_t));
+    CHECK_NOT_NULL(write);
+    write->conn = conn;
+    write->output = conn->pending;
+    memset(&conn->pending, 0, sizeof(http_output_t));
+
+    bufs = write->output.count > HTTP_STACK_BUFS ? malloc(write->output.count * sizeof(uv_buf_t)) : stack_bufs;
+    CHECK_NOT_NULL(bufs);
+    for (uint32_t n = 0; n < write->output.count; n++) {
+      bufs[n] = write->output.chunks[n].buf;
+    }
+
+    err = uv_write(&write->req, (uv_stream_t*) &conn->tcp, bufs, write->output.count, write_cb);
+    if (bufs != stack_bufs) {
+      free(bufs);
+    }
+
+    if (err) {
+      conn->writable_length -= write->output.size;
+      output_release(JS_GetRuntime(conn->vm->context), &write->output);
+      free(write->output.chunks);
+      free(write);
+      conn_close(conn);
+      return;
+    }
+  }
+
+  // the shutdown waits for the writes queued ahead of it
+  if (conn->close_when_done && !conn->queue_head && !conn->shutdown_sent) {
+    conn->shutdown_sent = true;
+    uv_read_stop((uv_stream_t*) &conn->tcp);
+    err = uv_shutdown(&conn->shutdown, (uv_stream_t*) &conn->tcp, shutdown_cb);
+    if (err) {
+      conn_close(conn);
+    }
+  }
+}
+
+static void conn_close(http_conn_t* conn) {
+  JSContext* ctx = conn->vm->context;
+  http_response_t* res;
+
+  if (conn->closing) {
+    return;
+  }
+
+  conn->closing = true;
+  veil_vm_remove_cleanup(&conn->cleanup);
+
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else if (conn->server->connections == conn) {
+    conn->server->connections = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  conn->prev = NULL;
+  conn->next = NULL;
+
+  if (!JS_IsUndefined(conn->body_target)) {
+    finish_body(conn, "aborted");
+  }
+
+  // responses still owed are cut off
+  while ((res = conn->queue_head)) {
+    conn->queue_head = res->next;
+    res->conn = NULL;
+    res->next = NULL;
+    output_release(JS_GetRuntime(ctx), &res->held);
+    if (!conn->released) {
+      veil_emitter_emit(ctx, res->object, "close", 0, NULL);
+    }
+    JS_FreeValue(ctx, res->object);
+  }
+  conn->queue_tail = NULL;
+  conn->queue_count = 0;
+
+  output_release(JS_GetRuntime(ctx), &conn->pending);
+
+  uv_close((uv_handle_t*) &conn->tcp, conn_close_cb);
+  uv_close((uv_handle_t*) &conn->timer, conn_close_cb);
+}
+
+static void write_cb(uv_write_t* req, int status) {
+  http_write_t* write = container_of(req, http_write_t, req);
+  http_conn_t* conn = write->conn;
+  JSContext* ctx = conn->vm->context;
+  http_response_t* res;
+
+  conn->writable_length -= write->output.size;
+  output_release(JS_GetRuntime(ctx), &write->output);
+  free(write->output.chunks);
+  free(write);
+
+  if (conn->closing) {
+    return;
+  }
+
+  if (status) {
+    conn_close(conn);
+    return;
+  }
+
+  res = conn->queue_head;
+  if (res && res->need_drain && conn->writable_length == 0) {
+    res->need_drain = false;
+    veil_emitter_emit(ctx, res->object, "drain", 0, NULL);
+  }
+}
+
+static void shutdown_cb(uv_shutdown_t* req, int status) {
+  http_conn_t* conn = container_of(req, http_conn_t, shutdown);
+
+  conn_close(conn);
+}
+
+static void timer_cb(uv_timer_t* timer) {
+  http_conn_t* conn = timer->data;
+
+  if (!conn->queue_head) {
+    conn_close(conn);
+  }
+}
+
+static void conn_close_cb(uv_handle_t* handle) {
+  http_conn_t* conn = handle->data;
+  JSContext* ctx = conn->vm->context;
+  JSValue server_object = conn->server_object;
+
+  if (++conn->closed_handles < 2) {
+    return;
+  }
+
+  free(conn->head);
+  free(conn->stash);
+  free(conn->pending.chunks);
+  free(conn);
+
+  // the last reference can run the server's finalizer
+  JS_FreeValue(ctx, server_object);
+}
+
+static void conn_cleanup_cb(veil_cleanup_t* cleanup) {
+  http_conn_t* conn = container_of(cleanup, http_conn_t, cleanup);
+
+  conn->released = true;
+  conn_close(conn);
+}
+
+static void output_push(http_output_t* output, http_chunk_t chunk) {
+  if (output->count == output->capacity) {
+    output->capacity = output->capacity ? output->capacity * 2 : 8;
+    output->chunks = realloc(output->chunks, output->capacity * sizeof(http_chunk_t));
+    CHECK_NOT_NULL(output->chunks);
+  }
+  output->chunks[output->count++] = chunk;
+  output->size += chunk.buf.len;
+}
+
+static void output_move(http_output_t* to, http_output_t* from) {
+  for (uint32_t n = 0; n < from->count; n++) {
+    output_push(to, from->chunks[n]);
+  }
+  free(from->chunks);
+  memset(from, 0, sizeof(http_output_t));
+}
+
+// Releases what the chunks hold; the array itself stays with the caller.
+static void output_release(JSRuntime* rt, http_output_t* output) {
+  for (uint32_t n = 0; n < output->count; n++) {
+    JS_FreeValueRT(rt, output->chunks[n].keep);
+    free(output->chunks[n].owned);
+  }
+  output->count = 0;
+  output->size = 0;
+}
+
+static http_chunk_t owned_chunk(const char* data, size_t size) {
+  http_chunk_t chunk = { uv_buf_init(NULL, 0), JS_UNDEFINED, NULL };
+
+  chunk.owned = malloc(size ? size : 1);
+  CHECK_NOT_NULL(chunk.owned);
+  memcpy(chunk.owned, data, size);
+  chunk.buf = uv_buf_init(chunk.owned, size);
+
+  return chunk;
+}
+
+static http_chunk_t static_chunk(const char* str) {
+  http_chunk_t chunk = { uv_buf_init((char*) str, strlen(str)), JS_UNDEFINED, NULL };
+
+  return chunk;
+}
+
+static const char* status_reason(int status) {
+  for (size_t n = 0; n < countof(STATUS_CODES); n++) {
+    if (STATUS_CODES[n].code == status) {
+      return STATUS_CODES[n].reason;
+    }
+  }
+
+  return "Unknown";
+}
+
+// RFC 9110 tchar
+static bool is_token(char c) {
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+    return true;
+  }
+
+  return c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static bool equals_lower(const char* str, size_t size, const char* lower) {
+  size_t n;
+
+  for (n = 0; n < size && lower[n]; n++) {
+    char c = str[n];
+
+    if ((c >= 'A' && c <= 'Z' ? (char) (c + 32) : c) != lower[n]) {
+      return false;
+    }
+  }
+
+  return n == size && lower[n] == 0;
+}
+
+static bool equals_ignore_case(const char* a, const char* b, size_t size) {
+  for (size_t n = 0; n < size; n++) {
+    char x = a[n] >= 'A' && a[n] <= 'Z' ? (char) (a[n] + 32) : a[n];
+    char y = b[n] >= 'A' && b[n] <= 'Z' ? (char) (b[n] + 32) : b[n];
+
+    if (x != y) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// whether a comma separated field value lists token
+static bool has_token(const char* str, size_t size, const char* token) {
+  const char* end = str + size;
+
+  while (str < end) {
+    const char* comma = memchr(str, ',', (size_t) (end - str));
+    const char* stop = comma ? comma : end;
+
+    while (str < stop && (*str == ' ' || *str == '\t')) {
+      str++;
+    }
+    while (stop > str && (stop[-1] == ' ' || stop[-1] == '\t')) {
+      stop--;
+    }
+    if (equals_lower(str, (size_t) (stop - str), token)) {
+      return true;
+    }
+    str = comma ? comma + 1 : end;
+  }
+
+  return false;
+}
@@ -0,0 +1,2177 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <math.h>
+
+// The json builtin: a parser that builds values straight from the source
+// bytes, a serializer that writes into a byte buffer instead of a JS string,
+// and a newline-delimited reader that hands out one record at a time.
+//
+// Parsing runs in two stages, as in Langdale and Lemire, "Parsing Gigabytes of
+// JSON per Second" (2019). Stage one classifies 64 bytes at a time into
+// bitmasks, works out which bytes are inside strings and collects the offset
+// of every token; stage two walks those offsets and creates the values. Stage
+// one runs a window ahead of stage two, so the index never grows with the
+// input.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JSON_X64
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define JSON_NEON
+#include <arm_neon.h>
+#endif
+
+#define JSON_MAX_DEPTH 1000
+// token offsets indexed ahead of the parser
+#define JSON_WINDOW 1024
+#define JSON_KEY_SLOTS 256
+#define JSON_KEY_LENGTH 24
+#define JSON_READ_SIZE (1024 * 1024)
+
+#define CLASS_WS 1
+#define CLASS_OP 2
+#define CLASS_QUOTE 4
+#define CLASS_BACKSLASH 8
+#define CLASS_CONTROL 16
+
+typedef struct json_masks_s {
+  uint64_t ws;
+  uint64_t op;
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t control;
+} json_masks_t;
+
+typedef struct json_index_s {
+  const uint8_t* data;
+  size_t size;
+  // the next block to classify
+  size_t offset;
+  // carried from one block to the next
+  uint64_t escaped;
+  uint64_t in_string;
+  uint64_t scalar;
+  // where a raw control character sits inside a string, or SIZE_MAX
+  size_t control;
+  size_t tokens[JSON_WINDOW];
+  size_t count;
+  size_t next;
+} json_index_t;
+
+// Object keys repeat from record to record; interning each one is the most
+// expensive part of building an object, so recent keys keep their atoms.
+typedef struct json_key_s {
+  JSAtom atom;
+  uint8_t length;
+  char key[JSON_KEY_LENGTH];
+} json_key_t;
+
+typedef struct json_keys_s {
+  json_key_t slots[JSON_KEY_SLOTS];
+} json_keys_t;
+
+typedef struct json_doc_s {
+  JSContext* ctx;
+  const uint8_t* data;
+  size_t size;
+  json_index_t index;
+  json_keys_t* keys;
+  // unescaped strings
+  uint8_t* scratch;
+  size_t scratch_capacity;
+  const char* message;
+  size_t error_offset;
+} json_doc_t;
+
+typedef struct json_writer_s {
+  JSContext* ctx;
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+  // writing into the caller's memory, which cannot grow
+  bool fixed;
+  bool overflow;
+  char gap[11];
+  size_t gap_length;
+  JSAtom to_json;
+  // the key toJSON() sees for the value itself
+  JSAtom root;
+  JSValue* stack;
+  uint32_t depth;
+} json_writer_t;
+
+typedef struct json_file_s json_file_t;
+
+typedef struct json_parser_s {
+  JSValue on_record;
+  json_keys_t keys;
+  // the start of a line whose end has not arrived yet
+  uint8_t* pending;
+  size_t pending_size;
+  size_t pending_capacity;
+  int64_t line;
+  bool busy;
+  bool ended;
+  json_file_t* file;
+} json_parser_t;
+
+struct json_file_s {
+  uv_fs_t req;
+  veil_cleanup_t cleanup;
+  // NULL once the VM has gone
+  veil_vm_t* vm;
+  // the Parser, held while a request is in flight
+  JSValue object;
+  // NULL once the Parser has been finalized
+  json_parser_t* parser;
+  cstr path;
+  uv_file fd;
+  int64_t position;
+  bool busy;
+  bool paused;
+  bool destroyed;
+  bool closed;
+  uint8_t* buffer;
+  size_t buffer_size;
+};
+
+static JSClassID parser_class_id;
+static uint8_t CHAR_CLASS[256];
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static int json_module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue json_parse(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue json_stringify(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue json_stringify_into(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue json_create_reader(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static JSValue parser_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv);
+static JSValue parser_new(JSContext* ctx, JSValue obj, JSValueConst on_record);
+static JSValue parser_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue parser_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue parser_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue parser_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue parser_line(JSContext* ctx, JSValueConst this_val);
+static void parser_finalizer(JSRuntime* rt, JSValue val);
+static void parser_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func);
+
+static void index_init(json_index_t* index, const uint8_t* data, size_t size);
+static void index_fill(json_index_t* index);
+static void classify(const uint8_t* block, json_masks_t* masks);
+static uint64_t find_escaped(json_index_t* index, uint64_t backslash);
+static uint64_t prefix_xor(uint64_t bits);
+static uint32_t ctz64(uint64_t bits);
+
+static void doc_init(json_doc_t* doc, JSContext* ctx, json_keys_t* keys, const uint8_t* data, size_t size);
+static JSValue doc_parse(json_doc_t* doc);
+static size_t next_token(json_doc_t* doc);
+static uint8_t char_at(json_doc_t* doc, size_t offset);
+static JSValue parse_value(json_doc_t* doc, size_t offset, int depth);
+static JSValue parse_object(json_doc_t* doc, int depth);
+static JSValue parse_array(json_doc_t* doc, int depth);
+static JSValue parse_scalar(json_doc_t* doc, size_t offset);
+static JSValue parse_number(json_doc_t* doc, size_t offset);
+static JSAtom parse_key(json_doc_t* doc, size_t offset);
+static bool scan_string(json_doc_t* doc, size_t offset, const uint8_t** str, size_t* length);
+static bool unescape(json_doc_t* doc, const uint8_t* p, const uint8_t* end, const uint8_t** str, size_t* length);
+static uint8_t* reserve_scratch(json_doc_t* doc, size_t used, size_t extra);
+static bool is_delimiter(json_doc_t* doc, size_t offset);
+static JSValue fail(json_doc_t* doc, size_t offset, const char* message);
+static void keys_drop(JSRuntime* rt, json_keys_t* keys);
+static JSValue internalize(JSContext* ctx, JSValueConst reviver, JSValueConst holder, JSAtom name);
+
+static bool writer_init(json_writer_t* w, JSContext* ctx, JSValueConst space);
+static void writer_drop(json_writer_t* w);
+static int write_value(json_writer_t* w, JSValue value, JSAtom key, uint32_t index);
+static int write_object(json_writer_t* w, JSValueConst obj);
+static int write_array(json_writer_t* w, JSValueConst array);
+static bool write_number(json_writer_t* w, JSValueConst value);
+static bool write_int(json_writer_t* w, int64_t value);
+static bool write_string(json_writer_t* w, JSValueConst value);
+static bool write_quoted(json_writer_t* w, const uint8_t* str, size_t size);
+static bool write_newline(json_writer_t* w);
+static bool put(json_writer_t* w, const void* data, size_t size);
+static bool reserve(json_writer_t* w, size_t size);
+static size_t plain_length(const uint8_t* str, size_t size);
+static bool stack_push(json_writer_t* w, JSValueConst obj);
+static JSValue stringify_fallback(JSContext* ctx, int argc, JSValueConst* argv);
+
+static bool feed(JSContext* ctx, JSValueConst obj, json_parser_t* parser, const uint8_t* data, size_t size);
+static bool feed_line(JSContext* ctx, JSValueConst obj, json_parser_t* parser, const uint8_t* line, size_t size);
+static bool finish(JSContext* ctx, JSValueConst obj, json_parser_t* parser);
+static void append_pending(json_parser_t* parser, const uint8_t* data, size_t size);
+
+static void file_read(json_file_t* file, JSValueConst obj);
+static void file_fail(json_file_t* file, JSValueConst obj, int err, const char* syscall);
+static void file_close(json_file_t* file);
+static void file_cb(uv_fs_t* req);
+static void file_cleanup_cb(veil_cleanup_t* cleanup);
+
+static const JSClassDef PARSER_CLASS = {
+  "Parser",
+  .finalizer = parser_finalizer,
+  .gc_mark = parser_mark,
+};
+
+static const JSCFunctionListEntry PARSER_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("write", 1, parser_write),
+  JS_CFUNC_DEF("end", 1, parser_end),
+  JS_CFUNC_MAGIC_DEF("pause", 0, parser_pause, true),
+  JS_CFUNC_MAGIC_DEF("resume", 0, parser_pause, false),
+  JS_CFUNC_DEF("destroy", 0, parser_destroy),
+  JS_CGETSET_DEF("line", parser_line, NULL),
+};
+
+enum {
+  STRINGIFY_STRING,
+  STRINGIFY_BUFFER,
+};
+
+static const JSCFunctionListEntry JSON[] = {
+  JS_CFUNC_DEF("parse", 2, json_parse),
+  JS_CFUNC_MAGIC_DEF("stringify", 3, json_stringify, STRINGIFY_STRING),
+  JS_CFUNC_MAGIC_DEF("stringifyToBuffer", 3, json_stringify, STRINGIFY_BUFFER),
+  JS_CFUNC_DEF("stringifyInto", 3, json_stringify_into),
+  JS_CFUNC_DEF("createReader", 3, json_create_reader),
+};
+
+JSModuleDef* veil_json_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, json_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, JSON, countof(JSON));
+    JS_AddModuleExport(ctx, m, "Parser");
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+static void global_init() {
+  static const char OPS[] = ",:[]{}";
+
+  JS_NewClassID(&parser_class_id);
+
+  for (int c = 0; c < 0x20; c++) {
+    CHAR_CLASS[c] = CLASS_CONTROL;
+  }
+  CHAR_CLASS[' '] = CLASS_WS;
+  CHAR_CLASS['\t'] |= CLASS_WS;
+  CHAR_CLASS['\n'] |= CLASS_WS;
+  CHAR_CLASS['\r'] |= CLASS_WS;
+  for (size_t n = 0; n < sizeof(OPS) - 1; n++) {
+    CHAR_CLASS[(uint8_t) OPS[n]] = CLASS_OP;
+  }
+  CHAR_CLASS['"'] = CLASS_QUOTE;
+  CHAR_CLASS['\\'] = CLASS_BACKSLASH;
+}
+
+static int json_module_init(JSContext* ctx, JSModuleDef* m) {
+  JSRuntime* rt = JS_GetRuntime(ctx);
+  JSValue proto;
+  JSValue ctor;
+  JSValue json;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, parser_class_id)) {
+    JS_NewClass(rt, parser_class_id, &PARSER_CLASS);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, PARSER_PROTO, countof(PARSER_PROTO));
+  ctor = JS_NewCFunction2(ctx, parser_ctor, "Parser", 1, JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, ctor, proto);
+  JS_SetClassProto(ctx, parser_class_id, proto);
+
+  json = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, json, JSON, countof(JSON));
+  JS_SetPropertyStr(ctx, json, "Parser", JS_DupValue(ctx, ctor));
+
+  JS_SetModuleExportList(ctx, m, JSON, countof(JSON));
+  JS_SetModuleExport(ctx, m, "Parser", ctor);
+  JS_SetModuleExport(ctx, m, "default", json);
+
+  return 0;
+}
+
+// parse(text[, reviver]), where text is a string or the UTF-8 bytes of one
+static JSValue json_parse(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JSValueConst text = argc > 0 ? argv[0] : JS_UNDEFINED;
+  json_keys_t* keys;
+  json_doc_t doc;
+  const char* str = NULL;
+  uint8_t* data;
+  size_t size;
+  JSValue value;
+
+  if (JS_IsObject(text)) {
+    if (!veil_builtin_get_bytes(ctx, text, &data, &size)) {
+      return JS_EXCEPTION;
+    }
+    if (!veil_codec_utf8_valid(data, size)) {
+      return JS_ThrowSyntaxError(ctx, "invalid UTF-8 in JSON");
+    }
+  } else {
+    str = JS_ToCStringLen(ctx, &size, text);
+    if (!str) {
+      return JS_EXCEPTION;
+    }
+    data = (uint8_t*) str;
+  }
+
+  keys = calloc(1, sizeof(json_keys_t));
+  CHECK_NOT_NULL(keys);
+  doc_init(&doc, ctx, keys, data, size);
+  value = doc_parse(&doc);
+  keys_drop(JS_GetRuntime(ctx), keys);
+  free(keys);
+  JS_FreeCString(ctx, str);
+
+  if (!JS_IsException(value) && argc > 1 && JS_IsFunction(ctx, argv[1])) {
+    JSValue root = JS_NewObject(ctx);
+    JSAtom name = JS_NewAtom(ctx, "");
+
+    JS_DefinePropertyValue(ctx, root, name, value, JS_PROP_C_W_E);
+    value = internalize(ctx, argv[1], root, name);
+    JS_FreeAtom(ctx, name);
+    JS_FreeValue(ctx, root);
+  }
+
+  return value;
+}
+
+// stringify(value[, replacer[, space]]) as a string or, for
+// stringifyToBuffer(), as a Buffer of UTF-8
+static JSValue json_stringify(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  json_writer_t w;
+  JSValue result;
+  int written;
+
+  if (argc > 1 && JS_IsObject(argv[1])) {
+    result = stringify_fallback(ctx, argc, argv);
+    if (magic == STRINGIFY_BUFFER && JS_IsString(result)) {
+      size_t size;
+      const char* str = JS_ToCStringLen(ctx, &size, result);
+      uint8_t* data;
+
+      JS_FreeValue(ctx, result);
+      if (!str) {
+        return JS_EXCEPTION;
+      }
+      data = malloc(size ? size : 1);
+      CHECK_NOT_NULL(data);
+      memcpy(data, str, size);
+      JS_FreeCString(ctx, str);
+      result = veil_buffer_new(ctx, data, size);
+    }
+    return result;
+  }
+
+  if (!writer_init(&w, ctx, argc > 2 ? argv[2] : JS_UNDEFINED)) {
+    return JS_EXCEPTION;
+  }
+
+  written = write_value(&w, JS_DupValue(ctx, argc > 0 ? argv[0] : JS_UNDEFINED), w.root, 0);
+  if (written < 0) {
+    result = JS_EXCEPTION;
+  } else if (written == 0) {
+    result = JS_UNDEFINED;
+  } else if (magic == STRINGIFY_BUFFER) {
+    result = veil_buffer_new(ctx, w.data, w.size);
+    w.data = NULL;
+  } else {
+    result = JS_NewStringLen(ctx, (const char*) w.data, w.size);
+  }
+
+  writer_drop(&w);
+
+  return result;
+}
+
+// stringifyInto(value, target[, offset]) serializes into the bytes of
+// target and returns how many it wrote
+static JSValue json_stringify_into(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  json_writer_t w;
+  uint8_t* data;
+  size_t size;
+  int64_t offset = 0;
+  int written;
+
+  if (argc < 2 || !veil_builtin_get_bytes(ctx, argv[1], &data, &size)) {
+    return argc < 2 ? JS_ThrowTypeError(ctx, "target must be a typed array or an ArrayBuffer") : JS_EXCEPTION;
+  }
+
+  if (argc > 2 && !JS_IsUndefined(argv[2])) {
+    if (JS_ToInt64(ctx, &offset, argv[2]) < 0) {
+      return JS_EXCEPTION;
+    }
+    if (offset < 0 || (uint64_t) offset > size) {
+      return JS_ThrowRangeError(ctx, "offset is out of range");
+    }
+  }
+
+  if (!writer_init(&w, ctx, JS_UNDEFINED)) {
+    return JS_EXCEPTION;
+  }
+  w.data = data + offset;
+  w.capacity = size - (size_t) offset;
+  w.fixed = true;
+
+  written = write_value(&w, JS_DupValue(ctx, argv[0]), w.root, 0);
+  if (written < 0 && w.overflow) {
+    JS_ThrowRangeError(ctx, "target is too small for the serialized value");
+  }
+
+  size = w.size;
+  w.data = NULL;
+  writer_drop(&w);
+
+  return written < 0 ? JS_EXCEPTION : JS_NewInt64(ctx, (int64_t) size);
+}
+
+// createReader(path, onRecord[, options]) is a Parser fed from a file, read
+// one chunk at a time so memory stays at one chunk plus one record
+static JSValue json_create_reader(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  json_parser_t* parser;
+  json_file_t* file;
+  const char* path;
+  int64_t size = JSON_READ_SIZE;
+  JSValue obj;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "createReader requires an event loop");
+  }
+
+  if (argc > 2 && JS_IsObject(argv[2])) {
+    JSValue value = JS_GetPropertyStr(ctx, argv[2], "highWaterMark");
+    int ret = JS_IsUndefined(value) ? 0 : JS_ToInt64(ctx, &size, value);
+
+    JS_FreeValue(ctx, value);
+    if (ret < 0) {
+      return JS_EXCEPTION;
+    }
+    if (size < 1 || size > INT32_MAX) {
+      return JS_ThrowRangeError(ctx, "highWaterMark is out of range");
+    }
+  }
+
+  if (argc < 2 || !JS_IsFunction(ctx, argv[1])) {
+    return JS_ThrowTypeError(ctx, "onRecord must be a function");
+  }
+
+  path = JS_ToCString(ctx, argv[0]);
+  if (!path) {
+    return JS_EXCEPTION;
+  }
+
+  obj = parser_new(ctx, JS_NewObjectClass(ctx, parser_class_id), argv[1]);
+  if (JS_IsException(obj)) {
+    JS_FreeCString(ctx, path);
+    return obj;
+  }
+  parser = JS_GetOpaque(obj, parser_class_id);
+
+  file = calloc(1, sizeof(json_file_t));
+  CHECK_NOT_NULL(file);
+  file->vm = vm;
+  file->object = JS_UNDEFINED;
+  file->parser = parser;
+  file->path = cstr_from(path);
+  file->fd = -1;
+  file->buffer_size = (size_t) size;
+  file->buffer = malloc(file->buffer_size);
+  CHECK_NOT_NULL(file->buffer);
+  file->req.data = file;
+  parser->file = file;
+  JS_FreeCString(ctx, path);
+
+  veil_vm_add_cleanup(vm, &file->cleanup, file_cleanup_cb);
+
+  file->busy = true;
+  file->object = JS_DupValue(ctx, obj);
+  CHECK_OK(uv_fs_open(&vm->uv->loop, &file->req, cstr_str(&file->path), UV_FS_O_RDONLY, 0, file_cb));
+
+  return obj;
+}
+
+// new Parser(onRecord) takes newline-delimited JSON in arbitrary chunks and
+// calls onRecord(value, line) for each complete line
+static JSValue parser_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv) {
+  JSValue proto;
+  JSValue obj;
+
+  if (argc < 1 || !JS_IsFunction(ctx, argv[0])) {
+    return JS_ThrowTypeError(ctx, "onRecord must be a function");
+  }
+
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  obj = JS_NewObjectProtoClass(ctx, proto, parser_class_id);
+  JS_FreeValue(ctx, proto);
+
+  return parser_new(ctx, obj, argv[0]);
+}
+
+static JSValue parser_new(JSContext* ctx, JSValue obj, JSValueConst on_record) {
+  json_parser_t* parser;
+
+  if (JS_IsException(obj)) {
+    return obj;
+  }
+
+  parser = calloc(1, sizeof(json_parser_t));
+  CHECK_NOT_NULL(parser);
+  parser->on_record = JS_DupValue(ctx, on_record);
+  JS_SetOpaque(obj, parser);
+
+  return obj;
+}
+
+static JSValue parser_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  json_parser_t* parser = JS_GetOpaque2(ctx, this_val, parser_class_id);
+  JSValueConst chunk = argc > 0 ? argv[0] : JS_UNDEFINED;
+  const char* str = NULL;
+  uint8_t* data;
+  size_t size;
+  bool ok;
+
+  if (!parser) {
+    return JS_EXCEPTION;
+  }
+
+  if (parser->ended) {
+    return JS_ThrowTypeError(ctx, "write after end");
+  }
+
+  if (parser->busy) {
+    return JS_ThrowTypeError(ctx, "cannot write to a Parser from its own callback");
+  }
+
+  if (JS_IsString(chunk)) {
+    str = JS_ToCStringLen(ctx, &size, chunk);
+    if (!str) {
+      return JS_EXCEPTION;
+    }
+    data = (uint8_t*) str;
+  } else if (!veil_builtin_get_bytes(ctx, chunk, &data, &size)) {
+    return JS_EXCEPTION;
+  }
+
+  ok = feed(ctx, this_val, parser, data, size);
+  JS_FreeCString(ctx, str);
+
+  return ok ? JS_UNDEFINED : JS_EXCEPTION;
+}
+
+static JSValue parser_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  json_parser_t* parser = JS_GetOpaque2(ctx, this_val, parser_class_id);
+
+  if (!parser) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && !JS_IsUndefined(argv[0])) {
+    JSValue result = parser_write(ctx, this_val, argc, argv);
+
+    if (JS_IsException(result)) {
+      return result;
+    }
+  }
+
+  if (parser->ended) {
+    return JS_UNDEFINED;
+  }
+
+  return finish(ctx, this_val, parser) ? JS_UNDEFINED : JS_EXCEPTION;
+}
+
+// only a reader has anything to pause: records of a chunk already read are
+// still delivered
+static JSValue parser_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  json_parser_t* parser = JS_GetOpaque2(ctx, this_val, parser_class_id);
+  json_file_t* file;
+
+  if (!parser) {
+    return JS_EXCEPTION;
+  }
+
+  file = parser->file;
+  if (file && !file->closed) {
+    file->paused = magic;
+    if (!file->paused && !file->busy && file->fd >= 0) {
+      file_read(file, this_val);
+    }
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue parser_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  json_parser_t* parser = JS_GetOpaque2(ctx, this_val, parser_class_id);
+  json_file_t* file;
+
+  if (!parser) {
+    return JS_EXCEPTION;
+  }
+
+  parser->ended = true;
+  parser->pending_size = 0;
+
+  file = parser->file;
+  if (file && !file->closed) {
+    // an in-flight request closes the file when it comes back
+    file->destroyed = true;
+    if (!file->busy) {
+      file_close(file);
+    }
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue parser_line(JSContext* ctx, JSValueConst this_val) {
+  json_parser_t* parser = JS_GetOpaque2(ctx, this_val, parser_class_id);
+
+  return parser ? JS_NewInt64(ctx, parser->line) : JS_EXCEPTION;
+}
+
+static void parser_finalizer(JSRuntime* rt, JSValue val) {
+  json_parser_t* parser = JS_GetOpaque(val, parser_class_id);
+  json_file_t* file;
+  uv_fs_t req;
+
+  if (!parser) {
+    return;
+  }
+
+  file = parser->file;
+  if (file) {
+    if (file->busy) {
+      // the request frees the file when it comes back
+      file->parser = NULL;
+    } else {
+      if (file->vm && !file->closed) {
+        veil_vm_remove_cleanup(&file->cleanup);
+      }
+      if (file->fd >= 0) {
+        uv_fs_close(NULL, &req, file->fd, NULL);
+        uv_fs_req_cleanup(&req);
+      }
+      cstr_drop(&file->path);
+      free(file->buffer);
+      free(file);
+    }
+  }
+
+  JS_FreeValueRT(rt, parser->on_record);
+  keys_drop(rt, &parser->keys);
+  free(parser->pending);
+  free(parser);
+}
+
+// file->object is the Parser itself, held as a root while a read is in flight
+static void parser_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+  json_parser_t* parser = JS_GetOpaque(val, parser_class_id);
+
+  if (parser) {
+    JS_MarkValue(rt, parser->on_record, mark_func);
+  }
+}
+
+static void index_init(json_index_t* index, const uint8_t* data, size_t size) {
+  index->data = data;
+  index->size = size;
+  index->offset = 0;
+  index->escaped = 0;
+  index->in_string = 0;
+  index->scalar = 0;
+  index->control = SIZE_MAX;
+  index->count = 0;
+  index->next = 0;
+}
+
+// Classifies blocks until the window is full. A token is an operator outside
+// a string, an opening quote or the first byte of a number or literal.
+static void index_fill(json_index_t* index) {
+  uint8_t padded[64];
+  json_masks_t masks;
+
+  index->count = 0;
+  index->next = 0;
+
+  while (index->offset < index->size && index->count + 64 <= JSON_WINDOW && index->control == SIZE_MAX) {
+    const uint8_t* block = index->data + index->offset;
+    uint64_t quote;
+    uint64_t in_string;
+    uint64_t scalar;
+    uint64_t starts;
+    uint64_t tokens;
+
+    if (index->size - index->offset < 64) {
+      memset(padded, ' ', sizeof(padded));
+      memcpy(padded, block, index->size - index->offset);
+      block = padded;
+    }
+
+    classify(block, &masks);
+
+    quote = masks.quote & ~find_escaped(index, masks.backslash);
+    // set from each opening quote up to, not including, its closing quote
+    in_string = prefix_xor(quote) ^ index->in_string;
+    index->in_string = (uint64_t) ((int64_t) in_string >> 63);
+
+    if (masks.control & in_string) {
+      index->control = index->offset + ctz64(masks.control & in_string);
+      break;
+    }
+
+    scalar = ~(masks.op | masks.ws | quote);
+    starts = scalar & ~(scalar << 1 | index->scalar);
+    index->scalar = scalar >> 63;
+
+    tokens = ((masks.op | starts) & ~in_string) | (quote & in_string);
+    while (tokens) {
+      index->tokens[index->count++] = index->offset + ctz64(tokens);
+      tokens &= tokens - 1;
+    }
+
+    index->offset += 64;
+  }
+}
+
+static void classify(const uint8_t* block, json_masks_t* masks) {
+#if defined(JSON_X64)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i colon = _mm_set1_epi8(':');
+  // '[' and '{', ']' and '}' differ only in bit 5
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+
+  memset(masks, 0, sizeof(json_masks_t));
+
+  for (int n = 0; n < 4; n++) {
+    __m128i v = _mm_loadu_si128((const __m128i*) (block + n * 16));
+    __m128i folded = _mm_or_si128(v, case_bit);
+    __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+                              _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    __m128i op = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, colon)),
+                              _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)));
+    int shift = n * 16;
+
+    masks->ws |= (uint64_t) (uint16_t) _mm_movemask_epi8(ws) << shift;
+    masks->op |= (uint64_t) (uint16_t) _mm_movemask_epi8(op) << shift;
+    masks->quote |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << shift;
+    masks->backslash |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash)) << shift;
+    masks->control |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, control), v)) << shift;
+  }
+#elif defined(JSON_NEON)
+  static const uint8_t BITS[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint8x16_t bits = vld1q_u8(BITS);
+  uint8x16_t ws[4];
+  uint8x16_t op[4];
+  uint8x16_t quote[4];
+  uint8x16_t backslash[4];
+  uint8x16_t control[4];
+  uint8x16_t* all[5] = { ws, op, quote, backslash, control };
+  uint64_t* out[5] = { &masks->ws, &masks->op, &masks->quote, &masks->backslash, &masks->control };
+
+  for (int n = 0; n < 4; n++) {
+    uint8x16_t v = vld1q_u8(block + n * 16);
+    uint8x16_t folded = vorrq_u8(v, vdupq_n_u8(0x20));
+
+    ws[n] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t'))),
+                     vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8('\r'))));
+    op[n] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(',')), vceqq_u8(v, vdupq_n_u8(':'))),
+                     vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')), vceqq_u8(folded, vdupq_n_u8('}'))));
+    quote[n] = vceqq_u8(v, vdupq_n_u8('"'));
+    backslash[n] = vceqq_u8(v, vdupq_n_u8('\\'));
+    control[n] = vcleq_u8(v, vdupq_n_u8(0x1F));
+  }
+
+  // a bit per byte: weight each lane, then add neighbours down to 8 bytes
+  for (int k = 0; k < 5; k++) {
+    uint8x16_t* v = all[k];
+    uint8x16_t sum0 = vpaddq_u8(vandq_u8(v[0], bits), vandq_u8(v[1], bits));
+    uint8x16_t sum1 = vpaddq_u8(vandq_u8(v[2], bits), vandq_u8(v[3], bits));
+
+    sum0 = vpaddq_u8(sum0, sum1);
+    sum0 = vpaddq_u8(sum0, sum0);
+    *out[k] = vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+  }
+#else
+  memset(masks, 0, sizeof(json_masks_t));
+
+  for (int n = 0; n < 64; n++) {
+    uint8_t cls = CHAR_CLASS[block[n]];
+    uint64_t bit = (uint64_t) 1 << n;
+
+    masks->ws |= cls & CLASS_WS ? bit : 0;
+    masks->op |= cls & CLASS_OP ? bit : 0;
+    masks->quote |= cls & CLASS_QUOTE ? bit : 0;
+    masks->backslash |= cls & CLASS_BACKSLASH ? bit : 0;
+    masks->control |= cls & CLASS_CONTROL ? bit : 0;
+  }
+#endif
+}
+
+// The bytes that follow an odd-length run of backslashes. Runs that start on
+// an even bit and runs that start on an odd bit are told apart by adding the
+// run starts to the runs: the carry ripples through to the end of each run.
+static uint64_t find_escaped(json_index_t* index, uint64_t backslash) {
+  const uint64_t even = 0x5555555555555555ULL;
+  uint64_t follows;
+  uint64_t odd_starts;
+  uint64_t even_runs;
+  uint64_t escaped;
+
+  if (!backslash && !index->escaped) {
+    return 0;
+  }
+
+  backslash &= ~index->escaped;
+  follows = backslash << 1 | index->escaped;
+  odd_starts = backslash & ~even & ~follows;
+  even_runs = odd_starts + backslash;
+  escaped = ((even ^ (even_runs << 1)) & follows);
+  // the carry out of the last bit continues the run into the next block
+  index->escaped = even_runs < backslash ? 1 : 0;
+
+  return escaped;
+}
+
+static uint64_t prefix_xor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+
+  return bits;
+}
+
+static uint32_t ctz64(uint64_t bits) {
+#ifdef _MSC_VER
+  unsigned long index;
+
+  _BitScanForward64(&index, bits);
+
+  return (uint32_t) index;
+#else
+  return (uint32_t) __builtin_ctzll(bits);
+#endif
+}
+
+static void doc_init(json_doc_t* doc, JSContext* ctx, json_keys_t* keys, const uint8_t* data, size_t size) {
+  doc->ctx = ctx;
+  doc->data = data;
+  doc->size = size;
+  doc->keys = keys;
+  doc->scratch = NULL;
+  doc->scratch_capacity = 0;
+  doc->message = NULL;
+  doc->error_offset = 0;
+  index_init(&doc->index, data, size);
+}
+
+// one value with nothing but whitespace around it; syntax errors are thrown
+// as a SyntaxError with the byte offset
+static JSValue doc_parse(json_doc_t* doc) {
+  size_t offset = next_token(doc);
+  JSValue value = parse_value(doc, offset, 0);
+
+  if (!JS_IsException(value)) {
+    offset = next_token(doc);
+    if (offset != doc->size) {
+      JS_FreeValue(doc->ctx, value);
+      value = fail(doc, offset, "unexpected token");
+    }
+  }
+
+  if (JS_IsException(value) && doc->message) {
+    JS_ThrowSyntaxError(doc->ctx, "%s in JSON at position %zu", doc->message, doc->error_offset);
+  }
+
+  free(doc->scratch);
+  doc->scratch = NULL;
+
+  return value;
+}
+
+// the offset of the next token, or the size at the end of the input
+static size_t next_token(json_doc_t* doc) {
+  json_index_t* index = &doc->index;
+
+  if (index->next == index->count) {
+    index_fill(index);
+
+    if (index->count == 0) {
+      if (index->control != SIZE_MAX) {
+        fail(doc, index->control, "bad control character in string literal");
+      }
+      return doc->size;
+    }
+  }
+
+  return index->tokens[index->next++];
+}
+
+static uint8_t char_at(json_doc_t* doc, size_t offset) {
+  return offset < doc->size ? doc->data[offset] : 0;
+}
+
+static JSValue parse_value(json_doc_t* doc, size_t offset, int depth) {
+  const uint8_t* str;
+  size_t length;
+
+  if (offset >= doc->size) {
+    return fail(doc, doc->size, "unexpected end of input");
+  }
+
+  switch (doc->data[offset]) {
+    case '{':
+    case '[':
+      if (depth >= JSON_MAX_DEPTH) {
+        return fail(doc, offset, "nesting too deep");
+      }
+      return doc->data[offset] == '{' ? parse_object(doc, depth + 1) : parse_array(doc, depth + 1);
+    case '"':
+      if (!scan_string(doc, offset, &str, &length)) {
+        return JS_EXCEPTION;
+      }
+      return JS_NewStringLen(doc->ctx, (const char*) str, length);
+    default:
+      return parse_scalar(doc, offset);
+  }
+}
+
+static JSValue parse_object(json_doc_t* doc, int depth) {
+  JSContext* ctx = doc->ctx;
+  JSValue obj = JS_NewObject(ctx);
+  size_t offset = next_token(doc);
+
+  if (JS_IsException(obj) || char_at(doc, offset) == '}') {
+    return obj;
+  }
+
+  for (;;) {
+    JSValue value;
+    JSAtom key;
+    int ret;
+
+    if (char_at(doc, offset) != '"') {
+      JS_FreeValue(ctx, obj);
+      return fail(doc, offset, "expected a property name");
+    }
+
+    key = parse_key(doc, offset);
+    if (key == JS_ATOM_NULL) {
+      JS_FreeValue(ctx, obj);
+      return JS_EXCEPTION;
+    }
+
+    offset = next_token(doc);
+    if (char_at(doc, offset) != ':') {
+      JS_FreeAtom(ctx, key);
+      JS_FreeValue(ctx, obj);
+      return fail(doc, offset, "expected ':'");
+    }
+
+    value = parse_value(doc, next_token(doc), depth);
+    if (JS_IsException(value)) {
+      JS_FreeAtom(ctx, key);
+      JS_FreeValue(ctx, obj);
+      return value;
+    }
+
+    // defining rather than setting keeps "__proto__" an ordinary key
+    ret = JS_DefinePropertyValue(ctx, obj, key, value, JS_PROP_C_W_E);
+    JS_FreeAtom(ctx, key);
+    if (ret < 0) {
+      JS_FreeValue(ctx, obj);
+      return JS_EXCEPTION;
+    }
+
+    offset = next_token(doc);
+    switch (char_at(doc, offset)) {
+      case ',':
+        offset = next_token(doc);
+        break;
+      case '}':
+        return obj;
+      default:
+        JS_FreeValue(ctx, obj);
+        return fail(doc, offset, "expected ',' or '}'");
+    }
+  }
+}
+
+static JSValue parse_array(json_doc_t* doc, int depth) {
+  JSContext* ctx = doc->ctx;
+  JSValue array = JS_NewArray(ctx);
+  size_t offset = next_token(doc);
+  uint32_t length = 0;
+
+  if (JS_IsException(array) || char_at(doc, offset) == ']') {
+    return array;
+  }
+
+  for (;;) {
+    JSValue value = parse_value(doc, offset, depth);
+
+    if (JS_IsException(value)) {
+      JS_FreeValue(ctx, array);
+      return value;
+    }
+
+    if (JS_DefinePropertyValueUint32(ctx, array, length++, value, JS_PROP_C_W_E) < 0) {
+      JS_FreeValue(ctx, array);
+      return JS_EXCEPTION;
+    }
+
+    offset = next_token(doc);
+    switch (char_at(doc, offset)) {
+      case ',':
+        offset = next_token(doc);
+        break;
+      case ']':
+        return array;
+      default:
+        JS_FreeValue(ctx, array);
+        return fail(doc, offset, "expected ',' or ']'");
+    }
+  }
+}
+
+static JSValue parse_scalar(json_doc_t* doc, size_t offset) {
+  static const char* const LITERALS[] = { "false", "true", "null" };
+  uint8_t c = doc->data[offset];
+
+  if (c == '-' || (c >= '0' && c <= '9')) {
+    return parse_number(doc, offset);
+  }
+
+  for (size_t n = 0; n < countof(LITERALS); n++) {
+    size_t length = strlen(LITERALS[n]);
+
+    if (c == LITERALS[n][0] && doc->size - offset >= length
+        && memcmp(doc->data + offset, LITERALS[n], length) == 0 && is_delimiter(doc, offset + length)) {
+      return n < 2 ? JS_NewBool(doc->ctx, n) : JS_NULL;
+    }
+  }
+
+  return fail(doc, offset, "unexpected token");
+}
+
+// Integers of up to 15 digits are exact in a double and are built directly;
+// everything else goes through strtod.
+static JSValue parse_number(json_doc_t* doc, size_t offset) {
+  const uint8_t* start = doc->data + offset;
+  const uint8_t* end = doc->data + doc->size;
+  const uint8_t* p = start;
+  const uint8_t* digits;
+  bool negative = *p == '-';
+  bool integer = true;
+  int64_t value = 0;
+  char buf[64];
+  char* copy;
+  double number;
+  size_t length;
+
+  if (negative) {
+    p++;
+  }
+
+  digits = p;
+  if (p < end && *p == '0') {
+    p++;
+  } else {
+    while (p < end && *p >= '0' && *p <= '9') {
+      value = value * 10 + (*p++ - '0');
+      if (p - digits > 15) {
+        integer = false;
+        while (p < end && *p >= '0' && *p <= '9') {
+          p++;
+        }
+        break;
+      }
+    }
+  }
+
+  if (p == digits) {
+    return fail(doc, offset, "bad number");
+  }
+
+  if (p < end && *p == '.') {
+    integer = false;
+    if (++p == end || *p < '0' || *p > '9') {
+      return fail(doc, offset, "bad number");
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+      p++;
+    }
+  }
+
+  if (p < end && (*p | 0x20) == 'e') {
+    integer = false;
+    if (++p < end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+      return fail(doc, offset, "bad number");
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+      p++;
+    }
+  }
+
+  length = (size_t) (p - start);
+  if (!is_delimiter(doc, offset + length)) {
+    return fail(doc, offset + length, "unexpected token");
+  }
+
+  if (integer) {
+    if (negative) {
+      return value == 0 ? JS_NewFloat64(doc->ctx, -0.0) : JS_NewInt64(doc->ctx, -value);
+    }
+    return JS_NewInt64(doc->ctx, value);
+  }
+
+  // strtod wants a terminated string
+  copy = length < sizeof(buf) ? buf : malloc(length + 1);
+  CHECK_NOT_NULL(copy);
+  memcpy(copy, start, length);
+  copy[length] = '\0';
+  number = strtod(copy, NULL);
+  if (copy != buf) {
+    free(copy);
+  }
+
+  return JS_NewFloat64(doc->ctx, number);
+}
+
+static JSAtom parse_key(json_doc_t* doc, size_t offset) {
+  JSContext* ctx = doc->ctx;
+  json_key_t* slot;
+  const uint8_t* str;
+  size_t length;
+  uint32_t hash = 2166136261u;
+  JSAtom atom;
+
+  if (!scan_string(doc, offset, &str, &length)) {
+    return JS_ATOM_NULL;
+  }
+
+  if (length > JSON_KEY_LENGTH) {
+    return JS_NewAtomLen(ctx, (const char*) str, length);
+  }
+
+  for (size_t n = 0; n < length; n++) {
+    hash = (hash ^ str[n]) * 16777619u;
+  }
+  slot = &doc->keys->slots[(hash ^ hash >> 16) & (JSON_KEY_SLOTS - 1)];
+
+  if (slot->atom != JS_ATOM_NULL && slot->length == length && memcmp(slot->key, str, length) == 0) {
+    return JS_DupAtom(ctx, slot->atom);
+  }
+
+  atom = JS_NewAtomLen(ctx, (const char*) str, length);
+  if (atom != JS_ATOM_NULL) {
+    if (slot->atom != JS_ATOM_NULL) {
+      JS_FreeAtom(ctx, slot->atom);
+    }
+    slot->atom = JS_DupAtom(ctx, atom);
+    slot->length = (uint8_t) length;
+    memcpy(slot->key, str, length);
+  }
+
+  return atom;
+}
+
+// The contents of the string whose opening quote is at offset: a slice of
+// the input when it has no escapes, otherwise unescaped into scratch.
+static bool scan_string(json_doc_t* doc, size_t offset, const uint8_t** str, size_t* length) {
+  const uint8_t* start = doc->data + offset + 1;
+  const uint8_t* end = doc->data + doc->size;
+  const uint8_t* quote = memchr(start, '"', (size_t) (end - start));
+
+  if (!quote) {
+    fail(doc, offset, "unterminated string");
+    return false;
+  }
+
+  if (!memchr(start, '\\', (size_t) (quote - start))) {
+    *str = start;
+    *length = (size_t) (quote - start);
+    return true;
+  }
+
+  return unescape(doc, start, end, str, length);
+}
+
+// Escapes of lone surrogates come out as their three byte encodings, which
+// QuickJS reads back as the same UTF-16 unit.
+static bool unescape(json_doc_t* doc, const uint8_t* p, const uint8_t* end, const uint8_t** str, size_t* length) {
+  size_t used = 0;
+  uint8_t* out;
+
+  for (;;) {
+    const uint8_t* run = p;
+    uint32_t cp;
+
+    while (p < end && *p != '"' && *p != '\\') {
+      p++;
+    }
+
+    out = reserve_scratch(doc, used, (size_t) (p - run) + 4);
+    memcpy(out + used, run, (size_t) (p - run));
+    used += (size_t) (p - run);
+
+    if (p == end) {
+      fail(doc, (size_t) (p - doc->data), "unterminated string");
+      return false;
+    }
+
+    if (*p == '"') {
+      *str = out;
+      *length = used;
+      return true;
+    }
+
+    if (end - p < 2) {
+      fail(doc, (size_t) (p - doc->data), "unterminated string");
+      return false;
+    }
+
+    switch (p[1]) {
+      case '"':
+      case '\\':
+      case '/':
+        out[used++] = p[1];
+        p += 2;
+        continue;
+      case 'b':
+        out[used++] = '\b';
+        p += 2;
+        continue;
+      case 'f':
+        out[used++] = '\f';
+        p += 2;
+        continue;
+      case 'n':
+        out[used++] = '\n';
+        p += 2;
+        continue;
+      case 'r':
+        out[used++] = '\r';
+        p += 2;
+        continue;
+      case 't':
+        out[used++] = '\t';
+        p += 2;
+        continue;
+      case 'u':
+        break;
+      default:
+        fail(doc, (size_t) (p - doc->data), "bad escape");
+        return false;
+    }
+
+    cp = 0;
+    for (int n = 2; n < 6; n++) {
+      uint8_t c = p + n < end ? p[n] : 0;
+      uint8_t digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : 0xFF;
+
+      if (digit == 0xFF) {
+        fail(doc, (size_t) (p - doc->data), "bad Unicode escape");
+        return false;
+      }
+      cp = cp << 4 | digit;
+    }
+    p += 6;
+
+    // a high surrogate and the low surrogate escaped right after it
+    if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+      uint32_t low = 0;
+
+      for (int n = 2; n < 6; n++) {
+        uint8_t c = p[n] | 0x20;
+
+        low = low << 4 | (uint32_t) (c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : 0x10000);
+      }
+
+      if (low >= 0xDC00 && low <= 0xDFFF) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        p += 6;
+      }
+    }
+
+    if (cp < 0x80) {
+      out[used++] = (uint8_t) cp;
+    } else if (cp < 0x800) {
+      out[used++] = (uint8_t) (0xC0 | cp >> 6);
+      out[used++] = (uint8_t) (0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      out[used++] = (uint8_t) (0xE0 | cp >> 12);
+      out[used++] = (uint8_t) (0x80 | (cp >> 6 & 0x3F));
+      out[used++] = (uint8_t) (0x80 | (cp & 0x3F));
+    } else {
+      out[used++] = (uint8_t) (0xF0 | cp >> 18);
+      out[used++] = (uint8_t) (0x80 | (cp >> 12 & 0x3F));
+      out[used++] = (uint8_t) (0x80 | (cp >> 6 & 0x3F));
+      out[used++] = (uint8_t) (0x80 | (cp & 0x3F));
+    }
+  }
+}
+
+static uint8_t* reserve_scratch(json_doc_t* doc, size_t used, size_t extra) {
+  if (used + extra > doc->scratch_capacity) {
+    size_t capacity = doc->scratch_capacity ? doc->scratch_capacity : 256;
+
+    while (capacity < used + extra) {
+      capacity *= 2;
+    }
+    doc->scratch = realloc(doc->scratch, capacity);
+    CHECK_NOT_NULL(doc->scratch);
+    doc->scratch_capacity = capacity;
+  }
+
+  return doc->scratch;
+}
+
+// a number or literal must run right up to whitespace, an operator or the end
+static bool is_delimiter(json_doc_t* doc, size_t offset) {
+  return offset >= doc->size || (CHAR_CLASS[doc->data[offset]] & (CLASS_WS | CLASS_OP | CLASS_QUOTE)) != 0;
+}
+
+// the first error wins; the caller turns it into a SyntaxError
+static JSValue fail(json_doc_t* doc, size_t offset, const char* message) {
+  if (!doc->message) {
+    doc->message = message;
+    doc->error_offset = offset;
+  }
+
+  return JS_EXCEPTION;
+}
+
+static void keys_drop(JSRuntime* rt, json_keys_t* keys) {
+  for (size_t n = 0; n < JSON_KEY_SLOTS; n++) {
+    if (keys->slots[n].atom != JS_ATOM_NULL) {
+      JS_FreeAtomRT(rt, keys->slots[n].atom);
+      keys->slots[n].atom = JS_ATOM_NULL;
+    }
+  }
+}
+
+// InternalizeJSONProperty: calls the reviver bottom up over the parsed value
+static JSValue internalize(JSContext* ctx, JSValueConst reviver, JSValueConst holder, JSAtom name) {
+  JSValue value = JS_GetProperty(ctx, holder, name);
+  JSPropertyEnum* props = NULL;
+  uint32_t count = 0;
+  bool ok = true;
+  JSValue args[2];
+  JSValue result;
+  int is_array;
+
+  if (JS_IsException(value)) {
+    return value;
+  }
+
+  if (JS_IsObject(value)) {
+    is_array = JS_IsArray(ctx, value);
+
+    if (is_array > 0) {
+      JSValue length = JS_GetPropertyStr(ctx, value, "length");
+
+      ok = JS_ToUint32(ctx, &count, length) == 0;
+      JS_FreeValue(ctx, length);
+    } else {
+      ok = is_array == 0 && JS_GetOwnPropertyNames(ctx, &props, &count, value, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) == 0;
+    }
+
+    for (uint32_t n = 0; ok && n < count; n++) {
+      JSAtom atom = props ? props[n].atom : JS_NewAtomUInt32(ctx, n);
+      JSValue element = internalize(ctx, reviver, value, atom);
+
+      if (JS_IsException(element)) {
+        ok = false;
+      } else if (JS_IsUndefined(element)) {
+        ok = JS_DeleteProperty(ctx, value, atom, 0) >= 0;
+      } else {
+        ok = JS_DefinePropertyValue(ctx, value, atom, element, JS_PROP_C_W_E) >= 0;
+      }
+
+      if (!props) {
+        JS_FreeAtom(ctx, atom);
+      }
+    }
+
+    for (uint32_t n = 0; props && n < count; n++) {
+      JS_FreeAtom(ctx, props[n].atom);
+    }
+    js_free(ctx, props);
+
+    if (!ok) {
+      JS_FreeValue(ctx, value);
+      return JS_EXCEPTION;
+    }
+  }
+
+  args[0] = JS_AtomToString(ctx, name);
+  args[1] = value;
+  result = JS_Call(ctx, reviver, holder, 2, args);
+  JS_FreeValue(ctx, args[0]);
+  JS_FreeValue(ctx, args[1]);
+
+  return result;
+}
+
+static bool writer_init(json_writer_t* w, JSContext* ctx, JSValueConst space) {
+  memset(w, 0, sizeof(json_writer_t));
+  w->ctx = ctx;
+
+  if (JS_IsNumber(space)) {
+    double number;
+
+    if (JS_ToFloat64(ctx, &number, space) < 0) {
+      return false;
+    }
+    w->gap_length = number >= 10 ? 10 : number >= 1 ? (size_t) number : 0;
+    memset(w->gap, ' ', w->gap_length);
+  } else if (JS_IsString(space)) {
+    size_t length;
+    const char* str = JS_ToCStringLen(ctx, &length, space);
+
+    if (!str) {
+      return false;
+    }
+    w->gap_length = length > 10 ? 10 : length;
+    memcpy(w->gap, str, w->gap_length);
+    JS_FreeCString(ctx, str);
+  }
+
+  w->to_json = JS_NewAtom(ctx, "toJSON");
+  w->root = JS_NewAtom(ctx, "");
+  w->stack = malloc(JSON_MAX_DEPTH * sizeof(JSValue));
+  CHECK_NOT_NULL(w->stack);
+
+  return true;
+}
+
+static void writer_drop(json_writer_t* w) {
+  if (!w->fixed) {
+    free(w->data);
+  }
+  JS_FreeAtom(w->ctx, w->to_json);
+  JS_FreeAtom(w->ctx, w->root);
+  free(w->stack);
+}
+
+// SerializeJSONProperty: 1 when something was written, 0 when the value is
+// skipped (undefined, a function or a symbol) and -1 on an exception or when
+// a fixed buffer runs out. Takes ownership of value.
+static int write_value(json_writer_t* w, JSValue value, JSAtom key, uint32_t index) {
+  JSContext* ctx = w->ctx;
+  int result = 1;
+  int is_array;
+
+  if (JS_IsObject(value)) {
+    JSValue to_json = JS_GetProperty(ctx, value, w->to_json);
+
+    if (JS_IsException(to_json)) {
+      JS_FreeValue(ctx, value);
+      return -1;
+    }
+
+    if (JS_IsFunction(ctx, to_json)) {
+      JSAtom name = key != JS_ATOM_NULL ? JS_DupAtom(ctx, key) : JS_NewAtomUInt32(ctx, index);
+      JSValue arg = JS_AtomToString(ctx, name);
+      JSValue next = JS_Call(ctx, to_json, value, 1, &arg);
+
+      JS_FreeAtom(ctx, name);
+      JS_FreeValue(ctx, arg);
+      JS_FreeValue(ctx, value);
+      value = next;
+      if (JS_IsException(value)) {
+        JS_FreeValue(ctx, to_json);
+        return -1;
+      }
+    }
+    JS_FreeValue(ctx, to_json);
+  }
+
+  switch (JS_VALUE_GET_TAG(value)) {
+    case JS_TAG_INT:
+      result = write_int(w, JS_VALUE_GET_INT(value)) ? 1 : -1;
+      break;
+    case JS_TAG_FLOAT64:
+      result = write_number(w, value) ? 1 : -1;
+      break;
+    case JS_TAG_BOOL:
+      result = (JS_VALUE_GET_BOOL(value) ? put(w, "true", 4) : put(w, "false", 5)) ? 1 : -1;
+      break;
+    case JS_TAG_NULL:
+      result = put(w, "null", 4) ? 1 : -1;
+      break;
+    case JS_TAG_STRING:
+      result = write_string(w, value) ? 1 : -1;
+      break;
+    case JS_TAG_OBJECT:
+      if (JS_IsFunction(ctx, value)) {
+        result = 0;
+        break;
+      }
+      is_array = JS_IsArray(ctx, value);
+      result = is_array < 0 ? -1 : is_array ? write_array(w, value) : write_object(w, value);
+      break;
+    case JS_TAG_BIG_INT:
+      JS_ThrowTypeError(ctx, "BigInt value can't be serialized in JSON");
+      result = -1;
+      break;
+    default:
+      result = 0;
+      break;
+  }
+
+  JS_FreeValue(ctx, value);
+
+  return result;
+}
+
+static int write_object(json_writer_t* w, JSValueConst obj) {
+  JSContext* ctx = w->ctx;
+  JSPropertyEnum* props;
+  uint32_t count;
+  uint32_t written = 0;
+  int result = 1;
+
+  if (!stack_push(w, obj)) {
+    return -1;
+  }
+
+  if (JS_GetOwnPropertyNames(ctx, &props, &count, obj, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+    w->depth--;
+    return -1;
+  }
+
+  if (!put(w, "{", 1)) {
+    result = -1;
+  }
+
+  for (uint32_t n = 0; result > 0 && n < count; n++) {
+    JSValue value = JS_GetProperty(ctx, obj, props[n].atom);
+    size_t mark = w->size;
+    JSValue name;
+    int ret;
+
+    if (JS_IsException(value)) {
+      result = -1;
+      break;
+    }
+
+    name = JS_AtomToString(ctx, props[n].atom);
+    if ((written && !put(w, ",", 1)) || !write_newline(w) || !write_string(w, name)
+        || !put(w, ": ", w->gap_length ? 2 : 1)) {
+      JS_FreeValue(ctx, name);
+      JS_FreeValue(ctx, value);
+      result = -1;
+      break;
+    }
+    JS_FreeValue(ctx, name);
+
+    ret = write_value(w, value, props[n].atom, 0);
+    if (ret < 0) {
+      result = -1;
+    } else if (ret == 0) {
+      // the key goes again along with the skipped value
+      w->size = mark;
+    } else {
+      written++;
+    }
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    JS_FreeAtom(ctx, props[n].atom);
+  }
+  js_free(ctx, props);
+  w->depth--;
+
+  if (result > 0 && ((written && !write_newline(w)) || !put(w, "}", 1))) {
+    result = -1;
+  }
+
+  return result;
+}
+
+static int write_array(json_writer_t* w, JSValueConst array) {
+  JSContext* ctx = w->ctx;
+  JSValue value = JS_GetPropertyStr(ctx, array, "length");
+  uint32_t length;
+  int result = 1;
+
+  if (JS_ToUint32(ctx, &length, value) < 0) {
+    JS_FreeValue(ctx, value);
+    return -1;
+  }
+  JS_FreeValue(ctx, value);
+
+  if (!stack_push(w, array)) {
+    return -1;
+  }
+
+  if (!put(w, "[", 1)) {
+    result = -1;
+  }
+
+  for (uint32_t n = 0; result > 0 && n < length; n++) {
+    int ret;
+
+    value = JS_GetPropertyUint32(ctx, array, n);
+    if (JS_IsException(value) || (n && !put(w, ",", 1)) || !write_newline(w)) {
+      JS_FreeValue(ctx, value);
+      result = -1;
+      break;
+    }
+
+    ret = write_value(w, value, JS_ATOM_NULL, n);
+    // holes and values that cannot be written become null
+    if (ret < 0 || (ret == 0 && !put(w, "null", 4))) {
+      result = -1;
+    }
+  }
+
+  w->depth--;
+
+  if (result > 0 && ((length && !write_newline(w)) || !put(w, "]", 1))) {
+    result = -1;
+  }
+
+  return result;
+}
+
+static bool write_number(json_writer_t* w, JSValueConst value) {
+  double number = JS_VALUE_GET_FLOAT64(value);
+  const char* str;
+  size_t length;
+  bool ok;
+
+  if (!isfinite(number)) {
+    return put(w, "null", 4);
+  }
+
+  // below 2^53 every integral double prints as its digits, -0 as 0
+  if (number == trunc(number) && fabs(number) < 9007199254740992.0) {
+    return write_int(w, (int64_t) number);
+  }
+
+  str = JS_ToCStringLen(w->ctx, &length, value);
+  if (!str) {
+    return false;
+  }
+  ok = put(w, str, length);
+  JS_FreeCString(w->ctx, str);
+
+  return ok;
+}
+
+static bool write_int(json_writer_t* w, int64_t value) {
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  uint64_t magnitude = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+
+  do {
+    *--p = (char) ('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude);
+
+  if (value < 0) {
+    *--p = '-';
+  }
+
+  return put(w, p, (size_t) (buf + sizeof(buf) - p));
+}
+
+static bool write_string(json_writer_t* w, JSValueConst value) {
+  size_t length;
+  const char* str = JS_ToCStringLen(w->ctx, &length, value);
+  bool ok;
+
+  if (!str) {
+    return false;
+  }
+
+  ok = write_quoted(w, (const uint8_t*) str, length);
+  JS_FreeCString(w->ctx, str);
+
+  return ok;
+}
+
+// QuoteJSONString over the UTF-8 of a JS string. JS_ToCStringLen encodes a
+// lone surrogate as its own three bytes (ED A0..BF xx); those are written as
+// \u escapes, as JSON.stringify does.
+static bool write_quoted(json_writer_t* w, const uint8_t* str, size_t size) {
+  static const char HEX[] = "0123456789abcdef";
+  const uint8_t* end = str + size;
+  char escape[6];
+
+  if (!reserve(w, size + 2)) {
+    return false;
+  }
+  w->data[w->size++] = '"';
+
+  while (str < end) {
+    size_t length = plain_length(str, (size_t) (end - str));
+    uint8_t c;
+
+    if (!put(w, str, length)) {
+      return false;
+    }
+    str += length;
+    if (str == end) {
+      break;
+    }
+
+    c = *str;
+    if (c == 0xED) {
+      uint32_t cp;
+
+      if (end - str < 3 || str[1] < 0xA0) {
+        if (!put(w, str++, 1)) {
+          return false;
+        }
+        continue;
+      }
+
+      cp = (uint32_t) (c & 0x0F) << 12 | (uint32_t) (str[1] & 0x3F) << 6 | (str[2] & 0x3F);
+      escape[0] = '\\';
+      escape[1] = 'u';
+      escape[2] = HEX[cp >> 12];
+      escape[3] = HEX[cp >> 8 & 0xF];
+      escape[4] = HEX[cp >> 4 & 0xF];
+      escape[5] = HEX[cp & 0xF];
+      length = 6;
+      str += 3;
+    } else {
+      escape[0] = '\\';
+      length = 2;
+      switch (c) {
+        case '"':
+        case '\\':
+          escape[1] = (char) c;
+          break;
+        case '\b':
+          escape[1] = 'b';
+          break;
+        case '\f':
+          escape[1] = 'f';
+          break;
+        case '\n':
+          escape[1] = 'n';
+          break;
+        case '\r':
+          escape[1] = 'r';
+          break;
+        case '\t':
+          escape[1] = 't';
+          break;
+        default:
+          escape[1] = 'u';
+          escape[2] = '0';
+          escape[3] = '0';
+          escape[4] = HEX[c >> 4];
+          escape[5] = HEX[c & 0xF];
+          length = 6;
+          break;
+      }
+      str++;
+    }
+
+    if (!put(w, escape, length)) {
+      return false;
+    }
+  }
+
+  return put(w, "\"", 1);
+}
+
+static bool write_newline(json_writer_t* w) {
+  if (!w->gap_length) {
+    return true;
+  }
+
+  if (!put(w, "\n", 1)) {
+    return false;
+  }
+
+  for (uint32_t n = 0; n < w->depth; n++) {
+    if (!put(w, w->gap, w->gap_length)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool put(json_writer_t* w, const void* data, size_t size) {
+  if (!reserve(w, size)) {
+    return false;
+  }
+
+  memcpy(w->data + w->size, data, size);
+  w->size += size;
+
+  return true;
+}
+
+static bool reserve(json_writer_t* w, size_t size) {
+  size_t capacity;
+
+  if (w->capacity - w->size >= size) {
+    return true;
+  }
+
+  if (w->fixed) {
+    w->overflow = true;
+    return false;
+  }
+
+  capacity = w->capacity ? w->capacity : 256;
+  while (capacity - w->size < size) {
+    capacity *= 2;
+  }
+
+  w->data = realloc(w->data, capacity);
+  CHECK_NOT_NULL(w->data);
+  w->capacity = capacity;
+
+  return true;
+}
+
+// the length of the prefix that needs no escaping: no quote, backslash,
+// control character or possible surrogate lead byte
+static size_t plain_length(const uint8_t* str, size_t size) {
+  size_t offset = 0;
+
+#if defined(JSON_X64)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+  const __m128i surrogate = _mm_set1_epi8((char) 0xED);
+
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) (str + offset));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, control), v), _mm_cmpeq_epi8(v, surrogate)));
+    int mask = _mm_movemask_epi8(hits);
+
+    if (mask) {
+      return offset + ctz64((uint64_t) mask);
+    }
+  }
+#elif defined(JSON_NEON)
+  for (; offset + 16 <= size; offset += 16) {
+    uint8x16_t v = vld1q_u8(str + offset);
+    uint8x16_t hits = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))),
+                               vorrq_u8(vcleq_u8(v, vdupq_n_u8(0x1F)), vceqq_u8(v, vdupq_n_u8(0xED))));
+
+    if (vmaxvq_u8(hits)) {
+      break;
+    }
+  }
+#endif
+
+  while (offset < size && !(CHAR_CLASS[str[offset]] & (CLASS_QUOTE | CLASS_BACKSLASH | CLASS_CONTROL)) && str[offset] != 0xED) {
+    offset++;
+  }
+
+  return offset;
+}
+
+static bool stack_push(json_writer_t* w, JSValueConst obj) {
+  for (uint32_t n = 0; n < w->depth; n++) {
+    if (JS_VALUE_GET_PTR(w->stack[n]) == JS_VALUE_GET_PTR(obj)) {
+      JS_ThrowTypeError(w->ctx, "Converting circular structure to JSON");
+      return false;
+    }
+  }
+
+  if (w->depth == JSON_MAX_DEPTH) {
+    JS_ThrowRangeError(w->ctx, "nesting too deep to serialize");
+    return false;
+  }
+
+  w->stack[w->depth++] = obj;
+
+  return true;
+}
+
+// a replacer function or allow list is left to the engine's JSON.stringify
+static JSValue stringify_fallback(JSContext* ctx, int argc, JSValueConst* argv) {
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue json = JS_GetPropertyStr(ctx, global, "JSON");
+  JSValue fn = JS_GetPropertyStr(ctx, json, "stringify");
+  JSValue result = JS_Call(ctx, fn, json, argc > 3 ? 3 : argc, argv);
+
+  JS_FreeValue(ctx, fn);
+  JS_FreeValue(ctx, json);
+  JS_FreeValue(ctx, global);
+
+  return result;
+}
+
+// Complete lines are parsed where they sit in the chunk; only a line split
+// across chunks is copied.
+static bool feed(JSContext* ctx, JSValueConst obj, json_parser_t* parser, const uint8_t* data, size_t size) {
+  const uint8_t* end = data + size;
+  const uint8_t* p = data;
+  const uint8_t* newline;
+  bool ok;
+
+  if (parser->pending_size) {
+    newline = memchr(p, '\n', size);
+    if (!newline) {
+      append_pending(parser, p, size);
+      return true;
+    }
+
+    append_pending(parser, p, (size_t) (newline - p));
+    ok = feed_line(ctx, obj, parser, parser->pending, parser->pending_size);
+    parser->pending_size = 0;
+    p = newline + 1;
+    if (!ok) {
+      return false;
+    }
+  }
+
+  while (p < end && !parser->ended) {
+    newline = memchr(p, '\n', (size_t) (end - p));
+    if (!newline) {
+      append_pending(parser, p, (size_t) (end - p));
+      return true;
+    }
+
+    if (!feed_line(ctx, obj, parser, p, (size_t) (newline - p))) {
+      return false;
+    }
+    p = newline + 1;
+  }
+
+  return true;
+}
+
+static bool feed_line(JSContext* ctx, JSValueConst obj, json_parser_t* parser, const uint8_t* line, size_t size) {
+  JSValue args[2];
+  JSValue result;
+  json_doc_t doc;
+  size_t start = 0;
+
+  parser->line++;
+
+  while (start < size && (CHAR_CLASS[line[start]] & CLASS_WS)) {
+    start++;
+  }
+  if (start == size) {
+    return true;
+  }
+
+  if (!veil_codec_utf8_valid(line, size)) {
+    JS_ThrowSyntaxError(ctx, "invalid UTF-8 in JSON");
+    args[0] = JS_EXCEPTION;
+  } else {
+    doc_init(&doc, ctx, &parser->keys, line, size);
+    args[0] = doc_parse(&doc);
+  }
+
+  // a bad line goes to 'error' listeners and the rest keep coming
+  if (JS_IsException(args[0])) {
+    JSValue err = JS_GetException(ctx);
+
+    if (JS_IsObject(err)) {
+      JS_SetPropertyStr(ctx, err, "line", JS_NewInt64(ctx, parser->line));
+    }
+
+    if (veil_emitter_count(ctx, obj, "error") == 0) {
+      JS_Throw(ctx, err);
+      return false;
+    }
+
+    veil_emitter_emit(ctx, obj, "error", 1, &err);
+    JS_FreeValue(ctx, err);
+    return true;
+  }
+
+  args[1] = JS_NewInt64(ctx, parser->line);
+  parser->busy = true;
+  result = JS_Call(ctx, parser->on_record, obj, 2, args);
+  parser->busy = false;
+  JS_FreeValue(ctx, args[0]);
+
+  if (JS_IsException(result)) {
+    return false;
+  }
+  JS_FreeValue(ctx, result);
+
+  return true;
+}
+
+// the last line needs no newline
+static bool finish(JSContext* ctx, JSValueConst obj, json_parser_t* parser) {
+  bool ok = true;
+
+  if (parser->pending_size) {
+    ok = feed_line(ctx, obj, parser, parser->pending, parser->pending_size);
+    parser->pending_size = 0;
+  }
+
+  parser->ended = true;
+  if (ok) {
+    veil_emitter_emit(ctx, obj, "end", 0, NULL);
+  }
+
+  return ok;
+}
+
+static void append_pending(json_parser_t* parser, const uint8_t* data, size_t size) {
+  if (parser->pending_size + size > parser->pending_capacity) {
+    size_t capacity = parser->pending_capacity ? parser->pending_capacity : 4096;
+
+    while (capacity < parser->pending_size + size) {
+      capacity *= 2;
+    }
+    parser->pending = realloc(parser->pending, capacity);
+    CHECK_NOT_NULL(parser->pending);
+    parser->pending_capacity = capacity;
+  }
+
+  memcpy(parser->pending + parser->pending_size, data, size);
+  parser->pending_size += size;
+}
+
+static void file_read(json_file_t* file, JSValueConst obj) {
+  uv_buf_t buf = uv_buf_init((char*) file->buffer, (unsigned int) file->buffer_size);
+
+  file->busy = true;
+  file->object = JS_DupValue(file->vm->context, obj);
+  CHECK_OK(uv_fs_read(&file->vm->uv->loop, &file->req, file->fd, &buf, 1, file->position, file_cb));
+}
+
+static void file_fail(json_file_t* file, JSValueConst obj, int err, const char* syscall) {
+  JSContext* ctx = file->vm->context;
+  JSValue error = veil_builtin_new_uv_error(ctx, err, syscall, cstr_str(&file->path));
+
+  file_close(file);
+
+  if (!veil_emitter_emit(ctx, obj, "error", 1, &error)) {
+    JS_Throw(ctx, error);
+    veil_vm_dump_exception(file->vm);
+    return;
+  }
+
+  JS_FreeValue(ctx, error);
+}
+
+static void file_close(json_file_t* file) {
+  uv_fs_t req;
+
+  if (file->fd >= 0) {
+    uv_fs_close(NULL, &req, file->fd, NULL);
+    uv_fs_req_cleanup(&req);
+    file->fd = -1;
+  }
+
+  file->closed = true;
+  veil_vm_remove_cleanup(&file->cleanup);
+}
+
+static void file_cb(uv_fs_t* req) {
+  json_file_t* file = req->data;
+  ssize_t result = req->result;
+  uv_fs_type type = req->fs_type;
+  JSContext* ctx;
+  JSValue obj;
+
+  uv_fs_req_cleanup(req);
+  file->busy = false;
+
+  if (type == UV_FS_OPEN && result >= 0) {
+    file->fd = (uv_file) result;
+  }
+
+  // the VM has gone and released the Parser
+  if (!file->vm) {
+    if (file->fd >= 0) {
+      uv_fs_t close_req;
+
+      uv_fs_close(NULL, &close_req, file->fd, NULL);
+      uv_fs_req_cleanup(&close_req);
+      file->fd = -1;
+    }
+    if (!file->parser) {
+      cstr_drop(&file->path);
+      free(file->buffer);
+      free(file);
+    }
+    return;
+  }
+
+  ctx = file->vm->context;
+  obj = file->object;
+  file->object = JS_UNDEFINED;
+
+  if (file->destroyed) {
+    file_close(file);
+  } else if (result < 0) {
+    file_fail(file, obj, (int) result, type == UV_FS_OPEN ? "open" : "read");
+  } else if (type == UV_FS_READ && result == 0) {
+    file_close(file);
+    if (!finish(ctx, obj, file->parser)) {
+      veil_vm_dump_exception(file->vm);
+    }
+  } else {
+    if (type == UV_FS_READ) {
+      file->position += result;
+      if (!feed(ctx, obj, file->parser, file->buffer, (size_t) result)) {
+        // a throwing callback stops the reader
+        veil_vm_dump_exception(file->vm);
+        file->destroyed = true;
+      }
+    }
+
+    if (file->destroyed || file->parser->ended) {
+      file_close(file);
+    } else if (!file->paused) {
+      file_read(file, obj);
+    }
+  }
+
+  JS_FreeValue(ctx, obj);
+}
+
+static void file_cleanup_cb(veil_cleanup_t* cleanup) {
+  json_file_t* file = container_of(cleanup, json_file_t, cleanup);
+
+  // a request still in flight frees the file when it comes back
+  JS_FreeValue(file->vm->context, file->object);
+  file->object = JS_UNDEFINED;
+  file->vm = NULL;
+}
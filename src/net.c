@@ -0,0 +1,1421 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+// socket.write() does not write. It appends the chunk to the socket's queue
+// and links the socket onto the VM's flush list; veil_net_flush(), run by
+// the loop's prepare and check phases, then hands each queue to a single
+// uv_write with one uv_buf_t per chunk. A burst of small writes in one turn
+// costs one writev instead of one syscall each.
+//
+// Reads land in slabs recycled through a small per-VM free list. Short reads
+// are copied out so the slab goes straight back; long ones hand the slab to
+// the ArrayBuffer itself, which returns it to the list when collected.
+
+#define NET_SLAB_SIZE (64 * 1024)
+// free slabs kept for reuse; any more go back to the allocator
+#define NET_SLAB_CACHE 16
+// reads of at least this many bytes keep their slab instead of copying
+#define NET_SLAB_ADOPT (NET_SLAB_SIZE / 2)
+// socket.write() returns false once this much is queued or in flight
+#define NET_HIGH_WATER_MARK (16 * 1024)
+#define NET_DEFAULT_BACKLOG 511
+// uv_buf_t arrays up to this size are built on the stack
+#define NET_STACK_BUFS 32
+
+typedef struct net_socket_s net_socket_t;
+
+struct veil_net_s {
+  net_socket_t* flush_head;
+  uint32_t slab_count;
+  void* slabs[NET_SLAB_CACHE];
+};
+
+typedef struct net_chunk_s {
+  uv_buf_t buf;
+  // the buffer that buf points into, or JS_UNDEFINED for strings
+  JSValue keep;
+  // UTF-8 of a string chunk
+  const char* str;
+  JSValue callback;
+} net_chunk_t;
+
+typedef struct net_write_s {
+  uv_write_t req;
+  net_socket_t* socket;
+  net_chunk_t* chunks;
+  uint32_t count;
+  size_t size;
+} net_write_t;
+
+struct net_socket_s {
+  uv_tcp_t tcp;
+  veil_cleanup_t cleanup;
+  veil_vm_t* vm;
+  veil_net_t* net;
+  // held while the handle is open, so an active socket is never collected
+  JSValue object;
+  net_socket_t* next_flush;
+  bool flush_queued;
+
+  // written since the last flush
+  net_chunk_t* pending;
+  uint32_t pending_count;
+  uint32_t pending_capacity;
+  // queued plus in flight
+  size_t writable_length;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+
+  uv_getaddrinfo_t resolve;
+  uv_connect_t connect;
+  uv_shutdown_t shutdown;
+  int port;
+  bool resolving;
+  bool connecting;
+  bool paused;
+  bool ending;
+  bool shutdown_sent;
+  bool eof;
+  bool need_drain;
+  bool had_error;
+  bool closing;
+  bool closed;
+  // set by the VM cleanup: no more events, only native teardown remains
+  bool released;
+};
+
+typedef struct net_server_s {
+  uv_tcp_t tcp;
+  veil_cleanup_t cleanup;
+  veil_vm_t* vm;
+  JSValue object;
+  bool open;
+  bool closing;
+  bool released;
+} net_server_t;
+
+static JSClassID socket_class_id;
+static JSClassID server_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static int net_module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue net_create_server(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue net_connect(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue net_is_ip(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static JSValue socket_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue socket_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue socket_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue socket_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue socket_set_no_delay(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue socket_set_keep_alive(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue socket_address(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue socket_get(JSContext* ctx, JSValueConst this_val, int magic);
+static void socket_finalizer(JSRuntime* rt, JSValue val);
+
+static JSValue server_listen(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue server_close(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue server_address(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue server_listening(JSContext* ctx, JSValueConst this_val);
+static void server_finalizer(JSRuntime* rt, JSValue val);
+
+static veil_net_t* get_net(veil_vm_t* vm);
+static net_socket_t* socket_new(JSContext* ctx, JSValue* object);
+static void socket_start_reading(net_socket_t* socket);
+static bool socket_queue(JSContext* ctx, net_socket_t* socket, JSValueConst data, JSValueConst callback);
+static void socket_schedule(net_socket_t* socket);
+static void socket_flush(net_socket_t* socket);
+static void socket_unlink(net_socket_t* socket);
+static void socket_fail(net_socket_t* socket, int err, const char* syscall);
+static void socket_destroy_now(net_socket_t* socket);
+static void socket_release(net_socket_t* socket);
+static void release_chunks(JSContext* ctx, net_chunk_t* chunks, uint32_t count);
+static void resolve_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res);
+static void connect_cb(uv_connect_t* req, int status);
+static void write_cb(uv_write_t* req, int status);
+static void shutdown_cb(uv_shutdown_t* req, int status);
+static void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+static void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+static void socket_close_cb(uv_handle_t* handle);
+static void socket_cleanup_cb(veil_cleanup_t* cleanup);
+
+static void connection_cb(uv_stream_t* stream, int status);
+static void server_close_cb(uv_handle_t* handle);
+static void server_cleanup_cb(veil_cleanup_t* cleanup);
+static JSValue emit_listening(JSContext* ctx, int argc, JSValueConst* argv);
+
+static void* slab_acquire(veil_net_t* net);
+static void slab_release(veil_net_t* net, void* slab);
+static JSValue new_read_buffer(net_socket_t* socket, char* slab, size_t size);
+
+static bool get_port(JSContext* ctx, JSValueConst value, int* out);
+static bool get_host(JSContext* ctx, JSValueConst value, const char* fallback, cstr* out);
+static int parse_ip(const char* host, int port, struct sockaddr_storage* out);
+static int set_reuse_port(uv_tcp_t* tcp);
+static void emit_error(JSContext* ctx, JSValueConst obj, int err, const char* syscall);
+
+enum {
+  SOCKET_REMOTE_ADDRESS,
+  SOCKET_REMOTE_PORT,
+  SOCKET_REMOTE_FAMILY,
+  SOCKET_BYTES_READ,
+  SOCKET_BYTES_WRITTEN,
+  SOCKET_WRITABLE_LENGTH,
+  SOCKET_WRITABLE_HIGH_WATER_MARK,
+  SOCKET_WRITABLE_NEED_DRAIN,
+  SOCKET_CONNECTING,
+  SOCKET_DESTROYED,
+};
+
+static const JSClassDef SOCKET_CLASS = {
+  "Socket",
+  .finalizer = socket_finalizer,
+};
+
+static const JSClassDef SERVER_CLASS = {
+  "Server",
+  .finalizer = server_finalizer,
+};
+
+static const JSCFunctionListEntry SOCKET_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("write", 2, socket_write),
+  JS_CFUNC_DEF("end", 2, socket_end),
+  JS_CFUNC_DEF("destroy", 0, socket_destroy),
+  JS_CFUNC_MAGIC_DEF("pause", 0, socket_pause, true),
+  JS_CFUNC_MAGIC_DEF("resume", 0, socket_pause, false),
+  JS_CFUNC_DEF("setNoDelay", 1, socket_set_no_delay),
+  JS_CFUNC_DEF("setKeepAlive", 2, socket_set_keep_alive),
+  JS_CFUNC_DEF("address", 0, socket_address),
+  JS_CGETSET_MAGIC_DEF("remoteAddress", socket_get, NULL, SOCKET_REMOTE_ADDRESS),
+  JS_CGETSET_MAGIC_DEF("remotePort", socket_get, NULL, SOCKET_REMOTE_PORT),
+  JS_CGETSET_MAGIC_DEF("remoteFamily", socket_get, NULL, SOCKET_REMOTE_FAMILY),
+  JS_CGETSET_MAGIC_DEF("bytesRead", socket_get, NULL, SOCKET_BYTES_READ),
+  JS_CGETSET_MAGIC_DEF("bytesWritten", socket_get, NULL, SOCKET_BYTES_WRITTEN),
+  JS_CGETSET_MAGIC_DEF("writableLength", socket_get, NULL, SOCKET_WRITABLE_LENGTH),
+  JS_CGETSET_MAGIC_DEF("writableHighWaterMark", socket_get, NULL, SOCKET_WRITABLE_HIGH_WATER_MARK),
+  JS_CGETSET_MAGIC_DEF("writableNeedDrain", socket_get, NULL, SOCKET_WRITABLE_NEED_DRAIN),
+  JS_CGETSET_MAGIC_DEF("connecting", socket_get, NULL, SOCKET_CONNECTING),
+  JS_CGETSET_MAGIC_DEF("destroyed", socket_get, NULL, SOCKET_DESTROYED),
+};
+
+static const JSCFunctionListEntry SERVER_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("listen", 3, server_listen),
+  JS_CFUNC_DEF("close", 1, server_close),
+  JS_CFUNC_DEF("address", 0, server_address),
+  JS_CGETSET_DEF("listening", server_listening, NULL),
+};
+
+static const JSCFunctionListEntry NET[] = {
+  JS_CFUNC_DEF("createServer", 2, net_create_server),
+  JS_CFUNC_DEF("connect", 3, net_connect),
+  JS_CFUNC_DEF("createConnection", 3, net_connect),
+  JS_CFUNC_DEF("isIP", 1, net_is_ip),
+};
+
+JSModuleDef* veil_net_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, net_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, NET, countof(NET));
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+void veil_net_flush(veil_vm_t* vm) {
+  veil_net_t* net = vm->net;
+  net_socket_t* socket;
+
+  if (!net) {
+    return;
+  }
+
+  // flushing can emit errors, and listeners can write to other sockets
+  while ((socket = net->flush_head)) {
+    net->flush_head = socket->next_flush;
+    socket->next_flush = NULL;
+    socket->flush_queued = false;
+    socket_flush(socket);
+  }
+}
+
+void veil_net_free(veil_net_t* net) {
+  if (!net) {
+    return;
+  }
+
+  for (uint32_t n = 0; n < net->slab_count; n++) {
+    free(net->slabs[n]);
+  }
+  free(net);
+}
+
+// listen(port[, host][, backlog][, callback]) or listen(options[, callback]),
+// where options are { port, host, backlog, reusePort }
+bool veil_net_parse_listen(JSContext* ctx, int argc, JSValueConst* argv, veil_net_listen_t* out) {
+  JSValueConst options = argc > 0 ? argv[0] : JS_UNDEFINED;
+  JSValue port_arg;
+  JSValue host_arg;
+  JSValue value;
+  int32_t backlog = NET_DEFAULT_BACKLOG;
+  cstr host;
+  int port;
+  int err;
+
+  out->reuse_port = false;
+
+  if (JS_IsObject(options) && !JS_IsFunction(ctx, options)) {
+    port_arg = JS_GetPropertyStr(ctx, options, "port");
+    host_arg = JS_GetPropertyStr(ctx, options, "host");
+    value = JS_GetPropertyStr(ctx, options, "backlog");
+    if (!JS_IsUndefined(value) && JS_ToInt32(ctx, &backlog, value) < 0) {
+      JS_FreeValue(ctx, value);
+      JS_FreeValue(ctx, port_arg);
+      JS_FreeValue(ctx, host_arg);
+      return false;
+    }
+    JS_FreeValue(ctx, value);
+    value = JS_GetPropertyStr(ctx, options, "reusePort");
+    out->reuse_port = JS_ToBool(ctx, value);
+    JS_FreeValue(ctx, value);
+  } else {
+    port_arg = JS_IsFunction(ctx, options) ? JS_UNDEFINED : JS_DupValue(ctx, options);
+    host_arg = argc > 1 && JS_IsString(argv[1]) ? JS_DupValue(ctx, argv[1]) : JS_UNDEFINED;
+    for (int n = 1; n < argc && n < 3; n++) {
+      if (JS_IsNumber(argv[n]) && JS_ToInt32(ctx, &backlog, argv[n]) < 0) {
+        JS_FreeValue(ctx, port_arg);
+        JS_FreeValue(ctx, host_arg);
+        return false;
+      }
+    }
+  }
+
+  if (!get_port(ctx, port_arg, &port) || !get_host(ctx, host_arg, "0.0.0.0", &host)) {
+    JS_FreeValue(ctx, port_arg);
+    JS_FreeValue(ctx, host_arg);
+    return false;
+  }
+  JS_FreeValue(ctx, port_arg);
+  JS_FreeValue(ctx, host_arg);
+
+  err = parse_ip(cstr_str(&host), port, &out->addr);
+  if (err) {
+    JS_ThrowTypeError(ctx, "listen address '%s' is not an IP address", cstr_str(&host));
+  }
+  cstr_drop(&host);
+  out->backlog = backlog;
+
+  return err == 0;
+}
+
+// tcp must have been created with uv_tcp_init_ex() for the address family, so
+// that socket options can be set before bind. Cluster workers always share
+// their ports.
+int veil_net_listen(uv_tcp_t* tcp, const veil_net_listen_t* listen, uv_connection_cb cb) {
+  int err = listen->reuse_port || veil_cluster_worker_id() > 0 ? set_reuse_port(tcp) : 0;
+
+  if (!err) {
+    err = uv_tcp_bind(tcp, (const struct sockaddr*) &listen->addr, 0);
+  }
+  if (!err) {
+    err = uv_listen((uv_stream_t*) tcp, listen->backlog, cb);
+  }
+
+  return err;
+}
+
+JSValue veil_net_new_address(JSContext* ctx, const struct sockaddr_storage* addr) {
+  JSValue result = JS_NewObject(ctx);
+  char name[INET6_ADDRSTRLEN];
+  int port;
+
+  if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) addr;
+
+    uv_ip6_name(in6, name, sizeof(name));
+    port = ntohs(in6->sin6_port);
+  } else {
+    const struct sockaddr_in* in = (const struct sockaddr_in*) addr;
+
+    uv_ip4_name(in, name, sizeof(name));
+    port = ntohs(in->sin_port);
+  }
+
+  JS_SetPropertyStr(ctx, result, "address", JS_NewString(ctx, name));
+  JS_SetPropertyStr(ctx, result, "family", JS_NewString(ctx, addr->ss_family == AF_INET6 ? "IPv6" : "IPv4"));
+  JS_SetPropertyStr(ctx, result, "port", JS_NewInt32(ctx, port));
+
+  return result;
+}
+
+void* veil_net_slab_acquire(veil_vm_t* vm, size_t* size) {
+  *size = NET_SLAB_SIZE;
+
+  return slab_acquire(get_net(vm));
+}
+
+void veil_net_slab_release(veil_vm_t* vm, void* slab) {
+  slab_release(get_net(vm), slab);
+}
+
+static void global_init() {
+  JS_NewClassID(&socket_class_id);
+  JS_NewClassID(&server_class_id);
+}
+
+static int net_module_init(JSContext* ctx, JSModuleDef* m) {
+  JSRuntime* rt = JS_GetRuntime(ctx);
+  JSValue proto;
+  JSValue net;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, socket_class_id)) {
+    JS_NewClass(rt, socket_class_id, &SOCKET_CLASS);
+    JS_NewClass(rt, server_class_id, &SERVER_CLASS);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, SOCKET_PROTO, countof(SOCKET_PROTO));
+  JS_SetClassProto(ctx, socket_class_id, proto);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, SERVER_PROTO, countof(SERVER_PROTO));
+  JS_SetClassProto(ctx, server_class_id, proto);
+
+  net = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, net, NET, countof(NET));
+
+  JS_SetModuleExportList(ctx, m, NET, countof(NET));
+  JS_SetModuleExport(ctx, m, "default", net);
+
+  return 0;
+}
+
+static JSValue net_create_server(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  net_server_t* server;
+  JSValue obj;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "net requires an event loop");
+  }
+
+  obj = JS_NewObjectClass(ctx, server_class_id);
+  if (JS_IsException(obj)) {
+    return obj;
+  }
+
+  server = calloc(1, sizeof(net_server_t));
+  CHECK_NOT_NULL(server);
+  server->vm = vm;
+  server->object = JS_UNDEFINED;
+  JS_SetOpaque(obj, server);
+
+  // createServer([options], [connectionListener])
+  for (int n = 0; n < argc && n < 2; n++) {
+    if (JS_IsFunction(ctx, argv[n])) {
+      veil_emitter_on(ctx, obj, "connection", argv[n]);
+      break;
+    }
+  }
+
+  return obj;
+}
+
+static JSValue net_connect(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  struct sockaddr_storage addr;
+  struct addrinfo hints;
+  net_socket_t* socket;
+  JSValueConst options = argc > 0 ? argv[0] : JS_UNDEFINED;
+  JSValueConst host_arg = argc > 1 ? argv[1] : JS_UNDEFINED;
+  JSValue port_arg;
+  JSValue value;
+  JSValue obj;
+  cstr host;
+  cstr service;
+  int port;
+  int err;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "net requires an event loop");
+  }
+
+  // connect(port[, host][, listener]) or connect({ port, host }[, listener])
+  if (JS_IsObject(options)) {
+    port_arg = JS_GetPropertyStr(ctx, options, "port");
+    value = JS_GetPropertyStr(ctx, options, "host");
+  } else {
+    port_arg = JS_DupValue(ctx, options);
+    value = JS_IsFunction(ctx, host_arg) ? JS_UNDEFINED : JS_DupValue(ctx, host_arg);
+  }
+
+  if (!get_port(ctx, port_arg, &port) || !get_host(ctx, value, "localhost", &host)) {
+    JS_FreeValue(ctx, port_arg);
+    JS_FreeValue(ctx, value);
+    return JS_EXCEPTION;
+  }
+  JS_FreeValue(ctx, port_arg);
+  JS_FreeValue(ctx, value);
+
+  socket = socket_new(ctx, &obj);
+  if (!socket) {
+    cstr_drop(&host);
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    veil_emitter_on(ctx, obj, "connect", argv[argc - 1]);
+  }
+
+  socket->connecting = true;
+  socket->port = port;
+
+  // IP literals skip the resolver and its threadpool round trip
+  if (parse_ip(cstr_str(&host), port, &addr) == 0) {
+    err = uv_tcp_connect(&socket->connect, &socket->tcp, (const struct sockaddr*) &addr, connect_cb);
+    if (err) {
+      socket_fail(socket, err, "connect");
+    }
+    cstr_drop(&host);
+    return obj;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  service = cstr_from_fmt("%d", port);
+
+  err = uv_getaddrinfo(&vm->uv->loop, &socket->resolve, resolve_cb, cstr_str(&host), cstr_str(&service), &hints);
+  if (err) {
+    socket_fail(socket, err, "getaddrinfo");
+  } else {
+    socket->resolving = true;
+  }
+
+  cstr_drop(&service);
+  cstr_drop(&host);
+
+  return obj;
+}
+
+static JSValue net_is_ip(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  struct sockaddr_storage addr;
+  const char* str;
+  int version = 0;
+
+  if (argc < 1 || !JS_IsString(argv[0])) {
+    return JS_NewInt32(ctx, 0);
+  }
+
+  str = JS_ToCString(ctx, argv[0]);
+  if (!str) {
+    return JS_EXCEPTION;
+  }
+
+  if (parse_ip(str, 0, &addr) == 0) {
+    version = addr.ss_family == AF_INET6 ? 6 : 4;
+  }
+  JS_FreeCString(ctx, str);
+
+  return JS_NewInt32(ctx, version);
+}
+
+static JSValue socket_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+  JSValueConst callback = JS_UNDEFINED;
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  if (socket->closing || socket->ending) {
+    return JS_ThrowTypeError(ctx, "write after end");
+  }
+
+  // write(data[, encoding][, callback]); only UTF-8 strings are supported
+  if (argc > 1 && JS_IsFunction(ctx, argv[argc - 1])) {
+    callback = argv[argc - 1];
+  }
+
+  if (!socket_queue(ctx, socket, argc > 0 ? argv[0] : JS_UNDEFINED, callback)) {
+    return JS_EXCEPTION;
+  }
+
+  if (socket->writable_length >= NET_HIGH_WATER_MARK) {
+    socket->need_drain = true;
+    return JS_FALSE;
+  }
+
+  return JS_TRUE;
+}
+
+static JSValue socket_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  if (socket->closing || socket->ending) {
+    return JS_DupValue(ctx, this_val);
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    veil_emitter_on(ctx, this_val, "finish", argv[--argc]);
+  }
+
+  if (argc > 0 && !JS_IsUndefined(argv[0]) && !JS_IsNull(argv[0])
+      && !socket_queue(ctx, socket, argv[0], JS_UNDEFINED)) {
+    return JS_EXCEPTION;
+  }
+
+  // the shutdown goes out behind the queued writes at the next flush
+  socket->ending = true;
+  socket_schedule(socket);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue socket_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && JS_IsObject(argv[0]) && !socket->closing) {
+    socket->had_error = true;
+    veil_emitter_emit(ctx, this_val, "error", 1, argv);
+  }
+
+  socket_destroy_now(socket);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue socket_pause(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  // stopping the read leaves data in the kernel buffer, which in turn
+  // closes the peer's TCP window
+  if (magic && !socket->paused) {
+    socket->paused = true;
+    if (!socket->closing && !socket->connecting) {
+      uv_read_stop((uv_stream_t*) &socket->tcp);
+    }
+  } else if (!magic && socket->paused) {
+    socket->paused = false;
+    socket_start_reading(socket);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue socket_set_no_delay(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+  bool enable = argc < 1 || JS_ToBool(ctx, argv[0]);
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  if (!socket->closing) {
+    uv_tcp_nodelay(&socket->tcp, enable);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue socket_set_keep_alive(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+  bool enable = argc > 0 && JS_ToBool(ctx, argv[0]);
+  int32_t delay_ms = 0;
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 1 && JS_ToInt32(ctx, &delay_ms, argv[1]) < 0) {
+    return JS_EXCEPTION;
+  }
+
+  if (!socket->closing) {
+    uv_tcp_keepalive(&socket->tcp, enable, delay_ms > 0 ? (unsigned int) (delay_ms / 1000) : 0);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue socket_address(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+  struct sockaddr_storage addr;
+  int size = sizeof(addr);
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  if (socket->closing || uv_tcp_getsockname(&socket->tcp, (struct sockaddr*) &addr, &size) != 0) {
+    return JS_NewObject(ctx);
+  }
+
+  return veil_net_new_address(ctx, &addr);
+}
+
+static JSValue socket_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  net_socket_t* socket = JS_GetOpaque2(ctx, this_val, socket_class_id);
+  struct sockaddr_storage addr;
+  int size = sizeof(addr);
+  JSValue address;
+  JSValue value;
+
+  if (!socket) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case SOCKET_REMOTE_ADDRESS:
+    case SOCKET_REMOTE_PORT:
+    case SOCKET_REMOTE_FAMILY:
+      if (socket->closing || uv_tcp_getpeername(&socket->tcp, (struct sockaddr*) &addr, &size) != 0) {
+        return JS_UNDEFINED;
+      }
+      address = veil_net_new_address(ctx, &addr);
+      value = JS_GetPropertyStr(ctx, address,
+          magic == SOCKET_REMOTE_ADDRESS ? "address" : magic == SOCKET_REMOTE_PORT ? "port" : "family");
+      JS_FreeValue(ctx, address);
+      return value;
+    case SOCKET_BYTES_READ:
+      return JS_NewInt64(ctx, (int64_t) socket->bytes_read);
+    case SOCKET_BYTES_WRITTEN:
+      return JS_NewInt64(ctx, (int64_t) socket->bytes_written);
+    case SOCKET_WRITABLE_LENGTH:
+      return JS_NewInt64(ctx, (int64_t) socket->writable_length);
+    case SOCKET_WRITABLE_HIGH_WATER_MARK:
+      return JS_NewInt32(ctx, NET_HIGH_WATER_MARK);
+    case SOCKET_WRITABLE_NEED_DRAIN:
+      return JS_NewBool(ctx, socket->need_drain);
+    case SOCKET_CONNECTING:
+      return JS_NewBool(ctx, socket->connecting);
+    case SOCKET_DESTROYED:
+      return JS_NewBool(ctx, socket->closing);
+    default:
+      return JS_UNDEFINED;
+  }
+}
+
+static void socket_finalizer(JSRuntime* rt, JSValue val) {
+  net_socket_t* socket = JS_GetOpaque(val, socket_class_id);
+
+  // the handle holds a reference until it has closed, so only memory is left
+  if (socket) {
+    free(socket->pending);
+    free(socket);
+  }
+}
+
+static JSValue server_listen(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+  veil_net_listen_t listen;
+  int err;
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  if (server->open) {
+    return JS_ThrowTypeError(ctx, "server is already listening");
+  }
+
+  if (!veil_net_parse_listen(ctx, argc, argv, &listen)) {
+    return JS_EXCEPTION;
+  }
+
+  // the socket is created up front so options can be set before bind
+  err = uv_tcp_init_ex(&server->vm->uv->loop, &server->tcp, listen.addr.ss_family);
+  if (err) {
+    return JS_Throw(ctx, veil_builtin_new_uv_error(ctx, err, "listen", NULL));
+  }
+  server->tcp.data = server;
+  server->open = true;
+  server->object = JS_DupValue(ctx, this_val);
+  veil_vm_add_cleanup(server->vm, &server->cleanup, server_cleanup_cb);
+
+  err = veil_net_listen(&server->tcp, &listen, connection_cb);
+  if (err) {
+    server->closing = true;
+    veil_vm_remove_cleanup(&server->cleanup);
+    uv_close((uv_handle_t*) &server->tcp, server_close_cb);
+    return JS_Throw(ctx, veil_builtin_new_uv_error(ctx, err, "listen", NULL));
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    veil_emitter_on(ctx, this_val, "listening", argv[argc - 1]);
+  }
+
+  // node emits 'listening' asynchronously, after listen() has returned
+  JS_EnqueueJob(ctx, emit_listening, 1, &this_val);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue server_close(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[0])) {
+    veil_emitter_on(ctx, this_val, "close", argv[0]);
+  }
+
+  // established connections are left alone, as in node
+  if (server->open && !server->closing) {
+    server->closing = true;
+    veil_vm_remove_cleanup(&server->cleanup);
+    uv_close((uv_handle_t*) &server->tcp, server_close_cb);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue server_address(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  net_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+  struct sockaddr_storage addr;
+  int size = sizeof(addr);
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  if (!server->open || server->closing
+      || uv_tcp_getsockname(&server->tcp, (struct sockaddr*) &addr, &size) != 0) {
+    return JS_NULL;
+  }
+
+  return veil_net_new_address(ctx, &addr);
+}
+
+static JSValue server_listening(JSContext* ctx, JSValueConst this_val) {
+  net_server_t* server = JS_GetOpaque2(ctx, this_val, server_class_id);
+
+  if (!server) {
+    return JS_EXCEPTION;
+  }
+
+  return JS_NewBool(ctx, server->open && !server->closing);
+}
+
+static void server_finalizer(JSRuntime* rt, JSValue val) {
+  free(JS_GetOpaque(val, server_class_id));
+}
+
+static veil_net_t* get_net(veil_vm_t* vm) {
+  if (!vm->net) {
+    vm->net = calloc(1, sizeof(veil_net_t));
+    CHECK_NOT_NULL(vm->net);
+  }
+
+  return vm->net;
+}
+
+static net_socket_t* socket_new(JSContext* ctx, JSValue* object) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  net_socket_t* socket;
+  JSValue obj = JS_NewObjectClass(ctx, socket_class_id);
+
+  if (JS_IsException(obj)) {
+    return NULL;
+  }
+
+  socket = calloc(1, sizeof(net_socket_t));
+  CHECK_NOT_NULL(socket);
+  socket->vm = vm;
+  socket->net = get_net(vm);
+  CHECK_OK(uv_tcp_init(&vm->uv->loop, &socket->tcp));
+  socket->tcp.data = socket;
+  socket->object = JS_DupValue(ctx, obj);
+  JS_SetOpaque(obj, socket);
+  veil_vm_add_cleanup(vm, &socket->cleanup, socket_cleanup_cb);
+
+  *object = obj;
+
+  return socket;
+}
+
+static void socket_start_reading(net_socket_t* socket) {
+  int err;
+
+  if (socket->paused || socket->connecting || socket->closing || socket->eof) {
+    return;
+  }
+
+  err = uv_read_start((uv_stream_t*) &socket->tcp, alloc_cb, read_cb);
+  if (err) {
+    socket_fail(socket, err, "read");
+  }
+}
+
+static bool socket_queue(JSContext* ctx, net_socket_t* socket, JSValueConst data, JSValueConst callback) {
+  net_chunk_t chunk = { uv_buf_init(NULL, 0), JS_UNDEFINED, NULL, JS_UNDEFINED };
+  uint8_t* bytes;
+  size_t size;
+
+  if (JS_IsString(data)) {
+    chunk.str = JS_ToCStringLen(ctx, &size, data);
+    if (!chunk.str) {
+      return false;
+    }
+    chunk.buf = uv_buf_init((char*) chunk.str, size);
+  } else if (veil_builtin_get_bytes(ctx, data, &bytes, &size)) {
+    chunk.keep = JS_DupValue(ctx, data);
+    chunk.buf = uv_buf_init((char*) bytes, size);
+  } else {
+    return false;
+  }
+  chunk.callback = JS_DupValue(ctx, callback);
+
+  if (socket->pending_count == socket->pending_capacity) {
+    socket->pending_capacity = socket->pending_capacity ? socket->pending_capacity * 2 : 8;
+    socket->pending = realloc(socket->pending, socket->pending_capacity * sizeof(net_chunk_t));
+    CHECK_NOT_NULL(socket->pending);
+  }
+  socket->pending[socket->pending_count++] = chunk;
+  socket->writable_length += size;
+
+  socket_schedule(socket);
+
+  return true;
+}
+
+static void socket_schedule(net_socket_t* socket) {
+  if (!socket->flush_queued) {
+    socket->next_flush = socket->net->flush_head;
+    socket->net->flush_head = socket;
+    socket->flush_queued = true;
+  }
+}
+
+static void socket_flush(net_socket_t* socket) {
+  uv_buf_t stack_bufs[NET_STACK_BUFS];
+  uv_buf_t* bufs;
+  net_write_t* write;
+  int err;
+
+  // connect_cb queues the socket again once the connection is up
+  if (socket->closing || socket->connecting) {
+    return;
+  }
+
+  if (socket->pending_count > 0) {
+    write = calloc(1, sizeof(net_write_t));
+    CHECK_NOT_NULL(write);
+    write->socket = socket;
+    write->chunks = socket->pending;
+    write->count = socket->pending_count;
+    socket->pending = NULL;
+    socket->pending_count = 0;
+    socket->pending_capacity = 0;
+
+    // uv_write copies the array, so it only has to outlive the call
+    bufs = write->count > NET_STACK_BUFS ? malloc(write->count * sizeof(uv_buf_t)) : stack_bufs;
+    CHECK_NOT_NULL(bufs);
+    for (uint32_t n = 0; n < write->count; n++) {
+      bufs[n] = write->chunks[n].buf;
+      write->size += write->chunks[n].buf.len;
+    }
+
+    err = uv_write(&write->req, (uv_stream_t*) &socket->tcp, bufs, write->count, write_cb);
+    if (bufs != stack_bufs) {
+      free(bufs);
+    }
+
+    if (err) {
+      socket->writable_length -= write->size;
+      release_chunks(socket->vm->context, write->chunks, write->count);
+      free(write);
+      socket_fail(socket, err, "write");
+      return;
+    }
+  }
+
+  if (socket->ending && !socket->shutdown_sent) {
+    socket->shutdown_sent = true;
+    err = uv_shutdown(&socket->shutdown, (uv_stream_t*) &socket->tcp, shutdown_cb);
+    if (err) {
+      socket_fail(socket, err, "shutdown");
+    }
+  }
+}
+
+static void socket_unlink(net_socket_t* socket) {
+  net_socket_t** link;
+
+  if (!socket->flush_queued) {
+    return;
+  }
+
+  for (link = &socket->net->flush_head; *link; link = &(*link)->next_flush) {
+    if (*link == socket) {
+      *link = socket->next_flush;
+      break;
+    }
+  }
+  socket->next_flush = NULL;
+  socket->flush_queued = false;
+}
+
+static void socket_fail(net_socket_t* socket, int err, const char* syscall) {
+  if (socket->closing) {
+    return;
+  }
+
+  socket->had_error = true;
+  if (!socket->released) {
+    emit_error(socket->vm->context, socket->object, err, syscall);
+  }
+  socket_destroy_now(socket);
+}
+
+static void socket_destroy_now(net_socket_t* socket) {
+  if (socket->closing) {
+    return;
+  }
+
+  socket->closing = true;
+  socket_unlink(socket);
+  for (uint32_t n = 0; n < socket->pending_count; n++) {
+    socket->writable_length -= socket->pending[n].buf.len;
+  }
+  release_chunks(socket->vm->context, socket->pending, socket->pending_count);
+  socket->pending_count = 0;
+  veil_vm_remove_cleanup(&socket->cleanup);
+
+  // in-flight writes and the shutdown complete with UV_ECANCELED first
+  if (socket->resolving) {
+    uv_cancel((uv_req_t*) &socket->resolve);
+  }
+  uv_close((uv_handle_t*) &socket->tcp, socket_close_cb);
+}
+
+static void socket_release(net_socket_t* socket) {
+  JSValue object = socket->object;
+
+  // the last reference can run the finalizer, which frees socket
+  if (socket->closed && !socket->resolving) {
+    socket->object = JS_UNDEFINED;
+    JS_FreeValue(socket->vm->context, object);
+  }
+}
+
+static void release_chunks(JSContext* ctx, net_chunk_t* chunks, uint32_t count) {
+  for (uint32_t n = 0; n < count; n++) {
+    JS_FreeValue(ctx, chunks[n].keep);
+    JS_FreeValue(ctx, chunks[n].callback);
+    JS_FreeCString(ctx, chunks[n].str);
+  }
+}
+
+static void resolve_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+  net_socket_t* socket = container_of(req, net_socket_t, resolve);
+  int err = status;
+
+  socket->resolving = false;
+
+  if (socket->closing) {
+    uv_freeaddrinfo(res);
+    socket_release(socket);
+    return;
+  }
+
+  if (!err) {
+    err = uv_tcp_connect(&socket->connect, &socket->tcp, res->ai_addr, connect_cb);
+  }
+  uv_freeaddrinfo(res);
+
+  if (err) {
+    socket_fail(socket, err, status ? "getaddrinfo" : "connect");
+  }
+}
+
+static void connect_cb(uv_connect_t* req, int status) {
+  net_socket_t* socket = container_of(req, net_socket_t, connect);
+
+  socket->connecting = false;
+
+  if (socket->closing) {
+    return;
+  }
+
+  if (status) {
+    socket_fail(socket, status, "connect");
+    return;
+  }
+
+  socket_start_reading(socket);
+  veil_emitter_emit(socket->vm->context, socket->object, "connect", 0, NULL);
+
+  // writes made while connecting were held back
+  if ((socket->pending_count || socket->ending) && !socket->closing) {
+    socket_schedule(socket);
+  }
+}
+
+static void write_cb(uv_write_t* req, int status) {
+  net_write_t* write = container_of(req, net_write_t, req);
+  net_socket_t* socket = write->socket;
+  JSContext* ctx = socket->vm->context;
+  JSValue error = JS_UNDEFINED;
+
+  socket->writable_length -= write->size;
+  if (status == 0) {
+    socket->bytes_written += write->size;
+  }
+
+  if (!socket->released) {
+    if (status) {
+      error = veil_builtin_new_uv_error(ctx, status, "write", NULL);
+    }
+
+    for (uint32_t n = 0; n < write->count; n++) {
+      if (JS_IsFunction(ctx, write->chunks[n].callback)) {
+        JSValue result = JS_Call(ctx, write->chunks[n].callback, socket->object, 1, (JSValueConst*) &error);
+
+        if (JS_IsException(result)) {
+          veil_vm_dump_exception(socket->vm);
+        }
+        JS_FreeValue(ctx, result);
+      }
+    }
+  }
+
+  release_chunks(ctx, write->chunks, write->count);
+  free(write->chunks);
+  free(write);
+
+  if (socket->released || socket->closing) {
+    JS_FreeValue(ctx, error);
+    return;
+  }
+
+  if (status) {
+    socket->had_error = true;
+    veil_emitter_emit(ctx, socket->object, "error", 1, (JSValueConst*) &error);
+    JS_FreeValue(ctx, error);
+    socket_destroy_now(socket);
+    return;
+  }
+
+  // as in node, 'drain' waits for the whole buffer rather than the mark
+  if (socket->need_drain && socket->writable_length == 0) {
+    socket->need_drain = false;
+    veil_emitter_emit(ctx, socket->object, "drain", 0, NULL);
+  }
+}
+
+static void shutdown_cb(uv_shutdown_t* req, int status) {
+  net_socket_t* socket = container_of(req, net_socket_t, shutdown);
+
+  if (socket->closing) {
+    return;
+  }
+
+  if (status) {
+    socket_fail(socket, status, "shutdown");
+    return;
+  }
+
+  veil_emitter_emit(socket->vm->context, socket->object, "finish", 0, NULL);
+
+  // both directions are done
+  if (socket->eof && !socket->closing) {
+    socket_destroy_now(socket);
+  }
+}
+
+static void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  net_socket_t* socket = handle->data;
+
+  *buf = uv_buf_init(slab_acquire(socket->net), NET_SLAB_SIZE);
+}
+
+static void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  net_socket_t* socket = stream->data;
+  JSContext* ctx = socket->vm->context;
+  JSValue data;
+
+  if (nread > 0) {
+    socket->bytes_read += (uint64_t) nread;
+    data = new_read_buffer(socket, buf->base, (size_t) nread);
+    if (JS_IsException(data)) {
+      veil_vm_dump_exception(socket->vm);
+      return;
+    }
+    veil_emitter_emit(ctx, socket->object, "data", 1, (JSValueConst*) &data);
+    JS_FreeValue(ctx, data);
+    return;
+  }
+
+  if (buf->base) {
+    slab_release(socket->net, buf->base);
+  }
+
+  if (nread == 0 || socket->closing) {
+    return;
+  }
+
+  if (nread != UV_EOF) {
+    socket_fail(socket, (int) nread, "read");
+    return;
+  }
+
+  socket->eof = true;
+  uv_read_stop(stream);
+  veil_emitter_emit(ctx, socket->object, "end", 0, NULL);
+
+  if (socket->closing) {
+    return;
+  }
+
+  // no half-open sockets: the writable side ends once its queue has drained
+  if (socket->shutdown_sent) {
+    socket_destroy_now(socket);
+  } else if (!socket->ending) {
+    socket->ending = true;
+    socket_schedule(socket);
+  }
+}
+
+static void socket_close_cb(uv_handle_t* handle) {
+  net_socket_t* socket = handle->data;
+  JSValue had_error;
+
+  socket->closed = true;
+
+  if (!socket->released) {
+    had_error = JS_NewBool(socket->vm->context, socket->had_error);
+    veil_emitter_emit(socket->vm->context, socket->object, "close", 1, &had_error);
+  }
+
+  socket_release(socket);
+}
+
+static void socket_cleanup_cb(veil_cleanup_t* cleanup) {
+  net_socket_t* socket = container_of(cleanup, net_socket_t, cleanup);
+
+  socket->released = true;
+  socket_destroy_now(socket);
+}
+
+static void connection_cb(uv_stream_t* stream, int status) {
+  net_server_t* server = stream->data;
+  JSContext* ctx = server->vm->context;
+  net_socket_t* socket;
+  JSValue obj;
+  int err;
+
+  if (status) {
+    emit_error(ctx, server->object, status, "accept");
+    return;
+  }
+
+  socket = socket_new(ctx, &obj);
+  if (!socket) {
+    veil_vm_dump_exception(server->vm);
+    return;
+  }
+
+  err = uv_accept(stream, (uv_stream_t*) &socket->tcp);
+  if (err) {
+    socket->released = true;
+    socket_destroy_now(socket);
+    JS_FreeValue(ctx, obj);
+    emit_error(ctx, server->object, err, "accept");
+    return;
+  }
+
+  socket_start_reading(socket);
+  veil_emitter_emit(ctx, server->object, "connection", 1, (JSValueConst*) &obj);
+  JS_FreeValue(ctx, obj);
+}
+
+static void server_close_cb(uv_handle_t* handle) {
+  net_server_t* server = handle->data;
+  JSContext* ctx = server->vm->context;
+  JSValue object = server->object;
+
+  server->open = false;
+  server->closing = false;
+  server->object = JS_UNDEFINED;
+
+  if (!server->released) {
+    veil_emitter_emit(ctx, object, "close", 0, NULL);
+  }
+
+  // the last reference can run the finalizer, which frees server
+  JS_FreeValue(ctx, object);
+}
+
+static void server_cleanup_cb(veil_cleanup_t* cleanup) {
+  net_server_t* server = container_of(cleanup, net_server_t, cleanup);
+
+  server->released = true;
+  server->closing = true;
+  uv_close((uv_handle_t*) &server->tcp, server_close_cb);
+}
+
+static JSValue emit_listening(JSContext* ctx, int argc, JSValueConst* argv) {
+  net_server_t* server = JS_GetOpaque(argv[0], server_class_id);
+
+  if (server && server->open && !server->closing) {
+    veil_emitter_emit(ctx, argv[0], "listening", 0, NULL);
+  }
+
+  return JS_UNDEFINED;
+}
+
+static void* slab_acquire(veil_net_t* net) {
+  void* slab;
+
+  if (net->slab_count > 0) {
+    return net->slabs[--net->slab_count];
+  }
+
+  slab = malloc(NET_SLAB_SIZE);
+  CHECK_NOT_NULL(slab);
+
+  return slab;
+}
+
+static void slab_release(veil_net_t* net, void* slab) {
+  if (net->slab_count < NET_SLAB_CACHE) {
+    net->slabs[net->slab_count++] = slab;
+  } else {
+    free(slab);
+  }
+}
+
+static JSValue new_read_buffer(net_socket_t* socket, char* slab, size_t size) {
+  JSContext* ctx = socket->vm->context;
+  JSValue buffer;
+
+  if (size < NET_SLAB_ADOPT) {
+    buffer = JS_NewArrayBufferCopy(ctx, (const uint8_t*) slab, size);
+    slab_release(socket->net, slab);
+  } else {
+    // the view covers the bytes read, and the slab leaves the cache as a
+    // shared block that a transfer to another VM can move as it is
+    buffer = veil_shared_adopt_array_buffer(ctx, (uint8_t*) slab, size);
+  }
+
+  return veil_builtin_new_uint8_array(ctx, buffer);
+}
+
+static bool get_port(JSContext* ctx, JSValueConst value, int* out) {
+  int32_t port;
+
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    *out = 0;
+    return true;
+  }
+
+  if (JS_ToInt32(ctx, &port, value) < 0) {
+    return false;
+  }
+
+  if (port < 0 || port > 65535) {
+    JS_ThrowRangeError(ctx, "port should be >= 0 and < 65536");
+    return false;
+  }
+
+  *out = port;
+
+  return true;
+}
+
+static bool get_host(JSContext* ctx, JSValueConst value, const char* fallback, cstr* out) {
+  const char* str;
+
+  if (JS_IsUndefined(value) || JS_IsNull(value)) {
+    *out = cstr_from(fallback);
+    return true;
+  }
+
+  str = JS_ToCString(ctx, value);
+  if (!str) {
+    return false;
+  }
+
+  *out = cstr_from(*str ? str : fallback);
+  JS_FreeCString(ctx, str);
+
+  return true;
+}
+
+static int parse_ip(const char* host, int port, struct sockaddr_storage* out) {
+  memset(out, 0, sizeof(*out));
+
+  if (uv_ip4_addr(host, port, (struct sockaddr_in*) out) == 0) {
+    return 0;
+  }
+
+  return uv_ip6_addr(host, port, (struct sockaddr_in6*) out);
+}
+
+// SO_REUSEPORT lets several processes bind the same address; the kernel then
+// picks an accept queue for each incoming connection by hashing its address.
+static int set_reuse_port(uv_tcp_t* tcp) {
+#ifdef SO_REUSEPORT
+  uv_os_fd_t fd;
+  int on = 1;
+  int err = uv_fileno((const uv_handle_t*) tcp, &fd);
+
+  if (err) {
+    return err;
+  }
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+    return uv_translate_sys_error(errno);
+  }
+
+  return 0;
+#else
+  return UV_ENOTSUP;
+#endif
+}
+
+static void emit_error(JSContext* ctx, JSValueConst obj, int err, const char* syscall) {
+  JSValue error = veil_builtin_new_uv_error(ctx, err, syscall, NULL);
+
+  // an unhandled 'error' must not pass silently
+  if (!veil_emitter_emit(ctx, obj, "error", 1, (JSValueConst*) &error)) {
+    JS_Throw(ctx, error);
+    veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+    return;
+  }
+
+  JS_FreeValue(ctx, error);
+}
@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <math.h>
+
+#define DELAY_DEFAULT_RESOLUTION_MS 10
+
+// backs monitorEventLoopDelay(): a repeating timer whose actual interval is
+// recorded on every tick, so loop stalls show up as long intervals
+typedef struct delay_monitor_s {
+  veil_cleanup_t cleanup;
+  uv_timer_t timer;
+  // timer initialized and not yet closing
+  bool open;
+  bool closing;
+  // the owning JS object has been finalized
+  bool orphan;
+  bool enabled;
+  uint64_t resolution_ms;
+  uint64_t prev;
+  veil_histogram_t histogram;
+} delay_monitor_t;
+
+static JSClassID delay_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static const double PERCENTILES[] = { 0, 50, 75, 90, 99, 99.9, 100 };
+
+static void global_init();
+static int module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue performance_now(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue performance_elu(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue monitor_event_loop_delay(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static JSValue delay_enable(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue delay_reset(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue delay_percentile(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue delay_get(JSContext* ctx, JSValueConst this_val, int magic);
+static JSValue delay_percentiles(JSContext* ctx, JSValueConst this_val);
+static void delay_finalizer(JSRuntime* rt, JSValue val);
+static void delay_timer_cb(uv_timer_t* handle);
+static void delay_close(delay_monitor_t* monitor);
+static void delay_close_cb(uv_handle_t* handle);
+static void delay_cleanup_cb(veil_cleanup_t* cleanup);
+
+static bool read_utilization(JSContext* ctx, JSValueConst value, double* idle, double* active);
+static JSValue new_utilization(JSContext* ctx, double idle, double active);
+
+enum {
+  DELAY_MIN,
+  DELAY_MAX,
+  DELAY_MEAN,
+  DELAY_STDDEV,
+  DELAY_COUNT,
+};
+
+static const JSClassDef DELAY_CLASS = {
+  "IntervalHistogram",
+  .finalizer = delay_finalizer,
+};
+
+static const JSCFunctionListEntry DELAY_PROTO[] = {
+  JS_CFUNC_MAGIC_DEF("enable", 0, delay_enable, 1),
+  JS_CFUNC_MAGIC_DEF("disable", 0, delay_enable, 0),
+  JS_CFUNC_DEF("reset", 0, delay_reset),
+  JS_CFUNC_DEF("percentile", 1, delay_percentile),
+  JS_CGETSET_MAGIC_DEF("min", delay_get, NULL, DELAY_MIN),
+  JS_CGETSET_MAGIC_DEF("max", delay_get, NULL, DELAY_MAX),
+  JS_CGETSET_MAGIC_DEF("mean", delay_get, NULL, DELAY_MEAN),
+  JS_CGETSET_MAGIC_DEF("stddev", delay_get, NULL, DELAY_STDDEV),
+  JS_CGETSET_MAGIC_DEF("count", delay_get, NULL, DELAY_COUNT),
+  JS_CGETSET_DEF("percentiles", delay_percentiles, NULL),
+};
+
+static const JSCFunctionListEntry PERFORMANCE[] = {
+  JS_CFUNC_DEF("now", 0, performance_now),
+  JS_CFUNC_DEF("eventLoopUtilization", 2, performance_elu),
+};
+
+JSModuleDef* veil_perf_hooks_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, module_init);
+
+  if (m) {
+    JS_AddModuleExport(ctx, m, "performance");
+    JS_AddModuleExport(ctx, m, "monitorEventLoopDelay");
+  }
+
+  return m;
+}
+
+static void global_init() {
+  JS_NewClassID(&delay_class_id);
+}
+
+static int module_init(JSContext* ctx, JSModuleDef* m) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  JSRuntime* rt = JS_GetRuntime(ctx);
+  JSValue performance;
+  JSValue proto;
+  uv_timeval64_t now;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, delay_class_id)) {
+    JS_NewClass(rt, delay_class_id, &DELAY_CLASS);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, DELAY_PROTO, countof(DELAY_PROTO));
+  JS_SetClassProto(ctx, delay_class_id, proto);
+
+  performance = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, performance, PERFORMANCE, countof(PERFORMANCE));
+
+  // wall clock time at which the VM's monotonic clock started
+  CHECK_OK(uv_gettimeofday(&now));
+  JS_SetPropertyStr(ctx, performance, "timeOrigin", JS_NewFloat64(ctx,
+      (double) now.tv_sec * 1e3 + (double) now.tv_usec / 1e3 - (double) (uv_hrtime() - vm->time_origin) / 1e6));
+
+  JS_SetModuleExport(ctx, m, "performance", performance);
+  JS_SetModuleExport(ctx, m, "monitorEventLoopDelay",
+      JS_NewCFunction(ctx, monitor_event_loop_delay, "monitorEventLoopDelay", 1));
+
+  return 0;
+}
+
+static JSValue performance_now(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+
+  return JS_NewFloat64(ctx, (double) (uv_hrtime() - vm->time_origin) / 1e6);
+}
+
+static JSValue performance_elu(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_loop_metrics_t metrics;
+  double idle;
+  double active;
+  double prev_idle;
+  double prev_active;
+
+  if (vm->uv) {
+    veil_uv_get_metrics(vm->uv, &metrics);
+  } else {
+    memset(&metrics, 0, sizeof(metrics));
+  }
+
+  idle = (double) metrics.idle_ns / 1e6;
+  active = (double) (metrics.loop_ns - metrics.idle_ns) / 1e6;
+
+  // eventLoopUtilization(u1) is the delta since u1; (u1, u2) is u1 - u2
+  if (argc >= 1 && !JS_IsUndefined(argv[0])) {
+    if (!read_utilization(ctx, argv[0], &prev_idle, &prev_active)) {
+      return JS_EXCEPTION;
+    }
+
+    if (argc >= 2 && !JS_IsUndefined(argv[1])) {
+      idle = prev_idle;
+      active = prev_active;
+
+      if (!read_utilization(ctx, argv[1], &prev_idle, &prev_active)) {
+        return JS_EXCEPTION;
+      }
+    }
+
+    idle -= prev_idle;
+    active -= prev_active;
+  }
+
+  return new_utilization(ctx, idle, active);
+}
+
+static JSValue monitor_event_loop_delay(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  delay_monitor_t* monitor;
+  int64_t resolution = DELAY_DEFAULT_RESOLUTION_MS;
+  JSValue obj;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "monitorEventLoopDelay() requires an event loop");
+  }
+
+  if (argc >= 1 && JS_IsObject(argv[0])) {
+    JSValue value = JS_GetPropertyStr(ctx, argv[0], "resolution");
+
+    if (!JS_IsUndefined(value) && JS_ToInt64(ctx, &resolution, value) < 0) {
+      JS_FreeValue(ctx, value);
+      return JS_EXCEPTION;
+    }
+    JS_FreeValue(ctx, value);
+
+    if (resolution < 1) {
+      return JS_ThrowRangeError(ctx, "resolution must be at least 1 millisecond");
+    }
+  }
+
+  obj = JS_NewObjectClass(ctx, delay_class_id);
+  if (JS_IsException(obj)) {
+    return obj;
+  }
+
+  monitor = calloc(1, sizeof(delay_monitor_t));
+  CHECK_NOT_NULL(monitor);
+  monitor->resolution_ms = (uint64_t) resolution;
+  veil_histogram_init(&monitor->histogram);
+
+  CHECK_OK(uv_timer_init(&vm->uv->loop, &monitor->timer));
+  monitor->timer.data = monitor;
+  // sampling must never keep the process alive
+  uv_unref((uv_handle_t*) &monitor->timer);
+  monitor->open = true;
+  veil_vm_add_cleanup(vm, &monitor->cleanup, delay_cleanup_cb);
+
+  JS_SetOpaque(obj, monitor);
+
+  return obj;
+}
+
+static JSValue delay_enable(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  delay_monitor_t* monitor = JS_GetOpaque2(ctx, this_val, delay_class_id);
+
+  if (!monitor) {
+    return JS_EXCEPTION;
+  }
+
+  if (!monitor->open || monitor->enabled == (bool) magic) {
+    return JS_FALSE;
+  }
+
+  if (magic) {
+    monitor->prev = uv_hrtime();
+    CHECK_OK(uv_timer_start(&monitor->timer, delay_timer_cb, monitor->resolution_ms, monitor->resolution_ms));
+  } else {
+    uv_timer_stop(&monitor->timer);
+  }
+  monitor->enabled = magic;
+
+  return JS_TRUE;
+}
+
+static JSValue delay_reset(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  delay_monitor_t* monitor = JS_GetOpaque2(ctx, this_val, delay_class_id);
+
+  if (!monitor) {
+    return JS_EXCEPTION;
+  }
+
+  veil_histogram_init(&monitor->histogram);
+
+  return JS_UNDEFINED;
+}
+
+static JSValue delay_percentile(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  delay_monitor_t* monitor = JS_GetOpaque2(ctx, this_val, delay_class_id);
+  double percentile;
+
+  if (!monitor || JS_ToFloat64(ctx, &percentile, argv[0]) < 0) {
+    return JS_EXCEPTION;
+  }
+
+  if (!(percentile > 0 && percentile <= 100)) {
+    return JS_ThrowRangeError(ctx, "percentile must be > 0 and <= 100");
+  }
+
+  return JS_NewFloat64(ctx, (double) veil_histogram_percentile(&monitor->histogram, percentile));
+}
+
+static JSValue delay_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  delay_monitor_t* monitor = JS_GetOpaque2(ctx, this_val, delay_class_id);
+  const veil_histogram_t* histogram;
+
+  if (!monitor) {
+    return JS_EXCEPTION;
+  }
+
+  histogram = &monitor->histogram;
+
+  switch (magic) {
+    case DELAY_MIN:
+      // node reports an empty histogram's min as the largest trackable value
+      return JS_NewFloat64(ctx, histogram->count ? (double) histogram->min : 9223372036854776000.0);
+    case DELAY_MAX:
+      return JS_NewFloat64(ctx, (double) histogram->max);
+    case DELAY_MEAN:
+      return JS_NewFloat64(ctx, histogram->count ? veil_histogram_mean(histogram) : NAN);
+    case DELAY_STDDEV:
+      return JS_NewFloat64(ctx, histogram->count ? veil_histogram_stddev(histogram) : NAN);
+    default:
+      return JS_NewFloat64(ctx, (double) histogram->count);
+  }
+}
+
+static JSValue delay_percentiles(JSContext* ctx, JSValueConst this_val) {
+  delay_monitor_t* monitor = JS_GetOpaque2(ctx, this_val, delay_class_id);
+  JSValue global;
+  JSValue map_ctor;
+  JSValue map;
+  JSValue set;
+
+  if (!monitor) {
+    return JS_EXCEPTION;
+  }
+
+  global = JS_GetGlobalObject(ctx);
+  map_ctor = JS_GetPropertyStr(ctx, global, "Map");
+  JS_FreeValue(ctx, global);
+  map = JS_CallConstructor(ctx, map_ctor, 0, NULL);
+  JS_FreeValue(ctx, map_ctor);
+
+  if (JS_IsException(map)) {
+    return map;
+  }
+
+  set = JS_GetPropertyStr(ctx, map, "set");
+
+  for (size_t n = 0; n < countof(PERCENTILES) && monitor->histogram.count; n++) {
+    JSValue args[2] = {
+      JS_NewFloat64(ctx, PERCENTILES[n]),
+      JS_NewFloat64(ctx, (double) veil_histogram_percentile(&monitor->histogram, PERCENTILES[n])),
+    };
+    JSValue result = JS_Call(ctx, set, map, 2, args);
+
+    JS_FreeValue(ctx, result);
+  }
+
+  JS_FreeValue(ctx, set);
+
+  return map;
+}
+
+static void delay_finalizer(JSRuntime* rt, JSValue val) {
+  delay_monitor_t* monitor = JS_GetOpaque(val, delay_class_id);
+
+  if (!monitor) {
+    return;
+  }
+
+  monitor->orphan = true;
+
+  if (monitor->open) {
+    delay_close(monitor);
+  } else if (!monitor->closing) {
+    free(monitor);
+  }
+}
+
+static void delay_timer_cb(uv_timer_t* handle) {
+  delay_monitor_t* monitor = handle->data;
+  uint64_t now = uv_hrtime();
+
+  if (now > monitor->prev) {
+    veil_histogram_record(&monitor->histogram, now - monitor->prev);
+  }
+  monitor->prev = now;
+}
+
+static void delay_close(delay_monitor_t* monitor) {
+  veil_vm_remove_cleanup(&monitor->cleanup);
+  monitor->open = false;
+  monitor->enabled = false;
+  monitor->closing = true;
+  uv_close((uv_handle_t*) &monitor->timer, delay_close_cb);
+}
+
+static void delay_close_cb(uv_handle_t* handle) {
+  delay_monitor_t* monitor = handle->data;
+
+  monitor->closing = false;
+  if (monitor->orphan) {
+    free(monitor);
+  }
+}
+
+static void delay_cleanup_cb(veil_cleanup_t* cleanup) {
+  delay_close(container_of(cleanup, delay_monitor_t, cleanup));
+}
+
+static bool read_utilization(JSContext* ctx, JSValueConst value, double* idle, double* active) {
+  JSValue idle_value;
+  JSValue active_value;
+  bool ok;
+
+  if (!JS_IsObject(value)) {
+    JS_ThrowTypeError(ctx, "expected an eventLoopUtilization() result");
+    return false;
+  }
+
+  idle_value = JS_GetPropertyStr(ctx, value, "idle");
+  active_value = JS_GetPropertyStr(ctx, value, "active");
+  ok = JS_ToFloat64(ctx, idle, idle_value) == 0 && JS_ToFloat64(ctx, active, active_value) == 0;
+  JS_FreeValue(ctx, idle_value);
+  JS_FreeValue(ctx, active_value);
+
+  return ok;
+}
+
+static JSValue new_utilization(JSContext* ctx, double idle, double active) {
+  JSValue result = JS_NewObject(ctx);
+
+  JS_SetPropertyStr(ctx, result, "idle", JS_NewFloat64(ctx, idle));
+  JS_SetPropertyStr(ctx, result, "active", JS_NewFloat64(ctx, active));
+  JS_SetPropertyStr(ctx, result, "utilization", JS_NewFloat64(ctx, idle + active > 0 ? active / (idle + active) : 0));
+
+  return result;
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// Each pooled VM is pinned to a thread of its own, which creates its runtime
+// and runs all of its JS: QuickJS measures stack depth from the thread that
+// created the runtime. Host threads hand a job to the VM's thread and wait
+// for it. A released VM resets on its own thread and only then goes back on
+// the free list, so acquiring never waits on a reset.
+
+#define POOL_STACK_SIZE (8 * 1024 * 1024)
+// the base for module specifiers, which resolve from the working directory
+#define POOL_FILENAME "[pool]"
+
+typedef enum {
+  POOL_JOB_EVAL,
+  POOL_JOB_CALL,
+} pool_job_type_t;
+
+typedef struct pool_job_s {
+  pool_job_type_t type;
+  const char* source;
+  const char* filename;
+  const char* specifier;
+  const char* name;
+  const char* args_json;
+  bool settled;
+  bool ok;
+  char* result;
+  bool done;
+} pool_job_t;
+
+struct veil_pool_vm_s {
+  veil_pool_t* pool;
+  veil_pool_vm_t* next_free;
+  uv_thread_t thread;
+  uv_mutex_t mutex;
+  uv_cond_t wake;
+  uv_cond_t done;
+  pool_job_t* job;
+  bool releasing;
+  bool quit;
+  veil_vm_t vm;
+  veil_uv_t uv;
+};
+
+struct veil_pool_s {
+  const veil_cfg_t* cfg;
+  uv_mutex_t mutex;
+  uv_cond_t available;
+  veil_pool_vm_t* free_list;
+  veil_pool_vm_t* vms;
+  uint32_t size;
+};
+
+// import() in a classic script, with the spread done by the engine
+static const char CALL_SOURCE[] = "(specifier, name, args) => import(specifier).then((ns) => ns[name](...args))";
+
+static bool pool_run(veil_pool_vm_t* pvm, pool_job_t* job, char** result);
+static void pool_put(veil_pool_vm_t* pvm);
+static void pool_main(void* arg);
+static void run_job(veil_pool_vm_t* pvm, pool_job_t* job);
+static JSValue call_export(JSContext* ctx, pool_job_t* job);
+static bool settle(JSContext* ctx, JSValueConst value);
+static JSValue settle_cb(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static void finish(pool_job_t* job, bool ok, char* result);
+static char* to_json(JSContext* ctx, JSValueConst value, bool* ok);
+static char* to_error(JSContext* ctx, JSValueConst error);
+
+veil_pool_t* veil_pool_new(veil_t* veil, uint32_t size) {
+  uv_thread_options_t options = { UV_THREAD_HAS_STACK_SIZE, POOL_STACK_SIZE };
+  veil_pool_t* pool;
+
+  CHECK_NOT_NULL(veil);
+  CHECK_TRUE(size > 0);
+
+  veil->cfg.writable = false;
+
+  pool = calloc(1, sizeof(veil_pool_t));
+  CHECK_NOT_NULL(pool);
+  pool->cfg = &veil->cfg;
+  pool->size = size;
+  CHECK_OK(uv_mutex_init(&pool->mutex));
+  CHECK_OK(uv_cond_init(&pool->available));
+
+  pool->vms = calloc(size, sizeof(veil_pool_vm_t));
+  CHECK_NOT_NULL(pool->vms);
+
+  for (uint32_t n = 0; n < size; n++) {
+    veil_pool_vm_t* pvm = &pool->vms[n];
+
+    pvm->pool = pool;
+    CHECK_OK(uv_mutex_init(&pvm->mutex));
+    CHECK_OK(uv_cond_init(&pvm->wake));
+    CHECK_OK(uv_cond_init(&pvm->done));
+    CHECK_OK(uv_thread_create_ex(&pvm->thread, &options, pool_main, pvm));
+  }
+
+  return pool;
+}
+
+void veil_pool_free(veil_pool_t* pool) {
+  if (!pool) {
+    return;
+  }
+
+  for (uint32_t n = 0; n < pool->size; n++) {
+    veil_pool_vm_t* pvm = &pool->vms[n];
+
+    uv_mutex_lock(&pvm->mutex);
+    pvm->quit = true;
+    uv_cond_signal(&pvm->wake);
+    uv_mutex_unlock(&pvm->mutex);
+  }
+
+  for (uint32_t n = 0; n < pool->size; n++) {
+    veil_pool_vm_t* pvm = &pool->vms[n];
+
+    CHECK_OK(uv_thread_join(&pvm->thread));
+    uv_cond_destroy(&pvm->done);
+    uv_cond_destroy(&pvm->wake);
+    uv_mutex_destroy(&pvm->mutex);
+  }
+
+  uv_cond_destroy(&pool->available);
+  uv_mutex_destroy(&pool->mutex);
+  free(pool->vms);
+  free(pool);
+}
+
+veil_pool_vm_t* veil_pool_acquire(veil_pool_t* pool) {
+  veil_pool_vm_t* pvm;
+
+  CHECK_NOT_NULL(pool);
+
+  uv_mutex_lock(&pool->mutex);
+  while (!pool->free_list) {
+    uv_cond_wait(&pool->available, &pool->mutex);
+  }
+  pvm = pool->free_list;
+  pool->free_list = pvm->next_free;
+  pvm->next_free = NULL;
+  uv_mutex_unlock(&pool->mutex);
+
+  return pvm;
+}
+
+void veil_pool_release(veil_pool_vm_t* pvm) {
+  CHECK_NOT_NULL(pvm);
+
+  uv_mutex_lock(&pvm->mutex);
+  pvm->releasing = true;
+  uv_cond_signal(&pvm->wake);
+  uv_mutex_unlock(&pvm->mutex);
+}
+
+bool veil_pool_eval(veil_pool_vm_t* pvm, const char* source, const char* filename, char** result) {
+  pool_job_t job = { POOL_JOB_EVAL };
+
+  CHECK_NOT_NULL(pvm);
+  CHECK_NOT_NULL(source);
+
+  job.source = source;
+  job.filename = filename ? filename : POOL_FILENAME;
+
+  return pool_run(pvm, &job, result);
+}
+
+bool veil_pool_call(veil_pool_vm_t* pvm, const char* specifier, const char* name, const char* args_json, char** result) {
+  pool_job_t job = { POOL_JOB_CALL };
+
+  CHECK_NOT_NULL(pvm);
+  CHECK_NOT_NULL(specifier);
+  CHECK_NOT_NULL(name);
+
+  job.specifier = specifier;
+  job.name = name;
+  job.args_json = args_json;
+
+  return pool_run(pvm, &job, result);
+}
+
+static bool pool_run(veil_pool_vm_t* pvm, pool_job_t* job, char** result) {
+  uv_mutex_lock(&pvm->mutex);
+  pvm->job = job;
+  uv_cond_signal(&pvm->wake);
+  while (!job->done) {
+    uv_cond_wait(&pvm->done, &pvm->mutex);
+  }
+  uv_mutex_unlock(&pvm->mutex);
+
+  if (result) {
+    *result = job->result;
+  } else {
+    free(job->result);
+  }
+
+  return job->ok;
+}
+
+static void pool_put(veil_pool_vm_t* pvm) {
+  veil_pool_t* pool = pvm->pool;
+
+  uv_mutex_lock(&pool->mutex);
+  pvm->next_free = pool->free_list;
+  pool->free_list = pvm;
+  uv_cond_signal(&pool->available);
+  uv_mutex_unlock(&pool->mutex);
+}
+
+static void pool_main(void* arg) {
+  veil_pool_vm_t* pvm = arg;
+  pool_job_t* job;
+  bool releasing;
+
+  veil_vm_init(&pvm->vm, pvm->pool->cfg);
+  veil_uv_init(&pvm->uv);
+  veil_vm_attach(&pvm->vm, &pvm->uv);
+  pool_put(pvm);
+
+  for (;;) {
+    uv_mutex_lock(&pvm->mutex);
+    while (!pvm->job && !pvm->releasing && !pvm->quit) {
+      uv_cond_wait(&pvm->wake, &pvm->mutex);
+    }
+    job = pvm->job;
+    releasing = pvm->releasing;
+    pvm->releasing = false;
+    uv_mutex_unlock(&pvm->mutex);
+
+    if (job) {
+      run_job(pvm, job);
+
+      uv_mutex_lock(&pvm->mutex);
+      pvm->job = NULL;
+      job->done = true;
+      uv_cond_signal(&pvm->done);
+      uv_mutex_unlock(&pvm->mutex);
+    } else if (releasing) {
+      veil_vm_reset(&pvm->vm);
+      // finishes closing the handles of the old context
+      uv_run(&pvm->uv.loop, UV_RUN_NOWAIT);
+      pool_put(pvm);
+    } else {
+      break;
+    }
+  }
+
+  veil_worker_drop_all(&pvm->vm);
+  veil_vm_run_cleanups(&pvm->vm);
+  veil_uv_drop(&pvm->uv);
+  veil_vm_drop(&pvm->vm);
+}
+
+static void run_job(veil_pool_vm_t* pvm, pool_job_t* job) {
+  JSContext* ctx = pvm->vm.context;
+  JSValue value;
+
+  if (job->type == POOL_JOB_EVAL) {
+    value = JS_Eval(ctx, job->source, strlen(job->source), job->filename, JS_EVAL_TYPE_GLOBAL);
+  } else {
+    value = call_export(ctx, job);
+  }
+
+  if (JS_IsException(value) || !settle(ctx, value)) {
+    JSValue exception = JS_GetException(ctx);
+
+    finish(job, false, to_error(ctx, exception));
+    JS_FreeValue(ctx, exception);
+  }
+  JS_FreeValue(ctx, value);
+
+  // runs the microtasks and whatever else the job started, until settle_cb
+  // stops the loop: an interval or a socket left open would otherwise keep
+  // the caller waiting forever. Handles still open close with the reset.
+  if (!job->settled) {
+    veil_uv_run(&pvm->uv);
+  }
+
+  if (!job->settled) {
+    finish(job, false, strdup("the result never settled: the event loop ran out of work first"));
+  }
+}
+
+static JSValue call_export(JSContext* ctx, pool_job_t* job) {
+  JSValue call = JS_Eval(ctx, CALL_SOURCE, sizeof(CALL_SOURCE) - 1, POOL_FILENAME, JS_EVAL_TYPE_GLOBAL);
+  JSValue argv[3];
+  JSValue result;
+
+  if (JS_IsException(call)) {
+    return call;
+  }
+
+  argv[0] = JS_NewString(ctx, job->specifier);
+  argv[1] = JS_NewString(ctx, job->name);
+  argv[2] = job->args_json ? JS_ParseJSON(ctx, job->args_json, strlen(job->args_json), "[args]") : JS_NewArray(ctx);
+
+  result = JS_IsException(argv[2]) ? JS_EXCEPTION : JS_Call(ctx, call, JS_UNDEFINED, 3, argv);
+
+  for (int n = 0; n < 3; n++) {
+    JS_FreeValue(ctx, argv[n]);
+  }
+  JS_FreeValue(ctx, call);
+
+  return result;
+}
+
+// Resolves a promise with value, so that a thenable is followed, and hands
+// the outcome to settle_cb.
+static bool settle(JSContext* ctx, JSValueConst value) {
+  JSValue resolving_funcs[2];
+  JSValue callbacks[2];
+  JSValue promise;
+  JSValue then;
+  JSValue result;
+
+  promise = JS_NewPromiseCapability(ctx, resolving_funcs);
+  if (JS_IsException(promise)) {
+    return false;
+  }
+
+  result = JS_Call(ctx, resolving_funcs[0], JS_UNDEFINED, 1, &value);
+  JS_FreeValue(ctx, resolving_funcs[0]);
+  JS_FreeValue(ctx, resolving_funcs[1]);
+  if (JS_IsException(result)) {
+    JS_FreeValue(ctx, promise);
+    return false;
+  }
+  JS_FreeValue(ctx, result);
+
+  callbacks[0] = JS_NewCFunctionMagic(ctx, settle_cb, "fulfilled", 1, JS_CFUNC_generic_magic, true);
+  callbacks[1] = JS_NewCFunctionMagic(ctx, settle_cb, "rejected", 1, JS_CFUNC_generic_magic, false);
+  then = JS_GetPropertyStr(ctx, promise, "then");
+  result = JS_Call(ctx, then, promise, 2, callbacks);
+
+  JS_FreeValue(ctx, then);
+  JS_FreeValue(ctx, callbacks[0]);
+  JS_FreeValue(ctx, callbacks[1]);
+  JS_FreeValue(ctx, promise);
+
+  if (JS_IsException(result)) {
+    return false;
+  }
+  JS_FreeValue(ctx, result);
+
+  return true;
+}
+
+static JSValue settle_cb(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_pool_vm_t* pvm = container_of(JS_GetContextOpaque(ctx), veil_pool_vm_t, vm);
+  JSValueConst value = argc > 0 ? argv[0] : JS_UNDEFINED;
+  pool_job_t* job = pvm->job;
+  char* result;
+  bool ok;
+
+  if (!job || job->settled) {
+    return JS_UNDEFINED;
+  }
+
+  if (magic) {
+    result = to_json(ctx, value, &ok);
+    finish(job, ok, result);
+  } else {
+    finish(job, false, to_error(ctx, value));
+  }
+  uv_stop(&pvm->uv.loop);
+
+  return JS_UNDEFINED;
+}
+
+static void finish(pool_job_t* job, bool ok, char* result) {
+  if (job->settled) {
+    free(result);
+    return;
+  }
+
+  job->settled = true;
+  job->ok = ok;
+  job->result = result;
+}
+
+// NULL with ok set when value has no JSON form
+static char* to_json(JSContext* ctx, JSValueConst value, bool* ok) {
+  JSValue json = JS_JSONStringify(ctx, value, JS_UNDEFINED, JS_UNDEFINED);
+  const char* str;
+  char* result = NULL;
+
+  *ok = true;
+
+  if (JS_IsException(json)) {
+    JSValue exception = JS_GetException(ctx);
+
+    *ok = false;
+    result = to_error(ctx, exception);
+    JS_FreeValue(ctx, exception);
+  } else if (!JS_IsUndefined(json)) {
+    str = JS_ToCString(ctx, json);
+    result = strdup(str ? str : "null");
+    CHECK_NOT_NULL(result);
+    JS_FreeCString(ctx, str);
+  }
+
+  JS_FreeValue(ctx, json);
+
+  return result;
+}
+
+// the error's message and, for an Error, its stack
+static char* to_error(JSContext* ctx, JSValueConst error) {
+  const char* message = JS_ToCString(ctx, error);
+  const char* trace = NULL;
+  JSValue stack = JS_UNDEFINED;
+  cstr text;
+  char* result;
+
+  if (!message) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  }
+
+  if (JS_IsError(ctx, error)) {
+    stack = JS_GetPropertyStr(ctx, error, "stack");
+    if (JS_IsException(stack)) {
+      JS_FreeValue(ctx, JS_GetException(ctx));
+    } else if (!JS_IsUndefined(stack)) {
+      trace = JS_ToCString(ctx, stack);
+    }
+  }
+
+  text = trace ? cstr_from_fmt("%s\n%s", message ? message : "[exception]", trace)
+      : cstr_from(message ? message : "[exception]");
+  result = strdup(cstr_str(&text));
+  CHECK_NOT_NULL(result);
+
+  cstr_drop(&text);
+  JS_FreeCString(ctx, trace);
+  JS_FreeValue(ctx, stack);
+  JS_FreeCString(ctx, message);
+
+  return result;
+}
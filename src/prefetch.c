@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <ctype.h>
+
+// Walks the static import graph of the startup modules on the libuv
+// threadpool before anything is evaluated. Each job reads a module and, when
+// no code cache is in use, compiles it to bytecode in a runtime of its own,
+// made on the pool thread with the VM's allocator and limits and freed once
+// the module is compiled (QuickJS runtimes are single threaded and check the
+// stack of the thread that created them). Import specifiers are found by a light
+// scan of the source and resolved on the main thread, which queues the new
+// files. The loader then takes the prepared source and bytecode by name, so
+// linking and evaluation keep their usual order on the main thread.
+
+typedef struct prefetch_entry_s {
+  veil_file_t source;
+  uint8_t* bytecode;
+  size_t bytecode_size;
+  int eval_flags;
+} prefetch_entry_t;
+
+#define i_type cmap_prefetch
+#define i_key_str
+#define i_val prefetch_entry_t*
+#include <stc/cmap.h>
+
+#define i_val_str
+#define i_opt (c_no_cmp | c_is_fwd)
+#include <stc/cvec.h>
+
+typedef struct prefetch_job_s {
+  uv_work_t req;
+  veil_prefetch_t* prefetch;
+  prefetch_entry_t* entry;
+  cstr filename;
+  bool force_module;
+  bool compile;
+  veil_allocator_t allocator;
+  size_t max_heap_size;
+  size_t max_stack_size;
+  cvec_str imports;
+} prefetch_job_t;
+
+struct veil_prefetch_s {
+  veil_vm_t* vm;
+  uv_loop_t loop;
+  cmap_prefetch entries;
+};
+
+static void work_cb(uv_work_t* req);
+static void after_work_cb(uv_work_t* req, int status);
+static void compile(prefetch_job_t* job);
+static void scan_imports(const char* p, const char* end, cvec_str* out);
+static const char* scan_from(const char* p, const char* end, cvec_str* out);
+static const char* skip_space(const char* p, const char* end);
+static const char* skip_string(const char* p, const char* end);
+static const char* skip_template(const char* p, const char* end);
+static const char* skip_regex(const char* p, const char* end);
+static const char* read_ident(const char* p, const char* end);
+static bool ident_equals(const char* start, const char* end, const char* ident);
+static bool regex_allowed_after(const char* start, const char* end);
+
+veil_prefetch_t* veil_prefetch_new(veil_vm_t* vm) {
+  veil_prefetch_t* prefetch = calloc(1, sizeof(veil_prefetch_t));
+  CHECK_NOT_NULL(prefetch);
+
+  prefetch->vm = vm;
+  prefetch->entries = cmap_prefetch_init();
+  // a private loop, so waiting does not run the VM's handles
+  CHECK_OK(uv_loop_init(&prefetch->loop));
+
+  return prefetch;
+}
+
+void veil_prefetch_free(veil_prefetch_t* prefetch) {
+  if (!prefetch) {
+    return;
+  }
+
+  // jobs hold entries, so drain any still queued
+  uv_run(&prefetch->loop, UV_RUN_DEFAULT);
+  CHECK_OK(uv_loop_close(&prefetch->loop));
+
+  c_foreach (it, cmap_prefetch, prefetch->entries) {
+    veil_file_drop(&it.ref->second->source);
+    free(it.ref->second->bytecode);
+    free(it.ref->second);
+  }
+  cmap_prefetch_drop(&prefetch->entries);
+  free(prefetch);
+}
+
+void veil_prefetch_add(veil_prefetch_t* prefetch, const char* filename, bool force_module) {
+  prefetch_job_t* job;
+
+  // dlopen reads addons itself
+  if (veil_addon_is_addon(filename) || cmap_prefetch_contains(&prefetch->entries, filename)) {
+    return;
+  }
+
+  job = calloc(1, sizeof(prefetch_job_t));
+  CHECK_NOT_NULL(job);
+
+  job->entry = calloc(1, sizeof(prefetch_entry_t));
+  CHECK_NOT_NULL(job->entry);
+
+  job->req.data = job;
+  job->prefetch = prefetch;
+  job->filename = cstr_from(filename);
+  job->force_module = force_module;
+  // a code cache hit is cheaper than compiling again, so leave that to it
+  job->compile = !prefetch->vm->code_cache.enabled;
+  job->allocator = prefetch->vm->alloc.kind;
+  job->max_heap_size = prefetch->vm->cfg->max_heap_size;
+  job->max_stack_size = prefetch->vm->cfg->max_stack_size;
+  job->imports = cvec_str_init();
+
+  cmap_prefetch_emplace(&prefetch->entries, filename, job->entry);
+  CHECK_OK(uv_queue_work(&prefetch->loop, &job->req, work_cb, after_work_cb));
+}
+
+void veil_prefetch_wait(veil_prefetch_t* prefetch) {
+  uv_run(&prefetch->loop, UV_RUN_DEFAULT);
+}
+
+bool veil_prefetch_take(veil_prefetch_t* prefetch, const char* filename, veil_prefetched_t* out) {
+  const cmap_prefetch_value* found = cmap_prefetch_get(&prefetch->entries, filename);
+  prefetch_entry_t* entry;
+
+  if (!found || !found->second->source.data) {
+    return false;
+  }
+
+  entry = found->second;
+  out->source = entry->source;
+  out->eval_flags = entry->eval_flags;
+  out->bytecode = entry->bytecode;
+  out->bytecode_size = entry->bytecode_size;
+
+  // ownership moves to the caller
+  memset(entry, 0, sizeof(prefetch_entry_t));
+
+  return true;
+}
+
+static void work_cb(uv_work_t* req) {
+  prefetch_job_t* job = req->data;
+  prefetch_entry_t* entry = job->entry;
+  const char* filename = cstr_str(&job->filename);
+
+  if (!veil_file_read(&entry->source, filename)) {
+    return;
+  }
+
+  // the same choice compile_file() makes
+  if (job->force_module
+      || cstr_ends_with(&job->filename, ".mjs")
+      || JS_DetectModule(entry->source.data, entry->source.size)) {
+    entry->eval_flags = JS_EVAL_TYPE_MODULE;
+    scan_imports(entry->source.data, entry->source.data + entry->source.size, &job->imports);
+  } else {
+    entry->eval_flags = JS_EVAL_TYPE_GLOBAL;
+  }
+
+  if (job->compile) {
+    compile(job);
+  }
+}
+
+static void after_work_cb(uv_work_t* req, int status) {
+  prefetch_job_t* job = req->data;
+  veil_prefetch_t* prefetch = job->prefetch;
+  JSContext* ctx = prefetch->vm->context;
+
+  c_foreach (it, cvec_str, job->imports) {
+    char* resolved;
+
+    if (veil_builtin_exists(cstr_str(it.ref))) {
+      continue;
+    }
+
+    // through the VM's resolver, so names match what the loader will ask for
+    resolved = veil_resolver_resolve(prefetch->vm->resolver, ctx, cstr_str(&job->filename), cstr_str(it.ref));
+    if (!resolved) {
+      // reported properly when the module is linked
+      JS_FreeValue(ctx, JS_GetException(ctx));
+      continue;
+    }
+
+    if (!veil_builtin_exists(resolved)) {
+      veil_prefetch_add(prefetch, resolved, true);
+    }
+    js_free(ctx, resolved);
+  }
+
+  cvec_str_drop(&job->imports);
+  cstr_drop(&job->filename);
+  free(job);
+}
+
+static void compile(prefetch_job_t* job) {
+  prefetch_entry_t* entry = job->entry;
+  veil_alloc_t alloc;
+  JSRuntime* rt;
+  JSContext* ctx;
+  JSValue compiled;
+  uint8_t* bytecode;
+  size_t size;
+
+  // a fresh runtime per module, since compiled modules stay registered with
+  // the context that parsed them, and pool threads outlive the VM
+  veil_alloc_init(&alloc, job->allocator);
+  rt = veil_alloc_new_runtime(&alloc);
+  CHECK_NOT_NULL(rt);
+
+  if (job->max_heap_size) {
+    JS_SetMemoryLimit(rt, job->max_heap_size);
+  }
+
+  if (job->max_stack_size) {
+    JS_SetMaxStackSize(rt, job->max_stack_size);
+  }
+
+  // under a small --max-heap-size the main thread compiles it instead
+  ctx = JS_NewContext(rt);
+  if (!ctx) {
+    JS_FreeRuntime(rt);
+    veil_alloc_drop(&alloc);
+    return;
+  }
+
+  compiled = JS_Eval(ctx, entry->source.data, entry->source.size, cstr_str(&job->filename),
+      entry->eval_flags | JS_EVAL_FLAG_COMPILE_ONLY);
+
+  if (JS_IsException(compiled)) {
+    // the main thread compiles it again to report the error
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  } else {
+    bytecode = JS_WriteObject(ctx, &size, compiled, JS_WRITE_OBJ_BYTECODE);
+    if (bytecode) {
+      entry->bytecode = malloc(size);
+      CHECK_NOT_NULL(entry->bytecode);
+      memcpy(entry->bytecode, bytecode, size);
+      entry->bytecode_size = size;
+      js_free(ctx, bytecode);
+    }
+    JS_FreeValue(ctx, compiled);
+  }
+
+  JS_FreeContext(ctx);
+  JS_FreeRuntime(rt);
+  veil_alloc_drop(&alloc);
+}
+
+static void scan_imports(const char* p, const char* end, cvec_str* out) {
+  // finds import ... from "x", import "x" and export ... from "x"; misses
+  // only cost a serial load later
+  const char* last = NULL;
+  const char* last_end = NULL;
+
+  while ((p = skip_space(p, end)) < end) {
+    char c = *p;
+
+    if (c == '"' || c == '\'') {
+      p = skip_string(p, end);
+      last = NULL;
+    } else if (c == '`') {
+      p = skip_template(p, end);
+      last = NULL;
+    } else if (c == '/' && (last == NULL || regex_allowed_after(last, last_end))) {
+      p = skip_regex(p, end);
+      last = NULL;
+    } else if (isalpha((unsigned char) c) || c == '_' || c == '$') {
+      const char* start = p;
+      bool member = last && last_end - last == 1 && *last == '.';
+
+      p = read_ident(p, end);
+
+      if (!member && (ident_equals(start, p, "import") || ident_equals(start, p, "export"))) {
+        const char* next = skip_space(p, end);
+
+        if (next < end && (*next == '"' || *next == '\'')) {
+          // import "side-effect"
+          const char* close = skip_string(next, end);
+
+          if (start[0] == 'i' && close - next >= 2) {
+            cvec_str_push(out, cstr_from_n(next + 1, close - next - 2));
+          }
+          p = close;
+          last = NULL;
+          continue;
+        }
+
+        // import(), import.meta and export declarations fall through
+        if (next < end && *next != '(' && *next != '.') {
+          p = scan_from(next, end, out);
+          last = NULL;
+          continue;
+        }
+      }
+
+      last = start;
+      last_end = p;
+    } else {
+      last = p;
+      last_end = ++p;
+    }
+  }
+}
+
+static const char* scan_from(const char* p, const char* end, cvec_str* out) {
+  // the clause before "from": default and namespace bindings and { lists }
+  while ((p = skip_space(p, end)) < end) {
+    if (*p == '{' || *p == '}' || *p == ',' || *p == '*') {
+      p++;
+    } else if (isalpha((unsigned char) *p) || *p == '_' || *p == '$') {
+      const char* start = p;
+
+      p = read_ident(p, end);
+      if (ident_equals(start, p, "from")) {
+        const char* next = skip_space(p, end);
+
+        if (next < end && (*next == '"' || *next == '\'')) {
+          const char* close = skip_string(next, end);
+
+          if (close - next >= 2) {
+            cvec_str_push(out, cstr_from_n(next + 1, close - next - 2));
+          }
+          return close;
+        }
+        return next;
+      }
+    } else {
+      break;
+    }
+  }
+
+  return p;
+}
+
+static const char* skip_space(const char* p, const char* end) {
+  for (;;) {
+    while (p < end && isspace((unsigned char) *p)) {
+      p++;
+    }
+
+    if (end - p >= 2 && p[0] == '/' && p[1] == '/') {
+      while (p < end && *p != '\n') {
+        p++;
+      }
+    } else if (end - p >= 2 && p[0] == '/' && p[1] == '*') {
+      p += 2;
+      while (end - p >= 2 && !(p[0] == '*' && p[1] == '/')) {
+        p++;
+      }
+      p = end - p >= 2 ? p + 2 : end;
+    } else {
+      return p;
+    }
+  }
+}
+
+static const char* skip_string(const char* p, const char* end) {
+  char quote = *p++;
+
+  while (p < end && *p != quote && *p != '\n') {
+    p += *p == '\\' ? 2 : 1;
+  }
+
+  return p < end ? p + 1 : end;
+}
+
+static const char* skip_template(const char* p, const char* end) {
+  p++;
+
+  while (p < end && *p != '`') {
+    if (*p == '\\') {
+      p += 2;
+    } else if (*p == '$' && p + 1 < end && p[1] == '{') {
+      int depth = 1;
+
+      p += 2;
+      while (p < end && depth > 0) {
+        if (*p == '"' || *p == '\'') {
+          p = skip_string(p, end);
+        } else if (*p == '`') {
+          p = skip_template(p, end);
+        } else {
+          depth += *p == '{' ? 1 : *p == '}' ? -1 : 0;
+          p++;
+        }
+      }
+    } else {
+      p++;
+    }
+  }
+
+  return p < end ? p + 1 : end;
+}
+
+static const char* skip_regex(const char* p, const char* end) {
+  bool in_class = false;
+
+  p++;
+  while (p < end && *p != '\n') {
+    if (*p == '\\') {
+      p += 2;
+      continue;
+    }
+
+    if (*p == '[') {
+      in_class = true;
+    } else if (*p == ']') {
+      in_class = false;
+    } else if (*p == '/' && !in_class) {
+      return read_ident(p + 1, end);
+    }
+    p++;
+  }
+
+  return p < end ? p : end;
+}
+
+static const char* read_ident(const char* p, const char* end) {
+  while (p < end && (isalnum((unsigned char) *p) || *p == '_' || *p == '$')) {
+    p++;
+  }
+
+  return p;
+}
+
+static bool ident_equals(const char* start, const char* end, const char* ident) {
+  size_t size = strlen(ident);
+
+  return (size_t) (end - start) == size && memcmp(start, ident, size) == 0;
+}
+
+static bool regex_allowed_after(const char* start, const char* end) {
+  static const char* KEYWORDS[] = { "return", "typeof", "case", "do", "else", "in", "instanceof", "new", "delete", "void", "throw", "yield", "await" };
+
+  // after an operator or punctuator a slash starts a regex, after a value
+  // it divides
+  if (end - start == 1 && !isalnum((unsigned char) *start) && *start != '_' && *start != '$') {
+    return *start != ')' && *start != ']' && *start != '}';
+  }
+
+  for (size_t n = 0; n < countof(KEYWORDS); n++) {
+    if (ident_equals(start, end, KEYWORDS[n])) {
+      return true;
+    }
+  }
+
+  return false;
+}
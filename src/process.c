@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+static int module_init(JSContext* ctx, JSModuleDef* m);
+static JSValue memory_usage(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue memory_usage_rss(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+JSModuleDef* veil_process_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, module_init);
+
+  if (m) {
+    JS_AddModuleExport(ctx, m, "memoryUsage");
+  }
+
+  return m;
+}
+
+static int module_init(JSContext* ctx, JSModuleDef* m) {
+  JSValue fn = JS_NewCFunction(ctx, memory_usage, "memoryUsage", 0);
+
+  JS_SetPropertyStr(ctx, fn, "rss", JS_NewCFunction(ctx, memory_usage_rss, "rss", 0));
+  JS_SetModuleExport(ctx, m, "memoryUsage", fn);
+
+  return 0;
+}
+
+static JSValue memory_usage(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_memory_usage_t usage;
+  JSValue result;
+
+  veil_heap_get_usage(vm, &usage);
+
+  result = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, result, "rss", JS_NewInt64(ctx, (int64_t) usage.rss));
+  JS_SetPropertyStr(ctx, result, "heapTotal", JS_NewInt64(ctx, (int64_t) usage.heap_total));
+  JS_SetPropertyStr(ctx, result, "heapUsed", JS_NewInt64(ctx, (int64_t) usage.heap_used));
+  // array buffer stores are the only engine memory held outside the heap
+  JS_SetPropertyStr(ctx, result, "external", JS_NewInt64(ctx, (int64_t) usage.array_buffers));
+  JS_SetPropertyStr(ctx, result, "arrayBuffers", JS_NewInt64(ctx, (int64_t) usage.array_buffers));
+
+  return result;
+}
+
+static JSValue memory_usage_rss(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  size_t rss;
+
+  if (uv_resident_set_memory(&rss) != 0) {
+    rss = 0;
+  }
+
+  return JS_NewInt64(ctx, (int64_t) rss);
+}
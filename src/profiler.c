@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// A timer thread raises a flag every interval; the VM's interrupt handler
+// consumes it and records the current JS stack, taken from the backtrace of
+// a fresh Error. QuickJS polls interrupts every few thousand operations, so
+// samples land within a few microseconds of the tick while JS is running.
+// Gaps where no JS ran are recorded as (idle).
+
+#define PROFILE_MAX_FRAMES 256
+#define PROFILE_ROOT 0
+
+typedef struct profile_node_s {
+  int32_t parent;
+  int32_t first_child;
+  int32_t next_sibling;
+  int32_t line;
+  uint32_t hits;
+  cstr name;
+  cstr url;
+} profile_node_t;
+
+#define i_type cvec_profile_node
+#define i_val profile_node_t
+#define i_opt c_no_cmp
+#include <stc/cvec.h>
+
+#define i_type cvec_i32
+#define i_val int32_t
+#include <stc/cvec.h>
+
+typedef struct profile_frame_s {
+  const char* name;
+  size_t name_size;
+  const char* url;
+  size_t url_size;
+  int32_t line;
+} profile_frame_t;
+
+struct veil_profiler_s {
+  uv_thread_t thread;
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  // guarded by mutex
+  bool stopping;
+  bool pending;
+
+  uint64_t interval_ns;
+  uint64_t start;
+  uint64_t last;
+  uint64_t end;
+  int32_t idle;
+  cvec_profile_node nodes;
+  cvec_i32 samples;
+  cvec_i32 deltas;
+};
+
+static void timer_main(void* arg);
+static int32_t add_node(veil_profiler_t* profiler, int32_t parent, const char* name, size_t name_size, const char* url, size_t url_size, int32_t line);
+static int32_t find_child(veil_profiler_t* profiler, int32_t parent, const profile_frame_t* frame);
+static int32_t insert_stack(veil_profiler_t* profiler, const char* stack, size_t size);
+static bool parse_frame(const char* line, size_t size, profile_frame_t* frame);
+static void record(veil_profiler_t* profiler, int32_t node, uint64_t now);
+
+veil_profiler_t* veil_profiler_start(uint32_t interval_us) {
+  veil_profiler_t* profiler = calloc(1, sizeof(veil_profiler_t));
+  CHECK_NOT_NULL(profiler);
+
+  profiler->interval_ns = (uint64_t) (interval_us ? interval_us : VEIL_CPU_PROF_DEFAULT_INTERVAL) * 1000;
+  profiler->nodes = cvec_profile_node_init();
+  profiler->samples = cvec_i32_init();
+  profiler->deltas = cvec_i32_init();
+
+  add_node(profiler, -1, "(root)", 6, "", 0, 0);
+  profiler->idle = add_node(profiler, PROFILE_ROOT, "(idle)", 6, "", 0, 0);
+
+  profiler->start = uv_hrtime();
+  profiler->last = profiler->start;
+
+  CHECK_OK(uv_mutex_init(&profiler->mutex));
+  CHECK_OK(uv_cond_init(&profiler->cond));
+  CHECK_OK(uv_thread_create(&profiler->thread, timer_main, profiler));
+
+  return profiler;
+}
+
+void veil_profiler_stop(veil_profiler_t* profiler) {
+  uv_mutex_lock(&profiler->mutex);
+  if (profiler->stopping) {
+    uv_mutex_unlock(&profiler->mutex);
+    return;
+  }
+  profiler->stopping = true;
+  uv_cond_signal(&profiler->cond);
+  uv_mutex_unlock(&profiler->mutex);
+
+  CHECK_OK(uv_thread_join(&profiler->thread));
+
+  profiler->end = uv_hrtime();
+  record(profiler, profiler->idle, profiler->end);
+}
+
+void veil_profiler_free(veil_profiler_t* profiler) {
+  veil_profiler_stop(profiler);
+
+  c_foreach (it, cvec_profile_node, profiler->nodes) {
+    cstr_drop(&it.ref->name);
+    cstr_drop(&it.ref->url);
+  }
+  cvec_profile_node_drop(&profiler->nodes);
+  cvec_i32_drop(&profiler->samples);
+  cvec_i32_drop(&profiler->deltas);
+  uv_cond_destroy(&profiler->cond);
+  uv_mutex_destroy(&profiler->mutex);
+  free(profiler);
+}
+
+void veil_profiler_sample(veil_profiler_t* profiler, JSContext* ctx) {
+  JSValue error;
+  JSValue stack;
+  const char* str;
+  size_t size;
+  uint64_t now;
+  bool pending;
+
+  uv_mutex_lock(&profiler->mutex);
+  pending = profiler->pending;
+  profiler->pending = false;
+  uv_mutex_unlock(&profiler->mutex);
+
+  if (!pending) {
+    return;
+  }
+
+  now = uv_hrtime();
+  error = JS_NewError(ctx);
+  if (JS_IsException(error)) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    return;
+  }
+
+  stack = JS_GetPropertyStr(ctx, error, "stack");
+  str = JS_ToCStringLen(ctx, &size, stack);
+
+  if (str) {
+    record(profiler, insert_stack(profiler, str, size), now);
+    JS_FreeCString(ctx, str);
+  } else {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  }
+
+  JS_FreeValue(ctx, stack);
+  JS_FreeValue(ctx, error);
+}
+
+bool veil_profiler_write(veil_profiler_t* profiler, const char* filename) {
+  cstr out = cstr_init();
+  size_t count = cvec_profile_node_size(&profiler->nodes);
+  bool ok;
+
+  cstr_append(&out, "{\"nodes\":[");
+
+  for (size_t n = 0; n < count; n++) {
+    const profile_node_t* node = cvec_profile_node_at(&profiler->nodes, n);
+    bool first = true;
+
+    veil_json_append_fmt(&out, "%s{\"id\":%zu,\"callFrame\":{\"functionName\":", n ? "," : "", n + 1);
+    veil_json_append_string(&out, cstr_str_safe(&node->name), cstr_size(&node->name));
+    cstr_append(&out, ",\"scriptId\":\"0\",\"url\":");
+    veil_json_append_string(&out, cstr_str_safe(&node->url), cstr_size(&node->url));
+    // .cpuprofile line numbers are zero based
+    veil_json_append_fmt(&out, ",\"lineNumber\":%d,\"columnNumber\":-1},\"hitCount\":%u,\"children\":[", node->line - 1, node->hits);
+
+    for (int32_t child = node->first_child; child >= 0; child = cvec_profile_node_at(&profiler->nodes, child)->next_sibling) {
+      veil_json_append_fmt(&out, "%s%d", first ? "" : ",", child + 1);
+      first = false;
+    }
+
+    cstr_append(&out, "]}");
+  }
+
+  // timestamps are microseconds on the monotonic clock, as in V8
+  veil_json_append_fmt(&out, "],\"startTime\":%llu,\"endTime\":%llu,\"samples\":[",
+      (unsigned long long) (profiler->start / 1000), (unsigned long long) (profiler->end / 1000));
+
+  for (size_t n = 0; n < cvec_i32_size(&profiler->samples); n++) {
+    veil_json_append_fmt(&out, "%s%d", n ? "," : "", *cvec_i32_at(&profiler->samples, n) + 1);
+  }
+
+  cstr_append(&out, "],\"timeDeltas\":[");
+
+  for (size_t n = 0; n < cvec_i32_size(&profiler->deltas); n++) {
+    veil_json_append_fmt(&out, "%s%d", n ? "," : "", *cvec_i32_at(&profiler->deltas, n));
+  }
+
+  cstr_append(&out, "]}");
+
+  ok = veil_file_write(filename, cstr_str(&out), cstr_size(&out));
+  cstr_drop(&out);
+
+  return ok;
+}
+
+static void timer_main(void* arg) {
+  veil_profiler_t* profiler = arg;
+
+  uv_mutex_lock(&profiler->mutex);
+  while (!profiler->stopping) {
+    uv_cond_timedwait(&profiler->cond, &profiler->mutex, profiler->interval_ns);
+    if (!profiler->stopping) {
+      profiler->pending = true;
+    }
+  }
+  uv_mutex_unlock(&profiler->mutex);
+}
+
+static int32_t add_node(veil_profiler_t* profiler, int32_t parent, const char* name, size_t name_size, const char* url, size_t url_size, int32_t line) {
+  int32_t index = (int32_t) cvec_profile_node_size(&profiler->nodes);
+  profile_node_t node = {
+    .parent = parent,
+    .first_child = -1,
+    .next_sibling = -1,
+    .line = line,
+    .hits = 0,
+    .name = cstr_from_n(name, name_size),
+    .url = cstr_from_n(url, url_size),
+  };
+
+  if (parent >= 0) {
+    profile_node_t* p = cvec_profile_node_at_mut(&profiler->nodes, parent);
+
+    node.next_sibling = p->first_child;
+    p->first_child = index;
+  }
+
+  cvec_profile_node_push(&profiler->nodes, node);
+
+  return index;
+}
+
+static int32_t find_child(veil_profiler_t* profiler, int32_t parent, const profile_frame_t* frame) {
+  int32_t child = cvec_profile_node_at(&profiler->nodes, parent)->first_child;
+
+  while (child >= 0) {
+    const profile_node_t* node = cvec_profile_node_at(&profiler->nodes, child);
+
+    if (node->line == frame->line
+        && cstr_size(&node->name) == frame->name_size
+        && cstr_size(&node->url) == frame->url_size
+        && memcmp(cstr_str(&node->name), frame->name, frame->name_size) == 0
+        && memcmp(cstr_str(&node->url), frame->url, frame->url_size) == 0) {
+      return child;
+    }
+
+    child = node->next_sibling;
+  }
+
+  return add_node(profiler, parent, frame->name, frame->name_size, frame->url, frame->url_size, frame->line);
+}
+
+static int32_t insert_stack(veil_profiler_t* profiler, const char* stack, size_t size) {
+  profile_frame_t frames[PROFILE_MAX_FRAMES];
+  uint32_t frame_count = 0;
+  const char* end = stack + size;
+  int32_t node = PROFILE_ROOT;
+
+  // the backtrace lists the innermost frame first
+  while (stack < end && frame_count < countof(frames)) {
+    const char* eol = memchr(stack, '\n', end - stack);
+
+    if (!eol) {
+      eol = end;
+    }
+
+    if (parse_frame(stack, eol - stack, &frames[frame_count])) {
+      frame_count++;
+    }
+
+    stack = eol + 1;
+  }
+
+  if (frame_count == 0) {
+    return profiler->idle;
+  }
+
+  while (frame_count > 0) {
+    node = find_child(profiler, node, &frames[--frame_count]);
+  }
+
+  return node;
+}
+
+static bool parse_frame(const char* line, size_t size, profile_frame_t* frame) {
+  // "    at <name> (<file>:<line>)" or "    at <name> (native)"
+  const char* end = line + size;
+  const char* open = NULL;
+  const char* colon = NULL;
+
+  while (line < end && *line == ' ') {
+    line++;
+  }
+
+  if (end - line < 4 || memcmp(line, "at ", 3) != 0 || end[-1] != ')') {
+    return false;
+  }
+  line += 3;
+  end--;
+
+  for (const char* p = end - 1; p > line; p--) {
+    if (*p == '(' && p[-1] == ' ') {
+      open = p;
+      break;
+    }
+  }
+
+  if (!open) {
+    return false;
+  }
+
+  frame->name = line;
+  frame->name_size = open - 1 - line;
+  frame->url = open + 1;
+  frame->url_size = end - frame->url;
+  frame->line = 0;
+
+  for (const char* p = end - 1; p > frame->url; p--) {
+    if (*p == ':') {
+      colon = p;
+      break;
+    }
+    if (*p < '0' || *p > '9') {
+      break;
+    }
+  }
+
+  if (colon && colon + 1 < end) {
+    frame->url_size = colon - frame->url;
+    frame->line = (int32_t) strtol(colon + 1, NULL, 10);
+  } else if (frame->url_size == 6 && memcmp(frame->url, "native", 6) == 0) {
+    frame->url_size = 0;
+  }
+
+  return true;
+}
+
+static void record(veil_profiler_t* profiler, int32_t node, uint64_t now) {
+  // account a gap with no samples to (idle) rather than to whatever ran next
+  if (node != profiler->idle && now - profiler->last > 2 * profiler->interval_ns) {
+    uint64_t idle_end = now - profiler->interval_ns;
+
+    cvec_i32_push(&profiler->samples, profiler->idle);
+    cvec_i32_push(&profiler->deltas, (int32_t) ((idle_end - profiler->last) / 1000));
+    cvec_profile_node_at_mut(&profiler->nodes, profiler->idle)->hits++;
+    profiler->last = idle_end;
+  }
+
+  cvec_i32_push(&profiler->samples, node);
+  cvec_i32_push(&profiler->deltas, (int32_t) ((now - profiler->last) / 1000));
+  cvec_profile_node_at_mut(&profiler->nodes, node)->hits++;
+  profiler->last = now;
+}
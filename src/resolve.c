@@ -0,0 +1,910 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <sys/stat.h>
+
+// Node-style specifier resolution for the module loader: relative and
+// absolute paths, bare specifiers through node_modules with package.json
+// "exports" (conditional, subpath and pattern) and "main", extension and
+// index probing under --es-module-specifier-resolution=node, and realpath
+// unless --preserve-symlinks.
+//
+// Results are cached per (parent directory, specifier); the condition set
+// is fixed for the life of a resolver. With --resolution-manifest the cache
+// is also persisted. Every resolution records the directories whose listing
+// decided a probe and the package.json files it read, together with their
+// mtimes, and a replayed entry is only used while all of those still match.
+
+#define i_type cmap_resolve_index
+#define i_key_str
+#define i_val uint32_t
+#include <stc/cmap.h>
+
+#define i_type cvec_u32
+#define i_val uint32_t
+#include <stc/cvec.h>
+
+#define i_val_str
+#define i_opt (c_no_cmp | c_is_fwd)
+#include <stc/cvec.h>
+
+#define RESOLVE_MANIFEST_MAGIC "VEILRES1"
+
+#define RESOLVE_FLAG_ESM_NODE 0x1
+#define RESOLVE_FLAG_PRESERVE_SYMLINKS 0x2
+
+typedef struct resolve_dep_s {
+  cstr path;
+  bool exists;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} resolve_dep_t;
+
+typedef struct resolve_entry_s {
+  cstr key;
+  cstr resolved;
+  uint32_t dep_start;
+  uint32_t dep_count;
+} resolve_entry_t;
+
+#define i_type cvec_resolve_dep
+#define i_val resolve_dep_t
+#define i_opt c_no_cmp
+#include <stc/cvec.h>
+
+#define i_type cvec_resolve_entry
+#define i_val resolve_entry_t
+#define i_opt c_no_cmp
+#include <stc/cvec.h>
+
+typedef struct manifest_header_s {
+  char magic[8];
+  uint32_t header_size;
+  uint32_t flags;
+  uint64_t conditions_hash;
+  uint32_t dep_count;
+  uint32_t entry_count;
+} manifest_header_t;
+
+typedef struct manifest_dep_s {
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t exists;
+  uint32_t path_size;
+} manifest_dep_t;
+
+typedef struct manifest_entry_s {
+  uint32_t key_size;
+  uint32_t resolved_size;
+  uint32_t dep_count;
+  uint32_t reserved;
+} manifest_entry_t;
+
+struct veil_resolver_s {
+  uint32_t flags;
+  // "node", "import", --conditions..., "default"
+  cvec_str conditions;
+  uint64_t conditions_hash;
+  cstr manifest;
+  bool dirty;
+  cmap_resolve_index cache;
+  cvec_resolve_entry entries;
+  // dependency tracking, only when a manifest is in use
+  cmap_resolve_index dep_index;
+  cvec_resolve_dep deps;
+  cvec_u32 entry_deps;
+  cvec_u32 pending;
+};
+
+static void manifest_load(veil_resolver_t* resolver);
+static uint32_t track(veil_resolver_t* resolver, const char* path);
+static void track_parent(veil_resolver_t* resolver, const char* path);
+static void depend(veil_resolver_t* resolver, uint32_t index);
+static void add_entry(veil_resolver_t* resolver, const char* key, const char* resolved, const uint32_t* deps, uint32_t dep_count);
+static bool resolve_specifier(veil_resolver_t* resolver, JSContext* ctx, const char* dir, const char* specifier, cstr* out);
+static bool resolve_file(veil_resolver_t* resolver, JSContext* ctx, const char* path, bool probe, cstr* out);
+static bool resolve_package(veil_resolver_t* resolver, JSContext* ctx, const char* dir, const char* specifier, cstr* out);
+static bool resolve_exports(veil_resolver_t* resolver, JSContext* ctx, const char* pkg_dir, JSValueConst exports, const char* subpath, cstr* out);
+static bool resolve_target(veil_resolver_t* resolver, JSContext* ctx, const char* pkg_dir, JSValueConst target, const char* match, cstr* out);
+static JSValue read_package(veil_resolver_t* resolver, JSContext* ctx, const char* pkg_dir);
+static bool is_file(veil_resolver_t* resolver, const char* path);
+static bool is_dir(veil_resolver_t* resolver, const char* path);
+static void path_dirname(cstr* out, const char* path);
+static void path_join(cstr* out, const char* dir, const char* rel);
+static bool is_relative(const char* specifier);
+
+veil_resolver_t* veil_resolver_new(const veil_cfg_t* cfg) {
+  veil_resolver_t* resolver = calloc(1, sizeof(veil_resolver_t));
+  CHECK_NOT_NULL(resolver);
+
+  resolver->flags = (cfg->esm_specifier_resolution == VEIL_ESM_SPECIFIER_RESOLUTION_NODE ? RESOLVE_FLAG_ESM_NODE : 0)
+      | (cfg->preserve_symlinks ? RESOLVE_FLAG_PRESERVE_SYMLINKS : 0);
+
+  resolver->conditions = cvec_str_init();
+  cvec_str_emplace_back(&resolver->conditions, "node");
+  cvec_str_emplace_back(&resolver->conditions, "import");
+  c_foreach (it, cvec_str, cfg->conditions) {
+    cvec_str_emplace_back(&resolver->conditions, cstr_str(it.ref));
+  }
+  cvec_str_emplace_back(&resolver->conditions, "default");
+
+  resolver->conditions_hash = 0;
+  c_foreach (it, cvec_str, resolver->conditions) {
+    // order matters for conditional exports, so the hash is order sensitive
+    resolver->conditions_hash = resolver->conditions_hash * 31 + veil_hash(cstr_str(it.ref), cstr_size(it.ref));
+  }
+
+  resolver->manifest = cstr_clone(cfg->resolution_manifest);
+  resolver->cache = cmap_resolve_index_init();
+  resolver->entries = cvec_resolve_entry_init();
+  resolver->dep_index = cmap_resolve_index_init();
+  resolver->deps = cvec_resolve_dep_init();
+  resolver->entry_deps = cvec_u32_init();
+  resolver->pending = cvec_u32_init();
+
+  if (!cstr_is_empty(&resolver->manifest)) {
+    manifest_load(resolver);
+  }
+
+  return resolver;
+}
+
+void veil_resolver_free(veil_resolver_t* resolver) {
+  if (!resolver) {
+    return;
+  }
+
+  c_foreach (it, cvec_resolve_entry, resolver->entries) {
+    cstr_drop(&it.ref->key);
+    cstr_drop(&it.ref->resolved);
+  }
+  c_foreach (it, cvec_resolve_dep, resolver->deps) {
+    cstr_drop(&it.ref->path);
+  }
+
+  cvec_str_drop(&resolver->conditions);
+  cstr_drop(&resolver->manifest);
+  cmap_resolve_index_drop(&resolver->cache);
+  cvec_resolve_entry_drop(&resolver->entries);
+  cmap_resolve_index_drop(&resolver->dep_index);
+  cvec_resolve_dep_drop(&resolver->deps);
+  cvec_u32_drop(&resolver->entry_deps);
+  cvec_u32_drop(&resolver->pending);
+  free(resolver);
+}
+
+char* veil_resolver_resolve(veil_resolver_t* resolver, JSContext* ctx, const char* base, const char* specifier) {
+  const cmap_resolve_index_value* cached;
+  cstr dir;
+  cstr key;
+  cstr resolved;
+  char* result = NULL;
+
+  if (veil_builtin_exists(specifier)) {
+    return js_strdup(ctx, specifier);
+  }
+
+  dir = cstr_init();
+  path_dirname(&dir, base);
+  key = cstr_from_fmt("%s\n%s", cstr_str(&dir), specifier);
+
+  cached = cmap_resolve_index_get(&resolver->cache, cstr_str(&key));
+  if (cached) {
+    result = js_strdup(ctx, cstr_str(&cvec_resolve_entry_at(&resolver->entries, cached->second)->resolved));
+    cstr_drop(&key);
+    cstr_drop(&dir);
+    return result;
+  }
+
+  resolved = cstr_init();
+  cvec_u32_clear(&resolver->pending);
+
+  if (resolve_specifier(resolver, ctx, cstr_str(&dir), specifier, &resolved)) {
+    add_entry(resolver, cstr_str(&key), cstr_str(&resolved), cvec_u32_front(&resolver->pending), (uint32_t) cvec_u32_size(&resolver->pending));
+    resolver->dirty = true;
+    result = js_strdup(ctx, cstr_str(&resolved));
+  } else {
+    JS_ThrowReferenceError(ctx, "cannot find module '%s' imported from '%s'", specifier, base);
+  }
+
+  cstr_drop(&resolved);
+  cstr_drop(&key);
+  cstr_drop(&dir);
+
+  return result;
+}
+
+bool veil_resolver_save(veil_resolver_t* resolver) {
+  manifest_header_t header;
+  cstr data;
+  cstr tmp_path;
+  uv_fs_t req;
+  bool ok;
+
+  if (!resolver || cstr_is_empty(&resolver->manifest) || !resolver->dirty) {
+    return true;
+  }
+
+  memset(&header, 0, sizeof(manifest_header_t));
+  memcpy(header.magic, RESOLVE_MANIFEST_MAGIC, sizeof(header.magic));
+  header.header_size = sizeof(manifest_header_t);
+  header.flags = resolver->flags;
+  header.conditions_hash = resolver->conditions_hash;
+  header.dep_count = (uint32_t) cvec_resolve_dep_size(&resolver->deps);
+  header.entry_count = (uint32_t) cvec_resolve_entry_size(&resolver->entries);
+
+  data = cstr_init();
+  cstr_append_n(&data, (const char*) &header, sizeof(header));
+
+  c_foreach (it, cvec_resolve_dep, resolver->deps) {
+    manifest_dep_t dep = {
+      .mtime_sec = it.ref->mtime_sec,
+      .mtime_nsec = it.ref->mtime_nsec,
+      .exists = it.ref->exists,
+      .path_size = (uint32_t) cstr_size(&it.ref->path),
+    };
+
+    cstr_append_n(&data, (const char*) &dep, sizeof(dep));
+    cstr_append_n(&data, cstr_str(&it.ref->path), dep.path_size);
+  }
+
+  c_foreach (it, cvec_resolve_entry, resolver->entries) {
+    manifest_entry_t entry = {
+      .key_size = (uint32_t) cstr_size(&it.ref->key),
+      .resolved_size = (uint32_t) cstr_size(&it.ref->resolved),
+      .dep_count = it.ref->dep_count,
+      .reserved = 0,
+    };
+
+    cstr_append_n(&data, (const char*) &entry, sizeof(entry));
+    cstr_append_n(&data, cstr_str(&it.ref->key), entry.key_size);
+    cstr_append_n(&data, cstr_str(&it.ref->resolved), entry.resolved_size);
+    cstr_append_n(&data, (const char*) cvec_u32_at(&resolver->entry_deps, it.ref->dep_start), entry.dep_count * sizeof(uint32_t));
+  }
+
+  // same temp file and rename dance as the code cache, for concurrent runs
+  tmp_path = cstr_from_fmt("%s.%d.%p.tmp", cstr_str(&resolver->manifest), (int) uv_os_getpid(), (void*) resolver);
+  ok = veil_file_write(cstr_str(&tmp_path), cstr_str(&data), cstr_size(&data));
+
+  if (ok) {
+    ok = uv_fs_rename(NULL, &req, cstr_str(&tmp_path), cstr_str(&resolver->manifest), NULL) == 0;
+  } else {
+    uv_fs_unlink(NULL, &req, cstr_str(&tmp_path), NULL);
+  }
+  uv_fs_req_cleanup(&req);
+
+  resolver->dirty = !ok;
+
+  cstr_drop(&tmp_path);
+  cstr_drop(&data);
+
+  return ok;
+}
+
+static void manifest_load(veil_resolver_t* resolver) {
+  const manifest_header_t* header;
+  const uint8_t* cursor;
+  const uint8_t* end;
+  veil_mmap_t map;
+  bool* valid;
+  uint32_t* remap;
+  cvec_u32 deps;
+
+  if (!veil_mmap_open(&map, cstr_str(&resolver->manifest))) {
+    return;
+  }
+
+  header = map.data;
+  if (map.size < sizeof(manifest_header_t)
+      || memcmp(header->magic, RESOLVE_MANIFEST_MAGIC, sizeof(header->magic)) != 0
+      || header->header_size != sizeof(manifest_header_t)
+      || header->flags != resolver->flags
+      || header->conditions_hash != resolver->conditions_hash) {
+    // written for different resolution settings; rebuilt on save
+    veil_mmap_close(&map);
+    return;
+  }
+
+  valid = calloc(header->dep_count + 1, sizeof(bool));
+  remap = calloc(header->dep_count + 1, sizeof(uint32_t));
+  CHECK_NOT_NULL(valid);
+  CHECK_NOT_NULL(remap);
+
+  cursor = (const uint8_t*) map.data + sizeof(manifest_header_t);
+  end = (const uint8_t*) map.data + map.size;
+
+  // one stat per dependency replaces every probe the entries needed
+  for (uint32_t n = 0; n < header->dep_count; n++) {
+    manifest_dep_t dep;
+    cstr path;
+    const resolve_dep_t* current;
+
+    if ((size_t) (end - cursor) < sizeof(dep)) {
+      goto done;
+    }
+    memcpy(&dep, cursor, sizeof(dep));
+    cursor += sizeof(dep);
+
+    if ((size_t) (end - cursor) < dep.path_size) {
+      goto done;
+    }
+    path = cstr_from_n((const char*) cursor, dep.path_size);
+    cursor += dep.path_size;
+
+    remap[n] = track(resolver, cstr_str(&path));
+    current = cvec_resolve_dep_at(&resolver->deps, remap[n]);
+    valid[n] = current->exists == (bool) dep.exists
+        && current->mtime_sec == dep.mtime_sec
+        && current->mtime_nsec == dep.mtime_nsec;
+    cstr_drop(&path);
+  }
+
+  deps = cvec_u32_init();
+
+  for (uint32_t n = 0; n < header->entry_count; n++) {
+    manifest_entry_t entry;
+    const char* key;
+    const char* resolved;
+    bool keep = true;
+
+    if ((size_t) (end - cursor) < sizeof(entry)) {
+      break;
+    }
+    memcpy(&entry, cursor, sizeof(entry));
+    cursor += sizeof(entry);
+
+    if ((uint64_t) (end - cursor) < (uint64_t) entry.key_size + entry.resolved_size + (uint64_t) entry.dep_count * sizeof(uint32_t)) {
+      break;
+    }
+    key = (const char*) cursor;
+    resolved = key + entry.key_size;
+    cursor += entry.key_size + entry.resolved_size;
+
+    cvec_u32_clear(&deps);
+    for (uint32_t d = 0; d < entry.dep_count; d++) {
+      uint32_t index;
+
+      memcpy(&index, cursor, sizeof(index));
+      cursor += sizeof(index);
+
+      if (index >= header->dep_count || !valid[index]) {
+        keep = false;
+      } else {
+        cvec_u32_push(&deps, remap[index]);
+      }
+    }
+
+    if (keep) {
+      cstr k = cstr_from_n(key, entry.key_size);
+      cstr r = cstr_from_n(resolved, entry.resolved_size);
+
+      add_entry(resolver, cstr_str(&k), cstr_str(&r), cvec_u32_front(&deps), (uint32_t) cvec_u32_size(&deps));
+      cstr_drop(&k);
+      cstr_drop(&r);
+    } else {
+      // dropped entries are re-resolved and the manifest rewritten
+      resolver->dirty = true;
+    }
+  }
+
+  cvec_u32_drop(&deps);
+
+done:
+  free(remap);
+  free(valid);
+  veil_mmap_close(&map);
+}
+
+static uint32_t track(veil_resolver_t* resolver, const char* path) {
+  const cmap_resolve_index_value* found = cmap_resolve_index_get(&resolver->dep_index, path);
+  resolve_dep_t dep;
+  uv_fs_t req;
+  uint32_t index;
+
+  if (found) {
+    return found->second;
+  }
+
+  dep.path = cstr_from(path);
+  dep.exists = uv_fs_stat(NULL, &req, path, NULL) == 0;
+  dep.mtime_sec = dep.exists ? req.statbuf.st_mtim.tv_sec : 0;
+  dep.mtime_nsec = dep.exists ? req.statbuf.st_mtim.tv_nsec : 0;
+  uv_fs_req_cleanup(&req);
+
+  index = (uint32_t) cvec_resolve_dep_size(&resolver->deps);
+  cvec_resolve_dep_push(&resolver->deps, dep);
+  cmap_resolve_index_emplace(&resolver->dep_index, path, index);
+
+  return index;
+}
+
+static void track_parent(veil_resolver_t* resolver, const char* path) {
+  cstr dir;
+  uint32_t index;
+
+  if (cstr_is_empty(&resolver->manifest)) {
+    return;
+  }
+
+  dir = cstr_init();
+  path_dirname(&dir, path);
+  index = track(resolver, cstr_str(&dir));
+  cstr_drop(&dir);
+
+  depend(resolver, index);
+}
+
+static void depend(veil_resolver_t* resolver, uint32_t index) {
+  c_foreach (it, cvec_u32, resolver->pending) {
+    if (*it.ref == index) {
+      return;
+    }
+  }
+  cvec_u32_push(&resolver->pending, index);
+}
+
+static void add_entry(veil_resolver_t* resolver, const char* key, const char* resolved, const uint32_t* deps, uint32_t dep_count) {
+  uint32_t index = (uint32_t) cvec_resolve_entry_size(&resolver->entries);
+
+  cvec_resolve_entry_push(&resolver->entries, (resolve_entry_t) {
+    .key = cstr_from(key),
+    .resolved = cstr_from(resolved),
+    .dep_start = (uint32_t) cvec_u32_size(&resolver->entry_deps),
+    .dep_count = dep_count,
+  });
+
+  for (uint32_t n = 0; n < dep_count; n++) {
+    cvec_u32_push(&resolver->entry_deps, deps[n]);
+  }
+
+  cmap_resolve_index_emplace(&resolver->cache, key, index);
+}
+
+static bool resolve_specifier(veil_resolver_t* resolver, JSContext* ctx, const char* dir, const char* specifier, cstr* out) {
+  cstr path;
+  bool found;
+
+  if (strncmp(specifier, "file://", 7) == 0) {
+    specifier += 7;
+  }
+
+  if (!is_relative(specifier) && specifier[0] != '/') {
+    found = resolve_package(resolver, ctx, dir, specifier, out);
+  } else {
+    path = cstr_init();
+    path_join(&path, dir, specifier);
+    found = resolve_file(resolver, ctx, cstr_str(&path), resolver->flags & RESOLVE_FLAG_ESM_NODE, out);
+    cstr_drop(&path);
+  }
+
+  if (found && !(resolver->flags & RESOLVE_FLAG_PRESERVE_SYMLINKS)) {
+    uv_fs_t req;
+
+    if (uv_fs_realpath(NULL, &req, cstr_str(out), NULL) == 0) {
+      cstr_assign(out, req.ptr);
+    }
+    uv_fs_req_cleanup(&req);
+  }
+
+  return found;
+}
+
+static bool resolve_file(veil_resolver_t* resolver, JSContext* ctx, const char* path, bool probe, cstr* out) {
+  static const char* EXTENSIONS[] = { ".js", ".mjs" };
+  static const char* INDEXES[] = { "/index.js", "/index.mjs" };
+  cstr candidate;
+  bool found = false;
+
+  if (is_file(resolver, path)) {
+    cstr_assign(out, path);
+    return true;
+  }
+
+  if (!probe) {
+    return false;
+  }
+
+  candidate = cstr_init();
+
+  for (size_t n = 0; n < countof(EXTENSIONS) && !found; n++) {
+    cstr_printf(&candidate, "%s%s", path, EXTENSIONS[n]);
+    found = is_file(resolver, cstr_str(&candidate));
+  }
+
+  if (!found && is_dir(resolver, path)) {
+    JSValue pkg = read_package(resolver, ctx, path);
+    JSValue main = JS_IsObject(pkg) ? JS_GetPropertyStr(ctx, pkg, "main") : JS_UNDEFINED;
+
+    if (JS_IsString(main)) {
+      const char* str = JS_ToCString(ctx, main);
+
+      if (str) {
+        cstr main_path = cstr_init();
+
+        path_join(&main_path, path, str);
+        // a directory main gets one level of probing, not another package
+        if (is_file(resolver, cstr_str(&main_path))) {
+          cstr_assign(&candidate, cstr_str(&main_path));
+          found = true;
+        }
+
+        for (size_t n = 0; n < countof(EXTENSIONS) && !found; n++) {
+          cstr_printf(&candidate, "%s%s", cstr_str(&main_path), EXTENSIONS[n]);
+          found = is_file(resolver, cstr_str(&candidate));
+        }
+
+        for (size_t n = 0; n < countof(INDEXES) && !found; n++) {
+          cstr_printf(&candidate, "%s%s", cstr_str(&main_path), INDEXES[n]);
+          found = is_file(resolver, cstr_str(&candidate));
+        }
+
+        cstr_drop(&main_path);
+        JS_FreeCString(ctx, str);
+      }
+    }
+
+    JS_FreeValue(ctx, main);
+    JS_FreeValue(ctx, pkg);
+
+    for (size_t n = 0; n < countof(INDEXES) && !found; n++) {
+      cstr_printf(&candidate, "%s%s", path, INDEXES[n]);
+      found = is_file(resolver, cstr_str(&candidate));
+    }
+  }
+
+  if (found) {
+    cstr_assign(out, cstr_str(&candidate));
+  }
+  cstr_drop(&candidate);
+
+  return found;
+}
+
+static bool resolve_package(veil_resolver_t* resolver, JSContext* ctx, const char* dir, const char* specifier, cstr* out) {
+  const char* slash = strchr(specifier, '/');
+  cstr name;
+  cstr subpath;
+  cstr current;
+  cstr pkg_dir;
+  bool found = false;
+
+  // @scope/name takes two segments
+  if (specifier[0] == '@' && slash) {
+    slash = strchr(slash + 1, '/');
+  }
+
+  name = slash ? cstr_from_n(specifier, slash - specifier) : cstr_from(specifier);
+  subpath = cstr_from_fmt(".%s", slash ? slash : "");
+  current = cstr_from(dir);
+  pkg_dir = cstr_init();
+
+  for (;;) {
+    const char* str = cstr_str(&current);
+    size_t size = cstr_size(&current);
+
+    // node_modules/node_modules is never searched
+    if (!(size >= 13 && strcmp(str + size - 13, "/node_modules") == 0)) {
+      cstr_printf(&pkg_dir, "%s%snode_modules/%s", str, size && str[size - 1] == '/' ? "" : "/", cstr_str(&name));
+
+      if (is_dir(resolver, cstr_str(&pkg_dir))) {
+        JSValue pkg = read_package(resolver, ctx, cstr_str(&pkg_dir));
+        JSValue exports = JS_IsObject(pkg) ? JS_GetPropertyStr(ctx, pkg, "exports") : JS_UNDEFINED;
+
+        if (!JS_IsUndefined(exports) && !JS_IsNull(exports)) {
+          found = resolve_exports(resolver, ctx, cstr_str(&pkg_dir), exports, cstr_str(&subpath), out);
+        } else {
+          cstr path = cstr_init();
+
+          path_join(&path, cstr_str(&pkg_dir), cstr_str(&subpath));
+          // package entry points are probed in either resolution mode
+          found = resolve_file(resolver, ctx, cstr_str(&path), true, out);
+          cstr_drop(&path);
+        }
+
+        JS_FreeValue(ctx, exports);
+        JS_FreeValue(ctx, pkg);
+        // the nearest package of that name wins even when it fails
+        break;
+      }
+    }
+
+    if (size <= 1 || strchr(str, '/') == NULL) {
+      break;
+    }
+    path_dirname(&pkg_dir, str);
+    if (cstr_equals(&pkg_dir, str)) {
+      break;
+    }
+    cstr_assign(&current, cstr_str(&pkg_dir));
+  }
+
+  cstr_drop(&pkg_dir);
+  cstr_drop(&current);
+  cstr_drop(&subpath);
+  cstr_drop(&name);
+
+  return found;
+}
+
+static bool resolve_exports(veil_resolver_t* resolver, JSContext* ctx, const char* pkg_dir, JSValueConst exports, const char* subpath, cstr* out) {
+  JSPropertyEnum* props;
+  uint32_t count;
+  bool subpaths = false;
+  bool found = false;
+  cstr best_key;
+  cstr best_match;
+  size_t best_prefix = 0;
+  JSValue target;
+
+  if (JS_IsObject(exports) && !JS_IsArray(ctx, exports)) {
+    if (JS_GetOwnPropertyNames(ctx, &props, &count, exports, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+      return false;
+    }
+
+    for (uint32_t n = 0; n < count; n++) {
+      const char* key = JS_AtomToCString(ctx, props[n].atom);
+
+      subpaths = subpaths || (key && key[0] == '.');
+      JS_FreeCString(ctx, key);
+    }
+  } else {
+    props = NULL;
+    count = 0;
+  }
+
+  // a string, array or condition object is sugar for { ".": exports }
+  if (!subpaths) {
+    for (uint32_t n = 0; n < count; n++) {
+      JS_FreeAtom(ctx, props[n].atom);
+    }
+    js_free(ctx, props);
+
+    return strcmp(subpath, ".") == 0 && resolve_target(resolver, ctx, pkg_dir, exports, NULL, out);
+  }
+
+  best_key = cstr_init();
+  best_match = cstr_init();
+
+  for (uint32_t n = 0; n < count; n++) {
+    const char* key = JS_AtomToCString(ctx, props[n].atom);
+    const char* star = key ? strchr(key, '*') : NULL;
+
+    if (key && strcmp(key, subpath) == 0) {
+      cstr_assign(&best_key, key);
+      cstr_clear(&best_match);
+      JS_FreeCString(ctx, key);
+      break;
+    }
+
+    // "./features/*.js": longest matching prefix wins
+    if (star && strncmp(subpath, key, star - key) == 0) {
+      size_t prefix = star - key;
+      size_t suffix = strlen(star + 1);
+      size_t size = strlen(subpath);
+
+      if (size >= prefix + suffix && strcmp(subpath + size - suffix, star + 1) == 0 && prefix >= best_prefix) {
+        best_prefix = prefix;
+        cstr_assign(&best_key, key);
+        cstr_assign_n(&best_match, subpath + prefix, size - prefix - suffix);
+      }
+    }
+
+    JS_FreeCString(ctx, key);
+  }
+
+  if (!cstr_is_empty(&best_key)) {
+    target = JS_GetPropertyStr(ctx, exports, cstr_str(&best_key));
+    found = resolve_target(resolver, ctx, pkg_dir, target,
+        strchr(cstr_str(&best_key), '*') ? cstr_str(&best_match) : NULL, out);
+    JS_FreeValue(ctx, target);
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    JS_FreeAtom(ctx, props[n].atom);
+  }
+  js_free(ctx, props);
+  cstr_drop(&best_match);
+  cstr_drop(&best_key);
+
+  return found;
+}
+
+static bool resolve_target(veil_resolver_t* resolver, JSContext* ctx, const char* pkg_dir, JSValueConst target, const char* match, cstr* out) {
+  bool found = false;
+
+  if (JS_IsString(target)) {
+    const char* str = JS_ToCString(ctx, target);
+    cstr rel;
+    cstr path;
+    const char* star;
+
+    // targets must stay inside the package
+    if (!str || strncmp(str, "./", 2) != 0) {
+      JS_FreeCString(ctx, str);
+      return false;
+    }
+
+    rel = cstr_init();
+    star = match ? strchr(str, '*') : NULL;
+    if (star) {
+      cstr_printf(&rel, "%.*s%s%s", (int) (star - str), str, match, star + 1);
+    } else {
+      cstr_assign(&rel, str);
+    }
+    JS_FreeCString(ctx, str);
+
+    path = cstr_init();
+    path_join(&path, pkg_dir, cstr_str(&rel));
+    // exports name exact files
+    found = resolve_file(resolver, ctx, cstr_str(&path), false, out);
+    cstr_drop(&path);
+    cstr_drop(&rel);
+  } else if (JS_IsArray(ctx, target)) {
+    int64_t length = 0;
+    JSValue value = JS_GetPropertyStr(ctx, target, "length");
+
+    JS_ToInt64(ctx, &length, value);
+    JS_FreeValue(ctx, value);
+
+    for (int64_t n = 0; n < length && !found; n++) {
+      JSValue item = JS_GetPropertyUint32(ctx, target, (uint32_t) n);
+
+      found = resolve_target(resolver, ctx, pkg_dir, item, match, out);
+      JS_FreeValue(ctx, item);
+    }
+  } else if (JS_IsObject(target)) {
+    JSPropertyEnum* props;
+    uint32_t count;
+
+    if (JS_GetOwnPropertyNames(ctx, &props, &count, target, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+      return false;
+    }
+
+    // conditions are tried in the object's key order, not ours
+    for (uint32_t n = 0; n < count; n++) {
+      const char* key = JS_AtomToCString(ctx, props[n].atom);
+      bool active = false;
+
+      if (key && !found) {
+        c_foreach (it, cvec_str, resolver->conditions) {
+          if (cstr_equals(it.ref, key)) {
+            active = true;
+            break;
+          }
+        }
+      }
+
+      if (active) {
+        JSValue value = JS_GetProperty(ctx, target, props[n].atom);
+
+        found = resolve_target(resolver, ctx, pkg_dir, value, match, out);
+        JS_FreeValue(ctx, value);
+      }
+
+      JS_FreeCString(ctx, key);
+      JS_FreeAtom(ctx, props[n].atom);
+    }
+    js_free(ctx, props);
+  }
+
+  return found;
+}
+
+static JSValue read_package(veil_resolver_t* resolver, JSContext* ctx, const char* pkg_dir) {
+  veil_file_t file;
+  cstr filename = cstr_from_fmt("%s/package.json", pkg_dir);
+  JSValue pkg = JS_UNDEFINED;
+
+  if (!cstr_is_empty(&resolver->manifest)) {
+    // an edit in place leaves the directory mtime alone
+    depend(resolver, track(resolver, cstr_str(&filename)));
+  }
+  track_parent(resolver, cstr_str(&filename));
+
+  if (veil_file_read(&file, cstr_str(&filename))) {
+    pkg = JS_ParseJSON(ctx, file.data, file.size, cstr_str(&filename));
+    if (JS_IsException(pkg)) {
+      // a broken package.json resolves as if it were missing
+      JS_FreeValue(ctx, JS_GetException(ctx));
+      pkg = JS_UNDEFINED;
+    }
+    veil_file_drop(&file);
+  }
+
+  cstr_drop(&filename);
+
+  return pkg;
+}
+
+static bool is_file(veil_resolver_t* resolver, const char* path) {
+  uv_fs_t req;
+  bool result;
+
+  track_parent(resolver, path);
+
+  result = uv_fs_stat(NULL, &req, path, NULL) == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFREG;
+  uv_fs_req_cleanup(&req);
+
+  return result;
+}
+
+static bool is_dir(veil_resolver_t* resolver, const char* path) {
+  uv_fs_t req;
+  bool result;
+
+  track_parent(resolver, path);
+
+  result = uv_fs_stat(NULL, &req, path, NULL) == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFDIR;
+  uv_fs_req_cleanup(&req);
+
+  return result;
+}
+
+static void path_dirname(cstr* out, const char* path) {
+  const char* slash = strrchr(path, '/');
+  char cwd[4096];
+  size_t cwd_size = sizeof(cwd);
+
+  if (path[0] != '/') {
+    // relative names come from the command line and are relative to the cwd
+    if (uv_cwd(cwd, &cwd_size) != 0) {
+      cwd[0] = '\0';
+    }
+    cstr_assign_n(out, path, slash ? (size_t) (slash - path) : 0);
+    path_join(out, cwd, cstr_str(out));
+  } else if (slash == path) {
+    cstr_assign(out, "/");
+  } else {
+    cstr_assign_n(out, path, slash - path);
+  }
+}
+
+static void path_join(cstr* out, const char* dir, const char* rel) {
+  // folds "." and ".." segments; an absolute rel ignores dir
+  cstr result = cstr_from(rel[0] == '/' ? "" : dir);
+  const char* p = rel;
+
+  if (cstr_size(&result) && cstr_str(&result)[cstr_size(&result) - 1] == '/') {
+    cstr_resize(&result, cstr_size(&result) - 1, 0);
+  }
+
+  while (*p) {
+    const char* slash = strchr(p, '/');
+    size_t size = slash ? (size_t) (slash - p) : strlen(p);
+
+    if (size == 2 && p[0] == '.' && p[1] == '.') {
+      const char* str = cstr_str(&result);
+      size_t n = cstr_size(&result);
+
+      while (n > 0 && str[n - 1] != '/') {
+        n--;
+      }
+      cstr_resize(&result, n > 0 ? n - 1 : 0, 0);
+    } else if (size > 0 && !(size == 1 && p[0] == '.')) {
+      cstr_append_n(&result, "/", 1);
+      cstr_append_n(&result, p, size);
+    }
+
+    p += size;
+    if (*p == '/') {
+      p++;
+    }
+  }
+
+  if (cstr_is_empty(&result)) {
+    cstr_assign(&result, "/");
+  }
+
+  cstr_assign(out, cstr_str(&result));
+  cstr_drop(&result);
+}
+
+static bool is_relative(const char* specifier) {
+  return strcmp(specifier, ".") == 0
+      || strcmp(specifier, "..") == 0
+      || strncmp(specifier, "./", 2) == 0
+      || strncmp(specifier, "../", 3) == 0;
+}
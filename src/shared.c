@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <math.h>
+
+#define i_type cmap_shared
+#define i_key uintptr_t
+#define i_val size_t
+#include <stc/cmap.h>
+
+// Reference counted malloc blocks that outlive any single runtime. They back
+// every SharedArrayBuffer, every large ArrayBuffer veil makes, and every
+// ArrayBuffer received through a transfer list, so moving them between VMs
+// never copies the payload.
+
+// smaller stores are not worth a registry entry; a transfer copies them
+#define SHARED_ADOPT_MIN (16 * 1024)
+
+// a thread blocked in Atomics.wait(), on the list until notified, timed out
+// or interrupted
+typedef struct waiter_s waiter_t;
+
+struct waiter_s {
+  waiter_t* next;
+  waiter_t* prev;
+  const void* address;
+  const veil_vm_t* vm;
+  uv_cond_t cond;
+  bool woken;
+};
+
+static uv_mutex_t mutex;
+static uv_once_t once = UV_ONCE_INIT;
+// data -> reference count
+static cmap_shared blocks;
+// guarded by mutex
+static waiter_t* waiters;
+
+static void shared_init();
+static void* sab_alloc(void* opaque, size_t size);
+static void sab_free(void* opaque, void* ptr);
+static void sab_dup(void* opaque, void* ptr);
+static void array_buffer_free(JSRuntime* rt, void* opaque, void* ptr);
+static void data_free(JSRuntime* rt, void* opaque, void* ptr);
+static JSValue array_buffer_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv);
+static JSValue atomics_wait(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue atomics_notify(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static uint8_t* atomics_address(JSContext* ctx, JSValueConst array, JSValueConst index, size_t* size);
+static void waiter_unlink(waiter_t* waiter);
+
+static const JSSharedArrayBufferFunctions SAB_FUNCTIONS = {
+  sab_alloc,
+  sab_free,
+  sab_dup,
+  NULL,
+};
+
+void veil_shared_install(JSRuntime* rt) {
+  JS_SetSharedArrayBufferFunctions(rt, &SAB_FUNCTIONS);
+  // Atomics.wait() is allowed on every veil thread, main thread included
+  JS_SetCanBlock(rt, true);
+}
+
+void veil_shared_install_globals(veil_vm_t* vm) {
+  JSContext* ctx = vm->context;
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue atomics = JS_GetPropertyStr(ctx, global, "Atomics");
+  JSValue proto;
+  JSValue ctor;
+
+  vm->array_buffer = JS_GetPropertyStr(ctx, global, "ArrayBuffer");
+  proto = JS_GetPropertyStr(ctx, vm->array_buffer, "prototype");
+
+  ctor = JS_NewCFunction2(ctx, array_buffer_ctor, "ArrayBuffer", 1, JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, ctor, proto);
+  // isView() and Symbol.species come from the engine's constructor
+  JS_SetPrototype(ctx, ctor, vm->array_buffer);
+  JS_SetPropertyStr(ctx, global, "ArrayBuffer", ctor);
+
+  vm->atomics_wait = JS_GetPropertyStr(ctx, atomics, "wait");
+  vm->atomics_notify = JS_GetPropertyStr(ctx, atomics, "notify");
+  JS_DefinePropertyValueStr(ctx, atomics, "wait", JS_NewCFunction(ctx, atomics_wait, "wait", 4), JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+  JS_DefinePropertyValueStr(ctx, atomics, "notify", JS_NewCFunction(ctx, atomics_notify, "notify", 3), JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+
+  JS_FreeValue(ctx, atomics);
+  JS_FreeValue(ctx, proto);
+  JS_FreeValue(ctx, global);
+}
+
+void veil_shared_drop_globals(veil_vm_t* vm) {
+  JS_FreeValue(vm->context, vm->array_buffer);
+  JS_FreeValue(vm->context, vm->atomics_wait);
+  JS_FreeValue(vm->context, vm->atomics_notify);
+  vm->array_buffer = JS_UNDEFINED;
+  vm->atomics_wait = JS_UNDEFINED;
+  vm->atomics_notify = JS_UNDEFINED;
+}
+
+void* veil_shared_alloc(size_t size) {
+  // never 0, so every block has a key of its own
+  void* data = malloc(size ? size : 1);
+  CHECK_NOT_NULL(data);
+
+  return veil_shared_adopt(data);
+}
+
+void* veil_shared_adopt(void* data) {
+  uv_once(&once, shared_init);
+  uv_mutex_lock(&mutex);
+  cmap_shared_insert(&blocks, (uintptr_t) data, 1);
+  uv_mutex_unlock(&mutex);
+
+  return data;
+}
+
+void veil_shared_dup(void* data) {
+  uv_mutex_lock(&mutex);
+  cmap_shared_get_mut(&blocks, (uintptr_t) data)->second++;
+  uv_mutex_unlock(&mutex);
+}
+
+void veil_shared_free(void* data) {
+  cmap_shared_value* block;
+  bool last;
+
+  uv_mutex_lock(&mutex);
+  block = cmap_shared_get_mut(&blocks, (uintptr_t) data);
+  last = --block->second == 0;
+  if (last) {
+    cmap_shared_erase(&blocks, (uintptr_t) data);
+  }
+  uv_mutex_unlock(&mutex);
+
+  if (last) {
+    free(data);
+  }
+}
+
+bool veil_shared_owns(const void* data) {
+  bool owned;
+
+  if (!data) {
+    return false;
+  }
+
+  uv_once(&once, shared_init);
+  uv_mutex_lock(&mutex);
+  owned = cmap_shared_contains(&blocks, (uintptr_t) data);
+  uv_mutex_unlock(&mutex);
+
+  return owned;
+}
+
+JSValue veil_shared_new_array_buffer(JSContext* ctx, void* data, size_t size) {
+  return JS_NewArrayBuffer(ctx, data, size, array_buffer_free, NULL, false);
+}
+
+JSValue veil_shared_adopt_array_buffer(JSContext* ctx, uint8_t* data, size_t size) {
+  JSValue buffer;
+
+  if (size < SHARED_ADOPT_MIN) {
+    buffer = JS_NewArrayBuffer(ctx, data, size, data_free, NULL, false);
+    if (JS_IsException(buffer)) {
+      free(data);
+    }
+    return buffer;
+  }
+
+  buffer = veil_shared_new_array_buffer(ctx, veil_shared_adopt(data), size);
+  if (JS_IsException(buffer)) {
+    veil_shared_free(data);
+  }
+
+  return buffer;
+}
+
+void veil_shared_interrupt(const veil_vm_t* vm) {
+  uv_once(&once, shared_init);
+  uv_mutex_lock(&mutex);
+  for (waiter_t* waiter = waiters; waiter; waiter = waiter->next) {
+    if (waiter->vm == vm) {
+      uv_cond_signal(&waiter->cond);
+    }
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+static void shared_init() {
+  CHECK_OK(uv_mutex_init(&mutex));
+  blocks = cmap_shared_init();
+}
+
+static void* sab_alloc(void* opaque, size_t size) {
+  return veil_shared_alloc(size);
+}
+
+static void sab_free(void* opaque, void* ptr) {
+  veil_shared_free(ptr);
+}
+
+static void sab_dup(void* opaque, void* ptr) {
+  veil_shared_dup(ptr);
+}
+
+static void array_buffer_free(JSRuntime* rt, void* opaque, void* ptr) {
+  veil_shared_free(ptr);
+}
+
+static void data_free(JSRuntime* rt, void* opaque, void* ptr) {
+  free(ptr);
+}
+
+// new ArrayBuffer(length) puts a large store in a shared block up front, so
+// that its first transfer to another VM does not copy it either. Anything
+// else goes to the engine's constructor.
+static JSValue array_buffer_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  uint64_t length = 0;
+  JSValue buffer;
+  JSValue proto;
+  void* data;
+
+  if (argc > 0 && JS_IsNumber(argv[0]) && JS_ToIndex(ctx, &length, argv[0]) < 0) {
+    return JS_EXCEPTION;
+  }
+
+  // shared blocks live outside the heap, so under --max-heap-size stores stay
+  // with the engine where the limit counts them
+  if (length < SHARED_ADOPT_MIN || length > INT32_MAX || vm->cfg->max_heap_size) {
+    return JS_CallConstructor2(ctx, vm->array_buffer, new_target, argc, argv);
+  }
+
+  data = calloc(1, (size_t) length);
+  if (!data) {
+    return JS_ThrowOutOfMemory(ctx);
+  }
+
+  buffer = veil_shared_new_array_buffer(ctx, veil_shared_adopt(data), (size_t) length);
+  if (JS_IsException(buffer)) {
+    veil_shared_free(data);
+    return buffer;
+  }
+
+  // class Foo extends ArrayBuffer
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  if (JS_IsObject(proto)) {
+    JS_SetPrototype(ctx, buffer, proto);
+  }
+  JS_FreeValue(ctx, proto);
+
+  return buffer;
+}
+
+// The engine's Atomics.wait() blocks in a condition variable nothing outside
+// it can signal, so a worker stuck in one could never be terminated. This one
+// keeps its own waiters, which veil_shared_interrupt() wakes to run the VM's
+// interrupt handler; the engine's version still does the argument checks.
+static JSValue atomics_wait(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  JSValueConst args[4];
+  const char* outcome;
+  uint64_t deadline = 0;
+  waiter_t waiter;
+  uint8_t* address;
+  size_t size;
+  int64_t expected;
+  double timeout = INFINITY;
+  JSValue result;
+  bool equal;
+
+  for (int n = 0; n < 3; n++) {
+    args[n] = n < argc ? argv[n] : JS_UNDEFINED;
+  }
+  args[3] = JS_NewInt32(ctx, 0);
+
+  if (argc > 3 && !JS_IsUndefined(argv[3]) && JS_ToFloat64(ctx, &timeout, argv[3]) < 0) {
+    return JS_EXCEPTION;
+  }
+
+  // a poll that finds the value still expected goes on to block here
+  result = JS_Call(ctx, vm->atomics_wait, this_val, 4, args);
+  if (JS_IsException(result) || timeout <= 0) {
+    return result;
+  }
+  outcome = JS_ToCString(ctx, result);
+  equal = outcome && strcmp(outcome, "timed-out") == 0;
+  JS_FreeCString(ctx, outcome);
+  if (!equal) {
+    return result;
+  }
+  JS_FreeValue(ctx, result);
+
+  address = atomics_address(ctx, argv[0], argv[1], &size);
+  if (!address) {
+    return JS_EXCEPTION;
+  }
+  if (size == 8) {
+    if (JS_ToBigInt64(ctx, &expected, argv[2]) < 0) {
+      return JS_EXCEPTION;
+    }
+  } else {
+    int32_t value;
+
+    if (JS_ToInt32(ctx, &value, argv[2]) < 0) {
+      return JS_EXCEPTION;
+    }
+    expected = value;
+  }
+
+  // NaN and anything past a few decades wait forever
+  if (!isnan(timeout) && timeout < 1e12) {
+    deadline = uv_hrtime() + (uint64_t) (timeout * 1e6);
+  }
+
+  memset(&waiter, 0, sizeof(waiter_t));
+  outcome = "ok";
+  waiter.address = address;
+  waiter.vm = vm;
+  CHECK_OK(uv_cond_init(&waiter.cond));
+
+  uv_once(&once, shared_init);
+  uv_mutex_lock(&mutex);
+
+  equal = size == 8 ? *(volatile int64_t*) address == expected : *(volatile int32_t*) address == expected;
+  if (!equal) {
+    outcome = "not-equal";
+  } else {
+    waiter.next = waiters;
+    if (waiters) {
+      waiters->prev = &waiter;
+    }
+    waiters = &waiter;
+
+    for (;;) {
+      uint64_t now;
+
+      // checked under the mutex, which veil_shared_interrupt() takes after
+      // the handler's flag is set, so a wakeup cannot slip in between
+      if (vm->interrupt && vm->interrupt(vm->runtime, vm->interrupt_opaque)) {
+        outcome = NULL;
+        break;
+      }
+      if (waiter.woken) {
+        break;
+      }
+
+      if (!deadline) {
+        uv_cond_wait(&waiter.cond, &mutex);
+        continue;
+      }
+
+      now = uv_hrtime();
+      if (now >= deadline || uv_cond_timedwait(&waiter.cond, &mutex, deadline - now) == UV_ETIMEDOUT) {
+        if (!waiter.woken) {
+          outcome = "timed-out";
+          break;
+        }
+      }
+    }
+
+    if (!waiter.woken) {
+      waiter_unlink(&waiter);
+    }
+  }
+
+  uv_mutex_unlock(&mutex);
+  uv_cond_destroy(&waiter.cond);
+
+  if (!outcome) {
+    return JS_ThrowInternalError(ctx, "interrupted");
+  }
+
+  return JS_NewString(ctx, outcome);
+}
+
+static JSValue atomics_notify(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  JSValueConst args[3];
+  double count = INFINITY;
+  int64_t woken = 0;
+  uint8_t* address;
+  size_t size;
+  JSValue result;
+
+  for (int n = 0; n < 2; n++) {
+    args[n] = n < argc ? argv[n] : JS_UNDEFINED;
+  }
+  args[2] = JS_NewInt32(ctx, 0);
+
+  if (argc > 2 && !JS_IsUndefined(argv[2]) && JS_ToFloat64(ctx, &count, argv[2]) < 0) {
+    return JS_EXCEPTION;
+  }
+
+  result = JS_Call(ctx, vm->atomics_notify, this_val, 3, args);
+  if (JS_IsException(result)) {
+    return result;
+  }
+  JS_FreeValue(ctx, result);
+
+  address = atomics_address(ctx, argv[0], argv[1], &size);
+  if (!address) {
+    return JS_EXCEPTION;
+  }
+
+  uv_once(&once, shared_init);
+  uv_mutex_lock(&mutex);
+  for (waiter_t* waiter = waiters; waiter && woken < count;) {
+    waiter_t* next = waiter->next;
+
+    if (waiter->address == address) {
+      waiter->woken = true;
+      waiter_unlink(waiter);
+      uv_cond_signal(&waiter->cond);
+      woken++;
+    }
+    waiter = next;
+  }
+  uv_mutex_unlock(&mutex);
+
+  return JS_NewInt64(ctx, woken);
+}
+
+// the element of an integer typed array the engine has already vetted
+static uint8_t* atomics_address(JSContext* ctx, JSValueConst array, JSValueConst index, size_t* size) {
+  size_t offset;
+  size_t length;
+  size_t buffer_size;
+  uint64_t n;
+  uint8_t* data;
+  JSValue buffer = JS_GetTypedArrayBuffer(ctx, array, &offset, &length, size);
+
+  if (JS_IsException(buffer)) {
+    return NULL;
+  }
+
+  data = JS_GetArrayBuffer(ctx, &buffer_size, buffer);
+  JS_FreeValue(ctx, buffer);
+
+  if (!data || JS_ToIndex(ctx, &n, index) < 0) {
+    return NULL;
+  }
+
+  return data + offset + n * *size;
+}
+
+static void waiter_unlink(waiter_t* waiter) {
+  if (waiter->prev) {
+    waiter->prev->next = waiter->next;
+  } else {
+    waiters = waiter->next;
+  }
+  if (waiter->next) {
+    waiter->next->prev = waiter->prev;
+  }
+  waiter->next = NULL;
+  waiter->prev = NULL;
+}
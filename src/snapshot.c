@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#define i_type cvec_snapshot_entry
+#define i_val veil_snapshot_entry_t
+#define i_opt (c_no_cmp | c_is_fwd)
+#include <stc/cvec.h>
+
+#define i_type cmap_snapshot_resolution
+#define i_key_str
+#define i_val_str
+#define i_opt c_is_fwd
+#include <stc/cmap.h>
+
+#define SNAPSHOT_MAGIC "VEILSNP2"
+#define SNAPSHOT_VERSION_SIZE 32
+
+#define SNAPSHOT_ENTRY_ROOT 0x1
+#define SNAPSHOT_ENTRY_MODULE 0x2
+// name is the resolution key, the payload is the resolved name
+#define SNAPSHOT_ENTRY_RESOLUTION 0x4
+
+typedef struct snapshot_header_s {
+  char magic[8];
+  char qjs_version[SNAPSHOT_VERSION_SIZE];
+  uint32_t header_size;
+  uint32_t entry_count;
+} snapshot_header_t;
+
+typedef struct snapshot_entry_header_s {
+  uint32_t flags;
+  uint32_t name_size;
+  uint64_t bytecode_size;
+} snapshot_entry_header_t;
+
+static void header_init(snapshot_header_t* header, uint32_t entry_count);
+static void resolution_key(cstr* key, const char* base, const char* specifier);
+static bool write_entry(uv_file fd, int64_t* offset, uint32_t flags, const cstr* name, const uint8_t* payload, size_t payload_size);
+
+void veil_snapshot_init(veil_snapshot_t* snapshot, bool recording) {
+  snapshot->recording = recording;
+  snapshot->entries = cvec_snapshot_entry_init();
+  snapshot->resolutions = cmap_snapshot_resolution_init();
+}
+
+void veil_snapshot_drop(veil_snapshot_t* snapshot) {
+  c_foreach (it, cvec_snapshot_entry, snapshot->entries) {
+    cstr_drop(&it.ref->name);
+    free(it.ref->bytecode);
+  }
+  cvec_snapshot_entry_drop(&snapshot->entries);
+  cmap_snapshot_resolution_drop(&snapshot->resolutions);
+  snapshot->recording = false;
+}
+
+void veil_snapshot_record(veil_snapshot_t* snapshot, JSContext* ctx, const char* filename, JSValueConst compiled, bool root) {
+  veil_snapshot_entry_t entry;
+  uint8_t* bytecode;
+  size_t size;
+
+  if (!snapshot->recording) {
+    return;
+  }
+
+  bytecode = JS_WriteObject(ctx, &size, compiled, JS_WRITE_OBJ_BYTECODE);
+  CHECK_NOT_NULL(bytecode);
+
+  entry.root = root;
+  entry.module = JS_VALUE_GET_TAG(compiled) == JS_TAG_MODULE;
+  entry.name = cstr_from(filename);
+  entry.bytecode = malloc(size);
+  CHECK_NOT_NULL(entry.bytecode);
+  memcpy(entry.bytecode, bytecode, size);
+  entry.bytecode_size = size;
+  js_free(ctx, bytecode);
+
+  cvec_snapshot_entry_push(&snapshot->entries, entry);
+}
+
+void veil_snapshot_record_resolution(veil_snapshot_t* snapshot, const char* base, const char* specifier, const char* resolved) {
+  cstr key;
+
+  if (!snapshot->recording) {
+    return;
+  }
+
+  key = cstr_init();
+  resolution_key(&key, base, specifier);
+  cmap_snapshot_resolution_emplace(&snapshot->resolutions, cstr_str(&key), resolved);
+  cstr_drop(&key);
+}
+
+char* veil_snapshot_resolve(veil_snapshot_t* snapshot, JSContext* ctx, const char* base, const char* specifier) {
+  const cmap_snapshot_resolution_value* found;
+  cstr key;
+
+  // only a restored snapshot has a table to answer from
+  if (snapshot->recording || cmap_snapshot_resolution_empty(&snapshot->resolutions)) {
+    return NULL;
+  }
+
+  key = cstr_init();
+  resolution_key(&key, base, specifier);
+  found = cmap_snapshot_resolution_get(&snapshot->resolutions, cstr_str(&key));
+  cstr_drop(&key);
+
+  return found ? js_strndup(ctx, cstr_str(&found->second), cstr_size(&found->second)) : NULL;
+}
+
+bool veil_snapshot_write(veil_snapshot_t* snapshot, const char* filename) {
+  snapshot_header_t header;
+  uv_buf_t buf;
+  uv_fs_t req;
+  uv_file fd;
+  cstr tmp_path;
+  int64_t offset = 0;
+  bool ok;
+
+  // a failed or interrupted build never leaves a truncated blob behind
+  tmp_path = cstr_from_fmt("%s.%d.tmp", filename, (int) uv_os_getpid());
+
+  fd = uv_fs_open(NULL, &req, cstr_str(&tmp_path), UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    cstr_drop(&tmp_path);
+    return false;
+  }
+
+  header_init(&header, cvec_snapshot_entry_size(&snapshot->entries) + cmap_snapshot_resolution_size(&snapshot->resolutions));
+  buf = uv_buf_init((char*) &header, sizeof(header));
+  ok = uv_fs_write(NULL, &req, fd, &buf, 1, offset, NULL) == (int) sizeof(header);
+  uv_fs_req_cleanup(&req);
+  offset += sizeof(header);
+
+  c_foreach (it, cvec_snapshot_entry, snapshot->entries) {
+    uint32_t flags = (it.ref->root ? SNAPSHOT_ENTRY_ROOT : 0) | (it.ref->module ? SNAPSHOT_ENTRY_MODULE : 0);
+
+    if (!ok) {
+      break;
+    }
+
+    ok = write_entry(fd, &offset, flags, &it.ref->name, it.ref->bytecode, it.ref->bytecode_size);
+  }
+
+  c_foreach (it, cmap_snapshot_resolution, snapshot->resolutions) {
+    if (!ok) {
+      break;
+    }
+
+    ok = write_entry(fd, &offset, SNAPSHOT_ENTRY_RESOLUTION, &it.ref->first, (const uint8_t*) cstr_str(&it.ref->second), cstr_size(&it.ref->second));
+  }
+
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+
+  if (ok) {
+    ok = uv_fs_rename(NULL, &req, cstr_str(&tmp_path), filename, NULL) == 0;
+  } else {
+    uv_fs_unlink(NULL, &req, cstr_str(&tmp_path), NULL);
+  }
+  uv_fs_req_cleanup(&req);
+  cstr_drop(&tmp_path);
+
+  return ok;
+}
+
+bool veil_snapshot_restore(veil_vm_t* vm, const char* filename) {
+  snapshot_header_t expected;
+  const snapshot_header_t* header;
+  const uint8_t* cursor;
+  const uint8_t* end;
+  veil_mmap_t map;
+  JSValue* roots;
+  uint32_t root_count = 0;
+  bool ok = true;
+
+  if (!veil_mmap_open(&map, filename)) {
+    fprintf(stderr, "veil: could not open snapshot blob '%s'\n", filename);
+    return false;
+  }
+
+  header = map.data;
+  if (map.size < sizeof(snapshot_header_t)) {
+    fprintf(stderr, "veil: invalid snapshot blob '%s'\n", filename);
+    veil_mmap_close(&map);
+    return false;
+  }
+
+  header_init(&expected, header->entry_count);
+  if (memcmp(header, &expected, sizeof(snapshot_header_t)) != 0) {
+    fprintf(stderr, "veil: snapshot blob '%s' was built by an incompatible version\n", filename);
+    veil_mmap_close(&map);
+    return false;
+  }
+
+  roots = calloc(header->entry_count + 1, sizeof(JSValue));
+  CHECK_NOT_NULL(roots);
+
+  cursor = (const uint8_t*) map.data + sizeof(snapshot_header_t);
+  end = (const uint8_t*) map.data + map.size;
+
+  // read every record first so module imports resolve against the context's
+  // module list instead of going through the loader, and specifiers resolve
+  // against the recorded table instead of the resolver
+  for (uint32_t n = 0; n < header->entry_count; n++) {
+    snapshot_entry_header_t entry_header;
+    JSValue compiled;
+
+    if ((size_t) (end - cursor) < sizeof(entry_header)) {
+      ok = false;
+      break;
+    }
+    memcpy(&entry_header, cursor, sizeof(entry_header));
+    cursor += sizeof(entry_header);
+
+    if ((uint64_t) (end - cursor) < entry_header.name_size + entry_header.bytecode_size) {
+      ok = false;
+      break;
+    }
+
+    if (entry_header.flags & SNAPSHOT_ENTRY_RESOLUTION) {
+      cmap_snapshot_resolution_insert(&vm->snapshot.resolutions,
+                                      cstr_from_n((const char*) cursor, entry_header.name_size),
+                                      cstr_from_n((const char*) cursor + entry_header.name_size, entry_header.bytecode_size));
+      cursor += entry_header.name_size + entry_header.bytecode_size;
+      continue;
+    }
+
+    cursor += entry_header.name_size;
+
+    compiled = JS_ReadObject(vm->context, cursor, entry_header.bytecode_size, JS_READ_OBJ_BYTECODE);
+    cursor += entry_header.bytecode_size;
+
+    if (JS_IsException(compiled)) {
+      veil_vm_dump_exception(vm);
+      ok = false;
+      break;
+    }
+
+    if (entry_header.flags & SNAPSHOT_ENTRY_ROOT) {
+      roots[root_count++] = compiled;
+    } else {
+      // modules stay registered with the context
+      JS_FreeValue(vm->context, compiled);
+    }
+  }
+
+  if (!ok) {
+    fprintf(stderr, "veil: invalid snapshot blob '%s'\n", filename);
+  }
+
+  for (uint32_t n = 0; n < root_count; n++) {
+    if (ok) {
+      ok = veil_vm_run_compiled(vm, roots[n]);
+    } else {
+      JS_FreeValue(vm->context, roots[n]);
+    }
+  }
+
+  free(roots);
+  veil_mmap_close(&map);
+
+  return ok;
+}
+
+static void header_init(snapshot_header_t* header, uint32_t entry_count) {
+  memset(header, 0, sizeof(snapshot_header_t));
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  strncpy(header->qjs_version, QJS_VERSION, SNAPSHOT_VERSION_SIZE - 1);
+  header->header_size = sizeof(snapshot_header_t);
+  header->entry_count = entry_count;
+}
+
+static void resolution_key(cstr* key, const char* base, const char* specifier) {
+  cstr_assign(key, base);
+  cstr_append(key, "\n");
+  cstr_append(key, specifier);
+}
+
+static bool write_entry(uv_file fd, int64_t* offset, uint32_t flags, const cstr* name, const uint8_t* payload, size_t payload_size) {
+  snapshot_entry_header_t entry_header = {
+    .flags = flags,
+    .name_size = cstr_size(name),
+    .bytecode_size = payload_size,
+  };
+  uv_buf_t bufs[3] = {
+    uv_buf_init((char*) &entry_header, sizeof(entry_header)),
+    uv_buf_init((char*) cstr_str(name), entry_header.name_size),
+    uv_buf_init((char*) payload, payload_size),
+  };
+  size_t size = bufs[0].len + bufs[1].len + bufs[2].len;
+  uv_fs_t req;
+  bool ok;
+
+  ok = uv_fs_write(NULL, &req, fd, bufs, 3, *offset, NULL) == (int) size;
+  uv_fs_req_cleanup(&req);
+  *offset += size;
+
+  return ok;
+}
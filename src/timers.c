@@ -0,0 +1,771 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+// setTimeout() and setInterval() share one uv_timer_t. Timers sit in a
+// hierarchical wheel of millisecond ticks: level n has 64 slots of 64^n ms,
+// and a timer goes in the level of the highest 6-bit group in which its
+// expiry differs from the wheel's time. Inserting and clearing are O(1) list
+// operations; a slot above level 0 is re-sorted into the levels below when
+// the wheel's time reaches it. The uv timer is only restarted when the next
+// slot to visit moves earlier, so a burst of request timeouts with the same
+// delay costs no heap operations at all.
+//
+// setImmediate() callbacks wait in a FIFO that the loop's check job runs
+// ahead of microtasks; its idle job keeps poll from blocking while any are
+// queued.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+// 42 bits of milliseconds
+#define WHEEL_LEVELS 7
+// node's TIMEOUT_MAX; longer delays become 1 ms, as there
+#define TIMER_MAX_DELAY 2147483647.0
+
+typedef struct timer_list_s {
+  veil_timer_t* head;
+  veil_timer_t* tail;
+} timer_list_t;
+
+struct veil_timer_s {
+  veil_timer_t* next;
+  veil_timer_t* prev;
+  // the list the timer is on, NULL when inactive
+  timer_list_t* list;
+  // held while active so the callback stays reachable; a root, so it is
+  // not marked
+  JSValue object;
+  // released once a timeout has fired or been cleared
+  JSValue callback;
+  JSValue* args;
+  int argc;
+  uint64_t expiry;
+  uint32_t delay;
+  bool repeat;
+  bool immediate;
+  bool refed;
+  // the callback is running, which keeps it and its arguments
+  bool firing;
+};
+
+struct veil_timers_s {
+  veil_vm_t* vm;
+  uv_timer_t handle;
+  veil_cleanup_t cleanup;
+  // the tick the wheel has reached
+  uint64_t now;
+  // when the uv timer is due, UINT64_MAX when it is stopped
+  uint64_t scheduled;
+  // ref'd timers; the uv timer is unref'd when there are none
+  uint32_t refs;
+  uint64_t occupied[WHEEL_LEVELS];
+  timer_list_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  // due timers whose callbacks have not run yet
+  timer_list_t expired;
+  timer_list_t immediates;
+  // the immediates of the current check phase
+  timer_list_t running;
+  uint32_t immediate_refs;
+};
+
+static JSClassID timeout_class_id;
+static JSClassID immediate_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static int timers_module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue timers_set(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue timers_clear(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue timer_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue timer_has_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue timer_refresh(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue timer_close(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static void timeout_finalizer(JSRuntime* rt, JSValue val);
+static void immediate_finalizer(JSRuntime* rt, JSValue val);
+static void timeout_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func);
+static void immediate_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func);
+static void timer_mark(JSRuntime* rt, veil_timer_t* timer, JS_MarkFunc* mark_func);
+static void timer_release(JSRuntime* rt, veil_timer_t* timer);
+static void timer_free(JSRuntime* rt, veil_timer_t* timer);
+
+static veil_timers_t* get_timers(veil_vm_t* vm);
+static veil_timer_t* get_timer(JSContext* ctx, JSValueConst obj, int magic);
+static void timer_start(veil_timers_t* timers, veil_timer_t* timer, JSValueConst obj);
+static void timer_stop(veil_timers_t* timers, veil_timer_t* timer);
+static void timer_fire(veil_timers_t* timers, veil_timer_t* timer);
+static void timer_set_ref(veil_timers_t* timers, veil_timer_t* timer, bool refed);
+static void wheel_insert(veil_timers_t* timers, veil_timer_t* timer);
+static void wheel_advance(veil_timers_t* timers, uint64_t target);
+static uint64_t wheel_next(veil_timers_t* timers, int* level);
+static void schedule(veil_timers_t* timers);
+static void update_ref(veil_timers_t* timers);
+static void list_push(timer_list_t* list, veil_timer_t* timer);
+static veil_timer_t* list_shift(timer_list_t* list);
+static void list_remove(veil_timers_t* timers, veil_timer_t* timer);
+static void release_list(veil_timers_t* timers, timer_list_t* list);
+static uint32_t ctz64(uint64_t bits);
+static void timer_cb(uv_timer_t* handle);
+static void close_cb(uv_handle_t* handle);
+static void cleanup_cb(veil_cleanup_t* cleanup);
+
+static const JSClassDef TIMEOUT_CLASS = {
+  "Timeout",
+  .finalizer = timeout_finalizer,
+  .gc_mark = timeout_mark,
+};
+
+static const JSClassDef IMMEDIATE_CLASS = {
+  "Immediate",
+  .finalizer = immediate_finalizer,
+  .gc_mark = immediate_mark,
+};
+
+enum {
+  SET_TIMEOUT,
+  SET_INTERVAL,
+  SET_IMMEDIATE,
+};
+
+static const JSCFunctionListEntry TIMEOUT_PROTO[] = {
+  JS_CFUNC_MAGIC_DEF("ref", 0, timer_ref, (SET_TIMEOUT << 1) | true),
+  JS_CFUNC_MAGIC_DEF("unref", 0, timer_ref, (SET_TIMEOUT << 1) | false),
+  JS_CFUNC_MAGIC_DEF("hasRef", 0, timer_has_ref, SET_TIMEOUT),
+  JS_CFUNC_DEF("refresh", 0, timer_refresh),
+  JS_CFUNC_DEF("close", 0, timer_close),
+};
+
+static const JSCFunctionListEntry IMMEDIATE_PROTO[] = {
+  JS_CFUNC_MAGIC_DEF("ref", 0, timer_ref, (SET_IMMEDIATE << 1) | true),
+  JS_CFUNC_MAGIC_DEF("unref", 0, timer_ref, (SET_IMMEDIATE << 1) | false),
+  JS_CFUNC_MAGIC_DEF("hasRef", 0, timer_has_ref, SET_IMMEDIATE),
+};
+
+static const JSCFunctionListEntry TIMERS[] = {
+  JS_CFUNC_MAGIC_DEF("setTimeout", 2, timers_set, SET_TIMEOUT),
+  JS_CFUNC_MAGIC_DEF("setInterval", 2, timers_set, SET_INTERVAL),
+  JS_CFUNC_MAGIC_DEF("setImmediate", 1, timers_set, SET_IMMEDIATE),
+  JS_CFUNC_MAGIC_DEF("clearTimeout", 1, timers_clear, SET_TIMEOUT),
+  JS_CFUNC_MAGIC_DEF("clearInterval", 1, timers_clear, SET_INTERVAL),
+  JS_CFUNC_MAGIC_DEF("clearImmediate", 1, timers_clear, SET_IMMEDIATE),
+};
+
+void veil_timers_install(veil_vm_t* vm) {
+  JSContext* ctx = vm->context;
+  JSRuntime* rt = vm->runtime;
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue proto;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, timeout_class_id)) {
+    JS_NewClass(rt, timeout_class_id, &TIMEOUT_CLASS);
+    JS_NewClass(rt, immediate_class_id, &IMMEDIATE_CLASS);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, TIMEOUT_PROTO, countof(TIMEOUT_PROTO));
+  JS_SetClassProto(ctx, timeout_class_id, proto);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, IMMEDIATE_PROTO, countof(IMMEDIATE_PROTO));
+  JS_SetClassProto(ctx, immediate_class_id, proto);
+
+  JS_SetPropertyFunctionList(ctx, global, TIMERS, countof(TIMERS));
+  JS_FreeValue(ctx, global);
+}
+
+JSModuleDef* veil_timers_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, timers_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, TIMERS, countof(TIMERS));
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+bool veil_timers_has_immediates(veil_vm_t* vm) {
+  return vm->timers && vm->timers->immediate_refs > 0;
+}
+
+// Runs the immediates queued before this check phase; ones they queue wait
+// for the next. Microtasks drain after each callback, as in node.
+void veil_timers_run_immediates(veil_vm_t* vm) {
+  veil_timers_t* timers = vm->timers;
+  veil_timer_t* timer;
+
+  if (!timers || !timers->immediates.head) {
+    return;
+  }
+
+  timers->running = timers->immediates;
+  timers->immediates.head = NULL;
+  timers->immediates.tail = NULL;
+  for (timer = timers->running.head; timer; timer = timer->next) {
+    timer->list = &timers->running;
+  }
+
+  // a callback can clear the next one or tear the VM down
+  while (vm->timers && (timer = list_shift(&timers->running))) {
+    timer_fire(timers, timer);
+  }
+}
+
+static void global_init() {
+  JS_NewClassID(&timeout_class_id);
+  JS_NewClassID(&immediate_class_id);
+}
+
+// the same functions as the globals
+static int timers_module_init(JSContext* ctx, JSModuleDef* m) {
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue timers = JS_NewObject(ctx);
+
+  for (size_t n = 0; n < countof(TIMERS); n++) {
+    JSValue value = JS_GetPropertyStr(ctx, global, TIMERS[n].name);
+
+    JS_SetPropertyStr(ctx, timers, TIMERS[n].name, JS_DupValue(ctx, value));
+    JS_SetModuleExport(ctx, m, TIMERS[n].name, value);
+  }
+
+  JS_SetModuleExport(ctx, m, "default", timers);
+  JS_FreeValue(ctx, global);
+
+  return 0;
+}
+
+// setTimeout(callback[, delay[, ...args]]), setInterval() alike and
+// setImmediate(callback[, ...args])
+static JSValue timers_set(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  int first_arg = magic == SET_IMMEDIATE ? 1 : 2;
+  veil_timers_t* timers;
+  veil_timer_t* timer;
+  double delay = 1;
+  JSValue obj;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "timers require an event loop");
+  }
+
+  if (argc < 1 || !JS_IsFunction(ctx, argv[0])) {
+    return JS_ThrowTypeError(ctx, "callback must be a function");
+  }
+
+  if (magic != SET_IMMEDIATE && argc > 1 && JS_ToFloat64(ctx, &delay, argv[1]) < 0) {
+    return JS_EXCEPTION;
+  }
+
+  // NaN fails both comparisons
+  if (!(delay >= 1 && delay <= TIMER_MAX_DELAY)) {
+    delay = 1;
+  }
+
+  obj = JS_NewObjectClass(ctx, magic == SET_IMMEDIATE ? immediate_class_id : timeout_class_id);
+  if (JS_IsException(obj)) {
+    return obj;
+  }
+
+  timer = calloc(1, sizeof(veil_timer_t));
+  CHECK_NOT_NULL(timer);
+  timer->object = JS_UNDEFINED;
+  timer->callback = JS_DupValue(ctx, argv[0]);
+  timer->delay = (uint32_t) delay;
+  timer->repeat = magic == SET_INTERVAL;
+  timer->immediate = magic == SET_IMMEDIATE;
+  timer->refed = true;
+
+  if (argc > first_arg) {
+    timer->argc = argc - first_arg;
+    timer->args = malloc(timer->argc * sizeof(JSValue));
+    CHECK_NOT_NULL(timer->args);
+    for (int n = 0; n < timer->argc; n++) {
+      timer->args[n] = JS_DupValue(ctx, argv[first_arg + n]);
+    }
+  }
+
+  JS_SetOpaque(obj, timer);
+
+  timers = get_timers(vm);
+  timer_start(timers, timer, obj);
+
+  return obj;
+}
+
+// clearing anything that is not a timer of the right kind does nothing
+static JSValue timers_clear(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_timer_t* timer = argc > 0 ? get_timer(ctx, argv[0], magic) : NULL;
+
+  if (timer && vm->timers) {
+    timer->repeat = false;
+    timer_stop(vm->timers, timer);
+  }
+
+  if (timer && !timer->firing) {
+    timer_release(JS_GetRuntime(ctx), timer);
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue timer_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_timer_t* timer = get_timer(ctx, this_val, magic >> 1);
+
+  if (timer) {
+    if (vm->timers) {
+      timer_set_ref(vm->timers, timer, magic & 1);
+    } else {
+      timer->refed = magic & 1;
+    }
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue timer_has_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_timer_t* timer = get_timer(ctx, this_val, magic);
+
+  return JS_NewBool(ctx, timer && timer->refed);
+}
+
+// starts the timer over with its original delay; one that has fired or been
+// cleared has no callback left to run
+static JSValue timer_refresh(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_timer_t* timer = get_timer(ctx, this_val, SET_TIMEOUT);
+
+  if (timer && vm->timers && !JS_IsUndefined(timer->callback)) {
+    timer_stop(vm->timers, timer);
+    timer_start(vm->timers, timer, this_val);
+  }
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue timer_close(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  timers_clear(ctx, JS_UNDEFINED, 1, &this_val, SET_TIMEOUT);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static void timeout_finalizer(JSRuntime* rt, JSValue val) {
+  timer_free(rt, JS_GetOpaque(val, timeout_class_id));
+}
+
+static void immediate_finalizer(JSRuntime* rt, JSValue val) {
+  timer_free(rt, JS_GetOpaque(val, immediate_class_id));
+}
+
+// The callback commonly closes over the timer, as in clearing it from a
+// request's 'end' listener; marking lets the cycle collector see that.
+static void timeout_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+  timer_mark(rt, JS_GetOpaque(val, timeout_class_id), mark_func);
+}
+
+static void immediate_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+  timer_mark(rt, JS_GetOpaque(val, immediate_class_id), mark_func);
+}
+
+static void timer_mark(JSRuntime* rt, veil_timer_t* timer, JS_MarkFunc* mark_func) {
+  if (!timer) {
+    return;
+  }
+
+  JS_MarkValue(rt, timer->callback, mark_func);
+  for (int n = 0; n < timer->argc; n++) {
+    JS_MarkValue(rt, timer->args[n], mark_func);
+  }
+}
+
+static void timer_release(JSRuntime* rt, veil_timer_t* timer) {
+  JSValue callback = timer->callback;
+  JSValue* args = timer->args;
+  int argc = timer->argc;
+
+  // freeing can finalize objects that reach the timer
+  timer->callback = JS_UNDEFINED;
+  timer->args = NULL;
+  timer->argc = 0;
+
+  JS_FreeValueRT(rt, callback);
+  for (int n = 0; n < argc; n++) {
+    JS_FreeValueRT(rt, args[n]);
+  }
+  free(args);
+}
+
+static void timer_free(JSRuntime* rt, veil_timer_t* timer) {
+  if (!timer) {
+    return;
+  }
+
+  timer_release(rt, timer);
+  free(timer);
+}
+
+static veil_timers_t* get_timers(veil_vm_t* vm) {
+  veil_timers_t* timers = vm->timers;
+
+  if (timers) {
+    return timers;
+  }
+
+  timers = calloc(1, sizeof(veil_timers_t));
+  CHECK_NOT_NULL(timers);
+  timers->vm = vm;
+  timers->now = uv_now(&vm->uv->loop);
+  timers->scheduled = UINT64_MAX;
+
+  CHECK_OK(uv_timer_init(&vm->uv->loop, &timers->handle));
+  timers->handle.data = timers;
+  veil_vm_add_cleanup(vm, &timers->cleanup, cleanup_cb);
+  vm->timers = timers;
+
+  return timers;
+}
+
+// clearTimeout() and clearInterval() take either kind, as in browsers
+static veil_timer_t* get_timer(JSContext* ctx, JSValueConst obj, int magic) {
+  return JS_GetOpaque(obj, magic == SET_IMMEDIATE ? immediate_class_id : timeout_class_id);
+}
+
+static void timer_start(veil_timers_t* timers, veil_timer_t* timer, JSValueConst obj) {
+  timer->object = JS_DupValue(timers->vm->context, obj);
+
+  if (timer->refed) {
+    if (timer->immediate) {
+      timers->immediate_refs++;
+    } else {
+      timers->refs++;
+    }
+  }
+
+  if (timer->immediate) {
+    list_push(&timers->immediates, timer);
+    timer->list = &timers->immediates;
+    return;
+  }
+
+  // a stopped uv timer means an empty wheel, whose time can catch up
+  if (timers->scheduled == UINT64_MAX) {
+    timers->now = uv_now(&timers->vm->uv->loop);
+  }
+
+  timer->expiry = uv_now(&timers->vm->uv->loop) + timer->delay;
+  wheel_insert(timers, timer);
+
+  if (timer->expiry < timers->scheduled) {
+    schedule(timers);
+  }
+  update_ref(timers);
+}
+
+// The uv timer is left running: it wakes up once for nothing at worst, and
+// is unref'd when no ref'd timer is left.
+static void timer_stop(veil_timers_t* timers, veil_timer_t* timer) {
+  if (!timer->list) {
+    return;
+  }
+
+  list_remove(timers, timer);
+
+  if (timer->refed) {
+    if (timer->immediate) {
+      timers->immediate_refs--;
+    } else {
+      timers->refs--;
+      update_ref(timers);
+    }
+  }
+
+  JS_FreeValue(timers->vm->context, timer->object);
+  timer->object = JS_UNDEFINED;
+}
+
+// The timer is off every list; an interval goes back on the wheel after the
+// callback unless the callback cleared or refreshed it.
+static void timer_fire(veil_timers_t* timers, veil_timer_t* timer) {
+  veil_vm_t* vm = timers->vm;
+  JSContext* ctx = vm->context;
+  JSValue obj = timer->object;
+  JSValue result;
+
+  timer->list = NULL;
+  timer->object = JS_UNDEFINED;
+  if (timer->refed) {
+    if (timer->immediate) {
+      timers->immediate_refs--;
+    } else {
+      timers->refs--;
+    }
+  }
+
+  timer->firing = true;
+  result = JS_Call(ctx, timer->callback, obj, timer->argc, timer->args);
+  timer->firing = false;
+  if (JS_IsException(result)) {
+    veil_vm_dump_exception(vm);
+  }
+  JS_FreeValue(ctx, result);
+  veil_vm_drain_microtasks(vm);
+
+  if (vm->timers == timers && timer->repeat && !timer->list) {
+    timer_start(timers, timer, obj);
+  } else if (!timer->list) {
+    timer_release(JS_GetRuntime(ctx), timer);
+  }
+
+  JS_FreeValue(ctx, obj);
+}
+
+static void timer_set_ref(veil_timers_t* timers, veil_timer_t* timer, bool refed) {
+  if (timer->refed == refed) {
+    return;
+  }
+
+  timer->refed = refed;
+  if (!timer->list) {
+    return;
+  }
+
+  if (timer->immediate) {
+    timers->immediate_refs += refed ? 1 : -1;
+  } else {
+    timers->refs += refed ? 1 : -1;
+    update_ref(timers);
+  }
+}
+
+static void wheel_insert(veil_timers_t* timers, veil_timer_t* timer) {
+  uint64_t diff = timer->expiry ^ timers->now;
+  int level = 0;
+  int slot;
+
+  while ((diff >>= WHEEL_BITS) && level < WHEEL_LEVELS - 1) {
+    level++;
+  }
+
+  slot = (int) (timer->expiry >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+  list_push(&timers->slots[level][slot], timer);
+  timer->list = &timers->slots[level][slot];
+  timers->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+// Moves the wheel up to target, jumping straight from one occupied slot to
+// the next. Reaching a slot above level 0 spreads its timers over the levels
+// below; reaching one at level 0 fires it.
+static void wheel_advance(veil_timers_t* timers, uint64_t target) {
+  veil_vm_t* vm = timers->vm;
+  veil_timer_t* timer;
+  timer_list_t* list;
+  uint64_t next;
+  int level;
+  int slot;
+
+  for (;;) {
+    slot = (int) (timers->now & (WHEEL_SLOTS - 1));
+    list = &timers->slots[0][slot];
+    if (list->head) {
+      timers->expired = *list;
+      list->head = NULL;
+      list->tail = NULL;
+      timers->occupied[0] &= ~((uint64_t) 1 << slot);
+      for (timer = timers->expired.head; timer; timer = timer->next) {
+        timer->list = &timers->expired;
+      }
+
+      while ((timer = list_shift(&timers->expired))) {
+        timer_fire(timers, timer);
+        if (vm->timers != timers) {
+          return;
+        }
+      }
+    }
+
+    next = wheel_next(timers, &level);
+    if (next > target) {
+      timers->now = target;
+      return;
+    }
+
+    timers->now = next;
+    if (level > 0) {
+      slot = (int) (next >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+      list = &timers->slots[level][slot];
+      timers->occupied[level] &= ~((uint64_t) 1 << slot);
+
+      while ((timer = list_shift(list))) {
+        wheel_insert(timers, timer);
+      }
+    }
+  }
+}
+
+// The tick of the next occupied slot: exact at level 0, the start of the
+// slot above. Every slot above level 0 lies ahead of the wheel's time in its
+// level, so the lowest level with one holds the earliest.
+static uint64_t wheel_next(veil_timers_t* timers, int* level) {
+  for (int n = 0; n < WHEEL_LEVELS; n++) {
+    int shift = n * WHEEL_BITS;
+    int current = (int) (timers->now >> shift) & (WHEEL_SLOTS - 1);
+    uint64_t ahead = n == 0 ? ~(uint64_t) 0 << current : current == WHEEL_SLOTS - 1 ? 0 : ~(uint64_t) 0 << (current + 1);
+    uint64_t bits = timers->occupied[n] & ahead;
+
+    if (bits) {
+      uint64_t base = shift + WHEEL_BITS < 64 ? timers->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS) : 0;
+
+      *level = n;
+      return base | (uint64_t) ctz64(bits) << shift;
+    }
+  }
+
+  *level = 0;
+  return UINT64_MAX;
+}
+
+static void schedule(veil_timers_t* timers) {
+  int level;
+  uint64_t next = wheel_next(timers, &level);
+  uint64_t now;
+
+  if (next == timers->scheduled) {
+    return;
+  }
+
+  timers->scheduled = next;
+  if (next == UINT64_MAX) {
+    uv_timer_stop(&timers->handle);
+    return;
+  }
+
+  now = uv_now(&timers->vm->uv->loop);
+  CHECK_OK(uv_timer_start(&timers->handle, timer_cb, next > now ? next - now : 0, 0));
+}
+
+static void update_ref(veil_timers_t* timers) {
+  if (timers->refs > 0) {
+    uv_ref((uv_handle_t*) &timers->handle);
+  } else {
+    uv_unref((uv_handle_t*) &timers->handle);
+  }
+}
+
+static void list_push(timer_list_t* list, veil_timer_t* timer) {
+  timer->next = NULL;
+  timer->prev = list->tail;
+  if (list->tail) {
+    list->tail->next = timer;
+  } else {
+    list->head = timer;
+  }
+  list->tail = timer;
+}
+
+static veil_timer_t* list_shift(timer_list_t* list) {
+  veil_timer_t* timer = list->head;
+
+  if (timer) {
+    list->head = timer->next;
+    if (list->head) {
+      list->head->prev = NULL;
+    } else {
+      list->tail = NULL;
+    }
+    timer->next = NULL;
+    timer->list = NULL;
+  }
+
+  return timer;
+}
+
+static void list_remove(veil_timers_t* timers, veil_timer_t* timer) {
+  timer_list_t* list = timer->list;
+
+  if (timer->prev) {
+    timer->prev->next = timer->next;
+  } else {
+    list->head = timer->next;
+  }
+  if (timer->next) {
+    timer->next->prev = timer->prev;
+  } else {
+    list->tail = timer->prev;
+  }
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->list = NULL;
+
+  // the last timer of a wheel slot clears its bit
+  if (!list->head && list >= &timers->slots[0][0] && list < &timers->slots[0][0] + WHEEL_LEVELS * WHEEL_SLOTS) {
+    ptrdiff_t index = list - &timers->slots[0][0];
+
+    timers->occupied[index / WHEEL_SLOTS] &= ~((uint64_t) 1 << (index % WHEEL_SLOTS));
+  }
+}
+
+// dropping the hold can finalize the timer, so it is unlinked first
+static void release_list(veil_timers_t* timers, timer_list_t* list) {
+  veil_timer_t* timer;
+
+  while ((timer = list_shift(list))) {
+    JSValue obj = timer->object;
+
+    timer->object = JS_UNDEFINED;
+    JS_FreeValue(timers->vm->context, obj);
+  }
+}
+
+static uint32_t ctz64(uint64_t bits) {
+#ifdef _MSC_VER
+  unsigned long index;
+
+  _BitScanForward64(&index, bits);
+
+  return (uint32_t) index;
+#else
+  return (uint32_t) __builtin_ctzll(bits);
+#endif
+}
+
+static void timer_cb(uv_timer_t* handle) {
+  veil_timers_t* timers = handle->data;
+  veil_vm_t* vm = timers->vm;
+  uint64_t start = uv_hrtime();
+
+  // intervals re-armed by the callbacks are scheduled once, at the end
+  timers->scheduled = 0;
+  wheel_advance(timers, uv_now(handle->loop));
+  vm->uv->metrics.timer_ns += uv_hrtime() - start;
+
+  if (vm->timers == timers) {
+    schedule(timers);
+    update_ref(timers);
+  }
+}
+
+static void close_cb(uv_handle_t* handle) {
+  free(handle->data);
+}
+
+static void cleanup_cb(veil_cleanup_t* cleanup) {
+  veil_timers_t* timers = container_of(cleanup, veil_timers_t, cleanup);
+
+  timers->vm->timers = NULL;
+
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+      release_list(timers, &timers->slots[level][slot]);
+    }
+  }
+  release_list(timers, &timers->expired);
+  release_list(timers, &timers->immediates);
+  release_list(timers, &timers->running);
+
+  uv_close((uv_handle_t*) &timers->handle, close_cb);
+}
@@ -5,6 +5,22 @@
 #include "defs.h"
 
 #include <stc/cstr.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static uv_mutex_t diagnostic_mutex;
+static uv_once_t diagnostic_once = UV_ONCE_INIT;
+static uint32_t diagnostic_seq = 0;
+
+static void diagnostic_init();
 
 const char* cstr_str_safe(const cstr* str) {
   const char* value = cstr_str(str);
@@ -16,3 +32,285 @@ void veil_abort(const char* filename, size_t line, const char* msg) {
   fprintf(stderr, "%s@%zu: %s", filename, line, msg);
   abort();
 }
+
+bool veil_file_read(veil_file_t* file, const char* filename) {
+  uv_fs_t req;
+  uv_file fd;
+  size_t offset = 0;
+
+  memset(file, 0, sizeof(veil_file_t));
+
+  fd = uv_fs_open(NULL, &req, filename, UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    return false;
+  }
+
+  if (uv_fs_fstat(NULL, &req, fd, NULL) != 0) {
+    uv_fs_req_cleanup(&req);
+    goto fail;
+  }
+  file->size = req.statbuf.st_size;
+  file->mtime = req.statbuf.st_mtim;
+  uv_fs_req_cleanup(&req);
+
+  // +1 for the NUL terminator the QuickJS parser requires
+  file->data = malloc(file->size + 1);
+  CHECK_NOT_NULL(file->data);
+
+  while (offset < file->size) {
+    uv_buf_t buf = uv_buf_init(file->data + offset, file->size - offset);
+    int n = uv_fs_read(NULL, &req, fd, &buf, 1, offset, NULL);
+    uv_fs_req_cleanup(&req);
+    if (n <= 0) {
+      goto fail;
+    }
+    offset += n;
+  }
+  file->data[file->size] = '\0';
+
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return true;
+
+fail:
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  veil_file_drop(file);
+  return false;
+}
+
+void veil_file_drop(veil_file_t* file) {
+  free(file->data);
+  memset(file, 0, sizeof(veil_file_t));
+}
+
+bool veil_file_write(const char* filename, const void* data, size_t size) {
+  uv_fs_t req;
+  uv_file fd;
+  size_t offset = 0;
+
+  fd = uv_fs_open(NULL, &req, filename, UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    return false;
+  }
+
+  while (offset < size) {
+    uv_buf_t buf = uv_buf_init((char*) data + offset, size - offset);
+    int n = uv_fs_write(NULL, &req, fd, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    if (n <= 0) {
+      break;
+    }
+    offset += n;
+  }
+
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+
+  return offset == size;
+}
+
+#ifdef _WIN32
+bool veil_mmap_open(veil_mmap_t* map, const char* filename) {
+  LARGE_INTEGER size;
+  HANDLE file;
+
+  memset(map, 0, sizeof(veil_mmap_t));
+
+  file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  map->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if (map->mapping == NULL) {
+    return false;
+  }
+
+  map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (map->data == NULL) {
+    CloseHandle(map->mapping);
+    map->mapping = NULL;
+    return false;
+  }
+  map->size = (size_t) size.QuadPart;
+
+  return true;
+}
+
+void veil_mmap_close(veil_mmap_t* map) {
+  if (map->data) {
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+  }
+  memset(map, 0, sizeof(veil_mmap_t));
+}
+#else
+bool veil_mmap_open(veil_mmap_t* map, const char* filename) {
+  struct stat st;
+  int fd;
+
+  memset(map, 0, sizeof(veil_mmap_t));
+
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  map->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map->data == MAP_FAILED) {
+    map->data = NULL;
+    return false;
+  }
+  map->size = st.st_size;
+
+  return true;
+}
+
+void veil_mmap_close(veil_mmap_t* map) {
+  if (map->data) {
+    munmap(map->data, map->size);
+  }
+  memset(map, 0, sizeof(veil_mmap_t));
+}
+#endif
+
+uint64_t veil_hash(const void* data, size_t size) {
+  // FNV-1a
+  const uint8_t* p = data;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t n = 0; n < size; n++) {
+    hash ^= p[n];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+bool veil_parse_size(const char* str, size_t* out) {
+  // accepts a byte count with an optional k, m or g suffix (powers of 1024)
+  char* end;
+  unsigned long long value;
+  unsigned shift = 0;
+
+  if (!str || *str < '0' || *str > '9') {
+    return false;
+  }
+
+  errno = 0;
+  value = strtoull(str, &end, 10);
+  if (errno != 0) {
+    return false;
+  }
+
+  switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: break;
+  }
+
+  if (*end == 'b' || *end == 'B') {
+    end++;
+  }
+
+  if (*end != '\0' || value > (SIZE_MAX >> shift)) {
+    return false;
+  }
+
+  *out = (size_t) (value << shift);
+
+  return true;
+}
+
+void veil_json_append_string(cstr* out, const char* str, size_t size) {
+  static const char HEX[] = "0123456789abcdef";
+  size_t start = 0;
+
+  cstr_append_n(out, "\"", 1);
+
+  for (size_t n = 0; n < size; n++) {
+    unsigned char c = (unsigned char) str[n];
+    char escape[6];
+    size_t escape_size = 2;
+
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+
+    switch (c) {
+      case '"': memcpy(escape, "\\\"", 2); break;
+      case '\\': memcpy(escape, "\\\\", 2); break;
+      case '\n': memcpy(escape, "\\n", 2); break;
+      case '\r': memcpy(escape, "\\r", 2); break;
+      case '\t': memcpy(escape, "\\t", 2); break;
+      default:
+        memcpy(escape, "\\u00", 4);
+        escape[4] = HEX[c >> 4];
+        escape[5] = HEX[c & 0xf];
+        escape_size = 6;
+        break;
+    }
+
+    cstr_append_n(out, str + start, n - start);
+    cstr_append_n(out, escape, escape_size);
+    start = n + 1;
+  }
+
+  cstr_append_n(out, str + start, size - start);
+  cstr_append_n(out, "\"", 1);
+}
+
+void veil_json_append_fmt(cstr* out, const char* fmt, ...) {
+  char buf[256];
+  va_list args;
+  int size;
+
+  va_start(args, fmt);
+  size = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  CHECK(size >= 0 && (size_t) size < sizeof(buf));
+  cstr_append_n(out, buf, size);
+}
+
+void veil_diagnostic_filename(cstr* out, const char* dir, const char* prefix, const char* ext, int32_t thread_id) {
+  // <prefix>.<date>.<time>.<pid>.<thread id>.<seq>.<ext>, as node names them
+  time_t now = time(NULL);
+  struct tm tm;
+  char stamp[32];
+  uint32_t seq;
+
+  uv_once(&diagnostic_once, diagnostic_init);
+  uv_mutex_lock(&diagnostic_mutex);
+  seq = ++diagnostic_seq;
+  uv_mutex_unlock(&diagnostic_mutex);
+
+#ifdef _WIN32
+  localtime_s(&tm, &now);
+#else
+  localtime_r(&now, &tm);
+#endif
+  strftime(stamp, sizeof(stamp), "%Y%m%d.%H%M%S", &tm);
+
+  cstr_printf(out, "%s/%s.%s.%d.%d.%03u.%s", dir && *dir ? dir : ".", prefix, stamp, (int) uv_os_getpid(), thread_id, seq, ext);
+}
+
+static void diagnostic_init() {
+  CHECK_OK(uv_mutex_init(&diagnostic_mutex));
+}
@@ -4,8 +4,39 @@
 
 #pragma once
 
+#include <uv.h>
 #include <stc/forward.h>
 
+typedef struct veil_file_s {
+  char* data;
+  size_t size;
+  uv_timespec_t mtime;
+} veil_file_t;
+
+typedef struct veil_mmap_s {
+  void* data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+} veil_mmap_t;
+
 const char* cstr_str_safe(const cstr* str);
 
 void veil_abort(const char* filename, size_t line, const char* msg);
+
+bool veil_file_read(veil_file_t* file, const char* filename);
+void veil_file_drop(veil_file_t* file);
+bool veil_file_write(const char* filename, const void* data, size_t size);
+
+bool veil_mmap_open(veil_mmap_t* map, const char* filename);
+void veil_mmap_close(veil_mmap_t* map);
+
+uint64_t veil_hash(const void* data, size_t size);
+
+bool veil_parse_size(const char* str, size_t* out);
+
+void veil_json_append_string(cstr* out, const char* str, size_t size);
+void veil_json_append_fmt(cstr* out, const char* fmt, ...);
+
+void veil_diagnostic_filename(cstr* out, const char* dir, const char* prefix, const char* ext, int32_t thread_id);
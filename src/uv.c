@@ -8,9 +8,14 @@ static void notify(veil_uv_t* uv);
 static void before_poll_io_cb(uv_prepare_t *handle);
 static void after_poll_io_cb(uv_check_t* handle);
 static void idle_cb(uv_idle_t *handle);
+static void heap_snapshot_signal_cb(uv_signal_t* handle, int signum);
 
 void veil_uv_init(veil_uv_t* uv) {
   CHECK_OK(uv_loop_init(&uv->loop));
+  CHECK_OK(uv_loop_configure(&uv->loop, UV_METRICS_IDLE_TIME));
+
+  memset(&uv->metrics, 0, sizeof(veil_uv_metrics_t));
+  veil_histogram_init(&uv->metrics.iteration_busy);
 
   CHECK_OK(uv_prepare_init(&uv->loop, &uv->prepare_job));
   uv->prepare_job.data = uv;
@@ -24,6 +29,9 @@ void veil_uv_init(veil_uv_t* uv) {
   CHECK_OK(uv_async_init(&uv->loop, &uv->stop, NULL));
   uv->stop.data = uv;
 
+  CHECK_OK(uv_signal_init(&uv->loop, &uv->heap_snapshot_signal));
+  uv->heap_snapshot_signal.data = uv;
+
   uv->enabled = true;
 }
 
@@ -36,8 +44,16 @@ void veil_uv_drop(veil_uv_t* uv) {
   uv_close((uv_handle_t*) &uv->check_job, NULL);
   uv_close((uv_handle_t*) &uv->idle_job, NULL);
   uv_close((uv_handle_t*) &uv->stop, NULL);
-
-  uv_run(&uv->loop, UV_RUN_NOWAIT);
+  uv_close((uv_handle_t*) &uv->heap_snapshot_signal, NULL);
+
+  // Threadpool work cannot be stopped once a thread has it. The VM's
+  // cleanups cancelled what had not started; the rest finishes here, and its
+  // after_work callbacks free what the work used while the runtime is still
+  // there. A loop stopped early, as a terminated worker's is, would
+  // otherwise fail to close.
+  do {
+    uv_run(&uv->loop, uv->loop.active_reqs.count > 0 ? UV_RUN_ONCE : UV_RUN_NOWAIT);
+  } while (uv->loop.active_reqs.count > 0);
   CHECK_OK(uv_loop_close(&uv->loop));
 
   uv->enabled = false;
@@ -52,12 +68,53 @@ void veil_uv_run(veil_uv_t* uv) {
 
   uv_unref((uv_handle_t*) &uv->stop);
 
+  if (uv->heap_snapshot_signum && uv->heap_snapshot_cb) {
+    CHECK_OK(uv_signal_start(&uv->heap_snapshot_signal, heap_snapshot_signal_cb, uv->heap_snapshot_signum));
+    uv_unref((uv_handle_t*) &uv->heap_snapshot_signal);
+  }
+
+  uv->metrics.start = uv_hrtime();
+  uv->metrics.iteration_end = uv->metrics.start;
+  uv->metrics.iteration_idle = uv_metrics_idle_time(&uv->loop);
+
   notify(uv);
   uv_run(&uv->loop, UV_RUN_DEFAULT);
 }
 
+void veil_uv_get_metrics(veil_uv_t* uv, veil_loop_metrics_t* metrics) {
+  const veil_uv_metrics_t* m = &uv->metrics;
+  uint64_t now;
+  uint64_t io_ns;
+
+  memset(metrics, 0, sizeof(veil_loop_metrics_t));
+
+  if (!uv->enabled || m->start == 0) {
+    return;
+  }
+
+  now = uv_hrtime();
+  metrics->iterations = m->iterations;
+  metrics->loop_ns = now - m->start;
+  metrics->idle_ns = uv_metrics_idle_time(&uv->loop);
+  // called from an I/O callback, the poll phase is still open
+  metrics->poll_ns = m->poll_ns + (m->poll_start ? now - m->poll_start : 0);
+  metrics->timer_ns = m->timer_ns;
+  metrics->immediate_ns = m->immediate_ns;
+  metrics->microtask_ns = m->microtask_ns;
+  metrics->flush_ns = m->flush_ns;
+  // poll is either blocked or running I/O callbacks
+  io_ns = metrics->poll_ns > metrics->idle_ns ? metrics->poll_ns - metrics->idle_ns : 0;
+  metrics->callback_ns = m->timer_ns + io_ns + m->immediate_ns + m->microtask_ns;
+  metrics->utilization = metrics->loop_ns ? 1.0 - (double) metrics->idle_ns / (double) metrics->loop_ns : 0;
+  metrics->iteration_p50_ns = veil_histogram_percentile(&m->iteration_busy, 50);
+  metrics->iteration_p90_ns = veil_histogram_percentile(&m->iteration_busy, 90);
+  metrics->iteration_p99_ns = veil_histogram_percentile(&m->iteration_busy, 99);
+  metrics->iteration_max_ns = m->iteration_busy.max;
+}
+
+// the idle job keeps poll from blocking while work is queued
 static void notify(veil_uv_t* uv) {
-  if (uv->has_microtasks_cb(uv->microtask_context)) {
+  if (uv->has_microtasks_cb(uv->microtask_context) || uv->has_immediates_cb(uv->microtask_context)) {
       uv_idle_start(&uv->idle_job, idle_cb);
   } else {
       uv_idle_stop(&uv->idle_job);
@@ -66,19 +123,59 @@ static void notify(veil_uv_t* uv) {
 
 static void before_poll_io_cb(uv_prepare_t* handle) {
   veil_uv_t* uv = handle->data;
+  uint64_t start;
   CHECK_NOT_NULL(uv);
 
+  start = uv_hrtime();
+  uv->flush_cb(uv->microtask_context);
   notify(uv);
+  uv->metrics.poll_start = uv_hrtime();
+  uv->metrics.flush_ns += uv->metrics.poll_start - start;
 }
 
 static void after_poll_io_cb(uv_check_t* handle) {
   veil_uv_t* uv = handle->data;
+  veil_uv_metrics_t* metrics;
+  uint64_t poll_end;
+  uint64_t immediates_end;
+  uint64_t microtasks_end;
+  uint64_t now;
+  uint64_t idle;
   CHECK_NOT_NULL(uv);
 
+  metrics = &uv->metrics;
+  poll_end = uv_hrtime();
+  if (metrics->poll_start) {
+    metrics->poll_ns += poll_end - metrics->poll_start;
+    metrics->poll_start = 0;
+  }
+
+  uv->run_immediates_cb(uv->microtask_context);
+  immediates_end = uv_hrtime();
   uv->run_microtasks_cb(uv->microtask_context);
+  microtasks_end = uv_hrtime();
+  uv->flush_cb(uv->microtask_context);
   notify(uv);
+
+  now = uv_hrtime();
+  idle = uv_metrics_idle_time(&uv->loop);
+  metrics->immediate_ns += immediates_end - poll_end;
+  metrics->microtask_ns += microtasks_end - immediates_end;
+  metrics->flush_ns += now - microtasks_end;
+  metrics->iterations++;
+  // an iteration runs check to check; time blocked in poll is not busy time
+  veil_histogram_record(&metrics->iteration_busy, (now - metrics->iteration_end) - (idle - metrics->iteration_idle));
+  metrics->iteration_end = now;
+  metrics->iteration_idle = idle;
 }
 
 static void idle_cb(uv_idle_t* handle) {
   (void) handle;
 }
+
+static void heap_snapshot_signal_cb(uv_signal_t* handle, int signum) {
+  veil_uv_t* uv = handle->data;
+  CHECK_NOT_NULL(uv);
+
+  uv->heap_snapshot_cb(uv->microtask_context);
+}
@@ -4,8 +4,9 @@
 
 #include "defs.h"
 
-static bool has_microtasks(uv_microtask_context_t* context);
-static void run_microtasks(uv_microtask_context_t* context);
+static void prefetch(veil_t* veil);
+static bool run_preloads(veil_t* veil);
+static bool run_script(veil_t* veil);
 
 veil_t* veil_init() {
   veil_t* veil = calloc(1, sizeof(veil_t));
@@ -29,23 +30,99 @@ veil_parse_args_result_t veil_parse_args(veil_t* veil, int argc, char** argv) {
 }
 
 int veil_run(veil_t* veil) {
+  int exit_code = 0;
+  bool ok;
+  veil_bundle_t* bundle = NULL;
+  veil_bundle_builder_t* bundle_builder = NULL;
+
   CHECK_NOT_NULL(veil);
 
   veil->cfg.writable = false;
 
-  veil_vm_init(&veil->vm);
+  veil_vm_init(&veil->vm, &veil->cfg);
   veil_uv_init(&veil->uv);
 
-  veil->uv.microtask_context = (uv_microtask_context_t*)&veil->vm;
-  veil->uv.has_microtasks_cb = has_microtasks;
-  veil->uv.run_microtasks_cb = run_microtasks;
+  veil_vm_attach(&veil->vm, &veil->uv);
+
+  if (veil->cfg.script_op == VEIL_SCRIPT_OP_BUNDLE) {
+    bundle = veil_bundle_open(cstr_str(&veil->cfg.script));
+    veil->vm.bundle = bundle;
+  }
+
+  if (!cstr_is_empty(&veil->cfg.build_bundle)) {
+    bundle_builder = veil_bundle_builder_new();
+    for (size_t n = 0; n < veil_cfg_get_bundle_asset_count(veil); n++) {
+      veil_bundle_builder_add_asset(bundle_builder, veil_cfg_get_bundle_asset(veil, n));
+    }
+    veil->vm.bundle_builder = bundle_builder;
+  }
+
+  if (veil->cfg.script_op == VEIL_SCRIPT_OP_BUNDLE && !bundle) {
+    exit_code = 1;
+  } else {
+    prefetch(veil);
+
+    ok = run_preloads(veil);
+    // the blob holds the preload graph only; the entry script always runs from source
+    veil->vm.snapshot.recording = false;
+
+    if (!ok || !run_script(veil)) {
+      exit_code = 1;
+    }
+
+    // later dynamic imports load on demand
+    veil_prefetch_free(veil->vm.prefetch);
+    veil->vm.prefetch = NULL;
+  }
+
+  if (exit_code == 0) {
+    veil_uv_run(&veil->uv);
+
+    if (veil->vm.uncaught) {
+      exit_code = 1;
+    }
+
+    if (exit_code == 0 && veil->cfg.build_snapshot && !veil_snapshot_write(&veil->vm.snapshot, cstr_str_safe(&veil->cfg.snapshot_blob))) {
+      fprintf(stderr, "veil: could not write snapshot blob '%s'\n", cstr_str_safe(&veil->cfg.snapshot_blob));
+      exit_code = 1;
+    }
 
-  veil_uv_run(&veil->uv);
+    if (exit_code == 0 && bundle_builder && !veil_bundle_builder_write(bundle_builder, cstr_str(&veil->cfg.build_bundle))) {
+      fprintf(stderr, "veil: could not write bundle '%s'\n", cstr_str(&veil->cfg.build_bundle));
+      exit_code = 1;
+    }
+  }
+
+  // workers replay the manifest but only the main thread writes it
+  if (!veil_resolver_save(veil->vm.resolver)) {
+    fprintf(stderr, "veil: could not write resolution manifest '%s'\n", cstr_str_safe(&veil->cfg.resolution_manifest));
+  }
 
+  veil_worker_drop_all(&veil->vm);
+  veil_vm_run_cleanups(&veil->vm);
   veil_uv_drop(&veil->uv);
   veil_vm_drop(&veil->vm);
+  // workers borrow both, so they go after the VM
+  veil_bundle_builder_free(bundle_builder);
+  veil_bundle_close(bundle);
+
+  return exit_code;
+}
+
+void veil_get_microtask_stats(veil_t* veil, veil_microtask_stats_t* stats) {
+  *stats = veil->vm.microtasks.stats;
+}
 
-  return 0;
+void veil_get_loop_metrics(veil_t* veil, veil_loop_metrics_t* metrics) {
+  veil_uv_get_metrics(&veil->uv, metrics);
+}
+
+void veil_get_memory_usage(veil_t* veil, veil_memory_usage_t* usage) {
+  veil_heap_get_usage(&veil->vm, usage);
+}
+
+bool veil_write_heap_snapshot(veil_t* veil, const char* filename) {
+  return veil->vm.enabled && veil_heap_write_snapshot(&veil->vm, filename);
 }
 
 int veil_main(int argc, char** argv) {
@@ -53,7 +130,10 @@ int veil_main(int argc, char** argv) {
   veil_t* veil = veil_init();
   veil_parse_args_result_t p = veil_parse_args(veil, argc, argv);
 
-  if (p.ok) {
+  // workers see --workers too, but run the script
+  if (p.ok && veil->cfg.workers > 0 && veil_cluster_worker_id() == 0) {
+    exit_code = veil_cluster_run(veil, argc, argv);
+  } else if (p.ok) {
     exit_code = veil_run(veil);
   } else {
     exit_code = p.exit_code;
@@ -64,16 +144,67 @@ int veil_main(int argc, char** argv) {
   return exit_code;
 }
 
-static bool has_microtasks(uv_microtask_context_t* context) {
-  veil_vm_t* vm = (veil_vm_t*)context;
-  CHECK_TRUE(vm->enabled);
+static void prefetch(veil_t* veil) {
+  veil_cfg_t* cfg = &veil->cfg;
+  veil_prefetch_t* prefetch = veil_prefetch_new(&veil->vm);
+
+  if (cfg->build_snapshot || cstr_is_empty(&cfg->snapshot_blob)) {
+    for (size_t n = 0; n < veil_cfg_get_require_count(veil); n++) {
+      veil_prefetch_add(prefetch, veil_cfg_get_require(veil, n), false);
+    }
 
-  return JS_IsJobPending(vm->runtime);
+    for (size_t n = 0; n < veil_cfg_get_import_count(veil); n++) {
+      veil_prefetch_add(prefetch, veil_cfg_get_import(veil, n), true);
+    }
+  }
+
+  if (cfg->script_op == VEIL_SCRIPT_OP_SPECIFIER && !cstr_is_empty(&cfg->script)) {
+    veil_prefetch_add(prefetch, cstr_str(&cfg->script), false);
+  }
+
+  // reads and compiles the import graph on the threadpool
+  veil_prefetch_wait(prefetch);
+  veil->vm.prefetch = prefetch;
 }
 
-static void run_microtasks(uv_microtask_context_t* context) {
-  veil_vm_t* vm = (veil_vm_t*)context;
-  CHECK_TRUE(vm->enabled);
+static bool run_preloads(veil_t* veil) {
+  veil_cfg_t* cfg = &veil->cfg;
+
+  // a restored snapshot replaces the --require / --import preloads
+  if (!cfg->build_snapshot && !cstr_is_empty(&cfg->snapshot_blob)) {
+    return veil_snapshot_restore(&veil->vm, cstr_str(&cfg->snapshot_blob));
+  }
+
+  for (size_t n = 0; n < veil_cfg_get_require_count(veil); n++) {
+    if (!veil_vm_run_file(&veil->vm, veil_cfg_get_require(veil, n), false)) {
+      return false;
+    }
+  }
+
+  for (size_t n = 0; n < veil_cfg_get_import_count(veil); n++) {
+    if (!veil_vm_run_file(&veil->vm, veil_cfg_get_import(veil, n), true)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool run_script(veil_t* veil) {
+  veil_cfg_t* cfg = &veil->cfg;
+
+  if (cfg->script_op == VEIL_SCRIPT_OP_BUNDLE) {
+    // the preloads and script of the build run, in their original order
+    for (size_t n = 0; n < veil_bundle_root_count(veil->vm.bundle); n++) {
+      if (!veil_vm_run_file(&veil->vm, veil_bundle_root(veil->vm.bundle, n), false)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
 
-  veil_vm_drain_microtasks(vm);
+  return cfg->script_op != VEIL_SCRIPT_OP_SPECIFIER
+      || cstr_is_empty(&cfg->script)
+      || veil_vm_run_file(&veil->vm, cstr_str(&cfg->script), false);
 }
@@ -4,14 +4,96 @@
 
 #include "defs.h"
 
-void veil_vm_init(veil_vm_t* vm) {
-  vm->runtime = JS_NewRuntime();
+#define i_type cvec_rejection
+#define i_val veil_rejection_t
+#define i_opt (c_no_cmp | c_is_fwd)
+#include <stc/cvec.h>
+
+// QuickJS's own starting threshold
+#define GC_DEFAULT_THRESHOLD (256 * 1024)
+// in adaptive mode the engine only collects on its own past this multiple of
+// veil's threshold, as a backstop for code that never yields to the loop
+#define GC_BACKSTOP_FACTOR 4
+// how many microtasks run between clock reads when a time slice is set
+#define MICROTASK_CLOCK_INTERVAL 16
+
+static JSValue compile_file(veil_vm_t* vm, const char* filename, bool force_module, bool root);
+static char* module_normalize(JSContext* ctx, const char* base_name, const char* module_name, void* opaque);
+static JSModuleDef* module_loader(JSContext* ctx, const char* module_name, void* opaque);
+static bool has_suffix(const char* str, const char* suffix);
+static int interrupt_handler(JSRuntime* rt, void* opaque);
+static void profiler_finish(veil_vm_t* vm);
+static void gc_init(veil_vm_t* vm);
+static void gc_tick(veil_vm_t* vm);
+static size_t gc_backstop(const veil_gc_t* gc);
+static void gc_expose(veil_vm_t* vm);
+static JSValue gc_run(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static bool has_microtasks(uv_microtask_context_t* context);
+static void run_microtasks(uv_microtask_context_t* context);
+static void heap_snapshot(uv_microtask_context_t* context);
+static void flush(uv_microtask_context_t* context);
+static bool has_immediates(uv_microtask_context_t* context);
+static void run_immediates(uv_microtask_context_t* context);
+// --expose-gc puts a global gc() in every context
+static void gc_expose(veil_vm_t* vm) {
+  JSValue global;
+
+  if (!vm->cfg->expose_gc) {
+    return;
+  }
+
+  global = JS_GetGlobalObject(vm->context);
+  JS_SetPropertyStr(vm->context, global, "gc", JS_NewCFunction(vm->context, gc_run, "gc", 0));
+  JS_FreeValue(vm->context, global);
+}
+
+// a full collection, cycles included
+static JSValue gc_run(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  JS_RunGC(JS_GetRuntime(ctx));
+
+  return JS_UNDEFINED;
+}
+
+static void rejection_tracker(JSContext* ctx, JSValueConst promise, JSValueConst reason, int is_handled, void* opaque);
+static void report_rejections(veil_vm_t* vm);
+static void drop_rejections(veil_vm_t* vm);
+
+void veil_vm_init(veil_vm_t* vm, const veil_cfg_t* cfg) {
+  vm->cfg = cfg;
+  vm->time_origin = uv_hrtime();
+  vm->cleanups.next = &vm->cleanups;
+  vm->cleanups.prev = &vm->cleanups;
+
+  veil_alloc_init(&vm->alloc, cfg->allocator);
+  vm->runtime = veil_alloc_new_runtime(&vm->alloc);
   CHECK_NOT_NULL(vm->runtime);
   JS_SetRuntimeOpaque(vm->runtime, vm);
+  JS_SetModuleLoaderFunc(vm->runtime, module_normalize, module_loader, vm);
+  veil_shared_install(vm->runtime);
+  JS_SetInterruptHandler(vm->runtime, interrupt_handler, vm);
+  vm->rejections = cvec_rejection_init();
+  JS_SetHostPromiseRejectionTracker(vm->runtime, rejection_tracker, vm);
+  gc_init(vm);
+
+  memset(&vm->microtasks, 0, sizeof(veil_microtasks_t));
+  vm->microtasks.budget = cfg->microtask_budget;
+  vm->microtasks.slice_ns = (uint64_t) cfg->microtask_slice_ms * 1000000;
 
   vm->context = JS_NewContext(vm->runtime);
   CHECK_NOT_NULL(vm->context);
   JS_SetContextOpaque(vm->context, vm);
+  veil_shared_install_globals(vm);
+  veil_encoding_install(vm);
+  veil_timers_install(vm);
+  gc_expose(vm);
+
+  veil_code_cache_init(&vm->code_cache, cstr_str_safe(&cfg->code_cache_dir));
+  veil_snapshot_init(&vm->snapshot, cfg->build_snapshot);
+  vm->resolver = veil_resolver_new(cfg);
+
+  if (cfg->cpu_prof) {
+    vm->profiler = veil_profiler_start(cfg->cpu_prof_interval);
+  }
 
   vm->enabled = true;
 }
@@ -21,22 +103,535 @@ void veil_vm_drop(veil_vm_t* vm) {
     return;
   }
 
+  veil_prefetch_free(vm->prefetch);
+  vm->prefetch = NULL;
+  profiler_finish(vm);
+  veil_shared_drop_globals(vm);
+  veil_encoding_drop(vm);
+  veil_addon_drop(vm);
+  drop_rejections(vm);
+  cvec_rejection_drop(&vm->rejections);
   JS_FreeContext(vm->context);
   JS_FreeRuntime(vm->runtime);
+  // after the runtime, which may still finalize sockets that use it
+  veil_net_free(vm->net);
+  vm->net = NULL;
+  veil_addon_free(vm->addons);
+  vm->addons = NULL;
+  veil_alloc_drop(&vm->alloc);
+  veil_code_cache_drop(&vm->code_cache);
+  veil_snapshot_drop(&vm->snapshot);
+  veil_resolver_free(vm->resolver);
+  vm->resolver = NULL;
   vm->enabled = false;
 }
 
-void veil_vm_drain_microtasks(veil_vm_t* vm) {
+// Replaces the context with a fresh one on the same runtime, which keeps the
+// runtime's classes, atoms and allocator warm along with the code cache and
+// resolver. Closing handles finish on the next turn of the loop, and the loop
+// must have run dry first so that no job still refers to the old context.
+void veil_vm_reset(veil_vm_t* vm) {
+  veil_worker_drop_all(vm);
+  veil_vm_run_cleanups(vm);
+  veil_shared_drop_globals(vm);
+  veil_encoding_drop(vm);
+  veil_addon_drop(vm);
+  drop_rejections(vm);
+  vm->uncaught = false;
+  JS_FreeContext(vm->context);
+  JS_RunGC(vm->runtime);
+  veil_addon_free(vm->addons);
+  vm->addons = NULL;
+
+  vm->context = JS_NewContext(vm->runtime);
+  CHECK_NOT_NULL(vm->context);
+  JS_SetContextOpaque(vm->context, vm);
+  veil_shared_install_globals(vm);
+  veil_encoding_install(vm);
+  veil_timers_install(vm);
+  gc_expose(vm);
+}
+
+void veil_vm_attach(veil_vm_t* vm, veil_uv_t* uv) {
+  vm->uv = uv;
+
+  uv->microtask_context = (uv_microtask_context_t*) vm;
+  uv->has_microtasks_cb = has_microtasks;
+  uv->run_microtasks_cb = run_microtasks;
+  uv->heap_snapshot_signum = vm->cfg->heapsnapshot_signal;
+  uv->heap_snapshot_cb = heap_snapshot;
+  uv->flush_cb = flush;
+  uv->has_immediates_cb = has_immediates;
+  uv->run_immediates_cb = run_immediates;
+}
+
+bool veil_vm_drain_microtasks(veil_vm_t* vm) {
+  veil_microtasks_t* microtasks = &vm->microtasks;
+  uint64_t deadline = microtasks->slice_ns ? uv_hrtime() + microtasks->slice_ns : 0;
+  uint32_t count = 0;
   int err;
   JSContext* last = NULL;
 
+  microtasks->stats.drains++;
+
   for(;;) {
+    if ((microtasks->budget && count >= microtasks->budget)
+        || (deadline && (count & (MICROTASK_CLOCK_INTERVAL - 1)) == 0 && count && uv_hrtime() >= deadline)) {
+      if (JS_IsJobPending(vm->runtime)) {
+        // the uv idle job keeps the loop from blocking in poll, and the next
+        // check phase picks up where this one stopped
+        microtasks->stats.budget_hits++;
+        return false;
+      }
+      break;
+    }
+
     err = JS_ExecutePendingJob(vm->runtime, &last);
-    if (err <= 0) {
-      if (err < 0) {
-        // TODO: handle error
+    if (err < 0) {
+      veil_vm_dump_exception(vm);
+      if (vm->uncaught) {
+        return true;
       }
+      continue;
+    }
+    if (err == 0) {
       break;
     }
+
+    count++;
+    microtasks->stats.jobs++;
+  }
+
+  report_rejections(vm);
+
+  return true;
+}
+
+void veil_vm_set_interrupt(veil_vm_t* vm, JSInterruptHandler* handler, void* opaque) {
+  vm->interrupt = handler;
+  vm->interrupt_opaque = opaque;
+}
+
+void veil_vm_add_cleanup(veil_vm_t* vm, veil_cleanup_t* cleanup, veil_cleanup_cb cb) {
+  cleanup->cb = cb;
+  cleanup->prev = vm->cleanups.prev;
+  cleanup->next = &vm->cleanups;
+  vm->cleanups.prev->next = cleanup;
+  vm->cleanups.prev = cleanup;
+}
+
+void veil_vm_remove_cleanup(veil_cleanup_t* cleanup) {
+  if (cleanup->next) {
+    cleanup->prev->next = cleanup->next;
+    cleanup->next->prev = cleanup->prev;
+    cleanup->next = NULL;
+    cleanup->prev = NULL;
+  }
+}
+
+void veil_vm_run_cleanups(veil_vm_t* vm) {
+  while (vm->cleanups.next != &vm->cleanups) {
+    veil_cleanup_t* cleanup = vm->cleanups.next;
+
+    veil_vm_remove_cleanup(cleanup);
+    cleanup->cb(cleanup);
+  }
+}
+
+JSValue veil_vm_compile_file(veil_vm_t* vm, const char* filename, bool force_module) {
+  return compile_file(vm, filename, force_module, false);
+}
+
+bool veil_vm_run_file(veil_vm_t* vm, const char* filename, bool force_module) {
+  JSValue compiled = compile_file(vm, filename, force_module, true);
+
+  if (JS_IsException(compiled)) {
+    veil_vm_dump_exception(vm);
+    return false;
+  }
+
+  return veil_vm_run_compiled(vm, compiled);
+}
+
+bool veil_vm_run_compiled(veil_vm_t* vm, JSValue compiled) {
+  JSValue result;
+
+  // modules read back from bytecode have not had their imports resolved yet
+  if (JS_VALUE_GET_TAG(compiled) == JS_TAG_MODULE && JS_ResolveModule(vm->context, compiled) < 0) {
+    JS_FreeValue(vm->context, compiled);
+    veil_vm_dump_exception(vm);
+    return false;
+  }
+
+  result = JS_EvalFunction(vm->context, compiled);
+  if (JS_IsException(result)) {
+    veil_vm_dump_exception(vm);
+    return false;
+  }
+
+  JS_FreeValue(vm->context, result);
+
+  return true;
+}
+
+void veil_vm_dump_exception(veil_vm_t* vm) {
+  JSValue exception = JS_GetException(vm->context);
+  const char* message;
+
+  // like node, an uncaught exception ends the process, or the worker, once it
+  // is reported
+  vm->uncaught = true;
+  if (vm->uv) {
+    uv_stop(&vm->uv->loop);
+  }
+
+  // a worker's uncaught exceptions surface on its Worker object instead
+  if (vm->worker) {
+    veil_worker_post_exception(vm, exception);
+    JS_FreeValue(vm->context, exception);
+    return;
+  }
+
+  message = JS_ToCString(vm->context, exception);
+
+  fprintf(stderr, "%s\n", message ? message : "[exception]");
+  JS_FreeCString(vm->context, message);
+
+  if (JS_IsError(vm->context, exception)) {
+    JSValue stack = JS_GetPropertyStr(vm->context, exception, "stack");
+
+    if (!JS_IsUndefined(stack)) {
+      const char* trace = JS_ToCString(vm->context, stack);
+
+      if (trace) {
+        fprintf(stderr, "%s\n", trace);
+      }
+      JS_FreeCString(vm->context, trace);
+    }
+    JS_FreeValue(vm->context, stack);
+  }
+
+  JS_FreeValue(vm->context, exception);
+}
+
+static JSValue compile_file(veil_vm_t* vm, const char* filename, bool force_module, bool root) {
+  veil_file_t source;
+  veil_prefetched_t prefetched = { 0 };
+  JSValue compiled;
+  int eval_flags;
+
+  if (vm->bundle) {
+    // modules outside the bundle, such as command line preloads, still load
+    // from disk
+    compiled = veil_bundle_compile(vm->bundle, vm->context, filename);
+    if (!JS_IsUndefined(compiled)) {
+      return compiled;
+    }
+  }
+
+  if (vm->prefetch && veil_prefetch_take(vm->prefetch, filename, &prefetched)) {
+    source = prefetched.source;
+  } else if (!veil_file_read(&source, filename)) {
+    return JS_ThrowReferenceError(vm->context, "could not load '%s'", filename);
+  }
+
+  if (force_module || has_suffix(filename, ".mjs") || JS_DetectModule(source.data, source.size)) {
+    eval_flags = JS_EVAL_TYPE_MODULE;
+  } else {
+    eval_flags = JS_EVAL_TYPE_GLOBAL;
+  }
+
+  compiled = veil_code_cache_load(&vm->code_cache, vm->context, filename, &source, eval_flags);
+
+  if (JS_IsUndefined(compiled) && prefetched.bytecode && prefetched.eval_flags == eval_flags) {
+    compiled = JS_ReadObject(vm->context, prefetched.bytecode, prefetched.bytecode_size, JS_READ_OBJ_BYTECODE);
+
+    if (JS_IsException(compiled)) {
+      JS_FreeValue(vm->context, JS_GetException(vm->context));
+      compiled = JS_UNDEFINED;
+    }
+  }
+
+  if (JS_IsUndefined(compiled)) {
+    compiled = JS_Eval(vm->context, source.data, source.size, filename, eval_flags | JS_EVAL_FLAG_COMPILE_ONLY);
+
+    if (!JS_IsException(compiled)) {
+      veil_code_cache_store(&vm->code_cache, vm->context, filename, &source, eval_flags, compiled);
+    }
+  }
+
+  if (!JS_IsException(compiled)) {
+    veil_snapshot_record(&vm->snapshot, vm->context, filename, compiled, root);
+
+    if (vm->bundle_builder) {
+      // a worker's entry script is loaded by the worker, not at startup
+      veil_bundle_builder_add_module(vm->bundle_builder, vm->context, filename, compiled, root && !vm->worker);
+    }
+  }
+
+  veil_file_drop(&source);
+  free(prefetched.bytecode);
+
+  return compiled;
+}
+
+static char* module_normalize(JSContext* ctx, const char* base_name, const char* module_name, void* opaque) {
+  veil_vm_t* vm = opaque;
+  char* resolved;
+
+  // bundled modules resolve by table lookup alone
+  if (vm->bundle && veil_bundle_contains(vm->bundle, base_name)) {
+    return veil_bundle_resolve(vm->bundle, ctx, base_name, module_name);
+  }
+
+  // so do the preload graph's imports after a snapshot restore
+  resolved = veil_snapshot_resolve(&vm->snapshot, ctx, base_name, module_name);
+  if (resolved) {
+    return resolved;
+  }
+
+  resolved = veil_resolver_resolve(vm->resolver, ctx, base_name, module_name);
+  if (resolved && vm->bundle_builder) {
+    veil_bundle_builder_add_resolution(vm->bundle_builder, base_name, module_name, resolved);
+  }
+
+  if (resolved) {
+    veil_snapshot_record_resolution(&vm->snapshot, base_name, module_name, resolved);
+  }
+
+  return resolved;
+}
+
+static JSModuleDef* module_loader(JSContext* ctx, const char* module_name, void* opaque) {
+  veil_vm_t* vm = opaque;
+  JSModuleDef* m;
+  JSValue compiled;
+
+  if (veil_builtin_exists(module_name)) {
+    return veil_builtin_load(ctx, module_name);
+  }
+
+  if (veil_addon_is_addon(module_name)) {
+    return veil_addon_load(ctx, module_name);
+  }
+
+  compiled = veil_vm_compile_file(vm, module_name, true);
+  if (JS_IsException(compiled)) {
+    return NULL;
+  }
+
+  // the module is owned by the context's module list once compiled
+  m = JS_VALUE_GET_PTR(compiled);
+  JS_FreeValue(ctx, compiled);
+
+  return m;
+}
+
+static bool has_suffix(const char* str, const char* suffix) {
+  size_t str_len = strlen(str);
+  size_t suffix_len = strlen(suffix);
+
+  return str_len >= suffix_len && memcmp(str + str_len - suffix_len, suffix, suffix_len) == 0;
+}
+
+static bool has_microtasks(uv_microtask_context_t* context) {
+  veil_vm_t* vm = (veil_vm_t*)context;
+  CHECK_TRUE(vm->enabled);
+
+  return JS_IsJobPending(vm->runtime);
+}
+
+static void run_microtasks(uv_microtask_context_t* context) {
+  veil_vm_t* vm = (veil_vm_t*)context;
+  CHECK_TRUE(vm->enabled);
+
+  veil_vm_drain_microtasks(vm);
+  gc_tick(vm);
+}
+
+static void heap_snapshot(uv_microtask_context_t* context) {
+  veil_vm_t* vm = (veil_vm_t*)context;
+  cstr filename;
+  CHECK_TRUE(vm->enabled);
+
+  filename = cstr_init();
+  veil_diagnostic_filename(&filename, NULL, "Heap", "heapsnapshot", veil_worker_thread_id(vm));
+  if (!veil_heap_write_snapshot(vm, cstr_str(&filename))) {
+    fprintf(stderr, "veil: could not write heap snapshot '%s'\n", cstr_str(&filename));
+  }
+  cstr_drop(&filename);
+}
+
+static void flush(uv_microtask_context_t* context) {
+  veil_vm_t* vm = (veil_vm_t*)context;
+  CHECK_TRUE(vm->enabled);
+
+  veil_net_flush(vm);
+}
+
+static bool has_immediates(uv_microtask_context_t* context) {
+  veil_vm_t* vm = (veil_vm_t*)context;
+  CHECK_TRUE(vm->enabled);
+
+  return veil_timers_has_immediates(vm);
+}
+
+static void run_immediates(uv_microtask_context_t* context) {
+  veil_vm_t* vm = (veil_vm_t*)context;
+  CHECK_TRUE(vm->enabled);
+
+  veil_timers_run_immediates(vm);
+}
+
+static int interrupt_handler(JSRuntime* rt, void* opaque) {
+  veil_vm_t* vm = opaque;
+
+  if (vm->profiler) {
+    veil_profiler_sample(vm->profiler, vm->context);
+  }
+
+  return vm->interrupt ? vm->interrupt(rt, vm->interrupt_opaque) : 0;
+}
+
+static void profiler_finish(veil_vm_t* vm) {
+  cstr filename;
+
+  if (!vm->profiler) {
+    return;
+  }
+
+  veil_profiler_stop(vm->profiler);
+
+  filename = cstr_init();
+  veil_diagnostic_filename(&filename, cstr_str_safe(&vm->cfg->cpu_prof_dir), "CPU", "cpuprofile", veil_worker_thread_id(vm));
+  if (!veil_profiler_write(vm->profiler, cstr_str(&filename))) {
+    fprintf(stderr, "veil: could not write cpu profile '%s'\n", cstr_str(&filename));
+  }
+  cstr_drop(&filename);
+
+  veil_profiler_free(vm->profiler);
+  vm->profiler = NULL;
+}
+
+static void gc_init(veil_vm_t* vm) {
+  const veil_cfg_t* cfg = vm->cfg;
+  veil_gc_t* gc = &vm->gc;
+
+  memset(gc, 0, sizeof(veil_gc_t));
+  gc->adaptive = cfg->gc_adaptive;
+  gc->min_threshold = cfg->gc_threshold ? cfg->gc_threshold : GC_DEFAULT_THRESHOLD;
+  gc->threshold = gc->min_threshold;
+  // leave headroom below the hard limit so a collection runs before it hits
+  gc->max_threshold = cfg->max_heap_size ? cfg->max_heap_size - cfg->max_heap_size / 4 : SIZE_MAX;
+
+  if (cfg->max_heap_size) {
+    JS_SetMemoryLimit(vm->runtime, cfg->max_heap_size);
+  }
+
+  if (cfg->max_stack_size) {
+    JS_SetMaxStackSize(vm->runtime, cfg->max_stack_size);
+  }
+
+  if (gc->adaptive) {
+    JS_SetGCThreshold(vm->runtime, gc_backstop(gc));
+  } else if (cfg->gc_threshold) {
+    JS_SetGCThreshold(vm->runtime, cfg->gc_threshold);
+  }
+}
+
+static void gc_tick(veil_vm_t* vm) {
+  veil_gc_t* gc = &vm->gc;
+  size_t before;
+  size_t after;
+  size_t threshold;
+
+  if (!gc->adaptive) {
+    return;
+  }
+
+  before = veil_alloc_heap_size(&vm->alloc);
+  if (before < gc->threshold) {
+    return;
+  }
+
+  JS_RunGC(vm->runtime);
+  gc->runs++;
+  after = veil_alloc_heap_size(&vm->alloc);
+
+  // A high survivor ratio means the collection mostly traced live data, so
+  // back off hard; a low one means garbage is cheap to reclaim, so stay close.
+  if (after > before - before / 4) {
+    threshold = after * 3;
+  } else if (after > before / 2) {
+    threshold = after * 2;
+  } else {
+    threshold = after + after / 2;
+  }
+
+  if (threshold < gc->min_threshold) {
+    threshold = gc->min_threshold;
+  } else if (threshold > gc->max_threshold) {
+    threshold = gc->max_threshold;
+  }
+
+  gc->threshold = threshold;
+  // the engine rewrites its threshold after each of its own collections
+  JS_SetGCThreshold(vm->runtime, gc_backstop(gc));
+}
+
+static size_t gc_backstop(const veil_gc_t* gc) {
+  if (gc->threshold > gc->max_threshold / GC_BACKSTOP_FACTOR) {
+    return gc->max_threshold > gc->threshold ? gc->max_threshold : gc->threshold;
+  }
+
+  return gc->threshold * GC_BACKSTOP_FACTOR;
+}
+
+static void rejection_tracker(JSContext* ctx, JSValueConst promise, JSValueConst reason, int is_handled, void* opaque) {
+  veil_vm_t* vm = opaque;
+  veil_rejection_t* rejection;
+
+  if (!is_handled) {
+    cvec_rejection_push(&vm->rejections, (veil_rejection_t) { JS_DupValue(ctx, promise), JS_DupValue(ctx, reason) });
+    return;
+  }
+
+  // a handler attached late, before the queue drained
+  for (size_t n = 0; n < cvec_rejection_size(&vm->rejections); n++) {
+    rejection = cvec_rejection_at_mut(&vm->rejections, n);
+    if (JS_VALUE_GET_PTR(rejection->promise) == JS_VALUE_GET_PTR(promise)) {
+      JS_FreeValue(ctx, rejection->promise);
+      JS_FreeValue(ctx, rejection->reason);
+      cvec_rejection_erase_n(&vm->rejections, n, 1);
+      return;
+    }
   }
 }
+
+static void report_rejections(veil_vm_t* vm) {
+  // reporting can run JS that rejects more promises
+  cvec_rejection pending = vm->rejections;
+
+  vm->rejections = cvec_rejection_init();
+
+  for (size_t n = 0; n < cvec_rejection_size(&pending); n++) {
+    veil_rejection_t* rejection = cvec_rejection_at_mut(&pending, n);
+
+    JS_FreeValue(vm->context, rejection->promise);
+    JS_Throw(vm->context, rejection->reason);
+    veil_vm_dump_exception(vm);
+  }
+
+  cvec_rejection_drop(&pending);
+}
+
+static void drop_rejections(veil_vm_t* vm) {
+  for (size_t n = 0; n < cvec_rejection_size(&vm->rejections); n++) {
+    veil_rejection_t* rejection = cvec_rejection_at_mut(&vm->rejections, n);
+
+    JS_FreeValue(vm->context, rejection->promise);
+    JS_FreeValue(vm->context, rejection->reason);
+  }
+
+  cvec_rejection_clear(&vm->rejections);
+}
@@ -0,0 +1,1108 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#define i_type cmap_transfer_memo
+#define i_key uintptr_t
+#define i_val JSValue
+#include <stc/cmap.h>
+
+#define i_type cset_transfer_seen
+#define i_key uintptr_t
+#include <stc/cset.h>
+
+#define WORKER_STACK_SIZE (8 * 1024 * 1024)
+#define TRANSFER_KEY "__veilTransfer"
+
+typedef struct message_s message_t;
+
+typedef struct transfer_s {
+  void* data;
+  size_t size;
+  JSValue buffer;
+} transfer_t;
+
+typedef enum {
+  MESSAGE_DATA,
+  // an uncaught exception in the worker, emitted as 'error' on the Worker
+  MESSAGE_EXCEPTION,
+  // the same, carrying the name, message and stack of a thrown Error
+  MESSAGE_ERROR,
+} message_kind_t;
+
+struct message_s {
+  message_t* next;
+  message_kind_t kind;
+  uint8_t* data;
+  size_t size;
+  // shared blocks referenced by SharedArrayBuffers in the payload
+  uint8_t** sabs;
+  size_t sab_count;
+  // ArrayBuffer stores moved out of the sender by the transfer list
+  transfer_t* transfers;
+  uint32_t transfer_count;
+};
+
+typedef struct transfer_walk_s {
+  JSValue array_buffer;
+  JSValue is_view;
+  JSValue object;
+  JSValue* buffers;
+  uint32_t count;
+  cmap_transfer_memo memo;
+} transfer_walk_t;
+
+// one direction of a worker <-> parent link. The async handle lives on the
+// receiving loop; senders append under the mutex and wake it.
+typedef struct channel_s {
+  uv_mutex_t mutex;
+  uv_async_t async;
+  bool ready;
+  message_t* head;
+  message_t* tail;
+} channel_t;
+
+struct veil_worker_s {
+  veil_worker_t* next;
+  veil_vm_t* parent;
+  JSValue object;
+  cstr filename;
+  message_t* worker_data;
+  int32_t thread_id;
+  uv_thread_t thread;
+
+  // parent -> worker, drained on the worker loop
+  channel_t inbox;
+  // worker -> parent, drained on the parent loop
+  channel_t outbox;
+  // guarded by inbox.mutex
+  bool terminating;
+  // guarded by outbox.mutex
+  bool exited;
+  int exit_code;
+
+  veil_vm_t vm;
+  veil_uv_t uv;
+  JSValue port;
+};
+
+static JSClassID worker_class_id;
+static JSClassID port_class_id;
+static int32_t next_thread_id = 1;
+static uv_mutex_t global_mutex;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static void register_classes(JSContext* ctx);
+static int module_init(JSContext* ctx, JSModuleDef* m);
+
+static void worker_main(void* arg);
+static int worker_interrupt(JSRuntime* rt, void* opaque);
+static void worker_request_terminate(veil_worker_t* worker);
+static void worker_finish(veil_worker_t* worker);
+static void worker_free_cb(uv_handle_t* handle);
+static void inbox_cb(uv_async_t* handle);
+static void outbox_cb(uv_async_t* handle);
+static void deliver(JSContext* ctx, JSValueConst target, message_t* head);
+static void emit_error(JSContext* ctx, JSValueConst target, JSValue error);
+static JSValue revive_error(JSContext* ctx, JSValue fields);
+
+static JSValue worker_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv);
+static JSValue worker_post_message(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue worker_terminate(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue worker_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue port_post_message(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue port_on(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue port_off(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+
+static void channel_init(channel_t* channel);
+static void channel_open(channel_t* channel, uv_loop_t* loop, uv_async_cb cb, void* data);
+static void channel_post(channel_t* channel, message_t* message);
+static void channel_signal(channel_t* channel);
+static message_t* channel_take(channel_t* channel);
+static void channel_close(channel_t* channel, uv_close_cb cb);
+static void channel_drop(channel_t* channel);
+
+static message_t* message_new(JSContext* ctx, JSValueConst value, JSValueConst transfer);
+static JSValue message_read(JSContext* ctx, message_t* message);
+static void message_free(message_t* message);
+static JSValue transfer_wrap(JSContext* ctx, transfer_walk_t* walk, JSValueConst value);
+static JSValue transfer_placeholder(JSContext* ctx, transfer_walk_t* walk, JSValueConst value, JSValueConst buffer);
+static int32_t transfer_index(transfer_walk_t* walk, JSValueConst value);
+static JSValue transfer_unwrap(JSContext* ctx, message_t* message, cset_transfer_seen* seen, JSValue value);
+static JSValue transfer_revive(JSContext* ctx, message_t* message, JSValue placeholder);
+
+static const JSClassDef WORKER_CLASS = {
+  "Worker",
+};
+
+static const JSClassDef PORT_CLASS = {
+  "MessagePort",
+};
+
+static const JSCFunctionListEntry WORKER_PROTO[] = {
+  JS_CFUNC_DEF("postMessage", 2, worker_post_message),
+  JS_CFUNC_DEF("terminate", 0, worker_terminate),
+  JS_CFUNC_MAGIC_DEF("ref", 0, worker_ref, 1),
+  JS_CFUNC_MAGIC_DEF("unref", 0, worker_ref, 0),
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+};
+
+static const JSCFunctionListEntry PORT_PROTO[] = {
+  JS_CFUNC_DEF("postMessage", 2, port_post_message),
+  JS_CFUNC_DEF("on", 2, port_on),
+  JS_CFUNC_DEF("off", 2, port_off),
+};
+
+JSModuleDef* veil_worker_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, module_init);
+
+  if (m) {
+    JS_AddModuleExport(ctx, m, "Worker");
+    JS_AddModuleExport(ctx, m, "isMainThread");
+    JS_AddModuleExport(ctx, m, "parentPort");
+    JS_AddModuleExport(ctx, m, "workerData");
+    JS_AddModuleExport(ctx, m, "threadId");
+  }
+
+  return m;
+}
+
+void veil_worker_drop_all(veil_vm_t* vm) {
+  while (vm->workers) {
+    veil_worker_t* worker = vm->workers;
+
+    worker_request_terminate(worker);
+
+    worker_finish(worker);
+  }
+}
+
+// Stands in for printing an uncaught exception on a worker thread. Error
+// objects cannot go through JS_WriteObject, so their fields are sent and the
+// parent builds a new Error from them.
+void veil_worker_post_exception(veil_vm_t* vm, JSValueConst exception) {
+  JSContext* ctx = vm->context;
+  message_kind_t kind = MESSAGE_EXCEPTION;
+  message_t* message;
+  JSValue value;
+  bool terminating;
+
+  // terminate() interrupts the worker with an exception of its own
+  uv_mutex_lock(&vm->worker->inbox.mutex);
+  terminating = vm->worker->terminating;
+  uv_mutex_unlock(&vm->worker->inbox.mutex);
+  if (terminating) {
+    return;
+  }
+
+  if (JS_IsError(ctx, exception)) {
+    kind = MESSAGE_ERROR;
+    value = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, value, "name", JS_GetPropertyStr(ctx, exception, "name"));
+    JS_SetPropertyStr(ctx, value, "message", JS_GetPropertyStr(ctx, exception, "message"));
+    JS_SetPropertyStr(ctx, value, "stack", JS_GetPropertyStr(ctx, exception, "stack"));
+  } else {
+    value = JS_DupValue(ctx, exception);
+  }
+
+  message = message_new(ctx, value, JS_UNDEFINED);
+  JS_FreeValue(ctx, value);
+
+  if (!message) {
+    // not serializable; its string form is the best the parent can get
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    kind = MESSAGE_EXCEPTION;
+    value = JS_ToString(ctx, exception);
+    message = JS_IsException(value) ? NULL : message_new(ctx, value, JS_UNDEFINED);
+    JS_FreeValue(ctx, value);
+  }
+
+  if (!message) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    fprintf(stderr, "veil: uncaught exception in worker %d\n", vm->worker->thread_id);
+    return;
+  }
+
+  message->kind = kind;
+  channel_post(&vm->worker->outbox, message);
+}
+
+int32_t veil_worker_thread_id(const veil_vm_t* vm) {
+  return vm->worker ? vm->worker->thread_id : 0;
+}
+
+static void global_init() {
+  CHECK_OK(uv_mutex_init(&global_mutex));
+  JS_NewClassID(&worker_class_id);
+  JS_NewClassID(&port_class_id);
+}
+
+static void register_classes(JSContext* ctx) {
+  JSRuntime* rt = JS_GetRuntime(ctx);
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, worker_class_id)) {
+    JS_NewClass(rt, worker_class_id, &WORKER_CLASS);
+    JS_NewClass(rt, port_class_id, &PORT_CLASS);
+  }
+}
+
+static int module_init(JSContext* ctx, JSModuleDef* m) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  veil_worker_t* self = vm->worker;
+  JSValue proto;
+  JSValue ctor;
+
+  register_classes(ctx);
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, WORKER_PROTO, countof(WORKER_PROTO));
+  ctor = JS_NewCFunction2(ctx, worker_ctor, "Worker", 2, JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, ctor, proto);
+  JS_SetClassProto(ctx, worker_class_id, proto);
+  JS_SetModuleExport(ctx, m, "Worker", ctor);
+
+  JS_SetModuleExport(ctx, m, "isMainThread", JS_NewBool(ctx, self == NULL));
+  JS_SetModuleExport(ctx, m, "threadId", JS_NewInt32(ctx, self ? self->thread_id : 0));
+
+  if (self) {
+    JSValue data = JS_UNDEFINED;
+
+    if (self->worker_data) {
+      data = message_read(ctx, self->worker_data);
+      if (JS_IsException(data)) {
+        return -1;
+      }
+    }
+
+    JS_SetModuleExport(ctx, m, "parentPort", JS_DupValue(ctx, self->port));
+    JS_SetModuleExport(ctx, m, "workerData", data);
+  } else {
+    JS_SetModuleExport(ctx, m, "parentPort", JS_NULL);
+    JS_SetModuleExport(ctx, m, "workerData", JS_UNDEFINED);
+  }
+
+  return 0;
+}
+
+static void worker_main(void* arg) {
+  veil_worker_t* worker = arg;
+  JSValue proto;
+  bool terminated;
+  bool ok;
+
+  veil_vm_init(&worker->vm, worker->parent->cfg);
+  veil_uv_init(&worker->uv);
+  veil_vm_attach(&worker->vm, &worker->uv);
+  worker->vm.worker = worker;
+  worker->vm.bundle = worker->parent->bundle;
+  worker->vm.bundle_builder = worker->parent->bundle_builder;
+
+  veil_vm_set_interrupt(&worker->vm, worker_interrupt, worker);
+
+  register_classes(worker->vm.context);
+  proto = JS_NewObject(worker->vm.context);
+  JS_SetPropertyFunctionList(worker->vm.context, proto, PORT_PROTO, countof(PORT_PROTO));
+  JS_SetClassProto(worker->vm.context, port_class_id, proto);
+  worker->port = JS_NewObjectClass(worker->vm.context, port_class_id);
+  JS_SetOpaque(worker->port, worker);
+
+  // only a parentPort "message" listener keeps the worker alive
+  channel_open(&worker->inbox, &worker->uv.loop, inbox_cb, worker);
+  uv_unref((uv_handle_t*) &worker->inbox.async);
+
+  if (!worker->vm.bundle) {
+    worker->vm.prefetch = veil_prefetch_new(&worker->vm);
+    veil_prefetch_add(worker->vm.prefetch, cstr_str(&worker->filename), false);
+    veil_prefetch_wait(worker->vm.prefetch);
+  }
+
+  ok = veil_vm_run_file(&worker->vm, cstr_str(&worker->filename), false);
+  veil_prefetch_free(worker->vm.prefetch);
+  worker->vm.prefetch = NULL;
+
+  if (ok) {
+    veil_uv_run(&worker->uv);
+  }
+  ok = ok && !worker->vm.uncaught;
+
+  channel_close(&worker->inbox, NULL);
+  veil_worker_drop_all(&worker->vm);
+  JS_SetOpaque(worker->port, NULL);
+  JS_FreeValue(worker->vm.context, worker->port);
+  worker->port = JS_UNDEFINED;
+  veil_vm_run_cleanups(&worker->vm);
+  veil_uv_drop(&worker->uv);
+  veil_vm_drop(&worker->vm);
+
+  uv_mutex_lock(&worker->inbox.mutex);
+  terminated = worker->terminating;
+  uv_mutex_unlock(&worker->inbox.mutex);
+
+  // like node, terminate() and an uncaught exception both exit with 1
+  uv_mutex_lock(&worker->outbox.mutex);
+  worker->exited = true;
+  worker->exit_code = ok && !terminated ? 0 : 1;
+  if (worker->outbox.ready) {
+    uv_async_send(&worker->outbox.async);
+  }
+  uv_mutex_unlock(&worker->outbox.mutex);
+}
+
+static int worker_interrupt(JSRuntime* rt, void* opaque) {
+  veil_worker_t* worker = opaque;
+  bool terminating;
+
+  uv_mutex_lock(&worker->inbox.mutex);
+  terminating = worker->terminating;
+  uv_mutex_unlock(&worker->inbox.mutex);
+
+  return terminating;
+}
+
+// Stops the worker's loop, interrupts any script it is running and wakes it
+// from Atomics.wait(), so the join that follows cannot hang.
+static void worker_request_terminate(veil_worker_t* worker) {
+  uv_mutex_lock(&worker->inbox.mutex);
+  worker->terminating = true;
+  uv_mutex_unlock(&worker->inbox.mutex);
+  channel_signal(&worker->inbox);
+  veil_shared_interrupt(&worker->vm);
+}
+
+static void worker_finish(veil_worker_t* worker) {
+  veil_vm_t* parent = worker->parent;
+  JSContext* ctx = parent->context;
+  veil_worker_t** link;
+
+  CHECK_OK(uv_thread_join(&worker->thread));
+
+  for (link = &parent->workers; *link; link = &(*link)->next) {
+    if (*link == worker) {
+      *link = worker->next;
+      break;
+    }
+  }
+
+  // deliver anything still queued before reporting the exit
+  deliver(ctx, worker->object, channel_take(&worker->outbox));
+
+  {
+    JSValue code = JS_NewInt32(ctx, worker->exit_code);
+    veil_emitter_emit(ctx, worker->object, "exit", 1, &code);
+  }
+
+  JS_SetOpaque(worker->object, NULL);
+  JS_FreeValue(ctx, worker->object);
+  worker->object = JS_UNDEFINED;
+
+  channel_close(&worker->outbox, worker_free_cb);
+}
+
+static void worker_free_cb(uv_handle_t* handle) {
+  veil_worker_t* worker = handle->data;
+
+  channel_drop(&worker->inbox);
+  channel_drop(&worker->outbox);
+  cstr_drop(&worker->filename);
+  if (worker->worker_data) {
+    message_free(worker->worker_data);
+  }
+  free(worker);
+}
+
+static void inbox_cb(uv_async_t* handle) {
+  veil_worker_t* worker = handle->data;
+  bool terminating;
+
+  uv_mutex_lock(&worker->inbox.mutex);
+  terminating = worker->terminating;
+  uv_mutex_unlock(&worker->inbox.mutex);
+
+  if (terminating) {
+    uv_stop(&worker->uv.loop);
+    return;
+  }
+
+  deliver(worker->vm.context, worker->port, channel_take(&worker->inbox));
+}
+
+static void outbox_cb(uv_async_t* handle) {
+  veil_worker_t* worker = handle->data;
+  message_t* head;
+  bool exited;
+
+  // read both under one lock: a message posted before exit is never lost
+  uv_mutex_lock(&worker->outbox.mutex);
+  head = worker->outbox.head;
+  worker->outbox.head = worker->outbox.tail = NULL;
+  exited = worker->exited;
+  uv_mutex_unlock(&worker->outbox.mutex);
+
+  deliver(worker->parent->context, worker->object, head);
+
+  if (exited) {
+    worker_finish(worker);
+  }
+}
+
+static void deliver(JSContext* ctx, JSValueConst target, message_t* head) {
+  while (head) {
+    message_t* next = head->next;
+    JSValue value = message_read(ctx, head);
+
+    if (JS_IsException(value)) {
+      emit_error(ctx, target, JS_GetException(ctx));
+    } else if (head->kind == MESSAGE_ERROR) {
+      emit_error(ctx, target, revive_error(ctx, value));
+    } else if (head->kind == MESSAGE_EXCEPTION) {
+      emit_error(ctx, target, value);
+    } else {
+      veil_emitter_emit(ctx, target, "message", 1, &value);
+      JS_FreeValue(ctx, value);
+    }
+
+    message_free(head);
+    head = next;
+  }
+}
+
+static void emit_error(JSContext* ctx, JSValueConst target, JSValue error) {
+  if (veil_emitter_count(ctx, target, "error") > 0) {
+    veil_emitter_emit(ctx, target, "error", 1, &error);
+    JS_FreeValue(ctx, error);
+    return;
+  }
+
+  // nobody handles it, so it is uncaught on this thread as well
+  JS_Throw(ctx, error);
+  veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+}
+
+static JSValue revive_error(JSContext* ctx, JSValue fields) {
+  JSValue error = JS_NewError(ctx);
+
+  JS_SetPropertyStr(ctx, error, "name", JS_GetPropertyStr(ctx, fields, "name"));
+  JS_SetPropertyStr(ctx, error, "message", JS_GetPropertyStr(ctx, fields, "message"));
+  JS_SetPropertyStr(ctx, error, "stack", JS_GetPropertyStr(ctx, fields, "stack"));
+  JS_FreeValue(ctx, fields);
+
+  return error;
+}
+
+static JSValue worker_ctor(JSContext* ctx, JSValueConst new_target, int argc, JSValueConst* argv) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  uv_thread_options_t options = { UV_THREAD_HAS_STACK_SIZE, WORKER_STACK_SIZE };
+  veil_worker_t* worker;
+  const char* filename;
+  JSValue proto;
+  JSValue obj;
+
+  if (argc < 1) {
+    return JS_ThrowTypeError(ctx, "Worker requires a filename");
+  }
+
+  filename = JS_ToCString(ctx, argv[0]);
+  if (!filename) {
+    return JS_EXCEPTION;
+  }
+
+  worker = calloc(1, sizeof(veil_worker_t));
+  CHECK_NOT_NULL(worker);
+  worker->parent = vm;
+  worker->filename = cstr_from(filename);
+  worker->port = JS_UNDEFINED;
+  JS_FreeCString(ctx, filename);
+
+  if (argc > 1 && JS_IsObject(argv[1])) {
+    JSValue data = JS_GetPropertyStr(ctx, argv[1], "workerData");
+
+    if (!JS_IsUndefined(data)) {
+      worker->worker_data = message_new(ctx, data, JS_UNDEFINED);
+
+      if (!worker->worker_data) {
+        JS_FreeValue(ctx, data);
+        cstr_drop(&worker->filename);
+        free(worker);
+        return JS_EXCEPTION;
+      }
+    }
+    JS_FreeValue(ctx, data);
+  }
+
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  obj = JS_NewObjectProtoClass(ctx, proto, worker_class_id);
+  JS_FreeValue(ctx, proto);
+  if (JS_IsException(obj)) {
+    cstr_drop(&worker->filename);
+    if (worker->worker_data) {
+      message_free(worker->worker_data);
+    }
+    free(worker);
+    return obj;
+  }
+
+  uv_mutex_lock(&global_mutex);
+  worker->thread_id = next_thread_id++;
+  uv_mutex_unlock(&global_mutex);
+
+  JS_SetOpaque(obj, worker);
+  JS_DefinePropertyValueStr(ctx, obj, "threadId", JS_NewInt32(ctx, worker->thread_id), JS_PROP_ENUMERABLE);
+  // held until the worker exits so listeners stay reachable
+  worker->object = JS_DupValue(ctx, obj);
+
+  channel_init(&worker->inbox);
+  channel_init(&worker->outbox);
+  channel_open(&worker->outbox, &vm->uv->loop, outbox_cb, worker);
+
+  worker->next = vm->workers;
+  vm->workers = worker;
+
+  CHECK_OK(uv_thread_create_ex(&worker->thread, &options, worker_main, worker));
+
+  return obj;
+}
+
+static JSValue worker_post_message(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_worker_t* worker = JS_GetOpaque(this_val, worker_class_id);
+  message_t* message;
+
+  if (!worker) {
+    return JS_UNDEFINED;
+  }
+
+  message = message_new(ctx, argc > 0 ? argv[0] : JS_UNDEFINED, argc > 1 ? argv[1] : JS_UNDEFINED);
+  if (!message) {
+    return JS_EXCEPTION;
+  }
+
+  channel_post(&worker->inbox, message);
+
+  return JS_UNDEFINED;
+}
+
+static JSValue worker_terminate(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_worker_t* worker = JS_GetOpaque(this_val, worker_class_id);
+
+  if (worker) {
+    worker_request_terminate(worker);
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue worker_ref(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_worker_t* worker = JS_GetOpaque(this_val, worker_class_id);
+
+  if (worker) {
+    if (magic) {
+      uv_ref((uv_handle_t*) &worker->outbox.async);
+    } else {
+      uv_unref((uv_handle_t*) &worker->outbox.async);
+    }
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue port_post_message(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_worker_t* worker = JS_GetOpaque(this_val, port_class_id);
+  message_t* message;
+
+  if (!worker) {
+    return JS_UNDEFINED;
+  }
+
+  message = message_new(ctx, argc > 0 ? argv[0] : JS_UNDEFINED, argc > 1 ? argv[1] : JS_UNDEFINED);
+  if (!message) {
+    return JS_EXCEPTION;
+  }
+
+  channel_post(&worker->outbox, message);
+
+  return JS_UNDEFINED;
+}
+
+static JSValue port_on(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_worker_t* worker = JS_GetOpaque(this_val, port_class_id);
+  JSValue result = veil_emitter_js_on(ctx, this_val, argc, argv);
+
+  if (worker && !JS_IsException(result) && veil_emitter_count(ctx, this_val, "message") > 0) {
+    uv_ref((uv_handle_t*) &worker->inbox.async);
+  }
+
+  return result;
+}
+
+static JSValue port_off(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  veil_worker_t* worker = JS_GetOpaque(this_val, port_class_id);
+  JSValue result = veil_emitter_js_off(ctx, this_val, argc, argv);
+
+  if (worker && !JS_IsException(result) && veil_emitter_count(ctx, this_val, "message") == 0) {
+    uv_unref((uv_handle_t*) &worker->inbox.async);
+  }
+
+  return result;
+}
+
+static void channel_init(channel_t* channel) {
+  CHECK_OK(uv_mutex_init(&channel->mutex));
+  channel->ready = false;
+  channel->head = NULL;
+  channel->tail = NULL;
+}
+
+static void channel_open(channel_t* channel, uv_loop_t* loop, uv_async_cb cb, void* data) {
+  CHECK_OK(uv_async_init(loop, &channel->async, cb));
+  channel->async.data = data;
+
+  uv_mutex_lock(&channel->mutex);
+  channel->ready = true;
+  // pick up anything posted before the receiving loop existed
+  uv_async_send(&channel->async);
+  uv_mutex_unlock(&channel->mutex);
+}
+
+static void channel_post(channel_t* channel, message_t* message) {
+  uv_mutex_lock(&channel->mutex);
+  if (channel->tail) {
+    channel->tail->next = message;
+  } else {
+    channel->head = message;
+  }
+  channel->tail = message;
+  if (channel->ready) {
+    uv_async_send(&channel->async);
+  }
+  uv_mutex_unlock(&channel->mutex);
+}
+
+static void channel_signal(channel_t* channel) {
+  uv_mutex_lock(&channel->mutex);
+  if (channel->ready) {
+    uv_async_send(&channel->async);
+  }
+  uv_mutex_unlock(&channel->mutex);
+}
+
+static message_t* channel_take(channel_t* channel) {
+  message_t* head;
+
+  uv_mutex_lock(&channel->mutex);
+  head = channel->head;
+  channel->head = channel->tail = NULL;
+  uv_mutex_unlock(&channel->mutex);
+
+  return head;
+}
+
+static void channel_close(channel_t* channel, uv_close_cb cb) {
+  uv_mutex_lock(&channel->mutex);
+  channel->ready = false;
+  uv_mutex_unlock(&channel->mutex);
+
+  uv_close((uv_handle_t*) &channel->async, cb);
+}
+
+static void channel_drop(channel_t* channel) {
+  message_t* head = channel->head;
+
+  while (head) {
+    message_t* next = head->next;
+    message_free(head);
+    head = next;
+  }
+
+  uv_mutex_destroy(&channel->mutex);
+}
+
+static message_t* message_new(JSContext* ctx, JSValueConst value, JSValueConst transfer) {
+  transfer_walk_t walk = { JS_UNDEFINED, JS_UNDEFINED, JS_UNDEFINED, NULL, 0 };
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue list = JS_UNDEFINED;
+  JSValue payload = JS_UNDEFINED;
+  message_t* message = NULL;
+  uint8_t** sabs = NULL;
+  size_t sab_count = 0;
+  uint8_t* data;
+  size_t size;
+
+  // postMessage(value, [buffers]) or postMessage(value, { transfer: [buffers] })
+  if (JS_IsArray(ctx, transfer)) {
+    list = JS_DupValue(ctx, transfer);
+  } else if (JS_IsObject(transfer)) {
+    list = JS_GetPropertyStr(ctx, transfer, "transfer");
+  }
+
+  walk.array_buffer = JS_GetPropertyStr(ctx, global, "ArrayBuffer");
+  walk.is_view = JS_GetPropertyStr(ctx, walk.array_buffer, "isView");
+  walk.object = JS_GetPropertyStr(ctx, global, "Object");
+  walk.memo = cmap_transfer_memo_init();
+
+  if (JS_IsArray(ctx, list)) {
+    JSValue length = JS_GetPropertyStr(ctx, list, "length");
+    JS_ToUint32(ctx, &walk.count, length);
+    JS_FreeValue(ctx, length);
+
+    walk.buffers = calloc(walk.count + 1, sizeof(JSValue));
+    CHECK_NOT_NULL(walk.buffers);
+
+    for (uint32_t n = 0; n < walk.count; n++) {
+      size_t buffer_size;
+
+      walk.buffers[n] = JS_GetPropertyUint32(ctx, list, n);
+      if (JS_IsInstanceOf(ctx, walk.buffers[n], walk.array_buffer) <= 0
+          || JS_GetArrayBuffer(ctx, &buffer_size, walk.buffers[n]) == NULL
+          || transfer_index(&walk, walk.buffers[n]) != (int32_t) n) {
+        JS_ThrowTypeError(ctx, "transfer list must contain distinct, attached ArrayBuffers");
+        walk.count = n + 1;
+        goto done;
+      }
+    }
+  }
+
+  payload = walk.count ? transfer_wrap(ctx, &walk, value) : JS_DupValue(ctx, value);
+  if (JS_IsException(payload)) {
+    goto done;
+  }
+
+  data = JS_WriteObject2(ctx, &size, payload, JS_WRITE_OBJ_SAB | JS_WRITE_OBJ_REFERENCE, &sabs, &sab_count);
+  if (!data) {
+    goto done;
+  }
+
+  // copied out of the sender's runtime heap: the receiver frees it
+  message = calloc(1, sizeof(message_t));
+  CHECK_NOT_NULL(message);
+  message->data = malloc(size);
+  CHECK_NOT_NULL(message->data);
+  memcpy(message->data, data, size);
+  message->size = size;
+  js_free(ctx, data);
+
+  // the message holds its own reference to every shared block it names
+  if (sab_count) {
+    message->sabs = malloc(sab_count * sizeof(uint8_t*));
+    CHECK_NOT_NULL(message->sabs);
+    for (size_t n = 0; n < sab_count; n++) {
+      message->sabs[n] = sabs[n];
+      veil_shared_dup(sabs[n]);
+    }
+    message->sab_count = sab_count;
+  }
+  js_free(ctx, sabs);
+
+  if (walk.count) {
+    message->transfers = calloc(walk.count, sizeof(transfer_t));
+    CHECK_NOT_NULL(message->transfers);
+    message->transfer_count = walk.count;
+
+    for (uint32_t n = 0; n < walk.count; n++) {
+      transfer_t* t = &message->transfers[n];
+      uint8_t* store = JS_GetArrayBuffer(ctx, &t->size, walk.buffers[n]);
+
+      // Shared stores, which large buffers from veil and from new
+      // ArrayBuffer() already are, move by reference. The engine owns and
+      // frees anything else, small buffers and typed array storage among
+      // them, so those are copied once into a block of their own.
+      if (veil_shared_owns(store)) {
+        veil_shared_dup(store);
+        t->data = store;
+      } else {
+        t->data = veil_shared_alloc(t->size);
+        memcpy(t->data, store, t->size);
+      }
+      t->buffer = JS_UNDEFINED;
+
+      JS_DetachArrayBuffer(ctx, walk.buffers[n]);
+    }
+  }
+
+done:
+  for (uint32_t n = 0; n < walk.count; n++) {
+    JS_FreeValue(ctx, walk.buffers[n]);
+  }
+  free(walk.buffers);
+  cmap_transfer_memo_drop(&walk.memo);
+  JS_FreeValue(ctx, payload);
+  JS_FreeValue(ctx, walk.object);
+  JS_FreeValue(ctx, walk.is_view);
+  JS_FreeValue(ctx, walk.array_buffer);
+  JS_FreeValue(ctx, list);
+  JS_FreeValue(ctx, global);
+
+  return message;
+}
+
+static JSValue message_read(JSContext* ctx, message_t* message) {
+  cset_transfer_seen seen;
+  JSValue value;
+
+  value = JS_ReadObject(ctx, message->data, message->size, JS_READ_OBJ_SAB | JS_READ_OBJ_REFERENCE);
+
+  if (message->transfer_count && !JS_IsException(value)) {
+    seen = cset_transfer_seen_init();
+    value = transfer_unwrap(ctx, message, &seen, value);
+    cset_transfer_seen_drop(&seen);
+
+    for (uint32_t n = 0; n < message->transfer_count; n++) {
+      JS_FreeValue(ctx, message->transfers[n].buffer);
+      message->transfers[n].buffer = JS_UNDEFINED;
+    }
+  }
+
+  return value;
+}
+
+static void message_free(message_t* message) {
+  for (size_t n = 0; n < message->sab_count; n++) {
+    veil_shared_free(message->sabs[n]);
+  }
+
+  // stores that never reached a receiver
+  for (uint32_t n = 0; n < message->transfer_count; n++) {
+    if (message->transfers[n].data) {
+      veil_shared_free(message->transfers[n].data);
+    }
+  }
+
+  free(message->sabs);
+  free(message->transfers);
+  free(message->data);
+  free(message);
+}
+
+// Builds a copy of the plain object / array skeleton of value in which every
+// transferred ArrayBuffer, and every view over one, is replaced by a small
+// placeholder. The copy is what gets serialized; the stores travel separately.
+static JSValue transfer_wrap(JSContext* ctx, transfer_walk_t* walk, JSValueConst value) {
+  const cmap_transfer_memo_value* memo;
+  JSValue is_view;
+  JSValue ctor;
+  JSValue copy;
+  bool plain;
+
+  if (!JS_IsObject(value)) {
+    return JS_DupValue(ctx, value);
+  }
+
+  memo = cmap_transfer_memo_get(&walk->memo, (uintptr_t) JS_VALUE_GET_PTR(value));
+  if (memo) {
+    return JS_DupValue(ctx, memo->second);
+  }
+
+  if (transfer_index(walk, value) >= 0) {
+    return transfer_placeholder(ctx, walk, value, value);
+  }
+
+  is_view = JS_Call(ctx, walk->is_view, walk->array_buffer, 1, &value);
+  if (JS_ToBool(ctx, is_view)) {
+    JSValue buffer = JS_GetPropertyStr(ctx, value, "buffer");
+
+    // views over buffers that are not transferred are serialized as copies
+    copy = transfer_index(walk, buffer) >= 0
+        ? transfer_placeholder(ctx, walk, value, buffer)
+        : JS_DupValue(ctx, value);
+    JS_FreeValue(ctx, buffer);
+    JS_FreeValue(ctx, is_view);
+    return copy;
+  }
+  JS_FreeValue(ctx, is_view);
+
+  if (JS_IsArray(ctx, value)) {
+    JSValue length = JS_GetPropertyStr(ctx, value, "length");
+    uint32_t count = 0;
+
+    JS_ToUint32(ctx, &count, length);
+    JS_FreeValue(ctx, length);
+
+    copy = JS_NewArray(ctx);
+    cmap_transfer_memo_insert(&walk->memo, (uintptr_t) JS_VALUE_GET_PTR(value), copy);
+
+    for (uint32_t n = 0; n < count; n++) {
+      JSValue item = JS_GetPropertyUint32(ctx, value, n);
+      JSValue wrapped = transfer_wrap(ctx, walk, item);
+
+      JS_FreeValue(ctx, item);
+      if (JS_IsException(wrapped)) {
+        JS_FreeValue(ctx, copy);
+        return wrapped;
+      }
+      JS_SetPropertyUint32(ctx, copy, n, wrapped);
+    }
+
+    return copy;
+  }
+
+  ctor = JS_GetPropertyStr(ctx, value, "constructor");
+  plain = JS_IsUndefined(ctor) || JS_VALUE_GET_PTR(ctor) == JS_VALUE_GET_PTR(walk->object);
+  JS_FreeValue(ctx, ctor);
+
+  if (plain) {
+    JSPropertyEnum* props;
+    uint32_t count;
+
+    if (JS_GetOwnPropertyNames(ctx, &props, &count, value, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+      return JS_EXCEPTION;
+    }
+
+    copy = JS_NewObject(ctx);
+    cmap_transfer_memo_insert(&walk->memo, (uintptr_t) JS_VALUE_GET_PTR(value), copy);
+
+    for (uint32_t n = 0; n < count; n++) {
+      JSValue item = JS_GetProperty(ctx, value, props[n].atom);
+      JSValue wrapped = JS_IsException(copy) ? JS_EXCEPTION : transfer_wrap(ctx, walk, item);
+
+      JS_FreeValue(ctx, item);
+      if (JS_IsException(wrapped)) {
+        JS_FreeValue(ctx, copy);
+        copy = JS_EXCEPTION;
+      } else {
+        JS_SetProperty(ctx, copy, props[n].atom, wrapped);
+      }
+      JS_FreeAtom(ctx, props[n].atom);
+    }
+    js_free(ctx, props);
+
+    return copy;
+  }
+
+  // Date and class instances are written as they are, the latter as plain
+  // objects. JS_WriteObject has no encoding for Map, Set or Error, so those
+  // make postMessage() throw a TypeError.
+  return JS_DupValue(ctx, value);
+}
+
+static JSValue transfer_placeholder(JSContext* ctx, transfer_walk_t* walk, JSValueConst value, JSValueConst buffer) {
+  JSValue placeholder = JS_NewObject(ctx);
+
+  JS_SetPropertyStr(ctx, placeholder, TRANSFER_KEY, JS_NewInt32(ctx, transfer_index(walk, buffer)));
+
+  if (JS_VALUE_GET_PTR(value) != JS_VALUE_GET_PTR(buffer)) {
+    JSValue ctor = JS_GetPropertyStr(ctx, value, "constructor");
+
+    JS_SetPropertyStr(ctx, placeholder, "type", JS_GetPropertyStr(ctx, ctor, "name"));
+    JS_SetPropertyStr(ctx, placeholder, "byteOffset", JS_GetPropertyStr(ctx, value, "byteOffset"));
+    JS_SetPropertyStr(ctx, placeholder, "byteLength", JS_GetPropertyStr(ctx, value, "byteLength"));
+    JS_FreeValue(ctx, ctor);
+  }
+
+  return placeholder;
+}
+
+static int32_t transfer_index(transfer_walk_t* walk, JSValueConst value) {
+  if (!JS_IsObject(value)) {
+    return -1;
+  }
+
+  for (uint32_t n = 0; n < walk->count; n++) {
+    if (JS_VALUE_GET_PTR(walk->buffers[n]) == JS_VALUE_GET_PTR(value)) {
+      return (int32_t) n;
+    }
+  }
+
+  return -1;
+}
+
+// Inverse of transfer_wrap on the receiving side: placeholders become
+// ArrayBuffers over the moved stores, or views over them.
+static JSValue transfer_unwrap(JSContext* ctx, message_t* message, cset_transfer_seen* seen, JSValue value) {
+  JSPropertyEnum* props;
+  uint32_t count;
+  JSValue marker;
+
+  if (!JS_IsObject(value) || cset_transfer_seen_contains(seen, (uintptr_t) JS_VALUE_GET_PTR(value))) {
+    return value;
+  }
+  cset_transfer_seen_insert(seen, (uintptr_t) JS_VALUE_GET_PTR(value));
+
+  marker = JS_GetPropertyStr(ctx, value, TRANSFER_KEY);
+  if (!JS_IsUndefined(marker)) {
+    JS_FreeValue(ctx, marker);
+    return transfer_revive(ctx, message, value);
+  }
+
+  if (JS_GetOwnPropertyNames(ctx, &props, &count, value, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+    JS_FreeValue(ctx, value);
+    return JS_EXCEPTION;
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    JSValue item = JS_GetProperty(ctx, value, props[n].atom);
+    void* before = JS_VALUE_GET_PTR(item);
+    JSValue unwrapped = transfer_unwrap(ctx, message, seen, item);
+
+    if (JS_IsObject(unwrapped) && JS_VALUE_GET_PTR(unwrapped) != before) {
+      JS_SetProperty(ctx, value, props[n].atom, unwrapped);
+    } else {
+      JS_FreeValue(ctx, unwrapped);
+    }
+    JS_FreeAtom(ctx, props[n].atom);
+  }
+  js_free(ctx, props);
+
+  return value;
+}
+
+static JSValue transfer_revive(JSContext* ctx, message_t* message, JSValue placeholder) {
+  JSValue index_value = JS_GetPropertyStr(ctx, placeholder, TRANSFER_KEY);
+  JSValue type = JS_GetPropertyStr(ctx, placeholder, "type");
+  transfer_t* t;
+  JSValue result;
+  int32_t index = -1;
+
+  JS_ToInt32(ctx, &index, index_value);
+  JS_FreeValue(ctx, index_value);
+
+  if (index < 0 || (uint32_t) index >= message->transfer_count) {
+    JS_FreeValue(ctx, type);
+    return placeholder;
+  }
+
+  // the first placeholder for a store takes ownership of it; views share it
+  t = &message->transfers[index];
+  if (t->data) {
+    t->buffer = veil_shared_new_array_buffer(ctx, t->data, t->size);
+    t->data = NULL;
+  }
+
+  if (JS_IsUndefined(type)) {
+    result = JS_DupValue(ctx, t->buffer);
+  } else {
+    JSValue global = JS_GetGlobalObject(ctx);
+    const char* name = JS_ToCString(ctx, type);
+    JSValue ctor = JS_GetPropertyStr(ctx, global, name ? name : "Uint8Array");
+    JSValue element_size = JS_GetPropertyStr(ctx, ctor, "BYTES_PER_ELEMENT");
+    JSValue length = JS_GetPropertyStr(ctx, placeholder, "byteLength");
+    JSValue args[3];
+    uint32_t byte_length = 0;
+    uint32_t bytes_per_element = 1;
+
+    JS_ToUint32(ctx, &byte_length, length);
+    if (!JS_IsUndefined(element_size)) {
+      JS_ToUint32(ctx, &bytes_per_element, element_size);
+    }
+
+    args[0] = t->buffer;
+    args[1] = JS_GetPropertyStr(ctx, placeholder, "byteOffset");
+    args[2] = JS_NewUint32(ctx, byte_length / (bytes_per_element ? bytes_per_element : 1));
+    result = JS_CallConstructor(ctx, ctor, 3, args);
+
+    JS_FreeValue(ctx, args[1]);
+    JS_FreeValue(ctx, length);
+    JS_FreeValue(ctx, element_size);
+    JS_FreeValue(ctx, ctor);
+    JS_FreeCString(ctx, name);
+    JS_FreeValue(ctx, global);
+  }
+
+  JS_FreeValue(ctx, type);
+  JS_FreeValue(ctx, placeholder);
+
+  return result;
+}
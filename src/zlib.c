@@ -0,0 +1,1694 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "defs.h"
+
+#include <limits.h>
+#include <string.h>
+
+#ifdef VEIL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef VEIL_HAVE_BROTLI
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#endif
+
+#ifdef VEIL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Every codec runs on the threadpool. A stream copies at most ZLIB_JOB_INPUT
+// bytes of what was written into a native buffer, hands it to a job and runs
+// the next job when that one is back. A job yields once it has produced
+// ZLIB_JOB_OUTPUT bytes, which go out as one 'data' event, so a stream's
+// memory stays bounded however well its input compresses. The worker never
+// touches JS memory.
+//
+// The one-shot calls (gzip(), gzipSync() and so on) run the codec over the
+// whole input, asynchronous ones on the threadpool with a copy of it.
+//
+// Each codec is compiled in with its library: VEIL_WITH_ZLIB for
+// deflate/inflate/gzip/gunzip/unzip, VEIL_WITH_BROTLI and VEIL_WITH_ZSTD. The
+// functions of a missing codec throw.
+
+#define ZLIB_DEFAULT_CHUNK (16 * 1024)
+#define ZLIB_MIN_CHUNK 64
+// input copied out of JS for one threadpool job
+#define ZLIB_JOB_INPUT (64 * 1024)
+// output after which a stream's job yields back to the loop
+#define ZLIB_JOB_OUTPUT (256 * 1024)
+// write() returns false once this much is queued
+#define ZLIB_HIGH_WATER_MARK (16 * 1024)
+// the largest ArrayBuffer QuickJS can make
+#define ZLIB_DEFAULT_MAX_OUTPUT ((size_t) INT32_MAX)
+// brotli and zstd parameters per stream
+#define ZLIB_MAX_PARAMS 16
+
+// the values of zlib.h, which may not be there
+#define ZLIB_DEFAULT_LEVEL (-1)
+#define ZLIB_DEFAULT_WINDOW_BITS 15
+#define ZLIB_DEFAULT_MEM_LEVEL 8
+
+typedef enum {
+  ZLIB_DEFLATE,
+  ZLIB_INFLATE,
+  ZLIB_GZIP,
+  ZLIB_GUNZIP,
+  ZLIB_DEFLATE_RAW,
+  ZLIB_INFLATE_RAW,
+  ZLIB_UNZIP,
+  ZLIB_BROTLI_COMPRESS,
+  ZLIB_BROTLI_DECOMPRESS,
+  ZLIB_ZSTD_COMPRESS,
+  ZLIB_ZSTD_DECOMPRESS,
+} zlib_mode_t;
+
+typedef enum {
+  ZLIB_OP_PROCESS,
+  ZLIB_OP_FLUSH,
+  ZLIB_OP_FINISH,
+} zlib_op_t;
+
+typedef enum {
+  // the input is consumed and the operation complete
+  ZLIB_STEP_IDLE,
+  // there is more to do: call again, with room for output
+  ZLIB_STEP_MORE,
+  // the compressed stream has ended
+  ZLIB_STEP_END,
+  ZLIB_STEP_ERROR,
+} zlib_step_t;
+
+typedef struct zlib_params_s {
+  int level;
+  bool has_level;
+  int window_bits;
+  int mem_level;
+  int strategy;
+  size_t chunk_size;
+  size_t max_output;
+  uint32_t param_count;
+  int param_keys[ZLIB_MAX_PARAMS];
+  int param_values[ZLIB_MAX_PARAMS];
+} zlib_params_t;
+
+typedef struct zlib_codec_s {
+  zlib_mode_t mode;
+  bool ready;
+#ifdef VEIL_HAVE_ZLIB
+  z_stream z;
+#endif
+#ifdef VEIL_HAVE_BROTLI
+  BrotliEncoderState* brotli_encoder;
+  BrotliDecoderState* brotli_decoder;
+#endif
+#ifdef VEIL_HAVE_ZSTD
+  ZSTD_CCtx* zstd_compressor;
+  ZSTD_DCtx* zstd_decompressor;
+  // the last frame read was complete
+  bool frame_done;
+#endif
+  // set with ZLIB_STEP_ERROR; plain C, as it is set on the threadpool
+  int errno_value;
+  char code[64];
+  char message[128];
+} zlib_codec_t;
+
+typedef struct zlib_buf_s {
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+  // consumed so far, for input
+  size_t offset;
+} zlib_buf_t;
+
+typedef struct zlib_chunk_s {
+  // the buffer written, or JS_UNDEFINED for strings and flushes
+  JSValue keep;
+  // UTF-8 of a string chunk
+  uint8_t* owned;
+  const uint8_t* data;
+  size_t size;
+  // copied into job input so far
+  size_t offset;
+  JSValue callback;
+  bool flush;
+} zlib_chunk_t;
+
+typedef struct zlib_stream_s {
+  uv_work_t work;
+  veil_cleanup_t cleanup;
+  // NULL once the VM has gone and released the JS values
+  veil_vm_t* vm;
+  // not a reference; the stream holds one only while a job runs
+  JSValue object;
+  zlib_codec_t codec;
+  zlib_params_t params;
+  zlib_chunk_t* queue;
+  uint32_t count;
+  uint32_t capacity;
+  // queue entries the job input has fully taken
+  uint32_t taken;
+  // queued, including what the running job has taken
+  size_t writable_length;
+  uint64_t bytes_written;
+  zlib_buf_t in;
+  zlib_buf_t out;
+  zlib_op_t op;
+  zlib_step_t step;
+  bool busy;
+  // the last job yielded with work left for the next
+  bool more;
+  bool ending;
+  bool ended;
+  bool finish_emitted;
+  bool end_emitted;
+  bool need_drain;
+  bool closed;
+  // the object was finalized while a job ran; the job frees the stream
+  bool orphaned;
+} zlib_stream_t;
+
+typedef struct zlib_req_s {
+  uv_work_t work;
+  veil_cleanup_t cleanup;
+  // NULL once the VM has gone and released the JS values
+  veil_vm_t* vm;
+  JSValue callback;
+  JSValue resolving_funcs[2];
+  zlib_codec_t codec;
+  zlib_params_t params;
+  zlib_buf_t in;
+  zlib_buf_t out;
+  zlib_step_t step;
+} zlib_req_t;
+
+static JSClassID stream_class_id;
+static uv_once_t global_once = UV_ONCE_INIT;
+
+static void global_init();
+static int zlib_module_init(JSContext* ctx, JSModuleDef* m);
+
+static JSValue zlib_create(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue zlib_async(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+static JSValue zlib_sync(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic);
+
+static JSValue stream_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue stream_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue stream_flush(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue stream_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv);
+static JSValue stream_get(JSContext* ctx, JSValueConst this_val, int magic);
+static void stream_finalizer(JSRuntime* rt, JSValue val);
+static void stream_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func);
+
+static bool stream_queue(JSContext* ctx, zlib_stream_t* stream, JSValueConst data, JSValueConst callback, bool flush);
+static void stream_schedule(zlib_stream_t* stream);
+static void stream_take(zlib_stream_t* stream);
+static void stream_complete(zlib_stream_t* stream, uint32_t count);
+static void stream_maybe_close(zlib_stream_t* stream);
+static void stream_close(zlib_stream_t* stream);
+static void stream_free(zlib_stream_t* stream);
+static void stream_work_cb(uv_work_t* work);
+static void stream_after_work_cb(uv_work_t* work, int status);
+static void stream_cleanup_cb(veil_cleanup_t* cleanup);
+
+static void req_work_cb(uv_work_t* work);
+static void req_after_work_cb(uv_work_t* work, int status);
+static void req_settle(JSContext* ctx, zlib_req_t* req);
+static void req_free(zlib_req_t* req);
+static void req_cleanup_cb(veil_cleanup_t* cleanup);
+
+static bool codec_init(zlib_codec_t* codec, zlib_mode_t mode, const zlib_params_t* params);
+static zlib_step_t codec_run(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out, size_t chunk_size, size_t limit);
+static zlib_step_t codec_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out);
+static zlib_step_t codec_finish(zlib_codec_t* codec, zlib_buf_t* in, zlib_buf_t* out, const zlib_params_t* params);
+static void codec_fail(zlib_codec_t* codec, const char* code, int errno_value, const char* message);
+static void codec_drop(zlib_codec_t* codec);
+static JSValue codec_error(JSContext* ctx, const zlib_codec_t* codec);
+
+#ifdef VEIL_HAVE_ZLIB
+static zlib_step_t zlib_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out);
+static const char* zlib_code(int ret);
+#endif
+#ifdef VEIL_HAVE_BROTLI
+static zlib_step_t brotli_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out);
+#endif
+#ifdef VEIL_HAVE_ZSTD
+static zlib_step_t zstd_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out);
+#endif
+
+static bool check_mode(JSContext* ctx, zlib_mode_t mode);
+static bool parse_params(JSContext* ctx, JSValueConst options, zlib_mode_t mode, zlib_params_t* out);
+static bool get_int_option(JSContext* ctx, JSValueConst options, const char* name, int min, int max, int* out, bool* found);
+static bool get_input(JSContext* ctx, JSValueConst value, zlib_buf_t* out, bool copy);
+static JSValue take_buffer(JSContext* ctx, zlib_buf_t* buf);
+static void release_chunks(JSRuntime* rt, zlib_chunk_t* chunks, uint32_t count);
+static void emit_error(JSContext* ctx, JSValueConst obj, JSValue error);
+
+enum {
+  STREAM_BYTES_WRITTEN,
+  STREAM_WRITABLE_LENGTH,
+  STREAM_WRITABLE_NEED_DRAIN,
+  STREAM_DESTROYED,
+};
+
+static const char* MODE_NAMES[] = {
+  "deflate",
+  "inflate",
+  "gzip",
+  "gunzip",
+  "deflateRaw",
+  "inflateRaw",
+  "unzip",
+  "brotliCompress",
+  "brotliDecompress",
+  "zstdCompress",
+  "zstdDecompress",
+};
+
+static const JSClassDef STREAM_CLASS = {
+  "Zlib",
+  .finalizer = stream_finalizer,
+  .gc_mark = stream_mark,
+};
+
+static const JSCFunctionListEntry STREAM_PROTO[] = {
+  JS_CFUNC_DEF("on", 2, veil_emitter_js_on),
+  JS_CFUNC_DEF("off", 2, veil_emitter_js_off),
+  JS_CFUNC_DEF("write", 2, stream_write),
+  JS_CFUNC_DEF("end", 2, stream_end),
+  JS_CFUNC_DEF("flush", 1, stream_flush),
+  JS_CFUNC_DEF("destroy", 0, stream_destroy),
+  JS_CFUNC_DEF("close", 0, stream_destroy),
+  JS_CGETSET_MAGIC_DEF("bytesWritten", stream_get, NULL, STREAM_BYTES_WRITTEN),
+  JS_CGETSET_MAGIC_DEF("writableLength", stream_get, NULL, STREAM_WRITABLE_LENGTH),
+  JS_CGETSET_MAGIC_DEF("writableNeedDrain", stream_get, NULL, STREAM_WRITABLE_NEED_DRAIN),
+  JS_CGETSET_MAGIC_DEF("destroyed", stream_get, NULL, STREAM_DESTROYED),
+};
+
+// the values of zlib.h, brotli/encode.h and zstd.h, so that they are there
+// whichever codecs are built
+static const JSCFunctionListEntry CONSTANTS[] = {
+  JS_PROP_INT32_DEF("Z_NO_FLUSH", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_PARTIAL_FLUSH", 1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_SYNC_FLUSH", 2, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_FULL_FLUSH", 3, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_FINISH", 4, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_OK", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_STREAM_END", 1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_NEED_DICT", 2, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_ERRNO", -1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_STREAM_ERROR", -2, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_DATA_ERROR", -3, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_MEM_ERROR", -4, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_BUF_ERROR", -5, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_VERSION_ERROR", -6, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_NO_COMPRESSION", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_BEST_SPEED", 1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_BEST_COMPRESSION", 9, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_DEFAULT_COMPRESSION", -1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_FILTERED", 1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_HUFFMAN_ONLY", 2, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_RLE", 3, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_FIXED", 4, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_DEFAULT_STRATEGY", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_DEFAULT_CHUNK", ZLIB_DEFAULT_CHUNK, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_DEFAULT_WINDOWBITS", ZLIB_DEFAULT_WINDOW_BITS, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("Z_DEFAULT_MEMLEVEL", ZLIB_DEFAULT_MEM_LEVEL, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_PARAM_MODE", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_PARAM_QUALITY", 1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_PARAM_LGWIN", 2, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_PARAM_LGBLOCK", 3, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_PARAM_DISABLE_LITERAL_CONTEXT_MODELING", 4, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_PARAM_SIZE_HINT", 5, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_PARAM_LARGE_WINDOW", 6, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_MODE_GENERIC", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_MODE_TEXT", 1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_MODE_FONT", 2, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_MIN_QUALITY", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_MAX_QUALITY", 11, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_DEFAULT_QUALITY", 11, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_DECODER_PARAM_DISABLE_RING_BUFFER_REALLOCATION", 0, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("BROTLI_DECODER_PARAM_LARGE_WINDOW", 1, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("ZSTD_c_compressionLevel", 100, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("ZSTD_c_windowLog", 101, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("ZSTD_c_checksumFlag", 201, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("ZSTD_c_nbWorkers", 400, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("ZSTD_d_windowLogMax", 100, JS_PROP_ENUMERABLE),
+  JS_PROP_INT32_DEF("ZSTD_CLEVEL_DEFAULT", 3, JS_PROP_ENUMERABLE),
+};
+
+static const JSCFunctionListEntry ZLIB[] = {
+  JS_CFUNC_MAGIC_DEF("createDeflate", 1, zlib_create, ZLIB_DEFLATE),
+  JS_CFUNC_MAGIC_DEF("createInflate", 1, zlib_create, ZLIB_INFLATE),
+  JS_CFUNC_MAGIC_DEF("createGzip", 1, zlib_create, ZLIB_GZIP),
+  JS_CFUNC_MAGIC_DEF("createGunzip", 1, zlib_create, ZLIB_GUNZIP),
+  JS_CFUNC_MAGIC_DEF("createDeflateRaw", 1, zlib_create, ZLIB_DEFLATE_RAW),
+  JS_CFUNC_MAGIC_DEF("createInflateRaw", 1, zlib_create, ZLIB_INFLATE_RAW),
+  JS_CFUNC_MAGIC_DEF("createUnzip", 1, zlib_create, ZLIB_UNZIP),
+  JS_CFUNC_MAGIC_DEF("createBrotliCompress", 1, zlib_create, ZLIB_BROTLI_COMPRESS),
+  JS_CFUNC_MAGIC_DEF("createBrotliDecompress", 1, zlib_create, ZLIB_BROTLI_DECOMPRESS),
+  JS_CFUNC_MAGIC_DEF("createZstdCompress", 1, zlib_create, ZLIB_ZSTD_COMPRESS),
+  JS_CFUNC_MAGIC_DEF("createZstdDecompress", 1, zlib_create, ZLIB_ZSTD_DECOMPRESS),
+  JS_CFUNC_MAGIC_DEF("deflate", 3, zlib_async, ZLIB_DEFLATE),
+  JS_CFUNC_MAGIC_DEF("inflate", 3, zlib_async, ZLIB_INFLATE),
+  JS_CFUNC_MAGIC_DEF("gzip", 3, zlib_async, ZLIB_GZIP),
+  JS_CFUNC_MAGIC_DEF("gunzip", 3, zlib_async, ZLIB_GUNZIP),
+  JS_CFUNC_MAGIC_DEF("deflateRaw", 3, zlib_async, ZLIB_DEFLATE_RAW),
+  JS_CFUNC_MAGIC_DEF("inflateRaw", 3, zlib_async, ZLIB_INFLATE_RAW),
+  JS_CFUNC_MAGIC_DEF("unzip", 3, zlib_async, ZLIB_UNZIP),
+  JS_CFUNC_MAGIC_DEF("brotliCompress", 3, zlib_async, ZLIB_BROTLI_COMPRESS),
+  JS_CFUNC_MAGIC_DEF("brotliDecompress", 3, zlib_async, ZLIB_BROTLI_DECOMPRESS),
+  JS_CFUNC_MAGIC_DEF("zstdCompress", 3, zlib_async, ZLIB_ZSTD_COMPRESS),
+  JS_CFUNC_MAGIC_DEF("zstdDecompress", 3, zlib_async, ZLIB_ZSTD_DECOMPRESS),
+  JS_CFUNC_MAGIC_DEF("deflateSync", 2, zlib_sync, ZLIB_DEFLATE),
+  JS_CFUNC_MAGIC_DEF("inflateSync", 2, zlib_sync, ZLIB_INFLATE),
+  JS_CFUNC_MAGIC_DEF("gzipSync", 2, zlib_sync, ZLIB_GZIP),
+  JS_CFUNC_MAGIC_DEF("gunzipSync", 2, zlib_sync, ZLIB_GUNZIP),
+  JS_CFUNC_MAGIC_DEF("deflateRawSync", 2, zlib_sync, ZLIB_DEFLATE_RAW),
+  JS_CFUNC_MAGIC_DEF("inflateRawSync", 2, zlib_sync, ZLIB_INFLATE_RAW),
+  JS_CFUNC_MAGIC_DEF("unzipSync", 2, zlib_sync, ZLIB_UNZIP),
+  JS_CFUNC_MAGIC_DEF("brotliCompressSync", 2, zlib_sync, ZLIB_BROTLI_COMPRESS),
+  JS_CFUNC_MAGIC_DEF("brotliDecompressSync", 2, zlib_sync, ZLIB_BROTLI_DECOMPRESS),
+  JS_CFUNC_MAGIC_DEF("zstdCompressSync", 2, zlib_sync, ZLIB_ZSTD_COMPRESS),
+  JS_CFUNC_MAGIC_DEF("zstdDecompressSync", 2, zlib_sync, ZLIB_ZSTD_DECOMPRESS),
+  JS_OBJECT_DEF("constants", CONSTANTS, countof(CONSTANTS), JS_PROP_CONFIGURABLE),
+};
+
+JSModuleDef* veil_zlib_init_module(JSContext* ctx, const char* name) {
+  JSModuleDef* m = JS_NewCModule(ctx, name, zlib_module_init);
+
+  if (m) {
+    JS_AddModuleExportList(ctx, m, ZLIB, countof(ZLIB));
+    JS_AddModuleExport(ctx, m, "default");
+  }
+
+  return m;
+}
+
+static void global_init() {
+  JS_NewClassID(&stream_class_id);
+}
+
+static int zlib_module_init(JSContext* ctx, JSModuleDef* m) {
+  JSRuntime* rt = JS_GetRuntime(ctx);
+  JSValue proto;
+  JSValue zlib;
+
+  uv_once(&global_once, global_init);
+
+  if (!JS_IsRegisteredClass(rt, stream_class_id)) {
+    JS_NewClass(rt, stream_class_id, &STREAM_CLASS);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, STREAM_PROTO, countof(STREAM_PROTO));
+  JS_SetClassProto(ctx, stream_class_id, proto);
+
+  zlib = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, zlib, ZLIB, countof(ZLIB));
+
+  JS_SetModuleExportList(ctx, m, ZLIB, countof(ZLIB));
+  JS_SetModuleExport(ctx, m, "default", zlib);
+
+  return 0;
+}
+
+// createGzip([options]) and the like. The stream emits 'data' with Buffers,
+// 'end' after the last of them, 'finish' once end() has been processed, and
+// 'close'.
+static JSValue zlib_create(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  zlib_stream_t* stream;
+  zlib_params_t params;
+  zlib_codec_t codec;
+  JSValue obj;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "zlib streams require an event loop");
+  }
+
+  if (!check_mode(ctx, magic) || !parse_params(ctx, argc > 0 ? argv[0] : JS_UNDEFINED, magic, &params)) {
+    return JS_EXCEPTION;
+  }
+
+  if (!codec_init(&codec, magic, &params)) {
+    codec_drop(&codec);
+    return JS_Throw(ctx, codec_error(ctx, &codec));
+  }
+
+  obj = JS_NewObjectClass(ctx, stream_class_id);
+  if (JS_IsException(obj)) {
+    codec_drop(&codec);
+    return obj;
+  }
+
+  stream = calloc(1, sizeof(zlib_stream_t));
+  CHECK_NOT_NULL(stream);
+  stream->vm = vm;
+  stream->object = obj;
+  stream->codec = codec;
+  stream->params = params;
+  stream->in.capacity = ZLIB_JOB_INPUT;
+  stream->in.data = malloc(ZLIB_JOB_INPUT);
+  CHECK_NOT_NULL(stream->in.data);
+  stream->work.data = stream;
+  JS_SetOpaque(obj, stream);
+
+  return obj;
+}
+
+// gzip(data[, options][, callback]) and the like call back with
+// (error, buffer); without a callback they return a promise.
+static JSValue zlib_async(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  veil_vm_t* vm = JS_GetContextOpaque(ctx);
+  zlib_req_t* req;
+  JSValue promise = JS_UNDEFINED;
+
+  if (!vm->uv) {
+    return JS_ThrowInternalError(ctx, "asynchronous zlib calls require an event loop");
+  }
+
+  if (!check_mode(ctx, magic)) {
+    return JS_EXCEPTION;
+  }
+
+  req = calloc(1, sizeof(zlib_req_t));
+  CHECK_NOT_NULL(req);
+  req->callback = JS_UNDEFINED;
+  req->resolving_funcs[0] = JS_UNDEFINED;
+  req->resolving_funcs[1] = JS_UNDEFINED;
+
+  if (argc > 1 && JS_IsFunction(ctx, argv[argc - 1])) {
+    req->callback = JS_DupValue(ctx, argv[--argc]);
+  }
+
+  // the threadpool gets a copy, so the caller can reuse its buffer at once
+  if (!parse_params(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, magic, &req->params)
+      || !get_input(ctx, argc > 0 ? argv[0] : JS_UNDEFINED, &req->in, true)) {
+    JS_FreeValue(ctx, req->callback);
+    free(req);
+    return JS_EXCEPTION;
+  }
+
+  if (!codec_init(&req->codec, magic, &req->params)) {
+    JSValue error = codec_error(ctx, &req->codec);
+
+    JS_FreeValue(ctx, req->callback);
+    req_free(req);
+    return JS_Throw(ctx, error);
+  }
+
+  if (JS_IsUndefined(req->callback)) {
+    promise = JS_NewPromiseCapability(ctx, req->resolving_funcs);
+    if (JS_IsException(promise)) {
+      req_free(req);
+      return promise;
+    }
+  }
+
+  req->vm = vm;
+  req->work.data = req;
+  veil_vm_add_cleanup(vm, &req->cleanup, req_cleanup_cb);
+  CHECK_OK(uv_queue_work(&vm->uv->loop, &req->work, req_work_cb, req_after_work_cb));
+
+  return promise;
+}
+
+// gzipSync(data[, options]) and the like, on the calling thread.
+static JSValue zlib_sync(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv, int magic) {
+  zlib_params_t params;
+  zlib_codec_t codec;
+  zlib_buf_t in = { 0 };
+  zlib_buf_t out = { 0 };
+  JSValueConst data = argc > 0 ? argv[0] : JS_UNDEFINED;
+  const char* str = NULL;
+  zlib_step_t step;
+  JSValue result;
+
+  if (!check_mode(ctx, magic) || !parse_params(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, magic, &params)) {
+    return JS_EXCEPTION;
+  }
+
+  // borrowed: nothing else runs until the call returns
+  if (JS_IsString(data)) {
+    str = JS_ToCStringLen(ctx, &in.size, data);
+    if (!str) {
+      return JS_EXCEPTION;
+    }
+    in.data = (uint8_t*) str;
+  } else if (!get_input(ctx, data, &in, false)) {
+    return JS_EXCEPTION;
+  }
+
+  step = codec_init(&codec, magic, &params) ? codec_finish(&codec, &in, &out, &params) : ZLIB_STEP_ERROR;
+  JS_FreeCString(ctx, str);
+
+  if (step == ZLIB_STEP_END) {
+    result = take_buffer(ctx, &out);
+  } else {
+    result = JS_Throw(ctx, codec_error(ctx, &codec));
+    free(out.data);
+  }
+  codec_drop(&codec);
+
+  return result;
+}
+
+// write(data[, encoding][, callback]); only UTF-8 strings are supported
+static JSValue stream_write(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  zlib_stream_t* stream = JS_GetOpaque2(ctx, this_val, stream_class_id);
+
+  if (!stream) {
+    return JS_EXCEPTION;
+  }
+
+  if (stream->closed || stream->ending) {
+    return JS_ThrowTypeError(ctx, "write after end");
+  }
+
+  if (!stream_queue(ctx, stream, argc > 0 ? argv[0] : JS_UNDEFINED,
+          argc > 1 && JS_IsFunction(ctx, argv[argc - 1]) ? argv[argc - 1] : JS_UNDEFINED, false)) {
+    return JS_EXCEPTION;
+  }
+
+  if (stream->writable_length >= ZLIB_HIGH_WATER_MARK) {
+    stream->need_drain = true;
+    return JS_FALSE;
+  }
+
+  return JS_TRUE;
+}
+
+static JSValue stream_end(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  zlib_stream_t* stream = JS_GetOpaque2(ctx, this_val, stream_class_id);
+
+  if (!stream) {
+    return JS_EXCEPTION;
+  }
+
+  if (stream->closed || stream->ending) {
+    return JS_DupValue(ctx, this_val);
+  }
+
+  if (argc > 0 && JS_IsFunction(ctx, argv[argc - 1])) {
+    veil_emitter_on(ctx, this_val, "finish", argv[--argc]);
+  }
+
+  if (argc > 0 && !JS_IsUndefined(argv[0]) && !JS_IsNull(argv[0])
+      && !stream_queue(ctx, stream, argv[0], JS_UNDEFINED, false)) {
+    return JS_EXCEPTION;
+  }
+
+  stream->ending = true;
+  stream_schedule(stream);
+  stream_maybe_close(stream);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+// flush([kind][, callback]) emits everything written so far; the kind is
+// always a sync flush.
+static JSValue stream_flush(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  zlib_stream_t* stream = JS_GetOpaque2(ctx, this_val, stream_class_id);
+
+  if (!stream) {
+    return JS_EXCEPTION;
+  }
+
+  if (stream->closed || stream->ending) {
+    return JS_UNDEFINED;
+  }
+
+  if (!stream_queue(ctx, stream, JS_UNDEFINED,
+          argc > 0 && JS_IsFunction(ctx, argv[argc - 1]) ? argv[argc - 1] : JS_UNDEFINED, true)) {
+    return JS_EXCEPTION;
+  }
+
+  return JS_UNDEFINED;
+}
+
+static JSValue stream_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+  zlib_stream_t* stream = JS_GetOpaque2(ctx, this_val, stream_class_id);
+
+  if (!stream) {
+    return JS_EXCEPTION;
+  }
+
+  if (argc > 0 && JS_IsObject(argv[0]) && !stream->closed) {
+    veil_emitter_emit(ctx, this_val, "error", 1, argv);
+  }
+
+  stream_close(stream);
+
+  return JS_DupValue(ctx, this_val);
+}
+
+static JSValue stream_get(JSContext* ctx, JSValueConst this_val, int magic) {
+  zlib_stream_t* stream = JS_GetOpaque2(ctx, this_val, stream_class_id);
+
+  if (!stream) {
+    return JS_EXCEPTION;
+  }
+
+  switch (magic) {
+    case STREAM_BYTES_WRITTEN:
+      return JS_NewInt64(ctx, (int64_t) stream->bytes_written);
+    case STREAM_WRITABLE_LENGTH:
+      return JS_NewInt64(ctx, (int64_t) stream->writable_length);
+    case STREAM_WRITABLE_NEED_DRAIN:
+      return JS_NewBool(ctx, stream->need_drain);
+    case STREAM_DESTROYED:
+      return JS_NewBool(ctx, stream->closed);
+    default:
+      return JS_UNDEFINED;
+  }
+}
+
+static void stream_finalizer(JSRuntime* rt, JSValue val) {
+  zlib_stream_t* stream = JS_GetOpaque(val, stream_class_id);
+
+  if (!stream) {
+    return;
+  }
+
+  // a running job holds a reference, unless the VM has gone and taken it
+  release_chunks(rt, stream->queue, stream->count);
+  stream->count = 0;
+  if (stream->busy) {
+    stream->orphaned = true;
+    return;
+  }
+
+  stream_free(stream);
+}
+
+// stream->object is a root while a job runs, so only the queue is marked
+static void stream_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+  zlib_stream_t* stream = JS_GetOpaque(val, stream_class_id);
+
+  if (!stream) {
+    return;
+  }
+
+  for (uint32_t n = 0; n < stream->count; n++) {
+    JS_MarkValue(rt, stream->queue[n].keep, mark_func);
+    JS_MarkValue(rt, stream->queue[n].callback, mark_func);
+  }
+}
+
+static bool stream_queue(JSContext* ctx, zlib_stream_t* stream, JSValueConst data, JSValueConst callback, bool flush) {
+  zlib_chunk_t chunk = { .keep = JS_UNDEFINED, .callback = JS_UNDEFINED, .flush = flush };
+  uint8_t* bytes;
+  size_t size;
+
+  if (flush) {
+    // nothing to take
+  } else if (JS_IsString(data)) {
+    const char* str = JS_ToCStringLen(ctx, &size, data);
+
+    if (!str) {
+      return false;
+    }
+    chunk.owned = malloc(size ? size : 1);
+    CHECK_NOT_NULL(chunk.owned);
+    memcpy(chunk.owned, str, size);
+    JS_FreeCString(ctx, str);
+    chunk.data = chunk.owned;
+    chunk.size = size;
+  } else if (veil_builtin_get_bytes(ctx, data, &bytes, &size)) {
+    // copied into job input on the loop thread, when its turn comes
+    chunk.keep = JS_DupValue(ctx, data);
+    chunk.data = bytes;
+    chunk.size = size;
+  } else {
+    return false;
+  }
+
+  if (stream->count == stream->capacity) {
+    stream->capacity = stream->capacity ? stream->capacity * 2 : 8;
+    stream->queue = realloc(stream->queue, stream->capacity * sizeof(zlib_chunk_t));
+    CHECK_NOT_NULL(stream->queue);
+  }
+
+  chunk.callback = JS_DupValue(ctx, callback);
+  stream->queue[stream->count++] = chunk;
+  stream->writable_length += chunk.size;
+  stream_schedule(stream);
+
+  return true;
+}
+
+static void stream_schedule(zlib_stream_t* stream) {
+  if (stream->busy || stream->closed || stream->ended) {
+    return;
+  }
+
+  // a job that yielded carries on with the same input and operation
+  if (!stream->more) {
+    stream_take(stream);
+    if (stream->in.size == 0 && stream->op == ZLIB_OP_PROCESS) {
+      if (!stream->ending) {
+        return;
+      }
+      stream->op = ZLIB_OP_FINISH;
+    }
+  }
+
+  stream->busy = true;
+  JS_DupValue(stream->vm->context, stream->object);
+  veil_vm_add_cleanup(stream->vm, &stream->cleanup, stream_cleanup_cb);
+  CHECK_OK(uv_queue_work(&stream->vm->uv->loop, &stream->work, stream_work_cb, stream_after_work_cb));
+}
+
+static void stream_take(zlib_stream_t* stream) {
+  stream->in.size = 0;
+  stream->in.offset = 0;
+  stream->op = ZLIB_OP_PROCESS;
+  stream->taken = 0;
+
+  while (stream->taken < stream->count && stream->in.size < stream->in.capacity) {
+    zlib_chunk_t* chunk = &stream->queue[stream->taken];
+    size_t size = chunk->size - chunk->offset;
+
+    // a flush goes alone, after what was written before it
+    if (chunk->flush) {
+      if (stream->in.size == 0) {
+        stream->op = ZLIB_OP_FLUSH;
+        stream->taken++;
+      }
+      break;
+    }
+
+    if (size > stream->in.capacity - stream->in.size) {
+      size = stream->in.capacity - stream->in.size;
+    }
+    memcpy(stream->in.data + stream->in.size, chunk->data + chunk->offset, size);
+    stream->in.size += size;
+    chunk->offset += size;
+    if (chunk->offset < chunk->size) {
+      break;
+    }
+    stream->taken++;
+  }
+}
+
+// Calls back and drops the first count chunks of the queue.
+static void stream_complete(zlib_stream_t* stream, uint32_t count) {
+  JSContext* ctx = stream->vm->context;
+  zlib_chunk_t* chunks;
+
+  if (!count) {
+    return;
+  }
+
+  // callbacks can write, which can grow the queue
+  chunks = malloc(count * sizeof(zlib_chunk_t));
+  CHECK_NOT_NULL(chunks);
+  memcpy(chunks, stream->queue, count * sizeof(zlib_chunk_t));
+  memmove(stream->queue, stream->queue + count, (stream->count - count) * sizeof(zlib_chunk_t));
+  stream->count -= count;
+
+  for (uint32_t n = 0; n < count; n++) {
+    stream->writable_length -= chunks[n].size;
+    stream->bytes_written += chunks[n].size;
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    if (JS_IsFunction(ctx, chunks[n].callback) && !stream->closed) {
+      JSValue result = JS_Call(ctx, chunks[n].callback, stream->object, 0, NULL);
+
+      if (JS_IsException(result)) {
+        veil_vm_dump_exception(stream->vm);
+      }
+      JS_FreeValue(ctx, result);
+    }
+  }
+
+  release_chunks(JS_GetRuntime(ctx), chunks, count);
+  free(chunks);
+}
+
+// A decompressor can reach the end of its data before end() is called; the
+// stream closes once both have happened.
+static void stream_maybe_close(zlib_stream_t* stream) {
+  JSContext* ctx = stream->vm->context;
+
+  if (stream->busy || stream->closed || !stream->ended) {
+    return;
+  }
+
+  if (stream->ending && !stream->finish_emitted) {
+    stream->finish_emitted = true;
+    veil_emitter_emit(ctx, stream->object, "finish", 0, NULL);
+  }
+
+  if (!stream->end_emitted && !stream->closed) {
+    stream->end_emitted = true;
+    veil_emitter_emit(ctx, stream->object, "end", 0, NULL);
+  }
+
+  if (stream->ending) {
+    stream_close(stream);
+  }
+}
+
+static void stream_close(zlib_stream_t* stream) {
+  JSContext* ctx = stream->vm->context;
+
+  if (stream->closed) {
+    return;
+  }
+
+  // as with sockets, pending callbacks never run
+  stream->closed = true;
+  release_chunks(JS_GetRuntime(ctx), stream->queue, stream->count);
+  stream->count = 0;
+  stream->writable_length = 0;
+  veil_emitter_emit(ctx, stream->object, "close", 0, NULL);
+}
+
+static void stream_free(zlib_stream_t* stream) {
+  codec_drop(&stream->codec);
+  free(stream->in.data);
+  free(stream->out.data);
+  free(stream->queue);
+  free(stream);
+}
+
+static void stream_work_cb(uv_work_t* work) {
+  zlib_stream_t* stream = work->data;
+
+  stream->step = codec_run(&stream->codec, stream->op, &stream->in, &stream->out,
+      stream->params.chunk_size, ZLIB_JOB_OUTPUT);
+}
+
+static void stream_after_work_cb(uv_work_t* work, int status) {
+  zlib_stream_t* stream = work->data;
+  JSContext* ctx;
+  JSValue object;
+  JSValue data;
+
+  // the VM is gone and has released the JS values
+  if (!stream->vm) {
+    stream->busy = false;
+    if (stream->orphaned) {
+      stream_free(stream);
+    }
+    return;
+  }
+
+  ctx = stream->vm->context;
+  object = stream->object;
+  veil_vm_remove_cleanup(&stream->cleanup);
+
+  // busy stays set until the job's results are handled, so that listeners
+  // that write only queue
+  if (stream->closed) {
+    stream->busy = false;
+    free(stream->out.data);
+    stream->out = (zlib_buf_t) { 0 };
+    JS_FreeValue(ctx, object);
+    return;
+  }
+
+  if (stream->out.size) {
+    data = take_buffer(ctx, &stream->out);
+    if (JS_IsException(data)) {
+      veil_vm_dump_exception(stream->vm);
+    } else {
+      veil_emitter_emit(ctx, object, "data", 1, (JSValueConst*) &data);
+      JS_FreeValue(ctx, data);
+    }
+  }
+
+  if (stream->step == ZLIB_STEP_ERROR && !stream->closed) {
+    emit_error(ctx, object, codec_error(ctx, &stream->codec));
+    stream_close(stream);
+  }
+
+  if (stream->closed) {
+    stream->busy = false;
+    JS_FreeValue(ctx, object);
+    return;
+  }
+
+  stream->more = stream->step == ZLIB_STEP_MORE;
+  if (!stream->more) {
+    stream_complete(stream, stream->taken);
+    stream->taken = 0;
+  }
+
+  // anything after the end of the compressed data is dropped
+  if (stream->step == ZLIB_STEP_END) {
+    stream->ended = true;
+    stream_complete(stream, stream->count);
+  }
+
+  // as in node, 'drain' waits for the whole queue rather than the mark
+  if (stream->need_drain && stream->writable_length == 0 && !stream->closed) {
+    stream->need_drain = false;
+    veil_emitter_emit(ctx, object, "drain", 0, NULL);
+  }
+
+  stream->busy = false;
+  stream_schedule(stream);
+  stream_maybe_close(stream);
+  JS_FreeValue(ctx, object);
+}
+
+static void stream_cleanup_cb(veil_cleanup_t* cleanup) {
+  zlib_stream_t* stream = container_of(cleanup, zlib_stream_t, cleanup);
+  JSContext* ctx = stream->vm->context;
+
+  // the job only touches native buffers and finishes without the VM, unless
+  // it has not started
+  uv_cancel((uv_req_t*) &stream->work);
+  release_chunks(JS_GetRuntime(ctx), stream->queue, stream->count);
+  stream->count = 0;
+  stream->vm = NULL;
+  JS_FreeValue(ctx, stream->object);
+}
+
+static void req_work_cb(uv_work_t* work) {
+  zlib_req_t* req = work->data;
+
+  req->step = codec_finish(&req->codec, &req->in, &req->out, &req->params);
+}
+
+static void req_after_work_cb(uv_work_t* work, int status) {
+  zlib_req_t* req = work->data;
+
+  // the VM is gone and has already released the JS values
+  if (req->vm) {
+    veil_vm_remove_cleanup(&req->cleanup);
+    req_settle(req->vm->context, req);
+    JS_FreeValue(req->vm->context, req->callback);
+    JS_FreeValue(req->vm->context, req->resolving_funcs[0]);
+    JS_FreeValue(req->vm->context, req->resolving_funcs[1]);
+  }
+
+  req_free(req);
+}
+
+static void req_settle(JSContext* ctx, zlib_req_t* req) {
+  JSValue args[2] = { JS_NULL, JS_UNDEFINED };
+  JSValue result;
+  bool failed;
+
+  if (req->step == ZLIB_STEP_END) {
+    args[1] = take_buffer(ctx, &req->out);
+    if (JS_IsException(args[1])) {
+      args[0] = JS_GetException(ctx);
+      args[1] = JS_UNDEFINED;
+    }
+  } else {
+    args[0] = codec_error(ctx, &req->codec);
+  }
+
+  failed = !JS_IsNull(args[0]);
+  if (JS_IsUndefined(req->callback)) {
+    result = JS_Call(ctx, req->resolving_funcs[failed ? 1 : 0], JS_UNDEFINED, 1, &args[failed ? 0 : 1]);
+  } else {
+    result = JS_Call(ctx, req->callback, JS_UNDEFINED, failed ? 1 : 2, args);
+  }
+
+  if (JS_IsException(result)) {
+    veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+  }
+
+  JS_FreeValue(ctx, result);
+  JS_FreeValue(ctx, args[0]);
+  JS_FreeValue(ctx, args[1]);
+}
+
+static void req_free(zlib_req_t* req) {
+  codec_drop(&req->codec);
+  free(req->in.data);
+  free(req->out.data);
+  free(req);
+}
+
+static void req_cleanup_cb(veil_cleanup_t* cleanup) {
+  zlib_req_t* req = container_of(cleanup, zlib_req_t, cleanup);
+
+  // A job a thread has taken only touches the native copy of its input and
+  // frees itself when done; one still queued need not run.
+  uv_cancel((uv_req_t*) &req->work);
+  JS_FreeValue(req->vm->context, req->callback);
+  JS_FreeValue(req->vm->context, req->resolving_funcs[0]);
+  JS_FreeValue(req->vm->context, req->resolving_funcs[1]);
+  req->vm = NULL;
+}
+
+// On failure the codec holds the error and must still be dropped.
+static bool codec_init(zlib_codec_t* codec, zlib_mode_t mode, const zlib_params_t* params) {
+  memset(codec, 0, sizeof(*codec));
+  codec->mode = mode;
+
+  switch (mode) {
+#ifdef VEIL_HAVE_ZLIB
+    case ZLIB_DEFLATE:
+    case ZLIB_GZIP:
+    case ZLIB_DEFLATE_RAW:
+    case ZLIB_INFLATE:
+    case ZLIB_GUNZIP:
+    case ZLIB_INFLATE_RAW:
+    case ZLIB_UNZIP: {
+      int window_bits = params->window_bits;
+      int ret;
+
+      // zlib picks the framing from the window bits
+      if (mode == ZLIB_GZIP || mode == ZLIB_GUNZIP) {
+        window_bits += 16;
+      } else if (mode == ZLIB_UNZIP) {
+        window_bits += 32;
+      } else if (mode == ZLIB_DEFLATE_RAW || mode == ZLIB_INFLATE_RAW) {
+        window_bits = -window_bits;
+      }
+
+      if (mode == ZLIB_DEFLATE || mode == ZLIB_GZIP || mode == ZLIB_DEFLATE_RAW) {
+        ret = deflateInit2(&codec->z, params->level, Z_DEFLATED, window_bits, params->mem_level, params->strategy);
+      } else {
+        ret = inflateInit2(&codec->z, window_bits);
+      }
+
+      if (ret != Z_OK) {
+        codec_fail(codec, "ERR_ZLIB_INITIALIZATION_FAILED", ret, "Initialization failed");
+        return false;
+      }
+      break;
+    }
+#endif
+#ifdef VEIL_HAVE_BROTLI
+    case ZLIB_BROTLI_COMPRESS:
+      codec->brotli_encoder = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+      CHECK_NOT_NULL(codec->brotli_encoder);
+      for (uint32_t n = 0; n < params->param_count; n++) {
+        if (!BrotliEncoderSetParameter(codec->brotli_encoder, params->param_keys[n], (uint32_t) params->param_values[n])) {
+          codec_fail(codec, "ERR_BROTLI_PARAM_SET_FAILED", -1, "Setting a brotli parameter failed");
+          return false;
+        }
+      }
+      break;
+    case ZLIB_BROTLI_DECOMPRESS:
+      codec->brotli_decoder = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+      CHECK_NOT_NULL(codec->brotli_decoder);
+      for (uint32_t n = 0; n < params->param_count; n++) {
+        if (!BrotliDecoderSetParameter(codec->brotli_decoder, params->param_keys[n], (uint32_t) params->param_values[n])) {
+          codec_fail(codec, "ERR_BROTLI_PARAM_SET_FAILED", -1, "Setting a brotli parameter failed");
+          return false;
+        }
+      }
+      break;
+#endif
+#ifdef VEIL_HAVE_ZSTD
+    case ZLIB_ZSTD_COMPRESS:
+      codec->zstd_compressor = ZSTD_createCCtx();
+      CHECK_NOT_NULL(codec->zstd_compressor);
+      if (params->has_level && ZSTD_isError(ZSTD_CCtx_setParameter(codec->zstd_compressor, ZSTD_c_compressionLevel, params->level))) {
+        codec_fail(codec, "ERR_ZSTD_PARAM_SET_FAILED", -1, "Setting the zstd compression level failed");
+        return false;
+      }
+      for (uint32_t n = 0; n < params->param_count; n++) {
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(codec->zstd_compressor, params->param_keys[n], params->param_values[n]))) {
+          codec_fail(codec, "ERR_ZSTD_PARAM_SET_FAILED", -1, "Setting a zstd parameter failed");
+          return false;
+        }
+      }
+      break;
+    case ZLIB_ZSTD_DECOMPRESS:
+      codec->zstd_decompressor = ZSTD_createDCtx();
+      CHECK_NOT_NULL(codec->zstd_decompressor);
+      for (uint32_t n = 0; n < params->param_count; n++) {
+        if (ZSTD_isError(ZSTD_DCtx_setParameter(codec->zstd_decompressor, params->param_keys[n], params->param_values[n]))) {
+          codec_fail(codec, "ERR_ZSTD_PARAM_SET_FAILED", -1, "Setting a zstd parameter failed");
+          return false;
+        }
+      }
+      break;
+#endif
+    default:
+      codec_fail(codec, "ERR_ZLIB_INITIALIZATION_FAILED", -1, "Codec not available");
+      return false;
+  }
+
+  codec->ready = true;
+
+  return true;
+}
+
+// Steps the codec until the operation is done with all of the input, the
+// stream ends, it fails, or output has passed limit (ZLIB_STEP_MORE). The
+// output grows by at least chunk_size at a time.
+static zlib_step_t codec_run(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out, size_t chunk_size, size_t limit) {
+  zlib_step_t step;
+  size_t in_offset;
+  size_t out_size;
+
+  for (;;) {
+    if (out->size > limit) {
+      return ZLIB_STEP_MORE;
+    }
+
+    if (out->size == out->capacity) {
+      out->capacity = out->capacity > chunk_size ? out->capacity * 2 : out->capacity + chunk_size;
+      out->data = realloc(out->data, out->capacity);
+      CHECK_NOT_NULL(out->data);
+    }
+
+    in_offset = in->offset;
+    out_size = out->size;
+    step = codec_step(codec, op, in, out);
+    if (step != ZLIB_STEP_MORE) {
+      return step;
+    }
+
+    // with room for output, every call moves something
+    if (in->offset == in_offset && out->size == out_size) {
+      codec_fail(codec, "Z_BUF_ERROR", -5, "The stream made no progress");
+      return ZLIB_STEP_ERROR;
+    }
+  }
+}
+
+static zlib_step_t codec_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out) {
+  switch (codec->mode) {
+#ifdef VEIL_HAVE_ZLIB
+    case ZLIB_DEFLATE:
+    case ZLIB_INFLATE:
+    case ZLIB_GZIP:
+    case ZLIB_GUNZIP:
+    case ZLIB_DEFLATE_RAW:
+    case ZLIB_INFLATE_RAW:
+    case ZLIB_UNZIP:
+      return zlib_step(codec, op, in, out);
+#endif
+#ifdef VEIL_HAVE_BROTLI
+    case ZLIB_BROTLI_COMPRESS:
+    case ZLIB_BROTLI_DECOMPRESS:
+      return brotli_step(codec, op, in, out);
+#endif
+#ifdef VEIL_HAVE_ZSTD
+    case ZLIB_ZSTD_COMPRESS:
+    case ZLIB_ZSTD_DECOMPRESS:
+      return zstd_step(codec, op, in, out);
+#endif
+    default:
+      codec_fail(codec, "ERR_ZLIB_INITIALIZATION_FAILED", -1, "Codec not available");
+      return ZLIB_STEP_ERROR;
+  }
+}
+
+// Runs a one-shot call: ZLIB_STEP_END, with the whole result in out, or
+// ZLIB_STEP_ERROR.
+static zlib_step_t codec_finish(zlib_codec_t* codec, zlib_buf_t* in, zlib_buf_t* out, const zlib_params_t* params) {
+  zlib_step_t step = codec_run(codec, ZLIB_OP_FINISH, in, out, params->chunk_size, params->max_output);
+
+  if (step == ZLIB_STEP_MORE) {
+    char message[sizeof(codec->message)];
+
+    snprintf(message, sizeof(message), "Cannot create a Buffer larger than %zu bytes", params->max_output);
+    codec_fail(codec, "ERR_BUFFER_TOO_LARGE", -1, message);
+    return ZLIB_STEP_ERROR;
+  }
+
+  // a decompressor that runs out of input first has already failed
+  return step;
+}
+
+static void codec_fail(zlib_codec_t* codec, const char* code, int errno_value, const char* message) {
+  codec->errno_value = errno_value;
+  snprintf(codec->code, sizeof(codec->code), "%s", code);
+  snprintf(codec->message, sizeof(codec->message), "%s", message);
+}
+
+static void codec_drop(zlib_codec_t* codec) {
+  switch (codec->mode) {
+#ifdef VEIL_HAVE_ZLIB
+    case ZLIB_DEFLATE:
+    case ZLIB_GZIP:
+    case ZLIB_DEFLATE_RAW:
+      if (codec->ready) {
+        deflateEnd(&codec->z);
+      }
+      break;
+    case ZLIB_INFLATE:
+    case ZLIB_GUNZIP:
+    case ZLIB_INFLATE_RAW:
+    case ZLIB_UNZIP:
+      if (codec->ready) {
+        inflateEnd(&codec->z);
+      }
+      break;
+#endif
+#ifdef VEIL_HAVE_BROTLI
+    case ZLIB_BROTLI_COMPRESS:
+      if (codec->brotli_encoder) {
+        BrotliEncoderDestroyInstance(codec->brotli_encoder);
+      }
+      break;
+    case ZLIB_BROTLI_DECOMPRESS:
+      if (codec->brotli_decoder) {
+        BrotliDecoderDestroyInstance(codec->brotli_decoder);
+      }
+      break;
+#endif
+#ifdef VEIL_HAVE_ZSTD
+    case ZLIB_ZSTD_COMPRESS:
+      ZSTD_freeCCtx(codec->zstd_compressor);
+      break;
+    case ZLIB_ZSTD_DECOMPRESS:
+      ZSTD_freeDCtx(codec->zstd_decompressor);
+      break;
+#endif
+    default:
+      break;
+  }
+
+  codec->ready = false;
+}
+
+// As node's: the message, with code and errno of the codec.
+static JSValue codec_error(JSContext* ctx, const zlib_codec_t* codec) {
+  JSValue error = JS_NewError(ctx);
+
+  JS_SetPropertyStr(ctx, error, "message", JS_NewString(ctx, codec->message));
+  JS_SetPropertyStr(ctx, error, "errno", JS_NewInt32(ctx, codec->errno_value));
+  JS_SetPropertyStr(ctx, error, "code", JS_NewString(ctx, codec->code));
+
+  return error;
+}
+
+#ifdef VEIL_HAVE_ZLIB
+static zlib_step_t zlib_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out) {
+  z_stream* z = &codec->z;
+  bool inflating = codec->mode == ZLIB_INFLATE || codec->mode == ZLIB_GUNZIP
+      || codec->mode == ZLIB_INFLATE_RAW || codec->mode == ZLIB_UNZIP;
+  size_t avail_in = in->size - in->offset;
+  size_t avail_out = out->capacity - out->size;
+  int ret;
+
+  z->next_in = in->data + in->offset;
+  z->avail_in = avail_in > UINT_MAX ? UINT_MAX : (uInt) avail_in;
+  z->next_out = out->data + out->size;
+  z->avail_out = avail_out > UINT_MAX ? UINT_MAX : (uInt) avail_out;
+
+  if (inflating) {
+    ret = inflate(z, op == ZLIB_OP_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+  } else {
+    ret = deflate(z, op == ZLIB_OP_FINISH ? Z_FINISH : op == ZLIB_OP_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+  }
+
+  in->offset = (size_t) (z->next_in - in->data);
+  out->size = (size_t) (z->next_out - out->data);
+
+  switch (ret) {
+    case Z_OK:
+    case Z_BUF_ERROR:
+      break;
+    case Z_STREAM_END:
+      // concatenated members, which gzip(1) writes and reads
+      if ((codec->mode == ZLIB_GUNZIP || codec->mode == ZLIB_UNZIP)
+          && in->offset < in->size && in->data[in->offset] == 0x1f) {
+        inflateReset(z);
+        return zlib_step(codec, op, in, out);
+      }
+      return ZLIB_STEP_END;
+    case Z_NEED_DICT:
+      codec_fail(codec, "Z_NEED_DICT", ret, "Missing dictionary");
+      return ZLIB_STEP_ERROR;
+    default:
+      codec_fail(codec, zlib_code(ret), ret, z->msg ? z->msg : "zlib error");
+      return ZLIB_STEP_ERROR;
+  }
+
+  if (z->avail_out == 0) {
+    return ZLIB_STEP_MORE;
+  }
+
+  if (in->offset == in->size) {
+    if (inflating && op == ZLIB_OP_FINISH) {
+      codec_fail(codec, "Z_BUF_ERROR", Z_BUF_ERROR, "unexpected end of file");
+      return ZLIB_STEP_ERROR;
+    }
+    if (op != ZLIB_OP_FINISH) {
+      return ZLIB_STEP_IDLE;
+    }
+  }
+
+  return ZLIB_STEP_MORE;
+}
+
+static const char* zlib_code(int ret) {
+  switch (ret) {
+    case Z_ERRNO:
+      return "Z_ERRNO";
+    case Z_STREAM_ERROR:
+      return "Z_STREAM_ERROR";
+    case Z_DATA_ERROR:
+      return "Z_DATA_ERROR";
+    case Z_MEM_ERROR:
+      return "Z_MEM_ERROR";
+    case Z_BUF_ERROR:
+      return "Z_BUF_ERROR";
+    case Z_VERSION_ERROR:
+      return "Z_VERSION_ERROR";
+    default:
+      return "Z_UNKNOWN_ERROR";
+  }
+}
+#endif
+
+#ifdef VEIL_HAVE_BROTLI
+static zlib_step_t brotli_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out) {
+  size_t avail_in = in->size - in->offset;
+  const uint8_t* next_in = in->data + in->offset;
+  size_t avail_out = out->capacity - out->size;
+  uint8_t* next_out = out->data + out->size;
+
+  if (codec->mode == ZLIB_BROTLI_COMPRESS) {
+    BrotliEncoderState* encoder = codec->brotli_encoder;
+    BrotliEncoderOperation operation = op == ZLIB_OP_FINISH ? BROTLI_OPERATION_FINISH
+        : op == ZLIB_OP_FLUSH ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_PROCESS;
+    BROTLI_BOOL ok = BrotliEncoderCompressStream(encoder, operation, &avail_in, &next_in, &avail_out, &next_out, NULL);
+
+    in->offset = (size_t) (next_in - in->data);
+    out->size = (size_t) (next_out - out->data);
+
+    if (!ok) {
+      codec_fail(codec, "ERR_BROTLI_COMPRESSION_FAILED", -1, "Compression failed");
+      return ZLIB_STEP_ERROR;
+    }
+    if (op == ZLIB_OP_FINISH && BrotliEncoderIsFinished(encoder)) {
+      return ZLIB_STEP_END;
+    }
+    if (avail_out == 0 || BrotliEncoderHasMoreOutput(encoder)) {
+      return ZLIB_STEP_MORE;
+    }
+    return avail_in == 0 && op != ZLIB_OP_FINISH ? ZLIB_STEP_IDLE : ZLIB_STEP_MORE;
+  } else {
+    BrotliDecoderState* decoder = codec->brotli_decoder;
+    BrotliDecoderResult result = BrotliDecoderDecompressStream(decoder, &avail_in, &next_in, &avail_out, &next_out, NULL);
+    BrotliDecoderErrorCode error;
+    char code[sizeof(codec->code)];
+
+    in->offset = (size_t) (next_in - in->data);
+    out->size = (size_t) (next_out - out->data);
+
+    switch (result) {
+      case BROTLI_DECODER_RESULT_SUCCESS:
+        return ZLIB_STEP_END;
+      case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+        return ZLIB_STEP_MORE;
+      case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+        if (op == ZLIB_OP_FINISH) {
+          codec_fail(codec, "ERR_BROTLI_DECOMPRESSION_FAILED", -5, "unexpected end of file");
+          return ZLIB_STEP_ERROR;
+        }
+        return ZLIB_STEP_IDLE;
+      default:
+        // node's codes, such as ERR__ERROR_FORMAT_PADDING_1
+        error = BrotliDecoderGetErrorCode(decoder);
+        snprintf(code, sizeof(code), "ERR_%s", BrotliDecoderErrorString(error));
+        codec_fail(codec, code, (int) error, "Decompression failed");
+        return ZLIB_STEP_ERROR;
+    }
+  }
+}
+#endif
+
+#ifdef VEIL_HAVE_ZSTD
+static zlib_step_t zstd_step(zlib_codec_t* codec, zlib_op_t op, zlib_buf_t* in, zlib_buf_t* out) {
+  ZSTD_inBuffer input = { in->data + in->offset, in->size - in->offset, 0 };
+  ZSTD_outBuffer output = { out->data + out->size, out->capacity - out->size, 0 };
+  size_t ret;
+
+  if (codec->mode == ZLIB_ZSTD_COMPRESS) {
+    ZSTD_EndDirective directive = op == ZLIB_OP_FINISH ? ZSTD_e_end : op == ZLIB_OP_FLUSH ? ZSTD_e_flush : ZSTD_e_continue;
+
+    ret = ZSTD_compressStream2(codec->zstd_compressor, &output, &input, directive);
+    in->offset += input.pos;
+    out->size += output.pos;
+
+    if (ZSTD_isError(ret)) {
+      codec_fail(codec, "ERR_ZSTD_COMPRESSION_FAILED", -1, ZSTD_getErrorName(ret));
+      return ZLIB_STEP_ERROR;
+    }
+    // 0 is what remains to flush
+    if (op != ZLIB_OP_PROCESS && ret == 0 && input.pos == input.size) {
+      return op == ZLIB_OP_FINISH ? ZLIB_STEP_END : ZLIB_STEP_IDLE;
+    }
+    if (op == ZLIB_OP_PROCESS && input.pos == input.size && output.pos < output.size) {
+      return ZLIB_STEP_IDLE;
+    }
+    return ZLIB_STEP_MORE;
+  }
+
+  ret = ZSTD_decompressStream(codec->zstd_decompressor, &output, &input);
+  in->offset += input.pos;
+  out->size += output.pos;
+
+  if (ZSTD_isError(ret)) {
+    codec_fail(codec, "ERR_ZSTD_DECOMPRESSION_FAILED", -1, ZSTD_getErrorName(ret));
+    return ZLIB_STEP_ERROR;
+  }
+  // frames can follow each other, so only the end of input ends the stream;
+  // a call that moves nothing starts no frame
+  if (input.pos || output.pos) {
+    codec->frame_done = ret == 0;
+  }
+  if (output.pos == output.size) {
+    return ZLIB_STEP_MORE;
+  }
+  if (input.pos == input.size) {
+    if (op != ZLIB_OP_FINISH) {
+      return ZLIB_STEP_IDLE;
+    }
+    if (codec->frame_done) {
+      return ZLIB_STEP_END;
+    }
+    codec_fail(codec, "ERR_ZSTD_DECOMPRESSION_FAILED", -5, "unexpected end of file");
+    return ZLIB_STEP_ERROR;
+  }
+  return ZLIB_STEP_MORE;
+}
+#endif
+
+static bool check_mode(JSContext* ctx, zlib_mode_t mode) {
+  const char* option;
+
+  switch (mode) {
+    case ZLIB_BROTLI_COMPRESS:
+    case ZLIB_BROTLI_DECOMPRESS:
+#ifdef VEIL_HAVE_BROTLI
+      return true;
+#else
+      option = "VEIL_WITH_BROTLI";
+      break;
+#endif
+    case ZLIB_ZSTD_COMPRESS:
+    case ZLIB_ZSTD_DECOMPRESS:
+#ifdef VEIL_HAVE_ZSTD
+      return true;
+#else
+      option = "VEIL_WITH_ZSTD";
+      break;
+#endif
+    default:
+#ifdef VEIL_HAVE_ZLIB
+      return true;
+#else
+      option = "VEIL_WITH_ZLIB";
+      break;
+#endif
+  }
+
+  JS_ThrowInternalError(ctx, "%s is not available: veil was built without %s", MODE_NAMES[mode], option);
+
+  return false;
+}
+
+// { level, windowBits, memLevel, strategy, chunkSize, maxOutputLength,
+// params }, where params maps brotli or zstd parameter ids to values.
+static bool parse_params(JSContext* ctx, JSValueConst options, zlib_mode_t mode, zlib_params_t* out) {
+  bool zstd = mode == ZLIB_ZSTD_COMPRESS || mode == ZLIB_ZSTD_DECOMPRESS;
+  JSPropertyEnum* props;
+  uint32_t count;
+  JSValue params;
+  int value;
+  bool found;
+  bool ok = true;
+
+  memset(out, 0, sizeof(*out));
+  out->level = ZLIB_DEFAULT_LEVEL;
+  out->window_bits = ZLIB_DEFAULT_WINDOW_BITS;
+  out->mem_level = ZLIB_DEFAULT_MEM_LEVEL;
+  out->chunk_size = ZLIB_DEFAULT_CHUNK;
+  out->max_output = ZLIB_DEFAULT_MAX_OUTPUT;
+
+  if (JS_IsUndefined(options) || JS_IsNull(options)) {
+    return true;
+  }
+
+  if (!JS_IsObject(options)) {
+    JS_ThrowTypeError(ctx, "options must be an object");
+    return false;
+  }
+
+  if (!get_int_option(ctx, options, "level", zstd ? -(1 << 17) : -1, zstd ? 22 : 9, &out->level, &out->has_level)
+      || !get_int_option(ctx, options, "windowBits", 8, 15, &out->window_bits, &found)
+      || !get_int_option(ctx, options, "memLevel", 1, 9, &out->mem_level, &found)
+      || !get_int_option(ctx, options, "strategy", 0, 4, &out->strategy, &found)) {
+    return false;
+  }
+
+  if (!get_int_option(ctx, options, "chunkSize", ZLIB_MIN_CHUNK, INT32_MAX, &value, &found)) {
+    return false;
+  }
+  if (found) {
+    out->chunk_size = (size_t) value;
+  }
+
+  if (!get_int_option(ctx, options, "maxOutputLength", 1, INT32_MAX, &value, &found)) {
+    return false;
+  }
+  if (found) {
+    out->max_output = (size_t) value;
+  }
+
+  params = JS_GetPropertyStr(ctx, options, "params");
+  if (!JS_IsObject(params)) {
+    JS_FreeValue(ctx, params);
+    return true;
+  }
+
+  if (JS_GetOwnPropertyNames(ctx, &props, &count, params, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+    JS_FreeValue(ctx, params);
+    return false;
+  }
+
+  if (count > ZLIB_MAX_PARAMS) {
+    JS_ThrowRangeError(ctx, "options.params has more than %d entries", ZLIB_MAX_PARAMS);
+    ok = false;
+  }
+
+  for (uint32_t n = 0; n < count && ok; n++) {
+    const char* key = JS_AtomToCString(ctx, props[n].atom);
+    JSValue item = JS_GetProperty(ctx, params, props[n].atom);
+
+    ok = key && JS_ToInt32(ctx, &out->param_values[n], item) == 0;
+    if (ok) {
+      out->param_keys[n] = atoi(key);
+      out->param_count++;
+    }
+    JS_FreeCString(ctx, key);
+    JS_FreeValue(ctx, item);
+  }
+
+  for (uint32_t n = 0; n < count; n++) {
+    JS_FreeAtom(ctx, props[n].atom);
+  }
+  js_free(ctx, props);
+  JS_FreeValue(ctx, params);
+
+  return ok;
+}
+
+static bool get_int_option(JSContext* ctx, JSValueConst options, const char* name, int min, int max, int* out, bool* found) {
+  JSValue value = JS_GetPropertyStr(ctx, options, name);
+  int32_t number;
+
+  *found = false;
+  if (JS_IsUndefined(value)) {
+    return true;
+  }
+
+  if (JS_ToInt32(ctx, &number, value) < 0) {
+    JS_FreeValue(ctx, value);
+    return false;
+  }
+  JS_FreeValue(ctx, value);
+
+  if (number < min || number > max) {
+    JS_ThrowRangeError(ctx, "options.%s must be between %d and %d", name, min, max);
+    return false;
+  }
+
+  *found = true;
+  *out = number;
+
+  return true;
+}
+
+// A string as UTF-8, or the bytes of an ArrayBuffer or typed array, which
+// are borrowed unless copy is set. Copies are freed with free().
+static bool get_input(JSContext* ctx, JSValueConst value, zlib_buf_t* out, bool copy) {
+  const char* str = NULL;
+  uint8_t* bytes;
+  size_t size;
+
+  if (JS_IsString(value)) {
+    str = JS_ToCStringLen(ctx, &size, value);
+    if (!str) {
+      return false;
+    }
+    bytes = (uint8_t*) str;
+  } else if (!veil_builtin_get_bytes(ctx, value, &bytes, &size)) {
+    return false;
+  }
+
+  if (copy) {
+    out->data = malloc(size ? size : 1);
+    CHECK_NOT_NULL(out->data);
+    memcpy(out->data, bytes, size);
+  } else {
+    out->data = bytes;
+  }
+  out->size = size;
+  out->offset = 0;
+  JS_FreeCString(ctx, str);
+
+  return true;
+}
+
+// Makes a Buffer of buf, which is left empty.
+static JSValue take_buffer(JSContext* ctx, zlib_buf_t* buf) {
+  uint8_t* data = buf->data;
+  JSValue result;
+
+  if (!data) {
+    data = malloc(1);
+    CHECK_NOT_NULL(data);
+  } else if (buf->capacity - buf->size > ZLIB_MIN_CHUNK) {
+    data = realloc(data, buf->size ? buf->size : 1);
+    CHECK_NOT_NULL(data);
+  }
+
+  result = veil_buffer_new(ctx, data, buf->size);
+  *buf = (zlib_buf_t) { 0 };
+
+  return result;
+}
+
+static void release_chunks(JSRuntime* rt, zlib_chunk_t* chunks, uint32_t count) {
+  for (uint32_t n = 0; n < count; n++) {
+    JS_FreeValueRT(rt, chunks[n].keep);
+    JS_FreeValueRT(rt, chunks[n].callback);
+    free(chunks[n].owned);
+  }
+}
+
+static void emit_error(JSContext* ctx, JSValueConst obj, JSValue error) {
+  // an unhandled 'error' must not pass silently
+  if (!veil_emitter_emit(ctx, obj, "error", 1, (JSValueConst*) &error)) {
+    JS_Throw(ctx, error);
+    veil_vm_dump_exception(JS_GetContextOpaque(ctx));
+    return;
+  }
+
+  JS_FreeValue(ctx, error);
+}
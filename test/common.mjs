@@ -0,0 +1,60 @@
+// ctest runs every test/test-*.mjs from this directory and goes by veil's exit
+// status: an uncaught exception or unhandled rejection fails the test. A test
+// with callbacks still to come calls done() from the last one, or the
+// watchdog fails it instead of letting an early exit pass.
+import { execSync } from 'child_process';
+import { existsSync, lstatSync, mkdirSync, readdirSync, rmdirSync, unlinkSync } from 'fs';
+
+const watchdog = setTimeout(() => {
+  throw new Error('test did not call done()');
+}, 30000);
+
+export function assert(value, message) {
+  if (!value) {
+    throw new Error(`assertion failed: ${message}`);
+  }
+}
+
+export function done() {
+  clearTimeout(watchdog);
+}
+
+export function run(main) {
+  main().then(done);
+}
+
+// Runs the veil under test, which ctest names in $VEIL, from cwd and returns
+// its stdout; a failed run throws with its stderr. POSIX shells only.
+export function veil(args, cwd = '.') {
+  const command = ['"$VEIL"', ...args.map((arg) => `'${arg}'`)].join(' ');
+
+  try {
+    return execSync(command, { cwd, encoding: 'utf8' });
+  } catch (error) {
+    throw new Error(`${command} failed in ${cwd}: ${error.stderr}`);
+  }
+}
+
+// an empty .tmp/<name>, for tests that write files
+export function tmpdir(name) {
+  const dir = `.tmp/${name}`;
+
+  if (existsSync(dir)) {
+    remove(dir);
+  }
+  mkdirSync(dir, { recursive: true });
+
+  return dir;
+}
+
+function remove(path) {
+  if (!lstatSync(path).isDirectory()) {
+    unlinkSync(path);
+    return;
+  }
+
+  for (const entry of readdirSync(path)) {
+    remove(`${path}/${entry}`);
+  }
+  rmdirSync(path);
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "veil_addon.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The addon test-addon.mjs loads, built as test/.tmp/addon.node. It only
+// includes veil_addon.h and reaches veil through the table it is given.
+
+static const veil_addon_api_t* api;
+static veil_addon_ref_t kept;
+
+static veil_addon_value_t add(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t argv[2];
+  veil_addon_value_t result;
+  size_t argc = 2;
+  double a;
+  double b;
+
+  api->get_cb_info(env, info, &argc, argv, NULL, NULL);
+  if (api->get_value_double(env, argv[0], &a) != VEIL_ADDON_OK || api->get_value_double(env, argv[1], &b) != VEIL_ADDON_OK) {
+    api->throw_type_error(env, "ERR_ADDON_ARG", "add expects two numbers");
+    return NULL;
+  }
+  api->create_double(env, a + b, &result);
+
+  return result;
+}
+
+static veil_addon_value_t greet(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t name;
+  veil_addon_value_t result;
+  size_t argc = 1;
+  size_t size;
+  char* text;
+
+  api->get_cb_info(env, info, &argc, &name, NULL, NULL);
+  if (api->get_value_string_utf8(env, name, NULL, 0, &size) != VEIL_ADDON_OK) {
+    api->throw_type_error(env, NULL, "greet expects a string");
+    return NULL;
+  }
+  text = malloc(size + 8);
+  memcpy(text, "hello, ", 7);
+  api->get_value_string_utf8(env, name, text + 7, size + 1, &size);
+  api->create_string_utf8(env, text, size + 7, &result);
+  free(text);
+
+  return result;
+}
+
+// calls fn(value) and returns what it returns; a throw passes through
+static veil_addon_value_t call(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t argv[2];
+  veil_addon_value_t result;
+  size_t argc = 2;
+
+  api->get_cb_info(env, info, &argc, argv, NULL, NULL);
+  if (api->call_function(env, argv[1], argv[0], 1, &argv[1], &result) != VEIL_ADDON_OK) {
+    return NULL;
+  }
+
+  return result;
+}
+
+// the sum of a buffer's bytes
+static veil_addon_value_t sum(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t bytes;
+  veil_addon_value_t result;
+  size_t argc = 1;
+  size_t size;
+  void* data;
+  uint32_t total = 0;
+
+  api->get_cb_info(env, info, &argc, &bytes, NULL, NULL);
+  if (api->get_buffer_info(env, bytes, &data, &size) != VEIL_ADDON_OK) {
+    api->throw_type_error(env, NULL, "sum expects bytes");
+    return NULL;
+  }
+  for (size_t n = 0; n < size; n++) {
+    total += ((uint8_t*) data)[n];
+  }
+  api->create_uint32(env, total, &result);
+
+  return result;
+}
+
+// a Buffer of n bytes counting up from 0
+static veil_addon_value_t count(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t arg;
+  veil_addon_value_t result;
+  size_t argc = 1;
+  uint32_t size;
+  void* data;
+
+  api->get_cb_info(env, info, &argc, &arg, NULL, NULL);
+  api->get_value_uint32(env, arg, &size);
+  api->create_buffer(env, size, &data, &result);
+  for (uint32_t n = 0; n < size; n++) {
+    ((uint8_t*) data)[n] = (uint8_t) n;
+  }
+
+  return result;
+}
+
+static void counter_free(veil_addon_env_t* env, void* data, void* hint) {
+  free(data);
+}
+
+// a counter object holding its count in native memory
+static veil_addon_value_t counter(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t result;
+  int64_t* value = calloc(1, sizeof(int64_t));
+
+  api->create_object(env, &result);
+  api->wrap(env, result, value, counter_free, NULL);
+
+  return result;
+}
+
+static veil_addon_value_t increment(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t object;
+  veil_addon_value_t result;
+  size_t argc = 1;
+  void* value;
+
+  api->get_cb_info(env, info, &argc, &object, NULL, NULL);
+  if (api->unwrap(env, object, &value) != VEIL_ADDON_OK) {
+    api->throw_error(env, "ERR_ADDON_UNWRAP", "not a counter");
+    return NULL;
+  }
+  api->create_bigint_int64(env, ++*(int64_t*) value, &result);
+
+  return result;
+}
+
+// keep(value) holds value past the call; kept() returns it
+static veil_addon_value_t keep(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t value;
+  size_t argc = 1;
+
+  api->get_cb_info(env, info, &argc, &value, NULL, NULL);
+  if (kept) {
+    api->delete_reference(env, kept);
+  }
+  api->create_reference(env, value, &kept);
+
+  return NULL;
+}
+
+static veil_addon_value_t get_kept(veil_addon_env_t* env, veil_addon_callback_info_t* info) {
+  veil_addon_value_t result;
+
+  api->get_reference_value(env, kept, &result);
+
+  return result;
+}
+
+static veil_addon_value_t init(const veil_addon_api_t* table, veil_addon_env_t* env, veil_addon_value_t exports) {
+  static const struct {
+    const char* name;
+    veil_addon_callback_t cb;
+  } FUNCTIONS[] = {
+    { "add", add },
+    { "greet", greet },
+    { "call", call },
+    { "sum", sum },
+    { "count", count },
+    { "counter", counter },
+    { "increment", increment },
+    { "keep", keep },
+    { "kept", get_kept },
+  };
+  veil_addon_value_t fn;
+
+  api = table;
+  for (size_t n = 0; n < sizeof(FUNCTIONS) / sizeof(FUNCTIONS[0]); n++) {
+    api->create_function(env, FUNCTIONS[n].name, FUNCTIONS[n].cb, NULL, &fn);
+    api->set_named_property(env, exports, FUNCTIONS[n].name, fn);
+  }
+  api->create_uint32(env, api->version, &fn);
+  api->set_named_property(env, exports, "abiVersion", fn);
+
+  return exports;
+}
+
+VEIL_ADDON_MODULE(init)
@@ -0,0 +1,5 @@
+import { leaf, sum } from './prefetch-leaf.mjs';
+export * from './prefetch-leaf.mjs';
+
+export const branch = `${leaf} of branch`;
+export const total = sum(1, 2, 3);
@@ -0,0 +1,6 @@
+// compiled on the threadpool, under the importing test's allocator and limits
+export const leaf = 'leaf';
+
+export function sum(...values) {
+  return values.reduce((total, value) => total + value, 0);
+}
@@ -0,0 +1,30 @@
+// keeps threadpool reads, zlib work and timers in flight until terminated
+import { readFile } from 'fs';
+import { gzip } from 'zlib';
+import { parentPort } from 'worker_threads';
+
+const input = new Uint8Array(64 * 1024).fill(42);
+
+function read() {
+  readFile('fixtures/worker-busy.mjs', read);
+}
+
+function compress() {
+  gzip(input, compress);
+}
+
+function tick() {
+  setTimeout(tick, 1);
+}
+
+for (let i = 0; i < 8; i++) {
+  read();
+  tick();
+  try {
+    compress();
+  } catch (e) {
+    // built without zlib
+  }
+}
+
+parentPort.postMessage('busy');
@@ -0,0 +1,13 @@
+// adds one to every byte it is sent and moves the buffer back
+import { parentPort } from 'worker_threads';
+
+parentPort.on('message', ({ buffer, shared }) => {
+  const bytes = new Uint8Array(buffer);
+
+  for (let i = 0; i < bytes.length; i++) {
+    bytes[i]++;
+  }
+
+  Atomics.store(new Int32Array(shared), 0, bytes.length);
+  parentPort.postMessage({ buffer }, [buffer]);
+});
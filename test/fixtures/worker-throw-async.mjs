@@ -0,0 +1,5 @@
+// throws from a timer while an interval would keep the loop alive for good
+setInterval(() => {}, 1000);
+setTimeout(() => {
+  throw new RangeError('thrown from a timer');
+}, 1);
@@ -0,0 +1 @@
+throw new TypeError('thrown in a worker');
@@ -0,0 +1,8 @@
+// blocks in Atomics.wait() until notified, then again with no timeout
+import { parentPort, workerData } from 'worker_threads';
+
+const state = new Int32Array(workerData);
+
+parentPort.postMessage('waiting');
+parentPort.postMessage(Atomics.wait(state, 0, 0));
+Atomics.wait(state, 0, 0);
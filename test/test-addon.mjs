@@ -0,0 +1,60 @@
+// fixtures/addon.c, which the build puts at .tmp/addon.node: its exports
+// arrive as named and default exports, values cross the ABI both ways,
+// exceptions pass through in both directions, and a file that is not an
+// addon is refused with an error rather than a crash
+import addon, { abiVersion, add, call, count, counter, greet, increment, keep, kept, sum } from './.tmp/addon.node';
+import { writeFileSync } from 'fs';
+import { assert, run, tmpdir } from './common.mjs';
+
+function throws(fn, check) {
+  try {
+    fn();
+  } catch (error) {
+    return check(error);
+  }
+
+  return false;
+}
+
+run(async () => {
+  assert(addon.add === add, 'default export is the exports object');
+  assert(abiVersion >= 1, 'the table names its version');
+
+  assert(add(2, 0.5) === 2.5, 'numbers');
+  assert(throws(() => add('2', 1), (error) => error instanceof TypeError && error.code === 'ERR_ADDON_ARG'), 'thrown with a code');
+  assert(greet('wörld') === 'hello, wörld', 'utf8 strings');
+
+  assert(call((x) => x * 2, 21) === 42, 'calling back into JS');
+  assert(throws(() => call(() => {
+    throw new RangeError('from js');
+  }, 0), (error) => error instanceof RangeError && error.message === 'from js'), 'a JS throw passes through');
+
+  const bytes = count(300);
+
+  assert(Buffer.isBuffer(bytes) && bytes.length === 300 && bytes[299] === 43, 'created buffer');
+  assert(sum(bytes) === bytes.reduce((total, byte) => total + byte, 0), 'borrowed buffer');
+  assert(sum(new Uint8Array([1, 2, 3]).buffer) === 6, 'ArrayBuffer');
+
+  const a = counter();
+  const b = counter();
+
+  increment(a);
+  assert(increment(a) === 2n && increment(b) === 1n, 'wrapped native state');
+  assert(throws(() => increment({}), (error) => error.code === 'ERR_ADDON_UNWRAP'), 'unwrap of a plain object');
+
+  const value = { marker: 1 };
+
+  keep(value);
+  await new Promise((resolve) => setTimeout(resolve, 10));
+  assert(kept() === value, 'a reference outlives the call');
+
+  const dir = tmpdir('addon');
+
+  writeFileSync(`${dir}/bad.node`, 'not a shared library');
+  try {
+    await import(`./${dir}/bad.node`);
+    assert(false, 'a bad addon loads');
+  } catch (error) {
+    assert(String(error.message).includes('cannot load'), `bad addon: ${error.message}`);
+  }
+});
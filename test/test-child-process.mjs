@@ -0,0 +1,89 @@
+// ctest runs this only where there are /bin/sh and sleep. Children are forked
+// on the spawner thread: pid is known from 'spawn', a kill before then still
+// lands, and the pipes carry data both ways
+import { exec, execFile, execSync, spawn, spawnSync } from 'child_process';
+import { assert, run } from './common.mjs';
+
+function events(child) {
+  let stdout = '';
+
+  child.stdout.setEncoding('utf8');
+  child.stdout.on('data', (data) => { stdout += data; });
+
+  return new Promise((resolve) => {
+    child.on('close', (code, signal) => resolve({ stdout, code, signal }));
+  });
+}
+
+async function spawned() {
+  const child = spawn('/bin/sh', ['-c', 'cat; exit 3']);
+  let pid;
+
+  child.on('spawn', () => { pid = child.pid; });
+  const closed = events(child);
+
+  child.stdin.write('hello ');
+  child.stdin.end('world');
+
+  const { stdout, code, signal } = await closed;
+  assert(pid > 0, `pid at 'spawn' ${pid}`);
+  assert(stdout === 'hello world', `stdout ${JSON.stringify(stdout)}`);
+  assert(code === 3 && signal === null, `exit ${code} ${signal}`);
+}
+
+async function killedBeforeSpawn() {
+  const child = spawn('sleep', ['10']);
+
+  assert(child.kill('SIGKILL'), 'kill() before spawn');
+  const { code, signal } = await events(child);
+  assert(code === null && signal === 'SIGKILL', `exit ${code} ${signal}`);
+}
+
+async function piped() {
+  const source = spawn('/bin/sh', ['-c', 'echo one; echo two']);
+  const sink = spawn('/bin/sh', ['-c', 'wc -l'], { stdio: [source.stdout, 'pipe', 'pipe'] });
+
+  const { stdout, code } = await events(sink);
+  assert(stdout.trim() === '2', `lines ${JSON.stringify(stdout)}`);
+  assert(code === 0, `exit ${code}`);
+}
+
+async function failed() {
+  const child = spawn('/nonexistent/veil-test');
+  const error = await new Promise((resolve) => child.on('error', resolve));
+
+  assert(error.code === 'ENOENT', `error ${error.code}`);
+  await new Promise((resolve) => child.on('close', resolve));
+}
+
+async function collected() {
+  const { stdout } = await exec('echo out; echo err >&2');
+  assert(stdout === 'out\n', `exec ${JSON.stringify(stdout)}`);
+
+  const result = await new Promise((resolve) => {
+    execFile('/bin/sh', ['-c', 'exit 5'], (error) => resolve(error));
+  });
+  assert(result && result.code === 5, `execFile ${result && result.code}`);
+
+  const timed = await new Promise((resolve) => {
+    execFile('sleep', ['10'], { timeout: 100 }, (error) => resolve(error));
+  });
+  assert(timed && timed.killed && timed.signal === 'SIGTERM', `timeout ${timed && timed.signal}`);
+}
+
+function synchronous() {
+  const out = execSync('cat', { input: 'sync', encoding: 'utf8' });
+  assert(out === 'sync', `execSync ${JSON.stringify(out)}`);
+
+  const result = spawnSync('/bin/sh', ['-c', 'exit 7']);
+  assert(result.pid > 0 && result.status === 7, `spawnSync ${result.pid} ${result.status}`);
+}
+
+run(async () => {
+  await spawned();
+  await killedBeforeSpawn();
+  await piped();
+  await failed();
+  await collected();
+  synchronous();
+});
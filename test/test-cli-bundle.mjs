@@ -0,0 +1,34 @@
+// --build-bundle writes the modules the script used and its assets to one
+// file, which runs on its own once the sources are gone
+import { existsSync, mkdirSync, readFileSync, unlinkSync, writeFileSync } from 'fs';
+import { assert, done, tmpdir, veil } from './common.mjs';
+
+const dir = tmpdir('cli-bundle');
+
+function result() {
+  return readFileSync(`${dir}/out.txt`, 'utf8');
+}
+
+mkdirSync(`${dir}/lib`);
+writeFileSync(`${dir}/lib/dep.mjs`, "export const value = 'from the bundle';\n");
+writeFileSync(`${dir}/data.txt`, 'and its asset');
+writeFileSync(`${dir}/main.mjs`, [
+  "import { writeFileSync } from 'fs';",
+  "import { getAsset, isSea } from 'sea';",
+  "import { value } from './lib/dep.mjs';",
+  "writeFileSync('out.txt', isSea() ? `${value} ${getAsset('data.txt', 'utf8')}` : value);",
+  '',
+].join('\n'));
+
+veil(['--build-bundle=app.bundle', '--bundle-asset=data.txt', 'main.mjs'], dir);
+assert(existsSync(`${dir}/app.bundle`), 'bundle written');
+assert(result() === 'from the bundle', `building run ${result()}`);
+
+for (const file of ['main.mjs', 'lib/dep.mjs', 'data.txt', 'out.txt']) {
+  unlinkSync(`${dir}/${file}`);
+}
+
+veil(['app.bundle'], dir);
+assert(result() === 'from the bundle and its asset', `bundled run ${result()}`);
+
+done();
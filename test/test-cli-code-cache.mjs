@@ -0,0 +1,43 @@
+// --code-cache-dir stores the bytecode of every module loaded, a second run
+// loads it, and an edited or damaged entry falls back to the source
+import { readFileSync, readdirSync, writeFileSync } from 'fs';
+import { assert, done, tmpdir, veil } from './common.mjs';
+
+const dir = tmpdir('cli-code-cache');
+const args = ['--code-cache-dir=cache', 'main.mjs'];
+
+function dependency(value) {
+  writeFileSync(`${dir}/dep.mjs`, `export const value = ${JSON.stringify(value)};\n`);
+}
+
+function result() {
+  return readFileSync(`${dir}/out.txt`, 'utf8');
+}
+
+writeFileSync(`${dir}/main.mjs`, [
+  "import { writeFileSync } from 'fs';",
+  "import { value } from './dep.mjs';",
+  "writeFileSync('out.txt', value);",
+  '',
+].join('\n'));
+dependency('first');
+
+veil(args, dir);
+assert(result() === 'first', `first run ${result()}`);
+const entries = readdirSync(`${dir}/cache`);
+assert(entries.length > 0 && entries.every((entry) => entry.endsWith('.jsc')), `entries ${entries}`);
+
+veil(args, dir);
+assert(result() === 'first', `cached run ${result()}`);
+
+dependency('second, and longer');
+veil(args, dir);
+assert(result() === 'second, and longer', `edited run ${result()}`);
+
+for (const entry of readdirSync(`${dir}/cache`)) {
+  writeFileSync(`${dir}/cache/${entry}`, 'damaged');
+}
+veil(args, dir);
+assert(result() === 'second, and longer', `damaged run ${result()}`);
+
+done();
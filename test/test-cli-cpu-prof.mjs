@@ -0,0 +1,48 @@
+// --cpu-prof writes a .cpuprofile on exit whose samples find the function
+// the script spent its time in
+import { mkdirSync, readFileSync, readdirSync, writeFileSync } from 'fs';
+import { assert, done, tmpdir, veil } from './common.mjs';
+
+const dir = tmpdir('cli-cpu-prof');
+
+mkdirSync(`${dir}/prof`);
+writeFileSync(`${dir}/main.mjs`, [
+  'function spinForProfile(ms) {',
+  '  const end = Date.now() + ms;',
+  '  let n = 0;',
+  '  while (Date.now() < end) n++;',
+  '  return n;',
+  '}',
+  'spinForProfile(300);',
+  '',
+].join('\n'));
+
+veil(['--cpu-prof', '--cpu-prof-dir=prof', '--cpu-prof-interval=500', 'main.mjs'], dir);
+
+const files = readdirSync(`${dir}/prof`).filter((name) => name.endsWith('.cpuprofile'));
+assert(files.length === 1, `profiles ${files}`);
+
+const profile = JSON.parse(readFileSync(`${dir}/prof/${files[0]}`, 'utf8'));
+const nodes = new Map(profile.nodes.map((node) => [node.id, node]));
+const spin = profile.nodes.find((node) => node.callFrame.functionName === 'spinForProfile');
+
+// spinForProfile and whatever it calls, such as Date.now
+function under(root) {
+  const ids = new Set([root.id]);
+
+  for (const id of ids) {
+    nodes.get(id).children.forEach((child) => ids.add(child));
+  }
+
+  return ids;
+}
+
+assert(profile.endTime > profile.startTime, `times ${profile.startTime} ${profile.endTime}`);
+assert(profile.samples.length === profile.timeDeltas.length, 'a delta per sample');
+assert(profile.samples.every((id) => nodes.has(id)), 'samples name nodes');
+assert(spin, 'spinForProfile is in the profile');
+
+const spinning = under(spin);
+assert(profile.samples.filter((id) => spinning.has(id)).length >= 10, 'spinForProfile was sampled');
+
+done();
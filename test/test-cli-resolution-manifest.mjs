@@ -0,0 +1,39 @@
+// --resolution-manifest persists resolutions, a later run replays them, and
+// one whose package.json has changed since is resolved afresh
+import { mkdirSync, readFileSync, writeFileSync } from 'fs';
+import { assert, done, tmpdir, veil } from './common.mjs';
+
+const dir = tmpdir('cli-resolution-manifest');
+const args = ['--resolution-manifest=manifest.bin', 'main.mjs'];
+
+function exports(target) {
+  writeFileSync(`${dir}/node_modules/pkg/package.json`, JSON.stringify({ name: 'pkg', exports: target }));
+}
+
+function result() {
+  return readFileSync(`${dir}/out.txt`, 'utf8');
+}
+
+mkdirSync(`${dir}/node_modules/pkg`, { recursive: true });
+writeFileSync(`${dir}/node_modules/pkg/a.mjs`, "export default 'a';\n");
+writeFileSync(`${dir}/node_modules/pkg/second.mjs`, "export default 'second';\n");
+writeFileSync(`${dir}/main.mjs`, [
+  "import { writeFileSync } from 'fs';",
+  "import value from 'pkg';",
+  'writeFileSync(\'out.txt\', value);',
+  '',
+].join('\n'));
+exports('./a.mjs');
+
+veil(args, dir);
+assert(result() === 'a', `first run ${result()}`);
+assert(readFileSync(`${dir}/manifest.bin`, 'utf8').startsWith('VEILRES1'), 'manifest written');
+
+veil(args, dir);
+assert(result() === 'a', `replayed run ${result()}`);
+
+exports('./second.mjs');
+veil(args, dir);
+assert(result() === 'second', `changed package run ${result()}`);
+
+done();
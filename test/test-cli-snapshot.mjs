@@ -0,0 +1,32 @@
+// --build-snapshot writes the preload graph to the blob, and a run with only
+// --snapshot-blob restores it in place of the preloads, even once their
+// sources are gone; the entry script still runs from source
+import { existsSync, readFileSync, unlinkSync, writeFileSync } from 'fs';
+import { assert, done, tmpdir, veil } from './common.mjs';
+
+const dir = tmpdir('cli-snapshot');
+
+writeFileSync(`${dir}/helper.mjs`, "export const greeting = 'from the snapshot';\n");
+writeFileSync(`${dir}/preload.mjs`, [
+  "import { greeting } from './helper.mjs';",
+  'globalThis.preloaded = greeting;',
+  '',
+].join('\n'));
+writeFileSync(`${dir}/main.mjs`, [
+  "import { writeFileSync } from 'fs';",
+  "writeFileSync('out.txt', String(globalThis.preloaded));",
+  '',
+].join('\n'));
+
+veil(['--build-snapshot', '--snapshot-blob=snap.blob', '--import=./preload.mjs', 'main.mjs'], dir);
+assert(existsSync(`${dir}/snap.blob`), 'blob written');
+assert(readFileSync(`${dir}/out.txt`, 'utf8') === 'from the snapshot', 'building run');
+
+unlinkSync(`${dir}/preload.mjs`);
+unlinkSync(`${dir}/helper.mjs`);
+unlinkSync(`${dir}/out.txt`);
+
+veil(['--snapshot-blob=snap.blob', 'main.mjs'], dir);
+assert(readFileSync(`${dir}/out.txt`, 'utf8') === 'from the snapshot', 'restored run');
+
+done();
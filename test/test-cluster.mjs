@@ -0,0 +1,49 @@
+// flags: --workers=2
+// both workers listen on one port, which only SO_REUSEPORT allows, and
+// connections to it are accepted; which worker takes each is up to the
+// kernel's hash, so that is not checked
+import { isWorker, worker } from 'cluster';
+import { connect, createServer } from 'net';
+import { assert, run } from './common.mjs';
+
+const PORT = 47321;
+const CONNECTIONS = 16;
+// long enough for the other worker to bind while this one listens
+const OVERLAP_MS = 1000;
+
+function delay(ms) {
+  return new Promise((resolve) => setTimeout(resolve, ms));
+}
+
+function listen(server) {
+  return new Promise((resolve, reject) => {
+    server.on('error', reject);
+    server.listen({ port: PORT, host: '127.0.0.1' }, resolve);
+  });
+}
+
+function open() {
+  return new Promise((resolve, reject) => {
+    const socket = connect(PORT, '127.0.0.1');
+
+    socket.on('error', reject);
+    socket.on('connect', () => {
+      socket.destroy();
+      resolve();
+    });
+  });
+}
+
+run(async () => {
+  const server = createServer((socket) => socket.destroy());
+
+  assert(isWorker && worker.id >= 1 && worker.id <= 2, `worker ${worker && worker.id}`);
+
+  await listen(server);
+  await delay(OVERLAP_MS / 2);
+  for (let n = 0; n < CONNECTIONS; n++) {
+    await open();
+  }
+  await delay(OVERLAP_MS / 2);
+  server.close();
+});
@@ -0,0 +1,191 @@
+// the native codecs against plain JS versions of the same encodings, at
+// sizes on both sides of the vector kernels' block widths, plus the edges:
+// invalid and split UTF-8, lone surrogates, forgiving base64 and the Buffer
+// species
+import { assert, done } from './common.mjs';
+
+const ALPHABET = 'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/';
+const SIZES = [0, 1, 2, 3, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 95, 96, 97, 1000, 4099];
+
+function bytesOf(size, seed) {
+  const bytes = new Uint8Array(size);
+
+  for (let n = 0; n < size; n++) {
+    bytes[n] = (n * 131 + seed * 17 + (n >> 3)) & 0xff;
+  }
+
+  return bytes;
+}
+
+function sameBytes(a, b) {
+  if (a.length !== b.length) {
+    return false;
+  }
+  for (let n = 0; n < a.length; n++) {
+    if (a[n] !== b[n]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+function hexOf(bytes) {
+  let text = '';
+
+  for (const byte of bytes) {
+    text += byte.toString(16).padStart(2, '0');
+  }
+
+  return text;
+}
+
+function base64Of(bytes) {
+  let text = '';
+  let n = 0;
+
+  for (; n + 2 < bytes.length; n += 3) {
+    const v = (bytes[n] << 16) | (bytes[n + 1] << 8) | bytes[n + 2];
+
+    text += ALPHABET[v >> 18] + ALPHABET[(v >> 12) & 63] + ALPHABET[(v >> 6) & 63] + ALPHABET[v & 63];
+  }
+  if (n + 1 === bytes.length) {
+    const v = bytes[n] << 16;
+
+    text += ALPHABET[v >> 18] + ALPHABET[(v >> 12) & 63] + '==';
+  } else if (n + 2 === bytes.length) {
+    const v = (bytes[n] << 16) | (bytes[n + 1] << 8);
+
+    text += ALPHABET[v >> 18] + ALPHABET[(v >> 12) & 63] + ALPHABET[(v >> 6) & 63] + '=';
+  }
+
+  return text;
+}
+
+function latin1Of(bytes) {
+  let text = '';
+
+  for (const byte of bytes) {
+    text += String.fromCharCode(byte);
+  }
+
+  return text;
+}
+
+function throwsNamed(fn, name) {
+  try {
+    fn();
+  } catch (error) {
+    return error.name === name;
+  }
+
+  return false;
+}
+
+function binary() {
+  for (const size of SIZES) {
+    const bytes = bytesOf(size, size);
+    const buffer = Buffer.from(bytes);
+    const hex = hexOf(bytes);
+    const base64 = base64Of(bytes);
+    const base64url = base64.replace(/\+/g, '-').replace(/\//g, '_').replace(/=+$/, '');
+
+    assert(buffer.toString('hex') === hex, `hex of ${size}`);
+    assert(buffer.toString('base64') === base64, `base64 of ${size}`);
+    assert(buffer.toString('base64url') === base64url, `base64url of ${size}`);
+    assert(buffer.toString('latin1') === latin1Of(bytes), `latin1 of ${size}`);
+    assert(sameBytes(Buffer.from(hex, 'hex'), bytes), `from hex at ${size}`);
+    assert(sameBytes(Buffer.from(base64, 'base64'), bytes), `from base64 at ${size}`);
+    assert(sameBytes(Buffer.from(base64url, 'base64url'), bytes), `from base64url at ${size}`);
+    assert(btoa(latin1Of(bytes)) === base64, `btoa of ${size}`);
+    assert(atob(base64) === latin1Of(bytes), `atob of ${size}`);
+    assert(Buffer.byteLength(base64, 'base64') === size, `byteLength of ${size}`);
+  }
+}
+
+function utf8() {
+  const encoder = new TextEncoder();
+  const decoder = new TextDecoder();
+  const fatal = new TextDecoder('utf-8', { fatal: true });
+  const sample = Array.from('ascii é€ 𝄞 ');
+
+  for (const size of SIZES) {
+    const text = Array.from({ length: size }, (_, n) => sample[n % sample.length]).join('');
+    const encoded = encoder.encode(text);
+    const expected = unescape(encodeURIComponent(text));
+
+    assert(latin1Of(encoded) === expected, `encode at ${size}`);
+    assert(decoder.decode(encoded) === text, `decode at ${size}`);
+    assert(Buffer.from(text).toString() === text, `Buffer utf8 at ${size}`);
+
+    // one bad byte after a run of valid ones has to be caught wherever the
+    // vector loop hands over to the scalar one
+    const bad = new Uint8Array(encoded.length + 1);
+
+    bad.set(encoded);
+    bad[encoded.length] = 0xff;
+    assert(decoder.decode(bad) === text + '\ufffd', `replacement at ${size}`);
+    assert(throwsNamed(() => fatal.decode(bad), 'TypeError'), `fatal at ${size}`);
+  }
+
+  // a truncated sequence is one replacement, then decoding resumes
+  assert(decoder.decode(new Uint8Array([0x61, 0xe2, 0x82, 0x62])) === 'a\ufffdb', 'truncated sequence');
+  assert(decoder.decode(new Uint8Array([0xed, 0xa0, 0x80])) === '\ufffd\ufffd\ufffd', 'encoded surrogate');
+  assert(decoder.decode(new Uint8Array([0xef, 0xbb, 0xbf, 0x61])) === 'a', 'BOM is dropped');
+  assert(new TextDecoder('utf-8', { ignoreBOM: true }).decode(new Uint8Array([0xef, 0xbb, 0xbf])) === '\ufeff', 'ignoreBOM');
+
+  // a character split across stream decodes comes out whole
+  const streaming = new TextDecoder();
+  const clef = encoder.encode('\ud834\udd1e');
+  let joined = '';
+
+  for (const byte of clef) {
+    joined += streaming.decode(new Uint8Array([byte]), { stream: true });
+  }
+  joined += streaming.decode();
+  assert(joined === '\ud834\udd1e', 'streamed character');
+
+  // lone surrogates encode as U+FFFD
+  assert(sameBytes(encoder.encode('\ud800'), new Uint8Array([0xef, 0xbf, 0xbd])), 'lone surrogate');
+
+  const target = new Uint8Array(5);
+  const { read, written } = encoder.encodeInto('ab€c', target);
+
+  assert(read === 3 && written === 5, 'encodeInto fills what fits');
+  assert(sameBytes(target, new Uint8Array([0x61, 0x62, 0xe2, 0x82, 0xac])), 'encodeInto bytes');
+}
+
+function forgiving() {
+  assert(atob(' YW Jj\nZA = = ') === 'abcd', 'whitespace is skipped');
+  assert(atob('YWJjZA') === 'abcd', 'padding is optional');
+  assert(throwsNamed(() => atob('YWJjZ'), 'InvalidCharacterError'), 'lone trailing character');
+  assert(throwsNamed(() => atob('YW=Jj'), 'InvalidCharacterError'), 'misplaced padding');
+  assert(throwsNamed(() => atob('YWJj*A=='), 'InvalidCharacterError'), 'bad character');
+  assert(throwsNamed(() => btoa('€'), 'InvalidCharacterError'), 'past latin1');
+  assert(btoa('ÿ') === '/w==', 'latin1 byte');
+
+  // Buffer.from is lenient: it skips what it does not recognise and stops at
+  // the first '='
+  assert(Buffer.from('YWJj*ZA==YWJj', 'base64').toString() === 'abcd', 'lenient base64');
+}
+
+function buffers() {
+  const buffer = Buffer.from('hello, world');
+
+  assert(Buffer.isBuffer(buffer) && buffer instanceof Uint8Array, 'Buffer is a Uint8Array');
+  assert(Buffer.isBuffer(buffer.subarray(1)), 'subarray is a Buffer');
+  assert(buffer.slice(7).toString() === 'world', 'slice');
+  assert(buffer.indexOf('world') === 7 && buffer.includes(','), 'search');
+  assert(Buffer.concat([Buffer.from('ab'), Buffer.from('cd')]).toString() === 'abcd', 'concat');
+  assert(Buffer.compare(Buffer.from('a'), Buffer.from('b')) === -1, 'compare');
+  assert(Buffer.from('abc').equals(Buffer.from([0x61, 0x62, 0x63])), 'equals');
+  assert(Buffer.alloc(4, 'ab').toString() === 'abab', 'fill');
+  assert(Buffer.from('hi', 'utf16le').toString('hex') === '68006900', 'utf16le');
+  assert(Buffer.isEncoding('UTF-8') && !Buffer.isEncoding('nope'), 'isEncoding');
+}
+
+binary();
+utf8();
+forgiving();
+buffers();
+done();
@@ -0,0 +1,86 @@
+// readFile comes back whole, as bytes or text, from all three flavours;
+// reads land in the caller's buffer at the offset and position asked for;
+// and failures are node-style errors
+import {
+  closeSync, existsSync, mkdirSync, openSync, readFile, readFileSync, readSync, readdirSync, renameSync,
+  rmdirSync, statSync, unlinkSync, writeFileSync,
+} from 'fs';
+import { open, readFile as readFilePromise, stat } from 'fs/promises';
+import { assert, run, tmpdir } from './common.mjs';
+
+// large enough to be read in one go only because fstat() sized the buffer
+const SIZE = 3 * 1024 * 1024 + 17;
+
+function pattern(size) {
+  const bytes = new Uint8Array(size);
+
+  for (let n = 0; n < size; n++) {
+    bytes[n] = (n * 31 + 7) & 0xff;
+  }
+
+  return bytes;
+}
+
+function same(actual, expected) {
+  if (!(actual instanceof Uint8Array) || actual.length !== expected.length) {
+    return false;
+  }
+
+  for (let n = 0; n < expected.length; n++) {
+    if (actual[n] !== expected[n]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+run(async () => {
+  const dir = tmpdir('fs');
+  const file = `${dir}/data.bin`;
+  const bytes = pattern(SIZE);
+
+  writeFileSync(file, bytes);
+  assert(statSync(file).isFile() && statSync(file).size === SIZE, 'stat of what was written');
+  assert(same(readFileSync(file), bytes), 'readFileSync');
+
+  const callback = await new Promise((resolve, reject) => {
+    readFile(file, (error, data) => (error ? reject(error) : resolve(data)));
+  });
+  assert(same(callback, bytes), 'readFile');
+  assert(same(await readFilePromise(file), bytes), 'fs/promises readFile');
+
+  writeFileSync(`${dir}/text.txt`, 'héllo wörld');
+  assert(readFileSync(`${dir}/text.txt`, 'utf8') === 'héllo wörld', 'utf8 text');
+
+  // 10 bytes from position 100 into the buffer at offset 5
+  const fd = openSync(file, 'r');
+  const target = new Uint8Array(20);
+  assert(readSync(fd, target, 5, 10, 100) === 10, 'bytes read');
+  closeSync(fd);
+  assert(target[4] === 0 && target[5] === bytes[100] && target[14] === bytes[109] && target[15] === 0, 'readSync placement');
+
+  const handle = await open(file, 'r');
+  const { bytesRead, buffer } = await handle.read(new Uint8Array(8), 0, 8, SIZE - 8);
+  await handle.close();
+  assert(bytesRead === 8 && same(buffer, bytes.subarray(SIZE - 8)), 'FileHandle read');
+
+  mkdirSync(`${dir}/sub`);
+  renameSync(`${dir}/text.txt`, `${dir}/sub/moved.txt`);
+  assert(readdirSync(`${dir}/sub`).join() === 'moved.txt', 'readdir after rename');
+  assert((await stat(`${dir}/sub`)).isDirectory(), 'fs/promises stat');
+  unlinkSync(`${dir}/sub/moved.txt`);
+  rmdirSync(`${dir}/sub`);
+  assert(!existsSync(`${dir}/sub`), 'removed');
+
+  let error;
+  try {
+    readFileSync(`${dir}/missing`);
+  } catch (e) {
+    error = e;
+  }
+  assert(error && error.code === 'ENOENT' && error.syscall === 'open', `sync error ${error && error.code}`);
+
+  error = await readFilePromise(`${dir}/missing`).catch((e) => e);
+  assert(error && error.code === 'ENOENT', `promise error ${error && error.code}`);
+});
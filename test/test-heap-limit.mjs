@@ -0,0 +1,31 @@
+// flags: --max-heap-size=32m --gc-threshold=1m --gc-adaptive --expose-gc
+// the heap stops at --max-heap-size and a collection gets the memory back
+import { getHeapStatistics } from 'v8';
+import { assert, done } from './common.mjs';
+
+const LIMIT = 32 * 1024 * 1024;
+
+function fill() {
+  const chunks = [];
+
+  try {
+    for (;;) {
+      chunks.push(new Array(64 * 1024).fill(chunks.length));
+    }
+  } catch (e) {
+    return chunks.length;
+  }
+}
+
+const stats = getHeapStatistics();
+assert(stats.heap_size_limit === LIMIT, `heap_size_limit is ${stats.heap_size_limit}`);
+
+const filled = fill();
+assert(filled > 0, 'nothing was allocated before the limit');
+assert(getHeapStatistics().total_heap_size <= LIMIT, 'the heap grew past --max-heap-size');
+
+gc();
+assert(getHeapStatistics().used_heap_size < LIMIT / 2, 'gc() did not free the dropped arrays');
+assert(fill() >= filled / 2, 'the heap could not be refilled after gc()');
+
+done();
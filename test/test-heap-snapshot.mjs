@@ -0,0 +1,47 @@
+// the heap statistics grow with what the script allocates, and a heap
+// snapshot is well formed and reaches an object hung off the global
+import { readFileSync } from 'fs';
+import { memoryUsage } from 'process';
+import { getHeapStatistics, writeHeapSnapshot } from 'v8';
+import { assert, done, tmpdir } from './common.mjs';
+
+const COUNT = 10000;
+
+const before = getHeapStatistics();
+globalThis.kept = Array.from({ length: COUNT }, (_, n) => ({ n }));
+globalThis.marker = { label: 'veil-heap-snapshot-marker' };
+const after = getHeapStatistics();
+
+assert(after.number_of_objects >= before.number_of_objects + COUNT, `objects ${after.number_of_objects}`);
+assert(after.used_heap_size > before.used_heap_size, `used ${after.used_heap_size}`);
+
+const usage = memoryUsage();
+assert(usage.heapUsed > 0 && usage.heapTotal >= usage.heapUsed, `usage ${usage.heapUsed} ${usage.heapTotal}`);
+assert(usage.rss > 0 && memoryUsage.rss() > 0, 'rss');
+
+const file = `${tmpdir('heap-snapshot')}/test.heapsnapshot`;
+assert(writeHeapSnapshot(file) === file, 'written where asked');
+
+const snapshot = JSON.parse(readFileSync(file, 'utf8'));
+const { node_fields: nodeFields, edge_fields: edgeFields } = snapshot.snapshot.meta;
+const edgeCount = nodeFields.indexOf('edge_count');
+const toNode = edgeFields.indexOf('to_node');
+
+assert(snapshot.nodes.length % nodeFields.length === 0, 'whole nodes');
+assert(snapshot.edges.length % edgeFields.length === 0, 'whole edges');
+
+let edges = 0;
+for (let n = edgeCount; n < snapshot.nodes.length; n += nodeFields.length) {
+  edges += snapshot.nodes[n];
+}
+assert(edges * edgeFields.length === snapshot.edges.length, 'edge counts add up');
+
+for (let n = toNode; n < snapshot.edges.length; n += edgeFields.length) {
+  const to = snapshot.edges[n];
+
+  assert(to % nodeFields.length === 0 && to < snapshot.nodes.length, `edge to ${to}`);
+}
+
+assert(snapshot.strings.includes('veil-heap-snapshot-marker'), 'marker string reached');
+
+done();
@@ -0,0 +1,128 @@
+// requests pipelined in one write are answered in order even when a later
+// one finishes first, a chunked body is reassembled, a request split across
+// many reads parses the same as one sent whole, and a malformed head gets a
+// 400 and the connection closed
+import { createServer } from 'http';
+import { connect } from 'net';
+import { assert, run } from './common.mjs';
+
+const decoder = new TextDecoder();
+
+function delay(ms) {
+  return new Promise((resolve) => setTimeout(resolve, ms));
+}
+
+function listen(server) {
+  return new Promise((resolve) => server.listen(0, '127.0.0.1', resolve));
+}
+
+function body(req) {
+  return new Promise((resolve) => {
+    let text = '';
+
+    req.on('data', (data) => {
+      text += decoder.decode(data);
+    });
+    req.on('end', () => resolve(text));
+  });
+}
+
+// sends each piece in its own turn and resolves with everything read back
+// once the server closes the connection
+function exchange(port, pieces) {
+  return new Promise((resolve, reject) => {
+    const socket = connect(port, '127.0.0.1');
+    let text = '';
+
+    socket.on('error', reject);
+    socket.on('data', (data) => {
+      text += decoder.decode(data);
+    });
+    socket.on('close', () => resolve(text));
+    socket.on('connect', async () => {
+      for (const piece of pieces) {
+        socket.write(piece);
+        await delay(5);
+      }
+    });
+  });
+}
+
+async function handle(req, res) {
+  const text = await body(req);
+
+  if (req.url === '/slow') {
+    await delay(50);
+    res.end('slow');
+  } else if (req.url === '/chunked') {
+    assert(req.method === 'POST', 'method');
+    assert(req.headers['transfer-encoding'] === 'chunked', 'headers object');
+    res.setHeader('X-Body', text);
+    res.write('first,');
+    res.end('second');
+  } else if (req.url === '/split') {
+    assert(req.getHeader('x-split') === 'yes', 'getHeader');
+    assert(req.httpVersion === '1.1', 'version');
+    res.writeHead(201, { 'Content-Type': 'text/plain' });
+    res.end(text.toUpperCase());
+  } else {
+    res.end(req.url);
+  }
+}
+
+async function pipelined(port) {
+  const text = await exchange(port, [
+    'GET /slow HTTP/1.1\r\nHost: a\r\n\r\n' +
+      'POST /chunked HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n' +
+      '3\r\nabc\r\n4\r\ndefg\r\n0\r\n\r\n' +
+      'GET /last HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n',
+  ]);
+  const slow = text.indexOf('\r\n\r\nslow');
+  const chunked = text.indexOf('X-Body: abcdefg');
+  const last = text.indexOf('\r\n\r\n/last');
+
+  assert(slow >= 0 && chunked > slow && last > chunked, `responses in request order: ${text}`);
+  assert(text.includes('Transfer-Encoding: chunked\r\n'), 'unknown length goes chunked');
+  assert(text.includes('6\r\nfirst,\r\n6\r\nsecond\r\n0\r\n\r\n'), 'chunk framing');
+  assert(text.includes('Content-Length: 4\r\n'), 'known length is sent');
+  assert(text.includes('Connection: close\r\n'), 'close is acknowledged');
+}
+
+async function split(port) {
+  const request =
+    'PUT /split HTTP/1.1\r\nHost: a\r\nX-Split: yes\r\nContent-Length: 11\r\nConnection: close\r\n\r\nhello world';
+  const pieces = [];
+
+  for (let n = 0; n < request.length; n += 3) {
+    pieces.push(request.slice(n, n + 3));
+  }
+
+  const text = await exchange(port, pieces);
+
+  assert(text.startsWith('HTTP/1.1 201 Created\r\n'), `status line: ${text}`);
+  assert(text.includes('Content-Type: text/plain\r\n'), 'writeHead headers');
+  assert(text.endsWith('\r\n\r\nHELLO WORLD'), 'body read across reads');
+}
+
+async function malformed(port) {
+  const text = await exchange(port, ['GET / HTTP/1.1\r\nNo colon here\r\n\r\n']);
+
+  assert(text.startsWith('HTTP/1.1 400 Bad Request\r\n'), `400: ${text}`);
+}
+
+run(async () => {
+  const server = createServer((req, res) => {
+    handle(req, res).catch((error) => {
+      server.close();
+      throw error;
+    });
+  });
+
+  await listen(server);
+  const { port } = server.address();
+
+  await pipelined(port);
+  await split(port);
+  await malformed(port);
+  server.close();
+});
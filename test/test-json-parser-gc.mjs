@@ -0,0 +1,36 @@
+// flags: --expose-gc
+// a Parser whose onRecord closes over the parser is still collected by gc()
+// once unreachable
+import { Parser } from 'json';
+import { memoryUsage } from 'process';
+import { assert, done } from './common.mjs';
+
+const ROUNDS = 10;
+const COUNT = 5000;
+
+let records = 0;
+
+function heapAfterRound() {
+  for (let i = 0; i < COUNT; i++) {
+    const parser = new Parser(() => {
+      records++;
+      return parser;
+    });
+
+    parser.write('{"n":1}\n');
+  }
+
+  gc();
+  return memoryUsage().heapUsed;
+}
+
+const baseline = heapAfterRound();
+let used = baseline;
+
+for (let i = 1; i < ROUNDS; i++) {
+  used = heapAfterRound();
+}
+
+assert(records === ROUNDS * COUNT, `onRecord ran ${records} times`);
+assert(used - baseline < 512 * 1024, `heap grew by ${used - baseline} bytes over ${ROUNDS} rounds`);
+done();
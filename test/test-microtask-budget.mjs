@@ -0,0 +1,26 @@
+// flags: --microtask-budget=100
+// a microtask chain that never ends on its own still lets the loop reach
+// timers and I/O, which is what stops it here
+import { readFile } from 'fs';
+import { assert, done } from './common.mjs';
+
+let turns = 0;
+let timer = false;
+let io = false;
+
+function spin() {
+  turns++;
+  if (!timer || !io) {
+    Promise.resolve().then(spin);
+  } else {
+    assert(turns > 100, `turns ${turns}`);
+    done();
+  }
+}
+
+setTimeout(() => { timer = true; }, 10);
+readFile('common.mjs', (error) => {
+  assert(!error, `readFile ${error}`);
+  io = true;
+});
+spin();
@@ -0,0 +1,111 @@
+// an echo over TCP: write() turns false past the high water mark and
+// 'drain' follows, paused reads hold the peer back, many small writes in one
+// turn all arrive, and every byte comes back in order
+import { connect, createServer } from 'net';
+import { assert, run } from './common.mjs';
+
+const CHUNK = 64 * 1024;
+const TOTAL = 8 * 1024 * 1024;
+const SMALL_WRITES = 1000;
+
+function chunk(n) {
+  const bytes = new Uint8Array(CHUNK);
+
+  bytes.fill(n & 0xff);
+
+  return bytes;
+}
+
+function echo(socket) {
+  socket.on('data', (data) => {
+    if (!socket.write(data)) {
+      socket.pause();
+    }
+  });
+  socket.on('drain', () => socket.resume());
+  socket.on('end', () => socket.end());
+}
+
+function listen(server) {
+  return new Promise((resolve) => server.listen(0, '127.0.0.1', resolve));
+}
+
+function exchange(port, send) {
+  return new Promise((resolve, reject) => {
+    const socket = connect(port, '127.0.0.1');
+    const received = [];
+    let size = 0;
+
+    socket.on('error', reject);
+    socket.on('data', (data) => {
+      received.push(data);
+      size += data.length;
+    });
+    socket.on('close', () => resolve({ received, size, socket }));
+    socket.on('connect', () => send(socket));
+  });
+}
+
+async function backpressure(port) {
+  let drains = 0;
+  let sent = 0;
+
+  const { received, size } = await exchange(port, (socket) => {
+    function fill() {
+      while (sent < TOTAL) {
+        const ok = socket.write(chunk(sent / CHUNK));
+
+        sent += CHUNK;
+        if (!ok) {
+          assert(socket.writableNeedDrain && socket.writableLength > 0, 'queued past the mark');
+          return;
+        }
+      }
+      socket.end();
+    }
+
+    socket.on('drain', () => {
+      drains++;
+      fill();
+    });
+    fill();
+  });
+
+  assert(drains > 0, 'write() returned false and drain followed');
+  assert(size === TOTAL, `echoed ${size} of ${TOTAL}`);
+
+  let offset = 0;
+  for (const data of received) {
+    for (let n = 0; n < data.length; n += 4096) {
+      const expected = Math.floor((offset + n) / CHUNK) & 0xff;
+
+      assert(data[n] === expected, `byte ${offset + n} is ${data[n]}, not ${expected}`);
+    }
+    offset += data.length;
+  }
+}
+
+async function batched(port) {
+  const { received, size, socket } = await exchange(port, (socket) => {
+    for (let n = 0; n < SMALL_WRITES; n++) {
+      socket.write('x');
+    }
+    socket.end();
+  });
+
+  assert(size === SMALL_WRITES, `echoed ${size} of ${SMALL_WRITES}`);
+  assert(received.every((data) => data.every((byte) => byte === 0x78)), 'only x came back');
+  assert(socket.bytesWritten === SMALL_WRITES && socket.bytesRead === SMALL_WRITES, 'byte counts');
+}
+
+run(async () => {
+  const server = createServer(echo);
+
+  await listen(server);
+  const { port } = server.address();
+
+  await backpressure(port);
+  await batched(port);
+
+  await new Promise((resolve) => server.close(resolve));
+});
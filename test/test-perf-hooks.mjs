@@ -0,0 +1,42 @@
+// a blocked loop shows up as a long interval in monitorEventLoopDelay() and
+// as active time in eventLoopUtilization(), and a loop waiting on a timer as
+// idle time
+import { monitorEventLoopDelay, performance } from 'perf_hooks';
+import { assert, done } from './common.mjs';
+
+const BLOCK_MS = 200;
+
+function block(ms) {
+  const start = performance.now();
+
+  while (performance.now() - start < ms);
+}
+
+const histogram = monitorEventLoopDelay({ resolution: 10 });
+const start = performance.eventLoopUtilization();
+
+histogram.enable();
+
+setTimeout(() => {
+  block(BLOCK_MS);
+
+  setTimeout(() => {
+    const busy = performance.eventLoopUtilization(start);
+
+    histogram.disable();
+    assert(histogram.count > 0, `count ${histogram.count}`);
+    assert(histogram.max >= BLOCK_MS * 0.75 * 1e6, `max ${histogram.max} ns`);
+    assert(histogram.percentile(100) >= histogram.percentile(50), 'percentiles ordered');
+    assert(busy.active >= BLOCK_MS * 0.75, `active ${busy.active} ms`);
+
+    const before = performance.eventLoopUtilization();
+
+    setTimeout(() => {
+      const quiet = performance.eventLoopUtilization(before);
+
+      assert(quiet.idle >= BLOCK_MS / 2, `idle ${quiet.idle} ms`);
+      assert(quiet.utilization < 0.5, `utilization ${quiet.utilization}`);
+      done();
+    }, BLOCK_MS);
+  }, 50);
+}, 50);
@@ -0,0 +1,46 @@
+// flags: --allocator=pool --max-heap-size=64m --expose-gc
+// the pool counts the pages it holds against the heap, and gives emptied
+// pages back once a collection frees their objects
+import { getHeapStatistics } from 'v8';
+import { assert, done } from './common.mjs';
+
+const LIMIT = 64 * 1024 * 1024;
+
+function total() {
+  return getHeapStatistics().total_heap_size;
+}
+
+function small(count) {
+  const objects = [];
+
+  for (let n = 0; n < count; n++) {
+    objects.push({ n, s: `object ${n}` });
+  }
+
+  return objects;
+}
+
+gc();
+const before = total();
+
+let objects = small(200000);
+const grown = total() - before;
+assert(grown > 200000 * 16, `200000 small objects only took ${grown} bytes`);
+
+objects = null;
+gc();
+const freed = total() - before;
+assert(freed < grown / 4, `gc() left ${freed} of ${grown} bytes held`);
+
+// small objects alone run into --max-heap-size
+const kept = [];
+try {
+  for (;;) {
+    kept.push(small(10000));
+  }
+} catch (e) {
+  assert(kept.length > 0, 'nothing was allocated before the limit');
+}
+assert(total() <= LIMIT, `the heap grew to ${total()} past --max-heap-size`);
+
+done();
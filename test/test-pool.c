@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2023 Light Source Software, LLC. All rights reserved.
+ */
+
+#include "veil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ctest runs this from test/. A pool job returns once its result settles,
+// even with timers and a server still open, and releasing the VM closes
+// them: veil_pool_free() aborts on a loop that still has handles.
+
+static int failures = 0;
+
+static void expect(veil_pool_vm_t* vm, const char* source, bool ok, const char* result) {
+  char* actual = NULL;
+  bool actual_ok = veil_pool_eval(vm, source, NULL, &actual);
+
+  if (actual_ok != ok || (result && (!actual || !strstr(actual, result)))) {
+    fprintf(stderr, "%s\n  expected %s %s\n  got %s %s\n", source, ok ? "ok" : "error",
+        result ? result : "", actual_ok ? "ok" : "error", actual ? actual : "(null)");
+    failures++;
+  }
+
+  free(actual);
+}
+
+int main(int argc, char** argv) {
+  veil_t* veil = veil_init();
+  veil_pool_t* pool = veil_pool_new(veil, 1);
+  veil_pool_vm_t* vm = veil_pool_acquire(pool);
+
+  expect(vm, "setInterval(() => {}, 10); 1 + 1", true, "2");
+  expect(vm, "new Promise((resolve) => setTimeout(() => resolve('late'), 10))", true, "late");
+  expect(vm, "import('net').then(({ createServer }) => new Promise((resolve) => "
+      "createServer().listen(0, () => resolve('listening'))))", true, "listening");
+  expect(vm, "setInterval(() => {}, 10); throw new Error('boom')", false, "boom");
+  expect(vm, "globalThis.kept = 1", true, "1");
+  veil_pool_release(vm);
+
+  vm = veil_pool_acquire(pool);
+  expect(vm, "typeof kept", true, "undefined");
+  veil_pool_release(vm);
+
+  veil_pool_free(pool);
+  veil_drop(veil);
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+// flags: --allocator=pool --max-heap-size=64m
+// the static imports are prefetched and compiled on the threadpool in
+// runtimes made like the VM's, and load the same as compiled here
+import { branch, leaf, sum, total } from './fixtures/prefetch-branch.mjs';
+import { assert, run } from './common.mjs';
+
+assert(leaf === 'leaf', `leaf ${leaf}`);
+assert(branch === 'leaf of branch', `branch ${branch}`);
+assert(total === 6 && sum(4, 5) === 9, `sum ${total}`);
+
+run(async () => {
+  const dynamic = await import('./fixtures/prefetch-leaf.mjs');
+
+  assert(dynamic.sum === sum, 'one instance of the leaf module');
+});
@@ -0,0 +1,43 @@
+// flags: --expose-gc
+// timers whose callbacks close over the timer itself are still collected by
+// gc() once they have fired or been cleared
+import { memoryUsage } from 'process';
+import { assert, run } from './common.mjs';
+
+const ROUNDS = 10;
+const COUNT = 5000;
+
+function cycles() {
+  return new Promise((resolve) => {
+    let pending = COUNT;
+
+    for (let i = 0; i < COUNT; i++) {
+      const timer = setTimeout(() => {
+        void timer;
+        if (--pending === 0) {
+          resolve();
+        }
+      }, 0);
+      const cleared = setInterval(() => cleared, 1000);
+
+      clearInterval(cleared);
+    }
+  });
+}
+
+async function heapAfterRound() {
+  await cycles();
+  gc();
+  return memoryUsage().heapUsed;
+}
+
+run(async () => {
+  const baseline = await heapAfterRound();
+  let used = baseline;
+
+  for (let i = 1; i < ROUNDS; i++) {
+    used = await heapAfterRound();
+  }
+
+  assert(used - baseline < 512 * 1024, `heap grew by ${used - baseline} bytes over ${ROUNDS} rounds`);
+});
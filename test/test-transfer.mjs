@@ -0,0 +1,41 @@
+// transferred ArrayBuffers move to the worker and back, leaving the sender's
+// copy detached; SharedArrayBuffers are seen by both sides
+import { Worker } from 'worker_threads';
+import { assert, done } from './common.mjs';
+
+const SIZE = 1024 * 1024;
+
+class Tagged extends ArrayBuffer {}
+
+const subclassed = new Tagged(SIZE);
+assert(subclassed instanceof Tagged && subclassed instanceof ArrayBuffer, 'subclass of ArrayBuffer');
+assert(new ArrayBuffer(SIZE).slice(16).byteLength === SIZE - 16, 'slice of a large ArrayBuffer');
+assert(ArrayBuffer.isView(new Uint8Array(4)), 'ArrayBuffer.isView');
+
+const buffer = new ArrayBuffer(SIZE);
+const shared = new SharedArrayBuffer(4);
+const bytes = new Uint8Array(buffer);
+
+for (let i = 0; i < SIZE; i++) {
+  bytes[i] = i & 0x7f;
+}
+
+const worker = new Worker('fixtures/worker-echo.mjs');
+
+worker.on('message', (message) => {
+  const echoed = new Uint8Array(message.buffer);
+
+  assert(echoed.length === SIZE, `echoed ${echoed.length} bytes`);
+  for (let i = 0; i < SIZE; i++) {
+    if (echoed[i] !== (i & 0x7f) + 1) {
+      assert(false, `byte ${i} is ${echoed[i]}`);
+    }
+  }
+  assert(Atomics.load(new Int32Array(shared), 0) === SIZE, 'the worker did not write to the SharedArrayBuffer');
+
+  worker.terminate();
+});
+worker.on('exit', done);
+
+worker.postMessage({ buffer, shared }, [buffer]);
+assert(buffer.byteLength === 0, 'the transferred buffer was not detached');
@@ -0,0 +1,30 @@
+// Atomics.notify() wakes a worker in Atomics.wait(), and terminate() ends one
+// that would wait forever
+import { Worker } from 'worker_threads';
+import { assert, done } from './common.mjs';
+
+const shared = new SharedArrayBuffer(4);
+const state = new Int32Array(shared);
+const worker = new Worker('fixtures/worker-wait.mjs', { workerData: shared });
+
+assert(Atomics.wait(state, 0, 1) === 'not-equal', 'Atomics.wait() on a changed value');
+assert(Atomics.wait(state, 0, 0, 10) === 'timed-out', 'Atomics.wait() with a timeout');
+
+worker.on('message', (message) => {
+  if (message === 'waiting') {
+    // the worker posts before it blocks, so keep notifying until it is woken
+    const notify = setInterval(() => {
+      if (Atomics.notify(state, 0, 1) === 1) {
+        clearInterval(notify);
+      }
+    }, 1);
+    return;
+  }
+
+  assert(message === 'ok', `the worker's wait returned ${message}`);
+  setTimeout(() => worker.terminate(), 50);
+});
+worker.on('exit', (code) => {
+  assert(code === 1, `terminate() exited with ${code}`);
+  done();
+});
@@ -0,0 +1,15 @@
+// an exception thrown from a callback ends the worker, which exits with 1
+import { Worker } from 'worker_threads';
+import { assert, done } from './common.mjs';
+
+const worker = new Worker('fixtures/worker-throw-async.mjs');
+let error = null;
+
+worker.on('error', (e) => {
+  error = e;
+});
+worker.on('exit', (code) => {
+  assert(error !== null && error.name === 'RangeError', "'error' was not emitted");
+  assert(code === 1, `unexpected exit code ${code}`);
+  done();
+});
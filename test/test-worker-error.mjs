@@ -0,0 +1,17 @@
+// an uncaught exception in a worker is an 'error' on its Worker, then 'exit'
+import { Worker } from 'worker_threads';
+import { assert, done } from './common.mjs';
+
+const worker = new Worker('fixtures/worker-throw.mjs');
+let error = null;
+
+worker.on('error', (e) => {
+  error = e;
+});
+worker.on('exit', (code) => {
+  assert(error !== null, "'error' was not emitted");
+  assert(error.name === 'TypeError', `unexpected name ${error.name}`);
+  assert(error.message === 'thrown in a worker', `unexpected message ${error.message}`);
+  assert(code !== 0, `unexpected exit code ${code}`);
+  done();
+});
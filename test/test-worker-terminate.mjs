@@ -0,0 +1,12 @@
+// terminating a worker with requests in flight on its loop shuts it down
+// cleanly, and it exits with 1 as in node
+import { Worker } from 'worker_threads';
+import { assert, done } from './common.mjs';
+
+const worker = new Worker('fixtures/worker-busy.mjs');
+
+worker.on('message', () => worker.terminate());
+worker.on('exit', (code) => {
+  assert(code === 1, `terminate() exited with ${code}`);
+  done();
+});
@@ -0,0 +1,103 @@
+// ctest runs this only in builds with zlib. A gzip stream fed through
+// write() honours backpressure, and its output read back through a gunzip
+// stream is the input
+import { createGunzip, createGzip, gunzipSync } from 'zlib';
+import { assert, run } from './common.mjs';
+
+const CHUNK = 16 * 1024;
+const CHUNKS = 64;
+
+function input(n) {
+  const bytes = new Uint8Array(CHUNK);
+
+  for (let i = 0; i < CHUNK; i++) {
+    bytes[i] = (i * 7 + n) & 0xff;
+  }
+
+  return bytes;
+}
+
+function concat(chunks) {
+  const out = new Uint8Array(chunks.reduce((size, chunk) => size + chunk.length, 0));
+  let offset = 0;
+
+  for (const chunk of chunks) {
+    out.set(chunk, offset);
+    offset += chunk.length;
+  }
+
+  return out;
+}
+
+function check(output) {
+  assert(output.length === CHUNK * CHUNKS, `read back ${output.length} bytes`);
+  for (let n = 0; n < CHUNKS; n++) {
+    const expected = input(n);
+
+    for (let i = 0; i < CHUNK; i++) {
+      if (output[n * CHUNK + i] !== expected[i]) {
+        assert(false, `byte ${i} of chunk ${n} is ${output[n * CHUNK + i]}`);
+      }
+    }
+  }
+}
+
+// writes every chunk, waiting for 'drain' whenever write() says to
+function feed(stream) {
+  return new Promise((resolve) => {
+    let n = 0;
+    let drains = 0;
+
+    stream.on('drain', () => {
+      drains++;
+      next();
+    });
+
+    function next() {
+      while (n < CHUNKS) {
+        if (!stream.write(input(n++))) {
+          assert(stream.writableNeedDrain, 'write() returned false without writableNeedDrain');
+          return;
+        }
+      }
+      stream.end();
+      resolve(drains);
+    }
+
+    next();
+  });
+}
+
+function collect(stream) {
+  return new Promise((resolve, reject) => {
+    const chunks = [];
+
+    stream.on('data', (chunk) => chunks.push(new Uint8Array(chunk)));
+    stream.on('end', () => resolve(concat(chunks)));
+    stream.on('error', reject);
+  });
+}
+
+run(async () => {
+  const gzip = createGzip();
+  const gunzip = createGunzip();
+  const compressed = collect(gzip);
+  const decompressed = collect(gunzip);
+
+  // the gzip stream's output goes straight into the gunzip stream
+  gzip.on('data', (chunk) => gunzip.write(chunk));
+  gzip.on('end', () => gunzip.end());
+
+  const drains = await feed(gzip);
+  assert(drains > 0, "a 1 MiB write never waited for 'drain'");
+
+  check(gunzipSync(await compressed));
+  assert(gzip.writableLength === 0, `${gzip.writableLength} bytes still queued`);
+  check(await decompressed);
+
+  // a corrupt stream ends in 'error'
+  const broken = createGunzip();
+  const failed = collect(broken).then(() => false, () => true);
+  broken.end(new Uint8Array(64).fill(1));
+  assert(await failed, "corrupt input did not emit 'error'");
+});
@@ -0,0 +1,50 @@
+// ctest runs this only in builds with zlib. Every codec this build has
+// round-trips, sync and async; the rest must say they are not available.
+import * as zlib from 'zlib';
+import { assert, run } from './common.mjs';
+
+const CODECS = [
+  ['deflate', 'inflate', true],
+  ['gzip', 'gunzip', true],
+  ['deflateRaw', 'inflateRaw', true],
+  ['brotliCompress', 'brotliDecompress', false],
+  ['zstdCompress', 'zstdDecompress', false],
+];
+
+const input = new TextEncoder().encode('veil '.repeat(10000));
+
+function same(a, b) {
+  if (a.length !== b.length) {
+    return false;
+  }
+  for (let i = 0; i < a.length; i++) {
+    if (a[i] !== b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+function available(compress) {
+  try {
+    zlib[`${compress}Sync`](input);
+    return true;
+  } catch (e) {
+    assert(/is not available/.test(e.message), `${compress}: ${e.message}`);
+    return false;
+  }
+}
+
+run(async () => {
+  for (const [compress, decompress, required] of CODECS) {
+    if (!available(compress)) {
+      assert(!required, `${compress} is missing from a build with zlib`);
+      continue;
+    }
+
+    const packed = zlib[`${compress}Sync`](input);
+    assert(packed.length < input.length, `${compress} did not compress`);
+    assert(same(zlib[`${decompress}Sync`](packed), input), `${compress} sync round trip`);
+    assert(same(await zlib[decompress](await zlib[compress](input)), input), `${compress} async round trip`);
+  }
+});